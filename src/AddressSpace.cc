@@ -5,9 +5,11 @@
 #include <limits.h>
 #include <linux/kdev_t.h>
 #include <linux/prctl.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <limits>
 
 #include "rr/rr.h"
@@ -21,6 +23,7 @@
 #include "Session.h"
 #include "Task.h"
 #include "core.h"
+#include "kernel_supplement.h"
 #include "log.h"
 
 using namespace std;
@@ -75,8 +78,8 @@ static bool thread_group_in_exec(Task* t) {
   return false;
 }
 
-KernelMapIterator::KernelMapIterator(Task* t, bool* ok)
-  : tid(t->tid) {
+KernelMapIterator::KernelMapIterator(Task* t, bool* ok, Source source)
+  : tid(t->tid), query(source == MAPS_QUERY_IF_AVAILABLE) {
   // See https://lkml.org/lkml/2016/9/21/423
   ASSERT(t, !thread_group_in_exec(t)) << "Task-group in execve, so reading "
                                          "/proc/.../maps may trigger kernel "
@@ -103,10 +106,67 @@ void KernelMapIterator::init(bool* ok) {
       FATAL() << "Failed to open " << maps_path;
     }
   }
+  query_addr = 0;
   ++*this;
 }
 
+/**
+ * Fetch the next mapping at or after |query_addr| with PROCMAP_QUERY.
+ * Returns false if the kernel doesn't support it, in which case nothing
+ * has been read from |maps_file| yet and we fall back to parsing text.
+ */
+bool KernelMapIterator::next_from_query() {
+  static bool procmap_query_unsupported = false;
+  if (procmap_query_unsupported) {
+    return false;
+  }
+
+  char name[PATH_MAX * 2];
+  struct procmap_query q;
+  memset(&q, 0, sizeof(q));
+  q.size = sizeof(q);
+  q.query_flags = PROCMAP_QUERY_COVERING_OR_NEXT_VMA;
+  q.query_addr = query_addr;
+  q.vma_name_addr = (uintptr_t)name;
+  q.vma_name_size = sizeof(name);
+  if (ioctl(fileno(maps_file), PROCMAP_QUERY, &q) < 0) {
+    if ((errno == ENOTTY || errno == EINVAL) && query_addr == 0) {
+      LOG(debug) << "PROCMAP_QUERY not supported, parsing /proc/" << tid
+                 << "/maps";
+      procmap_query_unsupported = true;
+      return false;
+    }
+    // ENOENT means there are no more mappings. ESRCH means the
+    // address space has gone away, which reading the text would also
+    // report as EOF.
+    if (errno != ENOENT && errno != ESRCH) {
+      FATAL() << "PROCMAP_QUERY failed for " << tid << " at "
+              << HEX(query_addr);
+    }
+    fclose(maps_file);
+    maps_file = nullptr;
+    return true;
+  }
+  query_addr = q.vma_end;
+
+  int prot = ((q.vma_flags & PROCMAP_QUERY_VMA_READABLE) ? PROT_READ : 0) |
+             ((q.vma_flags & PROCMAP_QUERY_VMA_WRITABLE) ? PROT_WRITE : 0) |
+             ((q.vma_flags & PROCMAP_QUERY_VMA_EXECUTABLE) ? PROT_EXEC : 0);
+  int f = (q.vma_flags & PROCMAP_QUERY_VMA_SHARED) ? MAP_SHARED : MAP_PRIVATE;
+  raw_line.clear();
+  set_current(q.vma_start, q.vma_end, q.vma_name_size ? name : "",
+              q.dev_major, q.dev_minor, q.inode, prot, f, q.vma_offset);
+  return true;
+}
+
 void KernelMapIterator::operator++() {
+  if (query) {
+    if (next_from_query()) {
+      return;
+    }
+    query = false;
+  }
+
   char line[PATH_MAX * 2];
   if (!fgets(line, sizeof(line), maps_file)) {
     fclose(maps_file);
@@ -133,25 +193,6 @@ void KernelMapIterator::operator++() {
   raw_line = line;
 
   const char* name = trim_leading_blanks(line + chars_scanned);
-#if defined(__i386__)
-  if (start > numeric_limits<uint32_t>::max() ||
-      end > numeric_limits<uint32_t>::max() ||
-      strcmp(name, "[vsyscall]") == 0) {
-    // We manually read the exe link here because
-    // this helper is used to set
-    // |t->vm()->exe_image()|, so we can't rely on
-    // that being correct yet.
-    char proc_exe[PATH_MAX];
-    char exe[PATH_MAX];
-    snprintf(proc_exe, sizeof(proc_exe), "/proc/%d/exe", tid);
-    ssize_t size = readlink(proc_exe, exe, sizeof(exe));
-    if (size < 0) {
-      FATAL() << "readlink failed";
-    }
-    FATAL() << "Sorry, tracee " << tid << " has x86-64 image " << exe
-            << " and that's not supported with a 32-bit rr.";
-  }
-#endif
   int prot = (strchr(flags, 'r') ? PROT_READ : 0) |
              (strchr(flags, 'w') ? PROT_WRITE : 0) |
              (strchr(flags, 'x') ? PROT_EXEC : 0);
@@ -173,8 +214,34 @@ void KernelMapIterator::operator++() {
     name = tmp_name.c_str();
   }
 
+  set_current(start, end, name, dev_major, dev_minor, inode, prot, f, offset);
+}
+
+void KernelMapIterator::set_current(uint64_t start, uint64_t end,
+                                    const char* name, int dev_major,
+                                    int dev_minor, uint64_t inode, int prot,
+                                    int flags, uint64_t offset) {
+#if defined(__i386__)
+  if (start > numeric_limits<uint32_t>::max() ||
+      end > numeric_limits<uint32_t>::max() ||
+      strcmp(name, "[vsyscall]") == 0) {
+    // We manually read the exe link here because
+    // this helper is used to set
+    // |t->vm()->exe_image()|, so we can't rely on
+    // that being correct yet.
+    char proc_exe[PATH_MAX];
+    char exe[PATH_MAX];
+    snprintf(proc_exe, sizeof(proc_exe), "/proc/%d/exe", tid);
+    ssize_t size = readlink(proc_exe, exe, sizeof(exe));
+    if (size < 0) {
+      FATAL() << "readlink failed";
+    }
+    FATAL() << "Sorry, tracee " << tid << " has x86-64 image " << exe
+            << " and that's not supported with a 32-bit rr.";
+  }
+#endif
   km = KernelMapping(start, end, name, MKDEV(dev_major, dev_minor), inode, prot,
-                     f, offset);
+                     flags, offset);
 }
 
 static KernelMapping read_kernel_mapping(pid_t tid, remote_ptr<void> addr) {
@@ -283,6 +350,7 @@ static uint32_t find_offset_of_syscall_instruction_in(SupportedArch arch,
 }
 
 uint32_t AddressSpace::offset_to_syscall_in_vdso[SupportedArch_MAX + 1];
+uint64_t AddressSpace::next_mapping_generation = 0;
 
 remote_code_ptr AddressSpace::find_syscall_instruction_in_vdso(Task* t) {
   SupportedArch arch = t->arch();
@@ -685,6 +753,8 @@ static const char* stringify_flags(int flags) {
       return " [rr_page]";
     case AddressSpace::Mapping::IS_RR_VDSO_PAGE:
       return " [rr_vdso_page]";
+    case AddressSpace::Mapping::IS_VIRTUAL_PERF_COUNTER_PAGE:
+      return " [virtual_perf_counter_page]";
     default:
       return " [unknown_flags]";
   }
@@ -948,7 +1018,7 @@ void AddressSpace::protect(Task* t, remote_ptr<void> addr, size_t num_bytes,
                                                MemoryRange rem) {
     LOG(debug) << "  protecting (" << rem << ") ...";
 
-    remove_from_map(m.map);
+    auto next = remove_from_map(m.map);
 
     // PROT_GROWSDOWN means that if this is a grows-down segment
     // (which for us means "stack") then the change should be
@@ -971,7 +1041,7 @@ void AddressSpace::protect(Task* t, remote_ptr<void> addr, size_t num_bytes,
     if (m.map.start() < new_start) {
       Mapping underflow = m.subrange(MemoryRange(m.map.start(), new_start),
           [](const KernelMapping& km) { return km; });
-      add_to_map(underflow);
+      add_to_map(underflow, next);
     }
     // Remap the overlapping region with the new prot.
     remote_ptr<void> new_end = min(rem.end(), m.map.end());
@@ -979,7 +1049,7 @@ void AddressSpace::protect(Task* t, remote_ptr<void> addr, size_t num_bytes,
     int new_prot = prot & (PROT_READ | PROT_WRITE | PROT_EXEC);
     Mapping overlap = m.subrange(MemoryRange(new_start, new_end),
         [new_prot](const KernelMapping& km) { return km.set_prot(new_prot); });
-    add_to_map(overlap);
+    add_to_map(overlap, next);
     last_overlap = overlap.map;
 
     // If the last segment we protect overflows the
@@ -988,7 +1058,7 @@ void AddressSpace::protect(Task* t, remote_ptr<void> addr, size_t num_bytes,
     if (new_end < m.map.end()) {
       Mapping overflow = m.subrange(MemoryRange(new_end, m.map.end()),
           [](const KernelMapping& km) { return km; });
-      add_to_map(overflow);
+      add_to_map(overflow, next);
     }
   };
   for_each_in_range(addr, num_bytes, protector, ITERATE_CONTIGUOUS);
@@ -1109,6 +1179,142 @@ bool AddressSpace::add_breakpoint(remote_code_ptr addr, BreakpointType type) {
   return true;
 }
 
+/**
+ * Return the end of the run of |addrs| starting at |begin| whose breakpoint
+ * instructions all lie in the page containing |addrs[begin]|.
+ */
+static size_t end_of_page_run(const vector<remote_code_ptr>& addrs,
+                              size_t begin, ssize_t bkpt_size) {
+  remote_ptr<void> start = addrs[begin].to_data_ptr<void>();
+  remote_ptr<void> page_end = floor_page_size(start) + page_size();
+  if (start + bkpt_size > page_end) {
+    return begin + 1;
+  }
+  size_t end = begin + 1;
+  while (end < addrs.size() &&
+         addrs[end].to_data_ptr<void>() + bkpt_size <= page_end) {
+    ++end;
+  }
+  return end;
+}
+
+bool AddressSpace::add_breakpoints(vector<remote_code_ptr> addrs,
+                                   BreakpointType type) {
+  sort(addrs.begin(), addrs.end());
+  ssize_t bkpt_size = bkpt_instruction_length(arch());
+  Task* t = first_running_task();
+  bool all_ok = true;
+  size_t begin = 0;
+  while (begin < addrs.size()) {
+    size_t end = end_of_page_run(addrs, begin, bkpt_size);
+    // Read the span of the page covering every new breakpoint in the run,
+    // patch in all the breakpoint instructions and write it back once,
+    // rather than doing a remote read and write per breakpoint.
+    vector<size_t> new_bkpts;
+    bool overlap = false;
+    for (size_t i = begin; i < end; ++i) {
+      if (breakpoints.count(addrs[i]) ||
+          (!new_bkpts.empty() && addrs[new_bkpts.back()] == addrs[i])) {
+        continue;
+      }
+      if (!new_bkpts.empty() &&
+          addrs[i] < addrs[new_bkpts.back()] + bkpt_size) {
+        overlap = true;
+      }
+      new_bkpts.push_back(i);
+    }
+    bool batched = false;
+    if (t && new_bkpts.size() > 1 && !overlap) {
+      remote_ptr<uint8_t> span_start = addrs[new_bkpts[0]].to_data_ptr<uint8_t>();
+      size_t span_size =
+          addrs[new_bkpts.back()].to_data_ptr<uint8_t>() + bkpt_size - span_start;
+      vector<uint8_t> buf(span_size);
+      if (t->read_bytes_fallible(span_start, span_size, buf.data()) ==
+          (ssize_t)span_size) {
+        for (size_t i : new_bkpts) {
+          uint8_t* p = buf.data() +
+              (addrs[i].to_data_ptr<uint8_t>() - span_start);
+          auto it_and_is_new =
+              breakpoints.insert(make_pair(addrs[i], Breakpoint()));
+          DEBUG_ASSERT(it_and_is_new.second);
+          memcpy(it_and_is_new.first->second.overwritten_data, p, bkpt_size);
+          memcpy(p, breakpoint_insn(arch()), bkpt_size);
+        }
+        t->write_bytes_helper(span_start, span_size, buf.data(), nullptr,
+                              Task::IS_BREAKPOINT_RELATED);
+        batched = true;
+      }
+    }
+    for (size_t i = begin; i < end; ++i) {
+      if (batched) {
+        breakpoints.find(addrs[i])->second.ref(type);
+      } else if (!add_breakpoint(addrs[i], type)) {
+        all_ok = false;
+      }
+    }
+    begin = end;
+  }
+  return all_ok;
+}
+
+void AddressSpace::remove_breakpoints(vector<remote_code_ptr> addrs,
+                                      BreakpointType type) {
+  sort(addrs.begin(), addrs.end());
+  // The breakpoints that lose their last reference.
+  vector<remote_code_ptr> dead;
+  for (auto addr : addrs) {
+    if (!dead.empty() && dead.back() == addr) {
+      continue;
+    }
+    auto it = breakpoints.find(addr);
+    if (it == breakpoints.end() || it->second.unref(type) > 0) {
+      continue;
+    }
+    dead.push_back(addr);
+  }
+
+  ssize_t bkpt_size = bkpt_instruction_length(arch());
+  Task* t = task_set().empty() ? nullptr : first_running_task();
+  size_t begin = 0;
+  while (begin < dead.size()) {
+    size_t end = end_of_page_run(dead, begin, bkpt_size);
+    bool overlap = false;
+    for (size_t i = begin + 1; i < end; ++i) {
+      if (dead[i] < dead[i - 1] + bkpt_size) {
+        overlap = true;
+      }
+    }
+    bool batched = false;
+    if (t && end - begin > 1 && !overlap) {
+      remote_ptr<uint8_t> span_start = dead[begin].to_data_ptr<uint8_t>();
+      size_t span_size =
+          dead[end - 1].to_data_ptr<uint8_t>() + bkpt_size - span_start;
+      vector<uint8_t> buf(span_size);
+      if (t->read_bytes_fallible(span_start, span_size, buf.data()) ==
+          (ssize_t)span_size) {
+        for (size_t i = begin; i < end; ++i) {
+          auto it = breakpoints.find(dead[i]);
+          memcpy(buf.data() + (dead[i].to_data_ptr<uint8_t>() - span_start),
+                 it->second.overwritten_data, bkpt_size);
+          breakpoints.erase(it);
+        }
+        LOG(debug) << "Writing back " << (end - begin)
+                   << " breakpoints in [" << span_start << ", "
+                   << span_start + span_size << ")";
+        t->write_bytes_helper(span_start, span_size, buf.data(), nullptr,
+                              Task::IS_BREAKPOINT_RELATED);
+        batched = true;
+      }
+    }
+    if (!batched) {
+      for (size_t i = begin; i < end; ++i) {
+        destroy_breakpoint(breakpoints.find(dead[i]));
+      }
+    }
+    begin = end;
+  }
+}
+
 void AddressSpace::remove_all_breakpoints() {
   while (!breakpoints.empty()) {
     destroy_breakpoint(breakpoints.begin());
@@ -1201,6 +1407,7 @@ bool AddressSpace::restore_watchpoints() {
   DEBUG_ASSERT(!saved_watchpoints.empty());
   watchpoints = saved_watchpoints[saved_watchpoints.size() - 1];
   saved_watchpoints.pop_back();
+  watchpoint_values_resume_count = 0;
   return allocate_watchpoints();
 }
 
@@ -1239,13 +1446,63 @@ bool AddressSpace::update_watchpoint_value(const MemoryRange& range,
   return changed;
 }
 
+vector<bool> AddressSpace::update_watchpoint_values(
+    const vector<pair<const MemoryRange, Watchpoint>*>& wps) {
+  vector<bool> changed(wps.size(), false);
+  Task* t = first_running_task();
+  if (!t || wps.empty()) {
+    return changed;
+  }
+  // Read everything in one scatter read. If any range can't be read
+  // completely, fall back to reading them one at a time so the valid
+  // parts of partially valid watchpoints are still tracked.
+  bool batch = wps.size() > 1;
+  vector<MemoryRange> ranges;
+  size_t total = 0;
+  for (auto wp : wps) {
+    // Ranges clipped at the end of the address space are left to
+    // update_watchpoint_value().
+    batch = batch && wp->first.size() == wp->second.value_bytes.size();
+    ranges.push_back(wp->first);
+    total += wp->first.size();
+  }
+  if (batch) {
+    vector<uint8_t> buf(total);
+    if (t->read_bytes_batch(ranges, buf.data())) {
+      const uint8_t* p = buf.data();
+      for (size_t i = 0; i < wps.size(); ++i) {
+        Watchpoint& watchpoint = wps[i]->second;
+        size_t size = watchpoint.value_bytes.size();
+        changed[i] = !watchpoint.valid ||
+                     memcmp(p, watchpoint.value_bytes.data(), size) != 0;
+        if (changed[i]) {
+          memcpy(watchpoint.value_bytes.data(), p, size);
+          watchpoint.valid = true;
+        }
+        p += size;
+      }
+      return changed;
+    }
+  }
+  for (size_t i = 0; i < wps.size(); ++i) {
+    changed[i] = update_watchpoint_value(wps[i]->first, wps[i]->second);
+  }
+  return changed;
+}
+
 void AddressSpace::update_watchpoint_values(remote_ptr<void> start,
                                             remote_ptr<void> end) {
   MemoryRange r(start, end);
+  vector<pair<const MemoryRange, Watchpoint>*> wps;
   for (auto& it : watchpoints) {
-    if (it.first.intersects(r) &&
-        update_watchpoint_value(it.first, it.second)) {
-      it.second.changed = true;
+    if (it.first.intersects(r)) {
+      wps.push_back(&it);
+    }
+  }
+  vector<bool> changed = update_watchpoint_values(wps);
+  for (size_t i = 0; i < wps.size(); ++i) {
+    if (changed[i]) {
+      wps[i]->second.changed = true;
       // We do nothing to track kernel reads of read-write watchpoints...
     }
   }
@@ -1267,6 +1524,20 @@ bool AddressSpace::notify_watchpoint_fired(uintptr_t debug_status,
     remote_ptr<void> hit_addr,
     remote_code_ptr address_of_singlestep_start) {
   bool triggered = false;
+  // Re-read all the write watchpoints at once. If nothing in this address
+  // space has run since we last read them (e.g. we're asked again about
+  // the same stop), their values can't have changed.
+  vector<pair<const MemoryRange, Watchpoint>*> write_wps;
+  if (watchpoint_values_resume_count != resume_count) {
+    for (auto& it : watchpoints) {
+      if (it.second.watched_bits() & WRITE_BIT) {
+        write_wps.push_back(&it);
+      }
+    }
+    watchpoint_values_resume_count = resume_count;
+  }
+  vector<bool> write_changed = update_watchpoint_values(write_wps);
+  size_t write_index = 0;
   for (auto& it : watchpoints) {
     // On Skylake/4.14.13-300.fc27.x86_64 at least, we have observed a
     // situation where singlestepping through the instruction before a hardware
@@ -1275,8 +1546,10 @@ bool AddressSpace::notify_watchpoint_fired(uintptr_t debug_status,
     // This could be a HW issue or a kernel issue. Work around it by ignoring
     // triggered watchpoints that aren't on the instruction we just tried to
     // execute.
-    bool write_triggered = (it.second.watched_bits() & WRITE_BIT) &&
-        update_watchpoint_value(it.first, it.second);
+    bool write_triggered = false;
+    if (write_index < write_wps.size() && write_wps[write_index] == &it) {
+      write_triggered = write_changed[write_index++];
+    }
     // Depending on the architecture the hardware may indicate hit watchpoints
     // either by number, or by the address that triggered the watchpoint hit
     // - support either.
@@ -1339,6 +1612,10 @@ void AddressSpace::unmap(Task* t, remote_ptr<void> addr, ssize_t num_bytes) {
 
   unmap_internal(t, addr, num_bytes);
 
+  if (monkeypatch_state) {
+    monkeypatch_state->release_stubs_in(MemoryRange(addr, num_bytes));
+  }
+
   if (MemoryRange(addr, num_bytes).contains(RR_PAGE_ADDR)) {
     update_syscall_ips(t);
   }
@@ -1383,7 +1660,7 @@ void AddressSpace::unmap_internal(Task* t, remote_ptr<void> addr,
   auto unmapper = [this](Mapping m, MemoryRange rem) {
     LOG(debug) << "  unmapping (" << rem << ") ...";
 
-    remove_from_map(m.map);
+    auto next = remove_from_map(m.map);
 
     LOG(debug) << "  erased (" << m.map << ") ...";
 
@@ -1396,7 +1673,7 @@ void AddressSpace::unmap_internal(Task* t, remote_ptr<void> addr,
                         m.emu_file, clone_stat(m.mapped_file_stat),
                         m.local_addr, std::move(monitored));
       underflow.flags = m.flags;
-      add_to_map(underflow);
+      add_to_map(underflow, next);
     }
     // If the last segment we unmap overflows the unmap
     // region, remap the overflow region.
@@ -1411,7 +1688,7 @@ void AddressSpace::unmap_internal(Task* t, remote_ptr<void> addr,
                                                     m.map.end() - rem.end())
               : nullptr);
       overflow.flags = m.flags;
-      add_to_map(overflow);
+      add_to_map(overflow, next);
     }
 
     if (m.local_addr) {
@@ -1716,6 +1993,7 @@ void AddressSpace::ensure_replay_matches_single_recorded_mapping(Task* t, Memory
       // We replace the entire mapping even if part of it falls outside the desired range.
       // That's OK, this replacement preserves behaviour, it's simpler, even if a bit
       // less efficient in weird cases.
+      mappings_changed();
       mem.erase(mapping.map);
       KernelMapping anonymous_km(mapping.map.start(), mapping.map.end(),
                                  string(), KernelMapping::NO_DEVICE, KernelMapping::NO_INODE,
@@ -1749,7 +2027,8 @@ void AddressSpace::verify(Task* t) const {
   LOG(debug) << "Verifying address space for task " << t->tid;
 
   MemoryMap::const_iterator mem_it = mem.begin();
-  KernelMapIterator kernel_it(t);
+  KernelMapIterator kernel_it(t, nullptr,
+                              KernelMapIterator::MAPS_QUERY_IF_AVAILABLE);
   if (kernel_it.at_end()) {
     LOG(debug) << "Task " << t->tid << " exited unexpectedly, ignoring";
     return;
@@ -1774,6 +2053,12 @@ void AddressSpace::verify(Task* t) const {
     assert_segments_match(t, vm, km);
   }
 
+  if (kernel_it.using_query()) {
+    // PROCMAP_QUERY doesn't report the [vsyscall] gate area.
+    while (mem_it != mem.end() && mem_it->second.map.is_vsyscall()) {
+      ++mem_it;
+    }
+  }
   ASSERT(t, kernel_it.at_end() && mem_it == mem.end());
 }
 
@@ -1809,9 +2094,12 @@ AddressSpace::AddressSpace(Task* t, const string& exe, uint32_t exec_count)
       leader_tid_(t->rec_tid),
       leader_serial(t->tuid().serial()),
       exec_count(exec_count),
+      mapping_generation_(++next_mapping_generation),
       session_(&t->session()),
       monkeypatch_state(t->session().is_recording() ? new Monkeypatcher()
                                                     : nullptr),
+      resume_count(1),
+      watchpoint_values_resume_count(0),
       syscallbuf_enabled_(false),
       do_breakpoint_fault_addr_(nullptr),
       stopping_breakpoint_table_(nullptr),
@@ -1841,6 +2129,7 @@ AddressSpace::AddressSpace(Session* session, const AddressSpace& o,
       brk_start(o.brk_start),
       brk_end(o.brk_end),
       mem(o.mem),
+      mapping_generation_(o.mapping_generation_),
       shm_sizes(o.shm_sizes),
       monitored_mem(o.monitored_mem),
       dont_fork(o.dont_fork),
@@ -1850,6 +2139,8 @@ AddressSpace::AddressSpace(Session* session, const AddressSpace& o,
       monkeypatch_state(o.monkeypatch_state
                             ? new Monkeypatcher(*o.monkeypatch_state)
                             : nullptr),
+      resume_count(1),
+      watchpoint_values_resume_count(0),
       traced_syscall_ip_(o.traced_syscall_ip_),
       privileged_traced_syscall_ip_(o.privileged_traced_syscall_ip_),
       syscallbuf_enabled_(o.syscallbuf_enabled_),
@@ -2096,10 +2387,11 @@ void AddressSpace::coalesce_around(Task* t, MemoryMap::iterator it) {
 
   // monitored-memory currently isn't coalescable so we don't need to
   // adjust monitored_mem
-  mem.erase(first_kv, ++last_kv);
+  auto next = mem.erase(first_kv, ++last_kv);
 
-  auto ins = mem.insert(MemoryMap::value_type(new_m.map, new_m));
-  DEBUG_ASSERT(ins.second); // key didn't already exist
+  size_t old_size = mem.size();
+  mem.emplace_hint(next, new_m.map, new_m);
+  DEBUG_ASSERT(mem.size() > old_size); // key didn't already exist
 }
 
 void AddressSpace::destroy_breakpoint(BreakpointMap::const_iterator it) {
@@ -2187,6 +2479,7 @@ void AddressSpace::map_and_coalesce(
     void* local_addr, shared_ptr<MonitoredSharedMemory> monitored) {
   LOG(debug) << "  mapping " << m;
 
+  mappings_changed();
   if (monitored) {
     monitored_mem.insert(m.start());
   }
@@ -315,6 +315,8 @@ public:
       IS_RR_PAGE = 0x8,
       // This mapping is the rr vdso page
       IS_RR_VDSO_PAGE = 0x10,
+      // This mapping stands in for a virtual perf counter's mmap page
+      IS_VIRTUAL_PERF_COUNTER_PAGE = 0x20,
     };
     uint32_t flags;
   };
@@ -568,6 +570,12 @@ public:
    */
   void notify_written(remote_ptr<void> addr, size_t num_bytes, uint32_t flags);
 
+  /**
+   * Notify that a task in this address space is about to run, so memory
+   * may change behind our back.
+   */
+  void notify_resumed() { ++resume_count; }
+
   /** Ensure a breakpoint of |type| is set at |addr|. */
   bool add_breakpoint(remote_code_ptr addr, BreakpointType type);
   /**
@@ -576,6 +584,14 @@ public:
    * destroyed.
    */
   void remove_breakpoint(remote_code_ptr addr, BreakpointType type);
+  /**
+   * Like add_breakpoint() / remove_breakpoint() for each of |addrs|, but
+   * the breakpoints on a page are written with one remote read and write.
+   * add_breakpoints() returns false if any breakpoint couldn't be set.
+   */
+  bool add_breakpoints(std::vector<remote_code_ptr> addrs, BreakpointType type);
+  void remove_breakpoints(std::vector<remote_code_ptr> addrs,
+                          BreakpointType type);
   /**
    * Destroy all breakpoints in this VM, regardless of their
    * reference counts.
@@ -791,6 +807,15 @@ public:
   void set_first_run_event(FrameTime event) { first_run_event_ = event; }
   FrameTime first_run_event() { return first_run_event_; }
 
+  /**
+   * Changes whenever mappings are added, removed or replaced. New values
+   * come from a counter shared by all address spaces. A copy (for a
+   * checkpoint or diversion) starts with its source's generation, but
+   * both get fresh values as soon as either changes its mappings, so
+   * equal generations still mean the same set of mappings.
+   */
+  uint64_t mapping_generation() const { return mapping_generation_; }
+
   const std::vector<uint8_t>& saved_auxv() { return saved_auxv_; }
   void save_auxv(Task* t);
 
@@ -943,6 +968,12 @@ private:
 
   bool update_watchpoint_value(const MemoryRange& range,
                                Watchpoint& watchpoint);
+  /**
+   * Like update_watchpoint_value(), for all of |wps| with as few reads as
+   * possible. Returns which watchpoints' values changed.
+   */
+  std::vector<bool> update_watchpoint_values(
+      const std::vector<std::pair<const MemoryRange, Watchpoint>*>& wps);
   void update_watchpoint_values(remote_ptr<void> start, remote_ptr<void> end);
   // Whether to handle all watchpoints or just data watchpoints whose data
   // has changed. In the latter case we clear their changed status.
@@ -1007,17 +1038,41 @@ private:
                         void* local_addr,
                         std::shared_ptr<MonitoredSharedMemory> monitored);
 
-  void remove_from_map(const MemoryRange& range) {
-    mem.erase(range);
+  /**
+   * Remove the mapping for |range| and return the iterator following it,
+   * which is where the pieces of a split mapping belong. Passing that to
+   * add_to_map() keeps splitting a mapping amortized O(1) rather than
+   * O(log n) per piece, which matters for processes with 100k+ mappings.
+   */
+  MemoryMap::iterator remove_from_map(const MemoryRange& range) {
+    mappings_changed();
+    MemoryMap::iterator it = mem.find(range);
+    if (it != mem.end()) {
+      it = mem.erase(it);
+    }
     monitored_mem.erase(range.start());
+    return it;
   }
-  void add_to_map(const Mapping& m) {
-    mem[m.map] = m;
+  void add_to_map(const Mapping& m) { add_to_map(m, mem.end()); }
+  /**
+   * Like add_to_map() above, but |m| is inserted just before |hint|.
+   */
+  MemoryMap::iterator add_to_map(const Mapping& m, MemoryMap::iterator hint) {
+    mappings_changed();
+    size_t old_size = mem.size();
+    auto it = mem.emplace_hint(hint, m.map, m);
+    if (mem.size() == old_size) {
+      // Preserve the replace-on-overlap behavior of mem[m.map] = m.
+      it->second = m;
+    }
     if (m.monitored_shared_memory) {
       monitored_mem.insert(m.map.start());
     }
+    return it;
   }
 
+  void mappings_changed() { mapping_generation_ = ++next_mapping_generation; }
+
   /**
    * Call this only during recording.
    */
@@ -1166,6 +1221,8 @@ private:
   remote_ptr<void> brk_end;
   /* All segments mapped into this address space. */
   MemoryMap mem;
+  uint64_t mapping_generation_;
+  static uint64_t next_mapping_generation;
   /* Sizes of SYSV shm segments, by address. We use this to determine the size
    * of memory regions unmapped via shmdt(). */
   std::map<remote_ptr<void>, size_t> shm_sizes;
@@ -1188,6 +1245,11 @@ private:
   // behalf of debuggers that assume that model.
   std::map<MemoryRange, Watchpoint> watchpoints;
   std::vector<std::map<MemoryRange, Watchpoint>> saved_watchpoints;
+  // Incremented whenever a task in this VM resumes. Watchpoint values
+  // only need to be re-read on a stop if this has changed since the last
+  // time we read them; zero forces a re-read.
+  uint64_t resume_count;
+  uint64_t watchpoint_values_resume_count;
   // Tracee memory is read and written through this fd, which is
   // opened for the tracee's magic /proc/[tid]/mem device.  The
   // advantage of this over ptrace is that we can access it even
@@ -1248,10 +1310,25 @@ private:
  */
 class KernelMapIterator {
 public:
-  KernelMapIterator(Task* t, bool* ok = nullptr);
-  KernelMapIterator(pid_t tid, bool* ok = nullptr) : tid(tid) { init(ok); }
+  enum Source {
+    // Parse the text of /proc/<tid>/maps.
+    MAPS_TEXT,
+    // Use the PROCMAP_QUERY ioctl on /proc/<tid>/maps if the kernel supports
+    // it (Linux 6.11+), which avoids formatting and parsing text and is much
+    // cheaper for processes with many mappings. This doesn't report the
+    // [vsyscall] gate area and doesn't provide raw lines.
+    MAPS_QUERY_IF_AVAILABLE
+  };
+
+  KernelMapIterator(Task* t, bool* ok = nullptr, Source source = MAPS_TEXT);
+  KernelMapIterator(pid_t tid, bool* ok = nullptr) : tid(tid), query(false) {
+    init(ok);
+  }
   ~KernelMapIterator();
 
+  // True if we're iterating with PROCMAP_QUERY.
+  bool using_query() const { return query; }
+
   // It's very important to keep in mind that btrfs files can have the wrong
   // device number!
   const KernelMapping& current(std::string* raw_line = nullptr) {
@@ -1265,9 +1342,15 @@ public:
 
 private:
   void init(bool* ok = nullptr);
+  bool next_from_query();
+  void set_current(uint64_t start, uint64_t end, const char* name,
+                   int dev_major, int dev_minor, uint64_t inode, int prot,
+                   int flags, uint64_t offset);
 
   pid_t tid;
   FILE* maps_file;
+  bool query;
+  uint64_t query_addr;
   std::string raw_line;
   KernelMapping km;
 };
@@ -876,8 +876,6 @@ void AutoRemoteSyscalls::finish_direct_mmap(
              << backing_file_name << " at offset "
              << HEX(backing_offset_bytes);
 
-  ASSERT(task(), !(flags & MAP_GROWSDOWN));
-
   /* Open in the tracee the file that was mapped during
    * recording. */
   {
@@ -889,6 +887,33 @@ void AutoRemoteSyscalls::finish_direct_mmap(
                             child_str.get().as_int(),
                             backing_file_open_flags);
   }
+  finish_direct_mmap_fd(rec_addr, length, prot, flags, fd,
+                        backing_offset_bytes, real_file, real_file_name);
+}
+
+void AutoRemoteSyscalls::finish_direct_mmap(
+                               remote_ptr<void> rec_addr, size_t length,
+                               int prot, int flags, const ScopedFd& backing_fd,
+                               off64_t backing_offset_bytes,
+                               struct stat& real_file, string& real_file_name) {
+  LOG(debug) << "directly mmap'ing " << length << " bytes of fd "
+             << backing_fd.get() << " at offset "
+             << HEX(backing_offset_bytes);
+
+  int fd = infallible_send_fd_if_alive(backing_fd);
+  ASSERT(task(), fd >= 0);
+  finish_direct_mmap_fd(rec_addr, length, prot, flags, fd,
+                        backing_offset_bytes, real_file, real_file_name);
+}
+
+void AutoRemoteSyscalls::finish_direct_mmap_fd(
+                               remote_ptr<void> rec_addr, size_t length,
+                               int prot, int flags, int fd,
+                               off64_t backing_offset_bytes,
+                               struct stat& real_file, string& real_file_name,
+                               CloseFd close_fd) {
+  ASSERT(task(), !(flags & MAP_GROWSDOWN));
+
   /* And mmap that file. */
   infallible_mmap_syscall_if_alive(rec_addr, length,
                           /* (We let SHARED|WRITEABLE
@@ -909,7 +934,9 @@ void AutoRemoteSyscalls::finish_direct_mmap(
 
   /* Don't leak the tmp fd.  The mmap doesn't need the fd to
    * stay open. */
-  infallible_close_syscall_if_alive(fd);
+  if (close_fd == CLOSE_FD) {
+    infallible_close_syscall_if_alive(fd);
+  }
 }
 
 
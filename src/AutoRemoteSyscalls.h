@@ -280,13 +280,29 @@ public:
                           int backing_file_open_flags,
                           off64_t backing_offset_bytes,
                           struct stat& real_file, std::string& real_file_name);
+  /* Like the above, but send the already-open |backing_fd| to the tracee
+   * instead of having it open the file */
+  void finish_direct_mmap(remote_ptr<void> rec_addr, size_t length,
+                          int prot, int flags, const ScopedFd& backing_fd,
+                          off64_t backing_offset_bytes,
+                          struct stat& real_file, std::string& real_file_name);
+
+  enum CloseFd { CLOSE_FD, KEEP_FD_OPEN };
+  /* Like the above, but map the tracee's already-open |child_fd|. With
+   * KEEP_FD_OPEN the caller can map more of the file through |child_fd|
+   * and must close it itself */
+  void finish_direct_mmap_fd(remote_ptr<void> rec_addr, size_t length,
+                             int prot, int flags, int child_fd,
+                             off64_t backing_offset_bytes,
+                             struct stat& real_file,
+                             std::string& real_file_name,
+                             CloseFd close_fd = CLOSE_FD);
 
   // Calling this with allow_death false is DEPRECATED.
   void check_syscall_result(long ret, int syscallno, bool allow_death = true);
 
 private:
   void setup_path(bool enable_singlestep_path);
-
   /**
    * "Recursively" build the set of syscall registers in
    * |callregs|.  |Index| is the syscall arg that will be set to
@@ -4,22 +4,58 @@
 #define RR_BPF_MAP_MONITOR_H_
 
 #include "FileMonitor.h"
+#include "kernel_supplement.h"
+#include "util.h"
 
 namespace rr {
 
 /**
- * A FileMonitor attached to BPF map fds to record their key and value size.
+ * A FileMonitor attached to BPF map fds to record their type, key and value
+ * size.
  */
 class BpfMapMonitor : public FileMonitor {
 public:
-  BpfMapMonitor(uint64_t key_size, uint64_t value_size) : key_size_(key_size), value_size_(value_size) {}
+  BpfMapMonitor(uint32_t map_type, uint64_t key_size, uint64_t value_size)
+      : map_type_(map_type), key_size_(key_size), value_size_(value_size) {}
 
   virtual Type type() override { return BpfMap; }
 
+  /**
+   * The syscallbuf only knows value_size(), so per-CPU maps, whose lookups
+   * return a value for every possible CPU, must trap to rr.
+   */
+  virtual enum syscallbuf_fd_classes get_syscallbuf_class() override {
+    return is_percpu() ? FD_CLASS_TRACED : FD_CLASS_BPF_MAP;
+  }
+
   uint64_t key_size() const { return key_size_; }
   uint64_t value_size() const { return value_size_; }
 
+  bool is_percpu() const {
+    switch (map_type_) {
+      case BPF_MAP_TYPE_PERCPU_HASH:
+      case BPF_MAP_TYPE_PERCPU_ARRAY:
+      case BPF_MAP_TYPE_LRU_PERCPU_HASH:
+      case BPF_MAP_TYPE_PERCPU_CGROUP_STORAGE:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /**
+   * The number of bytes a lookup writes for one element. For per-CPU maps
+   * that's a value, padded to 8 bytes, for each possible CPU.
+   */
+  uint64_t lookup_value_size() const {
+    if (!is_percpu()) {
+      return value_size_;
+    }
+    return ((value_size_ + 7) & ~uint64_t(7)) * get_num_possible_cpus();
+  }
+
 private:
+  uint32_t map_type_;
   uint64_t key_size_;
   uint64_t value_size_;
 };
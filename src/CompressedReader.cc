@@ -4,22 +4,381 @@
 
 #include "CompressedReader.h"
 
+#include <algorithm>
 #include <brotli/decode.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <signal.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <list>
+#include <map>
+#ifdef ZSTD
+#include <zstd.h>
+#endif
+
 #include "CompressedWriter.h"
 #include "core.h"
+#include "log.h"
 #include "util.h"
 
 using namespace std;
 
 namespace rr {
 
+struct CompressedReader::ReadAheadBlock {
+  // File offset of the block header
+  uint64_t offset;
+  CompressedWriter::BlockHeader header;
+  shared_ptr<ScopedFd> fd;
+  CompressedReader::FileId file_id;
+  // False if the block was in the block cache when we scheduled it
+  bool submitted;
+  // BEGIN protected by ReadAheadPool's mutex
+  bool done;
+  bool ok;
+  // Set if the thread decompressing this block vanished in fork().
+  bool abandoned;
+  // END protected by ReadAheadPool's mutex
+  shared_ptr<const vector<uint8_t>> data;
+};
+
+static bool read_all(const ScopedFd& fd, size_t size, void* data,
+                     uint64_t* offset);
+static bool do_decompress(CompressedWriter::Codec codec,
+                          std::vector<uint8_t>& compressed,
+                          std::vector<uint8_t>& uncompressed,
+                          const ScopedFd& fd,
+                          const CompressedReader::FileId& file_id);
+
+/**
+ * Threads that decompress blocks for all CompressedReaders that use
+ * read-ahead. Created on first use and never destroyed. rr sometimes fork()s
+ * and keeps replaying in the child (see ExportImportCheckpoints), so the
+ * threads are recreated in the child on demand.
+ */
+class ReadAheadPool {
+public:
+  typedef CompressedReader::ReadAheadBlock Block;
+
+  static ReadAheadPool& get() {
+    static ReadAheadPool* singleton = new ReadAheadPool();
+    return *singleton;
+  }
+
+  void submit(const shared_ptr<Block>& block) {
+    pthread_mutex_lock(&mutex);
+    if (!threads_started) {
+      start_threads();
+    }
+    queue.push_back(block);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  // Returns true if the block was decompressed successfully.
+  bool wait(Block& block) {
+    pthread_mutex_lock(&mutex);
+    while (!block.done) {
+      pthread_cond_wait(&cond, &mutex);
+    }
+    bool ok = block.ok;
+    pthread_mutex_unlock(&mutex);
+    return ok;
+  }
+
+private:
+  ReadAheadPool() : threads_started(false) {
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&cond, nullptr);
+    pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+  }
+
+  // Called with 'mutex' held.
+  void start_threads() {
+    // Make sure the threads block all signals
+    sigset_t set;
+    sigset_t old_mask;
+    sigfillset(&set);
+    sigprocmask(SIG_BLOCK, &set, &old_mask);
+    int num_threads = max(1, min(4, get_num_cpus() - 1));
+    for (int i = 0; i < num_threads; ++i) {
+      pthread_t thread;
+      int err = pthread_create(&thread, nullptr, thread_callback, this);
+      if (err != 0) {
+        SAFE_FATAL(err, "Failed to create read-ahead threads!");
+      }
+      pthread_setname_np(thread, "read-ahead");
+      pthread_detach(thread);
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+    threads_started = true;
+  }
+
+  static void atfork_prepare() { pthread_mutex_lock(&get().mutex); }
+  static void atfork_parent() { pthread_mutex_unlock(&get().mutex); }
+  static void atfork_child() {
+    ReadAheadPool& pool = get();
+    // Our threads don't exist in the child and won't be restarted until
+    // something new is submitted, so hand every outstanding block back to
+    // its reader, which decompresses it itself.
+    for (auto& block : pool.queue) {
+      block->abandoned = true;
+      block->done = true;
+    }
+    pool.queue.clear();
+    for (auto& block : pool.running) {
+      block->abandoned = true;
+      block->done = true;
+    }
+    pool.running.clear();
+    pool.threads_started = false;
+    pthread_mutex_unlock(&pool.mutex);
+  }
+
+  static void* thread_callback(void* p) {
+    static_cast<ReadAheadPool*>(p)->thread_main();
+    return nullptr;
+  }
+
+  void thread_main() {
+    pthread_mutex_lock(&mutex);
+    while (true) {
+      if (queue.empty()) {
+        pthread_cond_wait(&cond, &mutex);
+        continue;
+      }
+      shared_ptr<Block> block = queue.front();
+      queue.pop_front();
+      running.push_back(block);
+      pthread_mutex_unlock(&mutex);
+
+      vector<uint8_t> compressed;
+      compressed.resize(block->header.compressed_length());
+      uint64_t offset = block->offset + sizeof(block->header);
+      shared_ptr<vector<uint8_t>> data(new vector<uint8_t>());
+      bool ok = read_all(*block->fd, compressed.size(), compressed.data(),
+                         &offset);
+      if (ok) {
+        data->resize(block->header.uncompressed_length);
+        ok = do_decompress(block->header.codec(), compressed, *data,
+                           *block->fd, block->file_id);
+      }
+
+      pthread_mutex_lock(&mutex);
+      block->data = std::move(data);
+      block->ok = ok;
+      block->done = true;
+      running.erase(find(running.begin(), running.end(), block));
+      pthread_cond_broadcast(&cond);
+    }
+  }
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // BEGIN protected by 'mutex'
+  deque<shared_ptr<Block>> queue;
+  vector<shared_ptr<Block>> running;
+  bool threads_started;
+  // END protected by 'mutex'
+};
+
+/**
+ * Decompressed blocks, shared by all CompressedReaders in this process.
+ * ReplaySession::clone copies the TraceReader, and checkpoints replaying
+ * forward over the same region would otherwise decompress the same blocks
+ * again and again. Blocks are kept alive by their readers as long as
+ * they're in use, so evicting a block only drops the cache's reference.
+ * The memory cap defaults to 256MB and can be set with the
+ * RR_BLOCK_CACHE_MB environment variable; 0 disables the cache.
+ * Only used by the thread(s) doing the replay, one at a time.
+ */
+class BlockCache {
+public:
+  typedef shared_ptr<const vector<uint8_t>> Data;
+
+  static BlockCache& get() {
+    static BlockCache* singleton = new BlockCache();
+    return *singleton;
+  }
+
+  Data lookup(const CompressedReader::FileId& file, uint64_t offset) {
+    if (!file.valid) {
+      return nullptr;
+    }
+    auto it = index.find(Key(file, offset));
+    if (it == index.end()) {
+      return nullptr;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+  }
+
+  void insert(const CompressedReader::FileId& file, uint64_t offset,
+              const Data& data) {
+    if (!file.valid || data->size() > limit) {
+      return;
+    }
+    Key key(file, offset);
+    if (index.count(key)) {
+      return;
+    }
+    lru.push_front(make_pair(key, data));
+    index[key] = lru.begin();
+    size += data->size();
+    while (size > limit) {
+      auto& last = lru.back();
+      size -= last.second->size();
+      index.erase(last.first);
+      lru.pop_back();
+    }
+  }
+
+private:
+  struct Key {
+    Key(const CompressedReader::FileId& file, uint64_t offset)
+        : file(file), offset(offset) {}
+    bool operator<(const Key& other) const {
+      if (file < other.file || other.file < file) {
+        return file < other.file;
+      }
+      return offset < other.offset;
+    }
+    CompressedReader::FileId file;
+    uint64_t offset;
+  };
+
+  BlockCache() : size(0), limit(256 * 1024 * 1024) {
+    const char* mb = getenv("RR_BLOCK_CACHE_MB");
+    if (mb) {
+      limit = (size_t)strtoull(mb, nullptr, 10) * 1024 * 1024;
+    }
+  }
+
+  // Most recently used first
+  list<pair<Key, Data>> lru;
+  map<Key, list<pair<Key, Data>>::iterator> index;
+  size_t size;
+  size_t limit;
+};
+
+#ifdef ZSTD
+/**
+ * The zstd dictionaries of the files we've read CODEC_ZSTD_DICT blocks
+ * from, shared by all CompressedReaders in this process. Only the
+ * MAX_DICTIONARIES most recently used are kept; callers hold a reference
+ * while they use one, so evicting it is always safe. Used by the
+ * read-ahead threads too, so protected by a mutex, which fork() must not
+ * leave locked.
+ */
+class DictionaryCache {
+public:
+  typedef shared_ptr<const ZSTD_DDict> Dictionary;
+
+  static DictionaryCache& get() {
+    static DictionaryCache* singleton = new DictionaryCache();
+    return *singleton;
+  }
+
+  // Returns null if the file's first block can't be read.
+  Dictionary lookup(const ScopedFd& fd, const CompressedReader::FileId& file) {
+    if (file.valid) {
+      pthread_mutex_lock(&mutex);
+      auto it = index.find(file);
+      Dictionary ret;
+      if (it != index.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        ret = it->second->second;
+      }
+      pthread_mutex_unlock(&mutex);
+      if (ret) {
+        return ret;
+      }
+    }
+
+    Dictionary ret = create(fd);
+    if (!ret || !file.valid) {
+      return ret;
+    }
+    pthread_mutex_lock(&mutex);
+    auto it = index.find(file);
+    if (it != index.end()) {
+      // Another thread got there first.
+      ret = it->second->second;
+    } else {
+      lru.push_front(make_pair(file, ret));
+      index[file] = lru.begin();
+      if (lru.size() > MAX_DICTIONARIES) {
+        index.erase(lru.back().first);
+        lru.pop_back();
+      }
+    }
+    pthread_mutex_unlock(&mutex);
+    return ret;
+  }
+
+private:
+  // A trace has at most a few dictionary substreams, and replays rarely
+  // read more than a couple of traces.
+  static const size_t MAX_DICTIONARIES = 16;
+
+  DictionaryCache() {
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_atfork(atfork_prepare, atfork_parent, atfork_parent);
+  }
+
+  static void atfork_prepare() { pthread_mutex_lock(&get().mutex); }
+  static void atfork_parent() { pthread_mutex_unlock(&get().mutex); }
+
+  // The dictionary is the tail of the first block, which is always plain
+  // CODEC_ZSTD. See CompressedWriter::create_dictionary.
+  static Dictionary create(const ScopedFd& fd) {
+    uint64_t offset = 0;
+    CompressedWriter::BlockHeader header;
+    if (!read_all(fd, sizeof(header), &header, &offset) ||
+        header.codec() != CompressedWriter::CODEC_ZSTD) {
+      return nullptr;
+    }
+    vector<uint8_t> compressed;
+    compressed.resize(header.compressed_length());
+    if (!read_all(fd, compressed.size(), compressed.data(), &offset)) {
+      return nullptr;
+    }
+    vector<uint8_t> block;
+    block.resize(header.uncompressed_length);
+    if (!do_decompress(CompressedWriter::CODEC_ZSTD, compressed, block, fd,
+                       CompressedReader::FileId())) {
+      return nullptr;
+    }
+    size_t size = min(block.size(), CompressedWriter::DICTIONARY_SIZE);
+    ZSTD_DDict* dictionary =
+        ZSTD_createDDict(block.data() + block.size() - size, size);
+    if (!dictionary) {
+      return nullptr;
+    }
+    return Dictionary(dictionary, ZSTD_freeDDict);
+  }
+
+  pthread_mutex_t mutex;
+  // BEGIN protected by 'mutex'
+  // Most recently used first
+  list<pair<CompressedReader::FileId, Dictionary>> lru;
+  map<CompressedReader::FileId,
+      list<pair<CompressedReader::FileId, Dictionary>>::iterator> index;
+  // END protected by 'mutex'
+};
+#endif
+
+static const shared_ptr<const vector<uint8_t>>& empty_buffer() {
+  static const shared_ptr<const vector<uint8_t>>* empty =
+      new shared_ptr<const vector<uint8_t>>(new vector<uint8_t>());
+  return *empty;
+}
+
 CompressedReader::CompressedReader(const string& filename)
     : fd(new ScopedFd(filename.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE)) {
   fd_offset = 0;
@@ -29,14 +388,26 @@ CompressedReader::CompressedReader(const string& filename)
   } else {
     char ch;
     eof = pread(*fd, &ch, 1, fd_offset) == 0;
+    struct stat st;
+    if (fstat(*fd, &st) == 0) {
+      file_id.dev = st.st_dev;
+      file_id.ino = st.st_ino;
+      file_id.size = st.st_size;
+      file_id.mtime_sec = st.st_mtim.tv_sec;
+      file_id.mtime_nsec = st.st_mtim.tv_nsec;
+      file_id.valid = true;
+    }
   }
+  buffer = empty_buffer();
   buffer_read_pos = 0;
   buffer_skip_bytes = 0;
   have_saved_state = false;
+  read_ahead_blocks = 0;
 }
 
 CompressedReader::CompressedReader(const CompressedReader& other) {
   fd = other.fd;
+  file_id = other.file_id;
   fd_offset = other.fd_offset;
   error = other.error;
   eof = other.eof;
@@ -44,6 +415,7 @@ CompressedReader::CompressedReader(const CompressedReader& other) {
   buffer_skip_bytes = other.buffer_skip_bytes;
   buffer = other.buffer;
   have_saved_state = false;
+  read_ahead_blocks = other.read_ahead_blocks;
   DEBUG_ASSERT(!other.have_saved_state);
 }
 
@@ -59,13 +431,60 @@ static bool read_all(const ScopedFd& fd, size_t size, void* data,
   return false;
 }
 
-static bool do_decompress(std::vector<uint8_t>& compressed,
-                          std::vector<uint8_t>& uncompressed) {
-  size_t out_size = uncompressed.size();
-  return BrotliDecoderDecompress(compressed.size(), compressed.data(),
-                                 &out_size, uncompressed.data()) ==
-             BROTLI_DECODER_RESULT_SUCCESS &&
-         out_size == uncompressed.size();
+static bool do_decompress(CompressedWriter::Codec codec,
+                          std::vector<uint8_t>& compressed,
+                          std::vector<uint8_t>& uncompressed,
+                          const ScopedFd& fd,
+                          const CompressedReader::FileId& file_id) {
+#ifndef ZSTD
+  // Only CODEC_ZSTD_DICT blocks need the file.
+  (void)fd;
+  (void)file_id;
+#endif
+  switch (codec) {
+    case CompressedWriter::CODEC_BROTLI: {
+      size_t out_size = uncompressed.size();
+      return BrotliDecoderDecompress(compressed.size(), compressed.data(),
+                                     &out_size, uncompressed.data()) ==
+                 BROTLI_DECODER_RESULT_SUCCESS &&
+             out_size == uncompressed.size();
+    }
+#ifdef ZSTD
+    case CompressedWriter::CODEC_ZSTD: {
+      size_t out_size = ZSTD_decompress(uncompressed.data(),
+                                        uncompressed.size(),
+                                        compressed.data(), compressed.size());
+      return !ZSTD_isError(out_size) && out_size == uncompressed.size();
+    }
+    case CompressedWriter::CODEC_ZSTD_DICT: {
+      DictionaryCache::Dictionary dictionary =
+          DictionaryCache::get().lookup(fd, file_id);
+      if (!dictionary) {
+        LOG(error) << "Can't load the zstd dictionary";
+        return false;
+      }
+      ZSTD_DCtx* dctx = ZSTD_createDCtx();
+      if (!dctx) {
+        return false;
+      }
+      size_t out_size = ZSTD_decompress_usingDDict(
+          dctx, uncompressed.data(), uncompressed.size(), compressed.data(),
+          compressed.size(), dictionary.get());
+      ZSTD_freeDCtx(dctx);
+      return !ZSTD_isError(out_size) && out_size == uncompressed.size();
+    }
+#endif
+    case CompressedWriter::CODEC_NONE:
+      if (compressed.size() != uncompressed.size()) {
+        return false;
+      }
+      memcpy(uncompressed.data(), compressed.data(), compressed.size());
+      return true;
+    default:
+      LOG(error) << "Block compressed with unsupported codec "
+                 << CompressedWriter::codec_name(codec);
+      return false;
+  }
 }
 
 bool CompressedReader::get_buffer(const uint8_t** data, size_t* size) {
@@ -75,22 +494,22 @@ bool CompressedReader::get_buffer(const uint8_t** data, size_t* size) {
     return false;
   }
 
-  if (buffer_read_pos >= buffer.size() && !eof) {
+  if (buffer_read_pos >= buffer->size() && !eof) {
     if (!refill_buffer()) {
       return false;
     }
-    DEBUG_ASSERT(buffer_read_pos < buffer.size());
+    DEBUG_ASSERT(buffer_read_pos < buffer->size());
   }
 
-  *data = &buffer[buffer_read_pos];
-  *size = buffer.size() - buffer_read_pos;
+  *data = buffer->data() + buffer_read_pos;
+  *size = buffer->size() - buffer_read_pos;
   return true;
 }
 
 void CompressedReader::process_skip() {
   while (buffer_skip_bytes > 0 && !error) {
-    if (buffer_read_pos < buffer.size()) {
-      size_t amount = std::min(buffer_skip_bytes, buffer.size() - buffer_read_pos);
+    if (buffer_read_pos < buffer->size()) {
+      size_t amount = std::min(buffer_skip_bytes, buffer->size() - buffer_read_pos);
       buffer_skip_bytes -= amount;
       buffer_read_pos += amount;
       continue;
@@ -110,9 +529,9 @@ bool CompressedReader::read(void* data, size_t size) {
       return false;
     }
 
-    if (buffer_read_pos < buffer.size()) {
-      size_t amount = std::min(size, buffer.size() - buffer_read_pos);
-      memcpy(data, &buffer[buffer_read_pos], amount);
+    if (buffer_read_pos < buffer->size()) {
+      size_t amount = std::min(size, buffer->size() - buffer_read_pos);
+      memcpy(data, buffer->data() + buffer_read_pos, amount);
       size -= amount;
       data = static_cast<char*>(data) + amount;
       buffer_read_pos += amount;
@@ -126,13 +545,32 @@ bool CompressedReader::read(void* data, size_t size) {
   return true;
 }
 
-bool CompressedReader::refill_buffer(size_t* skip_bytes) {
-  if (have_saved_state && !have_saved_buffer) {
-    std::swap(buffer, saved_buffer);
-    have_saved_buffer = true;
+bool CompressedReader::read_spans(size_t size, vector<Span>* spans) {
+  process_skip();
+
+  while (size > 0) {
+    if (error) {
+      return false;
+    }
+
+    if (buffer_read_pos < buffer->size()) {
+      size_t amount = std::min(size, buffer->size() - buffer_read_pos);
+      spans->push_back({ buffer, buffer->data() + buffer_read_pos, amount });
+      size -= amount;
+      buffer_read_pos += amount;
+      continue;
+    }
+
+    if (!refill_buffer()) {
+      return false;
+    }
   }
+  return true;
+}
 
+bool CompressedReader::refill_buffer(size_t* skip_bytes) {
   while (true) {
+    uint64_t block_offset = fd_offset;
     CompressedWriter::BlockHeader header;
     if (!read_all(*fd, sizeof(header), &header, &fd_offset)) {
       error = true;
@@ -140,7 +578,7 @@ bool CompressedReader::refill_buffer(size_t* skip_bytes) {
     }
 
     if (skip_bytes && *skip_bytes >= header.uncompressed_length) {
-      fd_offset += header.compressed_length;
+      fd_offset += header.compressed_length();
       *skip_bytes -= header.uncompressed_length;
       char ch;
       if (pread(*fd, &ch, 1, fd_offset) == 0) {
@@ -150,11 +588,35 @@ bool CompressedReader::refill_buffer(size_t* skip_bytes) {
       continue;
     }
 
-    std::vector<uint8_t> compressed_buf;
-    compressed_buf.resize(header.compressed_length);
-    if (!read_all(*fd, compressed_buf.size(), &compressed_buf[0], &fd_offset)) {
-      error = true;
-      return false;
+    buffer_read_pos = 0;
+    BlockCache& cache = BlockCache::get();
+    shared_ptr<const vector<uint8_t>> cached = cache.lookup(file_id, block_offset);
+    if (cached) {
+      buffer = cached;
+      fd_offset += header.compressed_length();
+    } else if (take_read_ahead_block(block_offset)) {
+      fd_offset += header.compressed_length();
+      cache.insert(file_id, block_offset, buffer);
+    } else {
+      if (error) {
+        return false;
+      }
+      std::vector<uint8_t> compressed_buf;
+      compressed_buf.resize(header.compressed_length());
+      if (!read_all(*fd, compressed_buf.size(), &compressed_buf[0],
+                    &fd_offset)) {
+        error = true;
+        return false;
+      }
+      shared_ptr<vector<uint8_t>> data(new vector<uint8_t>());
+      data->resize(header.uncompressed_length);
+      if (!do_decompress(header.codec(), compressed_buf, *data, *fd,
+                         file_id)) {
+        error = true;
+        return false;
+      }
+      buffer = std::move(data);
+      cache.insert(file_id, block_offset, buffer);
     }
 
     char ch;
@@ -162,14 +624,78 @@ bool CompressedReader::refill_buffer(size_t* skip_bytes) {
       eof = true;
     }
 
-    buffer.resize(header.uncompressed_length);
-    buffer_read_pos = 0;
-    if (!do_decompress(compressed_buf, buffer)) {
-      error = true;
-      return false;
+    schedule_read_ahead();
+    return true;
+  }
+}
+
+bool CompressedReader::take_read_ahead_block(uint64_t block_offset) {
+  while (!read_ahead.empty() && read_ahead.front()->offset < block_offset) {
+    read_ahead.pop_front();
+  }
+  if (read_ahead.empty() || read_ahead.front()->offset != block_offset) {
+    return false;
+  }
+  shared_ptr<ReadAheadBlock> block = read_ahead.front();
+  read_ahead.pop_front();
+  if (!block->submitted) {
+    return false;
+  }
+  if (!ReadAheadPool::get().wait(*block)) {
+    // If the block was abandoned, our caller decompresses it instead.
+    error = !block->abandoned;
+    return false;
+  }
+  buffer = std::move(block->data);
+  return true;
+}
+
+void CompressedReader::schedule_read_ahead() {
+  if (!read_ahead_blocks || eof) {
+    return;
+  }
+  while (!read_ahead.empty() && read_ahead.front()->offset < fd_offset) {
+    read_ahead.pop_front();
+  }
+  if (!read_ahead.empty() && read_ahead.front()->offset != fd_offset) {
+    // We jumped somewhere else (restore_state(), seek() etc).
+    read_ahead.clear();
+  }
+  uint64_t offset = fd_offset;
+  if (!read_ahead.empty()) {
+    auto& last = read_ahead.back();
+    offset = last->offset + sizeof(last->header) +
+             last->header.compressed_length();
+  }
+  while (read_ahead.size() < read_ahead_blocks) {
+    shared_ptr<ReadAheadBlock> block(new ReadAheadBlock());
+    block->offset = offset;
+    block->fd = fd;
+    block->file_id = file_id;
+    block->done = false;
+    block->ok = false;
+    block->abandoned = false;
+    uint64_t header_offset = offset;
+    if (!read_all(*fd, sizeof(block->header), &block->header,
+                  &header_offset)) {
+      // End of file (or an error we'll report when we get there).
+      break;
     }
+    // Blocks already in the cache don't need to be decompressed again;
+    // refill_buffer will find them there.
+    block->submitted = !BlockCache::get().lookup(file_id, offset);
+    if (block->submitted) {
+      ReadAheadPool::get().submit(block);
+    }
+    read_ahead.push_back(block);
+    offset = header_offset + block->header.compressed_length();
+  }
+}
 
-    return true;
+void CompressedReader::set_read_ahead(size_t blocks) {
+  read_ahead_blocks = blocks;
+  if (!blocks) {
+    read_ahead.clear();
   }
 }
 
@@ -178,18 +704,32 @@ void CompressedReader::rewind() {
   fd_offset = 0;
   buffer_read_pos = 0;
   buffer_skip_bytes = 0;
-  buffer.clear();
+  buffer = empty_buffer();
   eof = false;
 }
 
-void CompressedReader::close() { fd = nullptr; }
+void CompressedReader::seek(uint64_t block_offset, size_t skip) {
+  DEBUG_ASSERT(!have_saved_state);
+  fd_offset = block_offset;
+  buffer_read_pos = 0;
+  buffer_skip_bytes = skip;
+  buffer = empty_buffer();
+  char ch;
+  eof = pread(*fd, &ch, 1, fd_offset) == 0;
+}
+
+void CompressedReader::close() {
+  read_ahead.clear();
+  fd = nullptr;
+}
 
 void CompressedReader::save_state() {
   DEBUG_ASSERT(!have_saved_state);
   process_skip();
   have_saved_state = true;
-  have_saved_buffer = false;
   saved_fd_offset = fd_offset;
+  // Blocks are never modified after decompression, so sharing is enough.
+  saved_buffer = buffer;
   saved_buffer_read_pos = buffer_read_pos;
 }
 
@@ -200,10 +740,8 @@ void CompressedReader::restore_state() {
     eof = false;
   }
   fd_offset = saved_fd_offset;
-  if (have_saved_buffer) {
-    std::swap(buffer, saved_buffer);
-    saved_buffer.clear();
-  }
+  buffer = std::move(saved_buffer);
+  saved_buffer = nullptr;
   buffer_read_pos = saved_buffer_read_pos;
   buffer_skip_bytes = 0;
 }
@@ -211,9 +749,7 @@ void CompressedReader::restore_state() {
 void CompressedReader::discard_state() {
   DEBUG_ASSERT(have_saved_state);
   have_saved_state = false;
-  if (have_saved_buffer) {
-    saved_buffer.clear();
-  }
+  saved_buffer = nullptr;
 }
 
 uint64_t CompressedReader::uncompressed_bytes() const {
@@ -222,11 +758,38 @@ uint64_t CompressedReader::uncompressed_bytes() const {
   CompressedWriter::BlockHeader header;
   while (read_all(*fd, sizeof(header), &header, &offset)) {
     uncompressed_bytes += header.uncompressed_length;
-    offset += header.compressed_length;
+    offset += header.compressed_length();
   }
   return uncompressed_bytes;
 }
 
+vector<uint64_t> CompressedReader::block_offsets() const {
+  uint64_t offset = 0;
+  vector<uint64_t> offsets;
+  CompressedWriter::BlockHeader header;
+  while (true) {
+    uint64_t block_offset = offset;
+    if (!read_all(*fd, sizeof(header), &header, &offset)) {
+      break;
+    }
+    offsets.push_back(block_offset);
+    offset += header.compressed_length();
+  }
+  return offsets;
+}
+
+bool CompressedReader::uses_codec(CompressedWriter::Codec codec) const {
+  uint64_t offset = 0;
+  CompressedWriter::BlockHeader header;
+  while (read_all(*fd, sizeof(header), &header, &offset)) {
+    if (header.codec() == codec) {
+      return true;
+    }
+    offset += header.compressed_length();
+  }
+  return false;
+}
+
 uint64_t CompressedReader::compressed_bytes() const {
   return lseek(*fd, 0, SEEK_END);
 }
@@ -5,19 +5,25 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <sys/types.h>
 
+#include <deque>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include "CompressedWriter.h"
 #include "ScopedFd.h"
 
 namespace rr {
 
 /**
  * CompressedReader opens an input file written by CompressedWriter
- * and reads data from it. Currently data is decompressed by the thread that
- * calls read().
+ * and reads data from it. By default data is decompressed by the thread that
+ * calls read(). With set_read_ahead(), the following blocks are decompressed
+ * in the background by a process-wide pool of threads. Decompressed blocks
+ * are kept in a process-wide LRU cache shared by all readers of the same file
+ * (e.g. the TraceReaders of cloned ReplaySessions).
  */
 class CompressedReader {
 public:
@@ -27,11 +33,21 @@ public:
   bool good() const { return !error; }
   bool at_end() const {
     const_cast<CompressedReader*>(this)->process_skip();
-    return eof && buffer_read_pos == buffer.size();
+    return eof && buffer_read_pos == buffer->size();
   }
   // Returns true if successful. Otherwise there's an error and good()
   // will be false.
   bool read(void* data, size_t size);
+  /**
+   * A piece of a decompressed block. 'block' keeps 'data' alive.
+   */
+  struct Span {
+    std::shared_ptr<const std::vector<uint8_t>> block;
+    const uint8_t* data;
+    size_t size;
+  };
+  // Like read(), but appends the data to 'spans' without copying it.
+  bool read_spans(size_t size, std::vector<Span>* spans);
   // Returns pointer/size of some buffered data. Does not change the state.
   // Returns zero size if at EOF.
   bool get_buffer(const uint8_t** data, size_t* size);
@@ -40,6 +56,18 @@ public:
     buffer_skip_bytes += size;
   }
   void rewind();
+  /**
+   * Keep up to 'blocks' blocks after the current one decompressing in the
+   * background. Zero disables read-ahead. Copies of this reader inherit the
+   * setting but not the blocks already read ahead.
+   */
+  void set_read_ahead(size_t blocks);
+  /**
+   * Position the reader at the block that starts at file offset
+   * 'block_offset' and then skip 'skip' uncompressed bytes. 'block_offset'
+   * must come from CompressedWriter::block_offsets().
+   */
+  void seek(uint64_t block_offset, size_t skip);
   void close();
 
   /**
@@ -61,28 +89,76 @@ public:
    */
   uint64_t uncompressed_bytes() const;
   uint64_t compressed_bytes() const;
+  /**
+   * File offsets of all blocks, in order.
+   */
+  std::vector<uint64_t> block_offsets() const;
+  /**
+   * True if any block was written with 'codec'.
+   */
+  bool uses_codec(CompressedWriter::Codec codec) const;
+
+  struct ReadAheadBlock;
+  // Identifies the file in the process-wide cache of decompressed blocks.
+  // Inode numbers are reused once a file is deleted, so the size and mtime
+  // are part of the identity too. If fstat() failed the file isn't 'valid'
+  // and nothing is cached for it.
+  struct FileId {
+    FileId()
+        : dev(0), ino(0), size(0), mtime_sec(0), mtime_nsec(0), valid(false) {}
+    bool operator<(const FileId& other) const {
+      if (dev != other.dev) {
+        return dev < other.dev;
+      }
+      if (ino != other.ino) {
+        return ino < other.ino;
+      }
+      if (size != other.size) {
+        return size < other.size;
+      }
+      if (mtime_sec != other.mtime_sec) {
+        return mtime_sec < other.mtime_sec;
+      }
+      return mtime_nsec < other.mtime_nsec;
+    }
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+    bool valid;
+  };
 
 protected:
   void process_skip();
   bool refill_buffer(size_t* skip_bytes = nullptr);
+  bool take_read_ahead_block(uint64_t block_offset);
+  void schedule_read_ahead();
 
   /* Our fd might be the dup of another fd, so we can't rely on its current file
      position.
      Instead track the current position in fd_offset and use pread. */
   uint64_t fd_offset;
   std::shared_ptr<ScopedFd> fd;
+  FileId file_id;
   bool error;
   bool eof;
-  std::vector<uint8_t> buffer;
+  // The current decompressed block. Possibly shared with other readers of
+  // the same file and with the block cache, so never modified.
+  std::shared_ptr<const std::vector<uint8_t>> buffer;
   // within `buffer`
   size_t buffer_read_pos;
   size_t buffer_skip_bytes;
 
   bool have_saved_state;
-  bool have_saved_buffer;
   uint64_t saved_fd_offset;
-  std::vector<uint8_t> saved_buffer;
+  std::shared_ptr<const std::vector<uint8_t>> saved_buffer;
   size_t saved_buffer_read_pos;
+
+  size_t read_ahead_blocks;
+  // Blocks being decompressed in the background, in file order, each
+  // following the previous one.
+  std::deque<std::shared_ptr<ReadAheadBlock>> read_ahead;
 };
 
 } // namespace rr
@@ -12,7 +12,12 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef ZSTD
+#include <zstd.h>
+#endif
 
+#include "SpanTracer.h"
+#include "TraceUploader.h"
 #include "core.h"
 #include "util.h"
 
@@ -24,6 +29,60 @@ namespace rr {
  * http://robert.ocallahan.org/2017/07/selecting-compression-algorithm-for-rr.html
  */
 static const int BROTLI_LEVEL = 5;
+// Favor speed; RAW_DATA is the bulk of most traces.
+static const int ZSTD_LEVEL = 3;
+
+// Number of blocks compressed between adjustments of the thread count
+static const uint32_t ADAPT_INTERVAL_BLOCKS = 16;
+
+const char* CompressedWriter::codec_name(Codec codec) {
+  switch (codec) {
+    case CODEC_BROTLI:
+      return "brotli";
+    case CODEC_ZSTD:
+      return "zstd";
+    case CODEC_NONE:
+      return "none";
+    case CODEC_ZSTD_DICT:
+      return "zstd+dictionary";
+    default:
+      return "unknown";
+  }
+}
+
+bool CompressedWriter::parse_codec(const string& name, Codec* codec) {
+  if (name == "brotli") {
+    *codec = CODEC_BROTLI;
+    return true;
+  }
+#ifdef ZSTD
+  if (name == "zstd") {
+    *codec = CODEC_ZSTD;
+    return true;
+  }
+#endif
+  if (name == "none") {
+    *codec = CODEC_NONE;
+    return true;
+  }
+  return false;
+}
+
+bool CompressedWriter::valid_level(Codec codec, int level) {
+  if (level == DEFAULT_LEVEL) {
+    return true;
+  }
+  switch (codec) {
+    case CODEC_BROTLI:
+      return level >= BROTLI_MIN_QUALITY && level <= BROTLI_MAX_QUALITY;
+    case CODEC_ZSTD:
+      return level >= 1 && level <= 19;
+    case CODEC_NONE:
+      return level == 0;
+    default:
+      return false;
+  }
+}
 
 void* CompressedWriter::compression_thread_callback(void* p) {
   static_cast<CompressedWriter*>(p)->compression_thread();
@@ -31,23 +90,68 @@ void* CompressedWriter::compression_thread_callback(void* p) {
 }
 
 CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
-                                   uint32_t num_threads)
+                                   uint32_t num_threads, Codec codec,
+                                   int level, uint32_t max_threads,
+                                   uint32_t buffer_blocks)
     : fd(filename.c_str(),
-         O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, 0400) {
+         O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, 0400),
+      uploader(nullptr),
+      codec_(codec),
+      level_(level),
+      use_dictionary(false) {
+  DEBUG_ASSERT(valid_level(codec, level));
+  if (level_ == DEFAULT_LEVEL) {
+    switch (codec) {
+      case CODEC_ZSTD:
+        level_ = ZSTD_LEVEL;
+        break;
+      case CODEC_NONE:
+        level_ = 0;
+        break;
+      default:
+        level_ = BROTLI_LEVEL;
+        break;
+    }
+  }
   this->block_size = block_size;
+  // The compressed length must fit below the codec bits of BlockHeader.
+  DEBUG_ASSERT((size_t)(block_size * 1.1) <= BlockHeader::LENGTH_MASK);
+  active_threads = num_threads;
+  num_threads = max(num_threads, max_threads);
+  buffer_limited = buffer_blocks > 0;
+  if (buffer_limited) {
+    buffer_blocks = max(buffer_blocks, 2u);
+    // Threads beyond the number of blocks that can be in flight would only
+    // sit on their output buffers.
+    num_threads = min(num_threads, buffer_blocks - 1);
+    active_threads = min(active_threads, num_threads);
+  } else {
+    buffer_blocks = num_threads + 2;
+  }
   threads.resize(num_threads);
   thread_pos.resize(num_threads);
-  buffer.resize(block_size * (num_threads + 2));
+  thread_has_offset.resize(num_threads);
+  buffer.resize((size_t)block_size * buffer_blocks);
   pthread_mutex_init(&mutex, nullptr);
   pthread_cond_init(&cond, nullptr);
 
+  adapt_start_time = monotonic_now_sec();
+  producer_stall_time = 0;
+  compress_time = 0;
+  adapt_blocks = 0;
   for (uint32_t i = 0; i < num_threads; ++i) {
     thread_pos[i] = UINT64_MAX;
+    thread_has_offset[i] = false;
   }
   next_thread_pos = 0;
   next_thread_end_pos = 0;
   closing = false;
   write_error = false;
+  producer_waiting = false;
+  next_block_offset = 0;
+  codecs_written = 0;
+  dictionary_done = false;
+  dictionary = nullptr;
 
   producer_reserved_pos = 0;
   producer_reserved_write_pos = 0;
@@ -90,6 +194,9 @@ CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
 
 CompressedWriter::~CompressedWriter() {
   close();
+#ifdef ZSTD
+  ZSTD_freeCDict(dictionary);
+#endif
   pthread_mutex_destroy(&mutex);
   pthread_cond_destroy(&cond);
 }
@@ -118,6 +225,36 @@ void CompressedWriter::write(const void* data, size_t size) {
   }
 }
 
+uint8_t* CompressedWriter::get_write_buffer(size_t* size) {
+  while (!error &&
+         producer_reserved_upto_pos == producer_reserved_write_pos) {
+    update_reservation(WAIT);
+  }
+  if (error) {
+    // Whatever gets written will be dropped, like in write().
+    static uint8_t discard[4096];
+    *size = sizeof(discard);
+    return discard;
+  }
+  size_t buf_offset = (size_t)(producer_reserved_write_pos % buffer.size());
+  *size = min(buffer.size() - buf_offset,
+              (size_t)(producer_reserved_upto_pos -
+                       producer_reserved_write_pos));
+  return &buffer[buf_offset];
+}
+
+void CompressedWriter::commit_write(size_t size) {
+  if (error) {
+    return;
+  }
+  DEBUG_ASSERT(size <= producer_reserved_upto_pos - producer_reserved_write_pos);
+  producer_reserved_write_pos += size;
+  if (producer_reserved_write_pos - producer_reserved_pos >=
+      buffer.size() / 2) {
+    update_reservation(NOWAIT);
+  }
+}
+
 void CompressedWriter::update_reservation(WaitFlag wait_flag) {
   pthread_mutex_lock(&mutex);
 
@@ -127,6 +264,7 @@ void CompressedWriter::update_reservation(WaitFlag wait_flag) {
   // Wake up threads that might be waiting to consume data.
   pthread_cond_broadcast(&cond);
 
+  double stall_start = 0;
   while (!error) {
     if (write_error) {
       error = true;
@@ -143,10 +281,56 @@ void CompressedWriter::update_reservation(WaitFlag wait_flag) {
       break;
     }
 
+    if (!stall_start) {
+      stall_start = monotonic_now_sec();
+      ++stats_.producer_stalls;
+      producer_waiting = true;
+      // Threads may store blocks uncompressed for us now.
+      pthread_cond_broadcast(&cond);
+    }
     pthread_cond_wait(&cond, &mutex);
   }
+  if (stall_start) {
+    producer_waiting = false;
+    double stall = monotonic_now_sec() - stall_start;
+    producer_stall_time += stall;
+    stats_.producer_stall_time += stall;
+  }
+  maybe_adapt_threads();
+
+  pthread_mutex_unlock(&mutex);
+}
 
+CompressedWriter::Stats CompressedWriter::stats() {
+  pthread_mutex_lock(&mutex);
+  Stats ret = stats_;
   pthread_mutex_unlock(&mutex);
+  return ret;
+}
+
+// Called with 'mutex' held.
+void CompressedWriter::maybe_adapt_threads() {
+  if (threads.size() <= 1 || adapt_blocks < ADAPT_INTERVAL_BLOCKS) {
+    return;
+  }
+  double now = monotonic_now_sec();
+  double elapsed = now - adapt_start_time;
+  if (producer_stall_time > elapsed * 0.05) {
+    // The producer (i.e. the tracees) spent more than 5% of the time
+    // waiting for us.
+    if (active_threads < threads.size()) {
+      ++active_threads;
+      pthread_cond_broadcast(&cond);
+    }
+  } else if (producer_stall_time == 0 && active_threads > 1 &&
+             compress_time < elapsed * (active_threads - 1) * 0.5) {
+    // One fewer thread would still be less than half busy.
+    --active_threads;
+  }
+  adapt_start_time = now;
+  producer_stall_time = 0;
+  compress_time = 0;
+  adapt_blocks = 0;
 }
 
 void CompressedWriter::compression_thread() {
@@ -157,37 +341,95 @@ void CompressedWriter::compression_thread() {
   for (thread_index = 0; threads[thread_index] != self; ++thread_index) {
   }
 
-  // Add slop for incompressible data
+  // Allocated when we first get a block, since threads beyond
+  // active_threads may never get one.
   vector<uint8_t> outputbuf;
-  outputbuf.resize((size_t)(block_size * 1.1) + sizeof(BlockHeader));
-  BlockHeader* header = reinterpret_cast<BlockHeader*>(&outputbuf[0]);
+  BlockHeader* header = nullptr;
 
   while (true) {
-    if (!write_error && next_thread_pos < next_thread_end_pos &&
+    if (!write_error && (uint32_t)thread_index < active_threads &&
+        next_thread_pos < next_thread_end_pos &&
         (closing || next_thread_pos + block_size <= next_thread_end_pos)) {
+      if (!header) {
+        // Add slop for incompressible data
+        outputbuf.resize((size_t)(block_size * 1.1) + sizeof(BlockHeader));
+        header = reinterpret_cast<BlockHeader*>(&outputbuf[0]);
+      }
       thread_pos[thread_index] = next_thread_pos;
       next_thread_pos = min(next_thread_end_pos, next_thread_pos + block_size);
       // header->uncompressed_length must be <= block_size,
       // therefore fits in a size_t.
       header->uncompressed_length =
           (size_t)(next_thread_pos - thread_pos[thread_index]);
+      bool first_block = thread_pos[thread_index] == 0;
+      Codec block_codec = codec_;
+      const ZSTD_CDict_s* block_dictionary = nullptr;
+      if (use_dictionary && !first_block) {
+        // The thread compressing the first block doesn't wait for anything
+        // before creating the dictionary.
+        while (!dictionary_done) {
+          pthread_cond_wait(&cond, &mutex);
+        }
+        if (dictionary) {
+          block_codec = CODEC_ZSTD_DICT;
+          block_dictionary = dictionary;
+        }
+      }
+      // With a capped buffer, the tracees stall as soon as we fall behind.
+      // Storing the block takes almost no CPU; 'rr pack' compresses it
+      // later. The first block is never stored since it may hold the
+      // dictionary.
+      bool store = buffer_limited && producer_waiting && !first_block &&
+                   codec_ != CODEC_NONE;
+      if (store) {
+        block_codec = CODEC_NONE;
+        ++stats_.stored_blocks;
+      }
 
       pthread_mutex_unlock(&mutex);
-      header->compressed_length =
-          do_compress(thread_pos[thread_index], header->uncompressed_length,
-                      &outputbuf[sizeof(BlockHeader)],
-                      outputbuf.size() - sizeof(BlockHeader));
+      double compress_start = monotonic_now_sec();
+      ZSTD_CDict_s* new_dictionary = nullptr;
+      {
+        ScopedSpan span("CompressedWriter::compress");
+        size_t output_size = outputbuf.size() - sizeof(BlockHeader);
+        header->set(block_codec,
+                    store ? do_store(thread_pos[thread_index],
+                                     header->uncompressed_length,
+                                     &outputbuf[sizeof(BlockHeader)],
+                                     output_size)
+                          : do_compress(thread_pos[thread_index],
+                                        header->uncompressed_length,
+                                        &outputbuf[sizeof(BlockHeader)],
+                                        output_size, block_dictionary));
+        if (use_dictionary && first_block) {
+          // The block is still reserved, so its data is still in 'buffer'.
+          new_dictionary = create_dictionary(header->uncompressed_length);
+        }
+      }
+      double compress_end = monotonic_now_sec();
       pthread_mutex_lock(&mutex);
+      if (use_dictionary && first_block) {
+        dictionary = new_dictionary;
+        dictionary_done = true;
+        pthread_cond_broadcast(&cond);
+      }
+      compress_time += compress_end - compress_start;
+      ++adapt_blocks;
+      stats_.compress_time += compress_end - compress_start;
+      stats_.bytes_in += header->uncompressed_length;
 
-      if (header->compressed_length == 0) {
+      if (header->compressed_length() == 0) {
         write_error = true;
       }
 
-      // wait until we're the next thread that needs to write
+      // Wait until all earlier blocks have been given their file offsets.
+      // We don't wait for them to be written: each thread pwrites its block
+      // at its own offset, so a slow write doesn't hold up later blocks.
       while (!write_error) {
         bool other_thread_write_first = false;
         for (uint32_t i = 0; i < thread_pos.size(); ++i) {
-          if (thread_pos[i] < thread_pos[thread_index]) {
+          if (thread_pos[i] < thread_pos[thread_index] &&
+              !thread_has_offset[i]) {
             other_thread_write_first = true;
           }
         }
@@ -198,13 +440,36 @@ void CompressedWriter::compression_thread() {
       }
 
       if (!write_error) {
+        size_t size = sizeof(BlockHeader) + header->compressed_length();
+        uint64_t offset = next_block_offset;
+        // All earlier blocks have offsets, so blocks are recorded in stream
+        // order.
+        block_offsets_.push_back(offset);
+        next_block_offset += size;
+        thread_has_offset[thread_index] = true;
+        pthread_cond_broadcast(&cond);
         pthread_mutex_unlock(&mutex);
-        write_all(fd, &outputbuf[0],
-                  sizeof(BlockHeader) + header->compressed_length);
+        double write_start = monotonic_now_sec();
+        {
+          ScopedSpan span("CompressedWriter::write");
+          if (pwrite_all_fallible(fd, &outputbuf[0], size, offset) !=
+              (ssize_t)size) {
+            FATAL() << "Can't write " << size << " bytes";
+          }
+        }
+        double write_end = monotonic_now_sec();
+        if (uploader) {
+          uploader->upload(upload_name, offset, size, fd);
+        }
         pthread_mutex_lock(&mutex);
+        stats_.write_time += write_end - write_start;
+        stats_.bytes_out += size;
+        ++stats_.blocks;
+        codecs_written |= 1u << header->codec();
       }
 
       thread_pos[thread_index] = UINT64_MAX;
+      thread_has_offset[thread_index] = false;
       // do a broadcast because we might need to unblock
       // the producer thread or a compressor thread waiting
       // for us to write.
@@ -222,6 +487,33 @@ void CompressedWriter::compression_thread() {
   pthread_mutex_unlock(&mutex);
 }
 
+void CompressedWriter::set_uploader(TraceUploader* uploader,
+                                    const string& name) {
+  this->uploader = uploader;
+  upload_name = name;
+}
+
+void CompressedWriter::enable_dictionary() {
+#ifdef ZSTD
+  DEBUG_ASSERT(producer_reserved_write_pos == 0);
+  use_dictionary = codec_ == CODEC_ZSTD;
+#endif
+}
+
+void CompressedWriter::set_thread_affinity(const cpu_set_t& cpus) {
+  if (!fd.is_open()) {
+    // The threads have been joined.
+    return;
+  }
+  for (auto& thread : threads) {
+    int err = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+    if (err) {
+      LOG(debug) << "Can't set compression thread affinity: "
+                 << errno_name(err);
+    }
+  }
+}
+
 void CompressedWriter::close(Sync sync) {
   if (!fd.is_open()) {
     return;
@@ -252,12 +544,30 @@ void CompressedWriter::close(Sync sync) {
 }
 
 size_t CompressedWriter::do_compress(uint64_t offset, size_t length,
-                                     uint8_t* outputbuf, size_t outputbuf_len) {
+                                     uint8_t* outputbuf, size_t outputbuf_len,
+                                     const ZSTD_CDict_s* dictionary) {
+  switch (codec_) {
+    case CODEC_BROTLI:
+      return do_compress_brotli(offset, length, outputbuf, outputbuf_len);
+    case CODEC_ZSTD:
+      return do_compress_zstd(offset, length, outputbuf, outputbuf_len,
+                              dictionary);
+    case CODEC_NONE:
+      return do_store(offset, length, outputbuf, outputbuf_len);
+    default:
+      DEBUG_ASSERT(0 && "Unknown codec");
+      return 0;
+  }
+}
+
+size_t CompressedWriter::do_compress_brotli(uint64_t offset, size_t length,
+                                            uint8_t* outputbuf,
+                                            size_t outputbuf_len) {
   BrotliEncoderState* state = BrotliEncoderCreateInstance(NULL, NULL, NULL);
   if (!state) {
     DEBUG_ASSERT(0 && "BrotliEncoderCreateInstance failed");
   }
-  if (!BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, BROTLI_LEVEL)) {
+  if (!BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, level_)) {
     DEBUG_ASSERT(0 && "Brotli initialization failed");
   }
 
@@ -284,4 +594,95 @@ size_t CompressedWriter::do_compress(uint64_t offset, size_t length,
   return ret;
 }
 
+#ifdef ZSTD
+size_t CompressedWriter::do_compress_zstd(uint64_t offset, size_t length,
+                                          uint8_t* outputbuf,
+                                          size_t outputbuf_len,
+                                          const ZSTD_CDict_s* dictionary) {
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  if (!cctx) {
+    DEBUG_ASSERT(0 && "ZSTD_createCCtx failed");
+  }
+  if (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                                          level_)) ||
+      ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(cctx, length)) ||
+      (dictionary && ZSTD_isError(ZSTD_CCtx_refCDict(cctx, dictionary)))) {
+    DEBUG_ASSERT(0 && "zstd initialization failed");
+  }
+
+  ZSTD_outBuffer out = { outputbuf, outputbuf_len, 0 };
+  // The block may wrap around the end of our ring buffer, so feed it in
+  // at most two pieces.
+  while (length > 0) {
+    size_t buf_offset = (size_t)(offset % buffer.size());
+    size_t amount = min(length, buffer.size() - buf_offset);
+    ZSTD_inBuffer in = { &buffer[buf_offset], amount, 0 };
+    while (in.pos < in.size) {
+      size_t r = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_continue);
+      if (ZSTD_isError(r) || out.pos == out.size) {
+        ZSTD_freeCCtx(cctx);
+        return 0;
+      }
+    }
+    offset += amount;
+    length -= amount;
+  }
+  ZSTD_inBuffer empty = { nullptr, 0, 0 };
+  while (true) {
+    size_t remaining = ZSTD_compressStream2(cctx, &out, &empty, ZSTD_e_end);
+    if (ZSTD_isError(remaining)) {
+      ZSTD_freeCCtx(cctx);
+      return 0;
+    }
+    if (remaining == 0) {
+      break;
+    }
+    if (out.pos == out.size) {
+      ZSTD_freeCCtx(cctx);
+      return 0;
+    }
+  }
+
+  ZSTD_freeCCtx(cctx);
+  return out.pos;
+}
+
+// The dictionary is the last DICTIONARY_SIZE bytes of the first block;
+// CompressedReader rebuilds it the same way. Returns null if zstd can't
+// make a dictionary of them, in which case later blocks are plain
+// CODEC_ZSTD.
+ZSTD_CDict_s* CompressedWriter::create_dictionary(size_t first_block_length) {
+  size_t size = min(first_block_length, DICTIONARY_SIZE);
+  ZSTD_CDict* ret = ZSTD_createCDict(&buffer[first_block_length - size],
+                                     size, level_);
+  if (!ret) {
+    LOG(warn) << "Can't create zstd dictionary";
+  }
+  return ret;
+}
+#else
+size_t CompressedWriter::do_compress_zstd(uint64_t, size_t, uint8_t*,
+                                          size_t, const ZSTD_CDict_s*) {
+  DEBUG_ASSERT(0 && "rr was built without zstd support");
+  return 0;
+}
+
+ZSTD_CDict_s* CompressedWriter::create_dictionary(size_t) { return nullptr; }
+#endif
+
+size_t CompressedWriter::do_store(uint64_t offset, size_t length,
+                                  uint8_t* outputbuf, size_t outputbuf_len) {
+  DEBUG_ASSERT(length <= outputbuf_len);
+  size_t ret = length;
+  while (length > 0) {
+    size_t buf_offset = (size_t)(offset % buffer.size());
+    size_t amount = min(length, buffer.size() - buf_offset);
+    memcpy(outputbuf, &buffer[buf_offset], amount);
+    outputbuf += amount;
+    offset += amount;
+    length -= amount;
+  }
+  return ret;
+}
+
 } // namespace rr
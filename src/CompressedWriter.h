@@ -4,6 +4,7 @@
 #define RR_COMPRESSED_WRITER_H_
 
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 
 #include <memory>
@@ -12,8 +13,12 @@
 
 #include "ScopedFd.h"
 
+struct ZSTD_CDict_s;
+
 namespace rr {
 
+class TraceUploader;
+
 /**
  * CompressedWriter opens an output file and writes compressed blocks to it.
  * Blocks of a fixed but unspecified size (currently 1MB) are compressed.
@@ -22,43 +27,198 @@ namespace rr {
  * and the size of the uncompressed data, in that order. See BlockHeader below.
  *
  * We use multiple threads to perform compression. The threads are
- * responsible for the actual data writes. The thread that creates the
+ * responsible for the actual data writes. Blocks are assigned file offsets
+ * in stream order as soon as they're compressed, then written concurrently
+ * with pwrite. The thread that creates the
  * CompressedWriter is the "producer" thread and must also be the caller of
  * 'write'. The producer thread may block in 'write' if 'buffer_size' bytes are
  * being compressed.
  *
- * Each data block is compressed independently using zlib.
+ * If 'max_threads' is larger than 'num_threads', the number of threads
+ * actually compressing adapts to the load: it grows (up to 'max_threads')
+ * while the producer is stalled waiting for buffer space and shrinks while
+ * the threads are mostly idle. The block size is fixed, since the block
+ * index and 'rr pack' rely on blocks starting at multiples of it.
+ *
+ * By default the buffer holds 'max_threads' + 2 blocks. A nonzero
+ * 'buffer_blocks' caps it (and the number of threads) instead, and while
+ * the producer is stalled on a capped buffer, blocks are stored
+ * uncompressed (CODEC_NONE) so the tracees aren't held up by compression.
+ *
+ * Each data block is compressed independently using the writer's Codec.
+ * The codec is recorded in the top bits of the block header's
+ * compressed-length word so readers can decode blocks from writers with
+ * different codecs.
+ *
+ * With enable_dictionary(), zstd blocks after the first are compressed
+ * against a dictionary made from the tail of the first block, so streams of
+ * small, repetitive records don't start every block from an empty context.
+ * The first block is an ordinary CODEC_ZSTD block, so the dictionary needs
+ * no separate storage: readers rebuild it from the file.
  */
 class CompressedWriter {
 public:
+  /**
+   * Never renumber these; the value is stored in every block header.
+   * Blocks written before codecs were selectable have CODEC_BROTLI (0).
+   * CODEC_NONE blocks are stored uncompressed; 'rr pack' recompresses them.
+   * CODEC_ZSTD_DICT blocks are zstd-compressed with the file's dictionary
+   * (see enable_dictionary()).
+   */
+  enum Codec {
+    CODEC_BROTLI = 0,
+    CODEC_ZSTD = 1,
+    CODEC_NONE = 2,
+    CODEC_ZSTD_DICT = 3,
+    CODEC_COUNT
+  };
+  // Maximum number of bytes at the end of the first block that form the
+  // dictionary for CODEC_ZSTD_DICT blocks.
+  static const size_t DICTIONARY_SIZE = 64 * 1024;
+  // Pass as 'level' to use the codec's default level.
+  static const int DEFAULT_LEVEL = -1;
+
   CompressedWriter(const std::string& filename, size_t buffer_size,
-                   uint32_t num_threads);
+                   uint32_t num_threads, Codec codec = CODEC_BROTLI,
+                   int level = DEFAULT_LEVEL, uint32_t max_threads = 0,
+                   uint32_t buffer_blocks = 0);
   ~CompressedWriter();
   // Call only on producer thread
   bool good() const { return !error; }
   // Call only on producer thread.
   void write(const void* data, size_t size);
+  /**
+   * Return contiguous buffer space for the next bytes written, and set
+   * |*size| to its size (never 0). Waits for space if there isn't any.
+   * Bytes placed there must then be committed with commit_write(). Lets a
+   * serializer write straight into our buffer. Call only on producer
+   * thread.
+   */
+  uint8_t* get_write_buffer(size_t* size);
+  void commit_write(size_t size);
   enum Sync { DONT_SYNC, SYNC };
   // Call only on producer thread
   void close(Sync sync = DONT_SYNC);
 
+  /**
+   * Queue each block with |uploader| as |name| once it's written, and let
+   * the uploader deallocate it locally after sending it. Call only on the
+   * producer thread, before the first write().
+   */
+  void set_uploader(TraceUploader* uploader, const std::string& name);
+  /**
+   * Move the compression threads to |cpus|. Call only on the producer
+   * thread.
+   */
+  void set_thread_affinity(const cpu_set_t& cpus);
+  /**
+   * Compress every block after the first with the first block's dictionary.
+   * Only has an effect with CODEC_ZSTD. Call only on the producer thread,
+   * before the first write().
+   */
+  void enable_dictionary();
+  bool dictionary_enabled() const { return use_dictionary; }
+
+  Codec codec() const { return codec_; }
+  int level() const { return level_; }
+  // Call only on producer thread. Total number of bytes passed to write().
+  uint64_t uncompressed_pos() const { return producer_reserved_write_pos; }
+  /**
+   * File offset of each block written, in order. Block i holds uncompressed
+   * bytes [i*block_size, (i+1)*block_size). Only valid after close().
+   */
+  const std::vector<uint64_t>& block_offsets() const { return block_offsets_; }
+  /**
+   * Whether any block written used |codec|. Blocks can use other codecs
+   * than codec(): stored blocks are CODEC_NONE and dictionary blocks are
+   * CODEC_ZSTD_DICT. Only valid after close().
+   */
+  bool wrote_codec(Codec codec) const {
+    return (codecs_written & (1u << codec)) != 0;
+  }
+
+  struct Stats {
+    Stats()
+        : bytes_in(0),
+          bytes_out(0),
+          blocks(0),
+          producer_stalls(0),
+          stored_blocks(0),
+          producer_stall_time(0),
+          compress_time(0),
+          write_time(0) {}
+    // Uncompressed bytes in the blocks compressed so far
+    uint64_t bytes_in;
+    // Bytes written to the file, including block headers
+    uint64_t bytes_out;
+    uint64_t blocks;
+    // Number of times the producer had to wait for buffer space
+    uint64_t producer_stalls;
+    // Blocks stored uncompressed because the producer was stalled
+    uint64_t stored_blocks;
+    // Seconds the producer spent waiting for buffer space
+    double producer_stall_time;
+    // Seconds spent in do_compress and in writing, summed over all threads
+    double compress_time;
+    double write_time;
+  };
+  // Call only on producer thread
+  Stats stats();
+
+  static const char* codec_name(Codec codec);
+  // Returns false if 'name' isn't a codec supported by this build.
+  static bool parse_codec(const std::string& name, Codec* codec);
+  // Returns false if 'level' isn't valid for 'codec'.
+  static bool valid_level(Codec codec, int level);
+
   struct BlockHeader {
-    uint32_t compressed_length;
+    static const int CODEC_SHIFT = 28;
+    static const uint32_t LENGTH_MASK = (1u << CODEC_SHIFT) - 1;
+
+    BlockHeader() : compressed_length_and_codec(0), uncompressed_length(0) {}
+
+    uint32_t compressed_length() const {
+      return compressed_length_and_codec & LENGTH_MASK;
+    }
+    Codec codec() const {
+      return (Codec)(compressed_length_and_codec >> CODEC_SHIFT);
+    }
+    void set(Codec codec, uint32_t compressed_length) {
+      compressed_length_and_codec =
+          ((uint32_t)codec << CODEC_SHIFT) | compressed_length;
+    }
+
+    uint32_t compressed_length_and_codec;
     uint32_t uncompressed_length;
   };
 
 protected:
   enum WaitFlag { WAIT, NOWAIT };
   void update_reservation(WaitFlag wait_flag);
+  void maybe_adapt_threads();
 
   static void* compression_thread_callback(void* p);
   void compression_thread();
   size_t do_compress(uint64_t offset, size_t length, uint8_t* outputbuf,
-                     size_t outputbuf_len);
+                     size_t outputbuf_len, const ZSTD_CDict_s* dictionary);
+  size_t do_compress_brotli(uint64_t offset, size_t length,
+                            uint8_t* outputbuf, size_t outputbuf_len);
+  size_t do_compress_zstd(uint64_t offset, size_t length, uint8_t* outputbuf,
+                          size_t outputbuf_len,
+                          const ZSTD_CDict_s* dictionary);
+  ZSTD_CDict_s* create_dictionary(size_t first_block_length);
+  size_t do_store(uint64_t offset, size_t length, uint8_t* outputbuf,
+                  size_t outputbuf_len);
 
   // Immutable while threads are running
   ScopedFd fd;
+  TraceUploader* uploader;
+  std::string upload_name;
   int block_size;
+  Codec codec_;
+  int level_;
+  bool use_dictionary;
+  bool buffer_limited;
   pthread_mutex_t mutex;
   pthread_cond_t cond;
   std::vector<pthread_t> threads;
@@ -70,12 +230,34 @@ protected:
   /* position in output stream that this thread is currently working on,
    * or UINT64_MAX if it's idle */
   std::vector<uint64_t> thread_pos;
+  /* true if the block this thread is working on has been assigned its
+   * file offset (and is being written) */
+  std::vector<bool> thread_has_offset;
   /* position in output stream of data to dispatch to next thread */
   uint64_t next_thread_pos;
   /* position in output stream of end of data ready to dispatch */
   uint64_t next_thread_end_pos;
   bool closing;
   bool write_error;
+  /* true while the producer is waiting for buffer space */
+  bool producer_waiting;
+  /* threads with index >= this don't take new blocks */
+  uint32_t active_threads;
+  /* stats since the last maybe_adapt_threads() decision */
+  double adapt_start_time;
+  double producer_stall_time;
+  double compress_time;
+  uint32_t adapt_blocks;
+  /* file offset at which the next block will be written */
+  uint64_t next_block_offset;
+  std::vector<uint64_t> block_offsets_;
+  /* bit (1 << codec) is set for each codec a written block used */
+  uint32_t codecs_written;
+  Stats stats_;
+  /* set once the first block's dictionary has been created (or couldn't
+   * be); 'dictionary' is immutable after that */
+  bool dictionary_done;
+  ZSTD_CDict_s* dictionary;
   // END protected by 'mutex'
 
   /* producer thread only */
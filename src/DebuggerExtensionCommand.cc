@@ -2,7 +2,14 @@
 
 #include "DebuggerExtensionCommand.h"
 
+#include <algorithm>
+#include <unordered_map>
+
+#include "preload/preload_interface.h"
+
 #include "ReplayTask.h"
+#include "core_dump.h"
+#include "kernel_metadata.h"
 #include "log.h"
 
 using namespace std;
@@ -187,6 +194,422 @@ static SimpleDebuggerExtensionCommand info_checkpoints(
   "list all checkpoints created with the 'checkpoint' command",
   invoke_info_checkpoints);
 
+static SimpleDebuggerExtensionCommand breakpoint_stats(
+    "breakpoint-stats",
+    "Print how many breakpoint/watchpoint hits and condition evaluations rr "
+    "has handled.",
+    [](GdbServer& gdb_server, Task*, const vector<string>&) {
+      if (!gdb_server.timeline()) {
+        return string("Command requires a full debugging session.");
+      }
+      const ReplayTimeline::ConditionStatistics& stats =
+          gdb_server.timeline()->condition_statistics();
+      return string("Breakpoint hits: ") + to_string(stats.breakpoint_hits) +
+             "\nWatchpoint hits: " + to_string(stats.watchpoint_hits) +
+             "\nCondition evaluations: " + to_string(stats.evaluations) +
+             "\nHits filtered by conditions: " +
+             to_string(stats.filtered_hits);
+    });
+
+static const size_t max_find_all_results = 10000;
+
+static bool parse_hex_bytes(const string& s, vector<uint8_t>* bytes) {
+  if (s.empty() || s.size() % 2) {
+    return false;
+  }
+  for (size_t i = 0; i < s.size(); i += 2) {
+    string byte = s.substr(i, 2);
+    char* endptr;
+    unsigned long v = strtoul(byte.c_str(), &endptr, 16);
+    if (*endptr || !isxdigit(byte[0])) {
+      return false;
+    }
+    bytes->push_back(v);
+  }
+  return true;
+}
+
+static SimpleDebuggerExtensionCommand find_all(
+    "find-all",
+    "find-all START LENGTH HEXBYTES\n"
+    "Print the address of every occurrence of HEXBYTES (e.g. efbeadde) in\n"
+    "[START, START+LENGTH) of the current process' memory.",
+    [](GdbServer&, Task* t, const vector<string>& args) {
+      if (args.size() != 3) {
+        return string("Usage: find-all START LENGTH HEXBYTES");
+      }
+      char* endptr;
+      uintptr_t start = strtoull(args[0].c_str(), &endptr, 0);
+      if (*endptr) {
+        return string("Invalid start address ") + args[0] + ".";
+      }
+      uintptr_t length = strtoull(args[1].c_str(), &endptr, 0);
+      if (*endptr || start + length < start) {
+        return string("Invalid length ") + args[1] + ".";
+      }
+      vector<uint8_t> find;
+      if (!parse_hex_bytes(args[2], &find)) {
+        return string("Invalid byte string ") + args[2] + ".";
+      }
+      vector<remote_ptr<void>> found;
+      GdbServer::search_memory(t, MemoryRange(start, length), find,
+                               max_find_all_results + 1, &found);
+      stringstream out;
+      for (size_t i = 0; i < found.size() && i < max_find_all_results; ++i) {
+        out << found[i] << "\n";
+      }
+      if (found.size() > max_find_all_results) {
+        out << "Stopped after " << max_find_all_results << " matches.";
+      } else {
+        out << found.size() << " matches.";
+      }
+      return out.str();
+    });
+
+struct RecordedWrite {
+  FrameTime time;
+  pid_t rec_tid;
+  MemoryRange range;
+};
+
+/**
+ * Every memory range rr recorded data for, in trace order. Built on first
+ * use by scanning the trace's data metadata (without reading the data).
+ */
+static const vector<RecordedWrite>& recorded_writes(const TraceReader& trace) {
+  static string index_dir;
+  static vector<RecordedWrite> index;
+  if (index_dir == trace.dir()) {
+    return index;
+  }
+  index.clear();
+  TraceReader reader(trace);
+  reader.rewind();
+  while (!reader.at_end()) {
+    TraceFrame frame = reader.read_frame();
+    while (true) {
+      TraceReader::MappedData data;
+      bool found;
+      reader.read_mapped_region(&data, &found, TraceReader::DONT_VALIDATE);
+      if (!found) {
+        break;
+      }
+    }
+    TraceReader::RawDataMetadata data;
+    while (reader.read_raw_data_metadata_for_frame(data)) {
+      index.push_back({ frame.time(), data.rec_tid,
+                        MemoryRange(data.addr, data.size) });
+    }
+  }
+  index_dir = trace.dir();
+  return index;
+}
+
+static const size_t max_recorded_writes_results = 100;
+
+static SimpleDebuggerExtensionCommand recorded_writes_cmd(
+    "recorded-writes",
+    "recorded-writes START LENGTH\n"
+    "Print the most recent events up to now whose recorded data (e.g. from\n"
+    "read() or ioctl()) overlaps [START, START+LENGTH). Writes made by\n"
+    "syscalls the syscall buffer handled, and by user code, aren't listed.",
+    [](GdbServer&, Task* t, const vector<string>& args) {
+      if (!t->session().is_replaying()) {
+        return DebuggerExtensionCommandHandler::cmd_end_diversion();
+      }
+      if (args.size() != 2) {
+        return string("Usage: recorded-writes START LENGTH");
+      }
+      char* endptr;
+      uintptr_t start = strtoull(args[0].c_str(), &endptr, 0);
+      if (*endptr) {
+        return string("Invalid start address ") + args[0] + ".";
+      }
+      uintptr_t length = strtoull(args[1].c_str(), &endptr, 0);
+      if (*endptr || start + length < start) {
+        return string("Invalid length ") + args[1] + ".";
+      }
+      ReplayTask* replay_t = static_cast<ReplayTask*>(t);
+      MemoryRange range(start, length);
+      FrameTime now = replay_t->current_trace_frame().time();
+      const vector<RecordedWrite>& writes =
+          recorded_writes(replay_t->session().trace_reader());
+      stringstream out;
+      size_t count = 0;
+      for (auto it = writes.rbegin(); it != writes.rend(); ++it) {
+        if (it->time >= now || !it->range.intersects(range)) {
+          continue;
+        }
+        if (count == max_recorded_writes_results) {
+          out << "...\n";
+          break;
+        }
+        out << "event " << it->time << " tid " << it->rec_tid << ": "
+            << it->range << "\n";
+        ++count;
+      }
+      if (!count) {
+        out << "No recorded writes.";
+      }
+      return out.str();
+    });
+
+struct RecordedSyscall {
+  // The event to stop at: the syscall's entry, or for syscalls the syscall
+  // buffer handled, the flush that recorded them.
+  FrameTime time;
+  Ticks ticks;
+  pid_t rec_tid;
+  SupportedArch arch;
+  int number;
+  uintptr_t arg1;
+  intptr_t result;
+  bool buffered;
+};
+
+/**
+ * Every syscall in the trace, sorted by where to stop for it. Built on first
+ * use by one scan of the trace. Buffered syscalls come from the syscall
+ * buffer flush records, which don't record arguments.
+ */
+static const vector<RecordedSyscall>& recorded_syscalls(
+    const TraceReader& trace) {
+  static string index_dir;
+  static vector<RecordedSyscall> index;
+  if (index_dir == trace.dir()) {
+    return index;
+  }
+  index.clear();
+  unordered_map<pid_t, TraceFrame> entries;
+  TraceReader reader(trace);
+  reader.rewind();
+  while (!reader.at_end()) {
+    TraceFrame frame = reader.read_frame();
+    while (true) {
+      TraceReader::MappedData data;
+      bool found;
+      reader.read_mapped_region(&data, &found, TraceReader::DONT_VALIDATE);
+      if (!found) {
+        break;
+      }
+    }
+    const Event& ev = frame.event();
+    if (ev.is_syscall_event()) {
+      const SyscallEvent& syscall = ev.Syscall();
+      if (syscall.state == ENTERING_SYSCALL) {
+        entries[frame.tid()] = frame;
+      } else if (syscall.state == EXITING_SYSCALL) {
+        auto it = entries.find(frame.tid());
+        const TraceFrame& entry = it == entries.end() ? frame : it->second;
+        index.push_back({ entry.time(), entry.ticks(), frame.tid(),
+                          syscall.arch(), syscall.number,
+                          frame.regs().orig_arg1(),
+                          frame.regs().syscall_result_signed(), false });
+        if (it != entries.end()) {
+          entries.erase(it);
+        }
+      }
+    } else if (ev.type() == EV_SYSCALLBUF_FLUSH) {
+      TraceReader::RawData buf;
+      if (reader.read_raw_data_for_frame(buf) &&
+          buf.data.size() >= reader.syscallbuf_hdr_size()) {
+        auto flush_hdr = reinterpret_cast<const syscallbuf_hdr*>(buf.data.data());
+        size_t num_rec_bytes = min<size_t>(
+            flush_hdr->num_rec_bytes,
+            buf.data.size() - reader.syscallbuf_hdr_size());
+        const uint8_t* record_ptr =
+            buf.data.data() + reader.syscallbuf_hdr_size();
+        const uint8_t* end_ptr = record_ptr + num_rec_bytes;
+        while (record_ptr + sizeof(syscallbuf_record) <= end_ptr) {
+          auto record = reinterpret_cast<const syscallbuf_record*>(record_ptr);
+          if (record->size < sizeof(*record)) {
+            break;
+          }
+          // Buffered syscalls always use the task arch
+          index.push_back({ frame.time(), frame.ticks(), frame.tid(),
+                            frame.regs().arch(), (int)record->syscallno, 0,
+                            (intptr_t)record->ret, true });
+          record_ptr += stored_record_size(record->size);
+        }
+      }
+    }
+    TraceReader::RawDataMetadata data;
+    while (reader.read_raw_data_metadata_for_frame(data)) {
+    }
+  }
+  // Unbuffered syscalls are added at their exit but stop at their entry, so
+  // a flush (or another task's syscall) in between puts them out of order.
+  stable_sort(index.begin(), index.end(),
+              [](const RecordedSyscall& a, const RecordedSyscall& b) {
+                return a.time < b.time ||
+                       (a.time == b.time && a.ticks < b.ticks);
+              });
+  index_dir = trace.dir();
+  return index;
+}
+
+static bool syscall_returns_fd(int number, SupportedArch arch) {
+  return is_open_syscall(number, arch) || is_openat_syscall(number, arch) ||
+         is_openat2_syscall(number, arch) || is_creat_syscall(number, arch);
+}
+
+struct SyscallFilter {
+  string name;
+  bool has_fd;
+  int fd;
+
+  SyscallFilter() : has_fd(false), fd(-1) {}
+
+  bool matches(const RecordedSyscall& s) const {
+    if (!name.empty() && syscall_name(s.number, s.arch) != name) {
+      return false;
+    }
+    if (!has_fd) {
+      return true;
+    }
+    if (s.buffered) {
+      return false;
+    }
+    if (syscall_returns_fd(s.number, s.arch)) {
+      return s.result == fd;
+    }
+    return (int)s.arg1 == fd;
+  }
+};
+
+/**
+ * Parse "[NAME [FD]]" into |filter|. Returns an error message, or the
+ * empty string on success.
+ */
+static string parse_syscall_filter(const vector<string>& args,
+                                   SyscallFilter* filter) {
+  if (args.size() > 2) {
+    return "Usage: next-syscall|prev-syscall [NAME [FD]]";
+  }
+  if (args.size() >= 1) {
+    filter->name = args[0];
+  }
+  if (args.size() == 2) {
+    char* endptr;
+    filter->fd = strtol(args[1].c_str(), &endptr, 0);
+    if (args[1].empty() || *endptr) {
+      return string("Invalid fd ") + args[1] + ".";
+    }
+    filter->has_fd = true;
+  }
+  return string();
+}
+
+static string describe_syscall(const RecordedSyscall& s) {
+  stringstream out;
+  out << "event " << s.time << " tid " << s.rec_tid << ": "
+      << syscall_name(s.number, s.arch) << " = " << s.result;
+  if (s.buffered) {
+    out << " (buffered; stopped at the flush that recorded it)";
+  }
+  return out.str();
+}
+
+static string seek_to_syscall(GdbServer& gdb_server, Task* t,
+                              const vector<string>& args, bool forward) {
+  if (!gdb_server.timeline()) {
+    return string("Command requires a full debugging session.");
+  }
+  if (!t->session().is_replaying()) {
+    return DebuggerExtensionCommandHandler::cmd_end_diversion();
+  }
+  SyscallFilter filter;
+  string error = parse_syscall_filter(args, &filter);
+  if (!error.empty()) {
+    return error;
+  }
+  ReplayTask* replay_t = static_cast<ReplayTask*>(t);
+  FrameTime now = replay_t->current_trace_frame().time();
+  const vector<RecordedSyscall>& syscalls =
+      recorded_syscalls(replay_t->session().trace_reader());
+  const RecordedSyscall* found = nullptr;
+  if (forward) {
+    // An index entry for the current event is still ahead of us if its
+    // task hasn't reached the stopping point yet.
+    auto it = lower_bound(syscalls.begin(), syscalls.end(), now,
+                          [](const RecordedSyscall& s, FrameTime time) {
+                            return s.time < time;
+                          });
+    for (; it != syscalls.end(); ++it) {
+      if (it->time == now && (it->rec_tid != replay_t->rec_tid ||
+                              t->tick_count() >= it->ticks)) {
+        continue;
+      }
+      if (filter.matches(*it)) {
+        found = &*it;
+        break;
+      }
+    }
+  } else {
+    auto it = lower_bound(syscalls.begin(), syscalls.end(), now,
+                          [](const RecordedSyscall& s, FrameTime time) {
+                            return s.time < time;
+                          });
+    while (it != syscalls.begin()) {
+      --it;
+      if (filter.matches(*it)) {
+        found = &*it;
+        break;
+      }
+    }
+  }
+  if (!found) {
+    return string("No matching syscall found.");
+  }
+  gdb_server.timeline()->seek_to_ticks(found->time, found->ticks);
+  return describe_syscall(*found);
+}
+
+static SimpleDebuggerExtensionCommand next_syscall(
+    "next-syscall",
+    "next-syscall [NAME [FD]]\n"
+    "Go forward to the entry of the next recorded syscall, optionally only\n"
+    "syscall NAME (e.g. write) and only on FD. FD matches the first\n"
+    "argument, or the result of open(), openat(), openat2() and creat().\n"
+    "Syscalls the syscall buffer handled stop at the event that recorded\n"
+    "them and never match an FD.",
+    [](GdbServer& gdb_server, Task* t, const vector<string>& args) {
+      return seek_to_syscall(gdb_server, t, args, true);
+    });
+
+static SimpleDebuggerExtensionCommand prev_syscall(
+    "prev-syscall",
+    "prev-syscall [NAME [FD]]\n"
+    "Go back to the entry of the previous recorded syscall. Takes the same\n"
+    "arguments as next-syscall.",
+    [](GdbServer& gdb_server, Task* t, const vector<string>& args) {
+      return seek_to_syscall(gdb_server, t, args, false);
+    });
+
+static SimpleDebuggerExtensionCommand dump_core(
+    "dump-core",
+    "dump-core [FILE]\n"
+    "Write an ELF core file for the current process at the current point\n"
+    "to FILE, default core.<PID>. This is much faster than gcore.",
+    [](GdbServer&, Task* t, const vector<string>& args) {
+      if (args.size() > 1) {
+        return string("Usage: dump-core [FILE]");
+      }
+      string path;
+      if (args.empty()) {
+        stringstream name;
+        name << "core." << t->tgid();
+        path = name.str();
+      } else {
+        path = args[0];
+      }
+      string error;
+      if (!write_core_dump(t, path, &error)) {
+        return error + ".";
+      }
+      return "Wrote " + path + ".";
+    });
+
 void DebuggerExtensionCommand::init_auto_args() {
   static __attribute__((unused)) int dummy = []() {
     checkpoint.add_auto_arg("rr-where");
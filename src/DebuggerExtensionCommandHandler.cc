@@ -188,6 +188,16 @@ define hookpost-forward
 maintenance flush register-cache
 frame
 end
+
+define hookpost-next-syscall
+maintenance flush register-cache
+frame
+end
+
+define hookpost-prev-syscall
+maintenance flush register-cache
+frame
+end
 )Delimiter");
 
   return ss.str();
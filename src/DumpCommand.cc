@@ -42,6 +42,8 @@ DumpCommand DumpCommand::singleton(
     "  like `1000-5000', or `end' for the last record in the trace.\n"
     "  By default, all events are dumped.\n"
     "  -b, --syscallbuf           dump syscallbuf contents\n"
+    "  -c, --csv                  dump one CSV row per trace frame, for\n"
+    "                             loading into analysis tools\n"
     "  -e, --task-events          dump task events\n"
     "  -m, --recorded-metadata    dump recorded data metadata\n"
     "  -p, --mmaps                dump mmap data\n"
@@ -59,6 +61,7 @@ static bool parse_dump_arg(vector<string>& args, DumpFlags& flags) {
   static const OptionSpec options[] = {
     { 0, "socket-addresses", NO_PARAMETER },
     { 'b', "syscallbuf", NO_PARAMETER },
+    { 'c', "csv", NO_PARAMETER },
     { 'e', "task-events", NO_PARAMETER },
     { 'm', "recorded-metadata", NO_PARAMETER },
     { 'p', "mmaps", NO_PARAMETER },
@@ -75,6 +78,9 @@ static bool parse_dump_arg(vector<string>& args, DumpFlags& flags) {
     case 'b':
       flags.dump_syscallbuf = true;
       break;
+    case 'c':
+      flags.csv_dump = true;
+      break;
     case 'e':
       flags.dump_task_events = true;
       break;
@@ -235,6 +241,27 @@ static void dump_task_event(FILE* out, const TraceTaskEvent& event) {
   }
 }
 
+static void dump_frame_csv(FILE* out, const TraceFrame& frame) {
+  const Event& ev = frame.event();
+  fprintf(out, "%lld,%d,%s,", (long long)frame.time(), frame.tid(),
+          ev.type_name().c_str());
+  if (ev.is_syscall_event()) {
+    fprintf(out, "%s,%s", ev.Syscall().syscall_name().c_str(),
+            state_name(ev.Syscall().state));
+  } else {
+    fputc(',', out);
+  }
+  fputc(',', out);
+  if (ev.is_signal_event()) {
+    fprintf(out, "%d", ev.Signal().siginfo.si_signo);
+  }
+  fprintf(out, ",%" PRId64 ",", frame.ticks());
+  if (ev.record_regs()) {
+    fprintf(out, "0x%llx", (long long)frame.regs().ip().register_value());
+  }
+  fprintf(out, ",%f\n", frame.monotonic_time());
+}
+
 /**
  * Dump all events from the current to trace that match |spec| to
  * |out|.  |spec| has the following syntax: /\d+(-\d+)?/, expressing
@@ -267,15 +294,44 @@ static void dump_events_matching(TraceReader& trace, const DumpFlags& flags,
 
   bool process_raw_data =
       flags.dump_syscallbuf || flags.dump_recorded_data_metadata;
+  if (only_end) {
+    // Only the last frame matters, so skip straight to the last indexed
+    // block instead of decoding the whole trace.
+    start = trace.last_indexed_frame();
+  }
+  if (start > trace.time() + 1) {
+    trace.seek_to_frame(start);
+  }
+  // With a task index, only decode the blocks that contain frames of the
+  // task we're interested in.
+  vector<pair<FrameTime, FrameTime>> task_blocks;
+  bool use_task_blocks = flags.only_tid && !only_end &&
+      trace.task_frame_ranges(flags.only_tid, task_blocks);
+  auto task_block = task_blocks.begin();
+  TraceFrame frame;
   while (!trace.at_end()) {
-    auto frame = trace.read_frame(start);
+    if (use_task_blocks) {
+      FrameTime next = trace.time() + 1;
+      while (task_block != task_blocks.end() && task_block->second <= next) {
+        ++task_block;
+      }
+      if (task_block == task_blocks.end()) {
+        return;
+      }
+      if (task_block->first > next) {
+        trace.seek_to_frame(task_block->first);
+      }
+    }
+    trace.read_frame(frame, start);
     if (end < frame.time()) {
       return;
     }
     if (only_end ? trace.at_end() :
          (start <= frame.time() && frame.time() <= end &&
            (!flags.only_tid || flags.only_tid == frame.tid()))) {
-      if (flags.raw_dump) {
+      if (flags.csv_dump) {
+        dump_frame_csv(out, frame);
+      } else if (flags.raw_dump) {
         frame.dump_raw(out);
       } else {
         frame.dump(out);
@@ -346,13 +402,16 @@ static void dump_events_matching(TraceReader& trace, const DumpFlags& flags,
             }
             fputs("]", out);
           }
+          if (data.is_ref) {
+            fprintf(out, ", data_pos:%p", (void*)data.ref_pos);
+          }
           fputs(" }\n", out);
         }
       }
       if (flags.dump_socket_addrs) {
         dump_socket_addrs(out, frame);
       }
-      if (!flags.raw_dump) {
+      if (!flags.raw_dump && !flags.csv_dump) {
         fprintf(out, "}\n");
       }
     } else {
@@ -383,7 +442,10 @@ void dump(const string& trace_dir, const DumpFlags& flags,
           const vector<string>& specs, FILE* out) {
   TraceReader trace(trace_dir);
 
-  if (flags.raw_dump) {
+  if (flags.csv_dump) {
+    fprintf(out, "global_time,tid,event,syscall,syscall_state,signo,ticks,ip,"
+                 "real_time\n");
+  } else if (flags.raw_dump) {
     fprintf(out, "global_time tid reason ticks "
                  "hw_interrupts page_faults instructions "
                  "eax ebx ecx edx esi edi ebp orig_eax esp eip eflags\n");
@@ -430,6 +492,16 @@ int DumpCommand::run(vector<string>& args) {
     return 1;
   }
 
+  if (flags.csv_dump &&
+      (flags.raw_dump || flags.dump_syscallbuf ||
+       flags.dump_recorded_data_metadata || flags.dump_mmaps ||
+       flags.dump_task_events || flags.dump_socket_addrs ||
+       flags.dump_statistics)) {
+    fprintf(stderr, "--csv can only be combined with --tid\n");
+    print_help(stderr);
+    return 1;
+  }
+
   dump(trace_dir, flags, args, stdout);
   return 0;
 }
@@ -21,6 +21,7 @@ struct DumpFlags {
   bool dump_mmaps;
   bool dump_task_events;
   bool raw_dump;
+  bool csv_dump;
   bool dump_statistics;
   bool dump_socket_addrs;
   int only_tid;
@@ -31,6 +32,7 @@ struct DumpFlags {
         dump_mmaps(false),
         dump_task_events(false),
         raw_dump(false),
+        csv_dump(false),
         dump_statistics(false),
         dump_socket_addrs(false),
         only_tid(0) {}
@@ -11,6 +11,9 @@
 #include <zstd.h>
 #endif
 
+#include <algorithm>
+#include <map>
+
 #include "log.h"
 #include "util.h"
 
@@ -18,6 +21,25 @@ using namespace std;
 
 namespace rr {
 
+vector<size_t> SymbolTable::find(const char* name) const {
+  if (index.empty()) {
+    index.reserve(symbols.size());
+    for (size_t i = 0; i < symbols.size(); ++i) {
+      const char* n = this->name(i);
+      if (n && *n) {
+        index.insert(make_pair(n, i));
+      }
+    }
+  }
+  vector<size_t> result;
+  auto range = index.equal_range(name);
+  for (auto it = range.first; it != range.second; ++it) {
+    result.push_back(it->second);
+  }
+  sort(result.begin(), result.end());
+  return result;
+}
+
 class ElfReaderImplBase {
 public:
   ElfReaderImplBase(ElfReader& r) : r(r), ok_(false) {}
@@ -35,7 +57,9 @@ public:
 
 protected:
   ElfReader& r;
-  vector<unique_ptr<vector<uint8_t>>> decompressed_sections;
+  // Keyed by section file offset, so each section is only decompressed once
+  // however many times it's asked for.
+  map<uint64_t, unique_ptr<vector<uint8_t>>> decompressed_sections;
   bool ok_;
 };
 
@@ -182,6 +206,11 @@ const vector<uint8_t>* ElfReaderImpl<Arch>::decompress_section(SectionOffsets of
   bool zlib = false;
   __attribute__((unused)) bool zstd = false;
   DEBUG_ASSERT(offsets.compressed);
+  auto cached = decompressed_sections.find(offsets.start);
+  if (cached != decompressed_sections.end()) {
+    return cached->second.get();
+  }
+  uint64_t section_start = offsets.start;
   auto hdr = r.read<typename Arch::ElfChdr>(offsets.start);
   if (!hdr) {
     LOG(warn) << "section at " << offsets.start
@@ -253,8 +282,9 @@ const vector<uint8_t>* ElfReaderImpl<Arch>::decompress_section(SectionOffsets of
     FATAL() << "Unrecognized compression algorithm";
   }
 
-  decompressed_sections.push_back(std::move(v));
-  return decompressed_sections.back().get();
+  auto ret = v.get();
+  decompressed_sections[section_start] = std::move(v);
+  return ret;
 }
 
 template <typename Arch>
@@ -565,6 +595,9 @@ DwarfSpan ElfReader::dwarf_section(const char* name, bool known_to_be_compressed
   offsets.compressed |= known_to_be_compressed;
   if (offsets.start && offsets.compressed) {
     auto decompressed = impl().decompress_section(offsets);
+    if (!decompressed) {
+      return DwarfSpan();
+    }
     return DwarfSpan(decompressed->data(), decompressed->data() + decompressed->size());
   }
   return DwarfSpan(map + offsets.start, map + offsets.end);
@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include "Dwarf.h"
@@ -28,6 +29,12 @@ public:
   }
   uintptr_t addr(size_t i) const { return symbols[i].addr; }
   size_t size() const { return symbols.size(); }
+  /**
+   * Returns the indices of all symbols named |name|, in table order. Builds
+   * a hash index over all the names on first use, so looking up several
+   * names costs one pass over the table instead of one per name.
+   */
+  std::vector<size_t> find(const char* name) const;
 
   struct Symbol {
     Symbol(uintptr_t addr, size_t name_index)
@@ -40,6 +47,35 @@ public:
   // Last character is always null  map = static_cast<uint8_t*>(fd);
 
   std::vector<char> strtab;
+
+private:
+  struct NameHash {
+    size_t operator()(const char* s) const {
+      // FNV-1a
+      size_t h = 14695981039346656037ULL;
+      for (; *s; ++s) {
+        h = (h ^ (uint8_t)*s) * 1099511628211ULL;
+      }
+      return h;
+    }
+  };
+  struct NameEqual {
+    bool operator()(const char* a, const char* b) const {
+      return strcmp(a, b) == 0;
+    }
+  };
+  // Holds pointers into strtab, so it starts out empty in copies.
+  typedef std::unordered_multimap<const char*, size_t, NameHash, NameEqual>
+      NameMap;
+  struct NameIndex : NameMap {
+    NameIndex() {}
+    NameIndex(const NameIndex&) : NameMap() {}
+    NameIndex& operator=(const NameIndex&) {
+      clear();
+      return *this;
+    }
+  };
+  mutable NameIndex index;
 };
 
 class DynamicSection {
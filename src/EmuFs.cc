@@ -3,12 +3,16 @@
 #include "EmuFs.h"
 
 #include <syscall.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/vfs.h>
 #include <linux/fs.h>
+#include <linux/magic.h>
 
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <unordered_set>
 
 #include "AddressSpace.h"
 #include "ReplaySession.h"
@@ -29,8 +33,26 @@ EmuFile::~EmuFile() {
 EmuFile::shr_ptr EmuFile::clone(EmuFs& owner) {
   auto f = EmuFile::create(owner, orig_path.c_str(), device(), inode(), size_);
 
-  // We could try using FICLONE but tmpfs doesn't support that yet so let's just
-  // not bother for now.
+  // EmuFiles are normally memfds, which can't be reflinked. Without memfd
+  // support they are created in tmp_dir(), which may be on a filesystem that
+  // can (e.g. btrfs or XFS); then share the extents copy-on-write so large,
+  // mostly-unwritten shared mappings cost nothing to checkpoint.
+  struct statfs sfs;
+  if (fstatfs(fd(), &sfs) == 0 && sfs.f_type != TMPFS_MAGIC &&
+      sfs.f_type != HUGETLBFS_MAGIC) {
+    if (ioctl(f->fd(), FICLONE, fd().get()) == 0) {
+      return f;
+    }
+    LOG(debug) << "FICLONE failed: " << errno_name(errno);
+  }
+
+  // copy_file_range doesn't work between every pair of files, e.g. tmpfs
+  // files before Linux 5.3, so remember the filesystems it failed on.
+  static unordered_set<dev_t> copy_file_range_unsupported_devs;
+  struct stat st;
+  bool copy_file_range_unsupported =
+      fstat(fd(), &st) == 0 &&
+      copy_file_range_unsupported_devs.count(st.st_dev);
 
   // Avoid copying holes.
   vector<uint8_t> buf;
@@ -47,16 +69,24 @@ EmuFile::shr_ptr EmuFile::clone(EmuFs& owner) {
     uint64_t hole = ret;
     // Copy data
     while (offset < hole) {
-      loff_t off_in = offset;
-      loff_t off_out = offset;
-      ssize_t ncopied = syscall(NativeArch::copy_file_range, file.get(), &off_in,
-                                f->fd().get(), &off_out, hole - offset, 0);
-      if (ncopied >= 0) {
-        if (ncopied == 0) {
-          FATAL() << "Didn't copy anything";
+      if (!copy_file_range_unsupported) {
+        loff_t off_in = offset;
+        loff_t off_out = offset;
+        ssize_t ncopied =
+            syscall(NativeArch::copy_file_range, file.get(), &off_in,
+                    f->fd().get(), &off_out, hole - offset, 0);
+        if (ncopied >= 0) {
+          if (ncopied == 0) {
+            FATAL() << "Didn't copy anything";
+          }
+          offset += ncopied;
+          continue;
+        }
+        LOG(debug) << "copy_file_range failed: " << errno_name(errno);
+        copy_file_range_unsupported = true;
+        if (fstat(fd(), &st) == 0) {
+          copy_file_range_unsupported_devs.insert(st.st_dev);
         }
-        offset += ncopied;
-        continue;
       }
 
       ssize_t amount = min<uint64_t>(hole - offset, 4*1024*1024);
@@ -65,11 +95,30 @@ EmuFile::shr_ptr EmuFile::clone(EmuFs& owner) {
       if (ret <= 0) {
         FATAL() << "Couldn't read all the data";
       }
-      ssize_t written = pwrite_all_fallible(f->fd(), buf.data(), ret, offset);
-      if (written < ret) {
-        FATAL() << "Couldn't write all the data";
+      // The new file is all hole, so pages of zeroes (e.g. space a database
+      // preallocated but never wrote) don't need writing and stay sparse.
+      // Runs of nonzero pages are written together.
+      size_t page = page_size();
+      ssize_t run_start = 0;
+      for (ssize_t done = 0; done < ret;) {
+        ssize_t n = min<ssize_t>(ret - done, page - (offset + done) % page);
+        const uint8_t* p = buf.data() + done;
+        bool zero = !p[0] && !memcmp(p, p + 1, n - 1);
+        if (zero || done + n == ret) {
+          ssize_t run_end = zero ? done : done + n;
+          if (run_end > run_start) {
+            ssize_t written =
+                pwrite_all_fallible(f->fd(), buf.data() + run_start,
+                                    run_end - run_start, offset + run_start);
+            if (written < run_end - run_start) {
+              FATAL() << "Couldn't write all the data";
+            }
+          }
+          run_start = done + n;
+        }
+        done += n;
       }
-      offset += written;
+      offset += ret;
     }
     if (offset < size_) {
       // Look for the end of the hole, if any
@@ -3,6 +3,7 @@
 #include "ExportImportCheckpoints.h"
 
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -13,6 +14,7 @@
 
 #include "log.h"
 #include "main.h"
+#include "StdioMonitor.h"
 #include "WaitManager.h"
 
 using namespace std;
@@ -23,8 +25,7 @@ using namespace std;
 
 namespace rr {
 
-bool parse_export_checkpoints(const string& arg, FrameTime& export_checkpoints_event,
-                              int& export_checkpoints_count, string& export_checkpoints_socket) {
+bool parse_export_checkpoints(const string& arg, ExportCheckpointsSpec& spec) {
   size_t first_comma = arg.find(',');
   if (first_comma == string::npos) {
     fprintf(stderr, "Missing <NUM> parameter for --export-checkpoints");
@@ -37,18 +38,29 @@ bool parse_export_checkpoints(const string& arg, FrameTime& export_checkpoints_e
   }
   char* endptr;
   string event_str = arg.substr(0, first_comma);
-  export_checkpoints_event = strtoul(event_str.c_str(), &endptr, 0);
-  if (*endptr) {
+  spec.event = strtoul(event_str.c_str(), &endptr, 0);
+  if (*endptr || !spec.event) {
     fprintf(stderr, "Invalid <EVENT> for --export-checkpoints: %s\n", event_str.c_str());
     return false;
   }
   string num_str = arg.substr(first_comma + 1, second_comma - (first_comma + 1));
-  export_checkpoints_count = strtoul(num_str.c_str(), &endptr, 0);
+  spec.count = strtoul(num_str.c_str(), &endptr, 0);
   if (*endptr) {
     fprintf(stderr, "Invalid <NUM> for --export-checkpoints: %s\n", num_str.c_str());
     return false;
   }
-  export_checkpoints_socket = arg.substr(second_comma + 1);
+  // The socket file name may contain commas; only a trailing numeric field
+  // is taken as the idle timeout.
+  spec.socket = arg.substr(second_comma + 1);
+  size_t last_comma = spec.socket.rfind(',');
+  if (last_comma != string::npos && last_comma + 1 < spec.socket.size()) {
+    string idle_str = spec.socket.substr(last_comma + 1);
+    long idle = strtol(idle_str.c_str(), &endptr, 10);
+    if (!*endptr && idle >= 0 && idle <= INT32_MAX) {
+      spec.idle_seconds = idle;
+      spec.socket.resize(last_comma);
+    }
+  }
   return true;
 }
 
@@ -74,7 +86,7 @@ ScopedFd bind_export_checkpoints_socket(int count, const string& socket_file_nam
   if (ret < 0) {
     FATAL() << "Can't bind Unix socket " << socket_file_name;
   }
-  ret = listen(sock, count);
+  ret = listen(sock, count ? count : SOMAXCONN);
   if (ret < 0) {
     FATAL() << "Can't listen on Unix socket " << socket_file_name;
   }
@@ -144,8 +156,74 @@ static void set_title(const vector<string>& args) {
   memset(arg0 + line.size(), 0, space - line.size());
 }
 
-CommandForCheckpoint export_checkpoints(ReplaySession::shr_ptr session, int count, ScopedFd& sock,
-    const std::string&) {
+ReplaySession::shr_ptr fork_checkpoint(ReplaySession& session, pid_t* child,
+                                       const std::function<void()>& in_child) {
+  ReplaySession::shr_ptr checkpoint = session.clone();
+  int parent_to_child_fds[2];
+  int ret = pipe(parent_to_child_fds);
+  if (ret < 0) {
+    FATAL() << "Can't pipe";
+  }
+  ScopedFd parent_to_child_read(parent_to_child_fds[0]);
+  ScopedFd parent_to_child_write(parent_to_child_fds[1]);
+
+  checkpoint->prepare_to_detach_tasks();
+
+  // We need to create a new control socket for the child, we can't use the shared control socket
+  // safely in multiple processes.
+  int sockets[2];
+  ret = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets);
+  if (ret < 0) {
+    FATAL() << "socketpair failed";
+  }
+  ScopedFd new_tracee_socket(sockets[0]);
+  ScopedFd new_tracee_socket_receiver(sockets[1]);
+
+  // Don't have the child echo our pending output too.
+  StdioMonitor::flush_echoed_output();
+  *child = fork();
+  if (!*child) {
+    session.forget_tasks();
+    if (in_child) {
+      in_child();
+    }
+    char ch;
+    ret = read(parent_to_child_read, &ch, 1);
+    if (ret != 1) {
+      FATAL() << "Failed to read parent notification";
+    }
+    checkpoint->reattach_tasks(std::move(new_tracee_socket),
+                               std::move(new_tracee_socket_receiver));
+    return checkpoint;
+  }
+  checkpoint->detach_tasks(*child, new_tracee_socket_receiver);
+  ret = write(parent_to_child_write, "x", 1);
+  if (ret != 1) {
+    FATAL() << "Failed to write parent notification";
+  }
+  return nullptr;
+}
+
+// Reap the children that have finished, without blocking.
+static void reap_exited_children(vector<pid_t>& children) {
+  for (size_t i = 0; i < children.size();) {
+    WaitOptions options(children[i]);
+    options.block_seconds = 0;
+    WaitResult result = WaitManager::wait_exit(options);
+    if (result.code == WAIT_NO_STATUS) {
+      ++i;
+      continue;
+    }
+    if (result.code != WAIT_OK) {
+      FATAL() << "Failed to wait for child " << children[i];
+    }
+    children.erase(children.begin() + i);
+  }
+}
+
+CommandForCheckpoint export_checkpoints(ReplaySession::shr_ptr session,
+                                        const ExportCheckpointsSpec& spec,
+                                        ScopedFd& sock) {
   if (!session->can_clone()) {
     FATAL() << "Can't create checkpoints at this time, aborting: " << session->current_frame_time();
   }
@@ -153,7 +231,25 @@ CommandForCheckpoint export_checkpoints(ReplaySession::shr_ptr session, int coun
   CommandForCheckpoint command_for_checkpoint;
 
   vector<pid_t> children;
-  for (int i = 0; i < count; ++i) {
+  for (int i = 0; !spec.count || i < spec.count; ++i) {
+    if (spec.idle_seconds) {
+      pollfd pfd = { sock, POLLIN, 0 };
+      int ret = poll(&pfd, 1, spec.idle_seconds * 1000);
+      if (ret < 0 && errno != EINTR) {
+        FATAL() << "Failed to poll checkpoints socket";
+      }
+      if (ret == 0) {
+        LOG(info) << "No connection for " << spec.idle_seconds
+                  << "s; releasing checkpoint at event " << spec.event;
+        break;
+      }
+      if (ret < 0) {
+        --i;
+        continue;
+      }
+    }
+    reap_exited_children(children);
+
     ScopedFd client = ScopedFd(accept4(sock, nullptr, nullptr, SOCK_CLOEXEC));
     if (!client.is_open()) {
       FATAL() << "Failed to accept client connection";
@@ -209,56 +305,24 @@ CommandForCheckpoint export_checkpoints(ReplaySession::shr_ptr session, int coun
       args.push_back(string(arg.data(), arg.size()));
     }
 
-    ReplaySession::shr_ptr checkpoint = session->clone();
-    int parent_to_child_fds[2];
-    ret = pipe(parent_to_child_fds);
-    if (ret < 0) {
-      FATAL() << "Can't pipe";
-    }
-    ScopedFd parent_to_child_read(parent_to_child_fds[0]);
-    ScopedFd parent_to_child_write(parent_to_child_fds[1]);
-
-    checkpoint->prepare_to_detach_tasks();
-
-    // We need to create a new control socket for the child, we can't use the shared control socket
-    // safely in multiple processes.
-    int sockets[2];
-    ret = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets);
-    if (ret < 0) {
-      FATAL() << "socketpair failed";
-    }
-    ScopedFd new_tracee_socket(sockets[0]);
-    ScopedFd new_tracee_socket_receiver(sockets[1]);
-
-    pid_t child = fork();
-    if (!child) {
+    pid_t child;
+    ReplaySession::shr_ptr checkpoint = fork_checkpoint(*session, &child, [&]() {
       set_title(args);
-      session->forget_tasks();
+      setup_child_fds(fds_data, command_for_checkpoint);
+    });
+    if (checkpoint) {
       command_for_checkpoint.args = std::move(args);
       command_for_checkpoint.session = std::move(checkpoint);
-      setup_child_fds(fds_data, command_for_checkpoint);
-      char ch;
-      ret = read(parent_to_child_read, &ch, 1);
-      if (ret != 1) {
-        FATAL() << "Failed to read parent notification";
-      }
-      command_for_checkpoint.session->reattach_tasks(std::move(new_tracee_socket),
-        std::move(new_tracee_socket_receiver));
       return command_for_checkpoint;
     }
     children.push_back(child);
-
-    checkpoint->detach_tasks(child, new_tracee_socket_receiver);
-    ret = write(parent_to_child_write, "x", 1);
-    if (ret != 1) {
-      FATAL() << "Failed to write parent notification";
-    }
     for (auto d : fds_data) {
       close(d);
     }
   }
 
-  // Wait for and reap all children
+  // Release the checkpoint, then wait for and reap all children
+  session = nullptr;
   for (size_t i = 0; i < children.size(); ++i) {
     WaitResult result = WaitManager::wait_exit(WaitOptions(children[i]));
     if (result.code != WAIT_OK) {
@@ -5,15 +5,29 @@
 
 #include "ReplaySession.h"
 
+#include <functional>
 #include <string>
 #include <vector>
 
 namespace rr {
 
-bool parse_export_checkpoints(const std::string& arg, FrameTime& export_checkpoints_event,
-                              int& export_checkpoints_count, std::string& export_checkpoints_socket);
+/* Where and how to export checkpoints, from
+   --export-checkpoints=<EVENT>,<NUM>,<FILE>[,<IDLE>]. */
+struct ExportCheckpointsSpec {
+  ExportCheckpointsSpec() : event(0), count(0), idle_seconds(0) {}
+  FrameTime event;
+  /* Number of connections to serve, or 0 for no limit. */
+  int count;
+  std::string socket;
+  /* Stop serving after this many seconds without a new connection, or
+     0 to wait forever. */
+  int idle_seconds;
+};
+
+bool parse_export_checkpoints(const std::string& arg, ExportCheckpointsSpec& spec);
 
-/* Bind the socket so clients can try to connect to it and block. */
+/* Bind the socket so clients can try to connect to it and block.
+   `count` is the backlog, or 0 for the system maximum. */
 ScopedFd bind_export_checkpoints_socket(int count, const std::string& socket_file_name);
 
 /* A command to run on the checkpoint */
@@ -24,15 +38,29 @@ struct CommandForCheckpoint {
   ScopedFd exit_notification_fd;
 };
 
+/* Clone `session` and hand the clone over to a forked child process, which
+   becomes the ptracer of its tasks. Returns the clone in the child and null in
+   the parent, which keeps replaying `session`; `*child` is set to the child's pid.
+   `in_child` runs in the child before it attaches to the clone's tasks.
+   The caller must check session.can_clone() first.
+*/
+ReplaySession::shr_ptr fork_checkpoint(ReplaySession& session, pid_t* child,
+                                       const std::function<void()>& in_child = nullptr);
+
 /* Export checkpoints from the given session.
-   This function will return `count` + 1 times; the first `count` times in a forked child
-   with a valid CommandForCheckpoint with a nonnull `session`; the last time with a null
-   `session` when all forked children have exited and been reaped.
+   This function will return once per connection in a forked child with a valid
+   CommandForCheckpoint with a nonnull `session`, and a last time with a null
+   `session` once `spec.count` connections (if nonzero) have been served or no
+   client has connected for `spec.idle_seconds` (if nonzero), and all forked
+   children have exited and been reaped. `session` is released before waiting
+   for the children. The children run concurrently; finished ones are reaped as
+   new connections arrive.
    For the child returns, stdin/stdout/stderr will have been rebound to fds passed in over
    the socket.
 */
-CommandForCheckpoint export_checkpoints(ReplaySession::shr_ptr session, int count, ScopedFd& sock,
-    const std::string& socket_file_name);
+CommandForCheckpoint export_checkpoints(ReplaySession::shr_ptr session,
+                                        const ExportCheckpointsSpec& spec,
+                                        ScopedFd& sock);
 
 /* After performing the CommandForCheckpoint, notify that we have exited normally. */
 void notify_normal_exit(ScopedFd& exit_notification_fd);
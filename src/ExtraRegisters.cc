@@ -271,6 +271,7 @@ bool ExtraRegisters::write_register(GdbServerRegister regno, const void* value,
     return false;
   }
 
+  expand();
   auto reg_data = xsave_register_data(arch(), regno);
   if (reg_data.offset < 0 || empty()) {
     return false;
@@ -362,6 +363,37 @@ bool ExtraRegisters::clear_fip_fdp() {
   return ret;
 }
 
+void ExtraRegisters::compact() {
+  const XSaveLayout& layout = xsave_native_layout();
+  const uint64_t* features = xsave_features(data_);
+  if (format_ != XSAVE || !features || data_.size() != layout.full_size) {
+    return;
+  }
+  size_t end = xsave_header_offset + xsave_header_size;
+  for (size_t i = 0; i < layout.feature_layouts.size(); ++i) {
+    const XSaveFeatureLayout& f = layout.feature_layouts[i];
+    if (f.size && (*features & (uint64_t(1) << i))) {
+      end = max<size_t>(end, f.offset + f.size);
+    }
+  }
+  if (end < data_.size()) {
+    data_.resize(end);
+    data_.shrink_to_fit();
+  }
+}
+
+void ExtraRegisters::expand() {
+  if (is_compacted()) {
+    // Components past the end aren't in XINUSE, so zeroes are fine.
+    data_.resize(xsave_native_layout().full_size, 0);
+  }
+}
+
+bool ExtraRegisters::is_compacted() const {
+  return format_ == XSAVE && xsave_features(data_) &&
+         data_.size() < xsave_native_layout().full_size;
+}
+
 void ExtraRegisters::validate(Task* t) {
   if (format_ != XSAVE) {
     return;
@@ -74,6 +74,23 @@ public:
   int data_size() const { return data_.size(); }
   const uint8_t* data_bytes() const { return data_.data(); }
   bool empty() const { return data_.empty(); }
+  // Reset to an empty value for |a|, keeping the buffer for reuse.
+  void clear(SupportedArch a) {
+    format_ = NONE;
+    arch_ = a;
+    data_.clear();
+  }
+
+  /**
+   * Drop the trailing XSAVE components that are in their init state
+   * according to XINUSE, e.g. unused AVX-512 state, so that the copies we
+   * keep in checkpoints and marks are small. read_register() returns the
+   * same values afterwards. expand() restores the standard layout the
+   * kernel wants.
+   */
+  void compact();
+  void expand();
+  bool is_compacted() const;
 
   /**
    * Read XSAVE `xinuse` field
@@ -4,12 +4,14 @@
 
 #include <limits.h>
 
+#include <map>
 #include <unordered_set>
 #include <utility>
 
 #include "rr/rr.h"
 
 #include "AddressSpace.h"
+#include "BpfMapMonitor.h"
 #include "RecordTask.h"
 #include "ReplayTask.h"
 #include "Session.h"
@@ -54,10 +56,10 @@ void FdTable::add_monitor(Task* t, int fd, FileMonitor* monitor) {
     ASSERT(t, false) << "Task " << t->rec_tid << " already monitoring fd "
       << fd << " " << file_monitor_type_name(current->type());
   }
-  if (fd >= syscallbuf_fds_disabled_size && fds.count(fd) == 0) {
+  if (fd >= syscallbuf_fds_disabled_size && fds->count(fd) == 0) {
     fd_count_beyond_limit++;
   }
-  fds[fd] = FileMonitor::shr_ptr(monitor);
+  mutable_fds()[fd] = FileMonitor::shr_ptr(monitor);
   update_syscallbuf_fds_disabled(fd);
 }
 
@@ -65,29 +67,29 @@ void FdTable::replace_monitor(Task* t, int fd, FileMonitor* monitor) {
   if (!is_monitoring(fd)) {
     add_monitor(t, fd, monitor);
   } else {
-    fds[fd] = FileMonitor::shr_ptr(monitor);
+    mutable_fds()[fd] = FileMonitor::shr_ptr(monitor);
   }
 }
 
 bool FdTable::is_rr_fd(int fd) {
-  auto it = fds.find(fd);
-  if (it == fds.end()) {
+  auto it = fds->find(fd);
+  if (it == fds->end()) {
     return false;
   }
   return it->second->is_rr_fd();
 }
 
 bool FdTable::emulate_ioctl(int fd, RecordTask* t, uint64_t* result) {
-  auto it = fds.find(fd);
-  if (it == fds.end()) {
+  auto it = fds->find(fd);
+  if (it == fds->end()) {
     return false;
   }
   return it->second->emulate_ioctl(t, result);
 }
 
 bool FdTable::emulate_fcntl(int fd, RecordTask* t, uint64_t* result) {
-  auto it = fds.find(fd);
-  if (it == fds.end()) {
+  auto it = fds->find(fd);
+  if (it == fds->end()) {
     return false;
   }
   return it->second->emulate_fcntl(t, result);
@@ -96,24 +98,24 @@ bool FdTable::emulate_fcntl(int fd, RecordTask* t, uint64_t* result) {
 bool FdTable::emulate_read(int fd, RecordTask* t,
                            const std::vector<FileMonitor::Range>& ranges,
                            FileMonitor::LazyOffset& offset, uint64_t* result) {
-  auto it = fds.find(fd);
-  if (it == fds.end()) {
+  auto it = fds->find(fd);
+  if (it == fds->end()) {
     return false;
   }
   return it->second->emulate_read(t, ranges, offset, result);
 }
 
 void FdTable::filter_getdents(int fd, RecordTask* t) {
-  auto it = fds.find(fd);
-  if (it == fds.end()) {
+  auto it = fds->find(fd);
+  if (it == fds->end()) {
     return;
   }
   it->second->filter_getdents(t);
 }
 
 Switchable FdTable::will_write(Task* t, int fd) {
-  auto it = fds.find(fd);
-  if (it == fds.end()) {
+  auto it = fds->find(fd);
+  if (it == fds->end()) {
     return ALLOW_SWITCH;
   }
   return it->second->will_write(t);
@@ -122,46 +124,59 @@ Switchable FdTable::will_write(Task* t, int fd) {
 void FdTable::did_write(Task* t, int fd,
                         const std::vector<FileMonitor::Range>& ranges,
                         FileMonitor::LazyOffset& offset) {
-  auto it = fds.find(fd);
-  if (it != fds.end()) {
+  auto it = fds->find(fd);
+  if (it != fds->end()) {
     it->second->did_write(t, ranges, offset);
   }
 }
 
 void FdTable::did_dup(FdTable* table, int from, int to) {
-  if (table->fds.count(from)) {
-    if (to >= syscallbuf_fds_disabled_size && fds.count(to) == 0) {
+  bool was_monitoring = fds->count(to) > 0;
+  auto from_it = table->fds->find(from);
+  bool monitoring = from_it != table->fds->end();
+  if (monitoring) {
+    if (to >= syscallbuf_fds_disabled_size && !was_monitoring) {
       fd_count_beyond_limit++;
     }
-    fds[to] = table->fds[from];
-  } else {
-    if (to >= syscallbuf_fds_disabled_size && fds.count(to) > 0) {
+    FileMonitor::shr_ptr monitor = from_it->second;
+    mutable_fds()[to] = monitor;
+  } else if (was_monitoring) {
+    if (to >= syscallbuf_fds_disabled_size) {
       fd_count_beyond_limit--;
     }
-    fds.erase(to);
+    mutable_fds().erase(to);
+  }
+  if (to < syscallbuf_fds_disabled_size - 1 || was_monitoring || monitoring) {
+    update_syscallbuf_fds_disabled(to);
   }
-  update_syscallbuf_fds_disabled(to);
 }
 
 void FdTable::did_close(int fd) {
   LOG(debug) << "Close fd " << fd;
-  if (fd >= syscallbuf_fds_disabled_size && fds.count(fd) > 0) {
+  bool was_monitoring = fds->count(fd) > 0;
+  if (was_monitoring) {
+    mutable_fds().erase(fd);
+  }
+  if (fd >= syscallbuf_fds_disabled_size && was_monitoring) {
     fd_count_beyond_limit--;
   }
-  fds.erase(fd);
-  update_syscallbuf_fds_disabled(fd);
+  // Closing an unmonitored high fd can't change any class, and processes
+  // with many fds close high fds all the time.
+  if (fd < syscallbuf_fds_disabled_size - 1 || was_monitoring) {
+    update_syscallbuf_fds_disabled(fd);
+  }
 }
 
 FileMonitor* FdTable::get_monitor(int fd) {
-  auto it = fds.find(fd);
-  if (it == fds.end()) {
+  auto it = fds->find(fd);
+  if (it == fds->end()) {
     return nullptr;
   }
   return it->second.get();
 }
 
-static syscallbuf_fd_classes join_fd_classes_over_tasks(AddressSpace* vm, int fd,
-    int syscallbuf_fds_disabled_size) {
+static syscallbuf_fd_classes join_fd_classes_over_tasks(AddressSpace* vm,
+                                                        int fd) {
   syscallbuf_fd_classes cls = FD_CLASS_UNTRACED;
   for (Task* t : vm->task_set()) {
     auto table = t->fd_table();
@@ -170,14 +185,185 @@ static syscallbuf_fd_classes join_fd_classes_over_tasks(AddressSpace* vm, int fd
         return FD_CLASS_TRACED;
       }
       cls = table->get_monitor(fd)->get_syscallbuf_class();
-    } else if (fd >= syscallbuf_fds_disabled_size - 1 &&
-        table->count_beyond_limit() > 0) {
-      return FD_CLASS_TRACED;
     }
   }
   return cls;
 }
 
+/**
+ * Make syscallbuf_bpf_maps list |fd| with the sizes of the BpfMapMonitor
+ * that gives it class FD_CLASS_BPF_MAP in |vm|. Returns false if the list is
+ * full; then the fd must be given FD_CLASS_TRACED instead.
+ */
+static bool list_syscallbuf_bpf_map(RecordTask* rt, AddressSpace* vm, int fd) {
+  BpfMapMonitor* monitor = nullptr;
+  for (Task* t : vm->task_set()) {
+    if (t->fd_table()->is_monitoring(fd)) {
+      monitor = static_cast<BpfMapMonitor*>(t->fd_table()->get_monitor(fd));
+      break;
+    }
+  }
+  DEBUG_ASSERT(monitor && monitor->type() == FileMonitor::BpfMap);
+  syscallbuf_bpf_map entry = { fd, (uint32_t)monitor->key_size(),
+                               (uint32_t)monitor->value_size() };
+  if (!entry.key_size && !entry.value_size) {
+    // Can't be told apart from an unused entry. Such maps (ringbufs) don't
+    // support lookups anyway.
+    return false;
+  }
+
+  auto maps_addr =
+      REMOTE_PTR_FIELD(rt->preload_globals, syscallbuf_bpf_maps[0]);
+  syscallbuf_bpf_map maps[SYSCALLBUF_BPF_MAPS_SIZE];
+  bool ok = true;
+  rt->read_bytes_helper(maps_addr, sizeof(maps), maps, &ok);
+  if (!ok) {
+    return false;
+  }
+  int slot = -1;
+  for (int i = 0; i < SYSCALLBUF_BPF_MAPS_SIZE; ++i) {
+    bool unused = !maps[i].key_size && !maps[i].value_size;
+    if (!unused && maps[i].fd == fd) {
+      if (maps[i].key_size == entry.key_size &&
+          maps[i].value_size == entry.value_size) {
+        return true;
+      }
+      // dup2() put a different map on |fd|. Make other threads stop using
+      // the old sizes before we change them.
+      auto class_addr =
+          REMOTE_PTR_FIELD(rt->preload_globals, syscallbuf_fd_class[0]) + fd;
+      char cls = FD_CLASS_TRACED;
+      rt->write_mem(class_addr, cls);
+      rt->record_local(class_addr, &cls);
+      slot = i;
+      break;
+    }
+    if (unused && slot < 0) {
+      slot = i;
+    }
+  }
+  if (slot < 0) {
+    return false;
+  }
+  auto addr = maps_addr + slot;
+  rt->write_mem(addr, entry);
+  rt->record_local(addr, &entry);
+  return true;
+}
+
+/**
+ * Remove |fd| from syscallbuf_bpf_maps, once it no longer has class
+ * FD_CLASS_BPF_MAP.
+ */
+static void unlist_syscallbuf_bpf_map(RecordTask* rt, int fd) {
+  auto maps_addr =
+      REMOTE_PTR_FIELD(rt->preload_globals, syscallbuf_bpf_maps[0]);
+  syscallbuf_bpf_map maps[SYSCALLBUF_BPF_MAPS_SIZE];
+  bool ok = true;
+  rt->read_bytes_helper(maps_addr, sizeof(maps), maps, &ok);
+  if (!ok) {
+    return;
+  }
+  for (int i = 0; i < SYSCALLBUF_BPF_MAPS_SIZE; ++i) {
+    if (maps[i].fd == fd && (maps[i].key_size || maps[i].value_size)) {
+      syscallbuf_bpf_map unused = { 0, 0, 0 };
+      auto addr = maps_addr + i;
+      rt->write_mem(addr, unused);
+      rt->record_local(addr, &unused);
+    }
+  }
+}
+
+void FdTable::update_syscallbuf_high_fds(RecordTask* rt, AddressSpace* vm) {
+  int high_fd_start = syscallbuf_fds_disabled_size - 1;
+  // Classes of the monitored high fds, joined over the fd tables in |vm|
+  // like join_fd_classes_over_tasks does.
+  map<int, char> classes;
+  unordered_set<FdTable*> tables;
+  for (Task* t : vm->task_set()) {
+    FdTable* table = t->fd_table().get();
+    if (!tables.insert(table).second ||
+        (!table->count_beyond_limit() && !table->is_monitoring(high_fd_start))) {
+      continue;
+    }
+    for (auto& it : *table->fds) {
+      if (it.first < high_fd_start) {
+        continue;
+      }
+      // syscallbuf_bpf_maps only lists low fds.
+      char cls = (char)it.second->get_syscallbuf_class();
+      if (cls == FD_CLASS_BPF_MAP) {
+        cls = FD_CLASS_TRACED;
+      }
+      auto c = classes.insert(make_pair(it.first, cls));
+      if (!c.second) {
+        c.first->second = FD_CLASS_TRACED;
+      }
+    }
+  }
+
+  // Skip rewriting the list if it's already right.
+  bool fits = classes.size() <= SYSCALLBUF_HIGH_FDS_SIZE;
+  int32_t count = fits ? classes.size() : 0;
+  int32_t high_fds[SYSCALLBUF_HIGH_FDS_SIZE];
+  char high_fd_class[SYSCALLBUF_HIGH_FDS_SIZE];
+  if (fits) {
+    int i = 0;
+    for (auto& c : classes) {
+      high_fds[i] = c.first;
+      high_fd_class[i] = c.second;
+      ++i;
+    }
+  }
+  auto slot_addr = REMOTE_PTR_FIELD(rt->preload_globals, syscallbuf_fd_class[0]) +
+      high_fd_start;
+  auto count_addr =
+      REMOTE_PTR_FIELD(rt->preload_globals, syscallbuf_high_fd_count);
+  auto fds_addr = REMOTE_PTR_FIELD(rt->preload_globals, syscallbuf_high_fds[0]);
+  auto class_addr =
+      REMOTE_PTR_FIELD(rt->preload_globals, syscallbuf_high_fd_class[0]);
+  bool ok = true;
+  char slot = rt->read_mem(slot_addr, &ok);
+  if (!ok) {
+    return;
+  }
+  if (!fits) {
+    if (slot != FD_CLASS_TRACED) {
+      slot = FD_CLASS_TRACED;
+      rt->write_mem(slot_addr, slot);
+      rt->record_local(slot_addr, &slot);
+    }
+    return;
+  }
+  if (slot == FD_CLASS_UNTRACED && rt->read_mem(count_addr) == count) {
+    int32_t current_fds[SYSCALLBUF_HIGH_FDS_SIZE];
+    char current_class[SYSCALLBUF_HIGH_FDS_SIZE];
+    rt->read_bytes_helper(fds_addr, count * sizeof(int32_t), current_fds);
+    rt->read_bytes_helper(class_addr, count, current_class);
+    if (!memcmp(current_fds, high_fds, count * sizeof(int32_t)) &&
+        !memcmp(current_class, high_fd_class, count)) {
+      return;
+    }
+  }
+
+  // Other threads in |vm| may be looking fds up concurrently. Make them use
+  // the conservative class until the list is consistent again.
+  slot = FD_CLASS_TRACED;
+  rt->write_mem(slot_addr, slot);
+  rt->record_local(slot_addr, &slot);
+  if (count) {
+    rt->write_mem(fds_addr, high_fds, count);
+    rt->record_local(fds_addr, high_fds, count);
+    rt->write_mem(class_addr, high_fd_class, count);
+    rt->record_local(class_addr, high_fd_class, count);
+  }
+  rt->write_mem(count_addr, count);
+  rt->record_local(count_addr, &count);
+  slot = FD_CLASS_UNTRACED;
+  rt->write_mem(slot_addr, slot);
+  rt->record_local(slot_addr, &slot);
+}
+
 void FdTable::update_syscallbuf_fds_disabled(int fd) {
   DEBUG_ASSERT(fd >= 0);
   DEBUG_ASSERT(task_set().size() > 0);
@@ -202,15 +388,22 @@ void FdTable::update_syscallbuf_fds_disabled(int fd) {
       rt = nullptr;
     }
     if (rt && !rt->preload_globals.is_null()) {
-      if (fd >= syscallbuf_fds_disabled_size) {
-        fd = syscallbuf_fds_disabled_size - 1;
+      if (fd >= syscallbuf_fds_disabled_size - 1) {
+        update_syscallbuf_high_fds(rt, address_space.first);
+        continue;
+      }
+      char disable = (char)join_fd_classes_over_tasks(address_space.first, fd);
+      if (disable == FD_CLASS_BPF_MAP &&
+          !list_syscallbuf_bpf_map(rt, address_space.first, fd)) {
+        disable = FD_CLASS_TRACED;
       }
-      char disable = (char)join_fd_classes_over_tasks(address_space.first, fd,
-          syscallbuf_fds_disabled_size);
       auto addr =
           REMOTE_PTR_FIELD(rt->preload_globals, syscallbuf_fd_class[0]) + fd;
       rt->write_mem(addr, disable);
       rt->record_local(addr, &disable);
+      if (disable != FD_CLASS_BPF_MAP) {
+        unlist_syscallbuf_bpf_map(rt, fd);
+      }
     }
   }
 }
@@ -233,12 +426,15 @@ void FdTable::init_syscallbuf_fds_disabled(Task* t) {
   // It's possible that some tasks in this address space have a different
   // FdTable. We need to disable syscallbuf for an fd if any tasks for this
   // address space are monitoring the fd.
+  bool have_high_fds = false;
   for (Task* vm_t : rt->vm()->task_set()) {
-    for (auto& it : vm_t->fd_table()->fds) {
+    for (auto& it : *vm_t->fd_table()->fds) {
       int fd = it.first;
       DEBUG_ASSERT(fd >= 0);
-      if (fd >= syscallbuf_fds_disabled_size) {
-        fd = syscallbuf_fds_disabled_size - 1;
+      if (fd >= syscallbuf_fds_disabled_size - 1) {
+        // Listed by update_syscallbuf_high_fds below.
+        have_high_fds = true;
+        continue;
       }
       if (disabled[fd] == FD_CLASS_UNTRACED) {
         disabled[fd] = it.second->get_syscallbuf_class();
@@ -248,9 +444,20 @@ void FdTable::init_syscallbuf_fds_disabled(Task* t) {
     }
   }
 
+  if (have_high_fds) {
+    disabled[syscallbuf_fds_disabled_size - 1] = FD_CLASS_TRACED;
+  }
+  for (int fd = 0; fd < syscallbuf_fds_disabled_size - 1; ++fd) {
+    if (disabled[fd] == FD_CLASS_BPF_MAP &&
+        !list_syscallbuf_bpf_map(rt, rt->vm().get(), fd)) {
+      disabled[fd] = FD_CLASS_TRACED;
+    }
+  }
+
   auto addr = REMOTE_PTR_FIELD(t->preload_globals, syscallbuf_fd_class[0]);
   rt->write_mem(addr, disabled, syscallbuf_fds_disabled_size);
   rt->record_local(addr, disabled, syscallbuf_fds_disabled_size);
+  update_syscallbuf_high_fds(rt, rt->vm().get());
 }
 
 void FdTable::close_after_exec(ReplayTask* t, const vector<int>& fds_to_close) {
@@ -272,7 +479,7 @@ vector<int> FdTable::fds_to_close_after_exec(RecordTask* t) {
   ASSERT(t, has_task(t));
 
   vector<int> fds_to_close;
-  for (auto& it : fds) {
+  for (auto& it : *fds) {
     if (!is_fd_open(t, it.first)) {
       fds_to_close.push_back(it.first);
     }
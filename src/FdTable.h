@@ -45,7 +45,7 @@ public:
 
   static shr_ptr create(Task* t);
 
-  bool is_monitoring(int fd) const { return fds.count(fd) > 0; }
+  bool is_monitoring(int fd) const { return fds->count(fd) > 0; }
   uint32_t count_beyond_limit() const { return fd_count_beyond_limit; }
 
   FileMonitor* get_monitor(int fd);
@@ -78,20 +78,42 @@ public:
   void erase_task(Task* t) override;
 
 private:
+  typedef std::unordered_map<int, FileMonitor::shr_ptr> FdMap;
+
   explicit FdTable(uint32_t syscallbuf_fds_disabled_size)
-    : syscallbuf_fds_disabled_size(syscallbuf_fds_disabled_size),
+    : fds(std::make_shared<FdMap>()),
+      syscallbuf_fds_disabled_size(syscallbuf_fds_disabled_size),
       fd_count_beyond_limit(0), last_free_fd_(0) {}
   // Does not call the base-class copy constructor because
   // we don't want to copy the task set; the new FdTable will
-  // be for new tasks.
+  // be for new tasks. The monitors are shared until one of the tables
+  // changes them; see mutable_fds().
   FdTable(const FdTable& other) : fds(other.fds),
     syscallbuf_fds_disabled_size(other.syscallbuf_fds_disabled_size),
     fd_count_beyond_limit(other.fd_count_beyond_limit),
     last_free_fd_(other.last_free_fd_) {}
 
   void update_syscallbuf_fds_disabled(int fd);
+  /**
+   * Rewrite the preload library's list of monitored fds that are too high
+   * for syscallbuf_fd_class, for the tasks in |vm|. |rt| must be a live task
+   * in |vm|.
+   */
+  void update_syscallbuf_high_fds(RecordTask* rt, AddressSpace* vm);
+
+  // Copy |fds| first if a cloned table still shares it.
+  FdMap& mutable_fds() {
+    if (fds.use_count() > 1) {
+      fds = std::make_shared<FdMap>(*fds);
+    }
+    return *fds;
+  }
 
-  std::unordered_map<int, FileMonitor::shr_ptr> fds;
+  // Shared with the tables cloned from this one, or that this one was
+  // cloned from, until either side changes its monitors. Checkpoint,
+  // diversion and exec clones never do. A forked child copies once, when
+  // it drops the other threads' syscallbuf fds.
+  std::shared_ptr<FdMap> fds;
   std::unordered_map<AddressSpace*, int> vms;
   // Currently this is only used during recording, so we could use
   // SYSCALLBUF_FDS_DISABLED_SIZE directly and not bother tracking it in
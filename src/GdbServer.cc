@@ -6,6 +6,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/sysmacros.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -25,6 +26,7 @@
 #include "ReplaySession.h"
 #include "ReplayTask.h"
 #include "ScopedFd.h"
+#include "StdioMonitor.h"
 #include "StringVectorToCharArray.h"
 #include "Task.h"
 #include "ThreadGroup.h"
@@ -70,7 +72,11 @@ GdbServer::GdbServer(std::unique_ptr<GdbServerConnection>& connection,
       exit_sigkill_pending(false),
       timeline_(timeline),
       emergency_debug_session(timeline ? nullptr : &t->session()),
-      file_scope_pid(0) {
+      file_scope_pid(0),
+      libraries_svr4_generation(0),
+      mem_info_generation(0),
+      spare_diversion_source(nullptr),
+      want_spare_diversion(false) {
   memset(&stop_siginfo, 0, sizeof(stop_siginfo));
 }
 
@@ -243,35 +249,101 @@ static unique_ptr<BreakpointCondition> breakpoint_condition(
       new GdbBreakpointCondition(request.watch().conditions));
 }
 
-static bool search_memory(Task* t, const MemoryRange& where,
-                          const vector<uint8_t>& find,
-                          remote_ptr<void>* result) {
+// Searches read this much memory at a time.
+static const size_t search_chunk_size = 1024 * 1024;
+
+/* static */ void GdbServer::search_memory(Task* t, const MemoryRange& where,
+                                           const vector<uint8_t>& find,
+                                           size_t max_results,
+                                           vector<remote_ptr<void>>* results) {
+  if (find.empty() || max_results == 0) {
+    return;
+  }
+  // A match must contain a nonzero byte unless the pattern is all zeroes, so
+  // we can skip parts of private anonymous mappings that have never been
+  // touched.
+  bool find_is_zero =
+      all_of(find.begin(), find.end(), [](uint8_t b) { return b == 0; });
+  int pagemap_fd = find_is_zero ? -1 : t->pagemap_fd().get();
+  size_t overlap = find.size() - 1;
   vector<uint8_t> buf;
-  buf.resize(page_size() + find.size() - 1);
+  buf.resize(search_chunk_size + overlap);
   for (const auto& m : t->vm()->maps()) {
-    MemoryRange r = MemoryRange(m.map.start(), m.map.end() + find.size() - 1)
-                        .intersect(where);
-    // We basically read page by page here, but we read past the end of the
-    // page to handle the case where a found string crosses page boundaries.
-    // This approach isn't great for handling long search strings but gdb's find
-    // command isn't really suited to that.
-    // Reading page by page lets us avoid problems where some pages in a
-    // mapping aren't readable (e.g. reading beyond end of file).
-    while (r.size() >= find.size()) {
-      ssize_t nread = t->read_bytes_fallible(
-          r.start(), std::min(buf.size(), r.size()), buf.data());
-      if (nread >= ssize_t(find.size())) {
-        void* found = memmem(buf.data(), nread, find.data(), find.size());
-        if (found) {
-          *result = r.start() + (static_cast<uint8_t*>(found) - buf.data());
-          return true;
+    bool anonymous_private = (m.map.flags() & MAP_ANONYMOUS) &&
+                             !(m.map.flags() & MAP_SHARED) && !m.local_addr;
+    // Matches may start anywhere in the mapping but can extend past its end.
+    remote_ptr<void> start = max(m.map.start(), where.start());
+    remote_ptr<void> data_end = min(m.map.end() + overlap, where.end());
+    while (start < m.map.end() && start + find.size() <= data_end) {
+      // Look for matches starting in [start, chunk_end); we read |overlap|
+      // bytes past that so we find matches crossing into the next chunk.
+      remote_ptr<void> chunk_end =
+          min(m.map.end(), floor_page_size(start) + search_chunk_size);
+      remote_ptr<void> read_end = min(chunk_end + overlap, data_end);
+      if (anonymous_private && pagemap_fd >= 0 && read_end <= m.map.end() &&
+          range_unpopulated(pagemap_fd,
+                            MemoryRange(floor_page_size(start),
+                                        ceil_page_size(read_end)))) {
+        start = chunk_end;
+        continue;
+      }
+      size_t len = read_end - start;
+      ssize_t nread = t->read_bytes_fallible(start, len, buf.data());
+      nread = max(ssize_t(0), nread);
+      size_t search_start = 0;
+      while (search_start < size_t(nread)) {
+        void* found = memmem(buf.data() + search_start, nread - search_start,
+                             find.data(), find.size());
+        if (!found) {
+          break;
         }
+        size_t offset = static_cast<uint8_t*>(found) - buf.data();
+        if (start + offset >= chunk_end) {
+          break;
+        }
+        results->push_back(start + offset);
+        if (results->size() >= max_results) {
+          return;
+        }
+        search_start = offset + 1;
+      }
+      if (size_t(nread) < len) {
+        // Some pages in a mapping may not be readable (e.g. beyond the end of
+        // the file). Resume the search after the first one.
+        start = floor_page_size(start + nread) + page_size();
+      } else {
+        start = chunk_end;
       }
-      r = MemoryRange(
-          std::min(r.end(), floor_page_size(r.start()) + page_size()), r.end());
     }
   }
-  return false;
+}
+
+/**
+ * Open the file in the trace that holds the contents of the mapping |id|,
+ * or return a closed fd if there isn't one.
+ */
+static ScopedFd open_mapped_file_from_trace(const TraceReader& reader,
+                                            const FileId& id) {
+  TraceReader tmp_reader(reader);
+  tmp_reader.rewind();
+  while (true) {
+    TraceReader::MappedData data;
+    bool found;
+    KernelMapping km = tmp_reader.read_mapped_region(
+        &data, &found, TraceReader::DONT_VALIDATE, TraceReader::ANY_TIME);
+    if (!found) {
+      break;
+    }
+    if (id == FileId(km)) {
+      if (data.source != TraceReader::SOURCE_FILE) {
+        LOG(warn) << "Not serving file because it is not a file source";
+        return ScopedFd();
+      }
+      return ScopedFd(data.file_name.c_str(), O_RDONLY);
+    }
+  }
+  LOG(warn) << "No mapping found";
+  return ScopedFd();
 }
 
 static bool is_in_patch_stubs(Task* t, remote_code_ptr ip) {
@@ -300,6 +372,22 @@ void GdbServer::maybe_intercept_mem_request(Task* target, const GdbRequest& req,
   }
 }
 
+/**
+ * The registers LLDB wants at every stop for each thread.
+ */
+static vector<GdbServerRegister> expedited_registers(SupportedArch arch) {
+  switch (arch) {
+    case x86:
+      return { DREG_EIP, DREG_ESP, DREG_EBP, DREG_EFLAGS };
+    case x86_64:
+      return { DREG_RIP, DREG_RSP, DREG_RBP, DREG_64_EFLAGS };
+    case aarch64:
+      return { DREG_PC, DREG_SP, DREG_X29, DREG_X30, DREG_CPSR };
+    default:
+      return {};
+  }
+}
+
 static vector<GdbServerConnection::ThreadInfo> thread_info(const Session& session) {
   vector<GdbServerConnection::ThreadInfo> threads;
   for (auto& kv : session.tasks()) {
@@ -314,6 +402,8 @@ static vector<GdbServerConnection::ThreadInfo> thread_info(const Session& sessio
 void GdbServer::notify_stop_internal(const Session& session,
                                      ExtendedTaskId which, int sig,
                                      const char *reason) {
+  // The user must see the program's output up to the stop before the stop.
+  StdioMonitor::flush_echoed_output();
   dbg->notify_stop(which, sig, thread_info(session), reason);
 }
 
@@ -344,6 +434,40 @@ void GdbServer::dispatch_debugger_request(Session& session,
       dbg->reply_get_thread_list(tids);
       return;
     }
+    case DREQ_GET_THREADS_INFO: {
+      vector<GdbServerConnection::ThreadStopInfo> threads;
+      if (state != REPORT_THREADS_DEAD && !failed_restart) {
+        int core = session.cpu_binding();
+        for (auto& kv : session.tasks()) {
+          Task* t = kv.second;
+          GdbServerConnection::ThreadStopInfo info;
+          info.id = extended_task_id(t);
+          info.name = t->name();
+          info.core = core;
+          info.signal =
+              info.id.tuid == last_continue_task.tuid ? stop_siginfo.si_signo : 0;
+          for (GdbServerRegister r : expedited_registers(t->arch())) {
+            info.expedited_registers.push_back(
+                get_reg(t->regs(), ExtraRegisters(t->arch()), r));
+          }
+          threads.push_back(std::move(info));
+        }
+      }
+      dbg->reply_get_threads_info(threads);
+      return;
+    }
+    case DREQ_GET_THREADS: {
+      vector<GdbServerConnection::ThreadDescription> threads;
+      if (state != REPORT_THREADS_DEAD && !failed_restart) {
+        int core = session.cpu_binding();
+        for (auto& kv : session.tasks()) {
+          threads.push_back(
+              { extended_task_id(kv.second), kv.second->name(), core });
+        }
+      }
+      dbg->reply_get_threads(threads);
+      return;
+    }
     case DREQ_INTERRUPT:
       notify_stop_internal(session, last_continue_task, 0);
       memset(&stop_siginfo, 0, sizeof(stop_siginfo));
@@ -387,51 +511,39 @@ void GdbServer::dispatch_debugger_request(Session& session,
       return;
     case DREQ_FILE_PREAD: {
       GdbRequest::FilePread read_req = req.file_pread();
+      {
+        auto it = memory_files.find(read_req.fd);
+        if (it != memory_files.end() && timeline_) {
+          // Look up the trace file backing this mapping once, then serve it
+          // like any other file. Scanning the mmap stream for every packet
+          // made loading large binaries take minutes.
+          ScopedFd fd = open_mapped_file_from_trace(
+              timeline_->current_session().trace_reader(), it->second);
+          if (fd.is_open()) {
+            memory_files.erase(it);
+            files[read_req.fd] = std::move(fd);
+          }
+        }
+      }
       {
         auto it = files.find(read_req.fd);
         if (it != files.end()) {
           size_t size = min<uint64_t>(read_req.size, 1024 * 1024);
           vector<uint8_t> data;
           data.resize(size);
+          LOG(debug) << "Reading " << size << " bytes at offset "
+                     << read_req.offset;
           ssize_t bytes =
               read_to_end(it->second, read_req.offset, data.data(), size);
-          dbg->reply_pread(data.data(), bytes, bytes >= 0 ? 0 : -errno);
-          return;
-        }
-      }
-      {
-        auto it = memory_files.find(read_req.fd);
-        if (it != memory_files.end() && timeline_) {
-          // Search our mmap stream for a record that can satisfy this request
-          TraceReader tmp_reader(timeline_->current_session().trace_reader());
-          tmp_reader.rewind();
-          while (true) {
-            TraceReader::MappedData data;
-            bool found;
-            KernelMapping km = tmp_reader.read_mapped_region(
-                &data, &found, TraceReader::DONT_VALIDATE, TraceReader::ANY_TIME);
-            if (!found)
-              break;
-            if (it->second == FileId(km)) {
-              if (data.source != TraceReader::SOURCE_FILE) {
-                LOG(warn) << "Not serving file because it is not a file source";
-                break;
-              }
-              ScopedFd fd(data.file_name.c_str(), O_RDONLY);
-              vector<uint8_t> data;
-              data.resize(read_req.size);
-              LOG(debug) << "Reading " << read_req.size << " bytes at offset " <<
-                read_req.offset;
-              ssize_t bytes =
-                  read_to_end(fd, read_req.offset, data.data(), read_req.size);
-              if (bytes < (ssize_t)read_req.size) {
-                LOG(warn) << "Requested " << read_req.size << " bytes but only got " << bytes;
-              }
-              dbg->reply_pread(data.data(), bytes, bytes >= 0 ? 0 : -errno);
-              return;
-            }
+          int err = bytes >= 0 ? 0 : -errno;
+          if (bytes == ssize_t(size)) {
+            // The debugger usually reads on from here; get the kernel to
+            // fetch the next chunk while it processes this one.
+            posix_fadvise(it->second, read_req.offset + bytes, size,
+                          POSIX_FADV_WILLNEED);
           }
-          LOG(warn) << "No mapping found";
+          dbg->reply_pread(data.data(), bytes, err);
+          return;
         }
       }
       LOG(warn) << "Unknown file descriptor requested";
@@ -507,31 +619,27 @@ void GdbServer::dispatch_debugger_request(Session& session,
       dbg->reply_get_auxv(target->vm()->saved_auxv());
       return;
     }
+    case DREQ_GET_LIBRARIES_SVR4: {
+      dbg->reply_get_libraries_svr4(libraries_svr4(target));
+      return;
+    }
     case DREQ_GET_MEM:
     case DREQ_GET_MEM_BINARY: {
-      vector<uint8_t> mem;
-      uintptr_t end = req.mem().addr + req.mem().len;
-      if (end < req.mem().addr) {
-        // Overflow
-        dbg->reply_get_mem(mem);
-        return;
-      }
-      mem.resize(req.mem().len);
-
-      if (!session.is_diversion() &&
-          read_debugger_mem(target->thread_group()->tguid(),
-              MemoryRange(req.mem().addr, req.mem().len), mem.data())) {
-      } else {
-        ssize_t nread = target->read_bytes_fallible(req.mem().addr, req.mem().len,
-                                                    mem.data());
-        mem.resize(max(ssize_t(0), nread));
-      }
-      target->vm()->replace_breakpoints_with_original_values(
-          mem.data(), mem.size(), req.mem().addr);
+      vector<uint8_t> mem = read_mem_for_debugger(session, target,
+                                                  req.mem().addr, req.mem().len);
       maybe_intercept_mem_request(target, req, &mem);
       dbg->reply_get_mem(mem);
       return;
     }
+    case DREQ_MULTI_MEM_READ: {
+      vector<vector<uint8_t>> mems;
+      for (auto& range : req.multi_mem().ranges) {
+        mems.push_back(
+            read_mem_for_debugger(session, target, range.start(), range.size()));
+      }
+      dbg->reply_multi_mem_read(mems);
+      return;
+    }
     case DREQ_SET_MEM:
     case DREQ_SET_MEM_BINARY: {
       // gdb has been observed to send requests of length 0 at
@@ -580,11 +688,12 @@ void GdbServer::dispatch_debugger_request(Session& session,
       return;
     }
     case DREQ_SEARCH_MEM_BINARY: {
-      remote_ptr<void> addr;
-      bool found =
-          search_memory(target, MemoryRange(req.mem().addr, req.mem().len),
-                        req.mem().data, &addr);
-      dbg->reply_search_mem_binary(found, addr);
+      vector<remote_ptr<void>> found;
+      search_memory(target, MemoryRange(req.mem().addr, req.mem().len),
+                    req.mem().data, 1, &found);
+      dbg->reply_search_mem_binary(!found.empty(),
+                                   found.empty() ? remote_ptr<void>()
+                                                 : found[0]);
       return;
     }
     case DREQ_MEM_INFO: {
@@ -596,16 +705,32 @@ void GdbServer::dispatch_debugger_request(Session& session,
         dbg->reply_mem_info(range, prot, "");
         return;
       }
-      if (target->vm()->has_mapping(req.mem().addr)) {
-        AddressSpace::Mapping m = target->vm()->mapping_of(req.mem().addr);
-        dbg->reply_mem_info(m.recorded_map, m.recorded_map.prot(),
-                            m.recorded_map.fsname());
+      // LLDB asks about the same regions over and over, and answering for
+      // an unmapped address means scanning the whole map.
+      remote_ptr<void> addr = req.mem().addr;
+      uint64_t generation = target->vm()->mapping_generation();
+      if (generation != mem_info_generation) {
+        mem_info_cache.clear();
+        mem_info_generation = generation;
+      }
+      auto cached = mem_info_cache.upper_bound(addr);
+      if (cached != mem_info_cache.begin() &&
+          (--cached)->second.range.contains(addr)) {
+        const MemInfo& info = cached->second;
+        dbg->reply_mem_info(info.range, info.prot, info.name);
+        return;
+      }
+      MemInfo info;
+      if (target->vm()->has_mapping(addr)) {
+        AddressSpace::Mapping m = target->vm()->mapping_of(addr);
+        info = { m.recorded_map, m.recorded_map.prot(),
+                 m.recorded_map.fsname() };
       } else {
         AddressSpace::Maps maps = target->vm()->maps();
         remote_ptr<void> last_end;
         remote_ptr<void> next_start;
         for (auto it : maps) {
-          if (it.recorded_map.start() > req.mem().addr) {
+          if (it.recorded_map.start() > addr) {
             next_start = it.recorded_map.start();
             break;
           }
@@ -614,8 +739,10 @@ void GdbServer::dispatch_debugger_request(Session& session,
         if (next_start.is_null()) {
           next_start = usable_address_space_end(target->arch());
         }
-        dbg->reply_mem_info(MemoryRange(last_end, next_start), 0, string());
+        info = { MemoryRange(last_end, next_start), 0, string() };
       }
+      mem_info_cache[info.range.start()] = info;
+      dbg->reply_mem_info(info.range, info.prot, info.name);
       return;
     }
     case DREQ_MEM_ALLOC: {
@@ -825,8 +952,7 @@ void GdbServer::dispatch_debugger_request(Session& session,
         thread_db->register_symbol(name, req.sym().address);
       } else if (name == "") {
         // Plain "qSymbol::" request.
-        symbols =
-            thread_db->get_symbols_and_clear_map(target->thread_group().get());
+        symbols = thread_db->get_unknown_symbols(target->thread_group().get());
         symbols_iter = symbols.begin();
       }
 
@@ -1057,6 +1183,7 @@ void GdbServer::maybe_notify_stop(const Session& session,
       // supposed to. FIXME.
       LOG(debug) << "Last task of diversion exiting. "
                  << "Notifying exit with synthetic SIGKILL";
+      StdioMonitor::flush_echoed_output();
       dbg->notify_exit_signal(SIGKILL);
       return;
     } else if (dbg->features().reverse_execution) {
@@ -1112,6 +1239,40 @@ static RunCommand compute_run_command_from_actions(Task* t,
   return RUN_CONTINUE;
 }
 
+/**
+ * If gdb asked |t| to range-step (vCont;r), return that action.
+ */
+static const GdbContAction* range_step_action(Task* t, const GdbRequest& req) {
+  for (auto& action : req.cont().actions) {
+    if (matches_threadid(t, action.target)) {
+      return action.type == ACTION_STEP && action.range_start < action.range_end
+                 ? &action
+                 : nullptr;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * True if |result| is nothing but a completed singlestep of |t| still
+ * inside |range|, so a range-step can carry on without reporting a stop.
+ */
+static bool can_continue_range_step(ReplayTimeline* timeline, Task* t,
+                                    const GdbContAction& range,
+                                    const ReplayResult& result) {
+  const BreakStatus& break_status = result.break_status;
+  if (result.status != REPLAY_CONTINUE || break_status.task_context.task != t ||
+      !break_status.singlestep_complete || break_status.breakpoint_hit ||
+      !break_status.watchpoints_hit.empty() || break_status.signal ||
+      break_status.task_exit || break_status.approaching_ticks_target) {
+    return false;
+  }
+  if (timeline->current_session().current_task() != t || is_in_exec(timeline)) {
+    return false;
+  }
+  return range.in_step_range(t->ip());
+}
+
 struct AllowedTasks {
   TaskUid task; // tid 0 means 'any member of debuggee_tguid'
   RunCommand command;
@@ -1162,7 +1323,14 @@ GdbRequest GdbServer::divert(ReplaySession& replay) {
     // breakpoint/watchpoint state.
     timeline_->apply_breakpoints_and_watchpoints();
   }
-  DiversionSession::shr_ptr diversion_session = replay.clone_diversion();
+  DiversionSession::shr_ptr diversion_session;
+  if (spare_diversion && spare_diversion_source == &replay) {
+    LOG(debug) << "  using spare diversion " << spare_diversion.get();
+    diversion_session = std::move(spare_diversion);
+  } else {
+    discard_spare_diversion();
+    diversion_session = replay.clone_diversion();
+  }
   uint32_t diversion_refcount = 1;
   ExtendedTaskId saved_query_task = last_query_task;
   ExtendedTaskId saved_continue_task = last_continue_task;
@@ -1222,20 +1390,184 @@ GdbRequest GdbServer::divert(ReplaySession& replay) {
   DEBUG_ASSERT(diversion_refcount == 0);
 
   diversion_session->kill_all_tasks();
+  want_spare_diversion = true;
 
   last_query_task = saved_query_task;
   last_continue_task = saved_continue_task;
   return req;
 }
 
+void GdbServer::maybe_prepare_spare_diversion() {
+  if (!timeline_ || !want_spare_diversion || spare_diversion ||
+      dbg->sniff_packet()) {
+    return;
+  }
+  // Match the breakpoint state divert() would clone.
+  timeline_->apply_breakpoints_and_watchpoints();
+  spare_diversion_source = &timeline_->current_session();
+  spare_diversion = spare_diversion_source->clone_diversion();
+  LOG(debug) << "Prepared spare diversion " << spare_diversion.get()
+             << " for " << spare_diversion_source;
+}
+
+void GdbServer::discard_spare_diversion() {
+  want_spare_diversion = false;
+  if (!spare_diversion) {
+    return;
+  }
+  LOG(debug) << "Discarding spare diversion " << spare_diversion.get();
+  spare_diversion->kill_all_tasks();
+  spare_diversion = nullptr;
+  spare_diversion_source = nullptr;
+}
+
+// How long the debugger must be quiet before we prewarm checkpoints.
+static const int prewarm_idle_ms = 1000;
+
+void GdbServer::maybe_prewarm_checkpoints() {
+  if (!timeline_ || !dbg->awaiting_request()) {
+    return;
+  }
+  // This doesn't delay the next request: sniff_packet() returns as soon as
+  // it arrives.
+  while (!dbg->sniff_packet(prewarm_idle_ms)) {
+    if (!timeline_->prewarm_checkpoints(
+            [&]() { return dbg->sniff_packet(); })) {
+      return;
+    }
+    // The replay session is now a copy of the one the spare diversion
+    // was cloned from, so clone a new one.
+    if (spare_diversion) {
+      discard_spare_diversion();
+      want_spare_diversion = true;
+      maybe_prepare_spare_diversion();
+    }
+  }
+}
+
+/**
+ * Returns true if |req| can't change tracee memory, so memory we've read
+ * for the debugger stays valid.
+ */
+static bool request_preserves_memory(const GdbRequest& req) {
+  switch (req.type) {
+    case DREQ_GET_CURRENT_THREAD:
+    case DREQ_GET_OFFSETS:
+    case DREQ_GET_REGS:
+    case DREQ_GET_STOP_REASON:
+    case DREQ_GET_THREAD_LIST:
+    case DREQ_GET_THREADS:
+    case DREQ_GET_THREADS_INFO:
+    case DREQ_MULTI_MEM_READ:
+    case DREQ_GET_AUXV:
+    case DREQ_GET_EXEC_FILE:
+    case DREQ_GET_LIBRARIES_SVR4:
+    case DREQ_GET_IS_THREAD_ALIVE:
+    case DREQ_GET_THREAD_EXTRA_INFO:
+    case DREQ_SET_CONTINUE_THREAD:
+    case DREQ_SET_QUERY_THREAD:
+    case DREQ_TLS:
+    case DREQ_GET_MEM:
+    case DREQ_GET_MEM_BINARY:
+    case DREQ_SEARCH_MEM_BINARY:
+    case DREQ_MEM_INFO:
+    case DREQ_GET_REG:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// gdb prints large structures and backtraces with many small memory reads,
+// and gdb's own caches don't cover all of them. On a miss we read this many
+// pages starting at the missing page, and serve later reads until the next
+// request that might change memory from the copy.
+static const size_t mem_read_cache_prefetch_pages = 4;
+
+vector<uint8_t> GdbServer::read_mem_for_debugger(Session& session, Task* t,
+                                                 remote_ptr<void> addr,
+                                                 size_t len) {
+  vector<uint8_t> mem;
+  uintptr_t end = addr.as_int() + len;
+  if (end < addr.as_int()) {
+    // Overflow
+    return mem;
+  }
+  mem.resize(len);
+
+  if (!session.is_diversion() &&
+      read_debugger_mem(t->thread_group()->tguid(), MemoryRange(addr, len),
+                        mem.data())) {
+  } else {
+    ssize_t nread = read_mem_cached(t, addr, len, mem.data());
+    mem.resize(max(ssize_t(0), nread));
+  }
+  t->vm()->replace_breakpoints_with_original_values(mem.data(), mem.size(),
+                                                    addr.cast<uint8_t>());
+  return mem;
+}
+
+ssize_t GdbServer::read_mem_cached(Task* t, remote_ptr<void> addr, size_t len,
+                                   uint8_t* buf) {
+  AddressSpaceUid vm = t->vm()->uid();
+  size_t done = 0;
+  while (done < len) {
+    remote_ptr<void> p = addr + done;
+    remote_ptr<void> page = floor_page_size(p);
+    auto it = mem_read_cache.find(make_pair(vm, page));
+    if (it == mem_read_cache.end()) {
+      size_t prefetch = mem_read_cache_prefetch_pages * page_size();
+      vector<uint8_t> data;
+      data.resize(prefetch);
+      ssize_t nread = t->read_bytes_fallible(page, prefetch, data.data());
+      nread = max(ssize_t(0), nread);
+      for (size_t offset = 0; offset < prefetch; offset += page_size()) {
+        size_t valid =
+            nread > ssize_t(offset) ? min(page_size(), nread - offset) : 0;
+        mem_read_cache[make_pair(vm, page + offset)] = vector<uint8_t>(
+            data.begin() + offset, data.begin() + offset + valid);
+        if (valid < page_size()) {
+          break;
+        }
+      }
+      it = mem_read_cache.find(make_pair(vm, page));
+    }
+    const vector<uint8_t>& contents = it->second;
+    size_t offset = p - page;
+    if (offset >= contents.size()) {
+      break;
+    }
+    size_t n = min(len - done, contents.size() - offset);
+    memcpy(buf + done, contents.data() + offset, n);
+    done += n;
+    if (contents.size() < page_size() && offset + n == contents.size()) {
+      // The rest of this page is unreadable.
+      break;
+    }
+  }
+  return done;
+}
+
 /**
  * Reply to debugger requests until the debugger asks us to resume
  * execution, detach, restart, or interrupt.
  */
 GdbRequest GdbServer::process_debugger_requests(ReportState state) {
   while (true) {
+    maybe_prepare_spare_diversion();
+    StdioMonitor::flush_echoed_output();
+    maybe_prewarm_checkpoints();
     GdbRequest req = dbg->get_request();
     req.suppress_debugger_stop = false;
+    if (!request_preserves_memory(req)) {
+      mem_read_cache.clear();
+      if (req.type != DREQ_READ_SIGINFO &&
+          req.type != DREQ_SAVE_REGISTER_STATE) {
+        // Anything but the start of another diversion could leave the
+        // spare out of date.
+        discard_spare_diversion();
+      }
+    }
     try_lazy_reverse_singlesteps(req);
 
     if (req.type == DREQ_READ_SIGINFO) {
@@ -1333,14 +1665,25 @@ void GdbServer::try_lazy_reverse_singlesteps(GdbRequest& req) {
     LOG(debug) << "  using lazy reverse-singlestep";
     maybe_notify_stop(timeline_->current_session(), req, break_status);
 
+    // Only |t| ran between |now| and the current state, so we can answer
+    // register requests for |t| and current-thread queries without
+    // seeking. Anything else (e.g. memory
+    // reads) needs the real state at |now|.
     while (true) {
       req = dbg->get_request();
       req.suppress_debugger_stop = false;
-      if (req.type != DREQ_GET_REGS) {
+      if (req.type == DREQ_GET_REGS) {
+        LOG(debug) << "  using lazy reverse-singlestep registers";
+        dispatch_regs_request(now.regs(), now.extra_regs());
+      } else if (req.type == DREQ_GET_REG && matches_threadid(t, req.target)) {
+        LOG(debug) << "  using lazy reverse-singlestep register";
+        dbg->reply_get_reg(
+            get_reg(now.regs(), now.extra_regs(), req.reg().name));
+      } else if (req.type == DREQ_GET_CURRENT_THREAD) {
+        dbg->reply_get_current_thread(last_continue_task);
+      } else {
         break;
       }
-      LOG(debug) << "  using lazy reverse-singlestep registers";
-      dispatch_regs_request(now.regs(), now.extra_regs());
     }
   }
 
@@ -1365,6 +1708,7 @@ bool GdbServer::detach_or_restart(const GdbRequest& req, ContinueOrStop* s) {
 GdbServer::ContinueOrStop GdbServer::handle_exited_state(
     GdbRequest& last_resume_request) {
   // TODO return real exit code, if it's useful.
+  StdioMonitor::flush_echoed_output();
   dbg->notify_exit_code(0);
   if (timeline_) {
     final_event = timeline_->current_session().trace_reader().time();
@@ -1472,11 +1816,22 @@ GdbServer::ContinueOrStop GdbServer::debug_one_step(
       // stop.
       result = ReplayResult();
     } else {
+      Task* t = require_timeline_current_task();
       int signal_to_deliver;
-      RunCommand command = compute_run_command_from_actions(
-          require_timeline_current_task(), req, &signal_to_deliver);
+      RunCommand command =
+          compute_run_command_from_actions(t, req, &signal_to_deliver);
       // Ignore gdb's |signal_to_deliver|; we just have to follow the replay.
       result = timeline_->replay_step_forward(command);
+      // For a range-step, keep singlestepping here rather than making gdb
+      // send a packet per instruction. Stop as soon as anything other than
+      // the step itself happens, or gdb wants our attention.
+      const GdbContAction* range = range_step_action(t, req);
+      if (range) {
+        while (can_continue_range_step(timeline_, t, *range, result) &&
+               !dbg->sniff_packet()) {
+          result = timeline_->replay_step_forward(RUN_SINGLESTEP);
+        }
+      }
     }
     if (result.status == REPLAY_EXITED) {
       return handle_exited_state(last_resume_request);
@@ -1694,7 +2049,22 @@ static FrameTime compute_time_from_ticks(ReplayTimeline& timeline, Ticks target)
     // it if the next frame is for another tid.
     return last_time;
   }
-  
+
+  // Skip to just before the first match with the ticks index, if any.
+  FrameTime from = tmp_reader.time() + 1;
+  FrameTime after;
+  FrameTime end;
+  if (tmp_reader.ticks_frame_range(task->tuid().tid(), from, target, &after,
+                                   &end)) {
+    if (end < 0) {
+      return -1;
+    }
+    if (after >= from) {
+      tmp_reader.seek_to_frame(after + 1);
+      last_time = after + 1;
+    }
+  }
+
   while (true) {
     if (tmp_reader.at_end()) {
       return -1;
@@ -1794,6 +2164,18 @@ void GdbServer::serve_replay(std::shared_ptr<ReplaySession> session,
                              const Target& target,
                              volatile bool* stop_replaying_to_target,
                              const ConnectionFlags& flags) {
+  // Nothing before target.event can be the target, so get there with plain
+  // replay steps rather than paying for the timeline's marks and
+  // checkpoints along the way.
+  while (target.event > 0 && session->trace_reader().time() + 1 < target.event &&
+         !(stop_replaying_to_target && *stop_replaying_to_target)) {
+    auto result =
+        session->replay_step(ReplaySession::StepConstraints(RUN_CONTINUE));
+    if (result.status == REPLAY_EXITED) {
+      LOG(info) << "Debugger was not launched before end of trace";
+      return;
+    }
+  }
   ReplayTimeline timeline(std::move(session));
 
   ReplayResult result;
@@ -1947,8 +2329,11 @@ static bool is_likely_interp(string fsname) {
 }
 
 #ifndef __BIONIC__
-static remote_ptr<void> base_addr_from_rendezvous(Task* t, string fname)
-{
+/**
+ * Find the dynamic linker's r_debug in |t|'s address space, via the
+ * _r_debug symbol of the interpreter rr saw at exec.
+ */
+static remote_ptr<NativeArch::r_debug> find_r_debug(Task* t) {
   remote_ptr<void> interpreter_base = t->vm()->saved_interpreter_base();
   if (!interpreter_base || !t->vm()->has_mapping(interpreter_base)) {
     return nullptr;
@@ -1963,21 +2348,21 @@ static remote_ptr<void> base_addr_from_rendezvous(Task* t, string fname)
   }
   ElfFileReader reader(ld);
   auto syms = reader.read_symbols(".dynsym", ".dynstr");
-  static const char r_debug[] = "_r_debug";
-  bool found = false;
-  uintptr_t r_debug_offset = 0;
-  for (size_t i = 0; i < syms.size(); ++i) {
-    if (!syms.is_name(i, r_debug)) {
-      continue;
-    }
-    r_debug_offset = syms.addr(i);
-    found = true;
+  vector<size_t> r_debug_syms = syms.find("_r_debug");
+  if (r_debug_syms.empty()) {
+    return nullptr;
   }
-  if (!found) {
+  uintptr_t r_debug_offset = syms.addr(r_debug_syms.back());
+  return interpreter_base.as_int() + r_debug_offset;
+}
+
+static remote_ptr<void> base_addr_from_rendezvous(Task* t, string fname)
+{
+  remote_ptr<NativeArch::r_debug> r_debug_remote = find_r_debug(t);
+  if (!r_debug_remote) {
     return nullptr;
   }
   bool ok = true;
-  remote_ptr<NativeArch::r_debug> r_debug_remote = interpreter_base.as_int()+r_debug_offset;
   remote_ptr<NativeArch::link_map> link_map = t->read_mem(REMOTE_PTR_FIELD(r_debug_remote, r_map), &ok);
   while (ok && link_map != nullptr) {
     if (fname == t->read_c_str(t->read_mem(REMOTE_PTR_FIELD(link_map, l_name), &ok), &ok)) {
@@ -1990,6 +2375,75 @@ static remote_ptr<void> base_addr_from_rendezvous(Task* t, string fname)
 }
 #endif
 
+string GdbServer::libraries_svr4(Task* t) {
+#ifdef __BIONIC__
+  (void)t;
+  return string();
+#else
+  // We only know the native link_map layout. gdb falls back to walking
+  // the list itself if we fail.
+  if (t->arch() != NativeArch::arch()) {
+    return string();
+  }
+  uint64_t generation = t->vm()->mapping_generation();
+  if (generation == libraries_svr4_generation) {
+    return libraries_svr4_cache;
+  }
+  remote_ptr<NativeArch::r_debug> r_debug_remote = find_r_debug(t);
+  if (!r_debug_remote) {
+    return string();
+  }
+  bool ok = true;
+  auto r_debug = t->read_mem(r_debug_remote, &ok);
+  if (!ok || !r_debug.r_map) {
+    return string();
+  }
+
+  // The first entry is the executable; gdb wants it as main-lm.
+  stringstream xml;
+  xml << "<library-list-svr4 version=\"1.0\" main-lm=\"" << HEX(r_debug.r_map.val)
+      << "\">";
+  remote_ptr<NativeArch::link_map> lm = r_debug.r_map.rptr();
+  auto entry = t->read_mem(lm, &ok);
+  size_t count = 0;
+  while (ok && entry.l_next) {
+    lm = entry.l_next.rptr();
+    entry = t->read_mem(lm, &ok);
+    if (!ok) {
+      break;
+    }
+    string name = t->read_c_str(entry.l_name.rptr(), &ok);
+    if (!ok) {
+      break;
+    }
+    // Skip entries whose dynamic section isn't mapped (anything the
+    // dynamic linker hasn't finished loading, or stale list entries).
+    if (name.empty() || !t->vm()->has_mapping(entry.l_ld.rptr())) {
+      continue;
+    }
+    xml << "<library name=\"" << xml_escape(name) << "\" lm=\"" << HEX(lm.as_int())
+        << "\" l_addr=\"" << HEX(entry.l_addr.val) << "\" l_ld=\""
+        << HEX(entry.l_ld.val) << "\"/>";
+    ++count;
+  }
+  if (!ok) {
+    return string();
+  }
+  xml << "</library-list-svr4>";
+  LOG(debug) << "Built libraries-svr4 list of " << count << " libraries";
+
+  // While the dynamic linker is changing the list, the list can change
+  // without the mappings changing, so don't cache it.
+  if (r_debug.r_state == NativeArch::r_debug::RT_CONSISTENT) {
+    libraries_svr4_generation = generation;
+    libraries_svr4_cache = xml.str();
+    return libraries_svr4_cache;
+  }
+  libraries_svr4_generation = 0;
+  return xml.str();
+#endif
+}
+
 int GdbServer::open_file(Session& session, Task* continue_task, const std::string& file_name) {
   // XXX should we require file_scope_pid == 0 here?
   ScopedFd contents;
@@ -79,6 +79,16 @@ public:
                                   const ExtraRegisters& extra_regs,
                                   GdbServerRegister which);
 
+  /**
+   * Find occurrences of |find| lying entirely within |where| in |t|'s memory
+   * and append the addresses of up to |max_results| of them to |results|,
+   * in ascending order.
+   */
+  static void search_memory(Task* t, const MemoryRange& where,
+                            const std::vector<uint8_t>& find,
+                            size_t max_results,
+                            std::vector<remote_ptr<void>>* results);
+
   // Null if this is an emergency debug session.
   ReplayTimeline* timeline() { return timeline_; }
 
@@ -152,6 +162,13 @@ private:
    * resuming execution in that session.
    */
   GdbRequest divert(ReplaySession& replay);
+  /**
+   * If the debugger has been making function calls at this stop and has
+   * nothing for us to do right now, clone the next diversion ahead of time.
+   */
+  void maybe_prepare_spare_diversion();
+  void discard_spare_diversion();
+  void maybe_prewarm_checkpoints();
 
   /**
    * If |break_status| indicates a stop that we should report to gdb,
@@ -177,6 +194,9 @@ private:
    * file descriptor.
    */
   int open_file(Session& session, Task *continue_task, const std::string& file_name);
+  // The <library-list-svr4> document for |t|'s process, or empty if it
+  // can't be built.
+  std::string libraries_svr4(Task* t);
 
   /**
    * Allocates debugger-owned memory region.
@@ -211,6 +231,15 @@ private:
   // Don't call this if the session is a diversion, write to the diversion directly
   // since it has the values.
   bool write_debugger_mem(ThreadGroupUid tguid, MemoryRange range, const uint8_t* values);
+  // Read tracee memory for the debugger through mem_read_cache. Returns the
+  // number of bytes read, like read_bytes_fallible.
+  ssize_t read_mem_cached(Task* t, remote_ptr<void> addr, size_t len,
+                          uint8_t* buf);
+  // Read [addr, addr + len) of |t|'s memory as the debugger should see it:
+  // debugger memory included, our breakpoints hidden. The result is
+  // truncated where memory stops being readable.
+  std::vector<uint8_t> read_mem_for_debugger(Session& session, Task* t,
+                                             remote_ptr<void> addr, size_t len);
   // Add mappings of the debugger memory to the session.
   // If `addr` is null then all mappings are added, otherwise only mappings
   // at that address are added.
@@ -315,6 +344,37 @@ private:
     ExtraRegisters extra_regs;
   };
   std::unordered_map<int, SavedRegisters> saved_register_states;
+
+  // Pages of tracee memory read for the debugger since the last request
+  // that could change memory, keyed by address space and page address. A
+  // page's vector holds only the bytes that could be read.
+  std::map<std::pair<AddressSpaceUid, remote_ptr<void>>, std::vector<uint8_t>>
+      mem_read_cache;
+
+  // The last libraries_svr4() result and the AddressSpace mapping generation
+  // it was built for. Only cached while the dynamic linker's list is
+  // consistent.
+  uint64_t libraries_svr4_generation;
+  std::string libraries_svr4_cache;
+
+  // qMemoryRegionInfo answers derived from the mappings of the address space
+  // whose mapping generation is |mem_info_generation|, keyed by region start.
+  // The regions are disjoint.
+  struct MemInfo {
+    MemoryRange range;
+    int prot;
+    std::string name;
+  };
+  uint64_t mem_info_generation;
+  std::map<remote_ptr<void>, MemInfo> mem_info_cache;
+
+  // A diversion cloned from |spare_diversion_source| while the debugger was
+  // idle, so the next call expression at this stop needn't wait for a clone.
+  // Discarded by any request that could change the replay session.
+  DiversionSession::shr_ptr spare_diversion;
+  ReplaySession* spare_diversion_source;
+  // Set after a diversion ends; the debugger is likely to start another.
+  bool want_spare_diversion;
 };
 
 } // namespace rr
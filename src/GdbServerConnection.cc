@@ -15,6 +15,8 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -120,6 +122,18 @@ void GdbServerConnection::await_debugger(ScopedFd& listen_fd) {
   sock_fd = ScopedFd(accept(listen_fd, nullptr, nullptr));
   // We might restart this debugging session, so don't set the
   // socket fd CLOEXEC.
+
+  // We send the '+' ack and the reply to a packet in separate writes. With
+  // Nagle's algorithm the reply then waits for the ack's ACK, which the
+  // debugger's side may delay by tens of milliseconds, and on a remote
+  // connection every step pays for it. This fails harmlessly for
+  // non-TCP sockets.
+  int nodelay = 1;
+  if (setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                 sizeof(nodelay))) {
+    LOG(debug) << "Can't set TCP_NODELAY on debugger socket: "
+               << errno_name(errno);
+  }
 }
 
 /**
@@ -335,13 +349,13 @@ bool GdbServerConnection::skip_to_packet_start() {
   return true;
 }
 
-bool GdbServerConnection::sniff_packet() {
+bool GdbServerConnection::sniff_packet(int timeout_ms) {
   if (skip_to_packet_start()) {
     /* We've already seen a (possibly partial) packet. */
     return true;
   }
   parser_assert(inbuf.empty());
-  return poll_incoming(sock_fd, 0 /*don't wait*/);
+  return poll_incoming(sock_fd, timeout_ms);
 }
 
 void GdbServerConnection::read_packet() {
@@ -585,6 +599,37 @@ bool GdbServerConnection::xfer(const char* name, char* args) {
     return true;
   }
 
+  if (!strcmp(name, "libraries-svr4")) {
+    if (strcmp(mode, "read")) {
+      write_packet("");
+      return false;
+    }
+
+    // We don't advertise augmented-libraries-svr4-read, so |annex| is
+    // always empty and we send the whole list.
+    req = GdbRequest(DREQ_GET_LIBRARIES_SVR4);
+    req.target = query_thread;
+    req.mem().addr = offset;
+    req.mem().len = len;
+    return true;
+  }
+
+  if (!strcmp(name, "threads")) {
+    if (strcmp(annex, "")) {
+      write_packet("E00");
+      return false;
+    }
+    if (strcmp(mode, "read")) {
+      write_packet("");
+      return false;
+    }
+
+    req = GdbRequest(DREQ_GET_THREADS);
+    req.mem().addr = offset;
+    req.mem().len = len;
+    return true;
+  }
+
   if (!strcmp(name, "siginfo")) {
     if (strcmp(annex, "")) {
       write_packet("E00");
@@ -763,6 +808,9 @@ bool GdbServerConnection::query(char* payload) {
                  ";qXfer:features:read+"
                  ";qXfer:auxv:read+"
                  ";qXfer:exec-file:read+"
+                 ";qXfer:libraries-svr4:read+"
+                 ";qXfer:threads:read+"
+                 ";MultiMemRead+"
                  ";qXfer:siginfo:read+"
                  ";qXfer:siginfo:write+"
                  ";multiprocess+"
@@ -1136,6 +1184,8 @@ bool GdbServerConnection::process_vpacket(char* payload) {
 
       GdbActionType action;
       int signal_to_deliver = 0;
+      uintptr_t range_start = 0;
+      uintptr_t range_end = 0;
       char* endptr = NULL;
       switch (cmd[0]) {
         case 'C':
@@ -1152,6 +1202,15 @@ bool GdbServerConnection::process_vpacket(char* payload) {
         case 's':
           action = ACTION_STEP;
           break;
+        case 'r':
+          action = ACTION_STEP;
+          range_start = strtoul(cmd + 1, &endptr, 16);
+          if (*endptr == ',') {
+            range_end = strtoul(endptr + 1, &endptr, 16);
+          } else {
+            endptr = cmd;
+          }
+          break;
         default:
           UNHANDLED_REQ() << "Unhandled vCont command " << cmd << "(" << args
                           << ")";
@@ -1170,8 +1229,12 @@ bool GdbServerConnection::process_vpacket(char* payload) {
         has_default_action = true;
         default_action =
             GdbContAction(action, GdbThreadId::ALL, signal_to_deliver);
+        default_action.range_start = range_start;
+        default_action.range_end = range_end;
       } else {
         actions.push_back(GdbContAction(action, target, signal_to_deliver));
+        actions.back().range_start = range_start;
+        actions.back().range_end = range_end;
       }
     }
 
@@ -1186,7 +1249,7 @@ bool GdbServerConnection::process_vpacket(char* payload) {
 
   if (!strcmp("Cont?", name)) {
     LOG(debug) << "debugger queries which continue commands we support";
-    write_packet("vCont;c;C;s;S;");
+    write_packet("vCont;c;C;s;S;r;");
     return false;
   }
 
@@ -1328,6 +1391,39 @@ static string to_string(const vector<uint8_t>& bytes, size_t max_len) {
   return ss.str();
 }
 
+bool GdbServerConnection::multi_mem_read(char* args) {
+  // ranges:<addr>,<len>[,<addr>,<len>]...;
+  req = GdbRequest(DREQ_MULTI_MEM_READ);
+  req.target = query_thread;
+  while (*args) {
+    char* key_end = strchr(args, ':');
+    parser_assert(key_end);
+    *key_end = '\0';
+    char* value = key_end + 1;
+    char* value_end = strchr(value, ';');
+    if (value_end) {
+      *value_end = '\0';
+    }
+    if (!strcmp(args, "ranges")) {
+      while (*value) {
+        uintptr_t addr = strtoul(value, &value, 16);
+        parser_assert(',' == *value++);
+        uintptr_t len = strtoul(value, &value, 16);
+        parser_assert(!*value || ',' == *value);
+        if (*value) {
+          ++value;
+        }
+        req.multi_mem().ranges.push_back(
+            MemoryRange(remote_ptr<void>(addr), len));
+      }
+    }
+    args = value_end ? value_end + 1 : value + strlen(value);
+  }
+  LOG(debug) << "debugger requests " << req.multi_mem().ranges.size()
+             << " memory ranges";
+  return true;
+}
+
 bool GdbServerConnection::process_packet() {
   parser_assert(
       INTERRUPT_CHAR == inbuf[0] ||
@@ -1393,8 +1489,18 @@ bool GdbServerConnection::process_packet() {
       ret = true;
       break;
     case 'j':
-      // Prefer to avoid implementing any JSON-formatted-output
-      // packets unless we have to
+      if (!strcmp(payload, "ThreadsInfo")) {
+        // LLDB asks for this at every stop. Answering saves it a round
+        // trip per thread for registers and stop reasons.
+        LOG(debug) << "debugger asks for threads info";
+        req = GdbRequest(DREQ_GET_THREADS_INFO);
+        ret = true;
+        break;
+      }
+      // Prefer to avoid implementing any other JSON-formatted-output
+      // packets unless we have to. (jThreadExtendedInfo only carries
+      // Darwin libdispatch details, which lldb-server on Linux doesn't
+      // provide either.)
       write_packet("");
       ret = false;
       break;
@@ -1416,6 +1522,10 @@ bool GdbServerConnection::process_packet() {
       ret = true;
       break;
     case 'M':
+      if (!strncmp(payload, "ultiMemRead:", 12)) {
+        ret = multi_mem_read(payload + 12);
+        break;
+      }
       req = GdbRequest(DREQ_SET_MEM);
       req.target = query_thread;
       req.mem().addr = strtoul(payload, &payload, 16);
@@ -1904,6 +2014,20 @@ void GdbServerConnection::reply_get_exec_file(const string& exec_file) {
   consume_request();
 }
 
+void GdbServerConnection::reply_get_libraries_svr4(
+    const string& library_list) {
+  DEBUG_ASSERT(DREQ_GET_LIBRARIES_SVR4 == req.type);
+
+  if (!library_list.empty()) {
+    write_xfer_response(library_list.data(), library_list.size(),
+                        req.mem().addr, req.mem().len);
+  } else {
+    write_packet("E01");
+  }
+
+  consume_request();
+}
+
 void GdbServerConnection::reply_get_is_thread_alive(bool alive) {
   DEBUG_ASSERT(DREQ_GET_IS_THREAD_ALIVE == req.type);
 
@@ -2122,6 +2246,94 @@ void GdbServerConnection::reply_get_thread_list(const vector<ExtendedTaskId>& th
   consume_request();
 }
 
+void GdbServerConnection::reply_get_threads(
+    const vector<ThreadDescription>& threads) {
+  DEBUG_ASSERT(DREQ_GET_THREADS == req.type);
+
+  if (req.mem().addr == 0 || threads_xml.empty()) {
+    stringstream sstr;
+    sstr << "<?xml version=\"1.0\"?>\n<threads>\n";
+    for (auto& t : threads) {
+      if (tguid != t.id.tguid) {
+        continue;
+      }
+      sstr << "<thread id=\"" << format_thread_id(t.id) << "\"";
+      if (t.core >= 0) {
+        sstr << " core=\"" << t.core << "\"";
+      }
+      sstr << " name=\"" << xml_escape(t.name) << "\"/>\n";
+    }
+    sstr << "</threads>\n";
+    threads_xml = sstr.str();
+  }
+  write_xfer_response(threads_xml.data(), threads_xml.size(), req.mem().addr,
+                      req.mem().len);
+
+  consume_request();
+}
+
+void GdbServerConnection::reply_get_threads_info(
+    const vector<ThreadStopInfo>& threads) {
+  DEBUG_ASSERT(DREQ_GET_THREADS_INFO == req.type);
+
+  stringstream sstr;
+  sstr << '[';
+  bool first = true;
+  for (auto& t : threads) {
+    if (tguid != t.id.tguid) {
+      continue;
+    }
+    if (!first) {
+      sstr << ',';
+    }
+    first = false;
+    sstr << "{\"tid\":" << t.id.tuid.tid() << ",\"name\":\""
+         << json_escape(t.name) << '"';
+    if (t.core >= 0) {
+      sstr << ",\"core\":" << t.core;
+    }
+    if (t.signal) {
+      sstr << ",\"reason\":\"signal\",\"signal\":" << to_gdb_signum(t.signal);
+    }
+    sstr << ",\"registers\":{";
+    bool first_reg = true;
+    for (auto& reg : t.expedited_registers) {
+      if (!reg.defined) {
+        continue;
+      }
+      char buf[2 * GdbServerRegisterValue::MAX_SIZE + 1];
+      print_reg_value(reg, buf);
+      sstr << (first_reg ? "" : ",") << '"' << int(reg.name) << "\":\""
+           << buf << '"';
+      first_reg = false;
+    }
+    sstr << "}}";
+  }
+  sstr << ']';
+  string json = sstr.str();
+  write_binary_packet("", reinterpret_cast<const uint8_t*>(json.data()),
+                      json.size());
+
+  consume_request();
+}
+
+void GdbServerConnection::reply_multi_mem_read(
+    const vector<vector<uint8_t>>& mems) {
+  DEBUG_ASSERT(DREQ_MULTI_MEM_READ == req.type);
+
+  stringstream sstr;
+  sstr << hex;
+  vector<uint8_t> data;
+  for (size_t i = 0; i < mems.size(); ++i) {
+    sstr << (i ? "," : "") << mems[i].size();
+    data.insert(data.end(), mems[i].begin(), mems[i].end());
+  }
+  sstr << ';';
+  write_binary_packet(sstr.str().c_str(), data.data(), data.size());
+
+  consume_request();
+}
+
 void GdbServerConnection::reply_watchpoint_request(bool ok) {
   DEBUG_ASSERT(DREQ_WATCH_FIRST <= req.type && req.type <= DREQ_WATCH_LAST);
 
@@ -133,6 +133,10 @@ enum GdbRequestType {
   //
   // Uses .mem for offset/len.
   DREQ_READ_SIGINFO,
+  // qXfer:libraries-svr4:read. Uses .mem for offset/len.
+  DREQ_GET_LIBRARIES_SVR4,
+  // qXfer:threads:read. Uses .mem for offset/len.
+  DREQ_GET_THREADS,
   DREQ_SEARCH_MEM_BINARY,
   DREQ_MEM_INFO,
   DREQ_MEM_FIRST = DREQ_GET_MEM,
@@ -180,6 +184,11 @@ enum GdbRequestType {
   // vFile:close packet, uses params.file_close.
   DREQ_FILE_CLOSE,
 
+  // LLDB jThreadsInfo. No parameters.
+  DREQ_GET_THREADS_INFO,
+  // LLDB MultiMemRead, uses params.multi_mem
+  DREQ_MULTI_MEM_READ,
+
   // Uses params.mem_alloc
   DREQ_MEM_ALLOC,
   // Uses params.mem_free
@@ -207,6 +216,14 @@ struct GdbContAction {
   GdbActionType type;
   GdbThreadId target;
   int signal_to_deliver;
+  // For ACTION_STEP from vCont;r: keep stepping while the pc is in
+  // [range_start, range_end). Empty for plain steps.
+  remote_code_ptr range_start;
+  remote_code_ptr range_end;
+
+  bool in_step_range(remote_code_ptr pc) const {
+    return range_start <= pc && pc < range_end;
+  }
 };
 
 /**
@@ -248,6 +265,8 @@ struct GdbRequest {
       mem_alloc_ = other.mem_alloc_;
     } else if (type == DREQ_MEM_FREE) {
       mem_free_ = other.mem_free_;
+    } else if (type == DREQ_MULTI_MEM_READ) {
+      multi_mem_ = other.multi_mem_;
     } else if (type == DREQ_RESTORE_REGISTER_STATE) {
       restore_register_state_ = other.restore_register_state_;
     }
@@ -325,6 +344,9 @@ struct GdbRequest {
   struct RestoreRegisterState {
     int state_index = 0;
   } restore_register_state_;
+  struct MultiMem {
+    std::vector<MemoryRange> ranges;
+  } multi_mem_;
 
   Mem& mem() {
     DEBUG_ASSERT(type >= DREQ_MEM_FIRST && type <= DREQ_MEM_LAST);
@@ -446,6 +468,14 @@ struct GdbRequest {
     DEBUG_ASSERT(type == DREQ_RESTORE_REGISTER_STATE);
     return restore_register_state_;
   }
+  MultiMem& multi_mem() {
+    DEBUG_ASSERT(type == DREQ_MULTI_MEM_READ);
+    return multi_mem_;
+  }
+  const MultiMem& multi_mem() const {
+    DEBUG_ASSERT(type == DREQ_MULTI_MEM_READ);
+    return multi_mem_;
+  }
 
   /**
    * Return nonzero if this requires that program execution be resumed
@@ -529,6 +559,23 @@ public:
     uintptr_t pc;
   };
 
+  // An entry in the qXfer:threads document.
+  struct ThreadDescription {
+    ExtendedTaskId id;
+    std::string name;
+    // -1 if unknown
+    int core;
+  };
+
+  // An entry in the jThreadsInfo reply.
+  struct ThreadStopInfo : ThreadDescription {
+    // The registers LLDB needs at every stop (pc, sp, fp, flags), so it
+    // needn't ask for them per thread
+    std::vector<GdbServerRegisterValue> expedited_registers;
+    // The signal the thread stopped for, or 0
+    int signal;
+  };
+
   /**
    * Notify the host that a resume request has "finished", i.e., the
    * target has stopped executing for some reason.  |sig| is the signal
@@ -557,6 +604,13 @@ public:
    */
   void reply_get_exec_file(const std::string& exec_file);
 
+  /**
+   * Reply with the slice of |library_list|, a <library-list-svr4> XML
+   * document, that the request asked for. |library_list.empty()| if the
+   * list isn't available.
+   */
+  void reply_get_libraries_svr4(const std::string& library_list);
+
   /**
    * |alive| is true if the requested thread is alive, false if dead.
    */
@@ -642,6 +696,25 @@ public:
    */
   void reply_get_thread_list(const std::vector<ExtendedTaskId>& threads);
 
+  /**
+   * Reply to qXfer:threads:read with the requested slice of a <threads>
+   * document describing |threads|. The document is built when gdb reads
+   * from offset 0 and reused for its later chunks, so they're consistent.
+   */
+  void reply_get_threads(const std::vector<ThreadDescription>& threads);
+
+  /**
+   * Reply to jThreadsInfo with a JSON description of |threads|.
+   */
+  void reply_get_threads_info(const std::vector<ThreadStopInfo>& threads);
+
+  /**
+   * Reply to MultiMemRead with the bytes read from each requested range.
+   * Each entry may be shorter than its range if the rest couldn't be
+   * read.
+   */
+  void reply_multi_mem_read(const std::vector<std::vector<uint8_t>>& mems);
+
   /**
    * |ok| is true if the request was successfully applied, false if
    * not.
@@ -738,9 +811,17 @@ public:
 
   /**
    * Return true if there's a new packet to be read/process (whether
-   * incomplete or not), and false if there isn't one.
+   * incomplete or not), and false if there isn't one. Waits up to
+   * |timeout_ms| milliseconds for one to arrive.
    */
-  bool sniff_packet();
+  bool sniff_packet(int timeout_ms = 0);
+  /**
+   * Return true if get_request() would wait for the debugger, i.e. we
+   * haven't been asked to resume or restart.
+   */
+  bool awaiting_request() const {
+    return req.type != DREQ_RESTART && !req.is_resume_request();
+  }
 
   const Features& features() { return features_; }
 
@@ -812,6 +893,7 @@ private:
    * false if we already handled the packet internally.
    */
   bool xfer(const char* name, char* args);
+  bool multi_mem_read(char* args);
   /**
    * Return true if we need to do something in a debugger request,
    * false if we already handled the packet internally.
@@ -848,6 +930,8 @@ private:
                               const char *reason);
   void send_file_error_reply(int system_errno);
   std::string format_thread_id(ExtendedTaskId thread);
+  // The last qXfer:threads document, for reads at nonzero offsets
+  std::string threads_xml;
 
   // Current request to be processed.
   GdbRequest req;
@@ -2,6 +2,8 @@
 
 #include "GdbServerExpression.h"
 
+#include <map>
+
 #include "GdbServer.h"
 #include "Task.h"
 #include "core.h"
@@ -68,11 +70,18 @@ enum Opcode {
   OP_printf = 0x34,
 };
 
+/**
+ * Memory values loaded while evaluating an expression, keyed by address and
+ * size. Shared by all the bytecode variants of an expression so each
+ * location is only read from the tracee once per evaluation.
+ */
+typedef map<pair<uint64_t, size_t>, uint64_t> LoadCache;
+
 struct ExpressionState {
   typedef GdbServerExpression::Value Value;
 
-  ExpressionState(const vector<uint8_t>& bytecode)
-      : bytecode(bytecode), pc(0), error(false), end(false) {}
+  ExpressionState(const vector<uint8_t>& bytecode, LoadCache& loads)
+      : bytecode(bytecode), loads(loads), pc(0), error(false), end(false) {}
 
   void set_error() { error = true; }
 
@@ -123,12 +132,19 @@ struct ExpressionState {
       // Don't do unnecessary syscalls if we're already in an error state.
       return;
     }
+    auto key = make_pair(addr, sizeof(T));
+    auto it = loads.find(key);
+    if (it != loads.end()) {
+      push(it->second);
+      return;
+    }
     bool ok = true;
     T v = t->read_mem(remote_ptr<T>(addr), &ok);
     if (!ok) {
       set_error();
       return;
     }
+    loads[key] = v;
     push(v);
   }
   void pick(size_t offset) {
@@ -260,8 +276,16 @@ struct ExpressionState {
       case OP_const64:
         return push(fetch<uint64_t>());
       case OP_reg: {
-        GdbServerRegisterValue v = GdbServer::get_reg(t->regs(), t->extra_regs(),
-                                                GdbServerRegister(fetch<uint16_t>()));
+        // Conditions almost always use general-purpose registers, so avoid
+        // fetching the extra registers from the tracee unless we need them.
+        GdbServerRegisterValue v;
+        memset(&v, 0, sizeof(v));
+        v.name = GdbServerRegister(fetch<uint16_t>());
+        v.size = t->regs().read_register(&v.value[0], v.name, &v.defined);
+        if (!v.defined) {
+          v.size = t->extra_regs().read_register(&v.value[0], v.name,
+                                                 &v.defined);
+        }
         if (!v.defined) {
           set_error();
           return;
@@ -289,6 +313,7 @@ struct ExpressionState {
   }
 
   const vector<uint8_t>& bytecode;
+  LoadCache& loads;
   vector<Value> stack;
   size_t pc;
   bool error;
@@ -430,9 +455,10 @@ bool GdbServerExpression::evaluate(ReplayTask* t, Value* result) const {
   }
 
   bool first = true;
+  LoadCache loads;
 
   for (auto& b : bytecode_variants) {
-    ExpressionState state(b);
+    ExpressionState state(b, loads);
     for (int steps = 0; !state.end; ++steps) {
       if (steps >= 10000 || state.error) {
         return false;
@@ -3,7 +3,7 @@
 #ifndef RR_HASTASKSET_H_
 #define RR_HASTASKSET_H_
 
-#include <set>
+#include <unordered_set>
 
 namespace rr {
 
@@ -17,7 +17,10 @@ public:
   // Has virtual methods, therefore must have virtual destructor
   virtual ~HasTaskSet() {}
 
-  typedef std::set<Task*> TaskSet;
+  // Hashed so insert/erase/has_task stay O(1) for processes with many
+  // threads. Iteration order is unspecified, as it always was for a set
+  // ordered by pointer value.
+  typedef std::unordered_set<Task*> TaskSet;
 
   const TaskSet& task_set() const { return tasks; }
 
@@ -4,6 +4,7 @@
 #include <dirent.h>
 
 #include <algorithm>
+#include <fstream>
 #include <iomanip>
 #include <memory>
 #include <numeric>
@@ -77,8 +78,10 @@ struct TraceInfo {
   string name;
   struct timespec ctime;
   string exit;
+  string exe;
+  bool has_summary;
 
-  TraceInfo(string in_name) : name(in_name) {}
+  TraceInfo(string in_name) : name(in_name), has_summary(false) {}
 };
 
 static bool compare_by_name(const TraceInfo& at, const TraceInfo& bt) {
@@ -96,11 +99,12 @@ static bool get_folder_size(string dir_name, string& size_str) {
 
   size_t bytes = 0;
   while (struct dirent* ent = readdir(dir)) {
-    string path = dir_name + "/" + ent->d_name;
-
+    // Relative to the directory fd, so the kernel doesn't walk the whole
+    // path again for every entry.
     struct stat st;
-    if (stat(path.c_str(), &st) == -1) {
-      cerr << "stat " << path << " failed\n";
+    if (fstatat(dirfd(dir), ent->d_name, &st, 0) == -1) {
+      cerr << "stat " << dir_name << "/" << ent->d_name << " failed\n";
+      closedir(dir);
       return false;
     }
 
@@ -144,6 +148,38 @@ static string get_exec_path(TraceReader& reader) {
   return string();
 }
 
+/**
+ * The exit status and executable of a complete trace never change, so `rr ls
+ * -l` caches them in this file in the trace directory instead of decoding
+ * the task events every time.
+ */
+static string summary_path(const string& trace_dir) {
+  return trace_dir + "/ls_summary";
+}
+
+static bool read_summary(const string& trace_dir, string* exit, string* exe) {
+  ifstream in(summary_path(trace_dir));
+  return getline(in, *exit) && getline(in, *exe);
+}
+
+// The summary is only a cache, so failing to write it isn't an error.
+static void write_summary(const string& trace_dir, const string& exit,
+                          const string& exe) {
+  string path = summary_path(trace_dir);
+  string tmp_path = path + "." + to_string(getpid());
+  {
+    ofstream out(tmp_path);
+    out << exit << "\n" << exe << "\n";
+    if (!out.good()) {
+      unlink(tmp_path.c_str());
+      return;
+    }
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+    unlink(tmp_path.c_str());
+  }
+}
+
 string find_exit_code(pid_t pid, const vector<TraceTaskEvent>& events,
                       size_t current_event,
                       const map<pid_t, pid_t> current_tid_to_pid);
@@ -174,7 +210,12 @@ static int ls(const string& traces_dir, const LsFlags& flags, FILE* out) {
     }
 
     if (flags.full_listing) {
-      TraceReader trace(traces_dir + "/" + trace_dir->d_name);
+      string dir_name = traces_dir + "/" + trace_dir->d_name;
+      if (read_summary(dir_name, &traces.back().exit, &traces.back().exe)) {
+        traces.back().has_summary = true;
+        continue;
+      }
+      TraceReader trace(dir_name);
 
       vector<TraceTaskEvent> events;
       while (true) {
@@ -243,12 +284,19 @@ static int ls(const string& traces_dir, const LsFlags& flags, FILE* out) {
 
     string folder_size = "????";
     string exe = "(incomplete)";
-    string version_file = traces_dir + "/" + t.name + "/version";
-    struct stat st;
-    if (stat(version_file.c_str(), &st) != -1) {
-      TraceReader reader(traces_dir + "/" + t.name);
-      get_folder_size(reader.dir(), folder_size);
-      exe = get_exec_path(reader);
+    string dir_name = traces_dir + "/" + t.name;
+    if (t.has_summary) {
+      get_folder_size(dir_name, folder_size);
+      exe = t.exe;
+    } else {
+      string version_file = dir_name + "/version";
+      struct stat st;
+      if (stat(version_file.c_str(), &st) != -1) {
+        TraceReader reader(dir_name);
+        get_folder_size(reader.dir(), folder_size);
+        exe = get_exec_path(reader);
+        write_summary(reader.dir(), t.exit, exe);
+      }
     }
 
     fprintf(out, "%-*s %s %5s %6s %s\n", max_name_size, t.name.c_str(),
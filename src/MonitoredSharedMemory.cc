@@ -86,10 +86,35 @@ void MonitoredSharedMemory::check_for_changes(RecordTask* t,
       return;
     }
   }
-  if (!memcmp(m.local_addr, real_mem, size)) {
-    return;
+  // Compare and record page by page so that a small update to a large
+  // mapping only records the pages that changed. Adjacent changed pages
+  // are recorded as one run.
+  uint8_t* local = static_cast<uint8_t*>(m.local_addr);
+  size_t run_start = 0;
+  size_t run_size = 0;
+  for (size_t offset = 0; offset < size; offset += page_size()) {
+    size_t bytes = min(page_size(), size - offset);
+    if (memcmp(local + offset, real_mem + offset, bytes)) {
+      if (!run_size) {
+        run_start = offset;
+      }
+      run_size += bytes;
+      continue;
+    }
+    if (run_size) {
+      record_changes(t, m, run_start, run_size);
+      run_size = 0;
+    }
   }
-  memcpy(m.local_addr, real_mem, size);
-  t->record_local(m.map.start(), size, real_mem);
+  if (run_size) {
+    record_changes(t, m, run_start, run_size);
+  }
+}
+
+void MonitoredSharedMemory::record_changes(RecordTask* t,
+                                           const AddressSpace::Mapping& m,
+                                           size_t offset, size_t len) {
+  memcpy(static_cast<uint8_t*>(m.local_addr) + offset, real_mem + offset, len);
+  t->record_local(m.map.start() + offset, len, real_mem + offset);
 }
 }
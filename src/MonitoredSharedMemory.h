@@ -22,7 +22,8 @@ class RecordTask;
  * and replace the tracee's mapping with a "shadow buffer" that's only shared
  * with rr. Then periodically rr reads the real memory, and if it doesn't match
  * the shadow buffer, we update the shadow buffer with the new values and
- * record that we did so.
+ * record that we did so. Only the pages that changed are copied and recorded,
+ * so a ring buffer or similar with sparse updates stays cheap to record.
  *
  * Currently we check the real memory after each syscall exit. This ensures
  * that if the tracee is woken up by some IPC mechanism (or after sched_yield),
@@ -44,6 +45,8 @@ public:
 
 private:
   void check_for_changes(RecordTask* t, AddressSpace::Mapping& m);
+  void record_changes(RecordTask* t, const AddressSpace::Mapping& m,
+                      size_t offset, size_t len);
 
   MonitoredSharedMemory(uint8_t* real_mem, size_t size)
       : real_mem(real_mem), size(size) {}
@@ -4,7 +4,9 @@
 
 #include <limits.h>
 #include <linux/auxvec.h>
+#include <sys/stat.h>
 
+#include <fstream>
 #include <sstream>
 
 #include "AddressSpace.h"
@@ -15,6 +17,7 @@
 #include "RecordTask.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
+#include "TraceStream.h"
 #include "core.h"
 #include "kernel_abi.h"
 #include "kernel_metadata.h"
@@ -207,6 +210,35 @@ void substitute_extended_jump<X64TrapInstructionStubExtendedJump>(
                                          target_addr);
 }
 
+/**
+ * Take a released stub of exactly `size` bytes for which `in_range` is true,
+ * if there is one.
+ */
+template <typename InRange>
+static remote_ptr<uint8_t> reuse_free_stub(
+    vector<Monkeypatcher::ExtendedJumpPage>& pages, size_t size,
+    InRange in_range) {
+  for (auto& p : pages) {
+    auto it = p.free_stubs.find(size);
+    if (it == p.free_stubs.end()) {
+      continue;
+    }
+    auto& stubs = it->second;
+    for (size_t i = 0; i < stubs.size(); ++i) {
+      remote_ptr<uint8_t> stub = stubs[i];
+      if (in_range(stub)) {
+        stubs[i] = stubs.back();
+        stubs.pop_back();
+        if (stubs.empty()) {
+          p.free_stubs.erase(it);
+        }
+        return stub;
+      }
+    }
+  }
+  return nullptr;
+}
+
 /**
  * Allocate an extended jump in an extended jump page and return its address.
  * The resulting address must be within 2G of from_end, and the instruction
@@ -216,6 +248,15 @@ template <typename ExtendedJumpPatch>
 static remote_ptr<uint8_t> allocate_extended_jump_x86ish(
     RecordTask* t, vector<Monkeypatcher::ExtendedJumpPage>& pages,
     remote_ptr<uint8_t> from_end) {
+  remote_ptr<uint8_t> reused = reuse_free_stub(
+      pages, ExtendedJumpPatch::size, [from_end](remote_ptr<uint8_t> stub) {
+        int64_t offset = stub - from_end;
+        return (int32_t)offset == offset;
+      });
+  if (!reused.is_null()) {
+    return reused;
+  }
+
   Monkeypatcher::ExtendedJumpPage* page = nullptr;
   for (auto& p : pages) {
     remote_ptr<uint8_t> page_jump_start = p.addr + p.allocated;
@@ -363,6 +404,17 @@ static uint32_t encode_extended_jump_aarch64(std::vector<uint32_t> &buff,
 constexpr int32_t aarch64_b_max_offset = ((1 << 25) - 1) * 4;
 constexpr int32_t aarch64_b_min_offset = (1 << 25) * -4;
 
+// Fill in the branch back to the patch site for a stub placed at `jump_addr`
+static void set_return_jump_aarch64(std::vector<uint32_t>& inst_buff,
+                                    uint32_t ret_idx,
+                                    remote_ptr<uint8_t> jump_addr,
+                                    uint64_t return_addr) {
+  const uint64_t reverse_jump_addr = jump_addr.as_int() + ret_idx * 4;
+  const int64_t reverse_offset = int64_t(return_addr - reverse_jump_addr);
+  const uint32_t offset_imm26 = (reverse_offset >> 2) & 0x03ffffff;
+  inst_buff[ret_idx] = 0x14000000 | offset_imm26;
+}
+
 static remote_ptr<uint8_t> allocate_extended_jump_aarch64(
     RecordTask* t, vector<Monkeypatcher::ExtendedJumpPage>& pages,
     remote_ptr<uint8_t> svc_ip, uint64_t to, std::vector<uint32_t> &inst_buff) {
@@ -390,6 +442,17 @@ static remote_ptr<uint8_t> allocate_extended_jump_aarch64(
                                       -aarch64_b_max_offset + 4 - int(ret_idx) * 4);
   int64_t patch_offset_max = std::min(aarch64_b_max_offset,
                                       -aarch64_b_min_offset + 4 - int(ret_idx) * 4);
+  remote_ptr<uint8_t> reused = reuse_free_stub(
+      pages, total_patch_size,
+      [svc_ip, patch_offset_min, patch_offset_max](remote_ptr<uint8_t> stub) {
+        int64_t offset = stub - svc_ip;
+        return offset <= patch_offset_max && offset >= patch_offset_min;
+      });
+  if (!reused.is_null()) {
+    set_return_jump_aarch64(inst_buff, ret_idx, reused, return_addr);
+    return reused;
+  }
+
   for (auto& p : pages) {
     remote_ptr<uint8_t> page_jump_start = p.addr + p.allocated;
     int64_t offset = page_jump_start - svc_ip;
@@ -403,11 +466,17 @@ static remote_ptr<uint8_t> allocate_extended_jump_aarch64(
   if (!page) {
     // We're looking for a gap of three pages --- one page to allocate and
     // a page on each side as a guard page.
+    // Start at the lowest address a stub can be reached from, so gaps
+    // below the patch site are considered as well as those above it. The
+    // first gap after the patch site's mapping is often more than 128MB
+    // away, e.g. for libraries at the top of the mmap area.
     uint32_t required_space = 3 * page_size();
+    remote_ptr<void> search_start =
+        svc_ip.as_int() > uint64_t(-patch_offset_min) + page_size()
+            ? svc_ip + patch_offset_min - page_size()
+            : remote_ptr<uint8_t>();
     remote_ptr<void> free_mem =
-        t->vm()->find_free_memory(t, required_space,
-                                  // Find free space after the patch site.
-                                  t->vm()->mapping_of(svc_ip).map.start());
+        t->vm()->find_free_memory(t, required_space, search_start);
     if (!free_mem) {
       LOG(debug) << "Can't find free memory anywhere after the jump";
       return nullptr;
@@ -447,17 +516,35 @@ static remote_ptr<uint8_t> allocate_extended_jump_aarch64(
   }
 
   remote_ptr<uint8_t> jump_addr = page->addr + page->allocated;
-
-  const uint64_t reverse_jump_addr = jump_addr.as_int() + ret_idx * 4;
-  const int64_t reverse_offset = int64_t(return_addr - reverse_jump_addr);
-  const uint32_t offset_imm26 = (reverse_offset >> 2) & 0x03ffffff;
-  inst_buff[ret_idx] = 0x14000000 | offset_imm26;
+  set_return_jump_aarch64(inst_buff, ret_idx, jump_addr, return_addr);
 
   page->allocated += total_patch_size;
 
   return jump_addr;
 }
 
+void Monkeypatcher::release_stubs_in(const MemoryRange& range) {
+  size_t released = 0;
+  for (auto it = syscallbuf_stubs.begin(); it != syscallbuf_stubs.end();) {
+    if (!range.contains(it->second.patch_addr)) {
+      ++it;
+      continue;
+    }
+    for (auto& p : extended_jump_pages) {
+      if (p.addr <= it->first && it->first < p.addr + page_size()) {
+        p.free_stubs[it->second.size].push_back(it->first);
+        break;
+      }
+    }
+    it = syscallbuf_stubs.erase(it);
+    ++released;
+  }
+  if (released) {
+    LOG(debug) << "Released " << released << " syscall patch stubs for "
+               << range;
+  }
+}
+
 bool Monkeypatcher::is_jump_stub_instruction(remote_code_ptr ip, bool include_safearea) {
   remote_ptr<uint8_t> pp = ip.to_data_ptr<uint8_t>();
   auto it = syscallbuf_stubs.upper_bound(pp);
@@ -548,6 +635,10 @@ static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher,
           t, patcher.extended_jump_pages, jump_patch_end);
   }
   if (extended_jump_start.is_null()) {
+    ++patcher.stub_allocation_failures;
+    LOG(info) << "No stub space for syscall patch at " << jump_patch_start
+              << " (" << patcher.stub_allocation_failures
+              << " failures so far)";
     return false;
   }
 
@@ -560,7 +651,9 @@ static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher,
                                                 fake_syscall_number);
     write_and_record_bytes(t, extended_jump_start, stub_patch);
 
-    patcher.syscallbuf_stubs[extended_jump_start] = { &hook, FakeSyscallExtendedJumpPatch::size };
+    patcher.syscallbuf_stubs[extended_jump_start] = {
+      &hook, FakeSyscallExtendedJumpPatch::size, 0, 0, jump_patch_start
+    };
   } else {
     uint8_t stub_patch[ExtendedJumpPatch::size];
     substitute_extended_jump<ExtendedJumpPatch>(stub_patch,
@@ -570,7 +663,9 @@ static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher,
                                                 0);
     write_and_record_bytes(t, extended_jump_start, stub_patch);
 
-    patcher.syscallbuf_stubs[extended_jump_start] = { &hook, ExtendedJumpPatch::size };
+    patcher.syscallbuf_stubs[extended_jump_start] = {
+      &hook, ExtendedJumpPatch::size, 0, 0, jump_patch_start
+    };
   }
 
   intptr_t jump_offset = extended_jump_start - jump_patch_end;
@@ -635,17 +730,20 @@ template <>
 bool patch_syscall_with_hook_arch<ARM64Arch>(Monkeypatcher& patcher,
                                              RecordTask *t,
                                              const syscall_patch_hook &hook,
-                                             remote_code_ptr,
+                                             remote_code_ptr ip_of_instruction,
                                              size_t,
                                              uint32_t) {
-  Registers r = t->regs();
-  remote_ptr<uint8_t> svc_ip = r.ip().to_data_ptr<uint8_t>();
+  remote_ptr<uint8_t> svc_ip = ip_of_instruction.to_data_ptr<uint8_t>();
   std::vector<uint32_t> inst_buff;
 
   remote_ptr<uint8_t> extended_jump_start =
     allocate_extended_jump_aarch64(
       t, patcher.extended_jump_pages, svc_ip, hook.hook_address, inst_buff);
   if (extended_jump_start.is_null()) {
+    ++patcher.stub_allocation_failures;
+    LOG(info) << "No stub space for syscall patch at " << svc_ip
+              << " (" << patcher.stub_allocation_failures
+              << " failures so far)";
     return false;
   }
   LOG(debug) << "Allocated stub size " << inst_buff.size() * sizeof(uint32_t)
@@ -674,7 +772,8 @@ bool patch_syscall_with_hook_arch<ARM64Arch>(Monkeypatcher& patcher,
      * it doesn't belong to the safe area.
      * The caller needs to have special handling for that instruction.
      */
-    3 * 4 + 8
+    3 * 4 + 8,
+    svc_ip
   };
 
   intptr_t jump_offset = extended_jump_start - svc_ip;
@@ -1178,19 +1277,17 @@ bool Monkeypatcher::try_patch_syscall_x86ish(RecordTask* t, bool entering_syscal
     return false;
   }
 
+  note_patched_syscall_site(t, ip - instruction_length);
   return true;
 }
 
-bool Monkeypatcher::try_patch_syscall_aarch64(RecordTask* t, bool entering_syscall) {
-  Registers r = t->regs();
-  remote_code_ptr ip = r.ip() - 4;
+static const uint32_t aarch64_svc_0 = 0xd4000001;
 
-  uint32_t inst[2] = {0, 0};
-  size_t bytes_count = t->read_bytes_fallible(ip.to_data_ptr<uint8_t>() - 4, 8, &inst);
-  if (bytes_count < sizeof(inst) || inst[1] != 0xd4000001) {
-    LOG(debug) << "Declining to patch syscall at "
-               << ip << " for unexpected instruction";
-    tried_to_patch_syscall_addresses.insert(ip);
+/**
+ * `inst` is the instruction before an `svc #0` and the `svc` itself.
+ */
+static bool is_patchable_svc_aarch64(const uint32_t inst[2]) {
+  if (inst[1] != aarch64_svc_0) {
     return false;
   }
   // mov x8, 0xdc
@@ -1201,8 +1298,21 @@ bool Monkeypatcher::try_patch_syscall_aarch64(RecordTask* t, bool entering_sysca
     // Our syscall hook cannot do that so this would have to be a raw syscall.
     // We can handle this at runtime but if we know the call is definitely
     // a clone we can avoid patching it here.
-    LOG(debug) << "Declining to patch clone syscall at " << ip;
-    tried_to_patch_syscall_addresses.insert(ip);
+    return false;
+  }
+  return true;
+}
+
+bool Monkeypatcher::try_patch_syscall_aarch64(RecordTask* t, bool entering_syscall) {
+  Registers r = t->regs();
+  remote_code_ptr ip = r.ip() - 4;
+
+  uint32_t inst[2] = {0, 0};
+  size_t bytes_count = t->read_bytes_fallible(ip.to_data_ptr<uint8_t>() - 4, 8, &inst);
+  if (bytes_count < sizeof(inst) || !is_patchable_svc_aarch64(inst)) {
+    LOG(debug) << "Declining to patch syscall at " << ip;
+    // try_patch_syscall looks up the address after the instruction.
+    tried_to_patch_syscall_addresses.insert(ip + 4);
     return false;
   }
 
@@ -1236,10 +1346,11 @@ bool Monkeypatcher::try_patch_syscall_aarch64(RecordTask* t, bool entering_sysca
   if (!success) {
     LOG(debug) << "Failed to patch syscall at " << ip << " syscall "
                << syscall_name(r.original_syscallno(), aarch64) << " tid " << t->tid;
-    tried_to_patch_syscall_addresses.insert(ip);
+    tried_to_patch_syscall_addresses.insert(ip + 4);
     return false;
   }
 
+  note_patched_syscall_site(t, ip);
   return true;
 }
 
@@ -1308,6 +1419,314 @@ bool Monkeypatcher::try_patch_syscall(RecordTask* t, bool entering_syscall) {
   return try_patch_syscall_x86ish(t, entering_syscall, arch);
 }
 
+static string patch_site_cache_dir() {
+  // Starts with "." so "rr ls" etc. don't treat it as a trace.
+  return trace_save_dir() + "/.patch-sites";
+}
+
+static string patch_site_cache_file(const string& build_id,
+                                    SupportedArch arch) {
+  return patch_site_cache_dir() + "/" + build_id + "-" + arch_name(arch);
+}
+
+static bool mapping_may_have_build_id(const KernelMapping& km) {
+  return (km.prot() & PROT_EXEC) && !km.fsname().empty() &&
+         km.inode() != KernelMapping::NO_INODE;
+}
+
+static ScopedFd open_mapped_file(const KernelMapping& km) {
+  ScopedFd fd(km.fsname().c_str(), O_RDONLY);
+  struct stat st;
+  // Make sure the file at this path is still the one that's mapped.
+  if (!fd.is_open() || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_dev != km.device() || st.st_ino != km.inode()) {
+    return ScopedFd();
+  }
+  return fd;
+}
+
+const string& Monkeypatcher::build_id_of(RecordTask* t,
+                                         const KernelMapping& km) {
+  auto key = make_pair(km.device(), km.inode());
+  auto it = build_ids.find(key);
+  if (it != build_ids.end()) {
+    return it->second;
+  }
+  string& build_id = build_ids[key];
+  ScopedFd fd = open_mapped_file(km);
+  if (fd.is_open()) {
+    ElfFileReader reader(fd, t->arch());
+    build_id = reader.read_buildid();
+  }
+  return build_id;
+}
+
+/**
+ * Find likely-patchable syscall instructions in the .text of `reader`
+ * without running anything. We don't have a disassembler, so to keep false
+ * positives (0f 05 in the middle of some other instruction) vanishingly
+ * rare we only accept the shape glibc's wrappers use: a `mov $nr,%eax`
+ * immediately before the `syscall`, and one of our hook patterns after it.
+ * Every candidate is still checked in tracee memory before patching.
+ *
+ * We also look for the sequence compilers emit for __rdtsc(),
+ * `rdtsc; shl $32,%rdx; or %rdx,%rax`, which is just as distinctive, so hot
+ * timing loops don't have to take a trap before their rdtsc gets patched.
+ */
+static void scan_for_syscall_sites_x64(ElfFileReader& reader,
+                                       const vector<syscall_patch_hook>& hooks,
+                                       set<uint64_t>* offsets) {
+  SectionOffsets text = reader.find_section_file_offsets(".text");
+  if (text.end <= text.start || text.compressed) {
+    return;
+  }
+  auto bytes = static_cast<const uint8_t*>(
+      reader.read_bytes(text.start, text.end - text.start));
+  if (!bytes) {
+    return;
+  }
+  size_t size = text.end - text.start;
+  static const uint8_t rdtsc_combine[] = { 0x48, 0xc1, 0xe2, 0x20,
+                                           0x48, 0x09, 0xd0 };
+  for (size_t i = 5; i + 2 <= size; ++i) {
+    if (bytes[i] != 0x0f) {
+      continue;
+    }
+    if (bytes[i + 1] == 0x31) {
+      if (i + 2 + sizeof(rdtsc_combine) > size ||
+          memcmp(bytes + i + 2, rdtsc_combine, sizeof(rdtsc_combine)) != 0) {
+        continue;
+      }
+    } else if (bytes[i + 1] != 0x05 || bytes[i - 5] != 0xb8 ||
+               bytes[i - 1] != 0 || bytes[i - 2] != 0 || bytes[i - 3] >= 0x04) {
+      continue;
+    }
+    const uint8_t* following = bytes + i + 2;
+    size_t following_count = size - (i + 2);
+    for (const auto& hook : hooks) {
+      if (!(hook.flags & PATCH_SYSCALL_INSTRUCTION_IS_LAST) &&
+          following_count >= hook.patch_region_length &&
+          memcmp(following, hook.patch_region_bytes,
+                 hook.patch_region_length) == 0) {
+        offsets->insert(text.start + i);
+        break;
+      }
+    }
+  }
+}
+
+/**
+ * Find likely-patchable `svc #0` instructions in the .text of `reader`.
+ * Instructions are aligned words, so the only false positives would be
+ * data in .text; to make those vanishingly rare too we require the
+ * preceding instruction to set the syscall number in x8 the ways
+ * compilers and hand-written wrappers do (glibc, Go and Rust's raw
+ * syscalls): `mov x8, #imm`, `mov x8, xN` or `ldr x8, [xN, #imm]`.
+ * Sites that load x8 some other way are still added to the cache when
+ * they trap and are patched.
+ */
+static void scan_for_syscall_sites_aarch64(ElfFileReader& reader,
+                                           set<uint64_t>* offsets) {
+  SectionOffsets text = reader.find_section_file_offsets(".text");
+  if (text.end <= text.start || text.compressed || (text.start & 3)) {
+    return;
+  }
+  auto words = static_cast<const uint32_t*>(
+      reader.read_bytes(text.start, text.end - text.start));
+  if (!words) {
+    return;
+  }
+  size_t count = (text.end - text.start) / 4;
+  for (size_t i = 1; i < count; ++i) {
+    if (!is_patchable_svc_aarch64(words + i - 1)) {
+      continue;
+    }
+    uint32_t prev = words[i - 1];
+    if ((prev & 0xffe0001f) == 0xd2800008 ||  // movz x8, #imm
+        (prev & 0xffe0ffff) == 0xaa0003e8 ||  // orr x8, xzr, xN
+        (prev & 0xffc0001f) == 0xf9400008) {  // ldr x8, [xN, #imm]
+      offsets->insert(text.start + i * 4);
+    }
+  }
+}
+
+set<uint64_t>& Monkeypatcher::patch_site_offsets(RecordTask* t,
+                                                 const KernelMapping& km,
+                                                 const string& build_id) {
+  auto it = patchable_syscall_offsets.find(build_id);
+  if (it != patchable_syscall_offsets.end()) {
+    return it->second;
+  }
+  set<uint64_t>& offsets = patchable_syscall_offsets[build_id];
+  string file_name = patch_site_cache_file(build_id, t->arch());
+  ifstream in(file_name);
+  if (in.is_open()) {
+    uint64_t offset;
+    while (in >> hex >> offset) {
+      offsets.insert(offset);
+    }
+    return offsets;
+  }
+  if ((t->arch() != x86_64 && t->arch() != aarch64) || syscall_hooks.empty()) {
+    return offsets;
+  }
+
+  // First time we've seen this file. Scan it and save the results, even if
+  // there are none, so that nobody needs to scan it again.
+  ScopedFd fd = open_mapped_file(km);
+  if (!fd.is_open()) {
+    return offsets;
+  }
+  ElfFileReader reader(fd, t->arch());
+  if (t->arch() == aarch64) {
+    scan_for_syscall_sites_aarch64(reader, &offsets);
+  } else {
+    scan_for_syscall_sites_x64(reader, syscall_hooks, &offsets);
+  }
+  LOG(debug) << "Found " << offsets.size()
+             << " candidate syscall and rdtsc sites in " << km.fsname();
+  mkdir(patch_site_cache_dir().c_str(), S_IRWXU);
+  // Write to a temporary file and rename it so concurrent recordings never
+  // see a partial list.
+  string tmp_name = file_name + "." + to_string(getpid());
+  ofstream out(tmp_name);
+  for (auto offset : offsets) {
+    out << hex << offset << "\n";
+  }
+  out.close();
+  if (!out || rename(tmp_name.c_str(), file_name.c_str()) != 0) {
+    LOG(debug) << "Can't write patch-site cache for " << km.fsname();
+    unlink(tmp_name.c_str());
+  }
+  return offsets;
+}
+
+void Monkeypatcher::note_patched_syscall_site(
+    RecordTask* t, remote_code_ptr ip_of_instruction) {
+  remote_ptr<void> addr = ip_of_instruction.to_data_ptr<void>();
+  if (!t->vm()->has_mapping(addr)) {
+    return;
+  }
+  const KernelMapping& km = t->vm()->mapping_of(addr).map;
+  if (!mapping_may_have_build_id(km)) {
+    return;
+  }
+  const string& build_id = build_id_of(t, km);
+  if (build_id.empty()) {
+    return;
+  }
+  uint64_t offset = addr - km.start() + km.file_offset_bytes();
+  auto& offsets = patch_site_offsets(t, km, build_id);
+  if (!offsets.insert(offset).second) {
+    return;
+  }
+
+  // Other recordings may be updating the same file concurrently. Each line
+  // is a single O_APPEND write, so at worst we get duplicates.
+  mkdir(patch_site_cache_dir().c_str(), S_IRWXU);
+  ScopedFd fd(patch_site_cache_file(build_id, t->arch()).c_str(),
+              O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (!fd.is_open()) {
+    LOG(debug) << "Can't open patch-site cache for " << km.fsname();
+    return;
+  }
+  char line[32];
+  int len = snprintf(line, sizeof(line), "%llx\n", (unsigned long long)offset);
+  if (write(fd, line, len) != len) {
+    LOG(debug) << "Can't update patch-site cache for " << km.fsname();
+  }
+}
+
+void Monkeypatcher::patch_cached_syscall_sites(RecordTask* t) {
+  if (syscall_hooks.empty() || t->emulated_ptracer ||
+      (!is_x86ish(t->arch()) && t->arch() != aarch64)) {
+    return;
+  }
+  size_t instruction_length = rr::syscall_instruction_length(t->arch());
+
+  // Collect the sites first, since patching may map new stub pages.
+  struct Binary {
+    string name;
+    size_t sites;
+    size_t patched;
+  };
+  vector<Binary> binaries;
+  vector<pair<remote_code_ptr, size_t>> sites;
+  for (const auto& m : t->vm()->maps()) {
+    const KernelMapping& km = m.map;
+    if (!mapping_may_have_build_id(km)) {
+      continue;
+    }
+    const string& build_id = build_id_of(t, km);
+    if (build_id.empty()) {
+      continue;
+    }
+    auto& offsets = patch_site_offsets(t, km, build_id);
+    uint64_t map_offset = km.file_offset_bytes();
+    size_t first = sites.size();
+    for (auto it = offsets.lower_bound(map_offset);
+         it != offsets.end() &&
+         *it + instruction_length <= map_offset + km.size();
+         ++it) {
+      sites.push_back(make_pair(
+          remote_code_ptr(km.start().as_int() + *it - map_offset),
+          binaries.size()));
+    }
+    if (sites.size() > first) {
+      binaries.push_back({ km.fsname(), sites.size() - first, 0 });
+    }
+  }
+
+  size_t patched = 0;
+  for (auto& site : sites) {
+    remote_code_ptr ip = site.first;
+    // The cache is only a hint. Check the site exactly as we would if the
+    // syscall or rdtsc had trapped.
+    size_t length = instruction_length;
+    bool ok;
+    if (t->arch() == aarch64) {
+      uint32_t inst[2];
+      if (t->read_bytes_fallible(ip.to_data_ptr<uint8_t>() - 4, sizeof(inst),
+                                 inst) != sizeof(inst) ||
+          !is_patchable_svc_aarch64(inst) ||
+          tried_to_patch_syscall_addresses.count(ip + length) ||
+          !safe_for_syscall_patching(ip, ip + length, t)) {
+        continue;
+      }
+      ok = patch_syscall_with_hook(*this, t, syscall_hooks[0], ip, length, 0);
+    } else {
+      uint32_t fake_syscall_number = 0;
+      uint8_t insn[sizeof(rdtsc_insn)];
+      SupportedArch arch;
+      if (t->read_bytes_fallible(ip.to_data_ptr<uint8_t>(), sizeof(insn),
+                                 insn) == sizeof(insn) &&
+          !memcmp(insn, rdtsc_insn, sizeof(insn))) {
+        length = sizeof(rdtsc_insn);
+        fake_syscall_number = SYS_rrcall_rdtsc;
+      } else if (!get_syscall_instruction_arch(t, ip, &arch) ||
+                 arch != t->arch()) {
+        continue;
+      }
+      if (tried_to_patch_syscall_addresses.count(ip + length)) {
+        continue;
+      }
+      const syscall_patch_hook* hook = find_syscall_hook(t, ip, false, length);
+      ok = hook && patch_syscall_with_hook(*this, t, *hook, ip, length,
+                                           fake_syscall_number);
+    }
+    if (ok) {
+      ++patched;
+      ++binaries[site.second].patched;
+    }
+  }
+  for (auto& b : binaries) {
+    LOG(info) << "Patched " << b.patched << " of " << b.sites
+              << " cached syscall and rdtsc sites in " << b.name;
+  }
+  LOG(debug) << "Patched " << patched << " of " << sites.size()
+             << " cached syscall and rdtsc sites";
+}
+
 bool Monkeypatcher::try_patch_trapping_instruction(RecordTask* t, size_t instruction_length,
                                                    bool before_instruction) {
   if (syscall_hooks.empty()) {
@@ -1350,6 +1769,7 @@ bool Monkeypatcher::try_patch_trapping_instruction(RecordTask* t, size_t instruc
     return false;
   }
 
+  note_patched_syscall_site(t, ip_of_instruction);
   return true;
 }
 
@@ -1394,6 +1814,7 @@ void patch_at_preload_init_arch<X86Arch>(RecordTask* t,
 
   patcher.init_dynamic_syscall_patching(t, params.syscall_patch_hook_count,
                                         params.syscall_patch_hooks);
+  patcher.patch_cached_syscall_sites(t);
 }
 
 template <>
@@ -1447,6 +1868,7 @@ void patch_at_preload_init_arch<X64Arch>(RecordTask* t,
 
   patcher.init_dynamic_syscall_patching(t, params.syscall_patch_hook_count,
                                         params.syscall_patch_hooks);
+  patcher.patch_cached_syscall_sites(t);
 }
 
 template <>
@@ -1460,6 +1882,7 @@ void patch_at_preload_init_arch<ARM64Arch>(RecordTask* t,
 
   patcher.init_dynamic_syscall_patching(t, params.syscall_patch_hook_count,
                                         params.syscall_patch_hooks);
+  patcher.patch_cached_syscall_sites(t);
 }
 
 void Monkeypatcher::patch_after_exec(RecordTask* t) {
@@ -1476,14 +1899,10 @@ void Monkeypatcher::patch_at_preload_init(RecordTask* t) {
   RR_ARCH_FUNCTION(patch_at_preload_init_arch, t->arch(), t, *this);
 }
 
-static remote_ptr<void> resolve_address(ElfReader& reader, uintptr_t elf_addr,
+static remote_ptr<void> resolve_address(uint64_t file_offset,
                                         remote_ptr<void> map_start,
                                         size_t map_size,
                                         uintptr_t map_offset) {
-  uintptr_t file_offset;
-  if (!reader.addr_to_offset(elf_addr, file_offset)) {
-    LOG(warn) << "ELF address " << HEX(elf_addr) << " not in file";
-  }
   if (file_offset < map_offset || file_offset + 32 > map_offset + map_size) {
     // The value(s) to be set are outside the mapped range. This happens
     // because code and data can be mapped in separate, partial mmaps in which
@@ -1493,12 +1912,12 @@ static remote_ptr<void> resolve_address(ElfReader& reader, uintptr_t elf_addr,
   return map_start + uintptr_t(file_offset - map_offset);
 }
 
-static void set_and_record_bytes(RecordTask* t, ElfReader& reader,
-                                 uintptr_t elf_addr, const void* bytes,
-                                 size_t size, remote_ptr<void> map_start,
-                                 size_t map_size, size_t map_offset) {
+static void set_and_record_bytes(RecordTask* t, uint64_t file_offset,
+                                 const void* bytes, size_t size,
+                                 remote_ptr<void> map_start, size_t map_size,
+                                 size_t map_offset) {
   remote_ptr<void> addr =
-    resolve_address(reader, elf_addr, map_start, map_size, map_offset);
+    resolve_address(file_offset, map_start, map_size, map_offset);
   if (!addr) {
     return;
   }
@@ -1516,8 +1935,8 @@ static void set_and_record_bytes(RecordTask* t, ElfReader& reader,
  * register so that CPU-specific behaviors involving that register don't leak
  * into stack memory.
  */
-void Monkeypatcher::patch_dl_runtime_resolve(RecordTask* t, ElfReader& reader,
-                                             uintptr_t elf_addr,
+void Monkeypatcher::patch_dl_runtime_resolve(RecordTask* t,
+                                             uint64_t file_offset,
                                              remote_ptr<void> map_start,
                                              size_t map_size,
                                              size_t map_offset) {
@@ -1525,7 +1944,7 @@ void Monkeypatcher::patch_dl_runtime_resolve(RecordTask* t, ElfReader& reader,
     return;
   }
   remote_ptr<void> addr =
-    resolve_address(reader, elf_addr, map_start, map_size, map_offset);
+    resolve_address(file_offset, map_start, map_size, map_offset);
   if (!addr) {
     return;
   }
@@ -1587,6 +2006,93 @@ void Monkeypatcher::unpatch_dl_runtime_resolves(RecordTask* t) {
   saved_dl_runtime_resolve_code.clear();
 }
 
+/**
+ * File offsets of the glibc internals patch_after_mmap instruments.
+ */
+struct InstrumentationTargets {
+  std::vector<uint64_t> elision_aconf_retry;
+  std::vector<uint64_t> elision_init;
+  std::vector<uint64_t> dl_runtime_resolve;
+};
+
+struct InstrumentationTargetsKey {
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  bool operator<(const InstrumentationTargetsKey& other) const {
+    return tie(device, inode, size, mtime_sec, mtime_nsec) <
+           tie(other.device, other.inode, other.size, other.mtime_sec,
+               other.mtime_nsec);
+  }
+};
+
+static void add_symbol_offsets(ElfFileReader& reader, const SymbolTable& syms,
+                               const char* name, uintptr_t delta,
+                               vector<uint64_t>* offsets) {
+  for (size_t i : syms.find(name)) {
+    uintptr_t file_offset;
+    if (!reader.addr_to_offset(syms.addr(i) + delta, file_offset)) {
+      LOG(warn) << "ELF address " << HEX(syms.addr(i) + delta)
+                << " not in file";
+      continue;
+    }
+    offsets->push_back(file_offset);
+  }
+}
+
+/**
+ * ld.so and libpthread are mapped by every exec, and reading their symbol
+ * tables (possibly from a separate debug file) dominates the cost of
+ * recording short-lived processes. The results only depend on the file, so
+ * keep them for the whole recording, keyed by the file's identity and
+ * modification time.
+ */
+static const InstrumentationTargets& instrumentation_targets(
+    RecordTask* t, ScopedFd& fd, const string& fsname) {
+  static map<InstrumentationTargetsKey, InstrumentationTargets> cache;
+  struct stat st;
+  InstrumentationTargetsKey key = { 0, 0, 0, 0, 0 };
+  bool cacheable = fstat(fd, &st) == 0;
+  if (cacheable) {
+    key = { st.st_dev, st.st_ino, st.st_size, (int64_t)st.st_mtim.tv_sec,
+            (int64_t)st.st_mtim.tv_nsec };
+    auto it = cache.find(key);
+    if (it != cache.end()) {
+      return it->second;
+    }
+  }
+
+  static InstrumentationTargets uncached;
+  InstrumentationTargets& targets = cacheable ? cache[key] : uncached;
+  targets = InstrumentationTargets();
+  ElfFileReader reader(fd, t->arch());
+  // Check for symbols first in the library itself, regardless of whether
+  // there is a debuglink.  For example, on Fedora 26, the .symtab and
+  // .strtab sections are stripped from the debuginfo file for
+  // libpthread.so.
+  SymbolTable syms = reader.read_symbols(".symtab", ".strtab");
+  if (syms.size() == 0) {
+    ScopedFd debug_fd = reader.open_debug_file(fsname);
+    if (debug_fd.is_open()) {
+      ElfFileReader debug_reader(debug_fd, t->arch());
+      syms = debug_reader.read_symbols(".symtab", ".strtab");
+    }
+  }
+  add_symbol_offsets(reader, syms, "__elision_aconf", 8,
+                     &targets.elision_aconf_retry);
+  add_symbol_offsets(reader, syms, "elision_init", 0, &targets.elision_init);
+  static const char* const dl_runtime_resolve_names[] = {
+    "_dl_runtime_resolve_fxsave", "_dl_runtime_resolve_xsave",
+    "_dl_runtime_resolve_xsavec"
+  };
+  for (const char* name : dl_runtime_resolve_names) {
+    add_symbol_offsets(reader, syms, name, 0, &targets.dl_runtime_resolve);
+  }
+  return targets;
+}
+
 static bool file_may_need_instrumentation(const AddressSpace::Mapping& map) {
   size_t file_part = map.map.fsname().rfind('/');
   if (file_part == string::npos) {
@@ -1626,48 +2132,33 @@ void Monkeypatcher::patch_after_mmap(RecordTask* t, remote_ptr<void> start,
         return;
       }
     }
-    ElfFileReader reader(open_fd, t->arch());
-    // Check for symbols first in the library itself, regardless of whether
-    // there is a debuglink.  For example, on Fedora 26, the .symtab and
-    // .strtab sections are stripped from the debuginfo file for
-    // libpthread.so.
-    SymbolTable syms = reader.read_symbols(".symtab", ".strtab");
-    if (syms.size() == 0) {
-      ScopedFd debug_fd = reader.open_debug_file(map.map.fsname());
-      if (debug_fd.is_open()) {
-        ElfFileReader debug_reader(debug_fd, t->arch());
-        syms = debug_reader.read_symbols(".symtab", ".strtab");
-      }
+    const InstrumentationTargets& targets =
+        instrumentation_targets(t, open_fd, map.map.fsname());
+    for (uint64_t file_offset : targets.elision_aconf_retry) {
+      static const int zero = 0;
+      // Setting __elision_aconf.retry_try_xbegin to zero means that
+      // pthread rwlocks don't try to use elision at all. See ELIDE_LOCK
+      // in glibc's elide.h.
+      set_and_record_bytes(t, file_offset, &zero, sizeof(zero), start, size,
+                           offset_bytes);
     }
-    for (size_t i = 0; i < syms.size(); ++i) {
-      if (syms.is_name(i, "__elision_aconf")) {
-        static const int zero = 0;
-        // Setting __elision_aconf.retry_try_xbegin to zero means that
-        // pthread rwlocks don't try to use elision at all. See ELIDE_LOCK
-        // in glibc's elide.h.
-        set_and_record_bytes(t, reader, syms.addr(i) + 8, &zero, sizeof(zero),
-                             start, size, offset_bytes);
-      }
-      if (syms.is_name(i, "elision_init")) {
-        // Make elision_init return without doing anything. This means
-        // the __elision_available and __pthread_force_elision flags will
-        // remain zero, disabling elision for mutexes. See glibc's
-        // elision-conf.c.
-        static const uint8_t ret = 0xC3;
-        set_and_record_bytes(t, reader, syms.addr(i), &ret, sizeof(ret), start,
-                             size, offset_bytes);
-      }
-      // The following operations can only be applied once because after the
-      // patch is applied the code no longer matches the expected template.
-      // For replaying a replay to work, we need to only apply these changes
-      // during a real exec, not during the mmap operations performed when rr
-      // replays an exec.
-      if (mode == MMAP_EXEC &&
-          (syms.is_name(i, "_dl_runtime_resolve_fxsave") ||
-           syms.is_name(i, "_dl_runtime_resolve_xsave") ||
-           syms.is_name(i, "_dl_runtime_resolve_xsavec"))) {
-        patch_dl_runtime_resolve(t, reader, syms.addr(i), start, size,
-                                 offset_bytes);
+    for (uint64_t file_offset : targets.elision_init) {
+      // Make elision_init return without doing anything. This means
+      // the __elision_available and __pthread_force_elision flags will
+      // remain zero, disabling elision for mutexes. See glibc's
+      // elision-conf.c.
+      static const uint8_t ret = 0xC3;
+      set_and_record_bytes(t, file_offset, &ret, sizeof(ret), start, size,
+                           offset_bytes);
+    }
+    // The following operations can only be applied once because after the
+    // patch is applied the code no longer matches the expected template.
+    // For replaying a replay to work, we need to only apply these changes
+    // during a real exec, not during the mmap operations performed when rr
+    // replays an exec.
+    if (mode == MMAP_EXEC) {
+      for (uint64_t file_offset : targets.dl_runtime_resolve) {
+        patch_dl_runtime_resolve(t, file_offset, start, size, offset_bytes);
       }
     }
   }
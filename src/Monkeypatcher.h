@@ -3,18 +3,24 @@
 #ifndef RR_MONKEYPATCHER_H_
 #define RR_MONKEYPATCHER_H_
 
+#include <sys/types.h>
+
 #include <map>
+#include <set>
+#include <string>
 #include <unordered_set>
 #include <vector>
 
 #include "preload/preload_interface.h"
 
+#include "MemoryRange.h"
 #include "remote_code_ptr.h"
 #include "remote_ptr.h"
 
 namespace rr {
 
 class ElfReader;
+class KernelMapping;
 class RecordTask;
 class ScopedFd;
 class Task;
@@ -32,7 +38,10 @@ class Task;
  * our syscall hook in the preload library (x86 only).
  *
  * 3) Patch syscall instructions whose following instructions match a known
- * pattern to call the syscall hook.
+ * pattern to call the syscall hook. Sites we've patched, and sites found by
+ * scanning a binary's .text the first time we see it, are remembered per ELF
+ * build-id in a cache under the trace directory, so recordings can patch them
+ * at preload init instead of taking a trap at each one first.
  *
  * Monkeypatcher only runs during recording, never replay.
  */
@@ -100,6 +109,12 @@ public:
       RecordTask* t, int syscall_patch_hook_count,
       remote_ptr<syscall_patch_hook> syscall_patch_hooks);
 
+  /**
+   * Patch all syscall and rdtsc sites in currently mapped files that the
+   * patch-site cache says were patchable in an earlier recording.
+   */
+  void patch_cached_syscall_sites(RecordTask* t);
+
   /**
    * Try to allocate a stub from the sycall patching stub buffer. Returns null
    * if there's no buffer or we've run out of free stubs.
@@ -124,8 +139,20 @@ public:
     ExtendedJumpPage(remote_ptr<uint8_t> addr) : addr(addr), allocated(0) {}
     remote_ptr<uint8_t> addr;
     size_t allocated;
+    // Stubs below `allocated` whose patch site has been unmapped, keyed by
+    // stub size, available for reuse.
+    std::map<size_t, std::vector<remote_ptr<uint8_t>>> free_stubs;
   };
   std::vector<ExtendedJumpPage> extended_jump_pages;
+  // Number of times we couldn't patch a syscall because there was no stub
+  // space within jump range of it.
+  size_t stub_allocation_failures = 0;
+
+  /**
+   * The tracee unmapped `range`. Make the stubs for syscalls patched in that
+   * range available for reuse.
+   */
+  void release_stubs_in(const MemoryRange& range);
 
   bool is_jump_stub_instruction(remote_code_ptr p, bool include_safearea);
   // Return the breakpoint instruction (i.e. the last branch back to caller)
@@ -141,6 +168,8 @@ public:
     size_t size;
     uint16_t safe_prefix = 0;
     uint16_t safe_suffix = 0;
+    // Start of the patched code that jumps to this stub
+    remote_ptr<uint8_t> patch_addr;
   };
 
   /**
@@ -149,12 +178,34 @@ public:
   std::map<remote_ptr<uint8_t>, patched_syscall> syscallbuf_stubs;
 
 private:
-  void patch_dl_runtime_resolve(RecordTask* t, ElfReader& reader,
-                                uintptr_t elf_addr,
+  void patch_dl_runtime_resolve(RecordTask* t, uint64_t file_offset,
                                 remote_ptr<void> map_start,
                                 size_t map_size,
                                 size_t map_offset);
 
+  /**
+   * Add the syscall or rdtsc instruction at `ip_of_instruction`, which we
+   * just patched, to the patch-site cache.
+   */
+  void note_patched_syscall_site(RecordTask* t,
+                                 remote_code_ptr ip_of_instruction);
+  /**
+   * Returns the build-id of the file mapped by `km`, or an empty string if
+   * it doesn't have one.
+   */
+  const std::string& build_id_of(RecordTask* t, const KernelMapping& km);
+
+  /**
+   * Returns the known-patchable file offsets for `build_id`, loading them
+   * from the patch-site cache the first time. If there is no cache entry yet
+   * (x86-64 and aarch64), scans the file mapped by `km` for likely sites and creates
+   * one. The cache file is just a list of hex file offsets of syscall and
+   * rdtsc instructions, one per line.
+   */
+  std::set<uint64_t>& patch_site_offsets(RecordTask* t,
+                                         const KernelMapping& km,
+                                         const std::string& build_id);
+
   /**
    * `ip` is the address of the instruction that triggered the syscall or trap
    */
@@ -175,6 +226,16 @@ private:
    */
   std::unordered_set<remote_code_ptr> tried_to_patch_syscall_addresses;
 
+  /**
+   * Build-ids of the files we've looked at, keyed by device and inode.
+   */
+  std::map<std::pair<dev_t, ino_t>, std::string> build_ids;
+  /**
+   * File offsets of the syscall instructions known or likely to be
+   * patchable, keyed by build-id. Populated lazily from the patch-site cache.
+   */
+  std::map<std::string, std::set<uint64_t>> patchable_syscall_offsets;
+
   std::map<remote_ptr<uint8_t>, std::vector<uint8_t>> saved_dl_runtime_resolve_code;
 };
 
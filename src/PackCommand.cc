@@ -6,6 +6,8 @@
 #include <linux/fiemap.h>
 #include <pthread.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -13,6 +15,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <fstream>
 #include <limits>
 #include <map>
 #include <set>
@@ -26,6 +29,7 @@
 #include "kernel_metadata.h"
 #include "log.h"
 #include "main.h"
+#include "util.h"
 
 #include "../third-party/blake2/blake2.h"
 
@@ -54,6 +58,13 @@ PackCommand PackCommand::singleton(
     " rr pack [OPTION]... [<trace-dir>]\n"
     "  --symlink                  Create symlinks to all mmapped files\n"
     "                             instead of copying them.\n"
+    "  --store=<dir>              Keep one copy of each mmapped file in the\n"
+    "                             content-addressed store <dir>, shared by\n"
+    "                             every trace packed with the same store.\n"
+    "                             Trace files are hardlinks to the store's\n"
+    "                             copies, so <dir> must be on the same\n"
+    "                             filesystem as the trace. `rr rm' deletes\n"
+    "                             store copies no trace uses any more.\n"
     "\n"
     "Eliminates duplicate files in the trace directory, and copies files into\n"
     "the trace directory as necessary to ensure that all needed files are in\n"
@@ -61,12 +72,16 @@ PackCommand PackCommand::singleton(
     "trace directory. This makes the trace directory independent of changes\n"
     "to other files and ready to be transported elsewhere (e.g. by packaging\n"
     "it into a ZIP or tar archive).\n"
+    "Substreams recorded with --compression=none are compressed.\n"
     "Be careful sharing traces with others; they may contain sensitive information.\n");
 
 struct PackFlags {
   /* If true, insert symlinks into the trace dir which point to the original
    * files, rather than copying the files themselves */
   bool symlink;
+  /* If nonempty, the content-addressed store directory to link mmapped
+   * files into. */
+  string store_dir;
 
   PackFlags()
       : symlink(false) {}
@@ -298,12 +313,110 @@ static bool get_file_extents_hash(const string& file_name, FsExtentsHash* result
   return true;
 }
 
+// Key for remembering a file's FileHash across `rr pack` runs. If none of
+// these change, we assume the contents haven't either.
+struct FileHashCacheKey {
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  // All zeroes if the extents aren't known.
+  FsExtentsHash extents_hash;
+};
+
+bool operator<(const FileHashCacheKey& k1, const FileHashCacheKey& k2) {
+  return memcmp(&k1, &k2, sizeof(k1)) < 0;
+}
+
+struct FileHashCacheEntry {
+  FileHashCacheKey key;
+  FileHash hash;
+};
+
+static const uint64_t FILE_HASH_CACHE_MAGIC = 0x3168736168726c72ULL;
+// Beyond this many entries, only the entries used by the current pack are
+// kept.
+static const size_t FILE_HASH_CACHE_MAX_ENTRIES = 100000;
+
+static string file_hash_cache_path() {
+  // Starts with '.' so `rr ls` doesn't treat it as a trace.
+  return trace_save_dir() + "/.pack_hash_cache";
+}
+
+static bool get_file_hash_cache_key(const string& file_name,
+                                    const FsExtentsHash* extents_hash,
+                                    FileHashCacheKey* key) {
+  struct stat st;
+  if (stat(file_name.c_str(), &st) < 0) {
+    return false;
+  }
+  memset(key, 0, sizeof(*key));
+  key->device = st.st_dev;
+  key->inode = st.st_ino;
+  key->size = st.st_size;
+  key->mtime_sec = st.st_mtim.tv_sec;
+  key->mtime_nsec = st.st_mtim.tv_nsec;
+  if (extents_hash) {
+    key->extents_hash = *extents_hash;
+  }
+  return true;
+}
+
+static map<FileHashCacheKey, FileHash> load_file_hash_cache() {
+  map<FileHashCacheKey, FileHash> cache;
+  ScopedFd fd(file_hash_cache_path().c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  uint64_t magic;
+  if (!fd.is_open() || fstat(fd, &st) < 0 ||
+      read_to_end(fd, 0, &magic, sizeof(magic)) != sizeof(magic) ||
+      magic != FILE_HASH_CACHE_MAGIC) {
+    return cache;
+  }
+  vector<FileHashCacheEntry> entries((st.st_size - sizeof(magic)) /
+                                     sizeof(FileHashCacheEntry));
+  ssize_t size = entries.size() * sizeof(FileHashCacheEntry);
+  if (read_to_end(fd, sizeof(magic), entries.data(), size) != size) {
+    return cache;
+  }
+  for (auto& e : entries) {
+    cache[e.key] = e.hash;
+  }
+  return cache;
+}
+
+// The cache is only an optimization, so failing to save it isn't an error.
+static void save_file_hash_cache(const map<FileHashCacheKey, FileHash>& cache) {
+  string path = file_hash_cache_path();
+  string tmp_path = path + "." + to_string(getpid());
+  ScopedFd fd(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+              0600);
+  if (!fd.is_open()) {
+    return;
+  }
+  vector<FileHashCacheEntry> entries;
+  entries.reserve(cache.size());
+  for (auto& p : cache) {
+    entries.push_back({ p.first, p.second });
+  }
+  uint64_t magic = FILE_HASH_CACHE_MAGIC;
+  ssize_t size = entries.size() * sizeof(FileHashCacheEntry);
+  if (write(fd, &magic, sizeof(magic)) != sizeof(magic) ||
+      write(fd, entries.data(), size) != size ||
+      rename(tmp_path.c_str(), path.c_str()) < 0) {
+    unlink(tmp_path.c_str());
+  }
+}
+
 // Makes a list of all mmapped files and computes their BLAKE2b hashes.
 // BLAKE2b was chosen because it's fast and cryptographically strong (we don't
 // compare the actual file contents, we're relying on hash collision avoidance).
 // Files with the same FileHash have the same contents.
 // The keys of the returned map are the full file names of the mapped files.
-static map<string, FileHash> gather_file_info(const string& trace_dir) {
+// If |need_content_hashes| is false, files that can't have duplicates get
+// made-up unique hashes instead of content hashes.
+static map<string, FileHash> gather_file_info(const string& trace_dir,
+                                              bool need_content_hashes) {
   vector<TraceReader::MappedData> files = gather_files(trace_dir);
   int use_cpus = min(20, get_num_cpus());
   use_cpus = min((int)files.size(), use_cpus);
@@ -314,11 +427,13 @@ static map<string, FileHash> gather_file_info(const string& trace_dir) {
   // All files for which we failed to get extents. We know nothing
   // about their contents.
   vector<const TraceReader::MappedData*> files_with_no_extents;
+  map<const TraceReader::MappedData*, FsExtentsHash> file_extents;
   for (const auto& file : files) {
     FsExtentsHash extents_hash;
     uint64_t size;
     if (get_file_extents_hash(file.file_name, &extents_hash, &size)) {
       extents_to_file[extents_hash].push_back(&file);
+      file_extents[&file] = extents_hash;
     } else {
       files_with_no_extents.push_back(&file);
     }
@@ -343,18 +458,38 @@ static map<string, FileHash> gather_file_info(const string& trace_dir) {
     ++file_size_to_file_count[file->file_size_bytes];
   }
 
+  // Files already hashed by an earlier pack don't need to be read again.
+  map<FileHashCacheKey, FileHash> cache = load_file_hash_cache();
+  map<FileHashCacheKey, FileHash> used_cache;
+  map<const std::string*, FileHashCacheKey> keys_to_cache;
+
   map<string, FileHash> result;
   vector<vector<pair<const std::string*, FileHash>>> thread_files;
   thread_files.resize(use_cpus);
   int num_files_to_hash = 0;
   for (auto file : files_to_hash) {
-    if (file_size_to_file_count[file->file_size_bytes] == 1) {
+    if (!need_content_hashes &&
+        file_size_to_file_count[file->file_size_bytes] == 1) {
       // There is only one file with this size, so it can't be a duplicate
       // of any other files in `files_to_hash` and there is no need to hash
       // its contents. We'll just make up a fake, unique hash value for it.
       result[file->file_name] = allocate_unique_file_hash();
       continue;
     }
+    auto extents = file_extents.find(file);
+    FileHashCacheKey key;
+    if (get_file_hash_cache_key(file->file_name,
+                                extents == file_extents.end() ?
+                                    nullptr : &extents->second,
+                                &key)) {
+      auto cached = cache.find(key);
+      if (cached != cache.end()) {
+        result[file->file_name] = cached->second;
+        used_cache.insert(*cached);
+        continue;
+      }
+      keys_to_cache[&file->file_name] = key;
+    }
     thread_files[num_files_to_hash % use_cpus].push_back(
         make_pair(&file->file_name, FileHash()));
     ++num_files_to_hash;
@@ -373,8 +508,17 @@ static map<string, FileHash> gather_file_info(const string& trace_dir) {
   for (auto& f : thread_files) {
     for (auto& ff : f) {
       result[*ff.first] = ff.second;
+      auto key = keys_to_cache.find(ff.first);
+      if (key != keys_to_cache.end()) {
+        cache[key->second] = ff.second;
+        used_cache[key->second] = ff.second;
+      }
     }
   }
+  if (num_files_to_hash > 0) {
+    save_file_hash_cache(cache.size() > FILE_HASH_CACHE_MAX_ENTRIES ?
+                             used_cache : cache);
+  }
 
   // Populate results for files we skipped because they had duplicate
   // FsExtentsHashes.
@@ -409,12 +553,12 @@ static const char* last_filename_component(const string& file_name) {
   return last_component;
 }
 
-static string copy_into_trace(const string& file_name, const string& trace_dir,
-                              int* name_index) {
-  // We don't bother trying to do a reflink-copy here because if that was going
-  // to succeed, rr would probably already have used it during recording.
+// Creates a new, empty "mmap_pack_" file in the trace directory to receive
+// a copy of |file_name|.
+static string create_pack_file(const string& file_name,
+                               const string& trace_dir, int* name_index,
+                               ScopedFd* out_fd) {
   string new_name;
-  ScopedFd out_fd;
   const char* last_component = last_filename_component(file_name);
   while (true) {
     char new_name_buf[PATH_MAX];
@@ -423,8 +567,8 @@ static string copy_into_trace(const string& file_name, const string& trace_dir,
     new_name_buf[sizeof(new_name_buf) - 1] = 0;
     new_name = trace_dir + "/" + new_name_buf;
     ++*name_index;
-    out_fd = ScopedFd(new_name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0700);
-    if (!out_fd.is_open()) {
+    *out_fd = ScopedFd(new_name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0700);
+    if (!out_fd->is_open()) {
       if (errno == EEXIST) {
         continue;
       }
@@ -432,37 +576,104 @@ static string copy_into_trace(const string& file_name, const string& trace_dir,
     }
     break;
   }
+  return new_name;
+}
 
-  ScopedFd in_fd(file_name.c_str(), O_RDONLY);
-  if (!in_fd.is_open()) {
-    FATAL() << "Couldn't open " << file_name;
-  }
+struct CopyJob {
+  const string* file_name;
+  const string* new_name;
+  ScopedFd out_fd;
+};
 
-  while (true) {
-    char buf[1024 * 1024];
-    ssize_t r = read(in_fd, buf, sizeof(buf));
-    if (r < 0) {
-      FATAL() << "Can't read from " << file_name;
-    }
-    if (r == 0) {
-      break;
+static void* copy_files_thread(void* p) {
+  // Don't use log.h macros here since they're not necessarily thread-safe
+  auto jobs = static_cast<vector<CopyJob*>*>(p);
+  for (auto job : *jobs) {
+    const char* name = job->file_name->c_str();
+    const char* new_name = job->new_name->c_str();
+    int out_fd = job->out_fd.get();
+    ScopedFd in_fd(name, O_RDONLY);
+    if (!in_fd.is_open()) {
+      fprintf(stderr, "Couldn't open %s\n", name);
+      exit(1);
     }
-    ssize_t written = 0;
-    while (written < r) {
-      ssize_t w = write(out_fd, buf + written, r - written);
-      if (w <= 0) {
-        FATAL() << "Can't write to " << new_name;
+
+    // Reflink if the filesystem allows it, otherwise let the kernel copy
+    // (which may be offloaded to the server on network filesystems), and
+    // only copy through userspace as a last resort.
+    if (ioctl(out_fd, FICLONE, in_fd.get()) < 0) {
+      bool copied = false;
+      bool can_copy_file_range = true;
+      while (can_copy_file_range) {
+        ssize_t r = syscall(NativeArch::copy_file_range, in_fd.get(), nullptr,
+                            out_fd, nullptr, 1 << 30, 0);
+        if (r == 0) {
+          // Could be EOF, or a filesystem that doesn't support this. Check
+          // below.
+          copied = true;
+          break;
+        }
+        if (r < 0) {
+          can_copy_file_range = false;
+        }
+      }
+      struct stat in_stat;
+      struct stat out_stat;
+      if (copied && fstat(in_fd, &in_stat) == 0 &&
+          fstat(out_fd, &out_stat) == 0 &&
+          in_stat.st_size != out_stat.st_size) {
+        copied = false;
+      }
+      while (!copied) {
+        char buf[1024 * 1024];
+        ssize_t r = read(in_fd, buf, sizeof(buf));
+        if (r < 0) {
+          fprintf(stderr, "Can't read from %s\n", name);
+          exit(1);
+        }
+        if (r == 0) {
+          break;
+        }
+        ssize_t written = 0;
+        while (written < r) {
+          ssize_t w = write(out_fd, buf + written, r - written);
+          if (w <= 0) {
+            fprintf(stderr, "Can't write to %s\n", new_name);
+            exit(1);
+          }
+          written += w;
+        }
       }
-      written += w;
     }
-  }
 
-  // Try to avoid dataloss
-  if (fsync(out_fd) < 0) {
-    FATAL() << "Can't write to " << new_name;
+    // Try to avoid dataloss
+    if (fsync(out_fd) < 0) {
+      fprintf(stderr, "Can't write to %s\n", new_name);
+      exit(1);
+    }
   }
+  return nullptr;
+}
 
-  return new_name;
+// Copies each file in |jobs| into its new trace file, using multiple threads
+// since copies from (network) storage can dominate packing time.
+static void copy_files_into_trace(vector<CopyJob>& jobs) {
+  int use_cpus = min(20, get_num_cpus());
+  use_cpus = min((int)jobs.size(), use_cpus);
+  vector<vector<CopyJob*>> thread_jobs;
+  thread_jobs.resize(use_cpus);
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    thread_jobs[i % use_cpus].push_back(&jobs[i]);
+  }
+  vector<pthread_t> threads;
+  for (size_t i = 0; i < thread_jobs.size(); ++i) {
+    pthread_t thread;
+    pthread_create(&thread, nullptr, copy_files_thread, &thread_jobs[i]);
+    threads.push_back(thread);
+  }
+  for (pthread_t t : threads) {
+    pthread_join(t, nullptr);
+  }
 }
 
 // Generates a symlink inside the trace directory, pointing to the provided
@@ -528,9 +739,7 @@ static map<string, string> compute_canonical_symlink_map(
  * for all files with that hash.
  */
 static map<string, string> compute_canonical_mmapped_files(
-    const string& trace_dir) {
-  map<string, FileHash> file_info = gather_file_info(trace_dir);
-
+    const map<string, FileHash>& file_info, const string& trace_dir) {
   map<FileHash, string> hash_to_name;
   for (auto& p : file_info) {
     const auto& existing = hash_to_name.find(p.second);
@@ -544,13 +753,22 @@ static map<string, string> compute_canonical_mmapped_files(
   }
 
   int name_index = 0;
+  vector<string> copy_sources;
+  vector<CopyJob> copies;
   for (auto& p : hash_to_name) {
     // Copy hardlinked files into the trace to avoid the possibility of someone
     // overwriting the original file.
     if (is_hardlink(p.second) || !is_in_trace_dir(p.second, trace_dir)) {
-      p.second = copy_into_trace(p.second, trace_dir, &name_index);
+      copy_sources.push_back(p.second);
+      ScopedFd out_fd;
+      p.second = create_pack_file(p.second, trace_dir, &name_index, &out_fd);
+      copies.push_back({ nullptr, &p.second, std::move(out_fd) });
     }
   }
+  for (size_t i = 0; i < copies.size(); ++i) {
+    copies[i].file_name = &copy_sources[i];
+  }
+  copy_files_into_trace(copies);
 
   map<string, string> file_map;
   for (auto& p : file_info) {
@@ -565,6 +783,108 @@ static map<string, string> compute_canonical_mmapped_files(
   return file_map;
 }
 
+static string hash_to_hex(const FileHash& hash) {
+  static const char digits[] = "0123456789abcdef";
+  string result;
+  for (uint8_t b : hash.bytes) {
+    result.push_back(digits[b >> 4]);
+    result.push_back(digits[b & 0xf]);
+  }
+  return result;
+}
+
+// Make |trace_path| a hardlink to the store object |object_path|, creating
+// the object from |trace_path| if it doesn't exist yet. The files have the
+// same contents, so the trace stays valid throughout.
+static void link_into_store(const string& trace_path,
+                            const string& object_path,
+                            const string& trace_dir) {
+  string tmp_path = trace_dir + "/pack_store_link";
+  while (true) {
+    if (link(trace_path.c_str(), object_path.c_str()) == 0) {
+      return;
+    }
+    if (errno != EEXIST) {
+      FATAL() << "Can't link " << trace_path << " into store as "
+              << object_path;
+    }
+    struct stat trace_stat;
+    struct stat object_stat;
+    if (stat(trace_path.c_str(), &trace_stat) < 0) {
+      FATAL() << "Can't stat " << trace_path;
+    }
+    if (stat(object_path.c_str(), &object_stat) == 0 &&
+        trace_stat.st_dev == object_stat.st_dev &&
+        trace_stat.st_ino == object_stat.st_ino) {
+      return;
+    }
+    unlink(tmp_path.c_str());
+    if (link(object_path.c_str(), tmp_path.c_str()) < 0) {
+      if (errno == ENOENT) {
+        // A concurrent `rr rm' released the object. Try creating it again.
+        continue;
+      }
+      FATAL() << "Can't link " << object_path << " to " << tmp_path;
+    }
+    if (rename(tmp_path.c_str(), trace_path.c_str()) < 0) {
+      FATAL() << "Error renaming " << tmp_path << " to " << trace_path;
+    }
+    return;
+  }
+}
+
+// Replace each canonical file in the trace directory with a hardlink to the
+// store object for its hash, and record the objects the trace uses in
+// "pack_store" so `rr rm` can release them.
+static void link_files_into_store(const map<string, FileHash>& file_info,
+                                  const map<string, string>& file_map,
+                                  const string& trace_dir,
+                                  const string& store_dir) {
+  string record_path = trace_dir + "/pack_store";
+  // Keep the fingerprint-indexed objects `rr record --file-store` linked.
+  vector<string> index_objects;
+  {
+    ifstream in(record_path);
+    string old_store_dir;
+    if (getline(in, old_store_dir) && old_store_dir != store_dir) {
+      FATAL() << "Trace was already packed into store " << old_store_dir;
+    }
+    string object;
+    while (getline(in, object)) {
+      if (object.find("index/") == 0) {
+        index_objects.push_back(object);
+      }
+    }
+  }
+
+  map<string, FileHash> name_to_hash;
+  for (auto& p : file_info) {
+    name_to_hash[file_map.at(p.first)] = p.second;
+  }
+
+  string tmp_record_path = record_path + ".tmp";
+  FILE* record = fopen(tmp_record_path.c_str(), "w");
+  if (!record) {
+    FATAL() << "Can't create " << tmp_record_path;
+  }
+  fprintf(record, "%s\n", store_dir.c_str());
+  for (auto& object : index_objects) {
+    fprintf(record, "%s\n", object.c_str());
+  }
+  for (auto& p : name_to_hash) {
+    string object = hash_to_hex(p.second);
+    link_into_store(trace_dir + "/" + p.first, store_dir + "/" + object,
+                    trace_dir);
+    fprintf(record, "%s\n", object.c_str());
+  }
+  if (fflush(record) != 0 || fsync(fileno(record)) < 0 || fclose(record)) {
+    FATAL() << "Can't write " << tmp_record_path;
+  }
+  if (rename(tmp_record_path.c_str(), record_path.c_str()) < 0) {
+    FATAL() << "Error renaming " << tmp_record_path << " to " << record_path;
+  }
+}
+
 // Write out a new 'mmaps' file with the new file names and atomically
 // replace the existing 'mmaps' file with it.
 static void rewrite_mmaps(const map<string, string>& file_map,
@@ -663,16 +983,29 @@ static int pack(const string& trace_dir, const PackFlags& flags) {
   }
   string abspath(buf);
 
+  {
+    // Traces recorded with --compression=none are compressed now, off the
+    // recording's critical path.
+    TraceReader reader(abspath);
+    reader.recompress_stored_substreams();
+  }
+
   if (flags.symlink) {
     map<string, string> canonical_symlink_map =
         compute_canonical_symlink_map(abspath);
     rewrite_mmaps(canonical_symlink_map, abspath);
     delete_unnecessary_files(canonical_symlink_map, abspath);
   } else {
+    bool use_store = !flags.store_dir.empty();
+    map<string, FileHash> file_info = gather_file_info(abspath, use_store);
     map<string, string> canonical_mmapped_files =
-        compute_canonical_mmapped_files(abspath);
+        compute_canonical_mmapped_files(file_info, abspath);
     rewrite_mmaps(canonical_mmapped_files, abspath);
     delete_unnecessary_files(canonical_mmapped_files, abspath);
+    if (use_store) {
+      link_files_into_store(file_info, canonical_mmapped_files, abspath,
+                            flags.store_dir);
+    }
   }
 
   if (!probably_not_interactive(STDOUT_FILENO)) {
@@ -685,6 +1018,7 @@ static int pack(const string& trace_dir, const PackFlags& flags) {
 static bool parse_pack_arg(vector<string>& args, PackFlags& flags) {
   static const OptionSpec options[] = {
     { 0, "symlink", NO_PARAMETER },
+    { 1, "store", HAS_PARAMETER },
   };
   ParsedOption opt;
   auto args_copy = args;
@@ -696,6 +1030,9 @@ static bool parse_pack_arg(vector<string>& args, PackFlags& flags) {
     case 0:
       flags.symlink = true;
       break;
+    case 1:
+      flags.store_dir = opt.value;
+      break;
     default:
       DEBUG_ASSERT(0 && "Unknown pack option");
   }
@@ -721,6 +1058,19 @@ int PackCommand::run(vector<string>& args) {
     return 1;
   }
 
+  if (!flags.store_dir.empty()) {
+    if (flags.symlink) {
+      fprintf(stderr, "--store and --symlink can't be combined\n");
+      return 1;
+    }
+    if (mkdir(flags.store_dir.c_str(), 0700) < 0 && errno != EEXIST) {
+      fprintf(stderr, "Can't create store directory %s\n",
+              flags.store_dir.c_str());
+      return 1;
+    }
+    flags.store_dir = real_path(flags.store_dir);
+  }
+
   return pack(trace_dir, flags);
 }
 
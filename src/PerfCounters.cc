@@ -21,6 +21,7 @@
 #include <fstream>
 #include <limits>
 #include <regex>
+#include <sstream>
 #include <string>
 #include <unordered_set>
 
@@ -440,12 +441,47 @@ static void check_working_counters(perf_event_attrs &perf_attr) {
   }
 }
 
+// The bug checks open and run several perf events, which is a noticeable
+// part of rr's startup time, and can only change on reboot, so their results
+// are kept in the probe cache. check_working_counters is always run: it is
+// what catches counters that don't count, and whether a second counter is
+// available depends on what else is using the PMU right now.
+static string counter_bugs_cache_key(const perf_event_attrs &perf_attr) {
+  char buf[100];
+  sprintf(buf, "perf_counter_bugs_v2.%u.%llx.%d", perf_attr.ticks.type,
+          (long long)perf_attr.ticks.config, perf_attr.bug_flags);
+  return buf;
+}
+
+static bool restore_counter_bugs(perf_event_attrs &perf_attr) {
+  string cached;
+  if (!probe_cache_get(counter_bugs_cache_key(perf_attr), &cached)) {
+    return false;
+  }
+  int ioc_period_bug, arch_offset;
+  if (sscanf(cached.c_str(), "%d %n", &ioc_period_bug, &arch_offset) != 1 ||
+      !arch_counter_bugs_from_string(cached.substr(arch_offset))) {
+    return false;
+  }
+  perf_attr.has_ioc_period_bug = ioc_period_bug;
+  return true;
+}
+
 static void check_for_bugs(perf_event_attrs &perf_attr) {
   DEBUG_ASSERT(!running_under_rr());
 
-  check_for_ioc_period_bug(perf_attr);
+  bool cached = restore_counter_bugs(perf_attr);
+  if (!cached) {
+    check_for_ioc_period_bug(perf_attr);
+  }
   check_working_counters(perf_attr);
-  check_for_arch_bugs(perf_attr);
+  if (!cached) {
+    check_for_arch_counter_bugs(perf_attr);
+    probe_cache_put(counter_bugs_cache_key(perf_attr),
+                    to_string(perf_attr.has_ioc_period_bug) + " " +
+                        arch_counter_bugs_to_string());
+  }
+  check_for_arch_config_bugs(perf_attr);
 }
 
 static std::vector<CpuMicroarch> get_cpu_microarchs() {
@@ -658,14 +694,6 @@ static void make_counter_async(ScopedFd& fd, int signal) {
   }
 }
 
-static void infallible_perf_event_reset_if_open(ScopedFd& fd) {
-  if (fd.is_open()) {
-    if (ioctl(fd, PERF_EVENT_IOC_RESET, 0)) {
-      FATAL() << "ioctl(PERF_EVENT_IOC_RESET) failed";
-    }
-  }
-}
-
 static void infallible_perf_event_enable_if_open(ScopedFd& fd) {
   if (fd.is_open()) {
     if (ioctl(fd, PERF_EVENT_IOC_ENABLE, 0)) {
@@ -682,6 +710,19 @@ static void infallible_perf_event_disable_if_open(ScopedFd& fd) {
   }
 }
 
+// The counters we reset and toggle on every resume (ticks interrupt, minus
+// ticks, measure, in-transaction and strex) are all in the ticks
+// interrupt counter's group, so one ioctl on the leader covers them all.
+static void infallible_perf_event_group_ioctl_if_open(ScopedFd& leader,
+                                                      unsigned long request,
+                                                      const char* name) {
+  if (leader.is_open()) {
+    if (ioctl(leader, request, PERF_IOC_FLAG_GROUP)) {
+      FATAL() << "ioctl(" << name << ", PERF_IOC_FLAG_GROUP) failed";
+    }
+  }
+}
+
 static uint32_t pt_event_type() {
   static const char file_name[] = "/sys/bus/event_source/devices/intel_pt/type";
   ScopedFd fd(file_name, O_RDONLY);
@@ -837,15 +878,33 @@ size_t PerfCounters::PTState::flush() {
         if (aux_packet->flags) {
           FATAL() << "Unexpected AUX packet flags " << aux_packet->flags;
         }
-        pt_data.data.emplace_back();
-        vector<uint8_t>& data = pt_data.data.back();
-        data.resize(aux_packet->aux_size);
         ret += aux_packet->aux_size;
         size_t aux_start_offset = aux_packet->aux_offset % PT_PERF_AUX_SIZE;
         first_chunk_size = min<size_t>(aux_packet->aux_size, PT_PERF_AUX_SIZE - aux_start_offset);
-        memcpy(data.data(), mmap_aux_buffer + aux_start_offset, first_chunk_size);
-        memcpy(data.data() + first_chunk_size, mmap_aux_buffer,
-               aux_packet->aux_size - first_chunk_size);
+        size_t second_chunk_size = aux_packet->aux_size - first_chunk_size;
+        if (spool_fd.is_open()) {
+          // Let the kernel copy straight from the aux buffer into the page
+          // cache; at hundreds of MB/s, staging it in our own buffers
+          // dominates the cost of recording.
+          if (pwrite_all_fallible(spool_fd, mmap_aux_buffer + aux_start_offset,
+                                  first_chunk_size, spool_size) !=
+                  (ssize_t)first_chunk_size ||
+              pwrite_all_fallible(spool_fd, mmap_aux_buffer, second_chunk_size,
+                                  spool_size + first_chunk_size) !=
+                  (ssize_t)second_chunk_size) {
+            FATAL() << "Can't write PT data to " << spool_path;
+          }
+          spool_size += aux_packet->aux_size;
+        } else {
+          pt_data.data.emplace_back();
+          vector<uint8_t>& data = pt_data.data.back();
+          data.resize(aux_packet->aux_size);
+          memcpy(data.data(), mmap_aux_buffer + aux_start_offset, first_chunk_size);
+          memcpy(data.data() + first_chunk_size, mmap_aux_buffer,
+                 second_chunk_size);
+        }
+        // Only now may the kernel reuse this part of the aux buffer.
+        __sync_synchronize();
         mmap_header->aux_tail += aux_packet->aux_size;
         break;
       }
@@ -865,6 +924,35 @@ PTData PerfCounters::extract_intel_pt_data() {
   return result;
 }
 
+bool PerfCounters::save_intel_pt_data(const string& path) {
+  if (!pt_state || !pt_state->spool_fd.is_open() || !pt_state->spool_size) {
+    return false;
+  }
+  if (rename(pt_state->spool_path.c_str(), path.c_str()) < 0) {
+    FATAL() << "Can't rename " << pt_state->spool_path << " to " << path;
+  }
+  pt_state->open_spool(pt_state->spool_path);
+  return true;
+}
+
+void PerfCounters::PTState::open_spool(const string& path) {
+  spool_path = path;
+  spool_fd = ScopedFd(path.c_str(), O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC,
+                      0700);
+  if (!spool_fd.is_open()) {
+    FATAL() << "Can't create " << path;
+  }
+  spool_size = 0;
+}
+
+PerfCounters::PTState::~PTState() {
+  close();
+  if (spool_fd.is_open()) {
+    // Data that never got attributed to an event.
+    unlink(spool_path.c_str());
+  }
+}
+
 void PerfCounters::PTState::close() {
   pt_perf_event_fd.close();
   if (mmap_aux_buffer) {
@@ -926,26 +1014,27 @@ void PerfCounters::start(Task* t, Ticks ticks_period) {
 
     if (pt_state) {
       pt_state->open(tid);
+      if (!pt_state->spool_fd.is_open() && t->session().is_recording()) {
+        stringstream spool_path;
+        spool_path << t->trace_dir() << "/pt_spool_" << t->rec_tid;
+        pt_state->open_spool(spool_path.str());
+      }
       pt_thread_state->start_copying(pt_state.get());
     }
   } else {
     LOG(debug) << "Resetting counters with period " << ticks_period;
 
-    infallible_perf_event_reset_if_open(fd_ticks_interrupt);
+    infallible_perf_event_group_ioctl_if_open(
+        fd_ticks_interrupt, PERF_EVENT_IOC_RESET, "PERF_EVENT_IOC_RESET");
+    // Setting the period also discards the part of the previous period
+    // left over from the last run, so this is needed even if the period
+    // hasn't changed.
     if (ioctl(fd_ticks_interrupt, PERF_EVENT_IOC_PERIOD, &ticks_period)) {
       FATAL() << "ioctl(PERF_EVENT_IOC_PERIOD) failed with period "
               << ticks_period;
     }
-    infallible_perf_event_enable_if_open(fd_ticks_interrupt);
-
-    infallible_perf_event_reset_if_open(fd_minus_ticks_measure);
-    infallible_perf_event_enable_if_open(fd_minus_ticks_measure);
-
-    infallible_perf_event_reset_if_open(fd_ticks_measure);
-    infallible_perf_event_enable_if_open(fd_ticks_measure);
-
-    infallible_perf_event_reset_if_open(fd_ticks_in_transaction);
-    infallible_perf_event_enable_if_open(fd_ticks_in_transaction);
+    infallible_perf_event_group_ioctl_if_open(
+        fd_ticks_interrupt, PERF_EVENT_IOC_ENABLE, "PERF_EVENT_IOC_ENABLE");
 
     if (pt_state) {
       infallible_perf_event_enable_if_open(pt_state->pt_perf_event_fd);
@@ -1000,10 +1089,8 @@ Ticks PerfCounters::stop(Task* t, Error* error) {
   if (always_recreate_counters(perf_attrs[pmu_index])) {
     close();
   } else {
-    infallible_perf_event_disable_if_open(fd_ticks_interrupt);
-    infallible_perf_event_disable_if_open(fd_minus_ticks_measure);
-    infallible_perf_event_disable_if_open(fd_ticks_measure);
-    infallible_perf_event_disable_if_open(fd_ticks_in_transaction);
+    infallible_perf_event_group_ioctl_if_open(
+        fd_ticks_interrupt, PERF_EVENT_IOC_DISABLE, "PERF_EVENT_IOC_DISABLE");
     if (pt_state) {
       infallible_perf_event_disable_if_open(pt_state->pt_perf_event_fd);
     }
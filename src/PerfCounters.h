@@ -13,6 +13,7 @@
 #include <sys/types.h>
 
 #include <memory>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -70,11 +71,17 @@ public:
     ScopedFd pt_perf_event_fd;
     volatile perf_event_mmap_page* mmap_header;
     char* mmap_aux_buffer;
+    // During recording, aux data is written straight from the aux buffer
+    // to this file instead of being collected in |pt_data|.
+    std::string spool_path;
+    ScopedFd spool_fd;
+    uint64_t spool_size;
 
-    PTState() : mmap_header(nullptr), mmap_aux_buffer(nullptr) {}
-    ~PTState() { close(); }
+    PTState() : mmap_header(nullptr), mmap_aux_buffer(nullptr), spool_size(0) {}
+    ~PTState();
 
     void open(pid_t tid);
+    void open_spool(const std::string& path);
     // Returns number of bytes flushed
     size_t flush();
     void close();
@@ -118,6 +125,12 @@ public:
    */
   void close();
 
+  /**
+   * Whether the counters are running, i.e. start() was called without a
+   * matching stop().
+   */
+  bool is_counting() const { return counting; }
+
   /**
    * Return the number of ticks we need for an emulated branch.
    */
@@ -168,6 +181,12 @@ public:
    * Otherwise returns an empty buffer.
    */
   PTData extract_intel_pt_data();
+  /**
+   * If Intel PT data is being spooled to a file (during recording), move
+   * the data accumulated so far to |path| and return true. Returns false
+   * if there's nothing to save or the data isn't being spooled.
+   */
+  bool save_intel_pt_data(const std::string& path);
 
   /**
    * Start the PT copy thread. We need to do this early, before CPU binding
@@ -290,7 +290,15 @@ static bool always_recreate_counters(__attribute__((unused)) const perf_event_at
   return false;
 }
 
-static void check_for_arch_bugs(__attribute__((unused)) perf_event_attrs &perf_attr) {}
+static void check_for_arch_counter_bugs(__attribute__((unused)) perf_event_attrs &perf_attr) {}
+
+static std::string arch_counter_bugs_to_string() { return std::string(); }
+
+static bool arch_counter_bugs_from_string(__attribute__((unused)) const std::string& s) {
+  return true;
+}
+
+static void check_for_arch_config_bugs(__attribute__((unused)) perf_event_attrs &perf_attr) {}
 
 static void post_init_pmu_uarchs(std::vector<PmuConfig> &pmu_uarchs)
 {
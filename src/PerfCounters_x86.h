@@ -385,13 +385,41 @@ static void check_for_freeze_on_smi() {
   }
 }
 
-static void check_for_arch_bugs(perf_event_attrs &perf_attr) {
+// Bugs found by running perf counters. The results can be cached.
+static void check_for_arch_counter_bugs(perf_event_attrs &perf_attr) {
   DEBUG_ASSERT(rr::perf_attrs.size() == 1);
   CpuMicroarch uarch = (CpuMicroarch)perf_attr.bug_flags;
   if (uarch >= FirstIntel && uarch <= LastIntel) {
     check_for_kvm_in_txcp_bug(perf_attr);
     check_for_xen_pmi_bug(perf_attr);
   }
+}
+
+static std::string arch_counter_bugs_to_string() {
+  char buf[20];
+  sprintf(buf, "%d %d %d", supports_txcp, has_kvm_in_txcp_bug,
+          has_xen_pmi_bug);
+  return buf;
+}
+
+// Returns false if |s| isn't usable and the checks need rerunning.
+static bool arch_counter_bugs_from_string(const std::string& s) {
+  int txcp, kvm_in_txcp, xen_pmi;
+  if (sscanf(s.c_str(), "%d %d %d", &txcp, &kvm_in_txcp, &xen_pmi) != 3 ||
+      xen_pmi) {
+    // Rerun the Xen check so it can report the bug.
+    return false;
+  }
+  supports_txcp = txcp;
+  has_kvm_in_txcp_bug = kvm_in_txcp;
+  has_xen_pmi_bug = false;
+  return true;
+}
+
+// Configuration problems we warn about. These are cheap and aren't cached,
+// so the warnings are always shown.
+static void check_for_arch_config_bugs(perf_event_attrs &perf_attr) {
+  CpuMicroarch uarch = (CpuMicroarch)perf_attr.bug_flags;
   if (uarch >= IntelCometlake && uarch <= LastIntel) {
     check_for_freeze_on_smi();
   }
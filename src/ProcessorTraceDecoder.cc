@@ -103,8 +103,32 @@ static const vector<uint8_t>& rr_page_for_recording(SupportedArch arch) {
   return *page;
 }
 
+ssize_t ProcessorTraceDecoder::read_mem_cached(remote_ptr<void> addr,
+                                               size_t size, uint8_t* buffer) {
+  size_t done = 0;
+  while (done < size) {
+    remote_ptr<void> page = floor_page_size(addr + done);
+    auto it = page_cache.find(page.as_int());
+    if (it == page_cache.end()) {
+      vector<uint8_t> data;
+      data.resize(page_size());
+      ssize_t nread = task->read_bytes_fallible(page, data.size(), data.data());
+      data.resize(max<ssize_t>(0, nread));
+      it = page_cache.insert(make_pair(page.as_int(), std::move(data))).first;
+    }
+    size_t offset = addr + done - page;
+    if (offset >= it->second.size()) {
+      break;
+    }
+    size_t n = min(size - done, it->second.size() - offset);
+    memcpy(buffer + done, it->second.data() + offset, n);
+    done += n;
+  }
+  return done ? ssize_t(done) : -1;
+}
+
 int ProcessorTraceDecoder::read_mem(uint64_t ip, uint8_t *buffer, size_t size) {
-  ssize_t ret = task->read_bytes_fallible(ip, size, buffer);
+  ssize_t ret = read_mem_cached(ip, size, buffer);
   if (ret <= 0) {
     return ret;
   }
@@ -5,6 +5,7 @@
 
 #include <stdint.h>
 
+#include <unordered_map>
 #include <vector>
 
 #include "log.h"
@@ -70,6 +71,7 @@ private:
 
   void dump_full_trace_data_to_file();
 
+  ssize_t read_mem_cached(remote_ptr<void> addr, size_t size, uint8_t* buffer);
   void maybe_process_events(int status);
   std::string internal_error_context_string();
 
@@ -78,6 +80,10 @@ private:
   pt_insn_decoder* decoder;
   remote_ptr<void> patch_addr;
   std::vector<uint8_t> patch_data;
+  // libipt fetches every decoded instruction's bytes separately. The
+  // task's memory doesn't change while we decode, so keep the pages we've
+  // read, keyed by page address. Each holds only the readable bytes.
+  std::unordered_map<uintptr_t, std::vector<uint8_t>> page_cache;
   Mode mode;
   bool need_sync;
 };
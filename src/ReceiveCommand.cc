@@ -0,0 +1,233 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <vector>
+
+#include "Command.h"
+#include "TraceStream.h"
+#include "TraceUploader.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+namespace rr {
+
+class ReceiveCommand : public Command {
+public:
+  virtual int run(vector<string>& args) override;
+
+protected:
+  ReceiveCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static ReceiveCommand singleton;
+};
+
+ReceiveCommand ReceiveCommand::singleton(
+    "receive",
+    " rr receive [OPTION]... <port>\n"
+    "  Store the traces that 'rr record --stream-to' sends to <port>.\n"
+    "  With <port> 0, a free port is chosen and printed.\n"
+    "  -h, --host=<ADDR>          listen on <ADDR> instead of localhost\n"
+    "  -o, --output-dir=<DIR>     store traces under <DIR> instead of the\n"
+    "                             default trace directory\n"
+    "  --once                     exit after the first trace\n");
+
+struct ReceiveFlags {
+  string host;
+  string output_dir;
+  bool once;
+
+  ReceiveFlags() : once(false) {}
+};
+
+static bool parse_receive_arg(vector<string>& args, ReceiveFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = {
+    { 0, "once", NO_PARAMETER },
+    { 'h', "host", HAS_PARAMETER },
+    { 'o', "output-dir", HAS_PARAMETER },
+  };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 0:
+      flags.once = true;
+      break;
+    case 'h':
+      flags.host = opt.value;
+      break;
+    case 'o':
+      flags.output_dir = opt.value;
+      break;
+    default:
+      DEBUG_ASSERT(0 && "Unknown option");
+  }
+  return true;
+}
+
+static bool read_all(int fd, void* buf, size_t size) {
+  char* p = static_cast<char*>(buf);
+  while (size > 0) {
+    ssize_t ret = read(fd, p, size);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    p += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+// A path component the sender may name: no directories, nothing hidden
+// behind "." or "..".
+static bool valid_name_part(const string& s) {
+  return !s.empty() && s != "." && s != ".." && s.find('/') == string::npos;
+}
+
+/**
+ * Store the trace sent over |sock| under |output_dir|. Sets |*trace_path|
+ * as soon as the trace name is known. Returns true if the sender finished
+ * the trace.
+ */
+static bool receive_trace(const ScopedFd& sock, const string& output_dir,
+                          string* trace_path) {
+  map<string, ScopedFd> files;
+  string trace_name;
+  vector<uint8_t> buf;
+  while (true) {
+    TraceUploader::UploadHeader header;
+    if (!read_all(sock, &header, sizeof(header)) ||
+        header.magic != TraceUploader::MAGIC) {
+      return false;
+    }
+    if (!header.name_length) {
+      return !trace_name.empty();
+    }
+    if (header.name_length > PATH_MAX) {
+      return false;
+    }
+    string name(header.name_length, '\0');
+    if (!read_all(sock, &name[0], name.size())) {
+      return false;
+    }
+    size_t slash = name.find('/');
+    if (slash == string::npos || !valid_name_part(name.substr(0, slash)) ||
+        !valid_name_part(name.substr(slash + 1))) {
+      fprintf(stderr, "Invalid trace file name `%s'\n", name.c_str());
+      return false;
+    }
+    string file = name.substr(slash + 1);
+    if (trace_name.empty()) {
+      trace_name = name.substr(0, slash);
+      *trace_path = output_dir + "/" + trace_name;
+      if (mkdir(trace_path->c_str(), 0700) < 0) {
+        fprintf(stderr, "Can't create %s: %s\n", trace_path->c_str(),
+                strerror(errno));
+        return false;
+      }
+    } else if (name.compare(0, slash, trace_name) != 0 ||
+               slash != trace_name.size()) {
+      fprintf(stderr, "Unexpected file `%s' in trace %s\n", name.c_str(),
+              trace_name.c_str());
+      return false;
+    }
+
+    auto& fd = files[file];
+    if (!fd.is_open()) {
+      string path = *trace_path + "/" + file;
+      fd = ScopedFd(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+      if (!fd.is_open()) {
+        fprintf(stderr, "Can't create %s: %s\n", path.c_str(),
+                strerror(errno));
+        return false;
+      }
+    }
+    uint64_t offset = header.offset;
+    uint64_t remaining = header.length;
+    while (remaining > 0) {
+      size_t size = min<uint64_t>(remaining, 1024 * 1024);
+      buf.resize(size);
+      if (!read_all(sock, buf.data(), size)) {
+        return false;
+      }
+      if (pwrite_all_fallible(fd, buf.data(), size, offset) != (ssize_t)size) {
+        fprintf(stderr, "Can't write to %s/%s: %s\n", trace_path->c_str(),
+                file.c_str(), strerror(errno));
+        return false;
+      }
+      offset += size;
+      remaining -= size;
+    }
+  }
+}
+
+static int receive(unsigned short port, const ReceiveFlags& flags) {
+  string output_dir =
+      flags.output_dir.empty() ? trace_save_dir() : flags.output_dir;
+  ensure_dir(output_dir, "trace directory", S_IRWXU);
+
+  OpenedSocket listen_sock =
+      open_socket(flags.host, port, port ? DONT_PROBE : PROBE_PORT);
+  if (!port) {
+    printf("Listening on port %d\n", listen_sock.port);
+    fflush(stdout);
+  }
+
+  while (true) {
+    ScopedFd sock(accept4(listen_sock.fd, nullptr, nullptr, SOCK_CLOEXEC));
+    if (!sock.is_open()) {
+      if (errno == EINTR) {
+        continue;
+      }
+      FATAL() << "accept failed";
+    }
+    string trace_path;
+    bool ok = receive_trace(sock, output_dir, &trace_path);
+    if (ok) {
+      printf("Received %s\n", trace_path.c_str());
+      fflush(stdout);
+    } else {
+      fprintf(stderr, "Incomplete trace%s%s\n",
+              trace_path.empty() ? "" : " ", trace_path.c_str());
+    }
+    if (flags.once) {
+      return ok ? 0 : 1;
+    }
+  }
+}
+
+int ReceiveCommand::run(vector<string>& args) {
+  ReceiveFlags flags;
+  while (parse_receive_arg(args, flags)) {
+  }
+
+  if (args.size() != 1) {
+    print_help(stderr);
+    return 1;
+  }
+  char* end;
+  long port = strtol(args[0].c_str(), &end, 10);
+  if (args[0].empty() || *end || port < 0 || port > 65535) {
+    print_help(stderr);
+    return 1;
+  }
+  return receive((unsigned short)port, flags);
+}
+
+} // namespace rr
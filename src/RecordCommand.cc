@@ -32,7 +32,19 @@ RecordCommand RecordCommand::singleton(
     " rr record [OPTION]... <exe> [exe-args]...\n"
     "  -c, --num-cpu-ticks=<NUM>  maximum number of 'CPU ticks' (currently \n"
     "                             retired conditional branches) to allow a \n"
-    "                             task to run before interrupting it\n"
+    "                             task to run before interrupting it. \n"
+    "                             Without -c, timeslices shrink while tasks\n"
+    "                             contend (yield, spin, futex-wait) and grow\n"
+    "                             back otherwise\n"
+    "  --compression=<SPEC>       select trace compression. <SPEC> is\n"
+    "                             <CODEC>[:<LEVEL>] for all substreams, or\n"
+    "                             a comma-separated list of\n"
+    "                             <SUBSTREAM>=<CODEC>[:<LEVEL>] where\n"
+    "                             <SUBSTREAM> is events, data, mmaps or\n"
+    "                             tasks and <CODEC> is brotli (default),\n"
+    "                             zstd or none. E.g. --compression=data=zstd:1\n"
+    "                             'none' spends disk instead of CPU while\n"
+    "                             recording; 'rr pack' compresses it later.\n"
     "  --disable-avx-512          Masks out the CPUID bits for AVX512\n"
     "                             This can improve trace portability\n"
     "  --disable-cpuid-features <CCC>[,<DDD>]\n"
@@ -51,6 +63,9 @@ RecordCommand RecordCommand::singleton(
     "                             reproduce bugs\n"
     "  -n, --no-syscall-buffer    disable the syscall buffer preload \n"
     "                             library even if it would otherwise be used\n"
+    "  --file-store=<dir>         share copies of mmapped files with other\n"
+    "                             traces recorded or packed with the same\n"
+    "                             `rr pack --store' directory\n"
     "  --no-file-cloning          disable file cloning for mmapped files\n"
     "  --no-read-cloning          disable file-block cloning for syscallbuf\n"
     "                             reads\n"
@@ -101,10 +116,38 @@ RecordCommand RecordCommand::singleton(
     "  --copy-preload-src         Copy preload sources to trace dir\n"
     "  --stap-sdt                 Enables the use of SystemTap statically-\n"
     "                             defined tracepoints\n"
+    "  --stream-to=<HOST>:<PORT>  Send the trace to 'rr receive' on <HOST>\n"
+    "                             while recording. Compressed blocks are\n"
+    "                             dropped from the local trace once sent,\n"
+    "                             so only the received copy is replayable.\n"
+    "  --max-buffer-memory=<BYTES>\n"
+    "                             Limit the memory used to buffer trace data\n"
+    "                             for compression to <BYTES>, which must\n"
+    "                             be at least 6907495 (about 6.6MB) so each\n"
+    "                             substream can buffer two blocks.\n"
+    "                             Blocks are stored uncompressed while the\n"
+    "                             compressors can't keep up; 'rr pack'\n"
+    "                             compresses them later.\n"
+    "  --verify                   When recording ends, replay the trace\n"
+    "                             without a debugger and exit with status\n"
+    "                             70 if it doesn't replay\n"
     "  --asan                     Override heuristics and always enable ASAN\n"
     "                             compatibility.\n"
     "  --tsan                     Override heuristics and always enable TSAN\n"
-    "                             compatibility.\n");
+    "                             compatibility.\n"
+    "  --writer-stats             When recording ends, print bytes, blocks,\n"
+    "                             compression, write and stall times, stall\n"
+    "                             counts and uncompressed blocks for each\n"
+    "                             trace substream\n"
+    "  --writer-stats-file=<FILE> Append the same stats to <FILE> every\n"
+    "                             --writer-stats-interval seconds\n"
+    "  --writer-stats-interval=<N>\n"
+    "                             Seconds between samples (default 1)\n"
+    "  --syscall-stats            When recording ends, print buffered and\n"
+    "                             unbuffered counts, ptrace stops, recorded\n"
+    "                             bytes and handler time for each syscall,\n"
+    "                             and how many rseq critical sections rr\n"
+    "                             aborted\n");
 
 struct RecordFlags {
   vector<string> extra_env;
@@ -188,6 +231,23 @@ struct RecordFlags {
      with PT. */
   bool intel_pt;
 
+  /* Print TraceWriter stats at the end of recording. */
+  bool print_writer_stats;
+
+  /* If not empty, sample TraceWriter stats to this file. */
+  string writer_stats_file;
+  string file_store_dir;
+  int writer_stats_interval;
+
+  /* Print per-syscall dispatch stats at the end of recording. */
+  bool print_syscall_stats;
+
+  /* True if the trace is being sent with --stream-to. */
+  bool stream_to;
+
+  /* Replay the trace once recording ends. */
+  bool verify;
+
   RecordFlags()
       : max_ticks(Scheduler::DEFAULT_MAX_TICKS),
         ignore_sig(0),
@@ -212,7 +272,12 @@ struct RecordFlags {
         unmap_vdso(false),
         asan(false),
         tsan(false),
-        intel_pt(false) {}
+        intel_pt(false),
+        print_writer_stats(false),
+        writer_stats_interval(1),
+        print_syscall_stats(false),
+        stream_to(false),
+        verify(false) {}
 };
 
 static void parse_signal_name(ParsedOption& opt) {
@@ -275,6 +340,15 @@ static bool parse_record_arg(vector<string>& args, RecordFlags& flags) {
     { 17, "asan", NO_PARAMETER },
     { 18, "tsan", NO_PARAMETER },
     { 19, "intel-pt", NO_PARAMETER },
+    { 20, "compression", HAS_PARAMETER },
+    { 21, "writer-stats", NO_PARAMETER },
+    { 22, "writer-stats-file", HAS_PARAMETER },
+    { 23, "writer-stats-interval", HAS_PARAMETER },
+    { 24, "file-store", HAS_PARAMETER },
+    { 25, "syscall-stats", NO_PARAMETER },
+    { 26, "stream-to", HAS_PARAMETER },
+    { 27, "verify", NO_PARAMETER },
+    { 28, "max-buffer-memory", HAS_PARAMETER },
     { 'c', "num-cpu-ticks", HAS_PARAMETER },
     { 'h', "chaos", NO_PARAMETER },
     { 'i', "ignore-signal", HAS_PARAMETER },
@@ -491,6 +565,52 @@ static bool parse_record_arg(vector<string>& args, RecordFlags& flags) {
     case 19:
       flags.intel_pt = true;
       break;
+    case 20:
+      if (!TraceWriter::set_compression(opt.value)) {
+        return false;
+      }
+      break;
+    case 21:
+      flags.print_writer_stats = true;
+      break;
+    case 22:
+      flags.writer_stats_file = opt.value;
+      break;
+    case 23:
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.writer_stats_interval = opt.int_value;
+      break;
+    case 24: {
+      string index_dir = opt.value + "/index";
+      if ((mkdir(opt.value.c_str(), 0700) < 0 && errno != EEXIST) ||
+          (mkdir(index_dir.c_str(), 0700) < 0 && errno != EEXIST)) {
+        fprintf(stderr, "Can't create file store directory %s\n",
+                index_dir.c_str());
+        return false;
+      }
+      flags.file_store_dir = real_path(opt.value);
+      break;
+    }
+    case 25:
+      flags.print_syscall_stats = true;
+      Session::enable_syscall_statistics();
+      break;
+    case 26:
+      TraceWriter::set_upload_destination(opt.value);
+      flags.stream_to = true;
+      break;
+    case 27:
+      flags.verify = true;
+      break;
+    case 28:
+      if (!opt.verify_valid_int(TraceWriter::min_buffer_memory(),
+                                INT64_MAX)) {
+        return false;
+      }
+      TraceWriter::set_max_buffer_memory(opt.int_value);
+      break;
     case 's':
       flags.always_switch = true;
       break;
@@ -585,6 +705,9 @@ static void install_signal_handlers(void) {
 static void setup_session_from_flags(RecordSession& session,
                                      const RecordFlags& flags) {
   session.scheduler().set_max_ticks(flags.max_ticks);
+  // An explicit -c asks for fixed-length timeslices.
+  session.scheduler().set_adaptive_timeslices(
+      flags.max_ticks == Scheduler::DEFAULT_MAX_TICKS);
   session.scheduler().set_always_switch(flags.always_switch);
   session.set_enable_chaos(flags.chaos);
   if (flags.num_cores) {
@@ -594,6 +717,7 @@ static void setup_session_from_flags(RecordSession& session,
   }
   session.set_use_read_cloning(flags.use_read_cloning);
   session.set_use_file_cloning(flags.use_file_cloning);
+  session.trace_writer().set_file_store_dir(flags.file_store_dir);
   session.set_ignore_sig(flags.ignore_sig);
   session.set_continue_through_sig(flags.continue_through_sig);
   session.set_wait_for_all(flags.wait_for_all);
@@ -660,6 +784,35 @@ static void save_rr_git_revision(const string& trace_dir) {
   }
 }
 
+/**
+ * Replay the trace in |trace_dir| with `rr replay -a` and return true if
+ * that succeeds. The replay's output to stdout/stderr isn't echoed again.
+ */
+static bool verify_trace(const string& trace_dir) {
+  LOG(info) << "Verifying " << trace_dir;
+  pid_t pid;
+  char rr[] = "rr";
+  char replay[] = "replay";
+  char a[] = "-a";
+  char q[] = "-q";
+  char* argv[] = {
+    rr, replay, a, q,
+    const_cast<char*>(trace_dir.c_str()),
+    NULL
+  };
+  int ret = posix_spawn(&pid, "/proc/self/exe", NULL, NULL, argv, environ);
+  if (ret) {
+    FATAL() << "Can't spawn rr replay";
+  }
+  WaitResult result = WaitManager::wait_exit(WaitOptions(pid));
+  if (result.code != WAIT_OK) {
+    FATAL() << "Wait failed";
+  }
+  LOG(info) << "Got replay status " << result.status;
+  return result.status.type() == WaitStatus::EXIT &&
+         result.status.exit_code() == 0;
+}
+
 static void* repeat_SIGTERM(__attribute__((unused)) void* p) {
   sleep_time(TRACEE_SIGTERM_RESPONSE_MAX_TIME);
   /* send another SIGTERM so we wake up and SIGKILL our tracees */
@@ -672,6 +825,46 @@ static void* repeat_SIGTERM(__attribute__((unused)) void* p) {
   }
 }
 
+static void dump_writer_stats(FILE* out, TraceWriter& trace,
+                              double elapsed) {
+  for (TraceStream::Substream s = TraceStream::SUBSTREAM_FIRST;
+       s < TraceStream::SUBSTREAM_COUNT;
+       s = (TraceStream::Substream)(s + 1)) {
+    CompressedWriter::Stats stats = trace.writer_stats(s);
+    fprintf(out,
+            "[WriterStatistics] time %.3f substream %s bytes_in %llu "
+            "bytes_out %llu blocks %llu stalls %llu stored_blocks %llu "
+            "stall_us %lld compress_us %lld write_us %lld\n",
+            elapsed, TraceStream::substream_name(s),
+            (unsigned long long)stats.bytes_in,
+            (unsigned long long)stats.bytes_out,
+            (unsigned long long)stats.blocks,
+            (unsigned long long)stats.producer_stalls,
+            (unsigned long long)stats.stored_blocks,
+            (long long)(stats.producer_stall_time * 1e6),
+            (long long)(stats.compress_time * 1e6),
+            (long long)(stats.write_time * 1e6));
+  }
+  fflush(out);
+}
+
+static void publish_trace_telemetry(RecordSession& session) {
+  uint64_t bytes = 0;
+  uint64_t bytes_written = 0;
+  uint64_t backlog = 0;
+  TraceWriter& trace = session.trace_writer();
+  for (TraceStream::Substream s = TraceStream::SUBSTREAM_FIRST;
+       s < TraceStream::SUBSTREAM_COUNT;
+       s = (TraceStream::Substream)(s + 1)) {
+    CompressedWriter::Stats stats = trace.writer_stats(s);
+    uint64_t in = trace.bytes_written(s);
+    bytes += in;
+    bytes_written += stats.bytes_out;
+    backlog += in - stats.bytes_in;
+  }
+  session.telemetry()->set_trace_stats(bytes, bytes_written, backlog);
+}
+
 static WaitStatus record(const vector<string>& args, const RecordFlags& flags) {
   LOG(info) << "Start recording...";
 
@@ -702,6 +895,20 @@ static WaitStatus record(const vector<string>& args, const RecordFlags& flags) {
   // inherited by the tracee.
   install_signal_handlers();
 
+  FILE* writer_stats_file = nullptr;
+  if (!flags.writer_stats_file.empty()) {
+    writer_stats_file = fopen(flags.writer_stats_file.c_str(), "a");
+    if (!writer_stats_file) {
+      FATAL() << "Can't open " << flags.writer_stats_file;
+    }
+  }
+  // Published for `rr top`.
+  session->set_telemetry(RecordTelemetry::create());
+
+  double start_time = monotonic_now_sec();
+  double next_writer_stats_time = start_time + flags.writer_stats_interval;
+  double next_telemetry_time = start_time;
+
   RecordSession::RecordResult step_result;
   bool did_forward_SIGTERM = false;
   bool did_term_detached_tasks = false;
@@ -713,6 +920,21 @@ static WaitStatus record(const vector<string>& args, const RecordFlags& flags) {
     if (!done_initial_exec && session->done_initial_exec() && flags.output_trace_dir.empty()) {
       session->trace_writer().make_latest_trace();
     }
+    if (writer_stats_file) {
+      double now = monotonic_now_sec();
+      if (now >= next_writer_stats_time) {
+        dump_writer_stats(writer_stats_file, session->trace_writer(),
+                          now - start_time);
+        next_writer_stats_time = now + flags.writer_stats_interval;
+      }
+    }
+    if (session->telemetry()) {
+      double now = monotonic_now_sec();
+      if (now >= next_telemetry_time) {
+        publish_trace_telemetry(*session);
+        next_telemetry_time = now + 0.25;
+      }
+    }
     if (term_requested) {
       if (monotonic_now_sec() - term_requested > TRACEE_SIGTERM_RESPONSE_MAX_TIME) {
         /* time ran out for the tracee to respond to SIGTERM; kill everything */
@@ -734,6 +956,24 @@ static WaitStatus record(const vector<string>& args, const RecordFlags& flags) {
 
   session->close_trace_writer(TraceWriter::CLOSE_OK);
   static_session = nullptr;
+  if (writer_stats_file) {
+    dump_writer_stats(writer_stats_file, session->trace_writer(),
+                      monotonic_now_sec() - start_time);
+    fclose(writer_stats_file);
+  }
+  if (flags.print_writer_stats) {
+    dump_writer_stats(stderr, session->trace_writer(),
+                      monotonic_now_sec() - start_time);
+  }
+  if (flags.print_syscall_stats) {
+    session->print_syscall_statistics(stderr, "RecordSyscalls");
+  }
+  if (flags.verify && step_result.status == RecordSession::STEP_EXITED &&
+      !verify_trace(session->trace_writer().dir())) {
+    fprintf(stderr, "rr: trace %s failed to replay\n",
+            session->trace_writer().dir().c_str());
+    return WaitStatus::for_exit_code(EX_SOFTWARE);
+  }
 
   switch (step_result.status) {
     case RecordSession::STEP_CONTINUE:
@@ -847,6 +1087,12 @@ int RecordCommand::run(vector<string>& args) {
     return 1;
   }
 
+  if (flags.verify && flags.stream_to) {
+    fprintf(stderr, "rr: --verify can't replay the local trace when it's "
+                    "sent with --stream-to.\n");
+    return 1;
+  }
+
   assert_prerequisites(flags.use_syscall_buffer);
 
   if (flags.setuid_sudo) {
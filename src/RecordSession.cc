@@ -48,7 +48,7 @@ template <typename T> static remote_ptr<T> mask_low_bit(remote_ptr<T> p) {
 template <typename Arch>
 static void record_robust_futex_change(
     RecordTask* t, const typename Arch::robust_list_head& head,
-    remote_ptr<void> base) {
+    remote_ptr<void> base, map<remote_ptr<uint32_t>, uint32_t>& changes) {
   if (base.is_null()) {
     return;
   }
@@ -69,7 +69,32 @@ static void record_robust_futex_change(
   // Update memory now so that the kernel doesn't decide to do it later, at
   // a time that might race with other tracee execution.
   t->write_mem(futex_ptr, val);
-  t->record_local(futex_ptr, &val);
+  changes[futex_ptr] = val;
+}
+
+/**
+ * Record the futex words in |changes|, merging adjacent words into a single
+ * raw data record. Threads that exit holding many robust mutexes (e.g.
+ * arrays of them) would otherwise produce one tiny record per futex, each
+ * of which also costs a separate write during replay.
+ */
+static void record_robust_futex_ranges(
+    RecordTask* t, const map<remote_ptr<uint32_t>, uint32_t>& changes) {
+  vector<uint32_t> vals;
+  remote_ptr<uint32_t> start;
+  for (auto& change : changes) {
+    if (!vals.empty() && change.first != start + vals.size()) {
+      t->record_local(start, vals.size() * sizeof(uint32_t), vals.data());
+      vals.clear();
+    }
+    if (vals.empty()) {
+      start = change.first;
+    }
+    vals.push_back(change.second);
+  }
+  if (!vals.empty()) {
+    t->record_local(start, vals.size() * sizeof(uint32_t), vals.data());
+  }
 }
 
 /**
@@ -95,17 +120,20 @@ static void record_robust_futex_changes_arch(RecordTask* t) {
   if (!ok) {
     return;
   }
+  map<remote_ptr<uint32_t>, uint32_t> changes;
   record_robust_futex_change<Arch>(t, head,
-                                   mask_low_bit(head.list_op_pending.rptr()));
+                                   mask_low_bit(head.list_op_pending.rptr()),
+                                   changes);
   for (auto current = mask_low_bit(head.list.next.rptr());
        current.as_int() != head_ptr.as_int();) {
-    record_robust_futex_change<Arch>(t, head, current);
+    record_robust_futex_change<Arch>(t, head, current, changes);
     auto next = t->read_mem(current, &ok);
     if (!ok) {
-      return;
+      break;
     }
     current = mask_low_bit(next.next.rptr());
   }
+  record_robust_futex_ranges(t, changes);
 }
 
 static void record_robust_futex_changes(RecordTask* t) {
@@ -1129,8 +1157,60 @@ static bool is_in_privileged_syscall(RecordTask* t) {
   return type && type->privileged == AddressSpace::PRIVILEGED;
 }
 
+/**
+ * Charges the time until it goes out of scope, and any raw data recorded
+ * meanwhile, to the syscall |t| is stopped in.
+ */
+class RecordSyscallStatisticsTimer {
+public:
+  RecordSyscallStatisticsTimer(RecordTask* t)
+      : session(Session::syscall_statistics_enabled() ? &t->session()
+                                                      : nullptr) {
+    if (!session) {
+      return;
+    }
+    const SyscallEvent& ev = t->ev().Syscall();
+    arch = ev.arch();
+    syscallno = ev.number;
+    entering = ev.state == ENTERING_SYSCALL;
+    start_bytes = recorded_bytes();
+    start_ns = monotonic_now_ns();
+  }
+  ~RecordSyscallStatisticsTimer() {
+    if (!session) {
+      return;
+    }
+    Session::SyscallStatistics& stats =
+        session->syscall_statistics_for(arch, syscallno);
+    stats.handler_ns += monotonic_now_ns() - start_ns;
+    stats.bytes += recorded_bytes() - start_bytes;
+    ++stats.ptrace_stops;
+    if (entering) {
+      ++stats.unbuffered;
+    }
+  }
+
+private:
+  uint64_t recorded_bytes() {
+    return session->trace_writer().bytes_written(TraceWriter::RAW_DATA) -
+           session->syscallbuf_flush_bytes();
+  }
+
+  RecordSession* session;
+  SupportedArch arch;
+  int syscallno;
+  bool entering;
+  uint64_t start_bytes;
+  uint64_t start_ns;
+};
+
 void RecordSession::syscall_state_changed(RecordTask* t,
                                           StepState* step_state) {
+  RecordSyscallStatisticsTimer timer(t);
+  if (telemetry_ && t->ev().Syscall().state == ENTERING_SYSCALL) {
+    telemetry_->count_unbuffered_syscall(t->ev().Syscall().arch(),
+                                         t->ev().Syscall().number);
+  }
   switch (t->ev().Syscall().state) {
     case ENTERING_SYSCALL_PTRACE:
       debug_exec_state("EXEC_SYSCALL_ENTRY_PTRACE", t);
@@ -1173,6 +1253,14 @@ void RecordSession::syscall_state_changed(RecordTask* t,
       // rec_prepare_syscall is associated with the syscall event
       t->maybe_flush_syscallbuf();
 
+      // A vfork child that does anything other than exec must stop seeing
+      // its parent's syscallbuf fds.
+      int syscallno = t->ev().Syscall().number;
+      if (!is_execve_syscall(syscallno, t->arch()) &&
+          !is_execveat_syscall(syscallno, t->arch())) {
+        t->close_deferred_buffer_fds();
+      }
+
       last_task_switchable = t->ev().Syscall().switchable =
           rec_prepare_syscall(t);
       t->record_event(t->ev(), RecordTask::DONT_FLUSH_SYSCALLBUF,
@@ -1468,8 +1556,13 @@ static void setup_sigframe_siginfo_arch(RecordTask* t,
       break;
   }
   typename Arch::siginfo_t si = t->read_mem(dest);
+  typename Arch::siginfo_t kernel_si = si;
   set_arch_siginfo(siginfo, t->arch(), &si, sizeof(si));
-  t->write_mem(dest, si);
+  // For most kernel-generated signals (e.g. SIGPROF/SIGALRM from timers) the
+  // kernel's copy already matches, so save the write to the tracee stack.
+  if (memcmp(&si, &kernel_si, sizeof(si))) {
+    t->write_mem(dest, si);
+  }
 }
 
 static void setup_sigframe_siginfo(RecordTask* t, const siginfo_t& siginfo) {
@@ -1660,7 +1753,11 @@ static bool inject_handled_signal(RecordTask* t) {
   if (auto e_ptr = t->extra_regs_fallible()) {
     ExtraRegisters e = *e_ptr;
     e.reset();
-    t->set_extra_regs(e);
+    // Skip the ptrace round trip when the state is already what we want.
+    if (e.data_size() != e_ptr->data_size() ||
+        memcmp(e.data_bytes(), e_ptr->data_bytes(), e.data_size())) {
+      t->set_extra_regs(e);
+    }
   }
 
   return true;
@@ -2330,12 +2427,11 @@ static ExeInfo read_exe_info(const string& exe_file) {
   }
 
   auto syms = reader.read_symbols(".dynsym", ".dynstr");
-  for (size_t i = 0; i < syms.size(); ++i) {
-    if (syms.is_name(i, "__asan_init")) {
-      ret.setup_asan_memory_ranges();
-    } else if (syms.is_name(i, "__tsan_init")) {
-      ret.setup_tsan_memory_ranges();
-    }
+  if (!syms.find("__asan_init").empty()) {
+    ret.setup_asan_memory_ranges();
+  }
+  if (!syms.find("__tsan_init").empty()) {
+    ret.setup_tsan_memory_ranges();
   }
 
   return ret;
@@ -2548,7 +2644,9 @@ RecordSession::RecordSession(const std::string& exe_path,
       enable_chaos_(false),
       wait_for_all_(false),
       use_audit_(use_audit),
-      unmap_vdso_(unmap_vdso) {
+      unmap_vdso_(unmap_vdso),
+      syscallbuf_flush_bytes_(0),
+      last_idle_counters_sweep(0) {
   set_intel_pt_enabled(intel_pt_enabled);
   if (intel_pt_enabled) {
     PerfCounters::start_pt_copy_thread();
@@ -2565,6 +2663,12 @@ RecordSession::RecordSession(const std::string& exe_path,
 
   trace_out.set_bound_cpu(choose_cpu(bind_cpu, cpu_lock));
   do_bind_cpu();
+  if (trace_out.bound_to_cpu() >= 0) {
+    // Keep the compression threads from competing with the tracees for
+    // their core.
+    trace_out.set_helper_thread_affinity(
+        helper_thread_cpus(trace_out.bound_to_cpu(), original_affinity()));
+  }
   ScopedFd error_fd = create_spawn_task_error_pipe();
   RecordTask* t = static_cast<RecordTask*>(
       Task::spawn(*this, error_fd, &tracee_socket_fd(),
@@ -2596,6 +2700,25 @@ RecordSession::~RecordSession() {
   kill_all_tasks();
 }
 
+RecordTelemetryData::StopReason RecordSession::stop_reason(
+    const WaitStatus& status) const {
+  if (status.is_syscall()) {
+    return RecordTelemetryData::STOP_SYSCALL;
+  }
+  if (status.ptrace_event()) {
+    return RecordTelemetryData::STOP_PTRACE_EVENT;
+  }
+  int sig = status.stop_sig();
+  if (sig == PerfCounters::TIME_SLICE_SIGNAL) {
+    return RecordTelemetryData::STOP_TIME_SLICE;
+  }
+  if (sig && sig == syscallbuf_desched_sig_) {
+    return RecordTelemetryData::STOP_DESCHED;
+  }
+  return sig ? RecordTelemetryData::STOP_SIGNAL
+             : RecordTelemetryData::STOP_OTHER;
+}
+
 RecordSession::RecordResult RecordSession::record_step() {
   RecordResult result;
 
@@ -2639,6 +2762,9 @@ RecordSession::RecordResult RecordSession::record_step() {
     return result;
   }
   RecordTask* prev_task = find_task(prev_task_tuid);
+  if (telemetry_ && prev_task != t) {
+    telemetry_->count_scheduler_switch();
+  }
   if (prev_task && prev_task->ev().type() == EV_SCHED) {
     if (prev_task != t) {
       // We did do a context switch, so record the SCHED event. Otherwise
@@ -2668,11 +2794,16 @@ RecordSession::RecordResult RecordSession::record_step() {
     t->registers_at_start_of_last_timeslice = t->regs();
     t->time_at_start_of_last_timeslice = trace_writer().time();
   }
+  t->time_at_last_scheduled = trace_writer().time();
+  close_idle_task_counters(t);
 
   StepState step_state(CONTINUE);
 
   ASSERT(t, t->is_stopped()) << "Somehow we're not stopped here; status="
     << t->status();
+  if (telemetry_ && rescheduled.by_waitpid) {
+    telemetry_->count_ptrace_stop(stop_reason(t->status()));
+  }
   bool did_enter_syscall;
   if (rescheduled.by_waitpid &&
       handle_ptrace_event(&t, &step_state, &result, &did_enter_syscall)) {
@@ -2746,6 +2877,37 @@ RecordSession::RecordResult RecordSession::record_step() {
   return result;
 }
 
+// Only bother with idle counters when there are this many tasks
+static const size_t IDLE_COUNTERS_MIN_TASKS = 256;
+// A task that hasn't been scheduled for this many events is idle
+static const FrameTime IDLE_COUNTERS_EVENTS = 100000;
+
+/**
+ * Every task has its own perf event fds, which costs rr fds and kernel
+ * memory for thread pools where most threads sit blocked. Close the counters
+ * of tasks that haven't run for a long time; PerfCounters::start() reopens
+ * them if the task runs again.
+ */
+void RecordSession::close_idle_task_counters(RecordTask* current) {
+  FrameTime now = trace_writer().time();
+  if (task_map.size() < IDLE_COUNTERS_MIN_TASKS || intel_pt_enabled() ||
+      now - last_idle_counters_sweep < IDLE_COUNTERS_EVENTS) {
+    return;
+  }
+  last_idle_counters_sweep = now;
+  size_t closed = 0;
+  for (auto& v : task_map) {
+    RecordTask* t = static_cast<RecordTask*>(v.second);
+    if (t == current || t->detached_proxy || t->hpc.is_counting() ||
+        now - t->time_at_last_scheduled < IDLE_COUNTERS_EVENTS) {
+      continue;
+    }
+    t->hpc.close();
+    ++closed;
+  }
+  LOG(debug) << "Closed perf counters of " << closed << " idle tasks";
+}
+
 void RecordSession::terminate_tracees() {
   for (auto& v : task_map) {
     RecordTask* t = static_cast<RecordTask*>(v.second);
@@ -2837,6 +2999,25 @@ uint64_t RecordSession::rr_signal_mask() const {
          signal_bit(syscallbuf_desched_sig_);
 }
 
+CPUIDData RecordSession::emulated_cpuid(uint32_t eax, uint32_t ecx) {
+  // Unbound, the APIC IDs in some leaves depend on where we happen to run,
+  // so don't pretend they're stable.
+  if (cpu_binding() < 0) {
+    CPUIDData data = cpuid(eax, ecx);
+    disable_cpuid_features_.amend_cpuid_data(eax, ecx, &data);
+    return data;
+  }
+  auto key = make_pair(eax, ecx);
+  auto it = cpuid_cache.find(key);
+  if (it != cpuid_cache.end()) {
+    return it->second;
+  }
+  CPUIDData data = cpuid(eax, ecx);
+  disable_cpuid_features_.amend_cpuid_data(eax, ecx, &data);
+  cpuid_cache[key] = data;
+  return data;
+}
+
 static const uint32_t CPUID_RDRAND_FLAG = 1 << 30;
 static const uint32_t CPUID_RTM_FLAG = 1 << 11;
 static const uint32_t CPUID_RDSEED_FLAG = 1 << 18;
@@ -3,9 +3,11 @@
 #ifndef RR_RECORD_SESSION_H_
 #define RR_RECORD_SESSION_H_
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
+#include "RecordTelemetry.h"
 #include "Scheduler.h"
 #include "SeccompFilterRewriter.h"
 #include "Session.h"
@@ -79,8 +81,20 @@ public:
   const DisableCPUIDFeatures& disable_cpuid_features() const {
     return disable_cpuid_features_;
   }
+  /**
+   * The result a tracee's trapped `cpuid` with inputs |eax| and |ecx| should
+   * see, i.e. with disable_cpuid_features() applied. When tracees are bound
+   * to a CPU the result can't change, so it's computed once per leaf and
+   * subleaf.
+   */
+  CPUIDData emulated_cpuid(uint32_t eax, uint32_t ecx);
   bool use_syscall_buffer() const { return use_syscall_buffer_; }
+  /* The largest a task's syscallbuf can grow to. */
   size_t syscall_buffer_size() const { return syscall_buffer_size_; }
+  /* Syscallbufs start at this size and grow for tasks that fill them. */
+  size_t syscall_buffer_initial_size() const {
+    return std::min<size_t>(syscall_buffer_size_, 128 * 1024);
+  }
   unsigned char syscallbuf_desched_sig() const { return syscallbuf_desched_sig_; }
   bool use_read_cloning() const { return use_read_cloning_; }
   bool use_file_cloning() const { return use_file_cloning_; }
@@ -145,6 +159,24 @@ public:
 
   Scheduler& scheduler() { return scheduler_; }
 
+  /**
+   * Raw data bytes written by syscallbuf flushes so far. Only maintained
+   * while syscall statistics are enabled, so flushes that happen inside an
+   * unbuffered syscall's handler aren't charged to that syscall.
+   */
+  uint64_t syscallbuf_flush_bytes() const { return syscallbuf_flush_bytes_; }
+  void accumulate_syscallbuf_flush_bytes(uint64_t bytes) {
+    syscallbuf_flush_bytes_ += bytes;
+  }
+
+  /**
+   * Counters published for `rr top`, or null if not enabled.
+   */
+  RecordTelemetry* telemetry() { return telemetry_.get(); }
+  void set_telemetry(std::unique_ptr<RecordTelemetry> telemetry) {
+    telemetry_ = std::move(telemetry);
+  }
+
   SeccompFilterRewriter& seccomp_filter_rewriter() {
     return seccomp_filter_rewriter_;
   }
@@ -234,6 +266,7 @@ private:
                              RecordResult* step_result,
                              SupportedArch syscall_arch);
   void check_initial_task_syscalls(RecordTask* t, RecordResult* step_result);
+  RecordTelemetryData::StopReason stop_reason(const WaitStatus& status) const;
   void handle_seccomp_trap(RecordTask* t, StepState* step_state,
                            uint16_t seccomp_data);
   void handle_seccomp_errno(RecordTask* t, StepState* step_state,
@@ -249,6 +282,7 @@ private:
   void desched_state_changed(RecordTask* t);
   bool prepare_to_inject_signal(RecordTask* t, StepState* step_state);
   void task_continue(const StepState& step_state);
+  void close_idle_task_counters(RecordTask* current);
 
   TraceWriter trace_out;
   Scheduler scheduler_;
@@ -257,6 +291,8 @@ private:
   std::unique_ptr<const TraceUuid> trace_id;
 
   DisableCPUIDFeatures disable_cpuid_features_;
+  // Amended cpuid results by (eax, ecx), when bound to a CPU
+  std::map<std::pair<uint32_t, uint32_t>, CPUIDData> cpuid_cache;
   int ignore_sig;
   int continue_through_sig;
   Switchable last_task_switchable;
@@ -286,6 +322,11 @@ private:
 
   bool use_audit_;
   bool unmap_vdso_;
+
+  uint64_t syscallbuf_flush_bytes_;
+  std::unique_ptr<RecordTelemetry> telemetry_;
+  // When close_idle_task_counters last ran
+  FrameTime last_idle_counters_sweep;
 };
 
 } // namespace rr
@@ -10,9 +10,13 @@
 #include <sys/resource.h>
 #include <sys/syscall.h>
 
+#include <algorithm>
+
 #include "AutoRemoteSyscalls.h"
 #include "PreserveFileMonitor.h"
 #include "RecordSession.h"
+#include "SpanTracer.h"
+#include "VirtualPerfCounterMonitor.h"
 #include "WaitManager.h"
 #include "core.h"
 #include "kernel_abi.h"
@@ -163,6 +167,7 @@ RecordTask::RecordTask(RecordSession& session, pid_t _tid, uint32_t serial,
       ticks_at_last_recorded_syscall_exit(0),
       ip_at_last_recorded_syscall_exit(nullptr),
       time_at_start_of_last_timeslice(0),
+      time_at_last_scheduled(0),
       priority(0),
       in_round_robin_queue(false),
       stable_exit(false),
@@ -182,6 +187,7 @@ RecordTask::RecordTask(RecordSession& session, pid_t _tid, uint32_t serial,
       syscallbuf_blocked_sigs_generation(0),
       flushed_num_rec_bytes(0),
       flushed_syscallbuf(false),
+      syscallbuf_wants_growth(false),
       delay_syscallbuf_reset_for_desched(false),
       delay_syscallbuf_reset_for_seccomp_trap(false),
       prctl_seccomp_status(0),
@@ -490,7 +496,9 @@ template <typename Arch> void RecordTask::init_buffers_arch() {
   auto args = read_mem(child_args);
 
   args.cloned_file_data_fd = -1;
-  args.syscallbuf_size = syscallbuf_size = session().syscall_buffer_size();
+  args.syscallbuf_size = syscallbuf_size =
+      session().syscall_buffer_initial_size();
+  syscallbuf_wants_growth = false;
   KernelMapping syscallbuf_km = init_syscall_buffer(remote, nullptr);
   if (!syscallbuf_km.size()) {
     // Syscallbuf allocation failed. This should mean the child is dead,
@@ -1706,6 +1714,43 @@ void RecordTask::record_local(remote_ptr<void> addr, ssize_t num_bytes,
   trace_writer().write_raw(rec_tid, data, num_bytes, addr);
 }
 
+// Records bigger than this get a buffer of their own rather than growing the
+// shared one, so a single huge record doesn't pin that much memory.
+static const size_t MAX_RECORD_SCRATCH_SIZE = 256 * 1024 * 1024;
+// A shared buffer bigger than this is freed once this many records in a row
+// have needed less than half of it, so the memory a burst of big records
+// used is given back when the burst is over.
+static const size_t RETAINED_RECORD_SCRATCH_SIZE = 1024 * 1024;
+static const uint32_t RECORD_SCRATCH_SHRINK_AFTER = 64;
+
+/**
+ * Returns a buffer of at least |size| bytes to read tracee memory into
+ * before writing it to the trace. Big reads (e.g. a 64MB read()) would
+ * otherwise allocate, page-fault and zero-fill a fresh buffer every time,
+ * which costs about as much as the read itself. Clobbered by the next call.
+ */
+static uint8_t* record_scratch(size_t size, vector<uint8_t>& fallback) {
+  static vector<uint8_t> scratch;
+  static uint32_t small_records;
+  if (size > MAX_RECORD_SCRATCH_SIZE) {
+    fallback.resize(size);
+    return fallback.data();
+  }
+  if (scratch.size() > RETAINED_RECORD_SCRATCH_SIZE &&
+      size < scratch.size() / 2) {
+    if (++small_records >= RECORD_SCRATCH_SHRINK_AFTER) {
+      vector<uint8_t>().swap(scratch);
+      small_records = 0;
+    }
+  } else {
+    small_records = 0;
+  }
+  if (scratch.size() < size) {
+    scratch.resize(size);
+  }
+  return scratch.data();
+}
+
 bool RecordTask::record_remote_by_local_map(remote_ptr<void> addr,
                                             size_t num_bytes) {
   if (uint8_t* local_addr = as->local_mapping(addr, num_bytes)) {
@@ -1727,7 +1772,9 @@ void RecordTask::record_remote(remote_ptr<void> addr, ssize_t num_bytes) {
   }
 
   bool ok = true;
-  auto buf = read_mem(addr.cast<uint8_t>(), num_bytes, &ok);
+  vector<uint8_t> fallback;
+  uint8_t* buf = record_scratch(num_bytes, fallback);
+  read_bytes_helper(addr, num_bytes, buf, &ok);
   if (!ok) {
     // Tracee probably died unexpectedly. This should only happen
     // due to SIGKILL racing with our PTRACE_CONT.
@@ -1741,7 +1788,71 @@ void RecordTask::record_remote(remote_ptr<void> addr, ssize_t num_bytes) {
     ASSERT(this, false) << "Should have recorded " << num_bytes << " bytes from "
                         << addr << ", but failed";
   }
-  trace_writer().write_raw(rec_tid, buf.data(), num_bytes, addr);
+  trace_writer().write_raw(rec_tid, buf, num_bytes, addr);
+}
+
+void RecordTask::record_remote_batch(const vector<MemoryRange>& ranges) {
+  // All the ranges are read at the same moment, so overlapping or adjacent
+  // ranges can be merged and recorded as one record without changing what
+  // replay writes.
+  vector<MemoryRange> merged;
+  for (auto& r : ranges) {
+    if (r.start().is_null()) {
+      continue;
+    }
+    if (!r.size()) {
+      record_local(r.start(), 0, nullptr);
+      continue;
+    }
+    merged.push_back(r);
+  }
+  sort(merged.begin(), merged.end(),
+       [](const MemoryRange& a, const MemoryRange& b) {
+         return a.start() < b.start();
+       });
+  size_t out = 0;
+  for (size_t i = 0; i < merged.size(); ++i) {
+    if (out > 0 && merged[i].start() <= merged[out - 1].end()) {
+      merged[out - 1] = MemoryRange(
+          merged[out - 1].start(), max(merged[out - 1].end(), merged[i].end()));
+    } else {
+      merged[out++] = merged[i];
+    }
+  }
+  merged.resize(out);
+
+  vector<MemoryRange> remote_ranges;
+  size_t total = 0;
+  for (auto& r : merged) {
+    if (!as->local_mapping(r.start(), r.size())) {
+      remote_ranges.push_back(r);
+      total += r.size();
+    }
+  }
+  if (remote_ranges.size() <= 1) {
+    for (auto& r : merged) {
+      record_remote(r);
+    }
+    return;
+  }
+  vector<uint8_t> fallback;
+  uint8_t* buf = record_scratch(total, fallback);
+  if (!read_bytes_batch(remote_ranges, buf)) {
+    // Let record_remote sort out (and report) any failure.
+    for (auto& r : merged) {
+      record_remote(r);
+    }
+    return;
+  }
+
+  size_t offset = 0;
+  for (auto& r : merged) {
+    if (record_remote_by_local_map(r.start(), r.size())) {
+      continue;
+    }
+    trace_writer().write_raw(rec_tid, buf + offset, r.size(), r.start());
+    offset += r.size();
+  }
 }
 
 void RecordTask::record_remote_writable(remote_ptr<void> addr,
@@ -1771,14 +1882,69 @@ void RecordTask::record_remote_writable(remote_ptr<void> addr,
   record_remote(addr, num_bytes);
 }
 
+static bool is_zero_page(const uint8_t* p) {
+  // Written so the compiler can vectorize it.
+  const uint64_t* words = reinterpret_cast<const uint64_t*>(p);
+  size_t count = page_size() / sizeof(uint64_t);
+  for (size_t i = 0; i < count; i += 8) {
+    uint64_t bits = 0;
+    for (size_t j = 0; j < 8; ++j) {
+      bits |= words[i + j];
+    }
+    if (bits) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void add_hole(vector<WriteHole>& holes, uint64_t offset,
+                     uint64_t size) {
+  if (!holes.empty() && holes.back().offset + holes.back().size == offset) {
+    holes.back().size += size;
+  } else {
+    holes.push_back({ offset, size });
+  }
+}
+
+/**
+ * Write |size| bytes of |buf|, which were read from |addr|, as raw data,
+ * except that whole pages of zeroes are added to |holes| (at |offset|
+ * relative to the start of the record) instead.
+ */
+static void write_raw_data_skipping_zero_pages(TraceWriter& writer,
+                                               remote_ptr<void> addr,
+                                               uint64_t offset,
+                                               const uint8_t* buf, size_t size,
+                                               vector<WriteHole>& holes) {
+  size_t data_start = 0;
+  size_t page = ceil_page_size(addr) - addr;
+  for (; page + page_size() <= size; page += page_size()) {
+    if (!is_zero_page(buf + page)) {
+      continue;
+    }
+    if (data_start < page) {
+      writer.write_raw_data(buf + data_start, page - data_start);
+    }
+    add_hole(holes, offset + page, page_size());
+    data_start = page + page_size();
+  }
+  if (data_start < size) {
+    writer.write_raw_data(buf + data_start, size - data_start);
+  }
+}
+
 ssize_t RecordTask::record_remote_fallible(remote_ptr<void> addr,
                                            uintptr_t num_bytes,
                                            const std::vector<WriteHole>& holes) {
   auto hole_iter = holes.begin();
   uintptr_t offset = 0;
-  vector<uint8_t> buf;
+  vector<uint8_t> fallback;
+  // |holes| plus any zero pages we find.
+  vector<WriteHole> all_holes;
   while (offset < num_bytes) {
     if (hole_iter != holes.end() && hole_iter->offset == offset) {
+      add_hole(all_holes, offset, hole_iter->size);
       offset += hole_iter->size;
       ++hole_iter;
       continue;
@@ -1795,18 +1961,19 @@ ssize_t RecordTask::record_remote_fallible(remote_ptr<void> addr,
     }
 
     if (addr) {
-      buf.resize(bytes);
-      ssize_t nread = read_bytes_fallible(addr + offset, bytes, buf.data());
+      uint8_t* buf = record_scratch(bytes, fallback);
+      ssize_t nread = read_bytes_fallible(addr + offset, bytes, buf);
       if (nread <= 0) {
         break;
       }
-      trace_writer().write_raw_data(buf.data(), nread);
+      write_raw_data_skipping_zero_pages(trace_writer(), addr + offset, offset,
+                                         buf, nread, all_holes);
       offset += nread;
     } else {
       offset += bytes;
     }
   }
-  trace_writer().write_raw_header(rec_tid, offset, addr, holes);
+  trace_writer().write_raw_header(rec_tid, offset, addr, all_holes);
   return offset;
 }
 
@@ -1823,8 +1990,10 @@ void RecordTask::record_remote_even_if_null(remote_ptr<void> addr,
     return;
   }
 
-  auto buf = read_mem(addr.cast<uint8_t>(), num_bytes);
-  trace_writer().write_raw(rec_tid, buf.data(), num_bytes, addr);
+  vector<uint8_t> fallback;
+  uint8_t* buf = record_scratch(num_bytes, fallback);
+  read_bytes_helper(addr, num_bytes, buf);
+  trace_writer().write_raw(rec_tid, buf, num_bytes, addr);
 }
 
 void RecordTask::pop_event(EventType expected_type) {
@@ -1894,7 +2063,30 @@ static void maybe_handle_rseq(RecordTask* t) {
   RR_ARCH_FUNCTION(maybe_handle_rseq_arch, t->arch(), t);
 }
 
+/**
+ * Charge the records in a syscallbuf about to be flushed to their syscalls.
+ * |records| holds hdr.num_rec_bytes of record data.
+ */
+static void accumulate_buffered_syscall_statistics(RecordTask* t,
+                                                   const uint8_t* records,
+                                                   size_t size) {
+  size_t offset = 0;
+  while (offset + sizeof(struct syscallbuf_record) <= size) {
+    auto record =
+        reinterpret_cast<const struct syscallbuf_record*>(records + offset);
+    if (record->size < sizeof(*record)) {
+      break;
+    }
+    Session::SyscallStatistics& stats =
+        t->session().syscall_statistics_for(t->arch(), record->syscallno);
+    ++stats.buffered;
+    stats.bytes += record->size - sizeof(*record);
+    offset += stored_record_size(record->size);
+  }
+}
+
 void RecordTask::maybe_flush_syscallbuf() {
+  ScopedSpan span("RecordTask::maybe_flush_syscallbuf");
   if (EV_SYSCALLBUF_FLUSH == ev().type()) {
     // Already flushing.
     return;
@@ -1913,6 +2105,19 @@ void RecordTask::maybe_flush_syscallbuf() {
   ASSERT(this,
          !flushed_syscallbuf || flushed_num_rec_bytes == hdr.num_rec_bytes);
 
+  if (hdr.record_did_not_fit && !flushed_syscallbuf &&
+      syscallbuf_size < session().syscall_buffer_size()) {
+    // A record too big for the buffer never gets buffered, so the buffer
+    // may never be flushed half full. Grow it at the next reset, and make
+    // sure there is one even if the buffer is empty.
+    syscallbuf_wants_growth = true;
+    if (!hdr.num_rec_bytes && is_stopped()) {
+      flushed_syscallbuf = true;
+      flushed_num_rec_bytes = 0;
+      return;
+    }
+  }
+
   if (!hdr.num_rec_bytes || flushed_syscallbuf) {
     // no records, or we've already flushed.
     return;
@@ -1925,14 +2130,25 @@ void RecordTask::maybe_flush_syscallbuf() {
     auto& records = ev().SyscallbufFlush().mprotect_records;
     records = read_mem(REMOTE_PTR_FIELD(preload_globals, mprotect_records[0]),
                        hdr.mprotect_record_count);
-    for (auto& r : records) {
+    for (size_t i = 0; i < records.size(); ++i) {
+      auto& r = records[i];
+      // JITs flip the same range between RW and RX over and over; only the
+      // last of a run of mprotects of the same range matters.
+      if (i + 1 < records.size() && records[i + 1].start == r.start &&
+          records[i + 1].size == r.size) {
+        continue;
+      }
       as->protect(this, r.start, r.size, r.prot);
     }
   }
 
   // Write the entire buffer in one shot without parsing it,
   // because replay will take care of that.
-  if (is_stopped()) {
+  bool collect_statistics = Session::syscall_statistics_enabled();
+  uint64_t start_bytes =
+      collect_statistics ? trace_writer().bytes_written(TraceWriter::RAW_DATA)
+                         : 0;
+  if (is_stopped() && !collect_statistics) {
     record_remote(syscallbuf_child, syscallbuf_data_size());
   } else {
     vector<uint8_t> buf;
@@ -1941,15 +2157,30 @@ void RecordTask::maybe_flush_syscallbuf() {
     read_bytes_helper(syscallbuf_child + 1, hdr.num_rec_bytes,
                       buf.data() + sizeof(hdr));
     record_local(syscallbuf_child, buf.size(), buf.data());
+    if (collect_statistics) {
+      accumulate_buffered_syscall_statistics(this, buf.data() + sizeof(hdr),
+                                             hdr.num_rec_bytes);
+    }
   }
   maybe_handle_rseq(this);
   maybe_handle_set_robust_list(this);
 
   record_current_event();
   pop_event(EV_SYSCALLBUF_FLUSH);
+  if (collect_statistics) {
+    session().accumulate_syscallbuf_flush_bytes(
+        trace_writer().bytes_written(TraceWriter::RAW_DATA) - start_bytes);
+  }
+  if (session().telemetry()) {
+    session().telemetry()->count_syscallbuf_flush();
+  }
 
   flushed_syscallbuf = true;
   flushed_num_rec_bytes = hdr.num_rec_bytes;
+  if (hdr.num_rec_bytes >
+      (syscallbuf_size - session().syscallbuf_hdr_size()) / 2) {
+    syscallbuf_wants_growth = true;
+  }
 
   LOG(debug) << "Syscallbuf flushed with num_rec_bytes="
              << (uint32_t)hdr.num_rec_bytes;
@@ -1960,13 +2191,66 @@ void RecordTask::maybe_flush_syscallbuf() {
  * overridden with a delay request, then record the reset event for
  * replay.
  */
-void RecordTask::maybe_reset_syscallbuf() {
+template <typename Arch>
+static bool in_syscallbuf_code_arch(const Task::ThreadLocals& thread_locals) {
+  auto locals =
+      reinterpret_cast<const preload_thread_locals<Arch>*>(thread_locals);
+  return locals->original_syscall_parameters ||
+         locals->alt_stack_nesting_level > 0;
+}
+
+/**
+ * Returns true if the preload library may be holding pointers into the
+ * syscallbuf, so it can't be moved.
+ */
+static bool in_syscallbuf_code(RecordTask* t) {
+  if (t->is_in_untraced_syscall() ||
+      t->read_mem(REMOTE_PTR_FIELD(t->syscallbuf_child, locked))) {
+    return true;
+  }
+  RR_ARCH_FUNCTION(in_syscallbuf_code_arch, t->arch(),
+                   t->fetch_preload_thread_locals());
+}
+
+/**
+ * Double the syscallbuf of a task whose flushes keep finding it more than
+ * half full, or that had a record not fit, up to the session's configured
+ * size. The buffer has just been
+ * reset, so only the header needs carrying over. Replay finds the new
+ * mapping recorded at the reset's frame time and does the same.
+ */
+static void maybe_grow_syscallbuf(RecordTask* t) {
+  size_t new_size =
+      min(t->syscallbuf_size * 2, t->session().syscall_buffer_size());
+  if (new_size <= t->syscallbuf_size || !t->is_stopped() ||
+      in_syscallbuf_code(t)) {
+    return;
+  }
+  AutoRemoteSyscalls remote(t);
+  KernelMapping km = t->resize_syscall_buffer(remote, new_size, nullptr);
+  if (!km.size()) {
+    return;
+  }
+  LOG(debug) << "Syscallbuf grown to " << new_size << " bytes at "
+             << km.start();
+  auto record_in_trace = t->trace_writer().write_mapped_region(
+      t, km, km.fake_stat(), km.fsname(), vector<TraceRemoteFd>(),
+      TraceWriter::RR_BUFFER_MAPPING);
+  ASSERT(t, record_in_trace == TraceWriter::DONT_RECORD_IN_TRACE);
+  t->trace_writer().note_syscallbuf_resize();
+}
+
+void RecordTask::maybe_reset_syscallbuf(bool may_resize) {
   if (flushed_syscallbuf && !delay_syscallbuf_reset_for_desched &&
       !delay_syscallbuf_reset_for_seccomp_trap) {
     flushed_syscallbuf = false;
     LOG(debug) << "Syscallbuf reset";
     reset_syscallbuf();
     syscallbuf_blocked_sigs_generation = 0;
+    if (may_resize && syscallbuf_wants_growth) {
+      syscallbuf_wants_growth = false;
+      maybe_grow_syscallbuf(this);
+    }
     record_event(Event::syscallbuf_reset());
   }
 }
@@ -1988,18 +2272,16 @@ void RecordTask::record_event(Event ev, FlushSyscallbuf flush,
   if (!ev.has_ticks_slop()) {
     // Only associate PT data with events whose timing is
     // exactly the same between recording and replay.
-    PTData pt_data = hpc.extract_intel_pt_data();
-    if (!pt_data.data.empty()) {
-      write_pt_data(this, current_time, pt_data.data);
-    }
+    hpc.save_intel_pt_data(format_dump_filename(this, current_time, "pt"));
   }
 
   if (trace_writer().clear_fip_fdp()) {
     const ExtraRegisters* maybe_extra = extra_regs_fallible();
     if (maybe_extra) {
       ExtraRegisters extra_registers = *maybe_extra;
-      extra_registers.clear_fip_fdp();
-      set_extra_regs(extra_registers);
+      if (extra_registers.clear_fip_fdp()) {
+        set_extra_regs(extra_registers);
+      }
     }
   }
 
@@ -2039,6 +2321,7 @@ void RecordTask::record_event(Event ev, FlushSyscallbuf flush,
   remote_code_ptr rseq_new_ip = ip();
   bool invalid_rseq_cs = false;
   if (should_apply_rseq_abort(ev.type(), &rseq_new_ip, &invalid_rseq_cs)) {
+    session().accumulate_rseq_abort();
     auto addr = REMOTE_PTR_FIELD(rseq_state->ptr.cast<typename NativeArch::rseq_t>(), rseq_cs);
     uint64_t value = 0;
     write_mem(addr, value);
@@ -2062,7 +2345,9 @@ void RecordTask::record_event(Event ev, FlushSyscallbuf flush,
     // consumed the syscallbuf data.
     // This only works if the event has a reliable tick count so when we
     // reach it, we're done.
-    maybe_reset_syscallbuf();
+    // Preemption stops the tracee outside any syscall, which makes it a
+    // safe point to move the buffer.
+    maybe_reset_syscallbuf(ev.type() == EV_SCHED);
   }
 }
 
@@ -2311,7 +2596,12 @@ void RecordTask::maybe_restore_original_syscall_registers() {
 }
 
 bool RecordTask::post_vm_clone(CloneReason reason, int flags, Task* origin) {
-  if (Task::post_vm_clone(reason, flags, origin)) {
+  bool created_preload_thread_locals_mapping =
+      Task::post_vm_clone(reason, flags, origin);
+  if (reason == TRACEE_CLONE && !(CLONE_SHARE_VM & flags)) {
+    VirtualPerfCounterMonitor::did_fork_into(origin, this);
+  }
+  if (created_preload_thread_locals_mapping) {
     KernelMapping preload_thread_locals_mapping =
       vm()->mapping_of(AddressSpace::preload_thread_locals_start()).map;
     auto mode = trace_writer().write_mapped_region(
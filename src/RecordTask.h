@@ -406,6 +406,10 @@ public:
   void record_remote(const MemoryRange& range) {
     record_remote(range.start(), range.size());
   }
+  // Record each of |ranges| as if by record_remote, reading the tracee
+  // memory for all of them in one batch. Overlapping and adjacent ranges
+  // are merged into a single record.
+  void record_remote_batch(const std::vector<MemoryRange>& ranges);
   ssize_t record_remote_fallible(const MemoryRange& range) {
     return record_remote_fallible(range.start(), range.size());
   }
@@ -487,7 +491,7 @@ public:
    * syscallbuf. It must be after recording an event to ensure during replay
    * we run past any syscallbuf after-syscall code that uses the buffer data.
    */
-  void maybe_reset_syscallbuf();
+  void maybe_reset_syscallbuf(bool may_resize = false);
   /**
    * Record an event on behalf of this.  Record the registers of
    * this (and other relevant execution state) so that it can be
@@ -680,6 +684,8 @@ public:
 
   Registers registers_at_start_of_last_timeslice;
   FrameTime time_at_start_of_last_timeslice;
+  // When the scheduler last picked this task
+  FrameTime time_at_last_scheduled;
   /* Task 'nice' value set by setpriority(2).
      We use this to drive scheduling decisions. rr's scheduler is
      deliberately simple and unfair; a task never runs as long as there's
@@ -759,6 +765,9 @@ public:
    * next available slow (taking |desched| into
    * consideration). */
   bool flushed_syscallbuf;
+  /* Set when a flush found the syscallbuf more than half full. The buffer
+   * is grown at the next reset where that's safe. */
+  bool syscallbuf_wants_growth;
   /* This bit is set when code wants to prevent the syscall
    * record buffer from being reset when it normally would be.
    * This bit is set by the desched code. */
@@ -0,0 +1,113 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "RecordTelemetry.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ScopedFd.h"
+#include "kernel_metadata.h"
+#include "log.h"
+#include "util.h"
+
+using namespace std;
+
+namespace rr {
+
+const char* RecordTelemetryData::stop_reason_name(int reason) {
+  switch (reason) {
+    case STOP_SYSCALL:
+      return "syscall";
+    case STOP_PTRACE_EVENT:
+      return "ptrace-event";
+    case STOP_TIME_SLICE:
+      return "time-slice";
+    case STOP_DESCHED:
+      return "desched";
+    case STOP_SIGNAL:
+      return "signal";
+    case STOP_OTHER:
+      return "other";
+    default:
+      return "???";
+  }
+}
+
+static string telemetry_path(const char* dir, pid_t pid) {
+  return string(dir) + "/rr-telemetry-" + to_string(pid);
+}
+
+static const char* telemetry_dir() {
+  return access("/dev/shm", W_OK) == 0 ? "/dev/shm" : tmp_dir();
+}
+
+/* static */ unique_ptr<RecordTelemetry> RecordTelemetry::create() {
+  string path = telemetry_path(telemetry_dir(), getpid());
+  // The directory is usually world-writable, so never follow or reuse
+  // something already there. A file left by an earlier rr that had our pid
+  // is replaced.
+  int flags = O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+  ScopedFd fd(path.c_str(), flags, 0600);
+  if (!fd.is_open() && errno == EEXIST && unlink(path.c_str()) == 0) {
+    fd = ScopedFd(path.c_str(), flags, 0600);
+  }
+  if (!fd.is_open()) {
+    LOG(warn) << "Can't create " << path << ": " << errno_name(errno);
+    return nullptr;
+  }
+  if (ftruncate(fd, sizeof(RecordTelemetryData)) < 0) {
+    LOG(warn) << "Can't size " << path << ": " << errno_name(errno);
+    unlink(path.c_str());
+    return nullptr;
+  }
+  void* p = mmap(nullptr, sizeof(RecordTelemetryData), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    LOG(warn) << "Can't map " << path << ": " << errno_name(errno);
+    unlink(path.c_str());
+    return nullptr;
+  }
+  // The file starts out zeroed; the magic marks it ready for readers.
+  RecordTelemetryData* data = static_cast<RecordTelemetryData*>(p);
+  data->version = RecordTelemetryData::VERSION;
+  __atomic_store_n(&data->magic, (uint32_t)RecordTelemetryData::MAGIC,
+                   __ATOMIC_RELEASE);
+  return unique_ptr<RecordTelemetry>(new RecordTelemetry(data, path));
+}
+
+RecordTelemetry::~RecordTelemetry() {
+  munmap(data, sizeof(RecordTelemetryData));
+  unlink(path.c_str());
+}
+
+/* static */ string RecordTelemetry::find_path(pid_t pid) {
+  for (const char* dir : { "/dev/shm", tmp_dir() }) {
+    string path = telemetry_path(dir, pid);
+    if (access(path.c_str(), R_OK) == 0) {
+      return path;
+    }
+  }
+  return string();
+}
+
+/* static */ void RecordTelemetry::read(const RecordTelemetryData* shared,
+                                        RecordTelemetryData* out) {
+  while (true) {
+    uint64_t seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+    memcpy(out, shared, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == seq) {
+      return;
+    }
+  }
+}
+
+} // namespace rr
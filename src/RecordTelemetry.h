@@ -0,0 +1,136 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_RECORD_TELEMETRY_H_
+#define RR_RECORD_TELEMETRY_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+
+#include "kernel_abi.h"
+
+namespace rr {
+
+/**
+ * Running totals a recording publishes for `rr top`. Rates are computed by
+ * the reader from the difference between two snapshots.
+ */
+struct RecordTelemetryData {
+  enum { MAGIC = 0x72727470, VERSION = 1 };
+  enum StopReason {
+    STOP_SYSCALL,
+    STOP_PTRACE_EVENT,
+    STOP_TIME_SLICE,
+    STOP_DESCHED,
+    STOP_SIGNAL,
+    STOP_OTHER,
+    STOP_REASON_COUNT
+  };
+  // Unbuffered syscalls are counted per number for rr's native
+  // architecture; the rest go in unbuffered_syscalls_other.
+  enum { MAX_SYSCALLNO = 1024 };
+
+  uint32_t magic;
+  uint32_t version;
+  // Odd while the recording is updating the counters.
+  uint64_t seq;
+  // Ptrace stops the recording handled, by what caused them
+  uint64_t ptrace_stops[STOP_REASON_COUNT];
+  uint64_t syscallbuf_flushes;
+  uint64_t scheduler_switches;
+  // Uncompressed bytes handed to the trace writers
+  uint64_t trace_bytes;
+  // Bytes the trace writers wrote to disk
+  uint64_t trace_bytes_written;
+  // Uncompressed bytes waiting to be compressed
+  uint64_t compression_backlog;
+  uint64_t unbuffered_syscalls_other;
+  uint64_t unbuffered_syscalls[MAX_SYSCALLNO];
+
+  static const char* stop_reason_name(int reason);
+};
+
+/**
+ * The recording side of RecordTelemetryData: a shared file
+ * /dev/shm/rr-telemetry-<rr pid> (or in tmp_dir() if there's no /dev/shm)
+ * mapped into rr. The recording is the only writer and each update is a few
+ * stores bracketed by a seqlock, so the hot path makes no syscalls.
+ * `rr top` maps the same file read-only and copies it out under the seqlock.
+ */
+class RecordTelemetry {
+public:
+  /**
+   * Create the telemetry file for this process. Returns null if it can't
+   * be created; recording works the same without it.
+   */
+  static std::unique_ptr<RecordTelemetry> create();
+  ~RecordTelemetry();
+
+  void count_ptrace_stop(RecordTelemetryData::StopReason reason) {
+    begin_update();
+    ++data->ptrace_stops[reason];
+    end_update();
+  }
+  void count_unbuffered_syscall(SupportedArch arch, int syscallno) {
+    begin_update();
+    if (arch == NativeArch::arch() && syscallno >= 0 &&
+        syscallno < RecordTelemetryData::MAX_SYSCALLNO) {
+      ++data->unbuffered_syscalls[syscallno];
+    } else {
+      ++data->unbuffered_syscalls_other;
+    }
+    end_update();
+  }
+  void count_syscallbuf_flush() {
+    begin_update();
+    ++data->syscallbuf_flushes;
+    end_update();
+  }
+  void count_scheduler_switch() {
+    begin_update();
+    ++data->scheduler_switches;
+    end_update();
+  }
+  void set_trace_stats(uint64_t bytes, uint64_t bytes_written,
+                       uint64_t backlog) {
+    begin_update();
+    data->trace_bytes = bytes;
+    data->trace_bytes_written = bytes_written;
+    data->compression_backlog = backlog;
+    end_update();
+  }
+
+  /**
+   * Where the recording rr process |pid| publishes its telemetry.
+   * Returns the empty string if it doesn't exist.
+   */
+  static std::string find_path(pid_t pid);
+
+  /**
+   * Copy a consistent snapshot of |shared|, which may be being updated
+   * concurrently, to |out|.
+   */
+  static void read(const RecordTelemetryData* shared,
+                   RecordTelemetryData* out);
+
+private:
+  RecordTelemetry(RecordTelemetryData* data, const std::string& path)
+      : data(data), path(path) {}
+
+  void begin_update() {
+    __atomic_store_n(&data->seq, data->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+  void end_update() {
+    __atomic_store_n(&data->seq, data->seq + 1, __ATOMIC_RELEASE);
+  }
+
+  RecordTelemetryData* data;
+  std::string path;
+};
+
+} // namespace rr
+
+#endif /* RR_RECORD_TELEMETRY_H_ */
@@ -393,6 +393,70 @@ void Registers::compare_internal(const Registers& other,
   RR_ARCH_FUNCTION(compare_registers_arch, arch(), *this, other, result);
 }
 
+/**
+ * The comparison masks of RegisterInfo<Arch>::registers laid out over the
+ * bytes of Arch::user_regs_struct, so two register files can be compared
+ * with one masked pass over their bytes. Registers with special comparison
+ * rules (orig_eax/orig_rax) have mask 0 in the table and are handled by
+ * special_registers_match below.
+ */
+template <typename Arch> struct ComparisonByteMask {
+  std::array<uint8_t, sizeof(typename Arch::user_regs_struct)> bytes;
+
+  ComparisonByteMask() {
+    bytes.fill(0);
+    for (auto& rv : RegisterInfo<Arch>::registers) {
+      // XXX assumes a little-endian register file, as elsewhere.
+      for (size_t i = 0; i < rv.nbytes; ++i) {
+        bytes[rv.offset + i] |= uint8_t(rv.comparison_mask >> (i * 8));
+      }
+    }
+  }
+};
+
+template <typename Arch>
+static bool special_registers_match(const typename Arch::user_regs_struct&,
+                                    const typename Arch::user_regs_struct&) {
+  return true;
+}
+
+// See compare_registers_arch.
+template <>
+bool special_registers_match<rr::X86Arch>(
+    const rr::X86Arch::user_regs_struct& r1,
+    const rr::X86Arch::user_regs_struct& r2) {
+  return r1.orig_eax < 0 || r2.orig_eax < 0 || r1.orig_eax == r2.orig_eax;
+}
+
+template <>
+bool special_registers_match<rr::X64Arch>(
+    const rr::X64Arch::user_regs_struct& r1,
+    const rr::X64Arch::user_regs_struct& r2) {
+  return (intptr_t)r1.orig_rax < 0 || (intptr_t)r2.orig_rax < 0 ||
+         r1.orig_rax == r2.orig_rax;
+}
+
+template <typename Arch>
+/* static */ bool Registers::matches_arch(const Registers& reg1,
+                                          const Registers& reg2) {
+  static const ComparisonByteMask<Arch> mask;
+  auto& r1 = reinterpret_cast<const typename Arch::user_regs_struct&>(reg1.u);
+  auto& r2 = reinterpret_cast<const typename Arch::user_regs_struct&>(reg2.u);
+  const uint8_t* p1 = reinterpret_cast<const uint8_t*>(&r1);
+  const uint8_t* p2 = reinterpret_cast<const uint8_t*>(&r2);
+  // No early exit, so the compiler can vectorize this.
+  uint8_t diff = 0;
+  for (size_t i = 0; i < mask.bytes.size(); ++i) {
+    diff |= (p1[i] ^ p2[i]) & mask.bytes[i];
+  }
+  return !diff && special_registers_match<Arch>(r1, r2);
+}
+
+bool Registers::matches(const Registers& other) const {
+  DEBUG_ASSERT(arch() == other.arch());
+  RR_ARCH_FUNCTION(matches_arch, arch(), *this, other);
+}
+
 template <typename Arch>
 size_t Registers::read_register_arch(uint8_t* buf, GdbServerRegister regno,
                                      bool* defined) const {
@@ -485,12 +485,10 @@ public:
     return result;
   }
 
-  bool matches(const Registers& other) const {
-    Comparison result;
-    result.store_mismatches = false;
-    compare_internal(other, result);
-    return !result.mismatch_count;
-  }
+  // Equivalent to !compare_with(other).mismatch_count, but compares the
+  // register files with a precomputed byte mask instead of walking the
+  // register table, so it's cheap enough for hot paths like mark lookup.
+  bool matches(const Registers& other) const;
 
   // TODO: refactor me to use the GdbServerRegisterValue helper from
   // GdbServerConnection.h.
@@ -575,6 +573,9 @@ private:
 
   void compare_internal(const Registers& other, Comparison& result) const;
 
+  template <typename Arch>
+  static bool matches_arch(const Registers& reg1, const Registers& reg2);
+
   template <typename Arch>
   size_t read_register_arch(uint8_t* buf, GdbServerRegister regno,
                             bool* defined) const;
@@ -8,14 +8,20 @@
 #include <unistd.h>
 
 #include <limits>
+#include <map>
+#include <sstream>
 
 #include "Command.h"
+#include "ExportImportCheckpoints.h"
 #include "Flags.h"
 #include "GdbServer.h"
 #include "ReplaySession.h"
+#include "ReplayTimeline.h"
 #include "ScopedFd.h"
+#include "StdioMonitor.h"
 #include "WaitManager.h"
 #include "core.h"
+#include "core_dump.h"
 #include "kernel_metadata.h"
 #include "launch_debugger.h"
 #include "log.h"
@@ -73,9 +79,21 @@ ReplayCommand ReplayCommand::singleton(
     "  --intel-pt-start-checking-event   verify control flow using Intel PT\n"
     "                             (used for debugging rr)\n"
     "  -x, --gdb-x=<FILE>         execute gdb commands from <FILE>\n"
+    "  --checkpoint-memory-budget=<MB>  limit the memory held by automatic\n"
+    "                             reverse-execution checkpoints to <MB>\n"
+    "                             megabytes, evicting the least useful ones\n"
+    "  --prewarm                  while the debugger is idle, create the\n"
+    "                             checkpoints a reverse-continue from the\n"
+    "                             current position would need\n"
+    "  --dump-core-at=<EVENT>     replay to <EVENT>, write an ELF core file\n"
+    "                             for the task running there and exit\n"
+    "  --shards=<N>               with -a and --checksum, validate checksums\n"
+    "                             in N segments of the trace in parallel\n"
     "  --retry-transient-errors   If we detect a transient error that might resolve\n"
     "                             by retrying, retry it\n"
-    "  --stats=<N>                display brief stats every N steps (eg 10000).\n"
+    "  --stats=<N>                display brief stats every N steps (eg 10000),\n"
+    "                             including where replay spent its time, and\n"
+    "                             per-syscall stats when replay finishes\n"
     "  --serve-files              Serve all files from the trace rather than\n"
     "                             assuming they exist on disk. Debugging will\n"
     "                             be slower, but be able to tolerate missing files\n"
@@ -102,6 +120,10 @@ struct ReplayFlags {
   // We force choosers to specify which they mean.
   enum { CREATED_NONE, CREATED_EXEC, CREATED_FORK } process_created_how;
 
+  // The event at which target_process was created (as above), from the
+  // trace's task events. It can't be the target any earlier than this.
+  FrameTime target_process_event;
+
   // Only open a debug socket, don't launch the debugger too.
   bool dont_launch_debugger;
 
@@ -144,11 +166,24 @@ struct ReplayFlags {
 
   FrameTime intel_pt_start_checking_event;
 
+  // When nonzero, the memory budget for reverse-exec checkpoints, in bytes.
+  uint64_t checkpoint_memory_budget;
+
+  // When true, create reverse-exec checkpoints while the debugger is idle.
+  bool prewarm;
+
+  // When > 1, validate the trace in this many segments concurrently.
+  int shards;
+
+  // When nonzero, write a core file at this event instead of debugging.
+  FrameTime dump_core_event;
+
   ReplayFlags()
       : goto_event(0),
         singlestep_to_event(0),
         target_process(0),
         process_created_how(CREATED_NONE),
+        target_process_event(0),
         dont_launch_debugger(false),
         dbg_port(-1),
         keep_listening(false),
@@ -159,7 +194,11 @@ struct ReplayFlags {
         retry_transient_errors(false),
         dump_interval(0),
         serve_files(false),
-        intel_pt_start_checking_event(-1) {}
+        intel_pt_start_checking_event(-1),
+        checkpoint_memory_budget(0),
+        prewarm(false),
+        shards(1),
+        dump_core_event(0) {}
 };
 
 static bool parse_replay_arg(vector<string>& args, ReplayFlags& flags) {
@@ -189,7 +228,11 @@ static bool parse_replay_arg(vector<string>& args, ReplayFlags& flags) {
     { 3, "serve-files", NO_PARAMETER },
     { 4, "tty", HAS_PARAMETER },
     { 5, "intel-pt-start-checking-event", HAS_PARAMETER },
-    { 6, "retry-transient-errors", NO_PARAMETER }
+    { 6, "retry-transient-errors", NO_PARAMETER },
+    { 7, "checkpoint-memory-budget", HAS_PARAMETER },
+    { 8, "shards", HAS_PARAMETER },
+    { 9, "prewarm", NO_PARAMETER },
+    { 10, "dump-core-at", HAS_PARAMETER }
   };
   ParsedOption opt;
   if (!Command::parse_option(args, options, &opt)) {
@@ -295,6 +338,27 @@ static bool parse_replay_arg(vector<string>& args, ReplayFlags& flags) {
     case 6:
       flags.retry_transient_errors = true;
       break;
+    case 7:
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.checkpoint_memory_budget = (uint64_t)opt.int_value * 1024 * 1024;
+      break;
+    case 8:
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.shards = opt.int_value;
+      break;
+    case 9:
+      flags.prewarm = true;
+      break;
+    case 10:
+      if (!opt.verify_valid_int(1, INT64_MAX)) {
+        return false;
+      }
+      flags.dump_core_event = opt.int_value;
+      break;
     default:
       DEBUG_ASSERT(0 && "Unknown option");
   }
@@ -325,33 +389,30 @@ static int find_pid_for_command(const string& trace_dir,
   }
 }
 
-static bool pid_exists(const string& trace_dir, pid_t pid) {
-  TraceReader trace(trace_dir);
-
-  while (true) {
-    auto e = trace.read_task_event();
-    if (e.type() == TraceTaskEvent::NONE) {
-      return false;
-    }
-    if (e.tid() == pid) {
-      return true;
+/**
+ * When each pid in the trace first shows up in the TASKS substream (at its
+ * clone, or at the initial exec) and when it first exec()s, so replaying to
+ * a process can skip everything that happened before it.
+ */
+struct ProcessCreationIndex {
+  explicit ProcessCreationIndex(const string& trace_dir) {
+    TraceReader trace(trace_dir);
+    while (true) {
+      FrameTime time;
+      auto e = trace.read_task_event(&time);
+      if (e.type() == TraceTaskEvent::NONE) {
+        break;
+      }
+      created.insert(make_pair(e.tid(), time));
+      if (e.type() == TraceTaskEvent::EXEC) {
+        execed.insert(make_pair(e.tid(), time));
+      }
     }
   }
-}
-
-static bool pid_execs(const string& trace_dir, pid_t pid) {
-  TraceReader trace(trace_dir);
 
-  while (true) {
-    auto e = trace.read_task_event();
-    if (e.type() == TraceTaskEvent::NONE) {
-      return false;
-    }
-    if (e.tid() == pid && e.type() == TraceTaskEvent::EXEC) {
-      return true;
-    }
-  }
-}
+  map<pid_t, FrameTime> created;
+  map<pid_t, FrameTime> execed;
+};
 
 // The parent process waits until the server, |waiting_for_child|, creates a
 // debug socket. Then the parent exec()s the debugger over itself. While it's
@@ -374,8 +435,44 @@ static uint64_t to_microseconds(const struct timeval& tv) {
   return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+static void print_histogram(const char* name, const uint64_t* histogram) {
+  fprintf(stderr, "[ReplayHistogram] %s", name);
+  for (int i = 0; i < ReplaySession::PhaseStatistics::HISTOGRAM_BUCKETS; ++i) {
+    if (histogram[i]) {
+      fprintf(stderr, " <%llu:%llu", (unsigned long long)1 << i,
+              (unsigned long long)histogram[i]);
+    }
+  }
+  fputc('\n', stderr);
+}
+
+static void print_phase_statistics(const ReplaySession& session) {
+  const ReplaySession::PhaseStatistics& stats = session.phase_statistics();
+  fputs("[ReplayPhases]", stderr);
+  for (int i = 0; i < ReplaySession::PHASE_COUNT; ++i) {
+    fprintf(stderr, " %s wall_us %llu cpu_us %llu",
+            ReplaySession::phase_name((ReplaySession::Phase)i),
+            (unsigned long long)(stats.wall_ns[i] / 1000),
+            (unsigned long long)(stats.cpu_ns[i] / 1000));
+  }
+  fputc('\n', stderr);
+  print_histogram("async_signal_ticks_left", stats.async_signal_ticks_left);
+  print_histogram("async_signal_singlesteps", stats.async_signal_singlesteps);
+  print_histogram("fast_forward_iterations", stats.fast_forward_iterations);
+  print_histogram("uncheckpointable_run_frames",
+                  stats.uncheckpointable_run_frames);
+  fprintf(stderr,
+          "[ReplayCheckpoints] longest_uncheckpointable_frames %llu start %lld\n",
+          (unsigned long long)stats.longest_uncheckpointable_run,
+          (long long)stats.longest_uncheckpointable_run_start);
+}
+
 static void serve_replay_no_debugger(const string& trace_dir,
                                      const ReplayFlags& flags) {
+  if (flags.dump_interval > 0) {
+    ReplaySession::enable_phase_statistics();
+    Session::enable_syscall_statistics();
+  }
   ReplaySession::shr_ptr replay_session =
     ReplaySession::create(trace_dir, session_flags(flags, true));
   uint32_t step_count = 0;
@@ -390,6 +487,7 @@ static void serve_replay_no_debugger(const string& trace_dir,
     if (flags.singlestep_to_event > 0 &&
         replay_session->trace_reader().time() >= flags.singlestep_to_event) {
       cmd = RUN_SINGLESTEP;
+      StdioMonitor::flush_echoed_output();
       fputs("Stepping from: ", stderr);
       ReplayTask* t = replay_session->current_task()->as_replay();
       t->regs().print_register_file_compact(stderr);
@@ -424,6 +522,7 @@ static void serve_replay_no_debugger(const string& trace_dir,
     if (flags.dump_interval > 0 && step_count % flags.dump_interval == 0) {
       struct timeval now;
       gettimeofday(&now, NULL);
+      StdioMonitor::flush_echoed_output();
       double rectime = replay_session->trace_reader().recording_time();
       uint64_t elapsed_usec = to_microseconds(now) - to_microseconds(last_dump_time);
       Session::Statistics stats = replay_session->statistics();
@@ -436,6 +535,7 @@ static void serve_replay_no_debugger(const string& trace_dir,
           (long long)elapsed_usec,
           100.0 * ((rectime - last_dump_rectime) * 1.0e6) / (double)elapsed_usec
         );
+      print_phase_statistics(*replay_session);
       last_dump_time = now;
       last_stats = stats;
       last_dump_rectime = rectime;
@@ -451,9 +551,150 @@ static void serve_replay_no_debugger(const string& trace_dir,
                  !result.break_status.singlestep_complete);
   }
 
+  if (flags.dump_interval > 0) {
+    replay_session->print_syscall_statistics(stderr, "ReplaySyscalls");
+  }
   LOG(info) << "Replayer successfully finished";
 }
 
+/**
+ * Replay the shard that starts at `session`'s current position, validating
+ * checksums, up to the first clonable point at or after `end` (where the
+ * next shard starts) or the end of the trace.
+ */
+static void replay_shard(ReplaySession& session, int shard, FrameTime end,
+                         FrameTime checksum) {
+  Flags::get_for_init().checksum = checksum;
+  // The main replay already prints tracee output.
+  session.set_suppress_stdio_before_event(numeric_limits<FrameTime>::max());
+
+  // Shards bound to the recorded CPU would all compete for it. Spread them
+  // out; with CPUID faulting replay doesn't depend on the CPU we run on.
+  int cpu = session.cpu_binding();
+  if (cpu >= 0 && Session::has_cpuid_faulting()) {
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET((cpu + shard) % get_num_cpus(), &mask);
+    if (sched_setaffinity(0, sizeof(mask), &mask) < 0) {
+      LOG(debug) << "Couldn't move shard " << shard << " to another CPU";
+    } else {
+      for (auto& t : session.tasks()) {
+        sched_setaffinity(t.second->tid, sizeof(mask), &mask);
+      }
+    }
+  }
+
+  LOG(debug) << "Shard " << shard << " replaying from "
+             << session.trace_reader().time() << " to " << end;
+  while (true) {
+    auto result = session.replay_step(RUN_CONTINUE);
+    if (result.status == REPLAY_EXITED ||
+        (session.trace_reader().time() >= end && session.can_clone())) {
+      break;
+    }
+  }
+}
+
+/**
+ * Replay the whole trace without checksum validation, forking off a child
+ * at `flags.shards` evenly spaced events that validates checksums from
+ * there up to the next one. Only the checksums are checked in parallel:
+ * the main replay still has to execute everything to reach each shard.
+ * Returns 0 if all shards succeeded.
+ */
+static int serve_replay_sharded(const string& trace_dir,
+                                const ReplayFlags& flags) {
+  FrameTime last_event = 0;
+  {
+    TraceReader reader(trace_dir);
+    while (!reader.at_end()) {
+      last_event = reader.read_frame().time();
+    }
+  }
+  vector<FrameTime> shard_starts;
+  for (int i = 0; i < flags.shards; ++i) {
+    shard_starts.push_back(last_event * i / flags.shards);
+  }
+  shard_starts.push_back(numeric_limits<FrameTime>::max());
+
+  FrameTime checksum = Flags::get().checksum;
+  Flags::get_for_init().checksum = Flags::CHECKSUM_NONE;
+  ReplaySession::shr_ptr replay_session =
+    ReplaySession::create(trace_dir, session_flags(flags, false));
+
+  vector<pid_t> children;
+  size_t next_shard = 0;
+  while (true) {
+    if (next_shard < (size_t)flags.shards &&
+        replay_session->trace_reader().time() >= shard_starts[next_shard] &&
+        replay_session->can_clone()) {
+      pid_t child;
+      ReplaySession::shr_ptr shard = fork_checkpoint(*replay_session, &child);
+      if (shard) {
+        replay_shard(*shard, next_shard, shard_starts[next_shard + 1],
+                     checksum);
+        return 0;
+      }
+      children.push_back(child);
+      ++next_shard;
+    }
+
+    auto result = replay_session->replay_step(RUN_CONTINUE);
+    if (result.status == REPLAY_EXITED) {
+      break;
+    }
+  }
+  Flags::get_for_init().checksum = checksum;
+
+  int ret = 0;
+  for (size_t i = 0; i < children.size(); ++i) {
+    WaitResult result = WaitManager::wait_exit(WaitOptions(children[i]));
+    if (result.code != WAIT_OK) {
+      FATAL() << "Failed to wait for child " << children[i];
+    }
+    if (result.status.type() != WaitStatus::EXIT ||
+        result.status.exit_code() != 0) {
+      fprintf(stderr, "Shard %d failed\n", (int)i);
+      ret = 1;
+    }
+  }
+  LOG(info) << "Replayer successfully finished";
+  return ret;
+}
+
+/**
+ * Replay to the first stop at or after `flags.dump_core_event` and write a
+ * core file for the current task there. Returns 0 on success.
+ */
+static int dump_core_at(const string& trace_dir, const ReplayFlags& flags) {
+  ReplaySession::shr_ptr replay_session =
+    ReplaySession::create(trace_dir, session_flags(flags, false));
+  while (replay_session->trace_reader().time() < flags.dump_core_event) {
+    auto result = replay_session->replay_step(RUN_CONTINUE);
+    if (result.status == REPLAY_EXITED) {
+      fprintf(stderr, "Trace ended before event %lld\n",
+              (long long)flags.dump_core_event);
+      return 1;
+    }
+  }
+  Task* t = replay_session->current_task();
+  if (!t) {
+    fprintf(stderr, "No task at event %lld\n",
+            (long long)flags.dump_core_event);
+    return 1;
+  }
+  stringstream path;
+  path << "core." << replay_session->trace_reader().time() << "." << t->tgid();
+  string error;
+  if (!write_core_dump(t, path.str(), &error)) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+  StdioMonitor::flush_echoed_output();
+  printf("Wrote %s\n", path.str().c_str());
+  return 0;
+}
+
 /* Handling ctrl-C during replay:
  * We want the entire group of processes to remain a single process group
  * since that allows shell job control to work best.
@@ -494,12 +735,28 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
       break;
   }
   target.event = flags.goto_event;
+  if (target.event >= 0) {
+    // GdbServer replays the session as far as target.event without the
+    // timeline's checkpointing, so skip straight past earlier processes.
+    target.event = max(target.event, flags.target_process_event - 1);
+  }
+
+  if (flags.dump_core_event > 0) {
+    int ret = dump_core_at(trace_dir, flags);
+    check_for_leaks();
+    return ret;
+  }
 
   // If we're not going to autolaunch the debugger, don't go
   // through the rigamarole to set that up.  All it does is
   // complicate the process tree and confuse users.
   if (flags.dont_launch_debugger) {
     if (target.event == numeric_limits<decltype(target.event)>::max()) {
+      if (flags.shards > 1) {
+        int ret = serve_replay_sharded(trace_dir, flags);
+        check_for_leaks();
+        return ret;
+      }
       serve_replay_no_debugger(trace_dir, flags);
     } else {
       auto session = ReplaySession::create(trace_dir, session_flags(flags, false));
@@ -624,17 +881,23 @@ int ReplayCommand::run(vector<string>& args) {
     }
   }
   if (flags.process_created_how != ReplayFlags::CREATED_NONE) {
-    if (!pid_exists(trace_dir, flags.target_process)) {
+    ProcessCreationIndex index(trace_dir);
+    auto created = index.created.find(flags.target_process);
+    if (created == index.created.end()) {
       fprintf(stderr, "No process %d found in trace. Try 'rr ps'.\n",
               flags.target_process);
       return 2;
     }
-    if (flags.process_created_how == ReplayFlags::CREATED_EXEC &&
-        !pid_execs(trace_dir, flags.target_process)) {
-      fprintf(stderr, "Process %d never exec()ed. Try 'rr ps', or use "
-                      "'-f'.\n",
-              flags.target_process);
-      return 2;
+    flags.target_process_event = created->second;
+    if (flags.process_created_how == ReplayFlags::CREATED_EXEC) {
+      auto execed = index.execed.find(flags.target_process);
+      if (execed == index.execed.end()) {
+        fprintf(stderr, "Process %d never exec()ed. Try 'rr ps', or use "
+                        "'-f'.\n",
+                flags.target_process);
+        return 2;
+      }
+      flags.target_process_event = execed->second;
     }
   }
   if (flags.dump_interval > 0 && !flags.dont_launch_debugger) {
@@ -642,6 +905,23 @@ int ReplayCommand::run(vector<string>& args) {
     print_help(stderr);
     return 2;
   }
+  if (flags.shards > 1) {
+    if (flags.goto_event != numeric_limits<decltype(flags.goto_event)>::max()) {
+      fprintf(stderr, "--shards requires -a\n");
+      print_help(stderr);
+      return 2;
+    }
+    if (flags.dump_interval || flags.singlestep_to_event) {
+      fprintf(stderr, "--shards is not compatible with --stats or --trace\n");
+      print_help(stderr);
+      return 2;
+    }
+    if (Flags::get().checksum == Flags::CHECKSUM_NONE) {
+      // Without checksums the main replay verifies everything by
+      // itself, so shards would only add work.
+      flags.shards = 1;
+    }
+  }
   if (flags.retry_transient_errors && flags.dump_interval) {
     fprintf(stderr, "--retry-transient-errors is not compatible with --dump-interval");
     print_help(stderr);
@@ -679,6 +959,9 @@ int ReplayCommand::run(vector<string>& args) {
     return 4;
   }
 
+  ReplayTimeline::set_checkpoint_memory_budget(flags.checkpoint_memory_budget);
+  ReplayTimeline::set_prewarm(flags.prewarm);
+
   return replay(trace_dir, flags);
 }
 
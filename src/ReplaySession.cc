@@ -7,8 +7,10 @@
 #include <linux/futex.h>
 #include <syscall.h>
 #include <sys/prctl.h>
+#include <time.h>
 
 #include <algorithm>
+#include <list>
 #include <ostream>
 #include <sstream>
 #include <unordered_map>
@@ -18,6 +20,8 @@
 #include "ProcessorTraceDecoder.h"
 #include "processor_trace_check.h"
 #include "ReplayTask.h"
+#include "SpanTracer.h"
+#include "StdioMonitor.h"
 #include "ThreadGroup.h"
 #include "core.h"
 #include "fast_forward.h"
@@ -31,6 +35,137 @@ using namespace std;
 
 namespace rr {
 
+static bool collect_phase_statistics = false;
+
+void ReplaySession::enable_phase_statistics() {
+  collect_phase_statistics = true;
+}
+
+const char* ReplaySession::phase_name(Phase phase) {
+  switch (phase) {
+    case PHASE_READ_TRACE:
+      return "read_trace";
+    case PHASE_EXECUTE:
+      return "execute";
+    case PHASE_SINGLESTEP:
+      return "singlestep";
+    case PHASE_SYSCALL:
+      return "syscall";
+    case PHASE_FLUSH_SYSCALLBUF:
+      return "flush_syscallbuf";
+    case PHASE_ASYNC_SIGNAL:
+      return "async_signal";
+    case PHASE_CLONE:
+      return "clone";
+    default:
+      return "???";
+  }
+}
+
+void ReplaySession::PhaseStatistics::add_to_histogram(uint64_t* histogram,
+                                                      uint64_t value) {
+  int bucket = 0;
+  while (value && bucket < HISTOGRAM_BUCKETS - 1) {
+    value >>= 1;
+    ++bucket;
+  }
+  ++histogram[bucket];
+}
+
+static uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Charges the time until it goes out of scope to |phase|. While a nested
+ * PhaseTimer is live, the outer one is paused, so phases don't overlap.
+ */
+class PhaseTimer {
+public:
+  PhaseTimer(ReplaySession::PhaseStatistics& stats, ReplaySession::Phase phase)
+      : stats(collect_phase_statistics ? &stats : nullptr),
+        phase(phase),
+        outer(nullptr) {
+    if (!this->stats) {
+      return;
+    }
+    outer = innermost;
+    innermost = this;
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    if (outer) {
+      outer->charge(wall, cpu);
+    }
+    start_wall = wall;
+    start_cpu = cpu;
+  }
+  ~PhaseTimer() {
+    if (!stats) {
+      return;
+    }
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    charge(wall, cpu);
+    innermost = outer;
+    if (outer) {
+      outer->start_wall = wall;
+      outer->start_cpu = cpu;
+    }
+  }
+
+private:
+  void charge(uint64_t wall, uint64_t cpu) {
+    stats->wall_ns[phase] += wall - start_wall;
+    stats->cpu_ns[phase] += cpu - start_cpu;
+  }
+
+  static PhaseTimer* innermost;
+  ReplaySession::PhaseStatistics* stats;
+  ReplaySession::Phase phase;
+  PhaseTimer* outer;
+  uint64_t start_wall;
+  uint64_t start_cpu;
+};
+
+PhaseTimer* PhaseTimer::innermost = nullptr;
+
+/**
+ * Charges the time until it goes out of scope, and the tracee memory written
+ * meanwhile, to a syscall's Session::SyscallStatistics. |stats| is null when
+ * syscall statistics aren't being collected.
+ */
+class ReplaySyscallStatisticsTimer {
+public:
+  ReplaySyscallStatisticsTimer(ReplaySession& session, SupportedArch arch,
+                               int syscallno)
+      : stats(Session::syscall_statistics_enabled()
+                  ? &session.syscall_statistics_for(arch, syscallno)
+                  : nullptr),
+        session(session) {
+    if (!stats) {
+      return;
+    }
+    start_bytes = session.statistics().bytes_written;
+    start_ns = monotonic_now_ns();
+  }
+  ~ReplaySyscallStatisticsTimer() {
+    if (!stats) {
+      return;
+    }
+    stats->handler_ns += monotonic_now_ns() - start_ns;
+    stats->bytes += session.statistics().bytes_written - start_bytes;
+  }
+
+  Session::SyscallStatistics* const stats;
+
+private:
+  ReplaySession& session;
+  uint64_t start_bytes;
+  uint64_t start_ns;
+};
+
 static void debug_memory(ReplayTask* t) {
   FrameTime current_time = t->current_frame_time();
   if (should_dump_memory(t->current_trace_frame().event(), current_time)) {
@@ -201,8 +336,47 @@ static void check_xsave_compatibility(const TraceReader& trace_in) {
   }
 }
 
+/**
+ * The trace directory files ReplaySession::open_mapped_file() keeps open.
+ * A trace can have any number of them, so only the most recently used
+ * ones are kept, to stay well clear of RLIMIT_NOFILE.
+ */
+class MappedFileFds {
+public:
+  MappedFileFds() {}
+
+  // Returns a closed fd if |path| isn't open.
+  const ScopedFd& lookup(const string& path) {
+    static const ScopedFd closed;
+    auto it = index.find(path);
+    if (it == index.end()) {
+      return closed;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+  }
+
+  const ScopedFd& insert(const string& path, ScopedFd fd) {
+    lru.push_front(make_pair(path, std::move(fd)));
+    index[path] = lru.begin();
+    if (lru.size() > MAX_OPEN_FILES) {
+      index.erase(lru.back().first);
+      lru.pop_back();
+    }
+    return lru.front().second;
+  }
+
+private:
+  static const size_t MAX_OPEN_FILES = 128;
+
+  // Most recently used first
+  list<pair<string, ScopedFd>> lru;
+  unordered_map<string, list<pair<string, ScopedFd>>::iterator> index;
+};
+
 ReplaySession::ReplaySession(const std::string& dir, const Flags& flags)
     : emu_fs(EmuFs::create()),
+      mapped_file_fds(make_shared<MappedFileFds>()),
       trace_in(dir),
       trace_frame(),
       current_step(),
@@ -268,9 +442,11 @@ ReplaySession::ReplaySession(const ReplaySession& other)
     : Session(other),
       emu_fs(EmuFs::create()),
       tracee_output_fd_(other.tracee_output_fd_),
+      mapped_file_fds(other.mapped_file_fds),
       trace_in(other.trace_in),
       trace_frame(other.trace_frame),
       current_step(other.current_step),
+      flush_recorded_buffer(other.flush_recorded_buffer),
       ticks_at_start_of_event(other.ticks_at_start_of_event),
       cpuid_bug_detector(other.cpuid_bug_detector),
       last_siginfo_(other.last_siginfo_),
@@ -281,15 +457,34 @@ ReplaySession::ReplaySession(const ReplaySession& other)
       detected_transient_error_(other.detected_transient_error_),
       trace_start_time(other.trace_start_time),
       suppress_stdio_before_event_(other.suppress_stdio_before_event_),
+      phase_statistics_(other.phase_statistics_),
       always_free_address_space_fast(other.always_free_address_space_fast),
       always_free_address_space_accurate(other.always_free_address_space_accurate) {}
 
+ScopedFd ReplaySession::open_mapped_file(const string& path) {
+  string prefix = trace_in.dir() + "/";
+  if (path.compare(0, prefix.size(), prefix) != 0) {
+    return ScopedFd(path.c_str(), O_RDONLY | O_CLOEXEC);
+  }
+  const ScopedFd* fd = &mapped_file_fds->lookup(path);
+  if (!fd->is_open()) {
+    ScopedFd file(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!file.is_open()) {
+      return ScopedFd();
+    }
+    fd = &mapped_file_fds->insert(path, std::move(file));
+  }
+  return ScopedFd(fcntl(*fd, F_DUPFD_CLOEXEC, 0));
+}
+
 ReplaySession::~ReplaySession() {
   // We won't permanently leak any OS resources by not ensuring
   // we've cleaned up here, but sessions can be created and
   // destroyed many times, and we don't want to temporarily hog
   // resources.
   kill_all_tasks();
+  // Our tracee output fd may be about to close.
+  StdioMonitor::flush_echoed_output();
   syscall_bp_vm = nullptr;
   DEBUG_ASSERT(task_map.empty() && vm_map.empty());
   DEBUG_ASSERT(emufs().size() == 0);
@@ -297,6 +492,8 @@ ReplaySession::~ReplaySession() {
 
 ReplaySession::shr_ptr ReplaySession::clone() {
   LOG(debug) << "Deepforking ReplaySession " << this << " ...";
+  PhaseTimer timer(phase_statistics_, PHASE_CLONE);
+  ScopedSpan span("ReplaySession::clone");
 
   finish_initializing();
   clear_syscall_bp();
@@ -333,6 +530,35 @@ static bool can_checkpoint_at(const Event& ev) {
   }
 }
 
+// Add the run we're in, if any, to the histogram. |end| is the first frame
+// after it.
+static void finish_uncheckpointable_run(ReplaySession::PhaseStatistics& stats,
+                                        FrameTime end) {
+  if (stats.uncheckpointable_run_start) {
+    ReplaySession::PhaseStatistics::add_to_histogram(
+        stats.uncheckpointable_run_frames,
+        end - stats.uncheckpointable_run_start);
+    stats.uncheckpointable_run_start = 0;
+  }
+}
+
+static void update_uncheckpointable_runs(
+    ReplaySession::PhaseStatistics& stats, const TraceFrame& frame) {
+  if (can_checkpoint_at(frame.event())) {
+    finish_uncheckpointable_run(stats, frame.time());
+    return;
+  }
+  if (!stats.uncheckpointable_run_start) {
+    stats.uncheckpointable_run_start = frame.time();
+  }
+  uint64_t length = frame.time() - stats.uncheckpointable_run_start + 1;
+  if (length > stats.longest_uncheckpointable_run) {
+    stats.longest_uncheckpointable_run = length;
+    stats.longest_uncheckpointable_run_start =
+        stats.uncheckpointable_run_start;
+  }
+}
+
 bool ReplaySession::can_clone() {
   finish_initializing();
 
@@ -399,12 +625,20 @@ int ReplaySession::cpu_binding() const {
 
 void ReplaySession::advance_to_next_trace_frame() {
   if (trace_in.at_end()) {
+    if (collect_phase_statistics) {
+      // The trace usually ends in a run of exit events.
+      finish_uncheckpointable_run(phase_statistics_, trace_frame.time() + 1);
+    }
     trace_frame = TraceFrame(trace_frame.time(), 0, Event::trace_termination(),
                              trace_frame.ticks(), trace_frame.monotonic_time());
     return;
   }
 
-  trace_frame = trace_in.read_frame();
+  PhaseTimer timer(phase_statistics_, PHASE_READ_TRACE);
+  trace_in.read_frame(trace_frame);
+  if (collect_phase_statistics) {
+    update_uncheckpointable_runs(phase_statistics_, trace_frame);
+  }
 }
 
 bool ReplaySession::is_ignored_signal(int sig) {
@@ -629,6 +863,7 @@ static void emulate_syscall_entry(ReplayTask* t, const TraceFrame& frame,
  */
 Completion ReplaySession::enter_syscall(ReplayTask* t,
                                         const StepConstraints& constraints) {
+  PhaseTimer timer(phase_statistics_, PHASE_SYSCALL);
   if (t->regs().matches(trace_frame.regs()) &&
       t->tick_count() == trace_frame.ticks()) {
     // We already entered the syscall via an ENTERING_SYSCALL_PTRACE
@@ -707,6 +942,9 @@ Completion ReplaySession::enter_syscall(ReplayTask* t,
  * Return COMPLETE if successful, or INCOMPLETE if an unhandled trap occurred.
  */
 Completion ReplaySession::exit_syscall(ReplayTask* t) {
+  PhaseTimer timer(phase_statistics_, PHASE_SYSCALL);
+  ReplaySyscallStatisticsTimer syscall_timer(
+      *this, current_step.syscall.arch, current_step.syscall.number);
   t->on_syscall_exit(current_step.syscall.number, current_step.syscall.arch,
                      current_trace_frame().regs());
 
@@ -775,15 +1013,26 @@ Completion ReplaySession::continue_or_step(ReplayTask* t,
                                            TicksRequest tick_request,
                                            ResumeRequest resume_how) {
   if (constraints.command == RUN_SINGLESTEP) {
+    PhaseTimer timer(phase_statistics_, PHASE_SINGLESTEP);
     bool ok = t->resume_execution(RESUME_SINGLESTEP, RESUME_WAIT_NO_EXIT, tick_request);
     ASSERT(t, ok) << "Tracee died unexpectedly";
     handle_unrecorded_cpuid_fault(t, constraints);
   } else if (constraints.command == RUN_SINGLESTEP_FAST_FORWARD) {
-    fast_forward_status |= fast_forward_through_instruction(
+    PhaseTimer timer(phase_statistics_, PHASE_SINGLESTEP);
+    FastForwardStatus status = fast_forward_through_instruction(
         t, RESUME_SINGLESTEP, constraints.stop_before_states);
+    if (collect_phase_statistics && status.did_fast_forward) {
+      PhaseStatistics::add_to_histogram(
+          phase_statistics_.fast_forward_iterations, status.iterations);
+    }
+    fast_forward_status |= status;
     handle_unrecorded_cpuid_fault(t, constraints);
   } else {
-    bool ok = t->resume_execution(resume_how, RESUME_WAIT_NO_EXIT, tick_request);
+    bool ok;
+    {
+      PhaseTimer timer(phase_statistics_, PHASE_EXECUTE);
+      ok = t->resume_execution(resume_how, RESUME_WAIT_NO_EXIT, tick_request);
+    }
     ASSERT(t, ok) << "Tracee died unexpectedly";
     if (t->stop_sig() == 0) {
       auto type = AddressSpace::rr_page_syscall_from_exit_point(t->arch(), t->ip());
@@ -924,6 +1173,7 @@ static bool is_same_execution_point(ReplayTask* t, const Registers& rec_regs,
 Completion ReplaySession::emulate_async_signal(
     ReplayTask* t, const StepConstraints& constraints, Ticks ticks,
     remote_code_ptr in_syscallbuf_syscall_hook) {
+  PhaseTimer timer(phase_statistics_, PHASE_ASYNC_SIGNAL);
   bool in_syscallbuf = !in_syscallbuf_syscall_hook.is_null();
 
   const Registers& regs = trace_frame.regs();
@@ -938,8 +1188,16 @@ Completion ReplaySession::emulate_async_signal(
              << ip;
 
   auto skid_size = t->hpc.skid_size();
-  /* XXX should we only do this if (ticks > 10000)? */
-  while (ticks_left - skid_size > skid_size) {
+  /* Whatever the interrupt leaves over is covered by breakpoints on the
+   * target $ip, which costs a singlestep and a resume every time the target
+   * $ip is reached too early, e.g. in every iteration of a loop. On x86
+   * that's cheap next to an extra interrupt when less than two skids are
+   * left, but aarch64 skids are 10-100 times bigger, so there it's worth
+   * interrupting whenever more than one skid is left.
+   * XXX should we only do this if (ticks > 10000)? */
+  Ticks interrupt_threshold =
+      t->arch() == aarch64 ? skid_size : 2 * (Ticks)skid_size;
+  while (ticks_left > interrupt_threshold) {
     LOG(debug) << "  programming interrupt for "
                << (ticks_left - skid_size) << " ticks";
 
@@ -977,12 +1235,17 @@ Completion ReplaySession::emulate_async_signal(
     }
   }
   guard_overshoot(t, regs, ticks, ticks_left, NULL);
+  if (collect_phase_statistics) {
+    PhaseStatistics::add_to_histogram(
+        phase_statistics_.async_signal_ticks_left, ticks_left);
+  }
 
   /* True when our advancing has triggered a tracee SIGTRAP that needs to
    * be dealt with. */
   bool pending_SIGTRAP = false;
   bool did_set_internal_breakpoints = false;
   RunCommand SIGTRAP_run_command = RUN_CONTINUE;
+  uint64_t singlesteps = 0;
 
   /* Step 2: more slowly, find our way to the target ticks and
    * execution point.  We set an internal breakpoint on the
@@ -1096,6 +1359,10 @@ Completion ReplaySession::emulate_async_signal(
 
     if (at_target) {
       /* Case (2) above: done. */
+      if (collect_phase_statistics) {
+        PhaseStatistics::add_to_histogram(
+            phase_statistics_.async_signal_singlesteps, singlesteps);
+      }
       return COMPLETE;
     }
 
@@ -1147,6 +1414,7 @@ Completion ReplaySession::emulate_async_signal(
         states.push_back(&regs);
         fast_forward_status |=
             fast_forward_through_instruction(t, RESUME_SINGLESTEP, states);
+        ++singlesteps;
         SIGTRAP_run_command = RUN_SINGLESTEP_FAST_FORWARD;
         check_pending_sig(t);
       }
@@ -1325,6 +1593,7 @@ void ReplaySession::prepare_syscallbuf_records(ReplayTask* t, Ticks ticks) {
 
   current_step.flush.stop_breakpoint_offset = recorded_hdr.num_rec_bytes / 8;
   current_step.flush.recorded_ticks = ticks;
+  flush_recorded_buffer = std::move(buf.data);
 
   LOG(debug) << "Prepared " << (uint32_t)recorded_hdr.num_rec_bytes
              << " bytes of syscall records";
@@ -1359,7 +1628,8 @@ static uint32_t apply_mprotect_records(ReplayTask* t,
     uint32_t completed_count = t->read_mem(REMOTE_PTR_FIELD(
         t->syscallbuf_child, mprotect_record_count_completed));
     size_t record_index = skip_mprotect_records;
-    for (const auto& r : records) {
+    for (size_t i = 0; i < records.size(); ++i) {
+      const auto& r = records[i];
       if (record_index >= completed_count) {
         auto km = t->vm()->read_kernel_mapping(t, r.start);
         if (km.prot() != r.prot) {
@@ -1374,6 +1644,12 @@ static uint32_t apply_mprotect_records(ReplayTask* t,
           << "Mismatched mprotect record " << record_index
           << ": recorded " << mprotect_record_string(recorded_r)
           << ", got " << mprotect_record_string(r);
+        // Superseded by the next completed record, as during recording.
+        if (record_index + 1 < completed_count && i + 1 < records.size() &&
+            records[i + 1].start == r.start && records[i + 1].size == r.size) {
+          ++record_index;
+          continue;
+        }
       }
       t->vm()->protect(t, r.start, r.size, r.prot);
       if (running_under_rr()) {
@@ -1424,6 +1700,8 @@ static void maybe_handle_rseq(ReplayTask* t) {
  */
 Completion ReplaySession::flush_syscallbuf(ReplayTask* t,
                                            const StepConstraints& constraints) {
+  PhaseTimer timer(phase_statistics_, PHASE_FLUSH_SYSCALLBUF);
+  ScopedSpan span("ReplaySession::flush_syscallbuf");
   bool legacy_breakpoint_mode = t->vm()->legacy_breakpoint_mode();
   bool user_breakpoint_at_addr = false;
   remote_code_ptr remote_brkpt_addr;
@@ -1464,11 +1742,28 @@ Completion ReplaySession::flush_syscallbuf(ReplayTask* t,
       write_breakpoint_value(t, (uint64_t)-1);
     }
 
-    // Account for buffered syscalls just completed
+    // Account for buffered syscalls just completed, reading the records
+    // from our copy of the recorded buffer, which is what the tracee
+    // replayed them from.
     auto end_rec = t->next_syscallbuf_record();
+    const vector<uint8_t>& recorded = flush_recorded_buffer;
     while (next_rec != end_rec) {
       accumulate_syscall_performed();
-      next_rec = next_rec.as_int() + t->stored_record_size(next_rec);
+      size_t offset =
+          next_rec.as_int() - t->syscallbuf_child.cast<void>().as_int();
+      struct syscallbuf_record rec;
+      if (offset + sizeof(rec) <= recorded.size()) {
+        memcpy(&rec, recorded.data() + offset, sizeof(rec));
+      } else {
+        rec = t->read_mem(next_rec);
+      }
+      if (Session::syscall_statistics_enabled()) {
+        SyscallStatistics& stats =
+            syscall_statistics_for(t->arch(), rec.syscallno);
+        ++stats.buffered;
+        stats.bytes += rec.size - sizeof(rec);
+      }
+      next_rec = next_rec.as_int() + stored_record_size(rec.size);
     }
 
     // Apply the mprotect records we just completed.
@@ -1571,23 +1866,7 @@ void ReplaySession::apply_patch_data(ReplayTask* t) {
   // All patching effects have been recorded to the trace.
   // First, replay any memory mapping done by Monkeypatcher. There should be
   // at most one but we might as well be general.
-  while (true) {
-    TraceReader::MappedData data;
-    bool found;
-    KernelMapping km = t->trace_reader().read_mapped_region(&data, &found);
-    if (!found) {
-      break;
-    }
-    AutoRemoteSyscalls remote(t);
-    ASSERT(t, km.flags() & MAP_ANONYMOUS);
-    remote.infallible_mmap_syscall_if_alive(km.start(), km.size(), km.prot(),
-                                            km.flags() | MAP_FIXED, -1, 0);
-    t->vm()->map(t, km.start(), km.size(), km.prot(), km.flags(), 0, string(),
-                 KernelMapping::NO_DEVICE, KernelMapping::NO_INODE, nullptr,
-                 &km);
-    t->vm()->mapping_flags_of(km.start()) |=
-        AddressSpace::Mapping::IS_PATCH_STUBS;
-  }
+  process_patch_stub_mappings(t);
 
   // Now replay all data records.
   t->apply_all_data_records_from_trace();
@@ -1683,6 +1962,7 @@ Completion ReplaySession::try_one_trace_step(
         bool invalid_rseq_cs;
         if (t->should_apply_rseq_abort(current_trace_frame().event().type(), &rseq_new_ip, &invalid_rseq_cs)
             && t->ip() != rseq_new_ip) {
+          accumulate_rseq_abort();
           Registers r = t->regs();
           r.set_ip(rseq_new_ip);
           t->set_regs(r);
@@ -1848,6 +2128,20 @@ ReplayTask* ReplaySession::setup_replay_one_trace_frame(ReplayTask* t) {
       // the recorded data area. This is important because stray reads such
       // as those performed by return_addresses should be consistent.
       t->reset_syscallbuf();
+      {
+        // A mapping recorded at this frame means the recorder grew the
+        // buffer here.
+        bool found;
+        KernelMapping km = trace_reader().read_mapped_region(
+            nullptr, &found, TraceReader::DONT_VALIDATE,
+            TraceReader::CURRENT_TIME_ONLY);
+        if (found) {
+          AutoRemoteSyscalls remote(t);
+          KernelMapping new_km =
+              t->resize_syscall_buffer(remote, km.size(), km.start());
+          ASSERT(t, new_km.size() == km.size());
+        }
+      }
       current_step.action = TSTEP_RETIRE;
       break;
     case EV_PATCH_SYSCALL:
@@ -1914,8 +2208,23 @@ ReplayTask* ReplaySession::setup_replay_one_trace_frame(ReplayTask* t) {
       }
       if (trace_frame.event().Syscall().state == ENTERING_SYSCALL ||
           trace_frame.event().Syscall().state == ENTERING_SYSCALL_PTRACE) {
+        PhaseTimer timer(phase_statistics_, PHASE_SYSCALL);
+        ReplaySyscallStatisticsTimer syscall_timer(
+            *this, trace_frame.event().Syscall().arch(),
+            trace_frame.event().Syscall().number);
+        if (syscall_timer.stats) {
+          ++syscall_timer.stats->ptrace_stops;
+        }
         rep_prepare_run_to_syscall(t, &current_step);
       } else {
+        PhaseTimer timer(phase_statistics_, PHASE_SYSCALL);
+        ReplaySyscallStatisticsTimer syscall_timer(
+            *this, trace_frame.event().Syscall().arch(),
+            trace_frame.event().Syscall().number);
+        if (syscall_timer.stats) {
+          ++syscall_timer.stats->ptrace_stops;
+          ++syscall_timer.stats->unbuffered;
+        }
         rep_process_syscall(t, &current_step);
         if (current_step.action == TSTEP_RETIRE) {
           t->on_syscall_exit(current_step.syscall.number,
@@ -1962,7 +2271,12 @@ bool ReplaySession::next_step_is_successful_exec_syscall_exit() {
 }
 
 ReplayResult ReplaySession::replay_step(const StepConstraints& constraints) {
-  finish_initializing();
+  {
+    PhaseTimer timer(phase_statistics_, PHASE_CLONE);
+    finish_initializing();
+  }
+
+  StdioMonitor::flush_stale_echoed_output();
 
   ReplayResult result(REPLAY_CONTINUE);
   if (detected_transient_error_) {
@@ -2042,8 +2356,9 @@ ReplayResult ReplaySession::replay_step(const StepConstraints& constraints) {
     const ExtraRegisters* maybe_extra = t->extra_regs_fallible();
     if (maybe_extra) {
       ExtraRegisters extra_registers = *maybe_extra;
-      extra_registers.clear_fip_fdp();
-      t->set_extra_regs(extra_registers);
+      if (extra_registers.clear_fip_fdp()) {
+        t->set_extra_regs(extra_registers);
+      }
     }
   }
 
@@ -3,6 +3,7 @@
 #ifndef RR_REPLAY_SESSION_H_
 #define RR_REPLAY_SESSION_H_
 
+#include <map>
 #include <memory>
 #include <ostream>
 #include <set>
@@ -20,6 +21,7 @@ struct syscallbuf_hdr;
 
 namespace rr {
 
+class MappedFileFds;
 class ReplayTask;
 
 /**
@@ -182,6 +184,15 @@ public:
    * to keep a session around inactive, keep the clone and not the original
    * session. Partially initialized sessions automatically finish
    * initializing when necessary.
+   *
+   * Checkpoints are forked processes rather than saved memory images
+   * because a tracee's state isn't just its pages. Its fd table, file
+   * offsets, pipe and socket buffers, mappings of shared files, signal
+   * state and children are kernel state that only fork() copies. Replay
+   * performs mmap, munmap, clone, execve and many fd operations for
+   * real, so restoring pages into another process is only correct
+   * between points with none of those in between, and reverse-exec
+   * checkpoints are spread much further apart than that.
    */
   shr_ptr clone();
 
@@ -199,6 +210,16 @@ public:
 
   EmuFs& emufs() const { return *emu_fs; }
 
+  /**
+   * Return a new fd open read-only on the mapped file |path|. Files in the
+   * trace directory are opened only once and shared by all clones of this
+   * session, which matters when the trace is on a network filesystem, so
+   * the fd's file offset is shared too: read it with pread. Only the most
+   * recently used files stay open. Returns a closed fd if |path| can't be
+   * opened.
+   */
+  ScopedFd open_mapped_file(const std::string& path);
+
   TraceReader& trace_reader() { return trace_in; }
   const TraceReader& trace_reader() const { return trace_in; }
 
@@ -373,6 +394,52 @@ public:
   void notify_detected_transient_error() { detected_transient_error_ = true; }
 
   void set_suppress_stdio_before_event(FrameTime event) { suppress_stdio_before_event_ = event; }
+
+  /**
+   * Where replay spends its time, for `rr replay --stats`. Each phase's time
+   * excludes time spent in phases nested inside it. CPU time is rr's own.
+   */
+  enum Phase {
+    PHASE_READ_TRACE,
+    PHASE_EXECUTE,
+    PHASE_SINGLESTEP,
+    PHASE_SYSCALL,
+    PHASE_FLUSH_SYSCALLBUF,
+    PHASE_ASYNC_SIGNAL,
+    PHASE_CLONE,
+    PHASE_COUNT
+  };
+  static const char* phase_name(Phase phase);
+  struct PhaseStatistics {
+    // Bucket i counts values v with 2^(i-1) <= v < 2^i; bucket 0 counts v == 0
+    // and the last bucket counts everything larger.
+    enum { HISTOGRAM_BUCKETS = 24 };
+    PhaseStatistics() { memset(this, 0, sizeof(*this)); }
+    static void add_to_histogram(uint64_t* histogram, uint64_t value);
+    uint64_t wall_ns[PHASE_COUNT];
+    uint64_t cpu_ns[PHASE_COUNT];
+    // Ticks still to go after the PMU interrupt stops us short of an async
+    // signal target; that distance is covered by breakpoints and singlesteps.
+    uint64_t async_signal_ticks_left[HISTOGRAM_BUCKETS];
+    // Internal singlesteps needed to cover that distance, per async signal.
+    uint64_t async_signal_singlesteps[HISTOGRAM_BUCKETS];
+    // String instruction iterations per fast-forward.
+    uint64_t fast_forward_iterations[HISTOGRAM_BUCKETS];
+    // Lengths, in frames, of runs of consecutive events we can't checkpoint
+    // at (see can_clone()). ReplayTimeline can't place reverse-exec
+    // checkpoints inside these.
+    uint64_t uncheckpointable_run_frames[HISTOGRAM_BUCKETS];
+    uint64_t longest_uncheckpointable_run;
+    FrameTime longest_uncheckpointable_run_start;
+    // First frame of the run we're currently in, or 0
+    FrameTime uncheckpointable_run_start;
+  };
+  /**
+   * Phase statistics are only collected (for all sessions) after this has
+   * been called, since reading the clocks isn't free.
+   */
+  static void enable_phase_statistics();
+  const PhaseStatistics& phase_statistics() const { return phase_statistics_; }
   bool mark_stdio() const override;
   bool echo_stdio() const;
 
@@ -422,9 +489,15 @@ private:
 
   std::shared_ptr<EmuFs> emu_fs;
   std::shared_ptr<ScopedFd> tracee_output_fd_;
+  // Trace directory files opened by open_mapped_file()
+  std::shared_ptr<MappedFileFds> mapped_file_fds;
   TraceReader trace_in;
   TraceFrame trace_frame;
   ReplayTraceStep current_step;
+  // The recorded syscallbuf contents (header included) for the current
+  // TSTEP_FLUSH_SYSCALLBUF step, so completed records can be accounted for
+  // without reading them back from the tracee.
+  std::vector<uint8_t> flush_recorded_buffer;
   Ticks ticks_at_start_of_event;
   CPUIDBugDetector cpuid_bug_detector;
   siginfo_t last_siginfo_;
@@ -441,6 +514,8 @@ private:
 
   FrameTime suppress_stdio_before_event_;
 
+  PhaseStatistics phase_statistics_;
+
   std::shared_ptr<AddressSpace> syscall_bp_vm;
   remote_code_ptr syscall_bp_addr;
 
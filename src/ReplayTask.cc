@@ -141,39 +141,58 @@ FrameTime ReplayTask::current_frame_time() {
 
 // Returns number of bytes written (including holes)
 static size_t write_data_with_holes(ReplayTask* t,
-                                    const TraceReader::RawDataWithHoles& buf) {
+                                    const TraceReader::RawDataWithHoles& buf,
+                                    bool holes_already_zero = false) {
   unique_ptr<AutoRemoteSyscalls> remote;
-  size_t data_offset = 0;
   size_t addr_offset = 0;
   auto holes_iter = buf.holes.begin();
-  while (data_offset < buf.data.size() || holes_iter != buf.holes.end()) {
+  auto span_iter = buf.data.begin();
+  // Offset within *span_iter
+  size_t span_offset = 0;
+  while (span_iter != buf.data.end() || holes_iter != buf.holes.end()) {
     if (holes_iter != buf.holes.end() && holes_iter->offset == addr_offset) {
-      t->write_zeroes(&remote, buf.addr + addr_offset, holes_iter->size);
+      if (holes_already_zero) {
+        // Leave the pages untouched so the kernel doesn't populate them.
+        t->vm()->notify_written(buf.addr + addr_offset, holes_iter->size, 0);
+      } else {
+        t->write_zeroes(&remote, buf.addr + addr_offset, holes_iter->size);
+      }
       addr_offset += holes_iter->size;
       ++holes_iter;
       continue;
     }
-    size_t data_end = buf.data.size();
+    ASSERT(t, span_iter != buf.data.end());
+    // The data is written straight from the decompressed trace block.
+    size_t size = span_iter->size - span_offset;
     if (holes_iter != buf.holes.end()) {
-      data_end = data_offset + holes_iter->offset - addr_offset;
+      size = min(size, holes_iter->offset - addr_offset);
+    }
+    t->write_bytes_helper(buf.addr + addr_offset, size,
+                          span_iter->data + span_offset, nullptr);
+    addr_offset += size;
+    span_offset += size;
+    if (span_offset == span_iter->size) {
+      ++span_iter;
+      span_offset = 0;
     }
-    t->write_bytes_helper(buf.addr + addr_offset, data_end - data_offset, buf.data.data() + data_offset,
-                          nullptr);
-    addr_offset += data_end - data_offset;
-    data_offset = data_end;
   }
   return addr_offset;
 }
 
-void ReplayTask::apply_data_record_from_trace() {
+void ReplayTask::apply_data_record_from_trace(bool holes_already_zero) {
   TraceReader::RawDataWithHoles buf;
   bool ok = trace_reader().read_raw_data_for_frame_with_holes(buf);
   ASSERT(this, ok);
+  apply_data_record(buf, holes_already_zero);
+}
+
+void ReplayTask::apply_data_record(const TraceReader::RawDataWithHoles& buf,
+                                   bool holes_already_zero) {
   if (buf.addr.is_null()) {
     return;
   }
   auto t = session().find_task(buf.rec_tid);
-  size_t size = write_data_with_holes(t, buf);
+  size_t size = write_data_with_holes(t, buf, holes_already_zero);
   t->vm()->maybe_update_breakpoints(t, buf.addr.cast<uint8_t>(), size);
 }
 
@@ -61,8 +61,19 @@ public:
   const TraceFrame& current_trace_frame();
   FrameTime current_frame_time();
 
-  /** Restore the next chunk of this frame's saved data from the trace to this. */
-  void apply_data_record_from_trace();
+  /**
+   * Restore the next chunk of this frame's saved data from the trace to this.
+   * If |holes_already_zero|, the destination is known to be freshly mapped
+   * anonymous memory and holes in the record are not written at all, so
+   * sparse regions stay unpopulated.
+   */
+  void apply_data_record_from_trace(bool holes_already_zero = false);
+  /**
+   * Like apply_data_record_from_trace(), for a record the caller has
+   * already read from the trace.
+   */
+  void apply_data_record(const TraceReader::RawDataWithHoles& buf,
+                         bool holes_already_zero = false);
   /** Restore all remaining chunks of saved data for the current trace frame. */
   void apply_all_data_records_from_trace();
 
@@ -3,6 +3,9 @@
 #include "ReplayTimeline.h"
 
 #include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
 #include <sstream>
 
 #include "core.h"
@@ -79,6 +82,7 @@ bool ReplayTimeline::less_than(const Mark& m1, const Mark& m2) {
 
 ReplayTimeline::ReplayTimeline(std::shared_ptr<ReplaySession> session)
     : current(std::move(session)),
+      initial_exec_key(0, 0, ReplayStepKey()),
       breakpoints_applied(false),
       reverse_execution_barrier_event_(0) {
   current->set_visible_execution(false);
@@ -120,17 +124,50 @@ ReplayTimeline::ProtoMark ReplayTimeline::proto_mark() const {
   return ProtoMark(current_mark_key());
 }
 
+size_t ReplayTimeline::state_hash(const ProtoMark& proto) {
+  size_t h = hash<FrameTime>()(proto.key.trace_time);
+  auto mix = [&h](uint64_t v) {
+    h ^= hash<uint64_t>()(v) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+  };
+  mix(proto.key.ticks);
+  mix(proto.key.step_key.as_int());
+  mix(proto.regs.ip().register_value());
+  mix(proto.regs.sp().as_int());
+  for (const auto& a : proto.return_addresses.addresses) {
+    mix(a.as_int());
+  }
+  return h;
+}
+
+shared_ptr<ReplayTimeline::InternalMark> ReplayTimeline::find_indexed_mark(
+    const ProtoMark& proto) const {
+  auto range = marks_by_state.equal_range(state_hash(proto));
+  for (auto it = range.first; it != range.second; ++it) {
+    const ProtoMark& candidate = it->second->proto;
+    if (candidate.key == proto.key && equal_regs(candidate.regs, proto.regs) &&
+        candidate.return_addresses == proto.return_addresses) {
+      return it->second;
+    }
+  }
+  return shared_ptr<InternalMark>();
+}
+
 shared_ptr<ReplayTimeline::InternalMark> ReplayTimeline::current_mark() const {
-  auto it = marks.find(current_mark_key());
-  // Avoid creating an entry in 'marks' if it doesn't already exist
-  if (it != marks.end()) {
-    for (const shared_ptr<InternalMark>& m : it->second) {
-      if (m->equal_states(*current)) {
-        return m;
+  if (!current->current_task()) {
+    auto it = marks.find(current_mark_key());
+    // Avoid creating an entry in 'marks' if it doesn't already exist
+    if (it != marks.end()) {
+      for (const shared_ptr<InternalMark>& m : it->second) {
+        if (m->equal_states(*current)) {
+          return m;
+        }
       }
     }
+    return shared_ptr<InternalMark>();
   }
-  return shared_ptr<InternalMark>();
+  // Capturing the state once (ReturnAddressList reads the stack) and looking
+  // it up beats calling equal_states() on every mark with this key.
+  return find_indexed_mark(proto_mark());
 }
 
 ReplayTimeline::Mark ReplayTimeline::mark() {
@@ -147,8 +184,10 @@ ReplayTimeline::Mark ReplayTimeline::mark() {
   auto& mark_vector = marks[key];
   if (mark_vector.empty()) {
     mark_vector.push_back(m);
+    add_to_marks_by_state(m);
   } else if (mark_vector[mark_vector.size() - 1] == current_at_or_after_mark) {
     mark_vector.push_back(m);
+    add_to_marks_by_state(m);
   } else {
     // Now the hard part: figuring out where to put it in the list of existing
     // marks.
@@ -183,17 +222,17 @@ ReplayTimeline::Mark ReplayTimeline::mark() {
         continue;
       }
 
-      for (auto it = mark_vector.begin(); it != mark_vector.end(); ++it) {
-        shared_ptr<InternalMark>& existing_mark = *it;
-        if (existing_mark->equal_states(*tmp_session)) {
-          if (!result.did_fast_forward && !result.break_status.signal) {
-            new_marks.back()->singlestep_to_next_mark_no_signal = true;
-          }
-          mark_index = it;
-          break;
-        }
+      shared_ptr<InternalMark> existing_mark;
+      if (tmp_session->current_task()) {
+        existing_mark =
+            find_indexed_mark(ProtoMark(key, tmp_session->current_task()));
       }
-      if (mark_index != mark_vector.end()) {
+      if (existing_mark) {
+        if (!result.did_fast_forward && !result.break_status.signal) {
+          new_marks.back()->singlestep_to_next_mark_no_signal = true;
+        }
+        mark_index = find(mark_vector.begin(), mark_vector.end(), existing_mark);
+        DEBUG_ASSERT(mark_index != mark_vector.end());
         break;
       }
 
@@ -212,6 +251,9 @@ ReplayTimeline::Mark ReplayTimeline::mark() {
     // mark_index is the current index of the next mark after 'current'. So
     // insert our new marks at mark_index.
     mark_vector.insert(mark_index, new_marks.begin(), new_marks.end());
+    for (auto& nm : new_marks) {
+      add_to_marks_by_state(nm);
+    }
   }
   swap(m, result.ptr);
   current_at_or_after_mark = result.ptr;
@@ -328,11 +370,36 @@ void ReplayTimeline::seek_to_before_key(const MarkKey& key) {
   if (it == marks_with_checkpoints.begin()) {
     if (current_key < key) {
       // We can use the current session, so do nothing.
+    } else if (initial_exec_checkpoint && initial_exec_key < key) {
+      // nowhere earlier to go, so restart from just after the initial exec.
+      current = initial_exec_checkpoint->clone();
+      // As below, keep the copy that isn't fully initialized.
+      swap(current, initial_exec_checkpoint);
+      breakpoints_applied = false;
+      current_at_or_after_mark = nullptr;
     } else {
       // nowhere earlier to go, so restart from beginning.
       current = ReplaySession::create(current->trace_reader().dir(), current->flags());
       breakpoints_applied = false;
       current_at_or_after_mark = nullptr;
+      if (!initial_exec_checkpoint) {
+        // Replay up to the end of the initial exec, staying well before
+        // 'key', and checkpoint there for next time.
+        while (!current->done_initial_exec() &&
+               current->trace_reader().time() + 1 < key.trace_time) {
+          ReplayResult result =
+              current->replay_step(ReplaySession::StepConstraints(RUN_CONTINUE));
+          if (result.status == REPLAY_EXITED) {
+            break;
+          }
+        }
+        if (current->done_initial_exec() && current->can_clone()) {
+          initial_exec_key = current_mark_key();
+          if (initial_exec_key < key) {
+            initial_exec_checkpoint = current->clone();
+          }
+        }
+      }
     }
   } else {
     --it;
@@ -732,16 +799,36 @@ void ReplayTimeline::remove_breakpoints_and_watchpoints() {
   watchpoints.clear();
 }
 
-void ReplayTimeline::apply_breakpoints_internal() {
-  for (auto& bp : breakpoints) {
-    AddressSpace* vm = current->find_address_space(get<0>(bp));
-    // XXX handle cases where we can't apply a breakpoint right now. Later
-    // during replay the address space might be created (or new mappings might
-    // be created) and we should reapply breakpoints then.
+/**
+ * Call |f| with each address space's breakpoint addresses. |breakpoints| is
+ * ordered by address space, so each address space's breakpoints are
+ * contiguous.
+ */
+template <typename BreakpointSet, typename F>
+static void for_each_breakpoint_vm(ReplaySession& session,
+                                   const BreakpointSet& breakpoints, F f) {
+  auto it = breakpoints.begin();
+  while (it != breakpoints.end()) {
+    AddressSpaceUid uid = get<0>(*it);
+    vector<remote_code_ptr> addrs;
+    for (; it != breakpoints.end() && get<0>(*it) == uid; ++it) {
+      addrs.push_back(get<1>(*it));
+    }
+    AddressSpace* vm = session.find_address_space(uid);
     if (vm) {
-      vm->add_breakpoint(get<1>(bp), BKPT_USER);
+      f(vm, std::move(addrs));
     }
   }
+}
+
+void ReplayTimeline::apply_breakpoints_internal() {
+  // XXX handle cases where we can't apply a breakpoint right now. Later
+  // during replay the address space might be created (or new mappings might
+  // be created) and we should reapply breakpoints then.
+  for_each_breakpoint_vm(*current, breakpoints,
+                         [](AddressSpace* vm, vector<remote_code_ptr> addrs) {
+                           vm->add_breakpoints(std::move(addrs), BKPT_USER);
+                         });
   for (auto& wp : watchpoints) {
     AddressSpace* vm = current->find_address_space(get<0>(wp));
     if (vm && get<3>(wp) == WATCH_EXEC) {
@@ -770,16 +857,14 @@ void ReplayTimeline::apply_breakpoints_and_watchpoints() {
 }
 
 void ReplayTimeline::unapply_breakpoints_internal() {
-  for (auto& bp : breakpoints) {
-    AddressSpace* vm = current->find_address_space(get<0>(bp));
-    if (vm) {
-      vm->remove_breakpoint(get<1>(bp), BKPT_USER);
-    }
-    for (auto& wp : watchpoints) {
-      AddressSpace* vm = current->find_address_space(get<0>(wp));
-      if (vm && get<3>(wp) == WATCH_EXEC) {
-        vm->remove_watchpoint(get<1>(wp), get<2>(wp), get<3>(wp));
-      }
+  for_each_breakpoint_vm(*current, breakpoints,
+                         [](AddressSpace* vm, vector<remote_code_ptr> addrs) {
+                           vm->remove_breakpoints(std::move(addrs), BKPT_USER);
+                         });
+  for (auto& wp : watchpoints) {
+    AddressSpace* vm = current->find_address_space(get<0>(wp));
+    if (vm && get<3>(wp) == WATCH_EXEC) {
+      vm->remove_watchpoint(get<1>(wp), get<2>(wp), get<3>(wp));
     }
   }
 }
@@ -940,6 +1025,27 @@ static bool arch_watch_fires_before_instr(SupportedArch arch) {
   }
 }
 
+/*
+ * Reverse-continue searches backward one interval at a time: seek to a
+ * checkpoint before |end|, run forward to |end| noting the last break, and if
+ * there was none, make the checkpoint the new |end|. The forward runs lay
+ * down EXPECT_SHORT_REVERSE_EXECUTION checkpoints as they go, so later
+ * searches over the same region only replay short intervals.
+ *
+ * The intervals aren't searched in parallel because it wouldn't be faster.
+ * Checkpoint spacing doubles going back in time (see
+ * discard_past_reverse_exec_checkpoints()), so if the latest break is in
+ * the k'th interval, of length L * 2^(k-1), the serial search replays
+ * L * (2^k - 1): less than twice that interval, which it has to replay
+ * anyway. Workers forked with
+ * fork_checkpoint() could search all k intervals at once, but a hit they
+ * find must become a Mark in this timeline, so this process would still
+ * replay the hit's interval after the slowest worker had replayed it:
+ * 2 * L * 2^(k-1) at best, plus a clone and fork per interval. The linear
+ * EXPECT_SHORT_REVERSE_EXECUTION spacing only covers the last
+ * low_overhead_inter_checkpoint_interval of progress, so there is little
+ * to gain there either.
+ */
 ReplayResult ReplayTimeline::reverse_continue(
     const std::function<bool(ReplayTask* t, const BreakStatus &)>& stop_filter,
     const std::function<bool()>& interrupt_check) {
@@ -1408,19 +1514,26 @@ void ReplayTimeline::evaluate_conditions(ReplayResult& result) {
   auto auid = t->vm()->uid();
 
   if (result.break_status.breakpoint_hit) {
+    ++condition_stats.breakpoint_hits;
     auto addr = t->ip();
     auto it = breakpoints.lower_bound(make_tuple(auid, addr, nullptr));
     bool hit = false;
     while (it != breakpoints.end() && get<0>(*it) == auid &&
            get<1>(*it) == addr) {
       const unique_ptr<BreakpointCondition>& cond = get<2>(*it);
-      if (!cond || cond->evaluate(t)) {
+      if (!cond) {
+        hit = true;
+        break;
+      }
+      ++condition_stats.evaluations;
+      if (cond->evaluate(t)) {
         hit = true;
         break;
       }
       ++it;
     }
     if (!hit) {
+      ++condition_stats.filtered_hits;
       result.break_status.breakpoint_hit = false;
     }
   }
@@ -1428,6 +1541,7 @@ void ReplayTimeline::evaluate_conditions(ReplayResult& result) {
   for (auto i = result.break_status.watchpoints_hit.begin();
        i != result.break_status.watchpoints_hit.end();) {
     auto& w = *i;
+    ++condition_stats.watchpoint_hits;
     auto it = watchpoints.lower_bound(
         make_tuple(auid, w.addr, w.num_bytes, w.type, nullptr));
     bool hit = false;
@@ -1435,7 +1549,12 @@ void ReplayTimeline::evaluate_conditions(ReplayResult& result) {
            get<1>(*it) == w.addr && get<2>(*it) == w.num_bytes &&
            get<3>(*it) == w.type) {
       const unique_ptr<BreakpointCondition>& cond = get<4>(*it);
-      if (!cond || cond->evaluate(t)) {
+      if (!cond) {
+        hit = true;
+        break;
+      }
+      ++condition_stats.evaluations;
+      if (cond->evaluate(t)) {
         hit = true;
         break;
       }
@@ -1444,6 +1563,7 @@ void ReplayTimeline::evaluate_conditions(ReplayResult& result) {
     if (hit) {
       ++i;
     } else {
+      ++condition_stats.filtered_hits;
       i = result.break_status.watchpoints_hit.erase(i);
     }
   }
@@ -1570,6 +1690,55 @@ static ReplayTimeline::Progress next_interval_length(
   return len + expecting_reverse_exec_inter_checkpoint_interval;
 }
 
+/**
+ * When nonzero, the maximum number of bytes we let reverse-exec checkpoints
+ * hold. See enforce_checkpoint_memory_budget.
+ */
+static uint64_t checkpoint_memory_budget = 0;
+
+void ReplayTimeline::set_checkpoint_memory_budget(uint64_t bytes) {
+  checkpoint_memory_budget = bytes;
+}
+
+/**
+ * With a memory budget, also never keep more than this many reverse-exec
+ * checkpoints. Without smaps_rollup every checkpoint costs nothing, and
+ * even cheap checkpoints each hold processes and file descriptors.
+ */
+static const size_t max_budgeted_reverse_exec_checkpoints = 32;
+
+/**
+ * Returns the number of bytes mapped only by the processes of |session|,
+ * i.e. roughly what dropping it would give back. Pages still shared
+ * copy-on-write with other sessions are not counted, so a fresh checkpoint
+ * is cheap and grows as the sessions diverge. Returns 0 when the kernel
+ * doesn't provide smaps_rollup.
+ */
+static uint64_t session_private_memory(const ReplaySession& session) {
+  uint64_t total = 0;
+  for (AddressSpace* vm : session.vms()) {
+    if (vm->task_set().empty()) {
+      continue;
+    }
+    Task* t = *vm->task_set().begin();
+    string path = "/proc/" + to_string(t->tid) + "/smaps_rollup";
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) {
+      continue;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+      unsigned long long kb;
+      if (sscanf(line, "Private_Clean: %llu kB", &kb) == 1 ||
+          sscanf(line, "Private_Dirty: %llu kB", &kb) == 1) {
+        total += kb * 1024;
+      }
+    }
+    fclose(f);
+  }
+  return total;
+}
+
 void ReplayTimeline::maybe_add_reverse_exec_checkpoint(
     CheckpointStrategy strategy) {
   discard_future_reverse_exec_checkpoints();
@@ -1587,13 +1756,73 @@ void ReplayTimeline::maybe_add_reverse_exec_checkpoint(
     return;
   }
 
-  // We always discard checkpoints before adding the new one to reduce the
-  // maximum checkpoint count by one.
-  discard_past_reverse_exec_checkpoints(strategy);
+  if (!checkpoint_memory_budget) {
+    // We always discard checkpoints before adding the new one to reduce the
+    // maximum checkpoint count by one.
+    discard_past_reverse_exec_checkpoints(strategy);
+  }
 
   Mark m = add_explicit_checkpoint();
   LOG(debug) << "Creating reverse-exec checkpoint at " << m;
   reverse_exec_checkpoints[m] = now;
+
+  if (checkpoint_memory_budget) {
+    enforce_checkpoint_memory_budget(strategy);
+  }
+}
+
+/*
+ * Budgeted checkpointing strategy:
+ *
+ * Dropping checkpoint i means a seek into (p[i], p[i+1]) has to replay from
+ * p[i-1] instead, costing roughly p[i] - p[i-1] extra. Targets close to the
+ * current position are far more likely than old ones, so we weight that gap
+ * down the further back it is. The checkpoint with the lowest weighted gap
+ * per byte is evicted first. Costs are measured once per call; evicting a
+ * checkpoint can make pages private to a neighbour, which the next call
+ * picks up. The same order is used to stay under
+ * max_budgeted_reverse_exec_checkpoints.
+ */
+void ReplayTimeline::enforce_checkpoint_memory_budget(
+    CheckpointStrategy strategy) {
+  struct Entry {
+    Mark mark;
+    Progress progress;
+    uint64_t cost;
+  };
+  vector<Entry> entries;
+  uint64_t total = 0;
+  for (auto& c : reverse_exec_checkpoints) {
+    uint64_t cost = session_private_memory(*c.first.ptr->checkpoint);
+    entries.push_back({ c.first, c.second, cost });
+    total += cost;
+  }
+
+  Progress now = estimate_progress();
+  double interval = (double)inter_checkpoint_interval(strategy);
+  while ((total > checkpoint_memory_budget ||
+          entries.size() > max_budgeted_reverse_exec_checkpoints) &&
+         entries.size() > 1) {
+    size_t victim = 0;
+    double victim_score = 0;
+    // Never evict the latest checkpoint.
+    for (size_t i = 0; i + 1 < entries.size(); ++i) {
+      Progress gap = entries[i].progress - (i ? entries[i - 1].progress : 0);
+      double weight = 1 / (1 + (now - entries[i].progress) / interval);
+      double score = gap * weight / max<uint64_t>(entries[i].cost, page_size());
+      if (i == 0 || score < victim_score) {
+        victim = i;
+        victim_score = score;
+      }
+    }
+    LOG(debug) << "Discarding reverse-exec checkpoint at "
+               << entries[victim].mark << " (" << entries[victim].cost
+               << " bytes)";
+    remove_explicit_checkpoint(entries[victim].mark);
+    reverse_exec_checkpoints.erase(entries[victim].mark);
+    total -= entries[victim].cost;
+    entries.erase(entries.begin() + victim);
+  }
 }
 
 void ReplayTimeline::discard_future_reverse_exec_checkpoints() {
@@ -1650,6 +1879,69 @@ void ReplayTimeline::discard_past_reverse_exec_checkpoints(
   }
 }
 
+static bool prewarm = false;
+
+void ReplayTimeline::set_prewarm(bool enabled) { prewarm = enabled; }
+
+/*
+ * Prewarming replays forward from the latest checkpoint before the current
+ * position, like the first interval of a reverse-continue would, so the
+ * checkpoints end up where reverse_continue() would have put them. Only
+ * whole events are replayed, so we never step past the current position.
+ * The checkpoints are made in this process: they have to be Marks in this
+ * timeline, so helpers forked with fork_checkpoint() couldn't hand theirs
+ * back.
+ */
+bool ReplayTimeline::prewarm_checkpoints(
+    const std::function<bool()>& interrupt_check) {
+  if (!prewarm || !can_add_checkpoint()) {
+    return false;
+  }
+  Progress now = estimate_progress();
+  Progress interval = expecting_reverse_exec_inter_checkpoint_interval;
+  Mark end = mark();
+  auto it = reverse_exec_checkpoints.rbegin();
+  while (it != reverse_exec_checkpoints.rend() && end < it->first) {
+    ++it;
+  }
+  if (it == reverse_exec_checkpoints.rend() ||
+      it->second >= now - 2 * interval) {
+    return false;
+  }
+  FrameTime end_time = end.ptr->proto.key.trace_time;
+  Mark start = it->first;
+  if (start.ptr->proto.key.trace_time >= end_time) {
+    return false;
+  }
+
+  end = add_explicit_checkpoint();
+  LOG(debug) << "Prewarming checkpoints from " << start << " to " << end;
+  seek_to_mark(start);
+  unapply_breakpoints_and_watchpoints();
+  ReplaySession::StepConstraints constraints(RUN_CONTINUE);
+  Progress last = it->second;
+  while (current->trace_reader().time() < end_time &&
+         estimate_progress() < now - interval && !interrupt_check()) {
+    current->replay_step(constraints);
+    // Not maybe_add_reverse_exec_checkpoint(): that would discard the
+    // checkpoints between here and the user's position as "future" ones.
+    Progress progress = estimate_progress();
+    if (progress >= last + interval && current->can_clone()) {
+      Mark m = add_explicit_checkpoint();
+      LOG(debug) << "Creating prewarm checkpoint at " << m;
+      reverse_exec_checkpoints[m] = progress;
+      last = progress;
+    }
+  }
+  seek_to_mark(end);
+  remove_explicit_checkpoint(end);
+  LOG(debug) << "Finished prewarming checkpoints";
+  if (checkpoint_memory_budget) {
+    enforce_checkpoint_memory_budget(EXPECT_SHORT_REVERSE_EXECUTION);
+  }
+  return true;
+}
+
 ReplayTimeline::Mark ReplayTimeline::set_short_checkpoint() {
   if (!can_add_checkpoint()) {
     return mark();
@@ -7,6 +7,7 @@
 #include <map>
 #include <memory>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
 #include "BreakpointCondition.h"
@@ -33,6 +34,18 @@ public:
   ReplayTimeline(std::shared_ptr<ReplaySession> session);
   ~ReplayTimeline();
 
+  /**
+   * Limit the memory held by reverse-exec checkpoints to |bytes|. When
+   * nonzero, instead of spacing checkpoints exponentially we keep adding
+   * them and evict the ones with the lowest benefit per byte once the
+   * budget is exceeded. 0 (the default) restores the exponential spacing.
+   */
+  static void set_checkpoint_memory_budget(uint64_t bytes);
+  /**
+   * Let prewarm_checkpoints() do work. Off by default.
+   */
+  static void set_prewarm(bool enabled);
+
   /**
    * An estimate of how much progress a session has made. This should roughly
    * correlate to the time required to replay from the start of a session
@@ -226,6 +239,15 @@ public:
    */
   Mark lazy_reverse_singlestep(const Mark& from, ReplayTask* t);
 
+  /**
+   * Use idle time to fill the interval between the latest reverse-exec
+   * checkpoint and the current position with the checkpoints a
+   * reverse-continue from here would create, then return to the current
+   * position. Stops early when |interrupt_check| returns true. Returns
+   * false if there was nothing to do (or set_prewarm() wasn't called).
+   */
+  bool prewarm_checkpoints(const std::function<bool()>& interrupt_check);
+
   /**
    * Different strategies for placing automatic checkpoints.
    */
@@ -256,6 +278,26 @@ public:
    */
   void apply_breakpoints_and_watchpoints();
 
+  /**
+   * Counts of conditional breakpoint/watchpoint work, for judging what
+   * conditions in hot code cost.
+   */
+  struct ConditionStatistics {
+    ConditionStatistics()
+        : breakpoint_hits(0), watchpoint_hits(0), evaluations(0),
+          filtered_hits(0) {}
+    // Breakpoint/watchpoint hits reported by the replay session
+    uint64_t breakpoint_hits;
+    uint64_t watchpoint_hits;
+    // Number of BreakpointCondition::evaluate calls
+    uint64_t evaluations;
+    // Hits that were suppressed because no condition was true
+    uint64_t filtered_hits;
+  };
+  const ConditionStatistics& condition_statistics() const {
+    return condition_stats;
+  }
+
 private:
   /**
    * A MarkKey consists of FrameTime + Ticks + ReplayStepKey. These values
@@ -339,6 +381,7 @@ private:
       if (t) {
         proto = ProtoMark(key, t);
         extra_regs = t->extra_regs();
+        extra_regs.compact();
       }
     }
     ~InternalMark();
@@ -435,9 +478,15 @@ private:
    * point and we might want to make a checkpoint to support reverse-execution.
    * If this adds a checkpoint, it will call
    * discard_past_reverse_exec_checkpoints
-   * first.
+   * first, or enforce_checkpoint_memory_budget afterwards if a memory
+   * budget is set.
    */
   void maybe_add_reverse_exec_checkpoint(CheckpointStrategy strategy);
+  /**
+   * Discard reverse-exec checkpoints until the memory they hold fits the
+   * checkpoint memory budget. The latest checkpoint is always kept.
+   */
+  void enforce_checkpoint_memory_budget(CheckpointStrategy strategy);
   /**
    * Discard some reverse-exec checkpoints in the past, if necessary. We do
    * this to stop the number of checkpoints growing out of control.
@@ -491,6 +540,19 @@ private:
    */
   std::map<MarkKey, std::vector<std::shared_ptr<InternalMark>>> marks;
 
+  /**
+   * Hash index over every mark in 'marks', keyed by state_hash(), so finding
+   * the mark for a state doesn't compare it against every mark with the same
+   * MarkKey. Marks are never removed from 'marks' so this only grows.
+   */
+  std::unordered_multimap<size_t, std::shared_ptr<InternalMark>> marks_by_state;
+  static size_t state_hash(const ProtoMark& proto);
+  void add_to_marks_by_state(const std::shared_ptr<InternalMark>& m) {
+    marks_by_state.insert(std::make_pair(state_hash(m->proto), m));
+  }
+  // Returns the mark whose state is |proto|, if there is one.
+  std::shared_ptr<InternalMark> find_indexed_mark(const ProtoMark& proto) const;
+
   /**
    * All mark keys with at least one checkpoint. The value is the number of
    * checkpoints. There can be multiple checkpoints for a given MarkKey
@@ -498,6 +560,15 @@ private:
    */
   std::map<MarkKey, uint32_t> marks_with_checkpoints;
 
+  /**
+   * A checkpoint taken just after the initial exec, the first time we had
+   * to restart from the beginning of the trace, so later restarts don't have
+   * to spawn, exec and replay the initial mappings again. Not a mark: it's
+   * only used when there's no earlier checkpoint to go back to.
+   */
+  ReplaySession::shr_ptr initial_exec_checkpoint;
+  MarkKey initial_exec_key;
+
   std::set<std::tuple<AddressSpaceUid, remote_code_ptr,
                       std::unique_ptr<BreakpointCondition>>>
       breakpoints;
@@ -506,6 +577,8 @@ private:
       watchpoints;
   bool breakpoints_applied;
 
+  ConditionStatistics condition_stats;
+
   FrameTime reverse_execution_barrier_event_;
 
   /**
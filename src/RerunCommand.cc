@@ -12,6 +12,7 @@
 #include "GdbServer.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
+#include "WaitManager.h"
 #include "core.h"
 #include "kernel_metadata.h"
 #include "log.h"
@@ -47,13 +48,20 @@ RerunCommand RerunCommand::singleton(
     "                             address and jump to <ADDR> to fake call\n"
     "  --singlestep=<REGS>        dump <REGS> after each singlestep\n"
     "  --event-regs=<REGS>        dump <REGS> after each event\n"
-    "  --export-checkpoints=<EVENT>,<NUM>,<FILE>\n"
+    "  --export-checkpoints=<EVENT>,<NUM>,<FILE>[,<IDLE>]\n"
     "                             Run to start of <EVENT> and then export checkpoints over\n"
     "                             Unix socket at <FILE>. Exit after <NUM>\n"
-    "                             connections to the socket.\n"
+    "                             connections to the socket (0 for no limit),\n"
+    "                             or after <IDLE> seconds without one. Imports\n"
+    "                             run concurrently. May be repeated to export\n"
+    "                             at several events; each checkpoint is held by\n"
+    "                             its own process while replay continues.\n"
     "  --import-checkpoint=<FILE> Start the replay by importing a checkpoint from\n"
     "                             another rr instance exporting checkpoints at\n"
     "                             <FILE>\n"
+    "  -j, --jobs=<N>             split the traced events into <N> ranges,\n"
+    "                             rerun them in parallel processes and output\n"
+    "                             their results in order. Requires -u.\n"
     "  -r, --raw                  dump registers in raw format\n"
     "  -s, --trace-start=<EVENT>  start tracing at <EVENT>\n"
     "  -u, --cpu-unbound          allow replay to run on any CPU. Default is\n"
@@ -102,19 +110,23 @@ struct RerunFlags {
   vector<TraceField> singlestep_trace;
   vector<TraceField> event_trace;
   string import_checkpoint_socket;
-  string export_checkpoints_socket;
-  FrameTime export_checkpoints_event;
-  int export_checkpoints_count;
+  // In event order
+  vector<ExportCheckpointsSpec> export_checkpoints;
+  int jobs;
   bool raw;
   bool cpu_unbound;
+  // Set when rerunning one range of a --jobs run other than the first: don't
+  // output anything for events before |trace_start|, since an earlier
+  // range already did.
+  bool continues_earlier_range;
 
   RerunFlags()
       : trace_start(0),
         trace_end(numeric_limits<decltype(trace_end)>::max()),
-        export_checkpoints_event(0),
-        export_checkpoints_count(0),
+        jobs(1),
         raw(false),
-        cpu_unbound(false) {}
+        cpu_unbound(false),
+        continues_earlier_range(false) {}
 };
 
 #ifdef __x86_64__
@@ -164,13 +176,22 @@ static uint16_t user_regs_fields[34] = {
 #endif
 
 static void print_hex(uint8_t* value, size_t size, FILE* out) {
+  static const char digits[] = "0123456789abcdef";
+  // We print at most a YMM register's worth of bytes.
+  char buf[64];
+  DEBUG_ASSERT(size * 2 <= sizeof(buf));
+  size_t len = 0;
   bool any_printed = false;
   for (ssize_t i = size - 1; i >= 0; --i) {
     if (value[i] || any_printed || i == 0) {
-      fprintf(out, any_printed ? "%02x" : "%x", value[i]);
+      if (any_printed || value[i] >= 16) {
+        buf[len++] = digits[value[i] >> 4];
+      }
+      buf[len++] = digits[value[i] & 15];
       any_printed = true;
     }
   }
+  fwrite(buf, 1, len, out);
 }
 
 static void print_value(const char* name, void* value, size_t size,
@@ -493,6 +514,7 @@ static bool parse_rerun_arg(vector<string>& args, RerunFlags& flags) {
     { 4, "import-checkpoint", HAS_PARAMETER },
     { 'e', "trace-end", HAS_PARAMETER },
     { 'f', "function", HAS_PARAMETER },
+    { 'j', "jobs", HAS_PARAMETER },
     { 'r', "raw", NO_PARAMETER },
     { 's', "trace-start", HAS_PARAMETER },
     { 'u', "cpu-unbound", NO_PARAMETER }
@@ -513,11 +535,23 @@ static bool parse_rerun_arg(vector<string>& args, RerunFlags& flags) {
         return false;
       }
       break;
-    case 3:
-      if (!parse_export_checkpoints(opt.value, flags.export_checkpoints_event, flags.export_checkpoints_count, flags.export_checkpoints_socket)) {
+    case 3: {
+      ExportCheckpointsSpec spec;
+      if (!parse_export_checkpoints(opt.value, spec)) {
         return false;
       }
+      auto it = flags.export_checkpoints.begin();
+      while (it != flags.export_checkpoints.end() && it->event < spec.event) {
+        ++it;
+      }
+      if (it != flags.export_checkpoints.end() && it->event == spec.event) {
+        fprintf(stderr, "Checkpoints for event %lld exported twice\n",
+                (long long)spec.event);
+        return false;
+      }
+      flags.export_checkpoints.insert(it, spec);
       break;
+    }
     case 4:
       flags.import_checkpoint_socket = opt.value;
       break;
@@ -536,6 +570,12 @@ static bool parse_rerun_arg(vector<string>& args, RerunFlags& flags) {
       }
       break;
     }
+    case 'j':
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.jobs = opt.int_value;
+      break;
     case 'r':
       flags.raw = true;
       break;
@@ -628,16 +668,27 @@ static ReplaySession::Flags session_flags(const RerunFlags& flags) {
   return result;
 }
 
+static void wait_for_holders(const vector<pid_t>& holders) {
+  for (pid_t holder : holders) {
+    WaitResult result = WaitManager::wait_exit(WaitOptions(holder));
+    if (result.code != WAIT_OK) {
+      FATAL() << "Failed to wait for child " << holder;
+    }
+  }
+}
+
 static int rerun(const string& trace_dir, const RerunFlags& flags, CommandForCheckpoint& command_for_checkpoint) {
-  ScopedFd export_checkpoints_socket;
-  // Construct the listening socket immediately so importers can connect early and block without polling.
-  // If we need to import a checkpoint, we pass the socket in command_for_checkpoint.fds to the checkpoint
+  vector<ScopedFd> export_checkpoints_sockets;
+  // Construct the listening sockets immediately so importers can connect early and block without polling.
+  // If we need to import a checkpoint, we pass the sockets in command_for_checkpoint.fds to the checkpoint
   // exporter's child process.
-  if (flags.export_checkpoints_event) {
+  for (size_t i = 0; i < flags.export_checkpoints.size(); ++i) {
+    const ExportCheckpointsSpec& spec = flags.export_checkpoints[i];
     if (command_for_checkpoint.session) {
-      export_checkpoints_socket = std::move(command_for_checkpoint.fds.front());
+      export_checkpoints_sockets.push_back(std::move(command_for_checkpoint.fds[i]));
     } else {
-      export_checkpoints_socket = bind_export_checkpoints_socket(flags.export_checkpoints_count, flags.export_checkpoints_socket);
+      export_checkpoints_sockets.push_back(
+          bind_export_checkpoints_socket(spec.count, spec.socket));
     }
   }
 
@@ -650,15 +701,16 @@ static int rerun(const string& trace_dir, const RerunFlags& flags, CommandForChe
     // possible.
     raise_resource_limits();
   } else {
-    vector<ScopedFd> fds;
-    if (export_checkpoints_socket.is_open()) {
-      fds.push_back(std::move(export_checkpoints_socket));
-    }
-    return invoke_checkpoint_command(flags.import_checkpoint_socket, command_for_checkpoint.args, std::move(fds));
+    return invoke_checkpoint_command(flags.import_checkpoint_socket, command_for_checkpoint.args, std::move(export_checkpoints_sockets));
   }
 
+  // Processes holding the checkpoints for all but the last export event
+  vector<pid_t> holders;
+  size_t next_export = 0;
   uint64_t instruction_count_within_event = 0;
   bool done_first_step = false;
+  // The first event at which the initial exec had been done.
+  FrameTime initial_exec_time = 0;
   bool need_to_singlestep = !flags.singlestep_trace.empty();
   for (auto& v : flags.event_trace) {
     if (v.kind == TRACE_INSTRUCTION_COUNT) {
@@ -674,6 +726,9 @@ static int rerun(const string& trace_dir, const RerunFlags& flags, CommandForChe
     auto old_task_tuid = old_task ? old_task->tuid() : TaskUid();
     remote_code_ptr old_ip = old_task ? old_task->ip() : remote_code_ptr();
     FrameTime before_time = replay_session->trace_reader().time();
+    if (!initial_exec_time && replay_session->done_initial_exec()) {
+      initial_exec_time = before_time;
+    }
     if (replay_session->done_initial_exec() &&
         before_time >= flags.trace_start) {
       if (!done_first_step) {
@@ -683,10 +738,22 @@ static int rerun(const string& trace_dir, const RerunFlags& flags, CommandForChe
         }
 
         done_first_step = true;
-        print_regs(old_task, before_time - 1, instruction_count_within_event,
-                   flags, flags.singlestep_trace, stdout);
+        // An earlier range printed the initial state unless the initial
+        // exec finished in this one.
+        if (!flags.continues_earlier_range ||
+            initial_exec_time >= flags.trace_start) {
+          print_regs(old_task, before_time - 1, instruction_count_within_event,
+                     flags, flags.singlestep_trace, stdout);
+        }
       }
 
+      // Even for IP-only traces we singlestep rather than decode Intel PT
+      // data from a full-speed run. The PT aux buffer drops packets when
+      // it overflows, leaving gaps, and decoding needs the code bytes as
+      // they were when each instruction ran, which JITs and
+      // self-modifying code change within a run. The output's per-event
+      // records and its handling of rep-string fast-forward would also
+      // have to be rebuilt around the decoded stream.
       if (need_to_singlestep) {
         cmd = RUN_SINGLESTEP_FAST_FORWARD;
       }
@@ -739,23 +806,148 @@ static int rerun(const string& trace_dir, const RerunFlags& flags, CommandForChe
     if (before_time < after_time) {
       LOG(debug) << "Completed event " << before_time
                  << " instruction_count=" << instruction_count_within_event;
-      print_regs(old_task, before_time, instruction_count_within_event, flags,
-                 flags.event_trace, stdout);
+      if (!flags.continues_earlier_range || before_time >= flags.trace_start) {
+        print_regs(old_task, before_time, instruction_count_within_event, flags,
+                   flags.event_trace, stdout);
+      }
       instruction_count_within_event = 1;
     }
 
-    if (after_time == flags.export_checkpoints_event) {
-      command_for_checkpoint = export_checkpoints(std::move(replay_session),
-          flags.export_checkpoints_count,
-          export_checkpoints_socket, flags.export_checkpoints_socket);
-      return 0;
+    if (next_export < flags.export_checkpoints.size() &&
+        after_time == flags.export_checkpoints[next_export].event) {
+      const ExportCheckpointsSpec& spec = flags.export_checkpoints[next_export];
+      ScopedFd& sock = export_checkpoints_sockets[next_export];
+      ++next_export;
+      // Exporting forks; don't let the children inherit buffered output.
+      fflush(stdout);
+      if (next_export == flags.export_checkpoints.size()) {
+        command_for_checkpoint = export_checkpoints(std::move(replay_session),
+                                                    spec, sock);
+        if (!command_for_checkpoint.session) {
+          wait_for_holders(holders);
+        }
+        return 0;
+      }
+      // Hand a clone to a process that serves it while we replay on to
+      // the next export event.
+      if (!replay_session->can_clone()) {
+        FATAL() << "Can't create checkpoints at this time, aborting: "
+                << replay_session->current_frame_time();
+      }
+      pid_t holder;
+      ReplaySession::shr_ptr held = fork_checkpoint(*replay_session, &holder);
+      if (held) {
+        // Later events' sockets belong to our parent. Holding them open
+        // would keep importers of those events waiting on us after the
+        // parent is gone.
+        for (auto& other : export_checkpoints_sockets) {
+          if (&other != &sock) {
+            other.close();
+          }
+        }
+        command_for_checkpoint = export_checkpoints(std::move(held), spec, sock);
+        if (!command_for_checkpoint.session) {
+          // Done serving. Don't let our caller tell an importer of our
+          // parent that it has finished.
+          _exit(0);
+        }
+        return 0;
+      }
+      holders.push_back(holder);
+      sock.close();
     }
   }
 
+  wait_for_holders(holders);
+
   LOG(info) << "Rerun successfully finished";
   return 0;
 }
 
+/**
+ * Split [trace_start, trace_end) into |flags.jobs| ranges of events, rerun
+ * each in a child process writing to its own temporary file, then copy the
+ * files to stdout in order. Every child replays from the start of the
+ * trace but only singlesteps through its own range, so as long as
+ * singlestepping dominates this scales with the number of cores.
+ */
+static int rerun_in_parallel(const string& trace_dir, const RerunFlags& flags) {
+  FrameTime last_time = 0;
+  {
+    TraceReader trace(trace_dir);
+    while (!trace.at_end()) {
+      last_time = trace.read_frame().time();
+    }
+  }
+  FrameTime start = max<FrameTime>(flags.trace_start, 1);
+  FrameTime end = min<FrameTime>(flags.trace_end, last_time + 1);
+  FrameTime jobs = max<FrameTime>(1, min<FrameTime>(flags.jobs, end - start));
+
+  vector<pair<pid_t, ScopedFd>> children;
+  for (FrameTime i = 0; i < jobs; ++i) {
+    RerunFlags child_flags = flags;
+    child_flags.jobs = 1;
+    child_flags.trace_start = start + (end - start) * i / jobs;
+    child_flags.trace_end = start + (end - start) * (i + 1) / jobs;
+    child_flags.continues_earlier_range = i > 0;
+
+    TempFile out = create_temporary_file("rr-rerun-XXXXXX");
+    unlink(out.name.c_str());
+    fflush(stdout);
+    pid_t child = fork();
+    if (child < 0) {
+      FATAL() << "Can't fork";
+    }
+    if (!child) {
+      if (dup2(out.fd, STDOUT_FILENO) < 0) {
+        FATAL() << "Can't redirect stdout";
+      }
+      CommandForCheckpoint command_for_checkpoint;
+      int ret = rerun(trace_dir, child_flags, command_for_checkpoint);
+      fflush(stdout);
+      _exit(ret);
+    }
+    LOG(info) << "Rerunning events [" << child_flags.trace_start << ", "
+              << child_flags.trace_end << ") in process " << child;
+    children.push_back(make_pair(child, std::move(out.fd)));
+  }
+
+  int ret = 0;
+  for (auto& c : children) {
+    int status;
+    if (waitpid(c.first, &status, 0) != c.first) {
+      FATAL() << "Can't wait for " << c.first;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      LOG(error) << "Rerun process " << c.first << " failed with status "
+                 << status;
+      ret = 1;
+    }
+  }
+  if (ret) {
+    return ret;
+  }
+
+  fflush(stdout);
+  vector<uint8_t> buf;
+  buf.resize(1024 * 1024);
+  for (auto& c : children) {
+    uint64_t offset = 0;
+    while (true) {
+      ssize_t nread = pread(c.second, buf.data(), buf.size(), offset);
+      if (nread < 0) {
+        FATAL() << "Can't read rerun output";
+      }
+      if (!nread) {
+        break;
+      }
+      write_all(STDOUT_FILENO, buf.data(), nread);
+      offset += nread;
+    }
+  }
+  return 0;
+}
+
 int RerunCommand::run_internal(CommandForCheckpoint& command_for_checkpoint) {
   // parse args first
   bool found_dir = false;
@@ -775,6 +967,24 @@ int RerunCommand::run_internal(CommandForCheckpoint& command_for_checkpoint) {
     return 1;
   }
 
+  if (flags.jobs > 1 &&
+      (!flags.cpu_unbound || !flags.function.is_null() ||
+       !flags.export_checkpoints.empty() ||
+       !flags.import_checkpoint_socket.empty())) {
+    fprintf(stderr, "rr: --jobs requires --cpu-unbound and can't be combined "
+                    "with --function or checkpoint export/import.\n");
+    return 1;
+  }
+
+  // We can write a record per singlestep; don't flush stdout that often.
+  // (We get here again after importing a checkpoint.)
+  static char stdout_buffer[1024 * 1024];
+  static bool set_stdout_buffer = false;
+  if (!set_stdout_buffer) {
+    setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer));
+    set_stdout_buffer = true;
+  }
+
   assert_prerequisites();
 
   if (running_under_rr()) {
@@ -790,6 +1000,9 @@ int RerunCommand::run_internal(CommandForCheckpoint& command_for_checkpoint) {
     }
   }
 
+  if (flags.jobs > 1) {
+    return rerun_in_parallel(trace_dir, flags);
+  }
   return rerun(trace_dir, flags, command_for_checkpoint);
 }
 
@@ -6,14 +6,20 @@
 
 namespace rr {
 
-static bool read_bytes_no_breakpoints(Task* t, remote_ptr<void> p, ssize_t size,
-                                      void* out) {
-  if (t->read_bytes_fallible(p, size, out) != size) {
-    return false;
+// Bytes of stack, starting at SP, that we read in one go. Frames found in
+// here are walked locally; we only go back to the tracee for frames further
+// up the stack.
+static const ssize_t STACK_WINDOW_SIZE = 4096;
+
+static ssize_t read_bytes_no_breakpoints(Task* t, remote_ptr<void> p,
+                                         ssize_t size, void* out) {
+  ssize_t nread = t->read_bytes_fallible(p, size, out);
+  if (nread <= 0) {
+    return 0;
   }
   t->vm()->replace_breakpoints_with_original_values(static_cast<uint8_t*>(out),
-      size, p.cast<uint8_t>());
-  return true;
+      nread, p.cast<uint8_t>());
+  return nread;
 }
 
 template <typename Arch>
@@ -32,7 +38,12 @@ static void return_addresses_x86ish(ReturnAddressList* result, Task* t) {
   // been set. We don't want these results to vary because we call this in
   // some contexts with internal breakpoints set and in other contexts without
   // them set.
-  if (read_bytes_no_breakpoints(t, t->regs().sp(), sizeof(frame), frame)) {
+  uint8_t window[STACK_WINDOW_SIZE];
+  remote_ptr<void> sp = t->regs().sp();
+  ssize_t window_size =
+      read_bytes_no_breakpoints(t, sp, sizeof(window), window);
+  if (window_size >= (ssize_t)sizeof(frame)) {
+    memcpy(frame, window, sizeof(frame));
     result->addresses[0] = frame[0];
     result->addresses[1] = frame[1];
     next_address = 2;
@@ -40,7 +51,12 @@ static void return_addresses_x86ish(ReturnAddressList* result, Task* t) {
 
   remote_ptr<void> bp = t->regs().bp();
   for (int i = next_address; i < ReturnAddressList::X86_COUNT; ++i) {
-    if (!read_bytes_no_breakpoints(t, bp, sizeof(frame), frame)) {
+    uintptr_t window_offset = bp.as_int() - sp.as_int();
+    if (bp >= sp && window_size >= (ssize_t)sizeof(frame) &&
+        window_offset <= window_size - sizeof(frame)) {
+      memcpy(frame, window + window_offset, sizeof(frame));
+    } else if (read_bytes_no_breakpoints(t, bp, sizeof(frame), frame) !=
+               (ssize_t)sizeof(frame)) {
       break;
     }
     result->addresses[i] = frame[1];
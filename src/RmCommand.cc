@@ -2,7 +2,9 @@
 
 #include <ftw.h>
 #include <stdio.h>
+#include <sys/stat.h>
 
+#include <fstream>
 #include <vector>
 
 #include "Command.h"
@@ -72,6 +74,31 @@ static bool remove_all(const string& path) {
   return true;
 }
 
+// Read the store objects recorded by `rr pack --store` for this trace.
+static vector<string> read_store_objects(const string& trace_path) {
+  vector<string> objects;
+  ifstream in(trace_path + "/pack_store");
+  string store_dir;
+  if (!getline(in, store_dir)) {
+    return objects;
+  }
+  string object;
+  while (getline(in, object)) {
+    objects.push_back(store_dir + "/" + object);
+  }
+  return objects;
+}
+
+// Delete store objects that are no longer linked into any trace.
+static void release_store_objects(const vector<string>& objects) {
+  for (auto& object : objects) {
+    struct stat st;
+    if (stat(object.c_str(), &st) == 0 && st.st_nlink == 1) {
+      unlink(object.c_str());
+    }
+  }
+}
+
 static int rm(const string& trace, const RmFlags& flags, FILE* out) {
   string reason;
   if (!is_valid_trace_name(trace, &reason)) {
@@ -116,6 +143,7 @@ static int rm(const string& trace, const RmFlags& flags, FILE* out) {
     }
   }
 
+  vector<string> store_objects = read_store_objects(trace_path);
   if (!remove_all(trace_path)) {
     fprintf(stderr,
             "\n"
@@ -124,6 +152,7 @@ static int rm(const string& trace, const RmFlags& flags, FILE* out) {
             trace_path.c_str());
     return 1;
   } else {
+    release_store_objects(store_objects);
     fprintf(out, "rr: Removed trace '%s'\n", trace_path.c_str());
     return 0;
   }
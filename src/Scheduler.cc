@@ -21,6 +21,7 @@
 #include "Flags.h"
 #include "RecordSession.h"
 #include "RecordTask.h"
+#include "SpanTracer.h"
 #include "TraceeAttentionSet.h"
 #include "WaitManager.h"
 #include "core.h"
@@ -42,6 +43,7 @@ static double very_short_timeslice_probability = 0.1;
 static Ticks very_short_timeslice_max_duration = 100;
 static double short_timeslice_probability = 0.1;
 static Ticks short_timeslice_max_duration = 10000;
+static int max_timeslice_shift = 6;
 // Time between priority refreshes is uniformly distributed from 0 to 20s
 static double priorities_refresh_max_interval = 20;
 
@@ -104,7 +106,10 @@ Scheduler::Scheduler(RecordSession& session)
       enable_chaos(false),
       enable_poll(false),
       last_reschedule_in_high_priority_only_interval(false),
-      unlimited_ticks_mode(false) {
+      unlimited_ticks_mode(false),
+      adaptive_timeslices(false),
+      contention_in_timeslice(false),
+      timeslice_shift(0) {
   std::random_device rd;
   random.seed(rd());
   regenerate_affinity_mask();
@@ -458,7 +463,15 @@ void Scheduler::setup_new_timeslice() {
     } else {
       max_timeslice_duration = max_ticks_;
     }
+  } else if (adaptive_timeslices) {
+    if (contention_in_timeslice) {
+      timeslice_shift = min(timeslice_shift + 1, max_timeslice_shift);
+    } else if (timeslice_shift > 0) {
+      --timeslice_shift;
+    }
+    max_timeslice_duration = max<Ticks>(max_ticks_ >> timeslice_shift, 1);
   }
+  contention_in_timeslice = false;
   current_timeslice_end_ = current_->tick_count() +
                            (random() % min(max_ticks_, max_timeslice_duration));
 }
@@ -656,18 +669,21 @@ void Scheduler::started_task(RecordTask* t) {
     unlimited_ticks_mode = true;
   }
   --ntasks_stopped;
+  stopped_tasks.erase(t);
   ASSERT(t, ntasks_stopped >= 0);
 }
 
 void Scheduler::stopped_task(RecordTask* t) {
   LOGM(debug) << "Stopping " << t->tid;
   ++ntasks_stopped;
+  stopped_tasks.insert(t);
   // When a task is created/cloned it temporarily can be stopped
   // but not in our task set.
   ASSERT(t, ntasks_stopped <= static_cast<int>(session.tasks().size()) + 1);
 }
 
 Scheduler::Rescheduled Scheduler::reschedule(Switchable switchable) {
+  ScopedSpan span("Scheduler::reschedule");
   Rescheduled result;
   result.interrupted_by_signal = false;
   result.by_waitpid = false;
@@ -771,10 +787,19 @@ Scheduler::Rescheduled Scheduler::reschedule(Switchable switchable) {
     maybe_reset_high_priority_only_intervals(now);
     last_reschedule_in_high_priority_only_interval =
         in_high_priority_only_interval(now);
-    WaitAggregator wait_aggregator((task_priority_set_total_count + task_round_robin_queue.size())/100 + 1);
-
     map<int, vector<RecordTask*>> attention_set_by_priority;
-    for (pid_t tid : TraceeAttentionSet::read()) {
+    unordered_set<pid_t> attention_set = TraceeAttentionSet::read();
+    // Normally we probe a few tasks individually before draining all pending
+    // stops with one waitid(P_ALL) loop. When many tasks signalled at once
+    // (e.g. a broadcast signal or exit_group), go straight to the drain.
+    int waits_before_polling =
+        (task_priority_set_total_count + task_round_robin_queue.size())/100 + 1;
+    if (attention_set.size() > (size_t)waits_before_polling) {
+      waits_before_polling = 0;
+    }
+    WaitAggregator wait_aggregator(waits_before_polling);
+
+    for (pid_t tid : attention_set) {
       if (current_ && current_->tid == tid) {
         // current_ will almost always be in the attention set because of
         // ptrace-stop activity related to when we last ran it.
@@ -786,6 +811,16 @@ Scheduler::Rescheduled Scheduler::reschedule(Switchable switchable) {
         attention_set_by_priority[t->priority].push_back(t);
       }
     }
+    // Tasks we preempted are sitting in a stop and won't raise SIGCHLD
+    // again, so offer them explicitly rather than relying on the full walk
+    // over all tasks to find them.
+    for (RecordTask* t : stopped_tasks) {
+      // Newly created tasks can be stopped before they're in our task set.
+      if (t != current_ && !attention_set.count(t->tid) &&
+          !t->in_round_robin_queue && session.find_task(t->tid) == t) {
+        attention_set_by_priority[t->priority].push_back(t);
+      }
+    }
 
     if (current_) {
       // Determine if we should run current_ again
@@ -1017,6 +1052,7 @@ void Scheduler::on_destroy(RecordTask* t) {
   if (t == current_) {
     current_ = nullptr;
   }
+  stopped_tasks.erase(t);
   // When the last task in a threadgroup undergoing execve dies,
   // the execve is over.
   if (t->tgid() == in_exec_tgid &&
@@ -1068,6 +1104,7 @@ static bool round_robin_scheduling_enabled() {
 }
 
 void Scheduler::schedule_one_round_robin(RecordTask* t) {
+  note_contention();
   if (!round_robin_scheduling_enabled()) {
     LOGM(debug) << "Would schedule round-robin because of task " << t->tid << ", but disabled";
     return;
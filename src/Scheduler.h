@@ -9,6 +9,7 @@
 #include <map>
 #include <random>
 #include <set>
+#include <unordered_set>
 #include <vector>
 
 #include "Ticks.h"
@@ -58,7 +59,11 @@ class WaitAggregator;
  * current task (so equal priority tasks run in round-robin order).
  *
  * The main parameter to the scheduler is |max_ticks|, which controls the
- * length of each timeslice.
+ * length of each timeslice. With adaptive timeslices, the limit is halved
+ * (down to 1/64 of |max_ticks|) after each timeslice in which a task yielded,
+ * looked like it was spinning or waited on a futex, and doubled back after
+ * each timeslice without such contention, so lock-heavy phases switch
+ * sooner and CPU-bound phases switch less.
  */
 class Scheduler {
 public:
@@ -97,6 +102,14 @@ public:
   void set_always_switch(bool always_switch) {
     this->always_switch = always_switch;
   }
+  void set_adaptive_timeslices(bool adaptive) {
+    adaptive_timeslices = adaptive;
+  }
+  /**
+   * Call when a task does something suggesting it's contending with other
+   * tasks (sched_yield, spinning, futex waits).
+   */
+  void note_contention() { contention_in_timeslice = true; }
   void set_enable_chaos(bool enable_chaos);
   void set_num_cores(int cores);
 
@@ -309,6 +322,18 @@ private:
   bool last_reschedule_in_high_priority_only_interval;
 
   bool unlimited_ticks_mode;
+
+  /**
+   * Tasks currently in a kernel stop (see stopped_task()). These are offered
+   * to find_next_runnable_task alongside the attention set so that switching
+   * to a preempted task doesn't need a walk over every task.
+   */
+  std::unordered_set<RecordTask*> stopped_tasks;
+
+  bool adaptive_timeslices;
+  bool contention_in_timeslice;
+  /* With adaptive timeslices, the current limit is max_ticks_ >> this. */
+  int timeslice_shift;
 };
 
 } // namespace rr
@@ -37,27 +37,16 @@ static void pass_through_seccomp_filter(RecordTask* t) {
   ASSERT(t, t->regs().syscall_failed());
 }
 
+/**
+ * Rewrite the tracee filter |code| so that rr can handle all of its
+ * non-ALLOW results, and prepend the rules allowing rr's own privileged
+ * syscalls. Returns the raw bytes of the patched program.
+ */
 template <typename Arch>
-static void install_patched_seccomp_filter_arch(
-    RecordTask* t, unordered_map<uint32_t, uint16_t>& result_to_index,
+static vector<uint8_t> patch_seccomp_filter(
+    RecordTask* t, vector<typename Arch::sock_filter> code,
+    unordered_map<uint32_t, uint16_t>& result_to_index,
     vector<uint32_t>& index_to_result) {
-  // Take advantage of the fact that the filter program is arg3() in both
-  // prctl and seccomp syscalls.
-  bool ok = true;
-  auto prog =
-      t->read_mem(remote_ptr<typename Arch::sock_fprog>(t->regs().arg3()), &ok);
-  if (!ok) {
-    // We'll probably return EFAULT but a kernel that doesn't support
-    // seccomp(2) should return ENOSYS instead, so just run the original
-    // system call to get the correct error.
-    pass_through_seccomp_filter(t);
-    return;
-  }
-  auto code = t->read_mem(prog.filter.rptr(), prog.len, &ok);
-  if (!ok) {
-    pass_through_seccomp_filter(t);
-    return;
-  }
   // Convert all returns to TRACE returns so that rr can handle them.
   // See handle_ptrace_event in RecordSession.
   for (auto& u : code) {
@@ -92,17 +81,59 @@ static void install_patched_seccomp_filter_arch(
   }
   f.filters.insert(f.filters.end(), code.begin(), code.end());
 
+  auto bytes = reinterpret_cast<const uint8_t*>(f.filters.data());
+  return vector<uint8_t>(
+      bytes, bytes + f.filters.size() * sizeof(typename Arch::sock_filter));
+}
+
+template <typename Arch>
+static void install_patched_seccomp_filter_arch(
+    RecordTask* t, unordered_map<uint32_t, uint16_t>& result_to_index,
+    vector<uint32_t>& index_to_result,
+    unordered_map<string, vector<uint8_t>>& patched_filters) {
+  // Take advantage of the fact that the filter program is arg3() in both
+  // prctl and seccomp syscalls.
+  bool ok = true;
+  auto prog =
+      t->read_mem(remote_ptr<typename Arch::sock_fprog>(t->regs().arg3()), &ok);
+  if (!ok) {
+    // We'll probably return EFAULT but a kernel that doesn't support
+    // seccomp(2) should return ENOSYS instead, so just run the original
+    // system call to get the correct error.
+    pass_through_seccomp_filter(t);
+    return;
+  }
+  auto code = t->read_mem(prog.filter.rptr(), prog.len, &ok);
+  if (!ok) {
+    pass_through_seccomp_filter(t);
+    return;
+  }
+  // Sandboxes install the same filter in every child, so only rewrite
+  // each distinct program once.
+  string key(1, (char)Arch::arch());
+  key.append(reinterpret_cast<const char*>(code.data()),
+             code.size() * sizeof(typename Arch::sock_filter));
+  auto it = patched_filters.find(key);
+  if (it == patched_filters.end()) {
+    it = patched_filters
+             .emplace(std::move(key),
+                      patch_seccomp_filter<Arch>(t, std::move(code),
+                                                 result_to_index,
+                                                 index_to_result))
+             .first;
+  }
+  const vector<uint8_t>& patched = it->second;
+  size_t patched_len = patched.size() / sizeof(typename Arch::sock_filter);
+
   long ret;
   {
     AutoRemoteSyscalls remote(t);
-    AutoRestoreMem mem(
-        remote, nullptr,
-        sizeof(prog) + f.filters.size() * sizeof(typename Arch::sock_filter));
+    AutoRestoreMem mem(remote, nullptr, sizeof(prog) + patched.size());
     auto code_ptr = mem.get().cast<typename Arch::sock_filter>();
-    t->write_mem(code_ptr, f.filters.data(), f.filters.size());
-    prog.len = f.filters.size();
+    t->write_bytes_helper(code_ptr, patched.size(), patched.data());
+    prog.len = patched_len;
     prog.filter = code_ptr;
-    auto prog_ptr = remote_ptr<void>(code_ptr + f.filters.size())
+    auto prog_ptr = remote_ptr<void>(code_ptr + patched_len)
                         .cast<typename Arch::sock_fprog>();
     t->write_mem(prog_ptr, prog);
 
@@ -125,7 +156,7 @@ static void install_patched_seccomp_filter_arch(
 
 void SeccompFilterRewriter::install_patched_seccomp_filter(RecordTask* t) {
   RR_ARCH_FUNCTION(install_patched_seccomp_filter_arch, t->arch(), t,
-                   result_to_index, index_to_result);
+                   result_to_index, index_to_result, patched_filters);
 }
 
 bool SeccompFilterRewriter::map_filter_data_to_real_result(RecordTask* t,
@@ -4,6 +4,7 @@
 #define RR_SECCOMP_FILTER_REWRITER_H_
 
 #include <cstdint>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
@@ -69,6 +70,11 @@ private:
    */
   std::unordered_map<uint32_t, uint16_t> result_to_index;
   std::vector<uint32_t> index_to_result;
+  /**
+   * Patched programs (as raw sock_filter bytes) keyed by the arch and the
+   * raw bytes of the program the tracee tried to install.
+   */
+  std::unordered_map<std::string, std::vector<uint8_t>> patched_filters;
 };
 
 } // namespace rr
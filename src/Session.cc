@@ -68,6 +68,7 @@ Session::~Session() {
 
 Session::Session(const Session& other)
     : statistics_(other.statistics_),
+      syscall_statistics_(other.syscall_statistics_),
       tracee_socket(other.tracee_socket),
       tracee_socket_receiver(other.tracee_socket_receiver),
       tracee_socket_fd_number(other.tracee_socket_fd_number),
@@ -82,6 +83,35 @@ Session::Session(const Session& other)
       visible_execution_(other.visible_execution_),
       intel_pt_(other.intel_pt_) {}
 
+static bool collect_syscall_statistics = false;
+
+void Session::enable_syscall_statistics() {
+  collect_syscall_statistics = true;
+}
+
+bool Session::syscall_statistics_enabled() {
+  return collect_syscall_statistics;
+}
+
+void Session::print_syscall_statistics(FILE* out, const char* tag) const {
+  for (auto& it : syscall_statistics_) {
+    const SyscallStatistics& stats = it.second;
+    fprintf(out,
+            "[%s] arch %s syscall %s number %d unbuffered %llu buffered %llu "
+            "ptrace_stops %llu handler_us %llu bytes %llu\n",
+            tag, arch_name(it.first.first).c_str(),
+            syscall_name(it.first.second, it.first.first).c_str(),
+            it.first.second, (unsigned long long)stats.unbuffered,
+            (unsigned long long)stats.buffered,
+            (unsigned long long)stats.ptrace_stops,
+            (unsigned long long)(stats.handler_ns / 1000),
+            (unsigned long long)stats.bytes);
+  }
+  fprintf(out, "[%s] rseq_aborts %llu\n", tag,
+          (unsigned long long)statistics_.rseq_aborts);
+  fflush(out);
+}
+
 void Session::on_create(ThreadGroup* tg) { thread_group_map_[tg->tguid()] = tg; }
 void Session::on_destroy(ThreadGroup* tg) {
   thread_group_map_.erase(tg->tguid());
@@ -217,6 +247,15 @@ AddressSpace* Session::find_address_space(const AddressSpaceUid& vmuid) const {
 
 void Session::kill_all_tasks() {
   LOG(debug) << "Killing all tasks ...";
+  // Send every SIGKILL up front so the tasks run their exits concurrently
+  // rather than one round trip at a time while we wait for each below.
+  // Task::kill() copes with a task that already has SIGKILL pending.
+  for (auto& v : task_map) {
+    Task* t = v.second;
+    if (!t->was_reaped()) {
+      syscall(SYS_tgkill, t->real_tgid(), t->tid, SIGKILL);
+    }
+  }
   for (int pass = 0; pass <= 1; ++pass) {
     /* We delete tasks in two passes. First, we kill
      * every non-thread-group-leader, then we kill every group leader.
@@ -368,6 +407,20 @@ void Session::finish_initializing() const {
         asleader.clone_leader->write_bytes_helper(mem.first, mem.second.size(),
                                                   mem.second.data());
       }
+      // Install the cloned-file-data fds of all threads sharing the leader's
+      // fd table here, before cloning the members, so the members inherit
+      // them and don't each need their own remote syscall session. Those fds
+      // are already at these numbers in the leader's table; we only replace
+      // them with descriptions whose offsets aren't shared with the original
+      // session.
+      uintptr_t leader_fdtable =
+          asleader.clone_leader_state.fdtable_identity;
+      Task::copy_cloned_file_data(remote, asleader.clone_leader_state);
+      for (auto& asmember : asleader.member_states) {
+        if (asmember.fdtable_identity == leader_fdtable) {
+          Task::copy_cloned_file_data(remote, asmember);
+        }
+      }
       for (auto& asmember : asleader.member_states) {
         auto it = thread_group_map_.find(asmember.tguid);
         ThreadGroup::shr_ptr tg(it == thread_group_map_.end() ? nullptr :
@@ -379,10 +432,11 @@ void Session::finish_initializing() const {
         Task* t_clone = Task::os_clone_into(
             asmember, remote, clone_completion->cloned_fd_tables, tg);
         self->on_create(t_clone);
-        t_clone->copy_state(asmember);
+        t_clone->copy_state(asmember,
+                            asmember.fdtable_identity == leader_fdtable);
       }
     }
-    asleader.clone_leader->copy_state(asleader.clone_leader_state);
+    asleader.clone_leader->copy_state(asleader.clone_leader_state, true);
   }
 
   self->clone_completion = nullptr;
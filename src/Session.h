@@ -297,20 +297,62 @@ public:
 
   struct Statistics {
     Statistics()
-        : bytes_written(0), ticks_processed(0), syscalls_performed(0) {}
+        : bytes_written(0), ticks_processed(0), syscalls_performed(0),
+          rseq_aborts(0) {}
     uint64_t bytes_written;
     Ticks ticks_processed;
     uint32_t syscalls_performed;
+    // rseq critical sections rr aborted because it preempted or signaled
+    // the task inside one
+    uint64_t rseq_aborts;
   };
   void accumulate_bytes_written(uint64_t bytes_written) {
     statistics_.bytes_written += bytes_written;
   }
   void accumulate_syscall_performed() { statistics_.syscalls_performed += 1; }
+  void accumulate_rseq_abort() { statistics_.rseq_aborts += 1; }
   void accumulate_ticks_processed(Ticks ticks) {
     statistics_.ticks_processed += ticks;
   }
   Statistics statistics() { return statistics_; }
 
+  /**
+   * Per-syscall dispatch counters, keyed by (arch, syscall number).
+   * |ptrace_stops| counts the times rr's unbuffered handler ran for the
+   * syscall, |handler_ns| is the time spent in it and |bytes| is the
+   * recorded (or, during replay, restored) data.
+   */
+  struct SyscallStatistics {
+    SyscallStatistics()
+        : unbuffered(0), buffered(0), ptrace_stops(0), handler_ns(0),
+          bytes(0) {}
+    uint64_t unbuffered;
+    uint64_t buffered;
+    uint64_t ptrace_stops;
+    uint64_t handler_ns;
+    uint64_t bytes;
+  };
+  typedef std::map<std::pair<SupportedArch, int>, SyscallStatistics>
+      SyscallStatisticsMap;
+  /**
+   * Syscall statistics are only collected (for all sessions) after this has
+   * been called, since reading the clocks isn't free.
+   */
+  static void enable_syscall_statistics();
+  static bool syscall_statistics_enabled();
+  SyscallStatistics& syscall_statistics_for(SupportedArch arch,
+                                            int syscallno) {
+    return syscall_statistics_[std::make_pair(arch, syscallno)];
+  }
+  const SyscallStatisticsMap& syscall_statistics() const {
+    return syscall_statistics_;
+  }
+  /**
+   * Write one "[<tag>] arch ... syscall ..." line per syscall seen to |out|,
+   * then a "[<tag>] rseq_aborts <n>" line.
+   */
+  void print_syscall_statistics(FILE* out, const char* tag) const;
+
   virtual Task* new_task(pid_t tid, pid_t rec_tid, uint32_t serial,
                          SupportedArch a, const std::string& name);
 
@@ -461,6 +503,7 @@ protected:
   std::unique_ptr<CloneCompletion> clone_completion;
 
   Statistics statistics_;
+  SyscallStatisticsMap syscall_statistics_;
 
   std::shared_ptr<ScopedFd> tracee_socket;
   std::shared_ptr<ScopedFd> tracee_socket_receiver;
@@ -2,6 +2,7 @@
 
 #include <dirent.h>
 #include <spawn.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -1021,6 +1022,266 @@ static bool starts_with(const string& s, const string& prefix) {
   return strncmp(s.c_str(), prefix.c_str(), prefix.size()) == 0;
 }
 
+// The result of process_compilation_units() for one binary.
+struct CompilationUnitsResult {
+  // The debugaltlink file the result was computed with.
+  string full_altfile_name;
+  bool has_source_files;
+  vector<string> file_names;
+  vector<DwoInfo> dwos;
+};
+
+static bool write_string(FILE* f, const string& s) {
+  uint32_t len = s.size();
+  return fwrite(&len, sizeof(len), 1, f) == 1 &&
+      fwrite(s.data(), 1, len, f) == len;
+}
+
+static bool read_string(FILE* f, string* s) {
+  uint32_t len;
+  if (fread(&len, sizeof(len), 1, f) != 1) {
+    return false;
+  }
+  s->resize(len);
+  return fread(&(*s)[0], 1, len, f) == len;
+}
+
+static bool write_compilation_units_result(FILE* f, const string& binary,
+                                           const CompilationUnitsResult& r) {
+  uint64_t counts[3] = { r.has_source_files, r.file_names.size(),
+                         r.dwos.size() };
+  if (!write_string(f, binary) || !write_string(f, r.full_altfile_name) ||
+      fwrite(counts, sizeof(counts), 1, f) != 1) {
+    return false;
+  }
+  for (auto& name : r.file_names) {
+    if (!write_string(f, name)) {
+      return false;
+    }
+  }
+  for (auto& d : r.dwos) {
+    if (!write_string(f, d.name) || !write_string(f, d.trace_file) ||
+        !write_string(f, d.build_id) || !write_string(f, d.comp_dir) ||
+        !write_string(f, d.full_path) ||
+        fwrite(&d.id, sizeof(d.id), 1, f) != 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool read_compilation_units_result(FILE* f, string* binary,
+                                          CompilationUnitsResult* r) {
+  uint64_t counts[3];
+  if (!read_string(f, binary) || !read_string(f, &r->full_altfile_name) ||
+      fread(counts, sizeof(counts), 1, f) != 1) {
+    return false;
+  }
+  r->has_source_files = counts[0];
+  r->file_names.resize(counts[1]);
+  for (auto& name : r->file_names) {
+    if (!read_string(f, &name)) {
+      return false;
+    }
+  }
+  r->dwos.resize(counts[2]);
+  for (auto& d : r->dwos) {
+    if (!read_string(f, &d.name) || !read_string(f, &d.trace_file) ||
+        !read_string(f, &d.build_id) || !read_string(f, &d.comp_dir) ||
+        !read_string(f, &d.full_path) ||
+        fread(&d.id, sizeof(d.id), 1, f) != 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * The compilation units of a binary with a given build-id always produce
+ * the same results for the same original file name, comp_dir substitution
+ * and debugaltlink file, so keep them in a persistent cache to avoid parsing
+ * the same libraries over and over for different traces. The only
+ * trace-specific part, DwoInfo::trace_file, is fixed up on load.
+ */
+static string compilation_units_cache_dir() {
+  return trace_save_dir() + "/.sources_cache";
+}
+
+static string compilation_units_cache_key(const string& build_id,
+                                          const string& original_file_name,
+                                          const string& comp_dir_substitution,
+                                          const string& full_altfile_name) {
+  return build_id + '\0' + original_file_name + '\0' + comp_dir_substitution +
+      '\0' + full_altfile_name;
+}
+
+static string compilation_units_cache_path(const string& build_id,
+                                           const string& key) {
+  char hash[32];
+  sprintf(hash, "%016llx", (unsigned long long)std::hash<string>()(key));
+  return compilation_units_cache_dir() + "/" + build_id + "-" + hash;
+}
+
+static bool process_compilation_units_cached(
+    ElfFileReader& reader, ElfFileReader* sup_reader,
+    const string& trace_relative_name, const string& original_file_name,
+    const string& comp_dir_substitution, DirExistsCache& dir_exists_cache,
+    CompilationUnitsResult* r) {
+  string build_id = reader.read_buildid();
+  string key = compilation_units_cache_key(build_id, original_file_name,
+                                           comp_dir_substitution,
+                                           r->full_altfile_name);
+  string path = compilation_units_cache_path(build_id, key);
+  if (!build_id.empty()) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (f) {
+      string cached_key;
+      CompilationUnitsResult cached;
+      bool hit = read_compilation_units_result(f, &cached_key, &cached) &&
+          cached_key == key;
+      fclose(f);
+      if (hit) {
+        for (auto& d : cached.dwos) {
+          d.trace_file = trace_relative_name;
+        }
+        r->has_source_files = cached.has_source_files;
+        r->file_names = std::move(cached.file_names);
+        r->dwos = std::move(cached.dwos);
+        return r->has_source_files;
+      }
+    }
+  }
+
+  vector<OutputCompDirSubstitution> unused_substitutions;
+  set<string> file_names;
+  r->has_source_files = process_compilation_units(
+      reader, sup_reader, trace_relative_name, original_file_name,
+      comp_dir_substitution, unused_substitutions, nullptr, nullptr,
+      &file_names, &r->dwos, dir_exists_cache);
+  r->file_names.assign(file_names.begin(), file_names.end());
+
+  if (!build_id.empty()) {
+    // The cache is only an optimization, so failing to write it isn't an
+    // error.
+    mkdir(compilation_units_cache_dir().c_str(), 0700);
+    string tmp_path = path + "." + to_string(getpid());
+    FILE* f = fopen(tmp_path.c_str(), "w");
+    if (f) {
+      write_compilation_units_result(f, key, *r);
+      if (fclose(f) || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        unlink(tmp_path.c_str());
+      }
+    }
+  }
+  return r->has_source_files;
+}
+
+/**
+ * Walking the compilation units of every binary dominates `rr sources` for
+ * traces with many large binaries. The DWARF parser and logging aren't
+ * thread-safe, so fork worker processes that each run
+ * process_compilation_units() for a share of the binaries and hand back the
+ * results through temporary files. sources() then only has to merge them.
+ * Results are keyed by the name the binary was opened with.
+ */
+template<class iterable>
+static map<string, CompilationUnitsResult> prefetch_compilation_units(
+    const iterable& binary_file_names,
+    const map<string, string>& comp_dir_substitutions,
+    const vector<string>& debug_file_directories, bool is_explicit) {
+  map<string, CompilationUnitsResult> results;
+  vector<pair<string, string>> binaries(binary_file_names.begin(),
+                                        binary_file_names.end());
+  int jobs = min<int>(min(16, get_num_cpus()), binaries.size());
+  if (jobs <= 1) {
+    return results;
+  }
+
+  vector<pair<pid_t, ScopedFd>> children;
+  for (int i = 0; i < jobs; ++i) {
+    TempFile out = create_temporary_file("rr-sources-XXXXXX");
+    unlink(out.name.c_str());
+    fflush(stdout);
+    pid_t child = fork();
+    if (child < 0) {
+      FATAL() << "Can't fork";
+    }
+    if (!child) {
+      FILE* f = fdopen(out.fd.extract(), "w");
+      if (!f) {
+        _exit(1);
+      }
+      DirExistsCache dir_exists_cache;
+      for (size_t j = i; j < binaries.size(); j += jobs) {
+        string trace_relative_name = binaries[j].first;
+        string original_name = binaries[j].second;
+        const char* file_name = is_explicit ? original_name.c_str() :
+            trace_relative_name.c_str();
+        ScopedFd fd(file_name, O_RDONLY);
+        if (!fd.is_open()) {
+          continue;
+        }
+        ElfFileReader reader(fd);
+        if (!reader.ok()) {
+          continue;
+        }
+        if (!is_explicit) {
+          base_name(trace_relative_name);
+        }
+        base_name(original_name);
+        Debugaltlink debugaltlink = reader.read_debugaltlink();
+        CompilationUnitsResult r;
+        auto altlink_reader = find_auxiliary_file(
+            binaries[j].second, debugaltlink.file_name, r.full_altfile_name,
+            debug_file_directories);
+        auto it = comp_dir_substitutions.find(original_name);
+        process_compilation_units_cached(
+            reader, altlink_reader.get(), trace_relative_name,
+            binaries[j].second,
+            it != comp_dir_substitutions.end() ? it->second : string(),
+            dir_exists_cache, &r);
+        if (!write_compilation_units_result(f, file_name, r)) {
+          _exit(1);
+        }
+      }
+      if (fclose(f)) {
+        _exit(1);
+      }
+      _exit(0);
+    }
+    children.push_back(make_pair(child, std::move(out.fd)));
+  }
+
+  for (auto& c : children) {
+    int status;
+    if (waitpid(c.first, &status, 0) != c.first) {
+      FATAL() << "Can't wait for " << c.first;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      // sources() will do this worker's binaries itself.
+      LOG(warn) << "Compilation unit worker " << c.first
+                << " failed with status " << status;
+      continue;
+    }
+    // The child shared our file offset, so rewind past what it wrote.
+    if (lseek(c.second, 0, SEEK_SET) < 0) {
+      FATAL() << "Can't seek compilation unit results";
+    }
+    FILE* f = fdopen(c.second.extract(), "r");
+    if (!f) {
+      FATAL() << "Can't read compilation unit results";
+    }
+    string binary;
+    CompilationUnitsResult r;
+    while (read_compilation_units_result(f, &binary, &r)) {
+      results[binary] = std::move(r);
+      r = CompilationUnitsResult();
+    }
+    fclose(f);
+  }
+  return results;
+}
+
 template<class iterable>
 static int sources(const iterable& binary_file_names,
                    map<string, string>& comp_dir_substitutions,
@@ -1037,6 +1298,9 @@ static int sources(const iterable& binary_file_names,
   if (debug_dirs) {
     dd = debug_dirs->initial_directories();
   }
+  map<string, CompilationUnitsResult> prefetched = prefetch_compilation_units(
+      binary_file_names, comp_dir_substitutions, dd.debug_file_directories,
+      is_explicit);
 
   for (auto& pair : binary_file_names) {
     string trace_relative_name = pair.first;
@@ -1069,18 +1333,25 @@ static int sources(const iterable& binary_file_names,
     if (it != comp_dir_substitutions.end()) {
       LOG(debug) << "\tFound comp_dir substitution " << it->second;
       output_comp_dir_substitutions.push_back({ trace_relative_name, it->second });
-      has_source_files = process_compilation_units(reader, altlink_reader.get(),
-                                                   trace_relative_name, pair.second,
-                                                   it->second, output_comp_dir_substitutions,
-                                                   nullptr, nullptr, &file_names, &dwos,
-                                                   dir_exists_cache);
     } else {
       LOG(debug) << "\tNo comp_dir substitution found";
-      has_source_files = process_compilation_units(reader, altlink_reader.get(),
-                                                   trace_relative_name, pair.second,
-                                                   {}, output_comp_dir_substitutions,
-                                                   nullptr, nullptr, &file_names, &dwos,
-                                                   dir_exists_cache);
+    }
+    auto pre = prefetched.find(file_name);
+    if (pre != prefetched.end() &&
+        pre->second.full_altfile_name == full_altfile_name) {
+      has_source_files = pre->second.has_source_files;
+      file_names.insert(pre->second.file_names.begin(),
+                        pre->second.file_names.end());
+      dwos.insert(dwos.end(), pre->second.dwos.begin(), pre->second.dwos.end());
+    } else {
+      CompilationUnitsResult r;
+      r.full_altfile_name = full_altfile_name;
+      has_source_files = process_compilation_units_cached(
+          reader, altlink_reader.get(), trace_relative_name, pair.second,
+          it != comp_dir_substitutions.end() ? it->second : string(),
+          dir_exists_cache, &r);
+      file_names.insert(r.file_names.begin(), r.file_names.end());
+      dwos.insert(dwos.end(), r.dwos.begin(), r.dwos.end());
     }
     /* If the original binary had source files, force the inclusion of any debugaltlink
      * file, even if it does not itself have compilation units (it may have relevant strings)
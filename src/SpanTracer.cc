@@ -0,0 +1,154 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "SpanTracer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+using namespace std;
+
+namespace rr {
+
+// Spans kept per thread: 24 bytes each, so 6MB of address space for each
+// thread that records any. Only the pages spans have been written to are
+// ever touched, so threads that record few spans cost little.
+static const size_t SPAN_BUFFER_SIZE = 1 << 18;
+
+struct Span {
+  const char* name;
+  uint64_t start_ns;
+  uint64_t end_ns;
+};
+
+struct SpanBuffer {
+  pid_t tid;
+  char thread_name[16];
+  // Total spans recorded; the last SPAN_BUFFER_SIZE of them are in |spans|.
+  uint64_t count;
+  Span spans[SPAN_BUFFER_SIZE];
+};
+
+static const char* span_trace_file;
+// The process that set up tracing; forked children mustn't write the file.
+static pid_t span_trace_pid;
+static uint64_t span_trace_start_ns;
+
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Never freed, so exiting threads' spans are still there at exit.
+static vector<SpanBuffer*>* buffers;
+
+static thread_local SpanBuffer* thread_buffer;
+
+uint64_t span_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Thread names come from pthread_setname_np()/prctl(PR_SET_NAME) and can
+// contain any bytes, so escape them like any other JSON string.
+static void write_json_string(FILE* f, const char* str) {
+  fputc('"', f);
+  for (const char* p = str; *p; ++p) {
+    unsigned char ch = *p;
+    if (ch == '"' || ch == '\\') {
+      fputc('\\', f);
+      fputc(ch, f);
+    } else if (ch < 0x20 || ch == 0x7f) {
+      fprintf(f, "\\u%04x", ch);
+    } else {
+      fputc(ch, f);
+    }
+  }
+  fputc('"', f);
+}
+
+static void write_span_trace() {
+  if (getpid() != span_trace_pid) {
+    return;
+  }
+  FILE* f = fopen(span_trace_file, "w");
+  if (!f) {
+    fprintf(stderr, "Can't write span trace to %s: %s\n", span_trace_file,
+            strerror(errno));
+    return;
+  }
+  pthread_mutex_lock(&buffers_mutex);
+  fputs("{\"traceEvents\":[\n", f);
+  const char* sep = "";
+  for (SpanBuffer* b : *buffers) {
+    fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+               "\"tid\":%d,\"args\":{\"name\":",
+            sep, span_trace_pid, b->tid);
+    write_json_string(f, b->thread_name);
+    fputs("}}", f);
+    sep = ",\n";
+    uint64_t first =
+        b->count > SPAN_BUFFER_SIZE ? b->count - SPAN_BUFFER_SIZE : 0;
+    for (uint64_t i = first; i < b->count; ++i) {
+      const Span& s = b->spans[i % SPAN_BUFFER_SIZE];
+      // Trace event times are in microseconds.
+      fprintf(f, "%s{\"name\":", sep);
+      write_json_string(f, s.name);
+      fprintf(f, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                 "\"ts\":%.3f,\"dur\":%.3f}",
+              span_trace_pid, b->tid,
+              (s.start_ns - span_trace_start_ns) / 1000.0,
+              (s.end_ns - s.start_ns) / 1000.0);
+    }
+    if (first) {
+      fprintf(stderr, "Span trace dropped the oldest %llu spans of thread %d\n",
+              (unsigned long long)first, b->tid);
+    }
+  }
+  fputs("\n]}\n", f);
+  pthread_mutex_unlock(&buffers_mutex);
+  fclose(f);
+}
+
+static bool init_span_tracing() {
+  span_trace_file = getenv("RR_SPAN_TRACE");
+  if (!span_trace_file || !*span_trace_file) {
+    return false;
+  }
+  span_trace_pid = getpid();
+  span_trace_start_ns = span_now_ns();
+  buffers = new vector<SpanBuffer*>();
+  atexit(write_span_trace);
+  return true;
+}
+
+bool span_tracing_enabled = init_span_tracing();
+
+void record_span(const char* name, uint64_t start_ns, uint64_t end_ns) {
+  SpanBuffer* b = thread_buffer;
+  if (!b) {
+    b = new SpanBuffer;
+    b->tid = syscall(SYS_gettid);
+    if (pthread_getname_np(pthread_self(), b->thread_name,
+                           sizeof(b->thread_name))) {
+      strcpy(b->thread_name, "rr");
+    }
+    b->count = 0;
+    pthread_mutex_lock(&buffers_mutex);
+    buffers->push_back(b);
+    pthread_mutex_unlock(&buffers_mutex);
+    thread_buffer = b;
+  }
+  Span& s = b->spans[b->count % SPAN_BUFFER_SIZE];
+  s.name = name;
+  s.start_ns = start_ns;
+  s.end_ns = end_ns;
+  // Only write_span_trace() reads other threads' buffers, at exit.
+  ++b->count;
+}
+
+} // namespace rr
@@ -0,0 +1,51 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_SPAN_TRACER_H_
+#define RR_SPAN_TRACER_H_
+
+#include <stdint.h>
+
+namespace rr {
+
+/*
+ * Timing of rr's own hot paths, for seeing where wall time goes without the
+ * distortion RR_LOG's text logging causes. Run rr with RR_SPAN_TRACE=<file>
+ * and at exit it writes every span it timed to <file> as Chrome trace event
+ * JSON, which chrome://tracing and Perfetto load.
+ *
+ * Each thread records into its own ring buffer without taking locks. When a
+ * thread's buffer fills, its oldest spans are dropped.
+ */
+
+extern bool span_tracing_enabled;
+
+/**
+ * Record that |name| ran from |start_ns| to |end_ns| on this thread.
+ * |name| must be a string literal: only the pointer is kept.
+ */
+void record_span(const char* name, uint64_t start_ns, uint64_t end_ns);
+
+uint64_t span_now_ns();
+
+/**
+ * Times the rest of the enclosing scope as a span named |name|, if span
+ * tracing is enabled.
+ */
+class ScopedSpan {
+public:
+  explicit ScopedSpan(const char* name)
+      : name(name), start_ns(span_tracing_enabled ? span_now_ns() : 0) {}
+  ~ScopedSpan() {
+    if (start_ns) {
+      record_span(name, start_ns, span_now_ns());
+    }
+  }
+
+private:
+  const char* name;
+  uint64_t start_ns;
+};
+
+} // namespace rr
+
+#endif /* RR_SPAN_TRACER_H_ */
@@ -7,15 +7,80 @@
 #include "ReplayTask.h"
 #include "Session.h"
 #include "log.h"
+#include "util.h"
+
+using namespace std;
 
 namespace rr {
 
+// Write out buffered echo output once there's this much of it...
+static const size_t max_echo_buffer_bytes = 64 * 1024;
+// ... or it's this old (in seconds).
+static const double max_echo_buffer_latency = 0.05;
+
+struct EchoChunk {
+  int fd;
+  vector<uint8_t> data;
+};
+// Output to echo, in order, with consecutive writes to one fd merged
+static vector<EchoChunk> echo_buffer;
+static size_t echo_buffer_bytes;
+static double echo_buffer_start;
+
+static void flush_echo_buffer_at_exit() { StdioMonitor::flush_echoed_output(); }
+
+static void echo(int fd, const uint8_t* data, size_t size) {
+  if (!size) {
+    return;
+  }
+  if (echo_buffer.empty()) {
+    static bool registered_atexit = false;
+    if (!registered_atexit) {
+      atexit(flush_echo_buffer_at_exit);
+      registered_atexit = true;
+    }
+    echo_buffer_start = monotonic_now_sec();
+  }
+  if (echo_buffer.empty() || echo_buffer.back().fd != fd) {
+    echo_buffer.push_back({ fd, vector<uint8_t>() });
+  }
+  auto& chunk = echo_buffer.back().data;
+  chunk.insert(chunk.end(), data, data + size);
+  echo_buffer_bytes += size;
+  if (echo_buffer_bytes >= max_echo_buffer_bytes) {
+    StdioMonitor::flush_echoed_output();
+  } else {
+    StdioMonitor::flush_stale_echoed_output();
+  }
+}
+
+void StdioMonitor::flush_echoed_output() {
+  // Take the buffer first: a failed write is FATAL, and fatal errors flush
+  // the buffer too.
+  vector<EchoChunk> chunks;
+  chunks.swap(echo_buffer);
+  echo_buffer_bytes = 0;
+  for (auto& chunk : chunks) {
+    write_all(chunk.fd, chunk.data.data(), chunk.data.size());
+  }
+}
+
+void StdioMonitor::flush_stale_echoed_output() {
+  if (!echo_buffer.empty() &&
+      monotonic_now_sec() - echo_buffer_start >= max_echo_buffer_latency) {
+    flush_echoed_output();
+  }
+}
+
 Switchable StdioMonitor::will_write(Task* t) {
   if (t->session().mark_stdio()) {
     char buf[256];
     snprintf(buf, sizeof(buf) - 1, "[rr %d %" PRId64 "]", t->tgid(), t->trace_time());
     ssize_t len = strlen(buf);
-    if (write(original_fd, buf, len) != len) {
+    if (t->session().is_replaying()) {
+      // Keep the marker in order with the echoed output it precedes.
+      echo(original_fd, reinterpret_cast<const uint8_t*>(buf), len);
+    } else if (write(original_fd, buf, len) != len) {
       ASSERT(t, false) << "Couldn't write to " << original_fd;
     }
   }
@@ -31,10 +96,7 @@ void StdioMonitor::did_write(Task* t, const std::vector<Range>& ranges,
   }
   for (auto& r : ranges) {
     auto bytes = t->read_mem(r.data.cast<uint8_t>(), r.length);
-    if (bytes.size() !=
-        (size_t)write(original_fd, bytes.data(), bytes.size())) {
-      ASSERT(t, false) << "Couldn't write to " << original_fd;
-    }
+    echo(original_fd, bytes.data(), bytes.size());
   }
 }
 
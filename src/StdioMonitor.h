@@ -43,6 +43,19 @@ public:
   virtual void did_write(Task* t, const std::vector<Range>& ranges,
                          LazyOffset&) override;
 
+  /**
+   * Echoed output is buffered and written out in batches, bounded in size
+   * and age. Write out everything buffered so far. Must be called before
+   * the user could see anything else we output, e.g. before a debugger
+   * stop is reported, before forking and before reporting a fatal error.
+   */
+  static void flush_echoed_output();
+  /**
+   * Flush the echoed output if it has been buffered too long. Cheap when
+   * nothing is buffered.
+   */
+  static void flush_stale_echoed_output();
+
 private:
   int original_fd;
 };
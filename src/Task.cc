@@ -18,6 +18,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/user.h>
 #include <sys/wait.h>
@@ -45,6 +46,7 @@
 #include "ReplaySession.h"
 #include "ReplayTask.h"
 #include "ScopedFd.h"
+#include "SpanTracer.h"
 #include "StdioMonitor.h"
 #include "StringVectorToCharArray.h"
 #include "TraceeAttentionSet.h"
@@ -502,6 +504,30 @@ void Task::close_buffers_for(AutoRemoteSyscalls& remote, Task* other, bool reall
   }
 }
 
+void Task::defer_close_buffers_for(Task* other) {
+  if (other->desched_fd_child >= 0) {
+    deferred_buffer_fd_closes.push_back(other->desched_fd_child);
+    fds->did_close(other->desched_fd_child);
+  }
+  if (other->cloned_file_data_fd_child >= 0) {
+    deferred_buffer_fd_closes.push_back(other->cloned_file_data_fd_child);
+    fds->did_close(other->cloned_file_data_fd_child);
+  }
+}
+
+void Task::close_deferred_buffer_fds() {
+  if (deferred_buffer_fd_closes.empty()) {
+    return;
+  }
+  LOG(debug) << "Closing " << deferred_buffer_fd_closes.size()
+             << " deferred syscallbuf fds in " << tid;
+  AutoRemoteSyscalls remote(this);
+  for (int fd : deferred_buffer_fd_closes) {
+    remote.infallible_close_syscall_if_alive(fd);
+  }
+  deferred_buffer_fd_closes.clear();
+}
+
 void Task::emulate_jump(remote_code_ptr ip) {
   Registers r = regs();
   r.set_ip(ip);
@@ -1098,6 +1124,8 @@ void Task::post_exec(const string& exe_file) {
   scratch_ptr = nullptr;
   cloned_file_data_fd_child = -1;
   desched_fd_child = -1;
+  // exec closed these for us.
+  deferred_buffer_fd_closes.clear();
   preload_globals = nullptr;
   rseq_state = nullptr;
   thread_group()->execed = true;
@@ -1496,11 +1524,13 @@ void Task::work_around_KNL_string_singlestep_bug() {
 
 bool Task::resume_execution(ResumeRequest how, WaitRequest wait_how,
                             TicksRequest tick_period, int sig) {
+  ScopedSpan span("Task::resume_execution");
   ASSERT(this, is_stopped_);
 
   // Ensure our HW debug registers are up to date before we execute any code.
   // If this fails because the task died, the code below will detect it.
   set_debug_regs(vm()->get_hw_watchpoints());
+  vm()->notify_resumed();
 
   will_resume_execution(how, wait_how, tick_period, sig);
 
@@ -1694,6 +1724,18 @@ void Task::set_extra_regs(const ExtraRegisters& regs) {
   ASSERT(this, !regs.empty()) << "Trying to set empty ExtraRegisters";
   ASSERT(this, regs.arch() == arch())
       << "Trying to set wrong arch ExtraRegisters";
+  if (regs.is_compacted()) {
+    ExtraRegisters expanded = regs;
+    expanded.expand();
+    set_extra_regs(expanded);
+    return;
+  }
+  if (extra_registers_known && extra_registers.format_ == regs.format_ &&
+      extra_registers.data_ == regs.data_) {
+    // The tracee already has these values. Writing an XSAVE area back costs
+    // as much as reading it, so don't bother.
+    return;
+  }
   extra_registers = regs;
 
   switch (extra_registers.format()) {
@@ -2057,6 +2099,7 @@ bool Task::account_for_potential_ptrace_interrupt_stop(WaitStatus status) {
 }
 
 bool Task::wait(double interrupt_after_elapsed) {
+  ScopedSpan span("Task::wait");
   LOG(debug) << "going into blocking wait for " << tid << " ...";
   ASSERT(this, session().is_recording() || interrupt_after_elapsed == -1);
 
@@ -2591,6 +2634,16 @@ Task* Task::clone(CloneReason reason, int flags, remote_ptr<void> stack,
       }
     } else if (CLONE_SHARE_FILES & flags) {
       // `t` is sharing our fd table, so it should not close anything.
+    } else if ((CLONE_SHARE_VM & flags) &&
+               !(CLONE_SHARE_THREAD_GROUP & flags)) {
+      // A vfork()/posix_spawn() child almost always execs straight away, and
+      // the syscallbuf fds are all O_CLOEXEC, so closing them now would be
+      // wasted remote syscalls. `t` has no syscallbuf, so every syscall it
+      // makes stops in rr; close the fds lazily at the first one that isn't
+      // an exec. See close_deferred_buffer_fds().
+      for (Task* tt : fds->task_set()) {
+        t->defer_close_buffers_for(tt);
+      }
     } else {
       // Close syscallbuf fds for all tasks using the original fd table.
       AutoRemoteSyscalls remote(t);
@@ -2696,8 +2749,6 @@ static void copy_tls_arch(const Task::CapturedState& state,
           syscall_number_for_set_thread_area(remote.arch()),
           remote_tls.get().as_int());
     }
-  } else if (Arch::arch() == aarch64) {
-    remote.task()->set_aarch64_tls_register(state.tls_register);
   }
 }
 
@@ -2756,6 +2807,7 @@ Task::CapturedState Task::capture_state() {
   state.tguid = thread_group()->tguid();
   state.regs = regs();
   state.extra_regs = *extra_regs_fallible();
+  state.extra_regs.compact();
   state.prname = name();
   if (arch() == aarch64) {
     bool ok = read_aarch64_tls_register(&state.tls_register);
@@ -2786,32 +2838,58 @@ Task::CapturedState Task::capture_state() {
   return state;
 }
 
-void Task::copy_state(const CapturedState& state) {
+/*static*/ void Task::copy_cloned_file_data(AutoRemoteSyscalls& remote,
+                                            const CapturedState& state) {
+  if (state.syscallbuf_child.is_null() ||
+      state.cloned_file_data_fd_child < 0) {
+    return;
+  }
+  ScopedFd fd(state.cloned_file_data_fname.c_str(),
+              remote.task()->session().as_record() ? O_RDWR : O_RDONLY);
+  remote.infallible_send_fd_dup(fd, state.cloned_file_data_fd_child, O_CLOEXEC);
+  remote.infallible_lseek_syscall(state.cloned_file_data_fd_child,
+                                  state.cloned_file_data_offset, SEEK_SET);
+}
+
+void Task::copy_state(const CapturedState& state,
+                      bool cloned_file_data_copied) {
   set_regs(state.regs);
   set_extra_regs(state.extra_regs);
-  {
+  // Running remote syscalls is by far the most expensive part of this, so
+  // only start a remote session if something actually needs one. Our name
+  // is inherited from whoever cloned us and usually already matches.
+  // Only x86 needs syscalls to set up TLS.
+  bool need_name = name() != state.prname;
+  bool need_tls = arch() == x86 && !state.thread_areas.empty();
+  bool need_file_data = !cloned_file_data_copied &&
+                        !state.syscallbuf_child.is_null() &&
+                        state.cloned_file_data_fd_child >= 0;
+  if (need_name || need_tls || need_file_data) {
     AutoRemoteSyscalls remote(this);
-    set_name(remote, state.prname);
-    copy_tls(state, remote);
-    thread_areas_ = state.thread_areas;
-    syscallbuf_size = state.syscallbuf_size;
-
-    ASSERT(this, !syscallbuf_child)
-        << "Syscallbuf should not already be initialized in clone";
-    if (!state.syscallbuf_child.is_null()) {
-      // All these fields are preserved by the fork.
-      desched_fd_child = state.desched_fd_child;
-      cloned_file_data_fd_child = state.cloned_file_data_fd_child;
-      cloned_file_data_fname = state.cloned_file_data_fname;
-      if (cloned_file_data_fd_child >= 0) {
-        ScopedFd fd(cloned_file_data_fname.c_str(), session().as_record() ?
-          O_RDWR : O_RDONLY);
-        remote.infallible_send_fd_dup(fd, cloned_file_data_fd_child, O_CLOEXEC);
-        remote.infallible_lseek_syscall(
-            cloned_file_data_fd_child, state.cloned_file_data_offset, SEEK_SET);
-      }
-      syscallbuf_child = state.syscallbuf_child;
+    if (need_name) {
+      set_name(remote, state.prname);
     }
+    if (need_tls) {
+      copy_tls(state, remote);
+    }
+    if (need_file_data) {
+      copy_cloned_file_data(remote, state);
+    }
+  }
+  if (arch() == aarch64) {
+    set_aarch64_tls_register(state.tls_register);
+  }
+  thread_areas_ = state.thread_areas;
+  syscallbuf_size = state.syscallbuf_size;
+
+  ASSERT(this, !syscallbuf_child)
+      << "Syscallbuf should not already be initialized in clone";
+  if (!state.syscallbuf_child.is_null()) {
+    // All these fields are preserved by the fork.
+    desched_fd_child = state.desched_fd_child;
+    cloned_file_data_fd_child = state.cloned_file_data_fd_child;
+    cloned_file_data_fname = state.cloned_file_data_fname;
+    syscallbuf_child = state.syscallbuf_child;
   }
   preload_globals = state.preload_globals;
   ASSERT(this, as->thread_locals_tuid() != tuid());
@@ -2985,6 +3063,65 @@ void Task::reset_syscallbuf() {
             (uint32_t)0);
   write_mem(REMOTE_PTR_FIELD(syscallbuf_child, blocked_sigs_generation),
             (uint32_t)0);
+  write_mem(REMOTE_PTR_FIELD(syscallbuf_child, record_did_not_fit),
+            (uint8_t)0);
+}
+
+template <typename Arch>
+static void set_preload_thread_locals_buffer_arch(void* locals_addr,
+                                                  remote_ptr<void> buffer,
+                                                  size_t size) {
+  auto locals = reinterpret_cast<preload_thread_locals<Arch>*>(locals_addr);
+  locals->buffer = buffer.cast<uint8_t>();
+  locals->buffer_size = size;
+}
+
+static void set_preload_thread_locals_buffer(SupportedArch arch,
+                                             void* locals_addr,
+                                             remote_ptr<void> buffer,
+                                             size_t size) {
+  RR_ARCH_FUNCTION(set_preload_thread_locals_buffer_arch, arch, locals_addr,
+                   buffer, size);
+}
+
+KernelMapping Task::resize_syscall_buffer(AutoRemoteSyscalls& remote,
+                                          size_t new_size,
+                                          remote_ptr<void> map_hint) {
+  ASSERT(this, !syscallbuf_child.is_null());
+  ASSERT(this, !read_mem(REMOTE_PTR_FIELD(syscallbuf_child, num_rec_bytes)))
+      << "Resizing a syscallbuf with unflushed records";
+
+  vector<uint8_t> hdr = read_mem(syscallbuf_child.cast<uint8_t>(),
+                                 session().syscallbuf_hdr_size());
+  remote_ptr<struct syscallbuf_hdr> old_child = syscallbuf_child;
+  size_t old_size = syscallbuf_size;
+  syscallbuf_child = nullptr;
+  syscallbuf_size = new_size;
+  KernelMapping km = init_syscall_buffer(remote, map_hint);
+  if (!km.size()) {
+    syscallbuf_child = old_child;
+    syscallbuf_size = old_size;
+    return km;
+  }
+  write_mem(syscallbuf_child.cast<uint8_t>(), hdr.data(), hdr.size());
+
+  remote.infallible_syscall(syscall_number_for_munmap(arch()), old_child,
+                            old_size);
+  vm()->unmap(this, old_child, old_size);
+
+  // The preload library finds its buffer through the thread-locals, which
+  // are only live in the shared mapping while this task owns it.
+  void* locals = nullptr;
+  if (tuid() == as->thread_locals_tuid()) {
+    locals = preload_thread_locals_local_addr(*as);
+  }
+  if (!locals) {
+    locals = thread_locals;
+  }
+  set_preload_thread_locals_buffer(arch(), locals,
+                                   syscallbuf_child.cast<void>(),
+                                   syscallbuf_size);
+  return km;
 }
 
 ssize_t Task::read_bytes_ptrace(remote_ptr<void> addr, ssize_t buf_size,
@@ -3110,6 +3247,64 @@ void Task::read_bytes_helper(remote_ptr<void> addr, ssize_t buf_size, void* buf,
   }
 }
 
+bool Task::read_bytes_batch(const vector<MemoryRange>& ranges, uint8_t* buf) {
+  // process_vm_readv can't read through PROT_NONE or unreadable mappings the
+  // way /proc/<pid>/mem can, and may be forbidden entirely (e.g. by
+  // seccomp in a container). In that case we just read range by range.
+  static bool process_vm_readv_unavailable = false;
+  size_t total = 0;
+  vector<struct iovec> remote_iov;
+  remote_iov.reserve(ranges.size());
+  for (auto& r : ranges) {
+    if (r.size()) {
+      remote_iov.push_back(
+          { reinterpret_cast<void*>(r.start().as_int()), r.size() });
+      total += r.size();
+    }
+  }
+  if (!total) {
+    return true;
+  }
+
+  if (!process_vm_readv_unavailable && remote_iov.size() > 1) {
+    size_t done = 0;
+    size_t next_iov = 0;
+    while (next_iov < remote_iov.size()) {
+      size_t count = min<size_t>(remote_iov.size() - next_iov, IOV_MAX);
+      size_t expected = 0;
+      for (size_t i = next_iov; i < next_iov + count; ++i) {
+        expected += remote_iov[i].iov_len;
+      }
+      struct iovec local_iov = { buf + done, expected };
+      ssize_t nread = process_vm_readv(tid, &local_iov, 1,
+                                       remote_iov.data() + next_iov, count, 0);
+      if (nread != ssize_t(expected)) {
+        if (nread < 0 && (errno == ENOSYS || errno == EPERM)) {
+          LOG(debug) << "process_vm_readv unavailable: " << errno_name(errno);
+          process_vm_readv_unavailable = true;
+        }
+        break;
+      }
+      done += expected;
+      next_iov += count;
+    }
+    if (done == total) {
+      return true;
+    }
+  }
+
+  size_t offset = 0;
+  for (auto& iov : remote_iov) {
+    ssize_t nread = read_bytes_fallible(
+        reinterpret_cast<uintptr_t>(iov.iov_base), iov.iov_len, buf + offset);
+    if (nread != ssize_t(iov.iov_len)) {
+      return false;
+    }
+    offset += iov.iov_len;
+  }
+  return true;
+}
+
 /**
  * This function exists to work around
  * https://bugzilla.kernel.org/show_bug.cgi?id=99101.
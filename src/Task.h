@@ -313,6 +313,11 @@ public:
      If `really_close` is true, actually close the kernel fds through `remote`,
      otherwise only update our FdTable. */
   void close_buffers_for(AutoRemoteSyscalls& remote, Task* t, bool really_close);
+  /* Like close_buffers_for, but only update our FdTable now and remember the
+     kernel fds so close_deferred_buffer_fds() can close them later. */
+  void defer_close_buffers_for(Task* t);
+  /* Close any fds queued by defer_close_buffers_for. */
+  void close_deferred_buffer_fds();
 
   remote_ptr<const struct syscallbuf_record> next_syscallbuf_record();
   long stored_record_size(remote_ptr<const struct syscallbuf_record> record);
@@ -713,6 +718,17 @@ public:
    */
   void reset_syscallbuf();
 
+  /**
+   * Replace this task's (empty) syscall buffer with one of |new_size| bytes,
+   * mapped at |map_hint| if that's not null, carrying over the header and
+   * pointing the preload thread-locals at it. Returns the new mapping, or
+   * an empty mapping (leaving the old buffer in place) if it couldn't be
+   * created.
+   */
+  KernelMapping resize_syscall_buffer(AutoRemoteSyscalls& remote,
+                                      size_t new_size,
+                                      remote_ptr<void> map_hint);
+
   /**
    * Return the virtual memory mapping (address space) of this
    * task.
@@ -803,6 +819,12 @@ public:
    */
   void read_bytes_helper(remote_ptr<void> addr, ssize_t buf_size, void* buf,
                          bool* ok = nullptr);
+  /**
+   * Read all of |ranges| into |buf|, back to back, using as few syscalls as
+   * possible (a single process_vm_readv when the kernel allows it). Returns
+   * false if any range couldn't be read completely.
+   */
+  bool read_bytes_batch(const std::vector<MemoryRange>& ranges, uint8_t* buf);
   /**
    * |flags| is bits from WriteFlags.
    */
@@ -926,6 +948,9 @@ public:
   int cloned_file_data_fd_child;
   /* The filename opened by the child's cloned_file_data_fd */
   std::string cloned_file_data_fname;
+  /* Syscallbuf fds inherited from our parent's fd table that we still need
+     to close; see defer_close_buffers_for. */
+  std::vector<int> deferred_buffer_fd_closes;
   // Current rseq state if registered
   std::unique_ptr<RseqState> rseq_state;
 
@@ -1187,8 +1212,19 @@ protected:
    * Some task state must be copied into this by injecting and
    * running syscalls in this task.  Other state is metadata
    * that can simply be copied over in local memory.
+   * If |cloned_file_data_copied| is true, the caller has already
+   * installed the cloned-file-data fd with copy_cloned_file_data().
+   */
+  void copy_state(const CapturedState& state,
+                  bool cloned_file_data_copied = false);
+
+  /**
+   * Install a fresh copy of the cloned-file-data fd captured in |state|
+   * (if any) into remote.task()'s fd table, at the captured offset.
+   * Tasks cloned from remote.task() afterwards inherit it.
    */
-  void copy_state(const CapturedState& state);
+  static void copy_cloned_file_data(AutoRemoteSyscalls& remote,
+                                    const CapturedState& state);
 
   /**
    * Read tracee memory using PTRACE_PEEKDATA calls. Slow, only use
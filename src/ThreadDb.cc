@@ -1,6 +1,7 @@
 /* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
 
 #include "ThreadDb.h"
+#include "AddressSpace.h"
 #include "GdbServer.h"
 #include "Task.h"
 #include "ThreadGroup.h"
@@ -167,7 +168,7 @@ rr::ThreadDb::~ThreadDb() {
   }
 }
 
-const std::set<std::string> rr::ThreadDb::get_symbols_and_clear_map(
+const std::set<std::string> rr::ThreadDb::get_unknown_symbols(
     ThreadGroup* thread_group) {
   // If we think the symbol locations might have changed, then we
   // probably need to recreate the handle.
@@ -177,21 +178,33 @@ const std::set<std::string> rr::ThreadDb::get_symbols_and_clear_map(
   }
 
   prochandle.thread_group = thread_group;
-  symbols.clear();
+  Task* t = thread_group->first_running_task();
+  current_vm = t ? t->vm()->uid() : AddressSpaceUid();
   load_library();
   prochandle.thread_group = nullptr;
-  return symbol_names;
+
+  const auto& known = symbols[current_vm];
+  std::set<std::string> result;
+  for (const auto& name : symbol_names) {
+    if (known.find(name) == known.end()) {
+      result.insert(name);
+    }
+  }
+  LOG(debug) << "get_unknown_symbols: " << known.size() << " known, "
+             << result.size() << " unknown";
+  return result;
 }
 
 void rr::ThreadDb::register_symbol(const std::string& name,
                                    remote_ptr<void> address) {
   LOG(debug) << "register_symbol " << name;
-  symbols[name] = address;
+  symbols[current_vm][name] = address;
 }
 
 bool rr::ThreadDb::query_symbol(const char* name, remote_ptr<void>* address) {
-  auto it = symbols.find(name);
-  if (it == symbols.end()) {
+  const auto& known = symbols[current_vm];
+  auto it = known.find(name);
+  if (it == known.end()) {
     return false;
   }
   *address = it->second;
@@ -7,6 +7,7 @@
 #include <map>
 #include <set>
 #include <string>
+#include "TaskishUid.h"
 
 extern "C" {
 #include <thread_db.h>
@@ -52,12 +53,12 @@ public:
   ~ThreadDb();
 
   /**
-   * Return a set of the names of all the symbols that might be needed
-   * by libthread_db.  Also clears the current mapping of symbol names
-   * to addresses.
+   * Return a set of the names of the symbols that might be needed by
+   * libthread_db and whose addresses in |thread_group|'s address space
+   * we don't know yet.  Addresses learned earlier for the same address
+   * space, e.g. before a restart, are kept.
    */
-  const std::set<std::string> get_symbols_and_clear_map(
-      ThreadGroup* thread_group);
+  const std::set<std::string> get_unknown_symbols(ThreadGroup* thread_group);
 
   /**
    * Note that the symbol |name| has the given address.
@@ -107,8 +108,11 @@ private:
   // Set of all symbol names.
   std::set<std::string> symbol_names;
 
-  // Map from symbol names to addresses.
-  std::map<std::string, remote_ptr<void>> symbols;
+  // The address space whose symbols we're currently using.
+  AddressSpaceUid current_vm;
+  // Map from address spaces to maps from symbol names to addresses.
+  // Replay is deterministic, so these stay valid across restarts.
+  std::map<AddressSpaceUid, std::map<std::string, remote_ptr<void>>> symbols;
 };
 
 } // namespace rr
@@ -0,0 +1,224 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "Command.h"
+#include "RecordTelemetry.h"
+#include "ScopedFd.h"
+#include "kernel_metadata.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+namespace rr {
+
+class TopCommand : public Command {
+public:
+  virtual int run(vector<string>& args) override;
+
+protected:
+  TopCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static TopCommand singleton;
+};
+
+TopCommand TopCommand::singleton(
+    "top",
+    " rr top [OPTION]... <PID>\n"
+    "  Show what the `rr record` process <PID> is spending its time on:\n"
+    "  ptrace stops per second by cause, unbuffered syscalls by number,\n"
+    "  syscallbuf flushes, scheduler switches, trace bytes per second and\n"
+    "  the backlog of trace data waiting to be compressed.\n"
+    "  -d, --delay=<MS>           update every <MS> milliseconds. Default 1000.\n"
+    "  -n, --iterations=<N>       exit after <N> updates. Default is to run\n"
+    "                             until the recording ends.\n"
+    "  -s, --syscalls=<N>         show the <N> most frequent unbuffered\n"
+    "                             syscalls. Default 10.\n");
+
+struct TopFlags {
+  int delay_ms;
+  int iterations;
+  int syscalls;
+
+  TopFlags() : delay_ms(1000), iterations(0), syscalls(10) {}
+};
+
+static bool parse_top_arg(vector<string>& args, TopFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = {
+    { 'd', "delay", HAS_PARAMETER },
+    { 'n', "iterations", HAS_PARAMETER },
+    { 's', "syscalls", HAS_PARAMETER },
+  };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'd':
+      if (!opt.verify_valid_int(10, 3600 * 1000)) {
+        return false;
+      }
+      flags.delay_ms = opt.int_value;
+      break;
+    case 'n':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.iterations = opt.int_value;
+      break;
+    case 's':
+      if (!opt.verify_valid_int(0, RecordTelemetryData::MAX_SYSCALLNO)) {
+        return false;
+      }
+      flags.syscalls = opt.int_value;
+      break;
+    default:
+      DEBUG_ASSERT(0 && "Unknown option");
+  }
+  return true;
+}
+
+static double rate(uint64_t now, uint64_t before, double seconds) {
+  return (now - before) / seconds;
+}
+
+static void print_update(const RecordTelemetryData& now,
+                         const RecordTelemetryData& before, double seconds,
+                         const TopFlags& flags) {
+  uint64_t stops = 0;
+  for (int i = 0; i < RecordTelemetryData::STOP_REASON_COUNT; ++i) {
+    stops += now.ptrace_stops[i] - before.ptrace_stops[i];
+  }
+  printf("ptrace stops/s %.0f:", stops / seconds);
+  for (int i = 0; i < RecordTelemetryData::STOP_REASON_COUNT; ++i) {
+    printf(" %s %.0f", RecordTelemetryData::stop_reason_name(i),
+           rate(now.ptrace_stops[i], before.ptrace_stops[i], seconds));
+  }
+  printf("\n");
+
+  vector<pair<uint64_t, int>> syscalls;
+  uint64_t unbuffered =
+      now.unbuffered_syscalls_other - before.unbuffered_syscalls_other;
+  for (int i = 0; i < RecordTelemetryData::MAX_SYSCALLNO; ++i) {
+    uint64_t count = now.unbuffered_syscalls[i] - before.unbuffered_syscalls[i];
+    if (count) {
+      syscalls.push_back(make_pair(count, i));
+      unbuffered += count;
+    }
+  }
+  sort(syscalls.begin(), syscalls.end(),
+       [](const pair<uint64_t, int>& a, const pair<uint64_t, int>& b) {
+         return a.first > b.first || (a.first == b.first && a.second < b.second);
+       });
+  printf("unbuffered syscalls/s %.0f:", unbuffered / seconds);
+  for (size_t i = 0; i < syscalls.size() && i < size_t(flags.syscalls); ++i) {
+    printf(" %s %.0f", syscall_name(syscalls[i].second, NativeArch::arch()).c_str(),
+           syscalls[i].first / seconds);
+  }
+  printf("\n");
+
+  printf("syscallbuf flushes/s %.0f\n",
+         rate(now.syscallbuf_flushes, before.syscallbuf_flushes, seconds));
+  printf("scheduler switches/s %.0f\n",
+         rate(now.scheduler_switches, before.scheduler_switches, seconds));
+  printf("trace MB/s %.2f, written %.2f; compression backlog %.2f MB\n",
+         rate(now.trace_bytes, before.trace_bytes, seconds) / (1024 * 1024),
+         rate(now.trace_bytes_written, before.trace_bytes_written, seconds) /
+             (1024 * 1024),
+         now.compression_backlog / (1024.0 * 1024));
+  fflush(stdout);
+}
+
+static bool is_alive(pid_t pid) {
+  return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static int top(pid_t pid, const TopFlags& flags) {
+  string path = RecordTelemetry::find_path(pid);
+  if (path.empty() || !is_alive(pid)) {
+    fprintf(stderr, "rr: No recording with pid %d\n", pid);
+    return 1;
+  }
+  ScopedFd fd(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (!fd.is_open()) {
+    fprintf(stderr, "rr: Can't open %s: %s\n", path.c_str(),
+            errno_name(errno).c_str());
+    return 1;
+  }
+  void* p = mmap(nullptr, sizeof(RecordTelemetryData), PROT_READ, MAP_SHARED,
+                 fd, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "rr: Can't map %s: %s\n", path.c_str(),
+            errno_name(errno).c_str());
+    return 1;
+  }
+  const RecordTelemetryData* shared = static_cast<RecordTelemetryData*>(p);
+  if (__atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) !=
+          RecordTelemetryData::MAGIC ||
+      shared->version != RecordTelemetryData::VERSION) {
+    fprintf(stderr, "rr: %s isn't telemetry from this version of rr\n",
+            path.c_str());
+    munmap(p, sizeof(RecordTelemetryData));
+    return 1;
+  }
+
+  bool clear_screen = isatty(STDOUT_FILENO);
+  RecordTelemetryData before;
+  RecordTelemetryData now;
+  RecordTelemetry::read(shared, &before);
+  double before_time = monotonic_now_sec();
+  for (int i = 0; !flags.iterations || i < flags.iterations; ++i) {
+    struct timespec ts = { flags.delay_ms / 1000,
+                           (flags.delay_ms % 1000) * 1000000L };
+    nanosleep(&ts, nullptr);
+    if (!is_alive(pid)) {
+      printf("Recording %d ended\n", pid);
+      break;
+    }
+    RecordTelemetry::read(shared, &now);
+    double now_time = monotonic_now_sec();
+    if (clear_screen) {
+      printf("\033[H\033[2J");
+    }
+    printf("rr record %d, last %.1fs\n", pid, now_time - before_time);
+    print_update(now, before, now_time - before_time, flags);
+    before = now;
+    before_time = now_time;
+  }
+  munmap(p, sizeof(RecordTelemetryData));
+  return 0;
+}
+
+int TopCommand::run(vector<string>& args) {
+  TopFlags flags;
+  while (parse_top_arg(args, flags)) {
+  }
+
+  if (args.size() != 1) {
+    print_help(stderr);
+    return 1;
+  }
+  char* end;
+  long pid = strtol(args[0].c_str(), &end, 10);
+  if (args[0].empty() || *end || pid <= 0 || pid > INT32_MAX) {
+    print_help(stderr);
+    return 1;
+  }
+  return top(pid, flags);
+}
+
+} // namespace rr
@@ -11,6 +11,7 @@
 #include <capnp/serialize-packed.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sched.h>
 #include <sys/file.h>
 #include <sys/utsname.h>
@@ -19,7 +20,9 @@
 #include <dirent.h>
 
 #include <algorithm>
+#include <deque>
 #include <fstream>
+#include <limits>
 #include <sstream>
 #include <string>
 
@@ -40,6 +43,8 @@
 
 #include "rr/rr.h"
 
+#include "../third-party/blake2/blake2.h"
+
 using namespace std;
 using namespace capnp;
 
@@ -58,23 +63,50 @@ namespace rr {
 struct SubstreamData {
   const char* name;
   size_t block_size;
+  // Initial number of compression threads
   int threads;
+  // The writer adds threads up to this many while it can't keep up
+  int max_threads;
+  CompressedWriter::Codec codec;
+  int level;
 };
 
 static SubstreamData substreams[TraceStream::SUBSTREAM_COUNT] = {
-  { "events", 1024 * 1024, 1 },
-  { "data", 1024 * 1024, 0 },
-  { "mmaps", 64 * 1024, 1 },
-  { "tasks", 64 * 1024, 1 },
+  { "events", 1024 * 1024, 1, 0, CompressedWriter::CODEC_BROTLI,
+    CompressedWriter::DEFAULT_LEVEL },
+  { "data", 1024 * 1024, 0, 0, CompressedWriter::CODEC_BROTLI,
+    CompressedWriter::DEFAULT_LEVEL },
+  { "mmaps", 64 * 1024, 1, 1, CompressedWriter::CODEC_BROTLI,
+    CompressedWriter::DEFAULT_LEVEL },
+  { "tasks", 64 * 1024, 1, 1, CompressedWriter::CODEC_BROTLI,
+    CompressedWriter::DEFAULT_LEVEL },
 };
 
 static const SubstreamData& substream(TraceStream::Substream s) {
   if (!substreams[TraceStream::RAW_DATA].threads) {
     substreams[TraceStream::RAW_DATA].threads = min(8, get_num_cpus());
+    substreams[TraceStream::RAW_DATA].max_threads = min(32, get_num_cpus());
+    substreams[TraceStream::EVENTS].max_threads = min(4, get_num_cpus());
   }
   return substreams[s];
 }
 
+static const uint32_t BLOCK_INDEX_MAGIC = 0x78646962; // "bidx"
+static const uint32_t TASK_INDEX_MAGIC = 0x78646974; // "tidx"
+static const uint32_t TICKS_INDEX_MAGIC = 0x7864696b; // "kidx"
+
+// Raw data records at least this large are hashed so that later identical
+// records can refer to them instead of being stored again.
+static const size_t MIN_DEDUP_RAW_DATA_SIZE = 4096;
+// Bound the memory used for the hashes.
+static const size_t MAX_DEDUP_RAW_DATA_HASHES = 1 << 20;
+
+struct BlockIndexHeader {
+  uint32_t magic;
+  // sizeof(BlockIndexEntry), so layout changes are detected
+  uint32_t entry_size;
+};
+
 static TraceStream::Substream operator++(TraceStream::Substream& s) {
   s = (TraceStream::Substream)(s + 1);
   return s;
@@ -152,17 +184,36 @@ string resolve_trace_name(const string& trace_name)
   return trace_name;
 }
 
-class CompressedWriterOutputStream : public kj::OutputStream {
+/**
+ * Packs messages straight into the CompressedWriter's buffer, instead of
+ * into a temporary buffer that then gets copied.
+ */
+class CompressedWriterOutputStream : public kj::BufferedOutputStream {
 public:
-  CompressedWriterOutputStream(CompressedWriter& writer) : writer(writer) {}
+  CompressedWriterOutputStream(CompressedWriter& writer)
+      : writer(writer), write_buffer(nullptr) {}
   virtual ~CompressedWriterOutputStream() {}
 
+  virtual kj::ArrayPtr<kj::byte> getWriteBuffer() {
+    size_t size;
+    write_buffer = writer.get_write_buffer(&size);
+    return kj::arrayPtr(write_buffer, size);
+  }
+
   virtual void write(const void* buffer, size_t size) {
-    writer.write(buffer, size);
+    if (buffer == write_buffer) {
+      // The data is already in place.
+      write_buffer = nullptr;
+      writer.commit_write(size);
+    } else {
+      write_buffer = nullptr;
+      writer.write(buffer, size);
+    }
   }
 
 private:
   CompressedWriter& writer;
+  uint8_t* write_buffer;
 };
 
 struct IOException {};
@@ -212,6 +263,10 @@ string TraceStream::path(Substream s) {
 
 size_t TraceStream::mmaps_block_size() { return substreams[MMAPS].block_size; }
 
+const char* TraceStream::substream_name(Substream s) {
+  return substreams[s].name;
+}
+
 bool TraceWriter::good() const {
   for (auto& w : writers) {
     if (!w->good()) {
@@ -401,14 +456,90 @@ static int check_fd(int fd) {
 // 8-byte words
 static const size_t reasonable_frame_message_words = 64;
 
+// Don't keep more than this many words of message scratch space around.
+static const size_t max_message_scratch_words = 64 * 1024;
+
+/**
+ * The first segment for a message builder: |scratch|, grown first to hold
+ * |*wanted| words. Once |scratch| fits the messages we write, building
+ * them doesn't touch the heap. MallocMessageBuilder zeroes the part it
+ * used again when it's destroyed, as a first segment must be zero.
+ */
+static kj::ArrayPtr<word> message_scratch_segment(vector<uint64_t>& scratch,
+                                                  size_t wanted) {
+  wanted = min(wanted, max_message_scratch_words);
+  if (scratch.size() < wanted) {
+    scratch.assign(wanted, 0);
+  }
+  return kj::arrayPtr(reinterpret_cast<word*>(scratch.data()), scratch.size());
+}
+
+/**
+ * Record how big |msg| got, so the next message_scratch_segment() can
+ * make room for it.
+ */
+static void note_message_size(MessageBuilder& msg, size_t* wanted) {
+  auto segments = msg.getSegmentsForOutput();
+  if (segments.size() > 1) {
+    size_t words = 0;
+    for (auto& segment : segments) {
+      words += segment.size();
+    }
+    *wanted = max(*wanted, words);
+  }
+}
+
+/**
+ * Store |size| bytes of |data| into |out|, XORed against |base| if we can.
+ * |base| is updated to |data|. Returns true if a delta was stored.
+ */
+static bool write_register_delta(Data::Builder out, vector<uint8_t>& base,
+                                 const uint8_t* data, size_t size) {
+  if (!size) {
+    return false;
+  }
+  bool delta = base.size() == size;
+  if (delta) {
+    for (size_t i = 0; i < size; ++i) {
+      out[i] = data[i] ^ base[i];
+    }
+    memcpy(base.data(), data, size);
+  } else {
+    memcpy(out.begin(), data, size);
+    base.assign(data, data + size);
+  }
+  return delta;
+}
+
+/**
+ * Reverse write_register_delta: update |base| with the register bytes
+ * stored in |data|.
+ */
+static void read_register_delta(vector<uint8_t>& base, Data::Reader data,
+                                bool delta) {
+  if (!data.size()) {
+    return;
+  }
+  if (!delta) {
+    base.assign(data.begin(), data.end());
+    return;
+  }
+  if (base.size() != data.size()) {
+    FATAL() << "Register delta without a matching earlier frame";
+  }
+  for (size_t i = 0; i < base.size(); ++i) {
+    base[i] ^= data[i];
+  }
+}
+
 void TraceWriter::write_frame(RecordTask* t, const Event& ev,
                               const Registers* registers,
                               const ExtraRegisters* extra_registers) {
   // Use an on-stack first segment that should be adequate for most cases. A
   // simple syscall event takes 320 bytes currently. The default Capnproto
   // implementation does a calloc(8192) for the first segment.
-  word buf[reasonable_frame_message_words] = {};
-  MallocMessageBuilder frame_msg(buf);
+  MallocMessageBuilder frame_msg(
+      message_scratch_segment(message_scratch, message_scratch_wanted));
   trace::Frame::Builder frame = frame_msg.initRoot<trace::Frame>();
 
   frame.setTid(t->tid);
@@ -427,17 +558,32 @@ void TraceWriter::write_frame(RecordTask* t, const Event& ev,
       holes[j].setOffset(r.holes[j].offset);
       holes[j].setSize(r.holes[j].size);
     }
+    if (r.is_ref) {
+      w.getSource().setEarlier(r.ref_pos);
+    }
   }
   raw_recs.clear();
   frame.setArch(to_trace_arch(t->arch()));
+  auto& delta_base = register_delta_bases[t->tid];
   if (registers) {
     // Avoid dynamic allocation and copy
     auto raw_regs = registers->get_regs_for_trace();
-    frame.initRegisters().setRaw(Data::Reader(raw_regs.data, raw_regs.size));
+    auto regs = frame.initRegisters();
+    if (write_register_delta(regs.initRaw(raw_regs.size), delta_base.regs,
+                             raw_regs.data, raw_regs.size)) {
+      regs.setDeltaFromPrevious(true);
+      wrote_register_deltas = true;
+    }
   }
   if (extra_registers) {
-    frame.initExtraRegisters().setRaw(Data::Reader(
-        extra_registers->data_bytes(), extra_registers->data_size()));
+    auto extra_regs = frame.initExtraRegisters();
+    if (write_register_delta(extra_regs.initRaw(extra_registers->data_size()),
+                             delta_base.extra_regs,
+                             extra_registers->data_bytes(),
+                             extra_registers->data_size())) {
+      extra_regs.setDeltaFromPrevious(true);
+      wrote_register_deltas = true;
+    }
   }
 
   auto event = frame.initEvent();
@@ -543,20 +689,181 @@ void TraceWriter::write_frame(RecordTask* t, const Event& ev,
     auto& events = writer(EVENTS);
     CompressedWriterOutputStream stream(events);
     writePackedMessage(stream, frame_msg);
+    note_message_size(frame_msg, &message_scratch_wanted);
   } catch (...) {
     FATAL() << "Unable to write events";
   }
 
+  task_index_block_tids.insert(t->tid);
+  update_ticks_index(t->tid, t->tick_count());
   tick_time();
+  if (update_block_index()) {
+    // Readers may seek to the new entry, so don't let anything after it
+    // depend on registers stored before it.
+    register_delta_bases.clear();
+    for (pid_t tid : task_index_block_tids) {
+      task_index.push_back({ task_index_block_start, tid, 0 });
+    }
+    task_index_block_tids.clear();
+    task_index_block_start = global_time;
+  }
+}
+
+bool TraceWriter::update_block_index() {
+  // Called after writing a frame, so the current positions are where the
+  // data for the frame at |global_time| starts.
+  BlockIndexEntry entry;
+  entry.time = global_time;
+  bool new_block = false;
+  for (int i = 0; i < BLOCK_INDEX_STREAMS; ++i) {
+    Substream s = block_index_substream(i);
+    uint64_t pos = writer(s).uncompressed_pos();
+    uint64_t last_pos =
+        block_index.empty() ? 0 : block_index.back().streams[i].skip;
+    size_t block_size = substream(s).block_size;
+    if (pos / block_size != last_pos / block_size) {
+      new_block = true;
+    }
+    entry.streams[i].block_offset = 0;
+    entry.streams[i].skip = pos;
+  }
+  if (new_block) {
+    block_index.push_back(entry);
+  }
+  return new_block;
+}
+
+void TraceWriter::write_block_index() {
+  vector<BlockIndexEntry> entries;
+  for (auto entry : block_index) {
+    bool valid = true;
+    for (int i = 0; i < BLOCK_INDEX_STREAMS; ++i) {
+      Substream s = block_index_substream(i);
+      size_t block_size = substream(s).block_size;
+      const vector<uint64_t>& offsets = writer(s).block_offsets();
+      uint64_t block = entry.streams[i].skip / block_size;
+      if (block >= offsets.size()) {
+        // Position is at the end of the stream, nothing to index.
+        valid = false;
+        break;
+      }
+      entry.streams[i].block_offset = offsets[block];
+      entry.streams[i].skip -= block * block_size;
+    }
+    if (valid) {
+      entries.push_back(entry);
+    }
+  }
+  block_index.clear();
+  if (entries.empty()) {
+    return;
+  }
+
+  string path = block_index_path();
+  if (!write_block_index_file(path, entries, CompressedWriter::DONT_SYNC)) {
+    LOG(warn) << "Unable to write " << path;
+  }
+}
+
+void TraceWriter::write_task_index() {
+  for (pid_t tid : task_index_block_tids) {
+    task_index.push_back({ task_index_block_start, tid, 0 });
+  }
+  task_index_block_tids.clear();
+  if (task_index.empty()) {
+    return;
+  }
+
+  string path = task_index_path();
+  ScopedFd fd(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0400);
+  BlockIndexHeader header = { TASK_INDEX_MAGIC, sizeof(TaskIndexEntry) };
+  ssize_t size = task_index.size() * sizeof(TaskIndexEntry);
+  if (!fd.is_open() ||
+      write(fd, &header, sizeof(header)) != sizeof(header) ||
+      write(fd, task_index.data(), size) != size) {
+    LOG(warn) << "Unable to write " << path;
+  }
+  task_index.clear();
+}
+
+void TraceWriter::update_ticks_index(pid_t tid, Ticks ticks) {
+  // Called with |global_time| the time of |tid|'s new frame.
+  auto it = ticks_index_tasks.find(tid);
+  if (it == ticks_index_tasks.end()) {
+    ticks_index.push_back({ global_time, ticks, tid, 0 });
+    ticks_index_tasks[tid] = { global_time, ticks, 0 };
+    return;
+  }
+  TicksIndexTask& task = it->second;
+  ++task.frames_since_entry;
+  if (ticks < task.last_ticks) {
+    if (task.frames_since_entry > 1) {
+      ticks_index.push_back({ task.last_time, task.last_ticks, tid, 0 });
+    }
+    task.frames_since_entry = TICKS_INDEX_INTERVAL;
+  }
+  if (task.frames_since_entry >= TICKS_INDEX_INTERVAL) {
+    ticks_index.push_back({ global_time, ticks, tid, 0 });
+    task.frames_since_entry = 0;
+  }
+  task.last_time = global_time;
+  task.last_ticks = ticks;
+}
+
+void TraceWriter::write_ticks_index() {
+  for (auto& it : ticks_index_tasks) {
+    if (it.second.frames_since_entry) {
+      ticks_index.push_back(
+          { it.second.last_time, it.second.last_ticks, it.first, 0 });
+    }
+  }
+  ticks_index_tasks.clear();
+  if (ticks_index.empty()) {
+    return;
+  }
+
+  string path = ticks_index_path();
+  ScopedFd fd(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0400);
+  BlockIndexHeader header = { TICKS_INDEX_MAGIC, sizeof(TicksIndexEntry) };
+  ssize_t size = ticks_index.size() * sizeof(TicksIndexEntry);
+  if (!fd.is_open() ||
+      write(fd, &header, sizeof(header)) != sizeof(header) ||
+      write(fd, ticks_index.data(), size) != size) {
+    LOG(warn) << "Unable to write " << path;
+  }
+  ticks_index.clear();
+}
+
+bool TraceStream::write_block_index_file(
+    const string& path, const vector<BlockIndexEntry>& entries,
+    CompressedWriter::Sync sync) {
+  // The file is read-only, so O_TRUNC alone won't do.
+  unlink(path.c_str());
+  ScopedFd fd(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0400);
+  if (!fd.is_open()) {
+    return false;
+  }
+  BlockIndexHeader header = { BLOCK_INDEX_MAGIC, sizeof(BlockIndexEntry) };
+  ssize_t size = entries.size() * sizeof(BlockIndexEntry);
+  if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+      write(fd, entries.data(), size) != size) {
+    return false;
+  }
+  return sync == CompressedWriter::DONT_SYNC || fsync(fd) == 0;
 }
 
 TraceFrame TraceReader::read_frame(FrameTime skip_before) {
+  TraceFrame ret;
+  read_frame(ret, skip_before);
+  return ret;
+}
+
+void TraceReader::read_frame(TraceFrame& ret, FrameTime skip_before) {
   auto& events = reader(EVENTS);
   word buf[reasonable_frame_message_words];
   CompressedReaderInputStream stream(events);
   PackedMessageReader frame_msg(stream, ReaderOptions(), buf);
   tick_time();
-  TraceFrame ret;
   ret.global_time = time();
 
   trace::Frame::Reader frame = frame_msg.getRoot<trace::Frame>();
@@ -566,18 +873,33 @@ TraceFrame TraceReader::read_frame(FrameTime skip_before) {
   for (size_t i = 0; i < raw_recs.size(); ++i) {
     // Build list in reverse order so we can efficiently pull records from it
     auto w = mem_writes[raw_recs.size() - 1 - i];
+    auto& r = raw_recs[i];
     auto holes = w.getHoles();
-    vector<WriteHole> h;
-    h.resize(holes.size());
-    for (size_t j = 0; j < h.size(); ++j) {
+    // Fill in place so the holes vector's storage gets reused.
+    r.holes.resize(holes.size());
+    for (size_t j = 0; j < r.holes.size(); ++j) {
       const auto& hole = holes[j];
-      h[j] = { hole.getOffset(), hole.getSize() };
+      r.holes[j] = { hole.getOffset(), hole.getSize() };
     }
-    raw_recs[i] = { w.getAddr(), (size_t)w.getSize(), i32_to_tid(w.getTid()), h };
-  }
+    auto src = w.getSource();
+    r.addr = w.getAddr();
+    r.size = w.getSize();
+    r.rec_tid = i32_to_tid(w.getTid());
+    r.is_ref = src.isEarlier();
+    r.ref_pos = r.is_ref ? src.getEarlier() : 0;
+  }
+
+  // Keep the delta bases up to date even for frames we skip.
+  auto& delta_base = register_delta_bases[i32_to_tid(frame.getTid())];
+  auto regs = frame.getRegisters();
+  read_register_delta(delta_base.regs, regs.getRaw(),
+                      regs.getDeltaFromPrevious());
+  auto extra_regs = frame.getExtraRegisters();
+  read_register_delta(delta_base.extra_regs, extra_regs.getRaw(),
+                      extra_regs.getDeltaFromPrevious());
 
   if (ret.global_time < skip_before) {
-    return ret;
+    return;
   }
 
   ret.tid_ = i32_to_tid(frame.getTid());
@@ -588,14 +910,13 @@ TraceFrame TraceReader::read_frame(FrameTime skip_before) {
   monotonic_time_ = ret.monotonic_time_ = frame.getMonotonicSec();
 
   SupportedArch arch = from_trace_arch(frame.getArch());
-  ret.recorded_regs.set_arch(arch);
-  auto reg_data = frame.getRegisters().getRaw();
-  if (reg_data.size()) {
-    ret.recorded_regs.set_from_trace(arch, reg_data.begin(),
-                                     reg_data.size());
-  }
-  auto extra_reg_data = frame.getExtraRegisters().getRaw();
-  if (extra_reg_data.size()) {
+  // Registers has no heap storage, so just start from a clean value.
+  ret.recorded_regs = Registers(arch);
+  if (regs.getRaw().size()) {
+    ret.recorded_regs.set_from_trace(arch, delta_base.regs.data(),
+                                     delta_base.regs.size());
+  }
+  if (extra_regs.getRaw().size()) {
     ExtraRegisters::Format fmt;
     switch (arch) {
       default:
@@ -610,13 +931,13 @@ TraceFrame TraceReader::read_frame(FrameTime skip_before) {
         break;
     }
     bool ok = ret.recorded_extra_regs.set_to_raw_data(
-        arch, fmt, extra_reg_data.begin(),
-        extra_reg_data.size(), xsave_layout_from_trace(cpuid_records()));
+        arch, fmt, delta_base.extra_regs.data(), delta_base.extra_regs.size(),
+        *xsave_layout_);
     if (!ok) {
       FATAL() << "Invalid extended register data in trace";
     }
   } else {
-    ret.recorded_extra_regs = ExtraRegisters(arch);
+    ret.recorded_extra_regs.clear(arch);
   }
 
   auto event = frame.getEvent();
@@ -750,11 +1071,11 @@ TraceFrame TraceReader::read_frame(FrameTime skip_before) {
       break;
   }
 
-  return ret;
 }
 
 void TraceWriter::write_task_event(const TraceTaskEvent& event) {
-  MallocMessageBuilder task_msg;
+  MallocMessageBuilder task_msg(
+      message_scratch_segment(message_scratch, message_scratch_wanted));
   trace::TaskEvent::Builder task = task_msg.initRoot<trace::TaskEvent>();
   task.setFrameTime(global_time);
   task.setTid(event.tid());
@@ -795,6 +1116,7 @@ void TraceWriter::write_task_event(const TraceTaskEvent& event) {
     auto& tasks = writer(TASKS);
     CompressedWriterOutputStream stream(tasks);
     writePackedMessage(stream, task_msg);
+    note_message_size(task_msg, &message_scratch_wanted);
   } catch (...) {
     FATAL() << "Unable to write tasks";
   }
@@ -912,6 +1234,57 @@ bool TraceWriter::try_clone_file(RecordTask* t,
   return true;
 }
 
+struct BackgroundFileCopy {
+  BackgroundFileCopy() : ok(false), changed(false) {}
+  ScopedFd src;
+  ScopedFd dest;
+  struct stat src_stat;
+  string access_file_name;
+  string dest_path;
+  // Store object to link the finished copy into, if any.
+  string object_path;
+  string object;
+  bool ok;
+  bool changed;
+};
+
+// Background copies run on at most this many threads; the rest queue up.
+static const size_t MAX_BACKGROUND_COPY_THREADS = 4;
+
+struct BackgroundCopyPool {
+  BackgroundCopyPool() : idle_threads(0), stopping(false) {
+    pthread_mutex_init(&lock, nullptr);
+    pthread_cond_init(&cond, nullptr);
+  }
+  ~BackgroundCopyPool() {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  deque<BackgroundFileCopy*> queue;
+  vector<pthread_t> threads;
+  // Threads waiting for a copy to run
+  size_t idle_threads;
+  bool stopping;
+};
+
+static void run_file_copy(BackgroundFileCopy* copy) {
+  // Don't use log.h macros here since they're not necessarily thread-safe
+  copy->ok = rr::copy_file(copy->dest, copy->src) && fsync(copy->dest) == 0;
+  struct stat st;
+  copy->changed = fstat(copy->src, &st) < 0 ||
+      st.st_size != copy->src_stat.st_size ||
+      st.st_mtim.tv_sec != copy->src_stat.st_mtim.tv_sec ||
+      st.st_mtim.tv_nsec != copy->src_stat.st_mtim.tv_nsec;
+  if (copy->ok && !copy->changed && !copy->object_path.empty() &&
+      link(copy->dest_path.c_str(), copy->object_path.c_str()) < 0) {
+    copy->object.clear();
+  }
+  copy->src.close();
+  copy->dest.close();
+}
+
 bool TraceWriter::copy_file(const std::string& real_file_name,
                             const std::string& access_file_name,
                             std::string* new_name) {
@@ -927,14 +1300,174 @@ bool TraceWriter::copy_file(const std::string& real_file_name,
     return false;
   }
   string dest_path = dir() + "/" + path;
+
+  string object;
+  struct stat src_stat;
+  if (fstat(src, &src_stat) < 0) {
+    return false;
+  }
+  if (!file_store_dir.empty()) {
+    char key[128];
+    sprintf(key, "index/%llx-%llx-%llx-%lld.%ld",
+            (long long)src_stat.st_dev, (long long)src_stat.st_ino,
+            (long long)src_stat.st_size, (long long)src_stat.st_mtim.tv_sec,
+            (long)src_stat.st_mtim.tv_nsec);
+    object = key;
+    string object_path = file_store_dir + "/" + object;
+    if (link(object_path.c_str(), dest_path.c_str()) == 0) {
+      LOG(debug) << "Linked " << access_file_name << " from " << object_path;
+      record_file_store_object(object);
+      *new_name = path;
+      return true;
+    }
+  }
+
   ScopedFd dest(dest_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0700);
   if (!dest.is_open()) {
     return false;
   }
 
+  auto copy = make_shared<BackgroundFileCopy>();
+  copy->src = std::move(src);
+  copy->dest = std::move(dest);
+  copy->src_stat = src_stat;
+  copy->access_file_name = access_file_name;
+  copy->dest_path = dest_path;
+  if (!object.empty()) {
+    copy->object_path = file_store_dir + "/" + object;
+    copy->object = object;
+  }
+
+  // Copying a big file can take a long time and every tracee is stopped
+  // while we handle its mmap, so copy in the background. A copy racing
+  // writes to the file would put torn data in the trace, though, so files
+  // we can write (our approximation of whether tracees can, as in
+  // should_copy_mmap_region) are copied now while the tracees are stopped.
+  if (access(access_file_name.c_str(), W_OK) == 0 ||
+      !start_background_copy(copy.get())) {
+    run_file_copy(copy.get());
+    if (!copy->ok) {
+      unlink(dest_path.c_str());
+      return false;
+    }
+    if (!copy->object.empty()) {
+      record_file_store_object(copy->object);
+    }
+    *new_name = path;
+    return true;
+  }
+  // The trace isn't complete until close() has waited for all copies.
+  background_copies.push_back(std::move(copy));
   *new_name = path;
+  return true;
+}
 
-  return rr::copy_file(dest, src);
+bool TraceWriter::start_background_copy(BackgroundFileCopy* copy) {
+  if (!background_copy_pool) {
+    background_copy_pool = make_shared<BackgroundCopyPool>();
+  }
+  BackgroundCopyPool& pool = *background_copy_pool;
+  pthread_mutex_lock(&pool.lock);
+  if (pool.threads.size() < MAX_BACKGROUND_COPY_THREADS &&
+      pool.idle_threads <= pool.queue.size()) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (has_helper_thread_affinity) {
+      pthread_attr_setaffinity_np(&attr, sizeof(helper_thread_affinity),
+                                  &helper_thread_affinity);
+    }
+    pthread_t thread;
+    int err = pthread_create(&thread, &attr, background_copy_thread, &pool);
+    pthread_attr_destroy(&attr);
+    if (err) {
+      LOG(debug) << "Can't start copy thread: " << errno_name(err);
+    } else {
+      pool.threads.push_back(thread);
+    }
+  }
+  bool started = !pool.threads.empty();
+  if (started) {
+    pool.queue.push_back(copy);
+    pthread_cond_signal(&pool.cond);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return started;
+}
+
+void TraceWriter::set_helper_thread_affinity(const cpu_set_t& cpus) {
+  has_helper_thread_affinity = true;
+  helper_thread_affinity = cpus;
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    writers[s]->set_thread_affinity(cpus);
+  }
+}
+
+/*static*/ void* TraceWriter::background_copy_thread(void* p) {
+  auto pool = static_cast<BackgroundCopyPool*>(p);
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    if (pool->queue.empty()) {
+      if (pool->stopping) {
+        break;
+      }
+      ++pool->idle_threads;
+      pthread_cond_wait(&pool->cond, &pool->lock);
+      --pool->idle_threads;
+      continue;
+    }
+    BackgroundFileCopy* copy = pool->queue.front();
+    pool->queue.pop_front();
+    pthread_mutex_unlock(&pool->lock);
+    run_file_copy(copy);
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return nullptr;
+}
+
+void TraceWriter::finish_background_copies() {
+  if (background_copy_pool) {
+    BackgroundCopyPool& pool = *background_copy_pool;
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = true;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    for (pthread_t thread : pool.threads) {
+      pthread_join(thread, nullptr);
+    }
+    background_copy_pool = nullptr;
+  }
+  for (auto& copy : background_copies) {
+    if (!copy->ok) {
+      FATAL() << "Failed to copy " << copy->access_file_name << " to "
+              << copy->dest_path;
+    }
+    if (copy->changed) {
+      FATAL() << copy->access_file_name
+              << " changed while being copied into the trace; the copy "
+                 "may be torn and replay would diverge";
+    }
+    if (!copy->object.empty()) {
+      record_file_store_object(copy->object);
+    }
+  }
+  background_copies.clear();
+}
+
+// Objects are listed in the same "pack_store" file `rr pack --store` writes,
+// so `rr rm` releases them.
+void TraceWriter::record_file_store_object(const string& object) {
+  string path = dir() + "/pack_store";
+  bool is_new = access(path.c_str(), F_OK) != 0;
+  FILE* f = fopen(path.c_str(), "a");
+  if (!f) {
+    FATAL() << "Can't open " << path;
+  }
+  if (is_new) {
+    fprintf(f, "%s\n", file_store_dir.c_str());
+  }
+  fprintf(f, "%s\n", object.c_str());
+  fclose(f);
 }
 
 static bool starts_with(const string& s, const string& with) {
@@ -946,7 +1479,8 @@ TraceWriter::RecordInTrace TraceWriter::write_mapped_region(
     const struct stat& stat, const std::string &file_name,
     const vector<TraceRemoteFd>& extra_fds, MappingOrigin origin,
     bool skip_monitoring_mapped_fd) {
-  MallocMessageBuilder map_msg;
+  MallocMessageBuilder map_msg(
+      message_scratch_segment(message_scratch, message_scratch_wanted));
   trace::MMap::Builder map = map_msg.initRoot<trace::MMap>();
   map.setFrameTime(global_time);
   map.setStart(km.start().as_int());
@@ -1060,6 +1594,7 @@ TraceWriter::RecordInTrace TraceWriter::write_mapped_region(
     auto& mmaps = writer(MMAPS);
     CompressedWriterOutputStream stream(mmaps);
     writePackedMessage(stream, map_msg);
+    note_message_size(map_msg, &message_scratch_wanted);
   } catch (...) {
     FATAL() << "Unable to write mmaps";
   }
@@ -1236,6 +1771,26 @@ void TraceWriter::write_raw_header(pid_t rec_tid, size_t total_len,
   raw_recs.push_back({ addr, total_len, rec_tid, holes });
 }
 
+void TraceWriter::write_raw(pid_t rec_tid, const void* d, size_t len,
+                            remote_ptr<void> addr) {
+  if (len >= MIN_DEDUP_RAW_DATA_SIZE) {
+    RawDataHash hash;
+    blake2b(hash.bytes, sizeof(hash.bytes), d, len, nullptr, 0);
+    auto it = raw_data_hashes.find(hash);
+    if (it != raw_data_hashes.end()) {
+      raw_recs.push_back(
+          { addr, len, rec_tid, vector<WriteHole>(), true, it->second });
+      wrote_raw_data_refs = true;
+      return;
+    }
+    if (raw_data_hashes.size() < MAX_DEDUP_RAW_DATA_HASHES) {
+      raw_data_hashes[hash] = writer(RAW_DATA).uncompressed_pos();
+    }
+  }
+  write_raw_data(d, len);
+  write_raw_header(rec_tid, len, addr, vector<WriteHole>());
+}
+
 void TraceWriter::write_raw_data(const void* d, size_t len) {
   auto& data = writer(RAW_DATA);
   data.write(d, len);
@@ -1250,6 +1805,7 @@ bool TraceReader::read_raw_data_for_frame(RawData& d) {
   d.addr = rec.addr;
 
   d.data.resize(rec.size);
+  CompressedReader& data_reader = raw_data_reader(rec);
   auto hole_iter = rec.holes.begin();
   uintptr_t offset = 0;
   while (offset < d.data.size()) {
@@ -1263,7 +1819,7 @@ bool TraceReader::read_raw_data_for_frame(RawData& d) {
       }
       end = hole_iter->offset;
     }
-    reader(RAW_DATA).read((char*)d.data.data() + offset, end - offset);
+    data_reader.read((char*)d.data.data() + offset, end - offset);
     offset = end;
   }
 
@@ -1283,8 +1839,8 @@ bool TraceReader::read_raw_data_for_frame_with_holes(RawDataWithHoles& d) {
   for (auto& h : d.holes) {
     data_size -= h.size;
   }
-  d.data.resize(data_size);
-  reader(RAW_DATA).read((char*)d.data.data(), data_size);
+  d.data.clear();
+  raw_data_reader(rec).read_spans(data_size, &d.data);
 
   raw_recs.pop_back();
   return true;
@@ -1299,11 +1855,35 @@ bool TraceReader::read_raw_data_metadata_for_frame(RawDataMetadata& d) {
   for (auto& h : d.holes) {
     data_size -= h.size;
   }
-  reader(RAW_DATA).skip(data_size);
+  if (!d.is_ref) {
+    reader(RAW_DATA).skip(data_size);
+  }
   raw_recs.pop_back();
   return true;
 }
 
+CompressedReader& TraceReader::raw_data_reader(const RawDataMetadata& rec) {
+  if (!rec.is_ref) {
+    return reader(RAW_DATA);
+  }
+  if (!raw_data_block_offsets) {
+    raw_data_block_offsets =
+        make_shared<const vector<uint64_t>>(reader(RAW_DATA).block_offsets());
+  }
+  if (!raw_data_ref_reader) {
+    raw_data_ref_reader =
+        unique_ptr<CompressedReader>(new CompressedReader(path(RAW_DATA)));
+  }
+  size_t block_size = substream(RAW_DATA).block_size;
+  uint64_t block = rec.ref_pos / block_size;
+  if (block >= raw_data_block_offsets->size()) {
+    FATAL() << "Invalid raw data reference " << rec.ref_pos;
+  }
+  raw_data_ref_reader->seek((*raw_data_block_offsets)[block],
+                            rec.ref_pos % block_size);
+  return *raw_data_ref_reader;
+}
+
 static string make_trace_dir(const string& exe_path, const string& output_trace_dir) {
   if (!output_trace_dir.empty()) {
     // save trace dir in given output trace dir with option -o
@@ -1347,6 +1927,133 @@ static string make_trace_dir(const string& exe_path, const string& output_trace_
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
 
+static bool parse_codec_and_level(const string& spec,
+                                  CompressedWriter::Codec* codec, int* level) {
+  size_t colon = spec.find(':');
+  if (!CompressedWriter::parse_codec(spec.substr(0, colon), codec)) {
+    return false;
+  }
+  *level = CompressedWriter::DEFAULT_LEVEL;
+  if (colon != string::npos) {
+    char* end;
+    string level_str = spec.substr(colon + 1);
+    long v = strtol(level_str.c_str(), &end, 10);
+    if (level_str.empty() || *end || v < 0 || v > INT32_MAX) {
+      return false;
+    }
+    *level = (int)v;
+  }
+  return CompressedWriter::valid_level(*codec, *level);
+}
+
+static string upload_destination;
+
+void TraceWriter::set_upload_destination(const string& dest) {
+  upload_destination = dest;
+}
+
+static uint64_t max_buffer_memory;
+
+void TraceWriter::set_max_buffer_memory(uint64_t bytes) {
+  max_buffer_memory = bytes;
+}
+
+// A writer with N blocks of buffer runs at most N - 1 compression threads,
+// each holding an output buffer of about 1.1 blocks.
+static double blocks_used_by_writer(uint32_t buffer_blocks) {
+  return 2.1 * buffer_blocks - 1.1;
+}
+
+// CompressedWriter needs at least this many blocks of buffer.
+static const uint32_t MIN_WRITER_BUFFER_BLOCKS = 2;
+
+uint64_t TraceWriter::min_buffer_memory() {
+  double bytes = 0;
+  for (int s = 0; s < TraceStream::SUBSTREAM_COUNT; ++s) {
+    bytes += substreams[s].block_size *
+             blocks_used_by_writer(MIN_WRITER_BUFFER_BLOCKS);
+  }
+  return (uint64_t)bytes + 1;
+}
+
+/**
+ * Number of blocks of buffer to give each substream's writer to stay within
+ * |max_buffer_memory|, or 0 everywhere if the default buffers fit. Every
+ * writer first gets its minimum; what's left of the budget is split in
+ * proportion to the default buffer sizes. The budget must be at least
+ * min_buffer_memory().
+ */
+static void buffer_blocks_for_budget(
+    uint32_t blocks[TraceStream::SUBSTREAM_COUNT]) {
+  uint64_t total = 0;
+  uint64_t sizes[TraceStream::SUBSTREAM_COUNT];
+  for (int s = 0; s < TraceStream::SUBSTREAM_COUNT; ++s) {
+    const SubstreamData& data = substream((TraceStream::Substream)s);
+    uint32_t threads = max(data.threads, data.max_threads);
+    sizes[s] = data.block_size * (threads + 2 + threads * 1.1);
+    total += sizes[s];
+    blocks[s] = 0;
+  }
+  if (!max_buffer_memory || total <= max_buffer_memory) {
+    return;
+  }
+  uint64_t min_memory = TraceWriter::min_buffer_memory();
+  DEBUG_ASSERT(max_buffer_memory >= min_memory);
+  double spare = (double)(max_buffer_memory - min_memory);
+  for (int s = 0; s < TraceStream::SUBSTREAM_COUNT; ++s) {
+    double allowed = blocks_used_by_writer(MIN_WRITER_BUFFER_BLOCKS) +
+        spare * sizes[s] / total /
+            substream((TraceStream::Substream)s).block_size;
+    blocks[s] = max<uint32_t>(MIN_WRITER_BUFFER_BLOCKS,
+                              (uint32_t)((allowed + 1.1) / 2.1));
+  }
+}
+
+bool TraceWriter::set_compression(const string& spec) {
+  SubstreamData parsed[SUBSTREAM_COUNT];
+  memcpy(parsed, substreams, sizeof(parsed));
+  if (spec.find('=') == string::npos) {
+    CompressedWriter::Codec codec;
+    int level;
+    if (!parse_codec_and_level(spec, &codec, &level)) {
+      return false;
+    }
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      parsed[s].codec = codec;
+      parsed[s].level = level;
+    }
+  } else {
+    size_t pos = 0;
+    while (pos <= spec.size()) {
+      size_t comma = spec.find(',', pos);
+      string item = spec.substr(pos, comma == string::npos ? string::npos
+                                                           : comma - pos);
+      size_t eq = item.find('=');
+      if (eq == string::npos) {
+        return false;
+      }
+      string name = item.substr(0, eq);
+      Substream s = SUBSTREAM_FIRST;
+      for (; s < SUBSTREAM_COUNT; ++s) {
+        if (name == substreams[s].name) {
+          break;
+        }
+      }
+      if (s == SUBSTREAM_COUNT ||
+          !parse_codec_and_level(item.substr(eq + 1), &parsed[s].codec,
+                                 &parsed[s].level)) {
+        return false;
+      }
+      if (comma == string::npos) {
+        break;
+      }
+      pos = comma + 1;
+    }
+  }
+  memcpy(substreams, parsed, sizeof(parsed));
+  return true;
+}
+
 TraceWriter::TraceWriter(const std::string& file_name,
                          const string& output_trace_dir,
                          TicksSemantics ticks_semantics_)
@@ -1354,6 +2061,11 @@ TraceWriter::TraceWriter(const std::string& file_name,
                   // Somewhat arbitrarily start the
                   // global time from 1.
                   1),
+      message_scratch_wanted(reasonable_frame_message_words),
+      wrote_raw_data_refs(false),
+      wrote_register_deltas(false),
+      wrote_syscallbuf_resize(false),
+      task_index_block_start(1),
       ticks_semantics_(ticks_semantics_),
       mmap_count(0),
       has_cpuid_faulting_(false),
@@ -1361,13 +2073,29 @@ TraceWriter::TraceWriter(const std::string& file_name,
       fdp_exception_only_quirk_(false),
       clear_fip_fdp_(false),
       supports_file_data_cloning_(false),
+      has_helper_thread_affinity(false),
       chaos_mode(false)
        {
   this->ticks_semantics_ = ticks_semantics_;
 
+  uint32_t buffer_blocks[SUBSTREAM_COUNT];
+  buffer_blocks_for_budget(buffer_blocks);
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
     writers[s] = unique_ptr<CompressedWriter>(new CompressedWriter(
-        path(s), substream(s).block_size, substream(s).threads));
+        path(s), substream(s).block_size, substream(s).threads,
+        substream(s).codec, substream(s).level, substream(s).max_threads,
+        buffer_blocks[s]));
+    if (s != RAW_DATA) {
+      // These are streams of small, similar records.
+      writers[s]->enable_dictionary();
+    }
+  }
+  if (!upload_destination.empty()) {
+    uploader = unique_ptr<TraceUploader>(
+        new TraceUploader(trace_dir, upload_destination));
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      writers[s]->set_uploader(uploader.get(), substream(s).name);
+    }
   }
 
   string ver_path = incomplete_version_path();
@@ -1386,7 +2114,9 @@ TraceWriter::TraceWriter(const std::string& file_name,
     FATAL() << "Unable to write " << ver_path;
   }
 
-  // Test if file data cloning is supported
+  // Test if file data cloning is supported. BTRFS_IOC_CLONE_RANGE is
+  // FICLONERANGE, so this works on any filesystem with reflinks (btrfs,
+  // XFS, bcachefs, ...).
   string version_clone_path = trace_dir + "/tmp_clone";
   ScopedFd version_clone_fd(version_clone_path.c_str(), O_WRONLY | O_CREAT,
                             0600);
@@ -1425,10 +2155,29 @@ void TraceWriter::setup_cpuid_records(bool has_cpuid_faulting,
   }
 }
 
+// The forward compatibility version needed to decode blocks of the codecs
+// in |codecs| (bit 1 << codec for each). Each
+// NO_*_FORWARD_COMPATIBILITY_VERSION is the last version without a feature,
+// so a trace using the feature needs the version after it.
+static int codecs_required_version(uint32_t codecs) {
+  if (codecs & (1u << CompressedWriter::CODEC_ZSTD_DICT)) {
+    return NO_ZSTD_DICTIONARY_FORWARD_COMPATIBILITY_VERSION + 1;
+  }
+  if (codecs & ((1u << CompressedWriter::CODEC_ZSTD) |
+                (1u << CompressedWriter::CODEC_NONE))) {
+    return BROTLI_ONLY_FORWARD_COMPATIBILITY_VERSION + 1;
+  }
+  return BROTLI_ONLY_FORWARD_COMPATIBILITY_VERSION;
+}
+
 void TraceWriter::close(CloseStatus status, const TraceUuid* uuid) {
+  finish_background_copies();
   for (auto& w : writers) {
     w->close();
   }
+  write_block_index();
+  write_task_index();
+  write_ticks_index();
 
   MallocMessageBuilder header_msg;
   trace::Header::Builder header = header_msg.initRoot<trace::Header>();
@@ -1436,7 +2185,41 @@ void TraceWriter::close(CloseStatus status, const TraceUuid* uuid) {
   header.setTicksSemantics(
     to_trace_ticks_semantics(PerfCounters::default_ticks_semantics()));
   header.setSyscallbufProtocolVersion(SYSCALLBUF_PROTOCOL_VERSION);
-  header.setRequiredForwardCompatibilityVersion(FORWARD_COMPATIBILITY_VERSION);
+  // Go by the blocks actually written, not the writers' settings: a
+  // brotli writer can store blocks uncompressed, and a writer that never
+  // got past its first block wrote no dictionary blocks.
+  uint32_t codecs = 0;
+  for (auto& w : writers) {
+    for (int c = 0; c < CompressedWriter::CODEC_COUNT; ++c) {
+      if (w->wrote_codec((CompressedWriter::Codec)c)) {
+        codecs |= 1u << c;
+      }
+    }
+  }
+  // As in codecs_required_version(), a feature needs the version after
+  // its NO_*_FORWARD_COMPATIBILITY_VERSION.
+  int required_version = codecs_required_version(codecs);
+  if (wrote_raw_data_refs) {
+    required_version = max(required_version,
+                           NO_RAW_DATA_REFS_FORWARD_COMPATIBILITY_VERSION + 1);
+  }
+  if (wrote_register_deltas) {
+    required_version =
+        max(required_version,
+            NO_REGISTER_DELTAS_FORWARD_COMPATIBILITY_VERSION + 1);
+  }
+  if (wrote_syscallbuf_resize) {
+    required_version =
+        max(required_version,
+            NO_SYSCALLBUF_RESIZE_FORWARD_COMPATIBILITY_VERSION + 1);
+  }
+  header.setRequiredForwardCompatibilityVersion(required_version);
+  auto compression = header.initSubstreamCompression(SUBSTREAM_COUNT);
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    compression[s].setCodec(writers[s]->codec());
+    compression[s].setLevel(writers[s]->level());
+    compression[s].setDictionary(writers[s]->dictionary_enabled());
+  }
   header.setPreloadThreadLocalsRecorded(true);
   header.setRrcallBase(syscall_number_for_rrcall_init_preload(x86_64));
   header.setSyscallbufFdsDisabledSize(SYSCALLBUF_FDS_DISABLED_SIZE);
@@ -1508,6 +2291,21 @@ void TraceWriter::close(CloseStatus status, const TraceUuid* uuid) {
     FATAL() << "Unable to create version file " << path;
   }
   version_fd.close();
+
+  if (uploader) {
+    // Everything else, with the version file last so the receiver can't
+    // see a complete-looking trace that's missing data.
+    uploader->finish("version");
+    if (uploader->local_copy_damaged()) {
+      // Make TraceReader refuse the trace rather than hit the holes.
+      string path = upload_failed_path();
+      ScopedFd marker(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+      if (!marker.is_open()) {
+        LOG(warn) << "Can't create " << path;
+      }
+    }
+    uploader = nullptr;
+  }
 }
 
 void TraceWriter::make_latest_trace() {
@@ -1537,6 +2335,9 @@ TraceFrame TraceReader::peek_frame() {
   events.save_state();
   auto saved_time = global_time;
   auto saved_raw_recs = raw_recs;
+  // Reading the frame replaces its task's delta base, and the frame must
+  // decode against the old one when it's read for real.
+  auto saved_register_delta_bases = register_delta_bases;
   TraceFrame frame;
   if (!at_end()) {
     frame = read_frame();
@@ -1544,6 +2345,7 @@ TraceFrame TraceReader::peek_frame() {
   events.restore_state();
   global_time = saved_time;
   raw_recs = saved_raw_recs;
+  register_delta_bases = std::move(saved_register_delta_bases);
   return frame;
 }
 
@@ -1552,14 +2354,441 @@ void TraceReader::rewind() {
     reader(s).rewind();
   }
   global_time = 0;
+  register_delta_bases.clear();
   DEBUG_ASSERT(good());
 }
 
+void TraceReader::load_block_index() {
+  if (block_index_) {
+    return;
+  }
+  auto entries = make_shared<vector<BlockIndexEntry>>();
+  block_index_ = entries;
+
+  string path = block_index_path();
+  ScopedFd fd(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (!fd.is_open() || fstat(fd, &st) < 0) {
+    return;
+  }
+  BlockIndexHeader header;
+  if (read_to_end(fd, 0, &header, sizeof(header)) != sizeof(header) ||
+      header.magic != BLOCK_INDEX_MAGIC ||
+      header.entry_size != sizeof(BlockIndexEntry)) {
+    LOG(warn) << "Ignoring invalid block index " << path;
+    return;
+  }
+  size_t count = (st.st_size - sizeof(header)) / sizeof(BlockIndexEntry);
+  entries->resize(count);
+  ssize_t size = count * sizeof(BlockIndexEntry);
+  if (read_to_end(fd, sizeof(header), entries->data(), size) != size) {
+    LOG(warn) << "Ignoring truncated block index " << path;
+    entries->clear();
+  }
+}
+
+void TraceReader::load_task_index() {
+  if (task_index_) {
+    return;
+  }
+  auto index = make_shared<map<pid_t, vector<FrameTime>>>();
+  task_index_ = index;
+
+  string path = task_index_path();
+  ScopedFd fd(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (!fd.is_open() || fstat(fd, &st) < 0) {
+    return;
+  }
+  BlockIndexHeader header;
+  if (read_to_end(fd, 0, &header, sizeof(header)) != sizeof(header) ||
+      header.magic != TASK_INDEX_MAGIC ||
+      header.entry_size != sizeof(TaskIndexEntry)) {
+    LOG(warn) << "Ignoring invalid task index " << path;
+    return;
+  }
+  size_t count = (st.st_size - sizeof(header)) / sizeof(TaskIndexEntry);
+  vector<TaskIndexEntry> entries(count);
+  ssize_t size = count * sizeof(TaskIndexEntry);
+  if (read_to_end(fd, sizeof(header), entries.data(), size) != size) {
+    LOG(warn) << "Ignoring truncated task index " << path;
+    return;
+  }
+  // Entries were written in block order.
+  for (auto& e : entries) {
+    (*index)[e.tid].push_back(e.block_start);
+  }
+}
+
+bool TraceReader::task_frame_ranges(
+    pid_t tid, vector<pair<FrameTime, FrameTime>>& blocks) {
+  load_task_index();
+  if (task_index_->empty()) {
+    return false;
+  }
+  load_block_index();
+  blocks.clear();
+  auto it = task_index_->find(tid);
+  if (it == task_index_->end()) {
+    return true;
+  }
+  for (FrameTime start : it->second) {
+    // The block ends where the next indexed block starts. Entries the
+    // writer couldn't index just make the range longer.
+    auto next = upper_bound(block_index_->begin(), block_index_->end(), start,
+                            [](FrameTime t, const BlockIndexEntry& e) {
+                              return t < e.time;
+                            });
+    FrameTime end = next == block_index_->end() ?
+        numeric_limits<FrameTime>::max() : next->time;
+    if (!blocks.empty() && blocks.back().second >= start) {
+      blocks.back().second = end;
+    } else {
+      blocks.push_back(make_pair(start, end));
+    }
+  }
+  return true;
+}
+
+void TraceReader::load_ticks_index() {
+  if (ticks_index_) {
+    return;
+  }
+  auto index = make_shared<map<pid_t, TicksIndexRuns>>();
+  ticks_index_ = index;
+
+  string path = ticks_index_path();
+  ScopedFd fd(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (!fd.is_open() || fstat(fd, &st) < 0) {
+    return;
+  }
+  BlockIndexHeader header;
+  if (read_to_end(fd, 0, &header, sizeof(header)) != sizeof(header) ||
+      header.magic != TICKS_INDEX_MAGIC ||
+      header.entry_size != sizeof(TicksIndexEntry)) {
+    LOG(warn) << "Ignoring invalid ticks index " << path;
+    return;
+  }
+  size_t count = (st.st_size - sizeof(header)) / sizeof(TicksIndexEntry);
+  vector<TicksIndexEntry> entries(count);
+  ssize_t size = count * sizeof(TicksIndexEntry);
+  if (read_to_end(fd, sizeof(header), entries.data(), size) != size) {
+    LOG(warn) << "Ignoring truncated ticks index " << path;
+    return;
+  }
+  for (auto& e : entries) {
+    (*index)[e.tid].entries.push_back(e);
+  }
+  // Each tid's entries were written in frame order, except that its last
+  // one is only added when the trace is closed.
+  for (auto& it : *index) {
+    vector<TicksIndexEntry>& v = it.second.entries;
+    stable_sort(v.begin(), v.end(),
+                [](const TicksIndexEntry& a, const TicksIndexEntry& b) {
+                  return a.time < b.time;
+                });
+    it.second.run_starts.push_back(0);
+    for (size_t i = 1; i < v.size(); ++i) {
+      if (v[i].ticks < v[i - 1].ticks) {
+        it.second.run_starts.push_back(i);
+      }
+    }
+  }
+}
+
+bool TraceReader::ticks_frame_range(pid_t tid, FrameTime from, Ticks ticks,
+                                    FrameTime* after, FrameTime* end) {
+  load_ticks_index();
+  if (ticks_index_->empty()) {
+    return false;
+  }
+  *after = from - 1;
+  *end = -1;
+  auto it = ticks_index_->find(tid);
+  if (it == ticks_index_->end()) {
+    return true;
+  }
+  const vector<TicksIndexEntry>& entries = it->second.entries;
+  const vector<size_t>& run_starts = it->second.run_starts;
+  // Every frame of |tid| lies between two consecutive entries (or is one),
+  // and within a run ticks don't decrease, so binary search each run from
+  // the one containing |from| until one goes past |ticks|.
+  size_t first = lower_bound(entries.begin(), entries.end(), from,
+                             [](const TicksIndexEntry& e, FrameTime t) {
+                               return e.time < t;
+                             }) - entries.begin();
+  if (first == entries.size()) {
+    return true;
+  }
+  size_t run = upper_bound(run_starts.begin(), run_starts.end(), first) -
+               run_starts.begin() - 1;
+  for (; run < run_starts.size(); ++run) {
+    size_t run_end =
+        run + 1 < run_starts.size() ? run_starts[run + 1] : entries.size();
+    auto begin = entries.begin() + max(first, run_starts[run]);
+    auto found = upper_bound(begin, entries.begin() + run_end, ticks,
+                             [](Ticks t, const TicksIndexEntry& e) {
+                               return t < e.ticks;
+                             });
+    if (found != entries.begin() + run_end) {
+      if (found != entries.begin()) {
+        *after = max(*after, (found - 1)->time);
+      }
+      *end = found->time;
+      return true;
+    }
+  }
+  return true;
+}
+
+int TraceReader::recompress_stored_substreams() {
+  // Block boundaries don't change (the new writer uses the same block size),
+  // so block i of the new file holds the same data as block i of the old.
+  vector<uint64_t> old_offsets[SUBSTREAM_COUNT];
+  vector<uint64_t> new_offsets[SUBSTREAM_COUNT];
+  vector<Substream> rewritten;
+  string header_path = version_path();
+  ScopedFd header_fd(header_path.c_str(), O_RDONLY);
+  string version_line;
+  while (true) {
+    char ch;
+    if (read(header_fd, &ch, 1) != 1) {
+      FATAL() << "Can't read version file " << header_path;
+    }
+    if (ch == '\n') {
+      break;
+    }
+    version_line += ch;
+  }
+  PackedFdMessageReader header_msg(header_fd);
+  trace::Header::Reader header = header_msg.getRoot<trace::Header>();
+  auto compression = header.getSubstreamCompression();
+
+  uint32_t codecs = 0;
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    CompressedReader in(path(s));
+    if (!in.good() || !in.uses_codec(CompressedWriter::CODEC_NONE)) {
+      for (int c = 0; in.good() && c < CompressedWriter::CODEC_COUNT; ++c) {
+        if (in.uses_codec((CompressedWriter::Codec)c)) {
+          codecs |= 1u << c;
+        }
+      }
+      continue;
+    }
+    old_offsets[s] = in.block_offsets();
+    // Recompress the way the recording meant to. Traces recorded with
+    // --compression=none (and traces from before the settings were
+    // recorded) get the default codec.
+    CompressedWriter::Codec codec = substream(s).codec;
+    int level = substream(s).level;
+    bool dictionary = s != RAW_DATA;
+    if (s < compression.size() &&
+        compression[s].getCodec() != CompressedWriter::CODEC_NONE) {
+      codec = (CompressedWriter::Codec)compression[s].getCodec();
+      level = compression[s].getLevel();
+      dictionary = compression[s].getDictionary();
+    }
+    string new_path = dir() + "/pack_" + substream(s).name;
+    unlink(new_path.c_str());
+    CompressedWriter out(new_path, substream(s).block_size, get_num_cpus(),
+                         codec, level);
+    if (dictionary) {
+      out.enable_dictionary();
+    }
+    while (!in.at_end()) {
+      const uint8_t* data;
+      size_t size;
+      if (!in.get_buffer(&data, &size)) {
+        FATAL() << "Error reading " << path(s);
+      }
+      out.write(data, size);
+      in.skip(size);
+    }
+    out.close(CompressedWriter::SYNC);
+    if (!out.good()) {
+      FATAL() << "Error writing " << new_path;
+    }
+    new_offsets[s] = out.block_offsets();
+    if (new_offsets[s].size() != old_offsets[s].size()) {
+      FATAL() << "Block count mismatch recompressing " << path(s);
+    }
+    for (int c = 0; c < CompressedWriter::CODEC_COUNT; ++c) {
+      if (out.wrote_codec((CompressedWriter::Codec)c)) {
+        codecs |= 1u << c;
+      }
+    }
+    rewritten.push_back(s);
+  }
+  if (rewritten.empty()) {
+    return 0;
+  }
+
+  // The new codecs may need a newer rr (e.g. blocks stored by a zstd
+  // writer). We don't know what else the old version accounted for, so
+  // never lower it.
+  int required_version =
+      max(header.getRequiredForwardCompatibilityVersion(),
+          codecs_required_version(codecs));
+  string new_header_path = dir() + "/pack_version";
+  if (required_version != header.getRequiredForwardCompatibilityVersion()) {
+    MallocMessageBuilder new_header_msg;
+    new_header_msg.setRoot(header);
+    new_header_msg.getRoot<trace::Header>()
+        .setRequiredForwardCompatibilityVersion(required_version);
+    ScopedFd new_header_fd(new_header_path.c_str(),
+                           O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    version_line += '\n';
+    if (!new_header_fd.is_open() ||
+        write(new_header_fd, version_line.data(), version_line.size()) !=
+            (ssize_t)version_line.size()) {
+      FATAL() << "Error writing " << new_header_path;
+    }
+    try {
+      writePackedMessageToFd(new_header_fd, new_header_msg);
+    } catch (...) {
+      FATAL() << "Error writing " << new_header_path;
+    }
+    if (fsync(new_header_fd) < 0) {
+      FATAL() << "Error writing " << new_header_path;
+    }
+  } else {
+    new_header_path.clear();
+  }
+
+  load_block_index();
+  vector<BlockIndexEntry> entries = *block_index_;
+  for (auto& e : entries) {
+    for (int i = 0; i < BLOCK_INDEX_STREAMS; ++i) {
+      Substream s = block_index_substream(i);
+      if (old_offsets[s].empty()) {
+        continue;
+      }
+      auto it = lower_bound(old_offsets[s].begin(), old_offsets[s].end(),
+                            e.streams[i].block_offset);
+      DEBUG_ASSERT(it != old_offsets[s].end() &&
+                   *it == e.streams[i].block_offset);
+      e.streams[i].block_offset = new_offsets[s][it - old_offsets[s].begin()];
+    }
+  }
+  string index_path = block_index_path();
+  string new_index_path = dir() + "/pack_block_index";
+  if (!entries.empty() &&
+      !write_block_index_file(new_index_path, entries,
+                              CompressedWriter::SYNC)) {
+    FATAL() << "Error writing " << new_index_path;
+  }
+
+  // The block index is optional, so drop it while the substreams are being
+  // switched over; the trace stays valid if we're interrupted.
+  if (unlink(index_path.c_str()) < 0 && errno != ENOENT) {
+    FATAL() << "Error deleting " << index_path;
+  }
+  // Raise the version first, so old rr never sees blocks it can't read.
+  if (!new_header_path.empty() &&
+      rename(new_header_path.c_str(), header_path.c_str()) < 0) {
+    FATAL() << "Error renaming " << new_header_path << " to " << header_path;
+  }
+  for (Substream s : rewritten) {
+    string new_path = dir() + "/pack_" + substream(s).name;
+    if (rename(new_path.c_str(), path(s).c_str()) < 0) {
+      FATAL() << "Error renaming " << new_path << " to " << path(s);
+    }
+  }
+  if (!entries.empty() &&
+      rename(new_index_path.c_str(), index_path.c_str()) < 0) {
+    FATAL() << "Error renaming " << new_index_path << " to " << index_path;
+  }
+  return rewritten.size();
+}
+
+void TraceReader::skip_mapped_regions_before(FrameTime time) {
+  auto& mmaps = reader(MMAPS);
+  while (!mmaps.at_end()) {
+    mmaps.save_state();
+    CompressedReaderInputStream stream(mmaps);
+    PackedMessageReader map_msg(stream);
+    if (map_msg.getRoot<trace::MMap>().getFrameTime() >= time) {
+      mmaps.restore_state();
+      return;
+    }
+    mmaps.discard_state();
+  }
+}
+
+void TraceReader::skip_task_events_before(FrameTime time) {
+  auto& tasks = reader(TASKS);
+  while (!tasks.at_end()) {
+    tasks.save_state();
+    CompressedReaderInputStream stream(tasks);
+    PackedMessageReader task_msg(stream);
+    if (task_msg.getRoot<trace::TaskEvent>().getFrameTime() >= time) {
+      tasks.restore_state();
+      return;
+    }
+    tasks.discard_state();
+  }
+}
+
+void TraceReader::seek_to_frame(FrameTime time) {
+  load_block_index();
+  // Find the last index entry at or before |time|.
+  auto it = upper_bound(block_index_->begin(), block_index_->end(), time,
+                        [](FrameTime t, const BlockIndexEntry& e) {
+                          return t < e.time;
+                        });
+  const BlockIndexEntry* entry =
+      it == block_index_->begin() ? nullptr : &*(it - 1);
+  FrameTime next_time = global_time + 1;
+  if (time < next_time || (entry && entry->time > next_time)) {
+    rewind();
+    raw_recs.clear();
+    if (entry) {
+      for (int i = 0; i < BLOCK_INDEX_STREAMS; ++i) {
+        reader(block_index_substream(i))
+            .seek(entry->streams[i].block_offset, entry->streams[i].skip);
+      }
+      global_time = entry->time - 1;
+    }
+  }
+
+  RawDataMetadata data;
+  while (read_raw_data_metadata_for_frame(data)) {
+  }
+  while (global_time + 1 < time && !at_end()) {
+    read_frame(time);
+    while (read_raw_data_metadata_for_frame(data)) {
+    }
+  }
+  skip_mapped_regions_before(time);
+  skip_task_events_before(time);
+}
+
+FrameTime TraceReader::last_indexed_frame() {
+  load_block_index();
+  return block_index_->empty() ? 0 : block_index_->back().time;
+}
+
 TraceReader::TraceReader(const string& dir)
     : TraceStream(resolve_trace_name(dir), 1) {
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
     readers[s] = unique_ptr<CompressedReader>(new CompressedReader(path(s)));
   }
+  // EVENTS and RAW_DATA are read steadily through the whole replay, so
+  // decompress their upcoming blocks in the background. MMAPS and TASKS
+  // are small and read in short bursts.
+  reader(EVENTS).set_read_ahead(2);
+  reader(RAW_DATA).set_read_ahead(4);
+
+  if (access(upload_failed_path().c_str(), F_OK) == 0) {
+    fprintf(stderr,
+            "\n"
+            "rr: Uploading trace `%s' failed after some of its data had been\n"
+            "sent and removed locally, so it can't be replayed.\n"
+            "\n",
+            dir().c_str());
+    exit(EX_DATAERR);
+  }
 
   string path = version_path();
   ScopedFd version_fd(path.c_str(), O_RDONLY);
@@ -1685,6 +2914,8 @@ TraceReader::TraceReader(const string& dir)
     xcr0_ = x86data.getXcr0();
     clear_fip_fdp_ = x86data.getClearFipFdp();
   }
+  xsave_layout_ =
+      make_shared<const XSaveLayout>(xsave_layout_from_trace(cpuid_records_));
 
   switch (header.getChaosMode()) {
     case trace::ChaosMode::UNKNOWN:
@@ -1727,11 +2958,17 @@ TraceReader::TraceReader(const TraceReader& other)
     readers[s] =
         unique_ptr<CompressedReader>(new CompressedReader(other.reader(s)));
   }
+  block_index_ = other.block_index_;
+  task_index_ = other.task_index_;
+  ticks_index_ = other.ticks_index_;
+  raw_data_block_offsets = other.raw_data_block_offsets;
 
   bind_to_cpu = other.bind_to_cpu;
   trace_uses_cpuid_faulting = other.trace_uses_cpuid_faulting;
   cpuid_records_ = other.cpuid_records_;
+  xsave_layout_ = other.xsave_layout_;
   raw_recs = other.raw_recs;
+  register_delta_bases = other.register_delta_bases;
   xcr0_ = other.xcr0_;
   preload_thread_locals_recorded_ = other.preload_thread_locals_recorded_;
   rrcall_base_ = other.rrcall_base_;
@@ -3,6 +3,7 @@
 #ifndef RR_TRACE_STREAM_H_
 #define RR_TRACE_STREAM_H_
 
+#include <string.h>
 #include <unistd.h>
 
 #include <map>
@@ -18,6 +19,7 @@
 #include "TaskishUid.h"
 #include "TraceFrame.h"
 #include "TraceTaskEvent.h"
+#include "TraceUploader.h"
 #include "remote_ptr.h"
 
 namespace rr {
@@ -25,10 +27,38 @@ namespace rr {
 /**
  * Bump this when rr changes mean that traces produced by new rr can't be replayed by old rr.
  */
-const int FORWARD_COMPATIBILITY_VERSION = 3;
+const int FORWARD_COMPATIBILITY_VERSION = 8;
+/**
+ * Traces in which no syscallbuf was resized can still be replayed by rr
+ * that only supports this forward compatibility version.
+ */
+const int NO_SYSCALLBUF_RESIZE_FORWARD_COMPATIBILITY_VERSION = 7;
+/**
+ * Traces without CODEC_ZSTD_DICT blocks can still be replayed by rr that
+ * only supports this forward compatibility version.
+ */
+const int NO_ZSTD_DICTIONARY_FORWARD_COMPATIBILITY_VERSION = 6;
+/**
+ * Traces whose frames don't store registers as deltas against earlier frames
+ * can still be replayed by rr that only supports this forward compatibility
+ * version.
+ */
+const int NO_REGISTER_DELTAS_FORWARD_COMPATIBILITY_VERSION = 5;
+/**
+ * Traces without references to earlier raw data can still be replayed by rr
+ * that only supports this forward compatibility version.
+ */
+const int NO_RAW_DATA_REFS_FORWARD_COMPATIBILITY_VERSION = 4;
+/**
+ * Traces whose substreams are all brotli-compressed (and have no references
+ * to earlier raw data) can still be replayed by rr that only supports this
+ * forward compatibility version.
+ */
+const int BROTLI_ONLY_FORWARD_COMPATIBILITY_VERSION = 3;
 
 struct CPUIDRecord;
 struct DisableCPUIDFeatures;
+struct XSaveLayout;
 class KernelMapping;
 class RecordTask;
 struct TraceUuid;
@@ -56,6 +86,10 @@ public:
     size_t size;
     pid_t rec_tid;
     std::vector<WriteHole> holes;
+    // If true, the data isn't stored with this record. It's a copy of the
+    // data stored earlier at uncompressed RAW_DATA position |ref_pos|.
+    bool is_ref;
+    uint64_t ref_pos;
   };
 
   /**
@@ -89,6 +123,7 @@ public:
   std::string file_data_clone_file_name(const TaskUid& tuid);
 
   static size_t mmaps_block_size();
+  static const char* substream_name(Substream s);
 
   /**
    * For REMAP_MAPPING maps, the memory contents are preserved so we don't
@@ -112,6 +147,67 @@ public:
 protected:
   TraceStream(const string& trace_dir, FrameTime initial_time);
 
+  /**
+   * The substreams covered by the block index, in BlockIndexEntry order.
+   */
+  enum { BLOCK_INDEX_EVENTS, BLOCK_INDEX_RAW_DATA, BLOCK_INDEX_STREAMS };
+  /**
+   * The state of an indexed substream just before the frame at |time| is
+   * read: decompress the block at file offset |block_offset| and skip
+   * |skip| bytes.
+   */
+  struct BlockIndexEntry {
+    FrameTime time;
+    struct {
+      uint64_t block_offset;
+      uint64_t skip;
+    } streams[BLOCK_INDEX_STREAMS];
+  };
+  /**
+   * Return the path of the sidecar block index. TraceWriter adds an entry
+   * each time EVENTS or RAW_DATA enters a new block. The index is optional;
+   * traces without it are simply read sequentially.
+   */
+  string block_index_path() const { return trace_dir + "/block_index"; }
+  static Substream block_index_substream(int i) {
+    return i == BLOCK_INDEX_EVENTS ? EVENTS : RAW_DATA;
+  }
+  /**
+   * Write |entries| to the block index at |path|, replacing any existing
+   * file. Returns false on failure.
+   */
+  static bool write_block_index_file(const string& path,
+                                     const std::vector<BlockIndexEntry>& entries,
+                                     CompressedWriter::Sync sync);
+
+  /**
+   * One entry of the sidecar task index: the EVENTS block starting with the
+   * frame at |block_start| contains at least one frame of |tid|. Block
+   * boundaries are the block index entries (plus the start of the trace).
+   */
+  struct TaskIndexEntry {
+    FrameTime block_start;
+    int32_t tid;
+    uint32_t padding;
+  };
+  string task_index_path() const { return trace_dir + "/task_index"; }
+
+  /**
+   * One entry of the sidecar ticks index: the frame at |time| was for |tid|
+   * with tick count |ticks|. Written for every TICKS_INDEX_INTERVAL'th frame
+   * of each tid, its first and last frames, and the frames on either side
+   * of a drop in its tick count (exec, or a new task reusing the tid), so
+   * between consecutive entries of a tid its ticks never decrease.
+   */
+  struct TicksIndexEntry {
+    FrameTime time;
+    Ticks ticks;
+    int32_t tid;
+    uint32_t padding;
+  };
+  enum { TICKS_INDEX_INTERVAL = 64 };
+  string ticks_index_path() const { return trace_dir + "/ticks_index"; }
+
   /**
    * Return the path of the file for the given substream.
    */
@@ -129,12 +225,30 @@ protected:
    * detect incomplete traces.
    */
   string incomplete_version_path() const { return trace_dir + "/incomplete"; }
+  /**
+   * Created when uploading the trace failed after sent data had been removed
+   * from the local files, so the local trace can't be replayed.
+   */
+  string upload_failed_path() const { return trace_dir + "/upload_failed"; }
 
   /**
    * Increment the global time and return the incremented value.
    */
   void tick_time() { ++global_time; }
 
+  /**
+   * The most recent register blobs stored in EVENTS for a task. Frames store
+   * their registers XORed against these, so bytes that didn't change pack
+   * down to almost nothing. The writer drops all of them whenever it starts
+   * a new block index entry, so the first frame of each task after a seek
+   * point is a keyframe.
+   */
+  struct RegisterDeltaBase {
+    std::vector<uint8_t> regs;
+    std::vector<uint8_t> extra_regs;
+  };
+  std::map<pid_t, RegisterDeltaBase> register_delta_bases;
+
   // Directory into which we're saving the trace files.
   string trace_dir;
   // CPU core# that the tracees are bound to
@@ -181,6 +295,9 @@ struct TraceRemoteFd {
  * rr has just started recording (or perhaps died during startup) (or perhaps
  * that isn't a trace directory at all).
  */
+struct BackgroundFileCopy;
+struct BackgroundCopyPool;
+
 class TraceWriter : public TraceStream {
 public:
   bool supports_file_data_cloning() { return supports_file_data_cloning_; }
@@ -223,11 +340,10 @@ public:
    * Write a raw-data record to the trace.
    * 'addr' is the address in the tracee where the data came from/will be
    * restored to.
+   * Large records identical to one written earlier are stored as a reference
+   * to the earlier data.
    */
-  void write_raw(pid_t tid, const void* data, size_t len, remote_ptr<void> addr) {
-    write_raw_data(data, len);
-    write_raw_header(tid, len, addr, std::vector<WriteHole>());
-  }
+  void write_raw(pid_t tid, const void* data, size_t len, remote_ptr<void> addr);
   void write_raw_data(const void* data, size_t len);
   void write_raw_header(pid_t tid, size_t total_len, remote_ptr<void> addr,
                         const std::vector<WriteHole>& holes);
@@ -263,6 +379,12 @@ public:
   void set_clear_fip_fdp(bool value) { clear_fip_fdp_ = value; }
   bool clear_fip_fdp() const { return clear_fip_fdp_; }
   void set_chaos_mode(bool value) { chaos_mode = value; }
+  /**
+   * Share copies of mapped files with other traces through the `rr pack
+   * --store` directory |dir|. Copies are found by a (device, inode, size,
+   * mtime) fingerprint of the original file, under |dir|/index.
+   */
+  void set_file_store_dir(const std::string& dir) { file_store_dir = dir; }
 
   enum CloseStatus {
     /**
@@ -289,6 +411,61 @@ public:
 
   TicksSemantics ticks_semantics() const { return ticks_semantics_; }
 
+  /**
+   * Select the codec (and optionally level) used for substreams of traces
+   * created after this call. 'spec' is either "<codec>[:<level>]" applying
+   * to all substreams, or a comma-separated list of
+   * "<substream>=<codec>[:<level>]" where <substream> is one of
+   * events/data/mmaps/tasks. Returns false if 'spec' is invalid.
+   */
+  static bool set_compression(const std::string& spec);
+
+  /**
+   * Also stream traces to `rr receive` at |dest|, "<host>:<port>", while
+   * they're recorded. Substream blocks are deallocated locally once sent.
+   */
+  static void set_upload_destination(const std::string& dest);
+
+  /**
+   * Limit the memory the substream writers of traces created after this
+   * call use to buffer data for compression to |bytes| in total
+   * (0 for no limit). |bytes| must be at least min_buffer_memory().
+   * Writers that fall behind then store blocks uncompressed rather than
+   * stall the tracees for long.
+   */
+  static void set_max_buffer_memory(uint64_t bytes);
+  /**
+   * The smallest budget set_max_buffer_memory() accepts: every substream
+   * writer needs a couple of blocks of buffer.
+   */
+  static uint64_t min_buffer_memory();
+
+  /**
+   * Run the compression threads, and any background file copies started
+   * from now on, on |cpus| rather than wherever they happen to be.
+   */
+  void set_helper_thread_affinity(const cpu_set_t& cpus);
+
+  /**
+   * Note that a syscallbuf was moved to a bigger mapping, which replayers
+   * that don't know about resizing can't reproduce.
+   */
+  void note_syscallbuf_resize() { wrote_syscallbuf_resize = true; }
+
+  /**
+   * Counters for the writer of substream |s|. Also valid after close().
+   */
+  CompressedWriter::Stats writer_stats(Substream s) {
+    return writer(s).stats();
+  }
+
+  /**
+   * Uncompressed bytes handed to the writer of substream |s| so far.
+   */
+  uint64_t bytes_written(Substream s) const {
+    return writer(s).uncompressed_pos();
+  }
+
 private:
   bool try_hardlink_file(const std::string& real_file_name,
                          const std::string& access_file_name, std::string* new_name);
@@ -297,11 +474,47 @@ private:
                       std::string* new_name);
   bool copy_file(const std::string& real_file_name,
                  const std::string& access_file_name, std::string* new_name);
+  void record_file_store_object(const std::string& object);
+  bool start_background_copy(BackgroundFileCopy* copy);
+  static void* background_copy_thread(void* p);
+  void finish_background_copies();
 
   CompressedWriter& writer(Substream s) { return *writers[s]; }
   const CompressedWriter& writer(Substream s) const { return *writers[s]; }
 
+  // Returns true if a new block index entry was added.
+  bool update_block_index();
+  void write_block_index();
+  void write_task_index();
+  void update_ticks_index(pid_t tid, Ticks ticks);
+  void write_ticks_index();
+
   std::unique_ptr<CompressedWriter> writers[SUBSTREAM_COUNT];
+  std::unique_ptr<TraceUploader> uploader;
+  /**
+   * Block index entries with uncompressed stream positions in
+   * |streams[i].skip|. Converted to block offsets in write_block_index()
+   * once the writers are closed.
+   */
+  std::vector<BlockIndexEntry> block_index;
+  /**
+   * Task index entries for finished blocks, and the tids seen in the block
+   * that started at |task_index_block_start|.
+   */
+  std::vector<TaskIndexEntry> task_index;
+  std::set<pid_t> task_index_block_tids;
+  FrameTime task_index_block_start;
+  /**
+   * Ticks index entries so far, and for each tid its last frame and the
+   * number of its frames since its last entry.
+   */
+  std::vector<TicksIndexEntry> ticks_index;
+  struct TicksIndexTask {
+    FrameTime last_time;
+    Ticks last_ticks;
+    uint32_t frames_since_entry;
+  };
+  std::map<pid_t, TicksIndexTask> ticks_index_tasks;
   /**
    * Files that have already been mapped without being copied to the trace,
    * i.e. that we have already assumed to be immutable.
@@ -311,6 +524,21 @@ private:
    */
   std::map<std::pair<dev_t, ino_t>, std::string> files_assumed_immutable;
   std::vector<RawDataMetadata> raw_recs;
+  struct RawDataHash {
+    uint8_t bytes[16];
+    bool operator<(const RawDataHash& other) const {
+      return memcmp(bytes, other.bytes, sizeof(bytes)) < 0;
+    }
+  };
+  // Uncompressed RAW_DATA position of earlier raw data records, by hash
+  std::map<RawDataHash, uint64_t> raw_data_hashes;
+  // First segment reused by the message builders of write_frame() etc.,
+  // and how big it should be to hold the biggest recent message
+  std::vector<uint64_t> message_scratch;
+  size_t message_scratch_wanted;
+  bool wrote_raw_data_refs;
+  bool wrote_register_deltas;
+  bool wrote_syscallbuf_resize;
   std::vector<CPUIDRecord> cpuid_records;
   TicksSemantics ticks_semantics_;
   // Keep the 'incomplete' (later renamed to 'version') file open until we
@@ -322,7 +550,12 @@ private:
   bool fdp_exception_only_quirk_;
   bool clear_fip_fdp_;
   bool supports_file_data_cloning_;
+  bool has_helper_thread_affinity;
+  cpu_set_t helper_thread_affinity;
   bool chaos_mode;
+  std::string file_store_dir;
+  std::vector<std::shared_ptr<BackgroundFileCopy>> background_copies;
+  std::shared_ptr<BackgroundCopyPool> background_copy_pool;
 };
 
 struct TraceUtsName {
@@ -348,9 +581,11 @@ public:
 
   /**
    * Like RawData, but returns positions of holes. `data` excludes holes.
+   * Instead of being copied, the data is returned as pieces of the
+   * decompressed trace blocks, in order.
    */
   struct RawDataWithHoles {
-    std::vector<uint8_t> data;
+    std::vector<CompressedReader::Span> data;
     remote_ptr<void> addr;
     pid_t rec_tid;
     std::vector<WriteHole> holes;
@@ -367,6 +602,13 @@ public:
    * field. (Raw data and maps are still accessible.)
    */
   TraceFrame read_frame(FrameTime skip_before = 0);
+  /**
+   * Like read_frame() above, but fill in |frame| so the storage of a frame
+   * the caller no longer needs (registers, extra registers) gets reused.
+   * For skipped frames only `global_time` is updated; the other fields keep
+   * whatever they held before.
+   */
+  void read_frame(TraceFrame& frame, FrameTime skip_before = 0);
 
   /**
    * Read the next mapped region descriptor and return it.
@@ -434,6 +676,49 @@ public:
    */
   void rewind();
 
+  /**
+   * Position all substreams so that the next read_frame() returns the frame
+   * at |time| (or we're at the end of the trace, if there is no such frame).
+   * Raw data, mapped regions and task events belonging to earlier frames are
+   * skipped. Uses the block index, when present, to avoid decompressing
+   * everything before |time|.
+   */
+  void seek_to_frame(FrameTime time);
+
+  /**
+   * Returns the time of the last frame seek_to_frame() can jump to directly
+   * via the block index, or 0 if there's no index.
+   */
+  FrameTime last_indexed_frame();
+
+  /**
+   * Fill |blocks| with the [start, end) frame ranges, in order, that contain
+   * all the frames of |tid|, so callers can seek_to_frame() past the rest.
+   * Returns false if the trace has no task index.
+   */
+  bool task_frame_ranges(pid_t tid,
+                         std::vector<std::pair<FrameTime, FrameTime>>& blocks);
+
+  /**
+   * Narrow down where the first frame of |tid| at or after |from| whose
+   * ticks exceed |ticks| is: after |*after| and at or before |*end|. Sets
+   * |*end| to -1 if there's no such frame. Returns false if the trace has
+   * no ticks index.
+   */
+  bool ticks_frame_range(pid_t tid, FrameTime from, Ticks ticks,
+                         FrameTime* after, FrameTime* end);
+
+  /**
+   * Recompress every substream containing blocks stored without compression
+   * (see 'rr record --compression=none') with the codec, level and
+   * dictionary setting the recording used (the default codec if that was
+   * none), and fix up the block index and required forward compatibility
+   * version to match. Afterwards this TraceReader still reads the
+   * old files; open a new one to read the recompressed trace.
+   * Returns the number of substreams rewritten.
+   */
+  int recompress_stored_substreams();
+
   uint64_t uncompressed_bytes() const;
   uint64_t compressed_bytes() const;
 
@@ -507,9 +792,38 @@ private:
   CompressedReader& reader(Substream s) { return *readers[s]; }
   const CompressedReader& reader(Substream s) const { return *readers[s]; }
 
+  void load_block_index();
+  void load_task_index();
+  void load_ticks_index();
+  // Returns the reader positioned at the data for |rec|.
+  CompressedReader& raw_data_reader(const RawDataMetadata& rec);
+  void skip_mapped_regions_before(FrameTime time);
+  void skip_task_events_before(FrameTime time);
+
   uint64_t xcr0_;
   std::unique_ptr<CompressedReader> readers[SUBSTREAM_COUNT];
+  // Loaded on first use by seek_to_frame(). Immutable once loaded, so
+  // shared between clones.
+  std::shared_ptr<const std::vector<BlockIndexEntry>> block_index_;
+  // Block start times for each tid, empty if there's no task index. Loaded
+  // on first use by task_frame_ranges() and shared between clones.
+  std::shared_ptr<const std::map<pid_t, std::vector<FrameTime>>> task_index_;
+  // Ticks index entries of each tid in frame order, with the indices at
+  // which its tick count drops. Loaded on first use by ticks_frame_range()
+  // and shared between clones.
+  struct TicksIndexRuns {
+    std::vector<TicksIndexEntry> entries;
+    std::vector<size_t> run_starts;
+  };
+  std::shared_ptr<const std::map<pid_t, TicksIndexRuns>> ticks_index_;
+  // For reading raw data that's a reference to earlier data. Created on
+  // first use.
+  std::unique_ptr<CompressedReader> raw_data_ref_reader;
+  std::shared_ptr<const std::vector<uint64_t>> raw_data_block_offsets;
   std::vector<CPUIDRecord> cpuid_records_;
+  // Derived from cpuid_records_ once, rather than for every frame with
+  // extra registers. Shared between clones.
+  std::shared_ptr<const XSaveLayout> xsave_layout_;
   std::vector<RawDataMetadata> raw_recs;
   TicksSemantics ticks_semantics_;
   double monotonic_time_;
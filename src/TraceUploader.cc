@@ -0,0 +1,286 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "TraceUploader.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <netdb.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "log.h"
+#include "util.h"
+
+using namespace std;
+
+namespace rr {
+
+// Bytes read back from the local file per send
+static const size_t UPLOAD_CHUNK_SIZE = 1024 * 1024;
+// Give up on a receiver that hasn't accepted any data for this long, so a
+// stuck receiver can't hang the end of recording.
+static const int UPLOAD_SEND_TIMEOUT_SECONDS = 60;
+
+static ScopedFd connect_to(const string& dest) {
+  size_t colon = dest.rfind(':');
+  if (colon == string::npos || colon == 0 || colon + 1 == dest.size()) {
+    CLEAN_FATAL() << "Invalid trace destination `" << dest
+                  << "'; expected <host>:<port>";
+  }
+  string host = dest.substr(0, colon);
+  string port = dest.substr(colon + 1);
+  if (host.size() > 2 && host[0] == '[' && host.back() == ']') {
+    // [ipv6-address]:port
+    host = host.substr(1, host.size() - 2);
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* addrs;
+  int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs);
+  if (ret) {
+    CLEAN_FATAL() << "Can't resolve " << dest << ": " << gai_strerror(ret);
+  }
+  ScopedFd fd;
+  for (struct addrinfo* a = addrs; a; a = a->ai_next) {
+    fd = ScopedFd(socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+                         a->ai_protocol));
+    if (fd.is_open() && connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+      break;
+    }
+    fd.close();
+  }
+  freeaddrinfo(addrs);
+  if (!fd.is_open()) {
+    CLEAN_FATAL() << "Can't connect to " << dest;
+  }
+  struct timeval timeout = { UPLOAD_SEND_TIMEOUT_SECONDS, 0 };
+  if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+    FATAL() << "Can't set send timeout for " << dest;
+  }
+  return fd;
+}
+
+void* TraceUploader::sender_thread_callback(void* p) {
+  static_cast<TraceUploader*>(p)->sender_thread();
+  return nullptr;
+}
+
+TraceUploader::TraceUploader(const string& trace_dir, const string& dest)
+    : trace_dir(trace_dir),
+      sock(connect_to(dest)),
+      closing(false),
+      complete(false),
+      send_error(false),
+      punched_holes(false),
+      joined(false) {
+  size_t last_slash = trace_dir.rfind('/');
+  trace_name = last_slash == string::npos ? trace_dir
+                                          : trace_dir.substr(last_slash + 1);
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&cond, nullptr);
+
+  // Like the compression threads, the sender must not take our signals.
+  sigset_t set;
+  sigset_t old_mask;
+  sigfillset(&set);
+  sigprocmask(SIG_BLOCK, &set, &old_mask);
+  int err = pthread_create(&thread, nullptr, sender_thread_callback, this);
+  sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+  if (err) {
+    SAFE_FATAL(err, "Failed to create trace upload thread");
+  }
+  pthread_setname_np(thread, "trace upload");
+}
+
+TraceUploader::~TraceUploader() {
+  if (!joined) {
+    // finish() wasn't called, so don't tell the receiver the trace is
+    // complete.
+    LOG(warn) << "Trace upload of " << trace_name << " is incomplete";
+    pthread_mutex_lock(&mutex);
+    closing = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread, nullptr);
+  }
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&cond);
+}
+
+void TraceUploader::upload(const string& file, uint64_t offset,
+                           uint64_t length, int punch_fd) {
+  pthread_mutex_lock(&mutex);
+  queued_files.insert(file);
+  bool punch = false;
+  if (punch_fd >= 0) {
+    auto& fd = punch_fds[file];
+    if (!fd.is_open()) {
+      fd = ScopedFd(fcntl(punch_fd, F_DUPFD_CLOEXEC, 0));
+    }
+    punch = fd.is_open();
+  }
+  queue.push_back({ file, offset, length, punch });
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+void TraceUploader::finish(const string& last) {
+  vector<string> names;
+  DIR* dir = opendir(trace_dir.c_str());
+  if (!dir) {
+    FATAL() << "Can't open " << trace_dir;
+  }
+  while (struct dirent* ent = readdir(dir)) {
+    names.push_back(ent->d_name);
+  }
+  closedir(dir);
+
+  for (auto& name : names) {
+    if (name == last) {
+      continue;
+    }
+    pthread_mutex_lock(&mutex);
+    bool queued = queued_files.count(name) > 0;
+    pthread_mutex_unlock(&mutex);
+    struct stat st;
+    if (queued || stat((trace_dir + "/" + name).c_str(), &st) < 0 ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    upload(name, 0, st.st_size);
+  }
+  struct stat st;
+  if (!last.empty() && stat((trace_dir + "/" + last).c_str(), &st) == 0) {
+    upload(last, 0, st.st_size);
+  }
+
+  pthread_mutex_lock(&mutex);
+  closing = true;
+  complete = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(thread, nullptr);
+  joined = true;
+}
+
+bool TraceUploader::send_all(const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t ret = send(sock, p, size, MSG_NOSIGNAL);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      LOG(warn) << "Trace receiver accepted nothing for "
+                << UPLOAD_SEND_TIMEOUT_SECONDS << "s; giving up on it";
+      return false;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    p += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+bool TraceUploader::send_region(const Region& r) {
+  auto& fd = open_files[r.file];
+  if (!fd.is_open()) {
+    string path = trace_dir + "/" + r.file;
+    fd = ScopedFd(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd.is_open()) {
+      LOG(warn) << "Can't open " << path << " for upload";
+      return false;
+    }
+  }
+
+  string name = trace_name + "/" + r.file;
+  UploadHeader header = { MAGIC, (uint32_t)name.size(), r.offset, r.length };
+  if (!send_all(&header, sizeof(header)) ||
+      !send_all(name.data(), name.size())) {
+    return false;
+  }
+  vector<uint8_t> buf;
+  uint64_t offset = r.offset;
+  uint64_t end = r.offset + r.length;
+  while (offset < end) {
+    size_t size = min<uint64_t>(end - offset, UPLOAD_CHUNK_SIZE);
+    buf.resize(size);
+    if (read_to_end(fd, offset, buf.data(), size) != (ssize_t)size) {
+      FATAL() << "Can't read back " << r.file << " for upload";
+    }
+    if (!send_all(buf.data(), size)) {
+      return false;
+    }
+    offset += size;
+  }
+  return true;
+}
+
+void TraceUploader::sender_thread() {
+  pthread_mutex_lock(&mutex);
+  while (true) {
+    if (queue.empty()) {
+      if (closing) {
+        break;
+      }
+      pthread_cond_wait(&cond, &mutex);
+      continue;
+    }
+    Region r = queue.front();
+    queue.pop_front();
+    int punch_fd = r.punch ? punch_fds[r.file].get() : -1;
+    pthread_mutex_unlock(&mutex);
+
+    if (!send_error) {
+      send_error = !send_region(r);
+      if (send_error) {
+        warn_lost_connection();
+      } else if (punch_fd >= 0) {
+        if (fallocate(punch_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      r.offset, r.length) < 0) {
+          LOG(debug) << "Can't punch hole in " << r.file << ": "
+                     << errno_name(errno);
+        } else {
+          punched_holes = true;
+        }
+      }
+    }
+
+    pthread_mutex_lock(&mutex);
+  }
+  bool send_end = complete;
+  pthread_mutex_unlock(&mutex);
+
+  if (!send_error && send_end) {
+    UploadHeader header = { MAGIC, 0, 0, 0 };
+    if (!send_all(&header, sizeof(header))) {
+      send_error = true;
+      warn_lost_connection();
+    }
+  }
+}
+
+void TraceUploader::warn_lost_connection() {
+  if (punched_holes) {
+    LOG(warn) << "Lost connection uploading " << trace_name
+              << "; data already sent has been removed from the local trace, "
+                 "so neither copy can be replayed";
+  } else {
+    LOG(warn) << "Lost connection uploading " << trace_name
+              << "; the trace is only stored locally";
+  }
+}
+
+} // namespace rr
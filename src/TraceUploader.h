@@ -0,0 +1,121 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_TRACE_UPLOADER_H_
+#define RR_TRACE_UPLOADER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+
+#include "ScopedFd.h"
+
+namespace rr {
+
+/**
+ * TraceUploader copies a trace to `rr receive` on another machine while the
+ * trace is being recorded.
+ *
+ * Writers queue regions of files in the trace directory with upload(). A
+ * background thread reads each region back from the local file and sends
+ * it. Regions queued with a |punch_fd| are then deallocated locally, so the
+ * local file only holds data that hasn't been sent yet: it is the spill
+ * buffer that absorbs a slow network, and recording never blocks on the
+ * connection. If the receiver accepts nothing for a minute, the upload is
+ * abandoned with a warning, so finish() can't hang on a stuck receiver.
+ * Once holes have been punched, an abandoned upload leaves both copies
+ * incomplete; local_copy_damaged() reports that.
+ *
+ * The wire format is a sequence of messages, each an UploadHeader followed
+ * by |name_length| bytes of path (trace name, '/', file name) and |length|
+ * bytes of file data to be stored at |offset|. A message with an empty path
+ * ends the trace.
+ */
+class TraceUploader {
+public:
+  struct UploadHeader {
+    uint32_t magic;
+    uint32_t name_length;
+    uint64_t offset;
+    uint64_t length;
+  };
+  static const uint32_t MAGIC = 0x70757272; // "rrup"
+
+  /**
+   * Connect to |dest|, "<host>:<port>", to upload the trace in |trace_dir|.
+   * Fatal if the connection can't be made.
+   */
+  TraceUploader(const std::string& trace_dir, const std::string& dest);
+  ~TraceUploader();
+
+  /**
+   * Queue bytes [offset, offset + length) of |file| in the trace directory.
+   * The bytes must already be in the file. If |punch_fd| is an fd open for
+   * writing on |file|, the bytes are deallocated from the local file once
+   * they've been sent. Callable from any thread.
+   */
+  void upload(const std::string& file, uint64_t offset, uint64_t length,
+              int punch_fd = -1);
+  /**
+   * Queue every regular file in the trace directory that hasn't had regions
+   * uploaded yet, with |last| (if non-empty) going last, then end the trace
+   * and wait until everything has been sent.
+   */
+  void finish(const std::string& last);
+  /**
+   * After finish(): true if the upload failed after sent data was removed
+   * from the local files, so neither the local nor the remote trace is
+   * complete.
+   */
+  bool local_copy_damaged() const { return send_error && punched_holes; }
+
+private:
+  struct Region {
+    std::string file;
+    uint64_t offset;
+    uint64_t length;
+    bool punch;
+  };
+
+  static void* sender_thread_callback(void* p);
+  void sender_thread();
+  bool send_region(const Region& r);
+  bool send_all(const void* data, size_t size);
+  void warn_lost_connection();
+
+  std::string trace_dir;
+  std::string trace_name;
+  ScopedFd sock;
+  pthread_t thread;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // BEGIN protected by 'mutex'
+  std::deque<Region> queue;
+  // Files that have had regions queued
+  std::set<std::string> queued_files;
+  // Our own dups of the writers' fds, for punching holes after the
+  // writers have closed theirs
+  std::map<std::string, ScopedFd> punch_fds;
+  bool closing;
+  // Set by finish(): the receiver gets told the trace is complete
+  bool complete;
+  // END protected by 'mutex'
+
+  /* sender thread only */
+  std::map<std::string, ScopedFd> open_files;
+  bool send_error;
+  // Some sent data has been deallocated from the local files
+  bool punched_holes;
+
+  /* owner thread only */
+  bool joined;
+};
+
+} // namespace rr
+
+#endif /* RR_TRACE_UPLOADER_H_ */
@@ -0,0 +1,344 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <limits>
+#include <map>
+#include <vector>
+
+#include "Command.h"
+#include "ExportImportCheckpoints.h"
+#include "ReplaySession.h"
+#include "ReplayTask.h"
+#include "TraceStream.h"
+#include "WaitManager.h"
+#include "log.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+namespace rr {
+
+class ValueHistoryCommand : public Command {
+public:
+  virtual int run(vector<string>& args) override;
+
+protected:
+  ValueHistoryCommand(const char* name, const char* help)
+      : Command(name, help) {}
+
+  static ValueHistoryCommand singleton;
+};
+
+ValueHistoryCommand ValueHistoryCommand::singleton(
+    "value-history",
+    " rr value-history [OPTION]... <ADDR> <LENGTH> [<trace-dir>]\n"
+    "  Print every change to the memory at [<ADDR>, <ADDR>+<LENGTH>) over the\n"
+    "  whole recording, one line per change: event, ticks, tid, old and new\n"
+    "  value in hex. <LENGTH> must fit in the hardware watchpoints.\n"
+    "  -j, --jobs=<N>             replay <N> intervals of the trace in\n"
+    "                             parallel. Requires -u. Defaults to the\n"
+    "                             number of CPUs with -u.\n"
+    "  -p, --pid=<PID>            only watch the memory of process <PID>;\n"
+    "                             by default every process is watched\n"
+    "  -u, --cpu-unbound          allow replay to run on any CPU. Default is\n"
+    "                             to run on the CPU stored in the trace.\n"
+    "                             Note that this may diverge from the recording\n"
+    "                             in some cases.\n");
+
+struct ValueHistoryFlags {
+  FrameTime jobs;
+  pid_t pid;
+  bool cpu_unbound;
+
+  ValueHistoryFlags() : jobs(0), pid(0), cpu_unbound(false) {}
+};
+
+static bool parse_value_history_arg(vector<string>& args,
+                                    ValueHistoryFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = {
+    { 'j', "jobs", HAS_PARAMETER },
+    { 'p', "pid", HAS_PARAMETER },
+    { 'u', "cpu-unbound", NO_PARAMETER },
+  };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'j':
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.jobs = opt.int_value;
+      break;
+    case 'p':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.pid = opt.int_value;
+      break;
+    case 'u':
+      flags.cpu_unbound = true;
+      break;
+    default:
+      DEBUG_ASSERT(0 && "Unknown option");
+  }
+  return true;
+}
+
+static string format_value(const vector<uint8_t>& value) {
+  if (value.empty()) {
+    return "unmapped";
+  }
+  string result;
+  for (uint8_t b : value) {
+    char buf[3];
+    snprintf(buf, sizeof(buf), "%02x", b);
+    result += buf;
+  }
+  return result;
+}
+
+// Current contents of the range, or empty if it isn't all mapped.
+static vector<uint8_t> read_value(Task* t, const MemoryRange& range) {
+  vector<uint8_t> value(range.size());
+  if (t->read_bytes_fallible(range.start(), value.size(), value.data()) !=
+      ssize_t(value.size())) {
+    value.clear();
+  }
+  return value;
+}
+
+class ValueWatcher {
+public:
+  ValueWatcher(const MemoryRange& range, const ValueHistoryFlags& flags,
+               FILE* out)
+      : range(range), flags(flags), out(out) {}
+
+  /**
+   * Set the watchpoint in every watched address space that doesn't have it
+   * yet: new ones appear with fork and exec (and watchpoints aren't carried
+   * over into cloned sessions). Returns false if the hardware can't watch
+   * the range.
+   */
+  bool watch_new_address_spaces(ReplaySession& session) {
+    for (auto& p : session.tasks()) {
+      Task* t = p.second;
+      if (flags.pid && t->tgid() != flags.pid) {
+        continue;
+      }
+      AddressSpaceUid uid = t->vm()->uid();
+      if (values.count(uid)) {
+        continue;
+      }
+      if (!t->vm()->add_watchpoint(range.start(), range.size(), WATCH_WRITE)) {
+        return false;
+      }
+      values[uid] = read_value(t, range);
+    }
+    return true;
+  }
+
+  // Print the change, if any, to the range in |t|'s address space.
+  void check(ReplaySession& session, Task* t) {
+    auto it = values.find(t->vm()->uid());
+    if (it == values.end()) {
+      return;
+    }
+    vector<uint8_t> value = read_value(t, range);
+    if (value == it->second) {
+      return;
+    }
+    fprintf(out, "event %lld ticks %" PRId64 " tid %d old %s new %s\n",
+            (long long)session.trace_reader().time(), t->tick_count(),
+            t->rec_tid, format_value(it->second).c_str(),
+            format_value(value).c_str());
+    it->second = std::move(value);
+  }
+
+private:
+  MemoryRange range;
+  const ValueHistoryFlags& flags;
+  FILE* out;
+  // Last value seen in each watched address space
+  map<AddressSpaceUid, vector<uint8_t>> values;
+};
+
+/**
+ * Replay `session` from its current position up to the first clonable point
+ * at or after `end` (where the next interval starts), printing the changes
+ * to `range`. Returns false if the range can't be watched.
+ */
+static bool watch_interval(ReplaySession& session, const MemoryRange& range,
+                           const ValueHistoryFlags& flags, FrameTime end,
+                           FILE* out) {
+  session.set_suppress_stdio_before_event(numeric_limits<FrameTime>::max());
+  ValueWatcher watcher(range, flags, out);
+  while (true) {
+    if (!watcher.watch_new_address_spaces(session)) {
+      return false;
+    }
+    auto result = session.replay_step(RUN_CONTINUE);
+    if (result.status == REPLAY_EXITED) {
+      break;
+    }
+    // Writes by the kernel or by rr itself (recorded syscall outputs, the
+    // syscall buffer's flushes) go through notify_written() and are reported
+    // here just like writes by user code.
+    Task* t = result.break_status.task_context.task;
+    if (t && !result.break_status.data_watchpoints_hit().empty()) {
+      watcher.check(session, t);
+    }
+    if (session.trace_reader().time() >= end && session.can_clone()) {
+      break;
+    }
+  }
+  return true;
+}
+
+/**
+ * Replay the whole trace without watchpoints, forking off a child at
+ * `jobs` evenly spaced events that watches `range` from there up to the
+ * next one and writes the changes to its own temporary file. Then copy the
+ * files to stdout in order.
+ */
+static int value_history(const string& trace_dir, const MemoryRange& range,
+                         const ValueHistoryFlags& flags) {
+  FrameTime last_event = 0;
+  {
+    TraceReader reader(trace_dir);
+    while (!reader.at_end()) {
+      last_event = reader.read_frame().time();
+    }
+  }
+  FrameTime jobs = max<FrameTime>(1, min(flags.jobs, last_event));
+  vector<FrameTime> starts;
+  for (FrameTime i = 0; i < jobs; ++i) {
+    starts.push_back(last_event * i / jobs);
+  }
+  starts.push_back(numeric_limits<FrameTime>::max());
+
+  ReplaySession::Flags session_flags;
+  session_flags.redirect_stdio = false;
+  session_flags.cpu_unbound = flags.cpu_unbound;
+  ReplaySession::shr_ptr session =
+      ReplaySession::create(trace_dir, session_flags);
+
+  vector<pair<pid_t, ScopedFd>> children;
+  size_t next = 0;
+  while (next < starts.size() - 1) {
+    if (session->trace_reader().time() >= starts[next] &&
+        session->can_clone()) {
+      TempFile out = create_temporary_file("rr-value-history-XXXXXX");
+      unlink(out.name.c_str());
+      fflush(stdout);
+      pid_t child;
+      ReplaySession::shr_ptr interval = fork_checkpoint(*session, &child);
+      if (interval) {
+        FILE* f = fdopen(out.fd.extract(), "w");
+        bool ok = watch_interval(*interval, range, flags, starts[next + 1], f);
+        fclose(f);
+        if (!ok) {
+          fprintf(stderr, "Can't watch %zu bytes at %p with hardware "
+                          "watchpoints\n",
+                  range.size(), (void*)range.start().as_int());
+        }
+        _exit(ok ? 0 : 1);
+      }
+      LOG(info) << "Watching from event " << session->trace_reader().time()
+                << " in process " << child;
+      children.push_back(make_pair(child, std::move(out.fd)));
+      ++next;
+      continue;
+    }
+    auto result = session->replay_step(RUN_CONTINUE);
+    if (result.status == REPLAY_EXITED) {
+      break;
+    }
+  }
+
+  int ret = 0;
+  for (auto& c : children) {
+    WaitResult result = WaitManager::wait_exit(WaitOptions(c.first));
+    if (result.code != WAIT_OK) {
+      FATAL() << "Failed to wait for child " << c.first;
+    }
+    if (result.status.type() != WaitStatus::EXIT ||
+        result.status.exit_code() != 0) {
+      ret = 1;
+    }
+  }
+  if (ret) {
+    return ret;
+  }
+
+  vector<uint8_t> buf;
+  buf.resize(1024 * 1024);
+  for (auto& c : children) {
+    uint64_t offset = 0;
+    while (true) {
+      ssize_t nread = pread(c.second, buf.data(), buf.size(), offset);
+      if (nread < 0) {
+        FATAL() << "Can't read value history output";
+      }
+      if (!nread) {
+        break;
+      }
+      write_all(STDOUT_FILENO, buf.data(), nread);
+      offset += nread;
+    }
+  }
+  return 0;
+}
+
+int ValueHistoryCommand::run(vector<string>& args) {
+  ValueHistoryFlags flags;
+  while (parse_value_history_arg(args, flags)) {
+  }
+
+  if (args.size() < 2) {
+    print_help(stderr);
+    return 1;
+  }
+  char* end;
+  uintptr_t addr = strtoull(args[0].c_str(), &end, 0);
+  if (args[0].empty() || *end) {
+    print_help(stderr);
+    return 1;
+  }
+  uintptr_t length = strtoull(args[1].c_str(), &end, 0);
+  if (args[1].empty() || *end || !length || addr + length < addr) {
+    print_help(stderr);
+    return 1;
+  }
+  args.erase(args.begin(), args.begin() + 2);
+  string trace_dir;
+  if (!args.empty() && (!parse_optional_trace_dir(args, &trace_dir) ||
+                        !args.empty())) {
+    print_help(stderr);
+    return 1;
+  }
+
+  if (!flags.jobs) {
+    flags.jobs = flags.cpu_unbound ? get_num_cpus() : 1;
+  }
+  if (flags.jobs > 1 && !flags.cpu_unbound) {
+    fprintf(stderr, "rr: --jobs requires --cpu-unbound.\n");
+    return 1;
+  }
+
+  assert_prerequisites();
+  int ret = value_history(trace_dir, MemoryRange(addr, length), flags);
+  check_for_leaks();
+  return ret;
+}
+
+} // namespace rr
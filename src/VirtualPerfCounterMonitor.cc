@@ -18,6 +18,9 @@ std::map<TaskUid, VirtualPerfCounterMonitor*>
     VirtualPerfCounterMonitor::tasks_with_interrupts =
         std::map<TaskUid, VirtualPerfCounterMonitor*>();
 
+std::vector<VirtualPerfCounterMonitor::MappedPage>
+    VirtualPerfCounterMonitor::mapped_pages;
+
 bool VirtualPerfCounterMonitor::should_virtualize(
     const struct perf_event_attr& attr) {
   return PerfCounters::is_rr_ticks_attr(attr);
@@ -37,7 +40,17 @@ VirtualPerfCounterMonitor::VirtualPerfCounterMonitor(
   }
 }
 
-VirtualPerfCounterMonitor::~VirtualPerfCounterMonitor() { disable_interrupt(); }
+VirtualPerfCounterMonitor::~VirtualPerfCounterMonitor() {
+  disable_interrupt();
+  // The pages stay mapped but stop counting, as far as the tracee can tell.
+  for (auto it = mapped_pages.begin(); it != mapped_pages.end();) {
+    if (it->monitor == this) {
+      it = mapped_pages.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
 
 bool VirtualPerfCounterMonitor::emulate_ioctl(RecordTask* t, uint64_t* result) {
   switch ((int)t->regs().arg2()) {
@@ -168,4 +181,91 @@ VirtualPerfCounterMonitor::interrupting_virtual_pmc_for_task(Task* t) {
   return found->second;
 }
 
+/* static */
+bool VirtualPerfCounterMonitor::supports_mmap(size_t length, uint64_t offset) {
+  return offset == 0 && length > 0 && length <= page_size();
+}
+
+void VirtualPerfCounterMonitor::did_mmap(RecordTask* t,
+                                         remote_ptr<void> addr) {
+  t->vm()->mapping_flags_of(addr) |=
+      AddressSpace::Mapping::IS_VIRTUAL_PERF_COUNTER_PAGE;
+  MappedPage page = { t->vm()->uid(), addr, this, 0, -1 };
+  if (write_mmapped_page(t, page)) {
+    mapped_pages.push_back(page);
+  }
+}
+
+bool VirtualPerfCounterMonitor::write_mmapped_page(RecordTask* t,
+                                                   MappedPage& page) {
+  if (!t->vm()->has_mapping(page.addr) ||
+      !(t->vm()->mapping_flags_of(page.addr) &
+        AddressSpace::Mapping::IS_VIRTUAL_PERF_COUNTER_PAGE)) {
+    return false;
+  }
+  RecordTask* target = t->session().find_task(target_tuid());
+  if (!target) {
+    return true;
+  }
+  int64_t value = target->tick_count() - initial_ticks;
+  if (value == page.value) {
+    return true;
+  }
+
+  // Only rr writes the page and tracees don't run while we do, so |lock|
+  // just needs to change for readers that raced with an earlier update.
+  struct perf_event_mmap_page header;
+  size_t header_size = offsetof(struct perf_event_mmap_page, pmc_width);
+  memset(&header, 0, header_size);
+  page.lock += 2;
+  page.value = value;
+  header.lock = page.lock;
+  header.index = 0;
+  header.offset = value;
+  header.time_enabled = value;
+  header.time_running = value;
+  header.cap_bit0_is_deprecated = 1;
+  bool ok = true;
+  t->write_bytes_helper(page.addr, header_size, &header, &ok);
+  if (!ok) {
+    return false;
+  }
+  t->record_local(page.addr, header_size, &header);
+  return true;
+}
+
+/* static */
+void VirtualPerfCounterMonitor::did_fork_into(Task* parent,
+                                              RecordTask* child) {
+  AddressSpaceUid vm = parent->vm()->uid();
+  // Appending invalidates iterators, and the copies mustn't be revisited.
+  size_t count = mapped_pages.size();
+  for (size_t i = 0; i < count; ++i) {
+    MappedPage page = mapped_pages[i];
+    if (!(page.vm == vm) || !child->vm()->has_mapping(page.addr) ||
+        !(child->vm()->mapping_flags_of(page.addr) &
+          AddressSpace::Mapping::IS_VIRTUAL_PERF_COUNTER_PAGE)) {
+      continue;
+    }
+    // The child's copy of the page starts out with the parent's contents.
+    page.vm = child->vm()->uid();
+    mapped_pages.push_back(page);
+  }
+}
+
+/* static */
+void VirtualPerfCounterMonitor::update_mmapped_pages(RecordTask* t) {
+  if (mapped_pages.empty()) {
+    return;
+  }
+  AddressSpaceUid vm = t->vm()->uid();
+  for (auto it = mapped_pages.begin(); it != mapped_pages.end();) {
+    if (it->vm == vm && !it->monitor->write_mmapped_page(t, *it)) {
+      it = mapped_pages.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
 } // namespace rr
@@ -14,6 +14,12 @@ namespace rr {
  * A FileMonitor to virtualize the performance counter that rr uses to count
  * ticks. Note that this doesn't support interrupts yet so recording rr replays
  * that involve async signals will not work!
+ *
+ * The tracee can mmap the counter's perf_event_mmap_page. It gets an
+ * anonymous page that rr refreshes at syscall exits, with the count in
+ * |offset| and |index| 0, so readers following the documented lock/offset
+ * protocol get the count without a syscall. The page isn't updated while the
+ * tracee runs, so the count is as of the last traced syscall.
  */
 class VirtualPerfCounterMonitor : public FileMonitor {
 public:
@@ -43,7 +49,40 @@ public:
 
   static VirtualPerfCounterMonitor* interrupting_virtual_pmc_for_task(Task* t);
 
+  /**
+   * Whether an mmap of |length| bytes at |offset| of a virtual counter fd
+   * can be emulated. Only the metadata page is supported, not a sample
+   * buffer.
+   */
+  static bool supports_mmap(size_t length, uint64_t offset);
+  /**
+   * Called during recording after the anonymous page standing in for this
+   * counter's perf_event_mmap_page has been mapped at |addr|.
+   */
+  void did_mmap(RecordTask* t, remote_ptr<void> addr);
+  /**
+   * Refresh the counter pages mapped in |t|'s address space. Called during
+   * recording at syscall exits; the writes are recorded.
+   */
+  static void update_mmapped_pages(RecordTask* t);
+  /**
+   * |child| just forked from |parent|'s address space. Keep refreshing the
+   * child's copies of the counter pages; like the kernel's, they go on
+   * showing the counter's count.
+   */
+  static void did_fork_into(Task* parent, RecordTask* child);
+
 private:
+  struct MappedPage {
+    AddressSpaceUid vm;
+    remote_ptr<void> addr;
+    VirtualPerfCounterMonitor* monitor;
+    uint32_t lock;
+    int64_t value;
+  };
+  // Returns false if the page is no longer mapped.
+  bool write_mmapped_page(RecordTask* t, MappedPage& page);
+
   void maybe_enable_interrupt(Task* t, uint64_t after);
   void disable_interrupt() const;
 
@@ -56,6 +95,7 @@ private:
   bool enabled;
 
   static std::map<TaskUid, VirtualPerfCounterMonitor*> tasks_with_interrupts;
+  static std::vector<MappedPage> mapped_pages;
 };
 
 } // namespace rr
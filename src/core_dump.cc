@@ -0,0 +1,378 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "core_dump.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/procfs.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <sstream>
+#include <vector>
+
+#include "AddressSpace.h"
+#include "ExtraRegisters.h"
+#include "ScopedFd.h"
+#include "Task.h"
+#include "ThreadGroup.h"
+#include "log.h"
+#include "util.h"
+
+using namespace std;
+
+namespace rr {
+
+// Bytes read from the tracee per pread
+static const size_t CORE_CHUNK_SIZE = 1024 * 1024;
+
+struct CoreSegment {
+  uint64_t start;
+  uint64_t size;
+  // Where the segment's data starts in the core file
+  uint64_t file_offset;
+  // Whether to read the segment at all
+  bool readable;
+  // Private anonymous memory, whose unpopulated pages can be skipped
+  bool anonymous;
+};
+
+static void append_note(vector<uint8_t>& notes, uint32_t type,
+                        const void* desc, size_t desc_size) {
+  static const char name[] = "CORE";
+  Elf64_Nhdr nhdr;
+  nhdr.n_namesz = sizeof(name);
+  nhdr.n_descsz = desc_size;
+  nhdr.n_type = type;
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(&nhdr);
+  notes.insert(notes.end(), p, p + sizeof(nhdr));
+  notes.insert(notes.end(), name, name + sizeof(name));
+  notes.resize((notes.size() + 3) & ~size_t(3));
+  p = static_cast<const uint8_t*>(desc);
+  notes.insert(notes.end(), p, p + desc_size);
+  notes.resize((notes.size() + 3) & ~size_t(3));
+}
+
+static void append_thread_notes(vector<uint8_t>& notes, Task* t) {
+  elf_prstatus prstatus;
+  memset(&prstatus, 0, sizeof(prstatus));
+  prstatus.pr_pid = t->rec_tid;
+  prstatus.pr_ppid = 0;
+  prstatus.pr_pgrp = t->tgid();
+  auto regs = t->regs().get_ptrace();
+  static_assert(sizeof(regs) == sizeof(prstatus.pr_reg),
+                "user_regs_struct doesn't match elf_gregset_t");
+  memcpy(&prstatus.pr_reg, &regs, sizeof(regs));
+  append_note(notes, NT_PRSTATUS, &prstatus, sizeof(prstatus));
+
+  const ExtraRegisters* extra = t->extra_regs_fallible();
+  if (!extra || extra->empty()) {
+    return;
+  }
+  switch (extra->format()) {
+    case ExtraRegisters::XSAVE: {
+      // The first 512 bytes are the FXSAVE area, which is what NT_FPREGSET
+      // holds; the full area goes in NT_X86_XSTATE as the kernel does.
+      static const int FXSAVE_SIZE = 512;
+      if (extra->data_size() >= FXSAVE_SIZE) {
+        append_note(notes, NT_FPREGSET, extra->data_bytes(), FXSAVE_SIZE);
+      }
+      if (extra->data_size() > FXSAVE_SIZE) {
+        append_note(notes, NT_X86_XSTATE, extra->data_bytes(),
+                    extra->data_size());
+      }
+      break;
+    }
+    case ExtraRegisters::NT_FPR:
+      append_note(notes, NT_FPREGSET, extra->data_bytes(), extra->data_size());
+      break;
+    default:
+      break;
+  }
+}
+
+static vector<uint8_t> build_notes(Task* t,
+                                   const vector<const AddressSpace::Mapping*>&
+                                       file_maps) {
+  vector<uint8_t> notes;
+
+  elf_prpsinfo prpsinfo;
+  memset(&prpsinfo, 0, sizeof(prpsinfo));
+  prpsinfo.pr_pid = t->tgid();
+  prpsinfo.pr_pgrp = t->tgid();
+  const string& exe = t->vm()->exe_image();
+  size_t slash = exe.rfind('/');
+  string fname = slash == string::npos ? exe : exe.substr(slash + 1);
+  strncpy(prpsinfo.pr_fname, fname.c_str(), sizeof(prpsinfo.pr_fname) - 1);
+  strncpy(prpsinfo.pr_psargs, exe.c_str(), sizeof(prpsinfo.pr_psargs) - 1);
+  append_note(notes, NT_PRPSINFO, &prpsinfo, sizeof(prpsinfo));
+
+  // The current task goes first so debuggers select it.
+  append_thread_notes(notes, t);
+  for (Task* other : t->thread_group()->task_set()) {
+    if (other != t) {
+      append_thread_notes(notes, other);
+    }
+  }
+
+  const vector<uint8_t>& auxv = t->vm()->saved_auxv();
+  if (!auxv.empty()) {
+    append_note(notes, NT_AUXV, auxv.data(), auxv.size());
+  }
+
+  // NT_FILE: count, page size, (start, end, page offset) triples, then the
+  // NUL-terminated names.
+  vector<uint64_t> header;
+  header.push_back(file_maps.size());
+  header.push_back(page_size());
+  string names;
+  for (auto m : file_maps) {
+    header.push_back(m->map.start().as_int());
+    header.push_back(m->map.end().as_int());
+    header.push_back(m->recorded_map.file_offset_bytes() / page_size());
+    names += m->recorded_map.fsname();
+    names.push_back('\0');
+  }
+  vector<uint8_t> file_note(header.size() * sizeof(uint64_t) + names.size());
+  memcpy(file_note.data(), header.data(), header.size() * sizeof(uint64_t));
+  memcpy(file_note.data() + header.size() * sizeof(uint64_t), names.data(),
+         names.size());
+  append_note(notes, NT_FILE, file_note.data(), file_note.size());
+  return notes;
+}
+
+struct CoreWriter {
+  int mem_fd;
+  int out_fd;
+  string pagemap_path;
+  const vector<CoreSegment>* segments;
+  atomic<size_t> next_segment;
+  atomic<bool> write_failed;
+  // errno of the failed write, which happened on some other thread
+  atomic<int> write_errno;
+};
+
+static void write_segment(CoreWriter& w, const ScopedFd& pagemap,
+                          const CoreSegment& seg, vector<uint8_t>& buf,
+                          vector<uint64_t>& page_bits) {
+  size_t page = page_size();
+  for (uint64_t done = 0; done < seg.size;) {
+    size_t size = min<uint64_t>(seg.size - done, CORE_CHUNK_SIZE);
+    size_t pages = size / page;
+    uint64_t addr = seg.start + done;
+    bool check_present = false;
+    if (seg.anonymous && pagemap.is_open()) {
+      page_bits.resize(pages);
+      ssize_t n = pread64(pagemap, page_bits.data(), pages * sizeof(uint64_t),
+                          (addr / page) * sizeof(uint64_t));
+      if (n == ssize_t(pages * sizeof(uint64_t))) {
+        check_present = true;
+        bool any = false;
+        for (uint64_t bits : page_bits) {
+          // Bit 63: present, bit 62: swapped
+          if (bits & (3ULL << 62)) {
+            any = true;
+            break;
+          }
+        }
+        if (!any) {
+          done += size;
+          continue;
+        }
+      }
+    }
+
+    buf.resize(size);
+    ssize_t nread = pread64(w.mem_fd, buf.data(), size, addr);
+    if (nread < ssize_t(size)) {
+      // Unreadable memory (e.g. beyond the end of a mapped file) stays zero.
+      memset(buf.data() + max<ssize_t>(nread, 0), 0,
+             size - max<ssize_t>(nread, 0));
+    }
+
+    // Write runs of pages that are present and nonzero; everything else is
+    // left as a hole.
+    size_t run_start = 0;
+    size_t run_pages = 0;
+    for (size_t i = 0; i <= pages; ++i) {
+      bool keep = false;
+      if (i < pages) {
+        const uint8_t* p = buf.data() + i * page;
+        keep = !(check_present && !(page_bits[i] & (3ULL << 62))) &&
+               (p[0] || memcmp(p, p + 1, page - 1));
+      }
+      if (keep) {
+        if (!run_pages) {
+          run_start = i;
+        }
+        ++run_pages;
+        continue;
+      }
+      if (run_pages) {
+        size_t len = run_pages * page;
+        if (pwrite_all_fallible(w.out_fd, buf.data() + run_start * page, len,
+                                seg.file_offset + done + run_start * page) <
+            ssize_t(len)) {
+          w.write_errno = errno;
+          w.write_failed = true;
+          return;
+        }
+        run_pages = 0;
+      }
+    }
+    done += size;
+  }
+}
+
+static void* core_writer_thread(void* p) {
+  CoreWriter& w = *static_cast<CoreWriter*>(p);
+  ScopedFd pagemap(w.pagemap_path.c_str(), O_RDONLY | O_CLOEXEC);
+  vector<uint8_t> buf;
+  vector<uint64_t> page_bits;
+  while (!w.write_failed) {
+    size_t i = w.next_segment++;
+    if (i >= w.segments->size()) {
+      break;
+    }
+    const CoreSegment& seg = (*w.segments)[i];
+    if (seg.readable) {
+      write_segment(w, pagemap, seg, buf, page_bits);
+    }
+  }
+  return nullptr;
+}
+
+bool write_core_dump(Task* t, const string& path, string* error) {
+  if (sizeof(void*) != 8 || t->arch() != NativeArch::arch()) {
+    *error = "Core dumps are only supported for 64-bit tracees of rr's "
+             "native architecture";
+    return false;
+  }
+
+  vector<CoreSegment> segments;
+  vector<const AddressSpace::Mapping*> file_maps;
+  vector<Elf64_Phdr> phdrs;
+  for (const auto& m : t->vm()->maps()) {
+    const KernelMapping& km = m.map;
+    if (km.fsname().find("[vvar") == 0 || km.is_vsyscall()) {
+      continue;
+    }
+    Elf64_Phdr phdr;
+    memset(&phdr, 0, sizeof(phdr));
+    phdr.p_type = PT_LOAD;
+    phdr.p_vaddr = km.start().as_int();
+    phdr.p_memsz = km.size();
+    phdr.p_filesz = (km.prot() & PROT_READ) ? km.size() : 0;
+    phdr.p_flags = ((km.prot() & PROT_READ) ? PF_R : 0) |
+                   ((km.prot() & PROT_WRITE) ? PF_W : 0) |
+                   ((km.prot() & PROT_EXEC) ? PF_X : 0);
+    phdr.p_align = page_size();
+    phdrs.push_back(phdr);
+    segments.push_back({ km.start().as_int(), phdr.p_filesz, 0,
+                         phdr.p_filesz > 0,
+                         km.inode() == 0 && !(km.flags() & MAP_SHARED) });
+    if (m.recorded_map.inode() != 0 && !m.recorded_map.fsname().empty()) {
+      file_maps.push_back(&m);
+    }
+  }
+  if (phdrs.size() + 1 >= PN_XNUM) {
+    *error = "Too many mappings for a core file";
+    return false;
+  }
+
+  vector<uint8_t> notes = build_notes(t, file_maps);
+
+  Elf64_Ehdr ehdr;
+  memset(&ehdr, 0, sizeof(ehdr));
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+  ehdr.e_type = ET_CORE;
+#if defined(__x86_64__)
+  ehdr.e_machine = EM_X86_64;
+#elif defined(__aarch64__)
+  ehdr.e_machine = EM_AARCH64;
+#endif
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_phoff = sizeof(ehdr);
+  ehdr.e_ehsize = sizeof(ehdr);
+  ehdr.e_phentsize = sizeof(Elf64_Phdr);
+  ehdr.e_phnum = phdrs.size() + 1;
+
+  Elf64_Phdr note_phdr;
+  memset(&note_phdr, 0, sizeof(note_phdr));
+  note_phdr.p_type = PT_NOTE;
+  note_phdr.p_offset = sizeof(ehdr) + ehdr.e_phnum * sizeof(Elf64_Phdr);
+  note_phdr.p_filesz = notes.size();
+  note_phdr.p_align = 4;
+  phdrs.insert(phdrs.begin(), note_phdr);
+
+  uint64_t offset = ceil_page_size(note_phdr.p_offset + notes.size());
+  for (size_t i = 0; i < segments.size(); ++i) {
+    phdrs[i + 1].p_offset = offset;
+    segments[i].file_offset = offset;
+    offset += segments[i].size;
+  }
+
+  ScopedFd out(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (!out.is_open()) {
+    *error = "Can't create " + path + ": " + strerror(errno);
+    return false;
+  }
+  size_t phdrs_size = phdrs.size() * sizeof(Elf64_Phdr);
+  if (pwrite_all_fallible(out, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+      pwrite_all_fallible(out, phdrs.data(), phdrs_size, sizeof(ehdr)) !=
+          ssize_t(phdrs_size) ||
+      pwrite_all_fallible(out, notes.data(), notes.size(),
+                          note_phdr.p_offset) != ssize_t(notes.size()) ||
+      ftruncate(out, offset) < 0) {
+    *error = "Can't write " + path + ": " + strerror(errno);
+    return false;
+  }
+
+  CoreWriter w;
+  w.mem_fd = t->vm()->mem_fd();
+  w.out_fd = out;
+  stringstream pagemap_path;
+  pagemap_path << "/proc/" << t->tid << "/pagemap";
+  w.pagemap_path = pagemap_path.str();
+  w.segments = &segments;
+  w.next_segment = 0;
+  w.write_failed = false;
+  w.write_errno = 0;
+
+  // Like the compression threads, the writers must not take our signals.
+  size_t nthreads = min<size_t>(max(get_num_cpus(), 1), segments.size());
+  vector<pthread_t> threads;
+  sigset_t set;
+  sigset_t old_mask;
+  sigfillset(&set);
+  sigprocmask(SIG_BLOCK, &set, &old_mask);
+  for (size_t i = 1; i < nthreads; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, core_writer_thread, &w)) {
+      break;
+    }
+    threads.push_back(thread);
+  }
+  sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+  core_writer_thread(&w);
+  for (pthread_t thread : threads) {
+    pthread_join(thread, nullptr);
+  }
+
+  if (w.write_failed) {
+    *error = "Can't write " + path + ": " + strerror(w.write_errno);
+    return false;
+  }
+  LOG(debug) << "Wrote core dump " << path << " with " << segments.size()
+             << " segments";
+  return true;
+}
+
+} // namespace rr
@@ -0,0 +1,25 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_CORE_DUMP_H_
+#define RR_CORE_DUMP_H_
+
+#include <string>
+
+namespace rr {
+
+class Task;
+
+/**
+ * Write an ELF core file for |t|'s process in its current state to |path|,
+ * with |t| as the current thread. Memory is read in bulk from
+ * /proc/<pid>/mem, one mapping at a time per thread, using all CPUs.
+ * Anonymous pages that were never populated (per /proc/<pid>/pagemap) and
+ * pages of zeroes are left as holes, so the file is sparse.
+ * Only supported for tracees of rr's native architecture. Returns false and
+ * sets |*error| on failure.
+ */
+bool write_core_dump(Task* t, const std::string& path, std::string* error);
+
+} // namespace rr
+
+#endif /* RR_CORE_DUMP_H_ */
@@ -347,6 +347,7 @@ FastForwardStatus fast_forward_through_instruction(Task* t, ResumeRequest how,
     // so we must have the IP of the string instruction.
     tmp.set_ip(r.ip());
     t->set_regs(tmp);
+    result.iterations = iterations_performed;
 
     LOG(debug) << "x86-string fast-forward done; ip()==" << t->ip();
     // Fake singlestep status for trap diagnosis
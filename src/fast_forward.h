@@ -12,16 +12,20 @@ namespace rr {
 class Registers;
 
 struct FastForwardStatus {
-  FastForwardStatus() : did_fast_forward(false), incomplete_fast_forward(false) {}
+  FastForwardStatus()
+      : did_fast_forward(false), incomplete_fast_forward(false), iterations(0) {}
   FastForwardStatus(const FastForwardStatus& other) = default;
   FastForwardStatus& operator=(const FastForwardStatus& other) = default;
   FastForwardStatus& operator|=(const FastForwardStatus& other) {
     did_fast_forward |= other.did_fast_forward;
     incomplete_fast_forward |= other.incomplete_fast_forward;
+    iterations += other.iterations;
     return *this;
   }
   bool did_fast_forward;
   bool incomplete_fast_forward;
+  // Number of string instruction iterations we fast-forwarded through.
+  uint64_t iterations;
 };
 
 /**
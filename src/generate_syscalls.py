@@ -42,23 +42,41 @@ def write_syscall_enum_for_tests(f, arch):
     f.write("};\n")
     f.write("\n")
 
-def write_syscallname_arch(f):
-    f.write("template <typename Arch> static std::string syscallname_arch(int syscall);\n")
+def syscall_table_flags(name, obj):
+    flags = []
+    if isinstance(obj, syscalls.UnsupportedSyscall):
+        flags.append("SYSCALL_UNSUPPORTED")
+    if isinstance(obj, (syscalls.EmulatedSyscall, syscalls.IrregularEmulatedSyscall)):
+        flags.append("SYSCALL_EMULATED")
+    if isinstance(obj, syscalls.RegularSyscall):
+        flags.append("SYSCALL_REGULAR")
+    if isinstance(obj, syscalls.RestartSyscall):
+        flags.append("SYSCALL_RESTART")
+    if name in ("sigreturn", "rt_sigreturn"):
+        flags.append("SYSCALL_SIGRETURN")
+    return " | ".join(flags) if flags else "0"
+
+def write_syscall_table(f):
+    f.write("template <typename Arch> static const SyscallTable& syscall_table_arch();\n")
     f.write("\n");
     for specializer, arch in [("X86Arch", "x86"), ("X64Arch", "x64"), ("ARM64Arch", "generic")]:
-        f.write("template <> std::string syscallname_arch<%s>(int syscall) {\n" % specializer)
-        f.write("  switch (syscall) {\n");
-        def write_case(name):
-            f.write("    case %(specializer)s::%(syscall)s: return \"%(syscall)s\";\n"
-                    % { 'specializer': specializer, 'syscall': name })
-        for name, _ in syscalls.for_arch(arch):
-            write_case(name)
-        f.write("    default: {")
-        f.write("      char buf[100];")
-        f.write("      sprintf(buf, \"<unknown-syscall-%d>\", syscall);")
-        f.write("      return buf;\n")
-        f.write("    }\n")
-        f.write("  }\n")
+        by_number = {}
+        for name, obj in syscalls.for_arch(arch):
+            by_number[getattr(obj, arch)] = (name, obj)
+        count = max(by_number.keys()) + 1
+        f.write("static constexpr SyscallInfo syscall_table_entries_%s[%d] = {\n"
+                % (specializer, count))
+        for number in range(count):
+            if number in by_number:
+                name, obj = by_number[number]
+                f.write("  { \"%s\", %s },\n" % (name, syscall_table_flags(name, obj)))
+            else:
+                f.write("  { nullptr, 0 },\n")
+        f.write("};\n")
+        f.write("template <> const SyscallTable& syscall_table_arch<%s>() {\n" % specializer)
+        f.write("  static constexpr SyscallTable table = { syscall_table_entries_%s, %d };\n"
+                % (specializer, count))
+        f.write("  return table;\n")
         f.write("}\n")
         f.write("\n")
 
@@ -154,7 +172,7 @@ generators_for = {
     'SyscallEnumsForTestsX86': lambda f: write_syscall_enum_for_tests(f, 'x86'),
     'SyscallEnumsForTestsX64': lambda f: write_syscall_enum_for_tests(f, 'x64'),
     'SyscallEnumsForTestsGeneric': lambda f: write_syscall_enum_for_tests(f, 'generic'),
-    'SyscallnameArch': write_syscallname_arch,
+    'SyscallTable': write_syscall_table,
     'SyscallRecordCase': write_syscall_record_cases,
     'SyscallHelperFunctions': write_syscall_helper_functions,
 }
@@ -1819,6 +1819,17 @@ struct BaseArch : public wordsize,
       ptr64<__u32> link_attach_flags;
       __u64 revision;
     } query;
+
+    struct { /* struct used by BPF_MAP_*_BATCH commands */
+      ptr64<void> in_batch;
+      ptr64<void> out_batch;
+      ptr64<void> keys;
+      ptr64<void> values;
+      __u32 count;
+      __u32 map_fd;
+      __u64 elem_flags;
+      __u64 flags;
+    } batch;
   };
 
   struct file_handle {
@@ -1840,6 +1851,10 @@ struct BaseArch : public wordsize,
   struct r_debug {
     int r_version;
     ptr<link_map> r_map;
+    ptr<void> r_brk;
+    enum { RT_CONSISTENT = 0, RT_ADD = 1, RT_DELETE = 2 };
+    // RT_CONSISTENT except while the dynamic linker is changing r_map
+    int r_state;
     // More fields we don't need (and are potentially libc specific)
   };
 
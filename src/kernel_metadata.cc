@@ -18,10 +18,21 @@ using namespace std;
 
 namespace rr {
 
-#include "SyscallnameArch.generated"
+#include "SyscallTable.generated"
+
+const SyscallTable& syscall_table(SupportedArch arch) {
+  RR_ARCH_FUNCTION(syscall_table_arch, arch)
+}
 
 string syscall_name(int syscall, SupportedArch arch) {
-  RR_ARCH_FUNCTION(syscallname_arch, arch, syscall)
+  const SyscallTable& table = syscall_table(arch);
+  if (syscall >= 0 && (size_t)syscall < table.count &&
+      table.entries[syscall].name) {
+    return table.entries[syscall].name;
+  }
+  char buf[100];
+  sprintf(buf, "<unknown-syscall-%d>", syscall);
+  return buf;
 }
 
 #define CASE(_id)                                                              \
@@ -175,11 +186,6 @@ string signal_name(int sig) {
   }
 }
 
-bool is_sigreturn(int syscallno, SupportedArch arch) {
-  return is_sigreturn_syscall(syscallno, arch) ||
-         is_rt_sigreturn_syscall(syscallno, arch);
-}
-
 const char *errno_name_cstr(int err) {
   switch (err) {
     case 0:
@@ -24,6 +24,47 @@ std::string arch_name(SupportedArch arch);
  */
 std::string syscall_name(int syscall, SupportedArch arch);
 
+/**
+ * Classification bits for a syscall number, from syscalls.py.
+ */
+enum SyscallFlags {
+  // UnsupportedSyscall or InvalidSyscall.
+  SYSCALL_UNSUPPORTED = 1 << 0,
+  // EmulatedSyscall or IrregularEmulatedSyscall.
+  SYSCALL_EMULATED = 1 << 1,
+  // RegularSyscall: its outparams are recorded by SyscallRecordCase.
+  SYSCALL_REGULAR = 1 << 2,
+  SYSCALL_RESTART = 1 << 3,
+  SYSCALL_SIGRETURN = 1 << 4
+};
+
+struct SyscallInfo {
+  const char* name;
+  uint32_t flags;
+};
+
+/**
+ * Dense per-architecture table indexed by syscall number. Numbers that
+ * don't exist on the architecture have a null |name|.
+ */
+struct SyscallTable {
+  const SyscallInfo* entries;
+  size_t count;
+};
+
+const SyscallTable& syscall_table(SupportedArch arch);
+
+/**
+ * Return the SyscallFlags of |syscall|, or 0 if it's unknown.
+ */
+inline uint32_t syscall_flags(int syscall, SupportedArch arch) {
+  const SyscallTable& table = syscall_table(arch);
+  if (syscall < 0 || (size_t)syscall >= table.count) {
+    return 0;
+  }
+  return table.entries[syscall].flags;
+}
+
 /**
  * Return the symbolic name of the PTRACE_EVENT_* |event|, or
  * "PTRACE_EVENT(%d)" if unknown.
@@ -46,7 +87,9 @@ std::string signal_name(int sig);
 /**
  * Return true if this is some kind of sigreturn syscall.
  */
-bool is_sigreturn(int syscall, SupportedArch arch);
+inline bool is_sigreturn(int syscall, SupportedArch arch) {
+  return syscall_flags(syscall, arch) & SYSCALL_SIGRETURN;
+}
 
 /**
  * Return the symbolic error name (e.g. "EINVAL") for errno.
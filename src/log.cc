@@ -18,6 +18,7 @@
 #include "RecordSession.h"
 #include "ReplaySession.h"
 #include "ReplayTask.h"
+#include "StdioMonitor.h"
 #include "core.h"
 #include "ftrace.h"
 #include "kernel_abi.h"
@@ -415,6 +416,8 @@ NewlineTerminatingOstream::~NewlineTerminatingOstream() {
 CleanFatalOstream::CleanFatalOstream(const char* file, int line,
                                      const char* function) {
   errno = 0;
+  // Echoed tracee output came first, and we're not going to return to it.
+  StdioMonitor::flush_echoed_output();
   write_prefix(*this, LOG_fatal, file, line, function);
 }
 
@@ -426,6 +429,7 @@ CleanFatalOstream::~CleanFatalOstream() {
 }
 
 FatalOstream::FatalOstream(const char* file, int line, const char* function) {
+  StdioMonitor::flush_echoed_output();
   write_prefix(*this, LOG_fatal, file, line, function);
 }
 
@@ -501,6 +505,7 @@ EmergencyDebugOstream::EmergencyDebugOstream(bool cond, const Task* t,
                                              const char* cond_str)
     : t(const_cast<Task*>(t)), cond(cond) {
   if (!cond) {
+    StdioMonitor::flush_echoed_output();
     write_prefix(*this, LOG_fatal, file, line, function);
     *this << "\n (task " << t->tid << " (rec:" << t->rec_tid << ") at time "
           << t->trace_time() << ")"
@@ -90,6 +90,10 @@ void print_global_options(FILE* out) {
       "Environment variables:\n"
       " $RR_LOG        logging configuration ; e.g. RR_LOG=all:warn,Task:debug\n"
       " $RR_TMPDIR     to use a different TMPDIR than the recorded program\n"
+      " $RR_MAPPED_DATA_CACHE\n"
+      "                directory where replays share the contents of mapped\n"
+      "                files saved in the trace; the oldest files are\n"
+      "                removed once it holds more than 4GB\n"
       " $_RR_TRACE_DIR where traces will be stored;\n"
       "                falls back to $XDG_DATA_HOME / $HOME/.local/share/rr\n",
       out);
@@ -0,0 +1,28 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BATCH 8
+
+int main(void) {
+  int fds[2];
+  char bufs[BATCH][64];
+  struct iovec iovs[BATCH];
+  struct mmsghdr msgs[BATCH];
+
+  socketpair(AF_UNIX, SOCK_DGRAM, 0, fds);
+
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < BATCH; ++i) {
+    iovs[i].iov_base = bufs[i];
+    iovs[i].iov_len = sizeof(bufs[i]);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  for (int i = 0; i < 100000; ++i) {
+    sendmmsg(fds[0], msgs, BATCH, 0);
+    recvmmsg(fds[1], msgs, BATCH, 0, NULL);
+  }
+  return 0;
+}
@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+"""Run the src/perf-test workloads under rr and print the results as JSON.
+
+Usage: bench.py [-o <file>] [-r <repeats>] [-w <workload>]... <rr-objdir>
+
+For each workload this measures the native run time, record time and
+overhead, trace size and bytes written per second of recording, autopilot
+replay time, and, driving gdb, the time to create and restore a checkpoint
+and the latency of a reverse-continue over the whole recording. Times are
+the median over the repeats. Metrics that couldn't be measured (e.g.
+because gdb isn't installed) are null.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+# name -> (workload class, arguments)
+WORKLOADS = {
+    'unbuffered-syscalls': ('syscall', []),
+    'batched-syscalls': ('syscall', []),
+    'many-threads': ('thread', []),
+    'many-threads-wake': ('thread', ['2000', '20000']),
+    'mprotect-storm': ('mmap', ['20000', '100000']),
+    'signal-storm': ('signal', []),
+    'sigprof-loop': ('signal', []),
+    'exec-chain': ('exec', []),
+    'big-memory': ('checkpoint', []),
+}
+
+# Runs in gdb after rr's own setup. Stops at main, times a checkpoint,
+# runs to the end of the recording with breakpoints disabled, times a
+# reverse-continue back to main and then restoring the checkpoint.
+GDB_SCRIPT = r'''
+python
+import time
+def rr_bench_timed(label, cmd):
+    start = time.monotonic()
+    gdb.execute(cmd, to_string=True)
+    print("rr-bench %s %f" % (label, time.monotonic() - start))
+try:
+    gdb.execute("break main", to_string=True)
+    gdb.execute("continue", to_string=True)
+    rr_bench_timed("checkpoint", "checkpoint")
+    gdb.execute("disable", to_string=True)
+    gdb.execute("continue", to_string=True)
+    gdb.execute("enable", to_string=True)
+    rr_bench_timed("reverse_continue", "reverse-continue")
+    rr_bench_timed("restart_checkpoint", "restart 1")
+except gdb.error as e:
+    print("rr-bench error %s" % e)
+end
+'''
+
+def timed_run(cmd, env):
+    start = time.monotonic()
+    ret = subprocess.call(cmd, env=env, stdout=subprocess.DEVNULL,
+                          stderr=subprocess.DEVNULL)
+    elapsed = time.monotonic() - start
+    if ret != 0:
+        raise RuntimeError('%s exited with status %d' % (' '.join(cmd), ret))
+    return elapsed
+
+def dir_size(path):
+    total = 0
+    for root, _, files in os.walk(path):
+        for f in files:
+            total += os.path.getsize(os.path.join(root, f))
+    return total
+
+def gdb_timings(rr, trace, env, script):
+    if not shutil.which('gdb'):
+        return {}
+    out = subprocess.run([rr, 'replay', '-o-n', '-o-batch', '-x', script,
+                          trace],
+                         env=env, stdin=subprocess.DEVNULL,
+                         stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                         universal_newlines=True).stdout
+    result = {}
+    for line in out.splitlines():
+        words = line.split()
+        if len(words) == 3 and words[0] == 'rr-bench' and words[1] != 'error':
+            result[words[1]] = float(words[2])
+    return result
+
+def run_once(objdir, name, args, script):
+    rr = os.path.join(objdir, 'bin', 'rr')
+    exe = [os.path.join(objdir, 'bin', name)] + args
+    d = tempfile.mkdtemp(prefix='rr-bench-')
+    try:
+        env = dict(os.environ)
+        env['_RR_TRACE_DIR'] = d
+        trace = os.path.join(d, 'trace')
+        result = {}
+        result['native_seconds'] = timed_run(exe, env)
+        result['record_seconds'] = timed_run(
+            [rr, 'record', '-o', trace] + exe, env)
+        result['trace_bytes'] = dir_size(trace)
+        result['replay_seconds'] = timed_run([rr, 'replay', '-a', trace], env)
+        gdb = gdb_timings(rr, trace, env, script)
+        for metric in ('checkpoint', 'restart_checkpoint', 'reverse_continue'):
+            result[metric + '_seconds'] = gdb.get(metric)
+        return result
+    finally:
+        shutil.rmtree(d)
+
+def median(values):
+    values = [v for v in values if v is not None]
+    return statistics.median(values) if values else None
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('objdir')
+    parser.add_argument('-o', '--output', help='write JSON here, not stdout')
+    parser.add_argument('-r', '--repeats', type=int, default=3)
+    parser.add_argument('-w', '--workload', action='append',
+                        choices=sorted(WORKLOADS),
+                        help='run only these workloads')
+    opts = parser.parse_args()
+
+    rr = os.path.join(opts.objdir, 'bin', 'rr')
+    version = subprocess.run([rr, '--version'], stdout=subprocess.PIPE,
+                             universal_newlines=True).stdout.strip()
+    script = tempfile.NamedTemporaryFile('w', prefix='rr-bench-',
+                                         suffix='.gdb')
+    script.write(GDB_SCRIPT)
+    script.flush()
+
+    workloads = {}
+    for name in opts.workload or sorted(WORKLOADS):
+        kind, args = WORKLOADS[name]
+        print('Running %s %s' % (name, ' '.join(args)), file=sys.stderr)
+        runs = [run_once(opts.objdir, name, args, script.name)
+                for _ in range(opts.repeats)]
+        result = {'class': kind, 'args': args}
+        for metric in runs[0]:
+            result[metric] = median([r[metric] for r in runs])
+        result['record_overhead'] = (
+            result['record_seconds'] / result['native_seconds']
+            if result['native_seconds'] else None)
+        result['trace_bytes_per_second'] = (
+            result['trace_bytes'] / result['record_seconds']
+            if result['record_seconds'] else None)
+        workloads[name] = result
+
+    report = {'rr_version': version, 'repeats': opts.repeats,
+              'workloads': workloads}
+    if opts.output:
+        with open(opts.output, 'w') as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+            f.write('\n')
+    else:
+        json.dump(report, sys.stdout, indent=2, sort_keys=True)
+        print()
+
+if __name__ == '__main__':
+    main()
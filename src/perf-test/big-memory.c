@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+  long mb = argc > 1 ? atol(argv[1]) : 1024;
+  long iterations = argc > 2 ? atol(argv[2]) : 1000;
+  size_t size = (size_t)mb * 1024 * 1024;
+  long page_size = sysconf(_SC_PAGESIZE);
+  char* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  /* Touch every page so checkpoints have real page tables to copy. */
+  for (size_t i = 0; i < size; i += page_size) {
+    p[i] = (char)i;
+  }
+  puts("Populated memory");
+  /* Then keep a few pages changing, with syscalls in between so replay
+     has places to checkpoint. */
+  for (long i = 0; i < iterations; ++i) {
+    p[((size_t)i * 7919 * page_size) % size] = (char)i;
+    getppid();
+  }
+  puts("Done");
+  return 0;
+}
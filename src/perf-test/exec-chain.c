@@ -0,0 +1,15 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+  long remaining = argc > 1 ? atol(argv[1]) : 200;
+  if (remaining <= 0) {
+    return 0;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%ld", remaining - 1);
+  execl("/proc/self/exe", argv[0], buf, (char*)NULL);
+  perror("execl");
+  return 1;
+}
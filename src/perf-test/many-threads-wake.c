@@ -1,10 +1,12 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <linux/futex.h>
 #include <sys/syscall.h>
 #include <pthread.h>
 #include <unistd.h>
 
 static volatile uint32_t futex_val;
+static volatile uint32_t ping_val;
 
 static void* do_thread(__attribute__((unused)) void* p) {
   if (futex_val == 0) {
@@ -16,13 +18,41 @@ static void* do_thread(__attribute__((unused)) void* p) {
   return NULL;
 }
 
-int main(void) {
-  for (int i = 0; i < 5000; ++i) {
+/* Bounce control with the main thread, so every step is a switch between
+   the two runnable tasks while all the other threads sit blocked. */
+static void* do_pong(void* p) {
+  int count = (int)(intptr_t)p;
+  for (int i = 0; i < count; ++i) {
+    while (ping_val != 1) {
+      syscall(SYS_futex, &ping_val, FUTEX_WAIT, 0, NULL);
+    }
+    ping_val = 0;
+    syscall(SYS_futex, &ping_val, FUTEX_WAKE, 1);
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 5000;
+  int pings = argc > 2 ? atoi(argv[2]) : 0;
+  for (int i = 0; i < threads; ++i) {
     pthread_t th;
     pthread_create(&th, NULL, do_thread, NULL);
     futex_val = 1;
     syscall(SYS_futex, &futex_val, FUTEX_WAKE, 1);
     syscall(SYS_futex, &futex_val, FUTEX_WAIT, 1, NULL);
   }
+  if (pings > 0) {
+    pthread_t th;
+    pthread_create(&th, NULL, do_pong, (void*)(intptr_t)pings);
+    for (int i = 0; i < pings; ++i) {
+      ping_val = 1;
+      syscall(SYS_futex, &ping_val, FUTEX_WAKE, 1);
+      while (ping_val != 0) {
+        syscall(SYS_futex, &ping_val, FUTEX_WAIT, 1, NULL);
+      }
+    }
+    pthread_join(th, NULL);
+  }
   return 0;
 }
@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+  long pages = argc > 1 ? atol(argv[1]) : 60000;
+  long iterations = argc > 2 ? atol(argv[2]) : 200000;
+  long page_size = sysconf(_SC_PAGESIZE);
+  char* p = mmap(NULL, pages * page_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  /* Split the region into one mapping per page by alternating protections,
+     the way a GC or JIT guarding its heap does. Stay below the default
+     vm.max_map_count (65530). */
+  for (long i = 0; i < pages; i += 2) {
+    mprotect(p + i * page_size, page_size, PROT_READ);
+  }
+  puts("Split mappings");
+  /* Now flip single pages back and forth. Each call splits a mapping and
+     the next one coalesces it again. */
+  unsigned int seed = 1;
+  for (long i = 0; i < iterations; ++i) {
+    long page = rand_r(&seed) % pages;
+    mprotect(p + page * page_size, page_size,
+             (page & 1) ? PROT_READ : PROT_READ | PROT_WRITE);
+    mprotect(p + page * page_size, page_size,
+             (page & 1) ? PROT_READ | PROT_WRITE : PROT_READ);
+  }
+  puts("Done");
+  return 0;
+}
@@ -0,0 +1,19 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+static volatile long handled;
+
+static void handler(__attribute__((unused)) int sig) { ++handled; }
+
+int main(int argc, char** argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 100000;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handler;
+  sigaction(SIGUSR1, &sa, NULL);
+  for (long i = 0; i < iterations; ++i) {
+    raise(SIGUSR1);
+  }
+  return handled == iterations ? 0 : 1;
+}
@@ -0,0 +1,29 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static volatile long handled;
+
+static void handler(__attribute__((unused)) int sig) { ++handled; }
+
+int main(int argc, char** argv) {
+  long signals = argc > 1 ? atol(argv[1]) : 5000;
+  long interval_us = argc > 2 ? atol(argv[2]) : 1000;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handler;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &sa, NULL);
+  struct itimerval timer = { { 0, interval_us }, { 0, interval_us } };
+  setitimer(ITIMER_PROF, &timer, NULL);
+  /* A tight loop, so the signals interrupt the same few instructions over
+     and over, the way a sampling profiler interrupts a hot loop. */
+  volatile unsigned long sum = 0;
+  while (handled < signals) {
+    for (int i = 0; i < 1000; ++i) {
+      sum += i;
+    }
+  }
+  return 0;
+}
@@ -108,6 +108,14 @@ static inline const char* extract_file_name(const char* s) {
 /* Size of table mapping fd numbers to syscallbuf-disabled flag. */
 #define SYSCALLBUF_FDS_DISABLED_SIZE 16384
 
+/* Number of monitored fds beyond the syscallbuf-disabled table that can be
+   listed individually. */
+#define SYSCALLBUF_HIGH_FDS_SIZE 256
+
+/* Number of BPF map fds whose key and value sizes can be given to the
+   syscallbuf. */
+#define SYSCALLBUF_BPF_MAPS_SIZE 64
+
 #define MPROTECT_RECORD_COUNT 1000
 
 #if defined(__x86_64__) || defined(__i386__)
@@ -230,6 +238,17 @@ struct mprotect_record {
   int32_t padding;
 };
 
+/**
+ * The key and value sizes of the BPF map open as |fd|, so the syscallbuf
+ * can size the outparams of map lookups. Must be arch-independent. Entries
+ * with key_size and value_size both 0 are unused.
+ */
+struct syscallbuf_bpf_map {
+  int32_t fd;
+  uint32_t key_size;
+  uint32_t value_size;
+};
+
 /**
  * Must be arch-independent.
  * Variables used to communicate between preload and rr.
@@ -268,7 +287,8 @@ struct preload_globals {
    * For each fd, indicate a class that is valid for all fds with the given
    * number in all tasks that share this address space. For fds >=
    * SYSCALLBUF_FDS_DISABLED_SIZE - 1, the class is given by by
-   * syscallbuf_fd_class[SYSCALLBUF_FDS_DISABLED_SIZE - 1]. See the
+   * syscallbuf_fd_class[SYSCALLBUF_FDS_DISABLED_SIZE - 1], unless that is
+   * FD_CLASS_UNTRACED: then it's given by syscallbuf_high_fds. See the
    */
   VOLATILE char syscallbuf_fd_class[SYSCALLBUF_FDS_DISABLED_SIZE];
 
@@ -298,6 +318,21 @@ struct preload_globals {
   unsigned char fdt_uniform;
   /* The CPU we're bound to, if any; -1 if not bound. Not read during replay. */
   int32_t cpu_binding;
+  /* The monitored fds >= SYSCALLBUF_FDS_DISABLED_SIZE - 1 in ascending order,
+     and their classes. Other fds in that range are FD_CLASS_UNTRACED. Only
+     valid while syscallbuf_fd_class[SYSCALLBUF_FDS_DISABLED_SIZE - 1] is
+     FD_CLASS_UNTRACED; rr sets that to FD_CLASS_TRACED while it rewrites
+     these, and leaves it so if there are too many fds to list. Set by rr
+     during record (modifications are recorded). Not read during replay. */
+  VOLATILE int32_t syscallbuf_high_fd_count;
+  VOLATILE int32_t syscallbuf_high_fds[SYSCALLBUF_HIGH_FDS_SIZE];
+  VOLATILE char syscallbuf_high_fd_class[SYSCALLBUF_HIGH_FDS_SIZE];
+  /* The fds < SYSCALLBUF_FDS_DISABLED_SIZE - 1 that have class
+     FD_CLASS_BPF_MAP. rr fills in an fd's entry before giving it that class
+     and clears the entry after taking the class away, so the entry for an
+     fd with that class is always valid. Set by rr during record
+     (modifications are recorded). Not read during replay. */
+  VOLATILE struct syscallbuf_bpf_map syscallbuf_bpf_maps[SYSCALLBUF_BPF_MAPS_SIZE];
 };
 
 /**
@@ -461,6 +496,9 @@ enum syscallbuf_fd_classes {
   // This fd either refers to a /proc/<pid>/mem or is untrace (if this as
   // is shared with another fd table)
   FD_CLASS_PROC_MEM = 0x2,
+  // This fd is a BPF map listed in syscallbuf_bpf_maps. Map lookups can be
+  // buffered; everything else is traced.
+  FD_CLASS_BPF_MAP  = 0x3,
 };
 
 #define CURRENT_INIT_PRELOAD_PARAMS_VERSION 2
@@ -620,8 +658,12 @@ struct syscallbuf_hdr {
   /* Nonzero when the syscall was aborted during preparation without doing
    * anything. This is set when a user seccomp filter forces a SIGSYS. */
   volatile uint8_t failed_during_preparation;
+  /* Nonzero when a record didn't fit in the buffer, so its syscall was
+   * traced instead. rr grows the buffer at the next reset, which clears
+   * this. */
+  volatile uint8_t record_did_not_fit;
 
-  uint8_t padding[2];
+  uint8_t padding[1];
 } __attribute__((__packed__));
 #ifdef __cplusplus
 static_assert(sizeof(struct syscallbuf_hdr) % 8 == 0,
@@ -93,15 +93,16 @@
 #ifndef BTRFS_IOCTL_MAGIC
 #define BTRFS_IOCTL_MAGIC 0x94
 #endif
-#ifndef BTRFS_IOC_CLONE_RANGE
-struct btrfs_ioctl_clone_range_args {
+/* The generic name for BTRFS_IOC_CLONE_RANGE, which XFS, bcachefs and
+ * others implement too. */
+#ifndef FICLONERANGE
+struct file_clone_range {
   int64_t src_fd;
   uint64_t src_offset;
   uint64_t src_length;
   uint64_t dest_offset;
 };
-#define BTRFS_IOC_CLONE_RANGE                                                  \
-  _IOW(BTRFS_IOCTL_MAGIC, 13, struct btrfs_ioctl_clone_range_args)
+#define FICLONERANGE _IOW(BTRFS_IOCTL_MAGIC, 13, struct file_clone_range)
 #endif
 #ifndef MADV_FREE
 #define MADV_FREE 8
@@ -1182,10 +1183,32 @@ static enum syscallbuf_fd_classes fd_class(int fd) {
   if (fd < 0) {
     return FD_CLASS_INVALID;
   }
-  if (fd >= SYSCALLBUF_FDS_DISABLED_SIZE - 1) {
-    fd = SYSCALLBUF_FDS_DISABLED_SIZE - 1;
+  if (fd < SYSCALLBUF_FDS_DISABLED_SIZE - 1) {
+    return globals.syscallbuf_fd_class[fd];
+  }
+  /* Read the high-fd class before the list, so we don't use a list that rr
+     is rewriting. */
+  enum syscallbuf_fd_classes cls = __atomic_load_n(
+      &globals.syscallbuf_fd_class[SYSCALLBUF_FDS_DISABLED_SIZE - 1],
+      __ATOMIC_ACQUIRE);
+  if (cls != FD_CLASS_UNTRACED) {
+    return cls;
+  }
+  int lo = 0;
+  int hi = globals.syscallbuf_high_fd_count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    int mid_fd = globals.syscallbuf_high_fds[mid];
+    if (mid_fd == fd) {
+      return globals.syscallbuf_high_fd_class[mid];
+    }
+    if (mid_fd < fd) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
   }
-  return globals.syscallbuf_fd_class[fd];
+  return FD_CLASS_UNTRACED;
 }
 
 static int is_bufferable_fd(int fd) {
@@ -1252,6 +1275,7 @@ static int fd_write_blocks(int fd) {
   switch (fd_class(fd)) {
     case FD_CLASS_UNTRACED:
     case FD_CLASS_TRACED:
+    case FD_CLASS_BPF_MAP:
       return MAY_BLOCK;
     case FD_CLASS_INVALID:
     case FD_CLASS_PROC_MEM:
@@ -1283,6 +1307,7 @@ static int start_commit_buffered_syscall(int syscallno, void* record_end,
      * Unlock the buffer and then execute the system call
      * with a trap to rr.  Note that we reserve enough
      * space in the buffer for the next prep_syscall(). */
+    buffer_hdr()->record_did_not_fit = 1;
     buffer_hdr()->locked &= ~SYSCALLBUF_LOCKED_TRACEE;
     return 0;
   }
@@ -2015,7 +2040,7 @@ static long sys_ioctl_fionread(struct syscall_info* call) {
 
 static long sys_ioctl(struct syscall_info* call) {
   switch (call->args[1]) {
-    case BTRFS_IOC_CLONE_RANGE:
+    case FICLONERANGE:
     case FIOCLEX:
     case FIONCLEX:
       return sys_safe_nonblocking_ioctl(call);
@@ -2137,6 +2162,75 @@ static long sys_getrandom(struct syscall_info* call) {
   return commit_raw_syscall(call->no, ptr, ret);
 }
 
+#if defined(SYS_bpf)
+/* The part of union bpf_attr used by BPF_MAP_LOOKUP_ELEM and
+   BPF_MAP_GET_NEXT_KEY. */
+struct bpf_map_elem_attr {
+  uint32_t map_fd;
+  uint32_t padding;
+  uint64_t key;
+  uint64_t value_or_next_key;
+  uint64_t flags;
+};
+
+enum { RR_BPF_MAP_LOOKUP_ELEM = 1, RR_BPF_MAP_GET_NEXT_KEY = 4 };
+
+static long sys_bpf(struct syscall_info* call) {
+  const int syscallno = SYS_bpf;
+  int cmd = call->args[0];
+  const void* attr = (const void*)call->args[1];
+  unsigned int size = call->args[2];
+  struct bpf_map_elem_attr attr2;
+  uint32_t out_size = 0;
+  void* out;
+  void* out2;
+  void* ptr;
+  long ret;
+  int i;
+
+  assert(syscallno == call->no);
+
+  if ((cmd != RR_BPF_MAP_LOOKUP_ELEM && cmd != RR_BPF_MAP_GET_NEXT_KEY) ||
+      !attr || size < offsetof(struct bpf_map_elem_attr, flags) ||
+      size > sizeof(attr2)) {
+    return traced_raw_syscall(call);
+  }
+  local_memset(&attr2, 0, sizeof(attr2));
+  local_memcpy(&attr2, attr, size);
+  if (fd_class(attr2.map_fd) != FD_CLASS_BPF_MAP) {
+    return traced_raw_syscall(call);
+  }
+  for (i = 0; i < SYSCALLBUF_BPF_MAPS_SIZE; ++i) {
+    if (globals.syscallbuf_bpf_maps[i].fd == (int32_t)attr2.map_fd &&
+        (globals.syscallbuf_bpf_maps[i].key_size ||
+         globals.syscallbuf_bpf_maps[i].value_size)) {
+      out_size = cmd == RR_BPF_MAP_LOOKUP_ELEM
+                     ? globals.syscallbuf_bpf_maps[i].value_size
+                     : globals.syscallbuf_bpf_maps[i].key_size;
+      break;
+    }
+  }
+  out = (void*)(uintptr_t)attr2.value_or_next_key;
+  if (!out_size || !out) {
+    return traced_raw_syscall(call);
+  }
+
+  /* Have the kernel write the value or next key into the syscallbuf,
+     through our copy of the attr. */
+  ptr = prep_syscall();
+  out2 = ptr;
+  ptr += out_size;
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  attr2.value_or_next_key = (uintptr_t)out2;
+
+  ret = untraced_syscall3(syscallno, cmd, &attr2, size);
+  ptr = copy_output_buffer(ret < 0 ? ret : (long)out_size, ptr, out, out2);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+#endif
+
 static long sys_generic_getdents(struct syscall_info* call) {
   int fd = (int)call->args[0];
   void* buf = (void*)call->args[1];
@@ -2880,9 +2974,9 @@ static long sys_read(struct syscall_info* call) {
   void* buf2 = NULL;
   long ret;
 
-  /* Try cloning data using CLONE_RANGE ioctl.
-   * XXX switch to FIOCLONERANGE when that's more widely available. It's the
-   * same ioctl number so it won't affect rr per se but it'd be cleaner code.
+  /* Try cloning data using the FICLONERANGE ioctl, which works on any
+   * filesystem with reflinks (btrfs, XFS, bcachefs, ...) when |fd|'s file is
+   * on the same filesystem as the trace.
    * 64-bit only for now, since lseek and pread64 need special handling for
    * 32-bit.
    * Basically we break down the read into three syscalls lseek, clone and
@@ -2890,7 +2984,7 @@ static long sys_read(struct syscall_info* call) {
    * Crucially, the read-from-clone syscall does NOT store data in the syscall
    * buffer; instead, we perform the syscall during replay, assuming that
    * cloned_file_data_fd is open to the same file during replay.
-   * Reads that hit EOF are rejected by the CLONE_RANGE ioctl so we take the
+   * Reads that hit EOF are rejected by the FICLONERANGE ioctl so we take the
    * slow path. That's OK.
    * There is a possible race here: between cloning the data and reading from
    * |fd|, |fd|'s data may be overwritten, in which case the data read during
@@ -2909,7 +3003,7 @@ static long sys_read(struct syscall_info* call) {
                                        { fd, 0, SEEK_CUR, 0, 0, 0 } };
     off_t lseek_ret = privileged_sys_generic_nonblocking_fd(&lseek_call);
     if (lseek_ret >= 0 && !(lseek_ret & 4095)) {
-      struct btrfs_ioctl_clone_range_args ioctl_args;
+      struct file_clone_range ioctl_args;
       int ioctl_ret;
       void* ioctl_ptr = prep_syscall();
       ioctl_args.src_fd = fd;
@@ -2924,13 +3018,13 @@ static long sys_read(struct syscall_info* call) {
       if (!start_commit_buffered_syscall(SYS_ioctl, ioctl_ptr, WONT_BLOCK)) {
         struct syscall_info ioctl_call = { SYS_ioctl,
                                            { thread_locals->cloned_file_data_fd,
-                                             BTRFS_IOC_CLONE_RANGE,
+                                             FICLONERANGE,
                                              (long)&ioctl_args, 0, 0, 0 } };
         ioctl_ret = privileged_traced_raw_syscall(&ioctl_call);
       } else {
         ioctl_ret =
             privileged_untraced_syscall3(SYS_ioctl, thread_locals->cloned_file_data_fd,
-                                         BTRFS_IOC_CLONE_RANGE, &ioctl_args);
+                                         FICLONERANGE, &ioctl_args);
         ioctl_ret = commit_raw_syscall(SYS_ioctl, ioctl_ptr, ioctl_ret);
       }
 
@@ -3221,6 +3315,11 @@ struct msghdr /* struct user_msghdr in the kernel */ {
   unsigned int msg_flags;
 };
 
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+
 #define SCM_RIGHTS 0x01
 #define SOL_PACKET 263
 
@@ -3345,6 +3444,120 @@ static long sys_recvmsg(struct syscall_info* call) {
 }
 #endif
 
+#if defined(SYS_recvmsg) && defined(SYS_recvmmsg)
+static long sys_recvmmsg(struct syscall_info* call) {
+  if (force_traced_syscall_for_chaos_mode()) {
+    /* Reading from a socket could unblock a higher priority task */
+    return traced_raw_syscall(call);
+  }
+
+  const int syscallno = SYS_recvmmsg;
+  int sockfd = call->args[0];
+  struct mmsghdr* msgvec = (struct mmsghdr*)call->args[1];
+  unsigned int vlen = call->args[2];
+  int flags = call->args[3];
+  void* timeout = (void*)call->args[4];
+
+  void* ptr = prep_syscall_for_fd(sockfd);
+  long ret;
+  struct mmsghdr* msgvec2;
+  void* ptr_base = ptr;
+  void* ptr_overwritten_end;
+  void* ptr_end;
+  unsigned int i;
+  size_t j;
+
+  assert(syscallno == call->no);
+
+  /* The kernel writes back the remaining time, and received file descriptors
+   * need rr's attention (see sys_recvmsg); leave both to the traced path.
+   */
+  if (timeout) {
+    return traced_raw_syscall(call);
+  }
+  ptr += sizeof(struct mmsghdr) * vlen;
+  for (i = 0; i < vlen; ++i) {
+    struct msghdr* msg = &msgvec[i].msg_hdr;
+    if (msg->msg_control) {
+      return traced_raw_syscall(call);
+    }
+    ptr += sizeof(struct iovec) * msg->msg_iovlen;
+    if (msg->msg_name) {
+      ptr += msg->msg_namelen;
+    }
+    for (j = 0; j < msg->msg_iovlen; ++j) {
+      ptr += msg->msg_iov[j].iov_len;
+    }
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  /* Same layout rules as sys_recvmsg: the headers are written with
+   * memcpy_input_parameter, everything else is derived from them. Message
+   * names come first so that each message's data, and the record, end where
+   * the kernel stopped writing.
+   */
+  msgvec2 = ptr = ptr_base;
+  memcpy_input_parameter(msgvec2, msgvec, sizeof(struct mmsghdr) * vlen);
+  ptr += sizeof(struct mmsghdr) * vlen;
+  for (i = 0; i < vlen; ++i) {
+    msgvec2[i].msg_hdr.msg_iov = ptr;
+    ptr += sizeof(struct iovec) * msgvec[i].msg_hdr.msg_iovlen;
+  }
+  ptr_overwritten_end = ptr;
+  for (i = 0; i < vlen; ++i) {
+    if (msgvec[i].msg_hdr.msg_name) {
+      msgvec2[i].msg_hdr.msg_name = ptr;
+      ptr += msgvec[i].msg_hdr.msg_namelen;
+    }
+  }
+  for (i = 0; i < vlen; ++i) {
+    struct msghdr* msg = &msgvec[i].msg_hdr;
+    for (j = 0; j < msg->msg_iovlen; ++j) {
+      msgvec2[i].msg_hdr.msg_iov[j].iov_base = ptr;
+      ptr += msg->msg_iov[j].iov_len;
+      msgvec2[i].msg_hdr.msg_iov[j].iov_len = msg->msg_iov[j].iov_len;
+    }
+  }
+
+  ret = untraced_syscall5(syscallno, sockfd, msgvec2, vlen, flags, NULL);
+
+  if (ret > 0 && !buffer_hdr()->failed_during_preparation) {
+    ptr_end = ptr_overwritten_end;
+    for (i = 0; i < (unsigned int)ret; ++i) {
+      struct msghdr* msg = &msgvec[i].msg_hdr;
+      struct msghdr* msg2 = &msgvec2[i].msg_hdr;
+      size_t bytes = msgvec2[i].msg_len;
+      if (msg->msg_name) {
+        local_memcpy(msg->msg_name, msg2->msg_name, msg2->msg_namelen);
+        if (msg2->msg_name + msg->msg_namelen > ptr_end) {
+          ptr_end = msg2->msg_name + msg->msg_namelen;
+        }
+      }
+      msg->msg_namelen = msg2->msg_namelen;
+      msg->msg_controllen = msg2->msg_controllen;
+      for (j = 0; j < msg->msg_iovlen; ++j) {
+        long copy_bytes =
+            bytes < msg->msg_iov[j].iov_len ? bytes : msg->msg_iov[j].iov_len;
+        local_memcpy(msg->msg_iov[j].iov_base, msg2->msg_iov[j].iov_base,
+                     copy_bytes);
+        if (copy_bytes > 0) {
+          ptr_end = msg2->msg_iov[j].iov_base + copy_bytes;
+        }
+        bytes -= copy_bytes;
+      }
+      msg->msg_flags = msg2->msg_flags;
+      msgvec[i].msg_len = msgvec2[i].msg_len;
+    }
+  } else {
+    /* As in sys_recvmsg, cover at least the data we overwrote above. */
+    ptr_end = ptr_overwritten_end;
+  }
+  return commit_raw_syscall(syscallno, ptr_end, ret);
+}
+#endif
+
 #ifdef SYS_sendmsg
 static long sys_sendmsg(struct syscall_info* call) {
   if (force_traced_syscall_for_chaos_mode()) {
@@ -3372,6 +3585,44 @@ static long sys_sendmsg(struct syscall_info* call) {
 }
 #endif
 
+#if defined(SYS_recvmsg) && defined(SYS_sendmmsg)
+static long sys_sendmmsg(struct syscall_info* call) {
+  if (force_traced_syscall_for_chaos_mode()) {
+    /* Sending to a socket could unblock a higher priority task */
+    return traced_raw_syscall(call);
+  }
+
+  const int syscallno = SYS_sendmmsg;
+  int sockfd = call->args[0];
+  struct mmsghdr* msgvec = (struct mmsghdr*)call->args[1];
+  unsigned int vlen = call->args[2];
+  int flags = call->args[3];
+
+  void* ptr = prep_syscall_for_fd(sockfd);
+  struct mmsghdr* msgvec2 = ptr;
+  long ret;
+  unsigned int i;
+
+  assert(syscallno == call->no);
+
+  /* The kernel only reads the messages but writes back each msg_len. */
+  ptr += sizeof(struct mmsghdr) * vlen;
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  memcpy_input_parameter(msgvec2, msgvec, sizeof(struct mmsghdr) * vlen);
+
+  ret = untraced_syscall4(syscallno, sockfd, msgvec2, vlen, flags);
+
+  if (ret > 0 && !buffer_hdr()->failed_during_preparation) {
+    for (i = 0; i < (unsigned int)ret; ++i) {
+      msgvec[i].msg_len = msgvec2[i].msg_len;
+    }
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+#endif
+
 #ifdef SYS_sendto
 static long sys_sendto(struct syscall_info* call) {
   if (force_traced_syscall_for_chaos_mode()) {
@@ -3793,7 +4044,7 @@ static long sys_pwrite64(struct syscall_info* call) {
   off_t offset = call->args[3];
 
   enum syscallbuf_fd_classes cls = fd_class(fd);
-  if (cls == FD_CLASS_TRACED) {
+  if (cls == FD_CLASS_TRACED || cls == FD_CLASS_BPF_MAP) {
     return traced_raw_syscall(call);
   }
   void* ptr = prep_syscall();
@@ -3932,11 +4183,12 @@ static long sys_ptrace(struct syscall_info* call) {
   void* addr = (void*)call->args[2];
   void* data = (void*)call->args[3];
 
-  if (request != PTRACE_PEEKDATA || !data) {
+  if ((request != PTRACE_PEEKDATA && request != PTRACE_PEEKTEXT) || !data) {
     return traced_raw_syscall(call);
   }
 
-  /* We try to emulate PTRACE_PEEKDATA using process_vm_readv. That might not
+  /* We try to emulate PTRACE_PEEKDATA (and PTRACE_PEEKTEXT, which is the
+   * same thing on Linux) using process_vm_readv. That might not
    * work for permissions reasons; if it fails for any reason, we retry with
    * a traced syscall.
    * This does mean that if a process issues a PTRACE_PEEKDATA while not
@@ -3970,7 +4222,8 @@ static long sys_ptrace(struct syscall_info* call) {
   if (ret != sizeof(long)) {
     return traced_raw_syscall(call);
   }
-  return ret;
+  /* Like the real syscall; the glibc wrapper returns the data. */
+  return 0;
 }
 
 static long sys_getrusage(struct syscall_info* call) {
@@ -4141,6 +4394,9 @@ static long syscall_hook_internal(struct syscall_info* call) {
   case SYS_##syscallname:                                                      \
     return sys_generic_nonblocking_fd(call)
     CASE(rrcall_rdtsc);
+#if defined(SYS_bpf)
+    CASE(bpf);
+#endif
 #if defined(SYS_access)
     CASE_GENERIC_NONBLOCKING(access);
 #endif
@@ -4236,6 +4492,9 @@ case SYS_epoll_pwait:
 #if defined(SYS_recvfrom)
     CASE(recvfrom);
 #endif
+#if defined(SYS_recvmsg) && defined(SYS_recvmmsg)
+    CASE(recvmmsg);
+#endif
 #if defined(SYS_recvmsg)
     CASE(recvmsg);
 #endif
@@ -4246,6 +4505,9 @@ case SYS_epoll_pwait:
     CASE_GENERIC_NONBLOCKING(rmdir);
 #endif
     CASE(rt_sigprocmask);
+#if defined(SYS_recvmsg) && defined(SYS_sendmmsg)
+    CASE(sendmmsg);
+#endif
 #if defined(SYS_sendmsg)
     CASE(sendmsg);
 #endif
@@ -117,9 +117,7 @@ static bool try_handle_trapped_instruction(RecordTask* t, siginfo_t* si) {
   } else if (trapped_instruction == TrappedInstruction::CPUID) {
     auto eax = r.syscallno();
     auto ecx = r.cx();
-    auto cpuid_data = cpuid(eax, ecx);
-    t->session().disable_cpuid_features()
-        .amend_cpuid_data(eax, ecx, &cpuid_data);
+    auto cpuid_data = t->session().emulated_cpuid(eax, ecx);
     r.set_cpuid_output(cpuid_data.eax, cpuid_data.ebx, cpuid_data.ecx,
                        cpuid_data.edx);
     LOG(debug) << " trapped for cpuid: " << HEX(eax) << ":" << HEX(ecx);
@@ -87,6 +87,7 @@
 #include "RecordSession.h"
 #include "RecordTask.h"
 #include "Scheduler.h"
+#include "SpanTracer.h"
 #include "StdioMonitor.h"
 #include "SysCpuMonitor.h"
 #include "TraceStream.h"
@@ -859,14 +860,16 @@ void TaskSyscallState::process_syscall_results() {
       }
     }
     ASSERT(t, saved_data.empty());
-    // Step 3: record all output memory areas
+    // Step 3: record all output memory areas, reading them from the tracee
+    // in one go
+    vector<MemoryRange> output_ranges;
     for (size_t i = 0; i < param_list.size(); ++i) {
       auto& param = param_list[i];
-      size_t size = actual_sizes[i];
       if (param.mode != IN) {
-        t->record_remote(param.dest, size);
+        output_ranges.push_back(MemoryRange(param.dest, actual_sizes[i]));
       }
     }
+    t->record_remote_batch(output_ranges);
   }
 
   if (should_emulate_result) {
@@ -2153,15 +2156,19 @@ static Switchable prepare_ioctl(RecordTask* t,
   return PREVENT_SWITCH;
 }
 
+static BpfMapMonitor* bpf_map_monitor(RecordTask* t, int map_fd) {
+  FileMonitor* monitor = t->fd_table()->get_monitor(map_fd);
+  ASSERT(t, monitor) << "We need a BpfMapMonitor to handle this, but couldn't find it for fd " << map_fd;
+  ASSERT(t, monitor->type() == FileMonitor::BpfMap);
+  return static_cast<BpfMapMonitor*>(monitor);
+}
+
 template <typename Arch> static BpfMapMonitor* bpf_map_monitor(RecordTask* t,
     TaskSyscallState& syscall_state, remote_ptr<typename Arch::bpf_attr>* argsp_out) {
   auto argsp = syscall_state.reg_parameter<typename Arch::bpf_attr>(2, IN);
   auto args = t->read_mem(argsp);
-  FileMonitor* monitor = t->fd_table()->get_monitor(args.map_fd);
-  ASSERT(t, monitor) << "We need a BpfMapMonitor to handle this, but couldn't find it for fd " << args.map_fd;
-  ASSERT(t, monitor->type() == FileMonitor::BpfMap);
   *argsp_out = argsp;
-  return static_cast<BpfMapMonitor*>(monitor);
+  return bpf_map_monitor(t, args.map_fd);
 }
 
 template <typename Arch>
@@ -2190,7 +2197,7 @@ static Switchable prepare_bpf(RecordTask* t,
       remote_ptr<typename Arch::bpf_attr> argsp;
       BpfMapMonitor* monitor = bpf_map_monitor<Arch>(t, syscall_state, &argsp);
       syscall_state.mem_ptr_parameter(REMOTE_PTR_FIELD(argsp, value),
-                                      monitor->value_size());
+                                      monitor->lookup_value_size());
       break;
     }
     case BPF_MAP_GET_NEXT_KEY: {
@@ -2200,6 +2207,32 @@ static Switchable prepare_bpf(RecordTask* t,
                                       monitor->key_size());
       break;
     }
+    case BPF_MAP_LOOKUP_BATCH:
+    case BPF_MAP_LOOKUP_AND_DELETE_BATCH: {
+      // The kernel writes the number of elements returned back to
+      // |batch.count|, so the attr is IN_OUT. We record space for as many
+      // elements as the tracee asked for.
+      auto attr_size = t->regs().arg3();
+      auto attr_begin = syscall_state.reg_parameter(2, attr_size, IN_OUT);
+      auto attr_buf = MemoryRange(attr_begin, attr_size);
+      auto attrp = attr_begin.cast<typename Arch::bpf_attr>();
+      auto map_fd_p = REMOTE_PTR_FIELD(attrp, batch.map_fd);
+      if (!attr_buf.contains(map_fd_p)) {
+        break;
+      }
+      BpfMapMonitor* monitor = bpf_map_monitor(t, t->read_mem(map_fd_p));
+      uint64_t count = t->read_mem(REMOTE_PTR_FIELD(attrp, batch.count));
+      // Hash maps return a 32-bit bucket index as the batch cursor, other
+      // maps the last key.
+      syscall_state.mem_ptr_parameter(
+          REMOTE_PTR_FIELD(attrp, batch.out_batch),
+          max<uint64_t>(monitor->key_size(), sizeof(uint32_t)));
+      syscall_state.mem_ptr_parameter(REMOTE_PTR_FIELD(attrp, batch.keys),
+                                      count * monitor->key_size());
+      syscall_state.mem_ptr_parameter(REMOTE_PTR_FIELD(attrp, batch.values),
+                                      count * monitor->lookup_value_size());
+      break;
+    }
     case BPF_PROG_QUERY: {
       auto attr_size = t->regs().arg3();
       auto attr_begin = syscall_state.reg_parameter(2, attr_size, IN_OUT);
@@ -3287,6 +3320,17 @@ static void prepare_mmap_register_params(RecordTask* t) {
   if (monitor) {
     switch (monitor->type()) {
       case FileMonitor::VirtualPerfCounter:
+        if (VirtualPerfCounterMonitor::supports_mmap(r.arg2(), r.arg6())) {
+          // Map an anonymous page instead. We fill it in when the syscall
+          // exits.
+          r.set_arg4(MAP_PRIVATE | MAP_ANONYMOUS |
+                     (r.arg4_signed() & (MAP_FIXED | MAP_FIXED_NOREPLACE)));
+          r.set_arg5(-1);
+          r.set_arg6(0);
+          t->set_regs(r);
+          return;
+        }
+        RR_FALLTHROUGH;
       case FileMonitor::NonvirtualPerfCounter:
         LOG(info) << "Faking failure of mmap for perf event counter";
         // Force mmap to fail by setting fd to our tracee socket
@@ -3965,6 +4009,7 @@ static Switchable rec_prepare_syscall_arch(RecordTask* t,
       switch (op & FUTEX_CMD_MASK) {
         case FUTEX_WAIT:
         case FUTEX_WAIT_BITSET:
+          t->session().scheduler().note_contention();
           return ALLOW_SWITCH;
 
         case FUTEX_REQUEUE:
@@ -5403,6 +5448,7 @@ static Switchable rec_prepare_syscall_internal(
 }
 
 Switchable rec_prepare_syscall(RecordTask* t) {
+  ScopedSpan span("rec_prepare_syscall");
   t->syscall_state = make_unique<TaskSyscallState>();
   auto& syscall_state = TaskSyscallState::get(t);
   syscall_state.init(t);
@@ -5985,6 +6031,30 @@ static vector<WriteHole> find_holes(RecordTask* t, int desc, uint64_t offset, ui
   return ret;
 }
 
+static void process_mmap(RecordTask* t, size_t length, int prot, int flags,
+                         int fd, off64_t offset);
+
+/**
+ * If prepare_mmap_register_params turned an mmap of a virtual perf counter
+ * into an anonymous mapping, process that mapping and return true.
+ */
+static bool process_virtual_perf_counter_mmap(RecordTask* t,
+                                              const Registers& entry_regs) {
+  const Registers& r = t->regs();
+  FileMonitor* monitor = t->fd_table()->get_monitor(entry_regs.arg5_signed());
+  if (!monitor || monitor->type() != FileMonitor::VirtualPerfCounter ||
+      r.arg5_signed() != -1) {
+    return false;
+  }
+  process_mmap(t, (size_t)r.arg2(), (int)r.arg3_signed(), (int)r.arg4_signed(),
+               -1, 0);
+  if (!r.syscall_failed()) {
+    static_cast<VirtualPerfCounterMonitor*>(monitor)->did_mmap(
+        t, r.syscall_result());
+  }
+  return true;
+}
+
 static void process_mmap(RecordTask* t, size_t length, int prot, int flags,
                          int fd, off64_t offset) {
   if (t->regs().syscall_failed()) {
@@ -6659,13 +6729,18 @@ static void rec_process_syscall_arch(RecordTask* t,
         case Arch::RegisterArguments: {
           Registers r = t->regs();
           r.set_orig_arg1(syscall_state.syscall_entry_registers.arg1());
-          r.set_arg4(syscall_state.syscall_entry_registers.arg4_signed());
-          process_mmap(t, (size_t)r.arg2(), (int)r.arg3_signed(),
-                       (int)r.arg4_signed(), (int)r.arg5_signed(),
-                       ((off_t)r.arg6_signed()));
+          if (!process_virtual_perf_counter_mmap(
+                  t, syscall_state.syscall_entry_registers)) {
+            r.set_arg4(syscall_state.syscall_entry_registers.arg4_signed());
+            process_mmap(t, (size_t)r.arg2(), (int)r.arg3_signed(),
+                         (int)r.arg4_signed(), (int)r.arg5_signed(),
+                         ((off_t)r.arg6_signed()));
+          }
           r.set_arg2(syscall_state.syscall_entry_registers.arg2_signed());
           r.set_arg3(syscall_state.syscall_entry_registers.arg3_signed());
+          r.set_arg4(syscall_state.syscall_entry_registers.arg4_signed());
           r.set_arg5(syscall_state.syscall_entry_registers.arg5_signed());
+          r.set_arg6(syscall_state.syscall_entry_registers.arg6_signed());
           t->set_regs(r);
           break;
         }
@@ -6675,13 +6750,18 @@ static void rec_process_syscall_arch(RecordTask* t,
     case Arch::mmap2: {
       Registers r = t->regs();
       r.set_orig_arg1(syscall_state.syscall_entry_registers.arg1());
-      r.set_arg4(syscall_state.syscall_entry_registers.arg4_signed());
-      process_mmap(t, (size_t)r.arg2(), (int)r.arg3_signed(),
-                   (int)r.arg4_signed(), (int)r.arg5_signed(),
-                   (off_t)r.arg6_signed() * 4096);
+      if (!process_virtual_perf_counter_mmap(
+              t, syscall_state.syscall_entry_registers)) {
+        r.set_arg4(syscall_state.syscall_entry_registers.arg4_signed());
+        process_mmap(t, (size_t)r.arg2(), (int)r.arg3_signed(),
+                     (int)r.arg4_signed(), (int)r.arg5_signed(),
+                     (off_t)r.arg6_signed() * 4096);
+      }
       r.set_arg2(syscall_state.syscall_entry_registers.arg2_signed());
       r.set_arg3(syscall_state.syscall_entry_registers.arg3_signed());
+      r.set_arg4(syscall_state.syscall_entry_registers.arg4_signed());
       r.set_arg5(syscall_state.syscall_entry_registers.arg5_signed());
+      r.set_arg6(syscall_state.syscall_entry_registers.arg6_signed());
       t->set_regs(r);
       break;
     }
@@ -6716,7 +6796,9 @@ static void rec_process_syscall_arch(RecordTask* t,
           case BPF_MAP_CREATE: {
             int fd = t->regs().syscall_result_signed();
             auto attr = t->read_mem(remote_ptr<typename Arch::bpf_attr>(t->regs().arg2()));
-            t->fd_table()->add_monitor(t, fd, new BpfMapMonitor(attr.key_size, attr.value_size));
+            t->fd_table()->add_monitor(
+                t, fd, new BpfMapMonitor(attr.map_type, attr.key_size,
+                                         attr.value_size));
             break;
           }
           default:
@@ -7164,6 +7246,8 @@ static void rec_process_syscall_arch(RecordTask* t,
       break;
     }
   }
+
+  VirtualPerfCounterMonitor::update_mmapped_pages(t);
 }
 
 /* N.B.: `arch` is the architecture of the syscall, which may be different
@@ -7181,6 +7265,7 @@ void rec_did_sigreturn(RecordTask *t) {
 }
 
 void rec_process_syscall(RecordTask* t) {
+  ScopedSpan span("rec_process_syscall");
   auto& syscall_state = TaskSyscallState::get(t);
   const SyscallEvent& sys_ev = t->ev().Syscall();
   if (sys_ev.arch() != t->arch()) {
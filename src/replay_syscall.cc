@@ -1,5 +1,6 @@
 /* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/futex.h>
@@ -15,6 +16,7 @@
 #include <sys/wait.h>
 #include <syscall.h>
 
+#include <algorithm>
 #include <array>
 #include <initializer_list>
 #include <map>
@@ -37,6 +39,7 @@
 #include "ProcMemMonitor.h"
 #include "ProcStatMonitor.h"
 #include "RRPageMonitor.h"
+#include "RecordSession.h"
 #include "ReplaySession.h"
 #include "ReplayTask.h"
 #include "SeccompFilterRewriter.h"
@@ -315,9 +318,18 @@ template <typename Arch> static void prepare_clone(ReplayTask* t) {
   init_scratch_memory(new_task, km, data);
 }
 
+/**
+ * Tracee fds of the files backing mappings restored after an exec, keyed by
+ * file name, so each file is sent to the tracee once and shared by all of
+ * its segments. Without an ExecBackingFiles, restore_mapped_region closes
+ * the tracee's fd right away.
+ */
+typedef map<string, int> ExecBackingFiles;
+
 static void restore_mapped_region(ReplayTask* t, AutoRemoteSyscalls& remote,
                                   const KernelMapping& km,
-                                  const TraceReader::MappedData& data) {
+                                  const TraceReader::MappedData& data,
+                                  ExecBackingFiles* backing_files = nullptr) {
   ASSERT(t, !(km.flags() & MAP_SHARED))
       << "Shared mappings after exec not supported";
 
@@ -328,13 +340,31 @@ static void restore_mapped_region(ReplayTask* t, AutoRemoteSyscalls& remote,
   uint64_t offset_bytes = 0;
   switch (data.source) {
     case TraceReader::SOURCE_FILE: {
-      struct stat real_file;
       offset_bytes = km.file_offset_bytes();
-      // Private mapping, so O_RDONLY is always OK.
-      remote.finish_direct_mmap(km.start(), km.size(), km.prot(),
-                         km.flags(), data.file_name, O_RDONLY,
-                         data.data_offset_bytes, real_file,
-                         real_file_name);
+      int child_fd = -1;
+      if (backing_files) {
+        auto it = backing_files->find(data.file_name);
+        if (it != backing_files->end()) {
+          child_fd = it->second;
+        }
+      }
+      if (child_fd < 0) {
+        // Private mapping, so O_RDONLY is always OK.
+        ScopedFd file = t->session().open_mapped_file(data.file_name);
+        ASSERT(t, file.is_open()) << "Can't open " << data.file_name;
+        child_fd = remote.send_fd(file);
+        ASSERT(t, child_fd >= 0) << "Can't send " << data.file_name;
+        if (backing_files) {
+          backing_files->insert(make_pair(data.file_name, child_fd));
+        }
+      }
+      struct stat real_file;
+      remote.finish_direct_mmap_fd(km.start(), km.size(), km.prot(), flags,
+                                   child_fd, data.data_offset_bytes,
+                                   real_file, real_file_name,
+                                   backing_files
+                                       ? AutoRemoteSyscalls::KEEP_FD_OPEN
+                                       : AutoRemoteSyscalls::CLOSE_FD);
       device = real_file.st_dev;
       inode = real_file.st_ino;
       break;
@@ -477,8 +507,14 @@ static void process_execve(ReplayTask* t, const TraceFrame& trace_frame,
     AutoRemoteSyscalls remote(t);
 
     // Now map in all the mappings that we recorded from the real exec.
+    // The executable and the dynamic linker have several segments each, so
+    // send each file to the tracee only once.
+    ExecBackingFiles backing_files;
     for (ssize_t i = 1; i < ssize_t(kms.size()) - 1; ++i) {
-      restore_mapped_region(t, remote, kms[i], datas[i]);
+      restore_mapped_region(t, remote, kms[i], datas[i], &backing_files);
+    }
+    for (auto& f : backing_files) {
+      remote.infallible_close_syscall_if_alive(f.second);
     }
   }
 
@@ -554,25 +590,25 @@ static void finish_anonymous_mmap(ReplayTask* t, AutoRemoteSyscalls& remote,
 static void write_mapped_data(ReplayTask* t,
                               remote_ptr<void> rec_addr,
                               size_t size,
-                              TraceReader::MappedData& data) {
+                              TraceReader::MappedData& data,
+                              bool fresh_anonymous = false) {
   switch (data.source) {
   case TraceReader::SOURCE_TRACE: {
     // Note that this gets called for remaps and shared maps that refer to the same pages
     // as previous maps and so the data we're recording might not be the initial data
     // for those pages, but it is the inital data *for this mapping*.
-    t->apply_data_record_from_trace();
+    t->apply_data_record_from_trace(fresh_anonymous);
     break;
   }
   case TraceReader::SOURCE_FILE: {
-    ScopedFd file(data.file_name.c_str(), O_RDONLY);
+    ScopedFd file = t->session().open_mapped_file(data.file_name);
     ASSERT(t, file.is_open()) << "Can't open " << data.file_name;
-    off_t offset = lseek(file, data.data_offset_bytes, SEEK_SET);
-    ASSERT(t, offset == (off_t)data.data_offset_bytes)
-      << "Couldn't seek to " << data.data_offset_bytes << ", got " << offset;
+    // The fd may be shared with other sessions, so don't move its offset.
+    uint64_t offset = data.data_offset_bytes;
     vector<uint8_t> buf;
     buf.resize(page_size()*16);
     while (size > 0) {
-      ssize_t ret = read(file, buf.data(), min(size, buf.size()));
+      ssize_t ret = pread64(file, buf.data(), min(size, buf.size()), offset);
       if (ret < 0) {
         FATAL() << "Can't read from trace file " << data.file_name;
       }
@@ -581,6 +617,7 @@ static void write_mapped_data(ReplayTask* t,
       }
       t->write_bytes_helper(rec_addr, ret, buf.data());
       rec_addr += ret;
+      offset += ret;
       size -= ret;
     }
     break;
@@ -593,6 +630,170 @@ static void write_mapped_data(ReplayTask* t,
   }
 }
 
+/**
+ * If RR_MAPPED_DATA_CACHE names a directory, the contents of private file
+ * mappings restored from the trace are written there once and mapped from
+ * the cache file, so concurrent replays of the same trace share one copy
+ * in the page cache instead of each holding private anonymous pages. Files
+ * are named by trace UUID, event and address, so every replay materializes
+ * identical contents under the same name.
+ */
+static const char* mapped_data_cache_dir() {
+  static const char* dir = getenv("RR_MAPPED_DATA_CACHE");
+  return dir && *dir ? dir : nullptr;
+}
+
+static const char MAPPED_DATA_CACHE_PREFIX[] = "rr-mapped-";
+// When the cache grows beyond this, the oldest files are removed until it's
+// back under three quarters of it.
+static const uint64_t MAX_MAPPED_DATA_CACHE_BYTES = (uint64_t)4 << 30;
+
+/**
+ * Returns the disk space used by the cache files in |dir|, after removing
+ * the oldest ones if there are too many. Replays that have a removed file
+ * mapped keep their copy; later replays just write it again.
+ */
+static uint64_t trim_mapped_data_cache(const char* dir) {
+  struct CacheFile {
+    time_t mtime;
+    uint64_t bytes;
+    string path;
+    bool operator<(const CacheFile& other) const {
+      return mtime < other.mtime;
+    }
+  };
+  vector<CacheFile> files;
+  uint64_t total = 0;
+  DIR* d = opendir(dir);
+  if (!d) {
+    return 0;
+  }
+  while (struct dirent* e = readdir(d)) {
+    // Skip other replays' files that are still being written.
+    if (strncmp(e->d_name, MAPPED_DATA_CACHE_PREFIX,
+                sizeof(MAPPED_DATA_CACHE_PREFIX) - 1) ||
+        strstr(e->d_name, ".tmp-")) {
+      continue;
+    }
+    CacheFile f;
+    f.path = string(dir) + "/" + e->d_name;
+    struct stat st;
+    if (stat(f.path.c_str(), &st) < 0) {
+      continue;
+    }
+    f.mtime = st.st_mtime;
+    f.bytes = (uint64_t)st.st_blocks * 512;
+    total += f.bytes;
+    files.push_back(std::move(f));
+  }
+  closedir(d);
+  if (total <= MAX_MAPPED_DATA_CACHE_BYTES) {
+    return total;
+  }
+  sort(files.begin(), files.end());
+  for (auto& f : files) {
+    if (total <= MAX_MAPPED_DATA_CACHE_BYTES / 4 * 3) {
+      break;
+    }
+    if (unlink(f.path.c_str()) == 0) {
+      LOG(debug) << "Evicted " << f.path << " from the mapped data cache";
+      total -= f.bytes;
+    }
+  }
+  return total;
+}
+
+/**
+ * Make room in the cache for a |size|-byte file. Other replays add files
+ * too, so this rescans the cache whenever our estimate of its size would
+ * go over the limit.
+ */
+static void reserve_mapped_data_cache(size_t size) {
+  static bool scanned = false;
+  static uint64_t cache_bytes;
+  if (!scanned || cache_bytes + size > MAX_MAPPED_DATA_CACHE_BYTES) {
+    cache_bytes = trim_mapped_data_cache(mapped_data_cache_dir());
+    scanned = true;
+  }
+  cache_bytes += size;
+}
+
+/**
+ * Write the data record |buf| for a |size|-byte mapping at |addr| into the
+ * cache, unless it's already there, and set |*path| to the cache file.
+ * Returns false if the record doesn't cover exactly that mapping or the
+ * file can't be written.
+ */
+static bool materialize_mapped_data(ReplayTask* t,
+                                    const TraceReader::RawDataWithHoles& buf,
+                                    remote_ptr<void> addr, size_t size,
+                                    string* path) {
+  if (buf.addr != addr || buf.rec_tid != t->rec_tid) {
+    return false;
+  }
+  size_t total = 0;
+  for (auto& span : buf.data) {
+    total += span.size;
+  }
+  for (auto& hole : buf.holes) {
+    total += hole.size;
+  }
+  if (total != size) {
+    return false;
+  }
+
+  stringstream name;
+  name << mapped_data_cache_dir() << "/" << MAPPED_DATA_CACHE_PREFIX;
+  const TraceUuid& uuid = t->trace_reader().uuid();
+  for (size_t i = 0; i < sizeof(uuid.bytes); ++i) {
+    name << "0123456789abcdef"[uuid.bytes[i] >> 4]
+         << "0123456789abcdef"[uuid.bytes[i] & 0xf];
+  }
+  name << "-" << t->trace_reader().time() << "-" << addr;
+  *path = name.str();
+  if (access(path->c_str(), R_OK) == 0) {
+    return true;
+  }
+
+  reserve_mapped_data_cache(size);
+
+  // Another replay may be materializing the same record; each writes its
+  // own temporary file and the rename makes whichever finishes first (with
+  // identical contents) visible.
+  string tmp_path = *path + ".tmp-" + to_string(getpid());
+  ScopedFd fd(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0444);
+  if (!fd.is_open()) {
+    LOG(warn) << "Can't create " << tmp_path << ": " << errno_name(errno);
+    return false;
+  }
+  // Holes are left unwritten so they stay sparse in the cache file.
+  bool ok = ftruncate(fd, size) == 0;
+  uint64_t offset = 0;
+  auto hole = buf.holes.begin();
+  for (auto span = buf.data.begin(); ok && span != buf.data.end(); ++span) {
+    size_t done = 0;
+    while (ok && done < span->size) {
+      while (hole != buf.holes.end() && hole->offset == offset) {
+        offset += hole->size;
+        ++hole;
+      }
+      size_t n = span->size - done;
+      if (hole != buf.holes.end()) {
+        n = min<uint64_t>(n, hole->offset - offset);
+      }
+      ok = pwrite_all_fallible(fd, span->data + done, n, offset) == (ssize_t)n;
+      done += n;
+      offset += n;
+    }
+  }
+  if (!ok || rename(tmp_path.c_str(), path->c_str()) < 0) {
+    LOG(warn) << "Can't write " << *path << ": " << errno_name(errno);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
 static void finish_private_mmap(ReplayTask* t, AutoRemoteSyscalls& remote,
                                 remote_ptr<void> rec_addr, size_t length,
                                 int prot, int flags, off64_t offset_bytes,
@@ -600,6 +801,26 @@ static void finish_private_mmap(ReplayTask* t, AutoRemoteSyscalls& remote,
                                 TraceReader::MappedData& data) {
   LOG(debug) << "  finishing private mmap of " << km.fsname();
 
+  TraceReader::RawDataWithHoles buf;
+  bool have_record = false;
+  if (data.source == TraceReader::SOURCE_TRACE && mapped_data_cache_dir() &&
+      length == km.size()) {
+    have_record = t->trace_reader().read_raw_data_for_frame_with_holes(buf);
+    ASSERT(t, have_record);
+    string path;
+    if (materialize_mapped_data(t, buf, rec_addr, length, &path)) {
+      struct stat real_file;
+      string real_file_name;
+      remote.finish_direct_mmap(rec_addr, length, prot,
+                                flags & ~MAP_GROWSDOWN, path, O_RDONLY, 0,
+                                real_file, real_file_name);
+      t->vm()->map(t, rec_addr, length, prot, flags, 0, real_file_name,
+                   real_file.st_dev, real_file.st_ino, nullptr, &km);
+      t->vm()->maybe_update_breakpoints(t, rec_addr.cast<uint8_t>(), length);
+      return;
+    }
+  }
+
   remote.infallible_mmap_syscall_if_alive(
       rec_addr, length, prot,
       // Tell the kernel to take |rec_addr| seriously.
@@ -612,8 +833,13 @@ static void finish_private_mmap(ReplayTask* t, AutoRemoteSyscalls& remote,
                offset_bytes, string(), KernelMapping::NO_DEVICE,
                KernelMapping::NO_INODE, nullptr, &km);
 
-  /* Restore the map region we copied. */
-  write_mapped_data(t, rec_addr, km.size(), data);
+  /* Restore the map region we copied. The mapping was just created
+   * anonymous, so holes (sparse file ranges) are already zero. */
+  if (have_record) {
+    t->apply_data_record(buf, true);
+  } else {
+    write_mapped_data(t, rec_addr, km.size(), data, true);
+  }
 }
 
 static void finish_shared_mmap(ReplayTask* t, AutoRemoteSyscalls& remote,
@@ -680,6 +906,17 @@ static void process_mmap(ReplayTask* t, const TraceFrame& trace_frame,
                          off64_t offset_bytes, ReplayTraceStep* step) {
   step->action = TSTEP_RETIRE;
 
+  bool virtual_perf_counter_page = false;
+  if (!(flags & MAP_ANONYMOUS)) {
+    FileMonitor* fd_monitor = t->fd_table()->get_monitor(fd);
+    if (fd_monitor && fd_monitor->type() == FileMonitor::VirtualPerfCounter) {
+      // Recorded as an anonymous page; its contents come from data records.
+      flags = MAP_PRIVATE | MAP_ANONYMOUS |
+              (flags & (MAP_FIXED | MAP_FIXED_NOREPLACE));
+      virtual_perf_counter_page = true;
+    }
+  }
+
   {
     remote_ptr<void> addr = trace_frame.regs().syscall_result();
     // Hand off actual execution of the mapping to the appropriate helper.
@@ -690,6 +927,10 @@ static void process_mmap(ReplayTask* t, const TraceFrame& trace_frame,
     if (flags & MAP_ANONYMOUS) {
       finish_anonymous_mmap(t, remote, trace_frame.regs().syscall_result(),
                             length, prot, flags);
+      if (virtual_perf_counter_page) {
+        t->vm()->mapping_flags_of(addr) |=
+            AddressSpace::Mapping::IS_VIRTUAL_PERF_COUNTER_PAGE;
+      }
     } else {
       TraceReader::MappedData data;
       vector<TraceRemoteFd> extra_fds;
@@ -721,8 +962,9 @@ static void process_mmap(ReplayTask* t, const TraceFrame& trace_frame,
         struct stat real_file;
         string real_file_name;
         uint64_t map_bytes = min(ceil_page_size(data.file_size_bytes) - data.data_offset_bytes, length);
-        remote.finish_direct_mmap(addr, map_bytes, prot, flags,
-                           data.file_name, O_RDONLY,
+        ScopedFd file = t->session().open_mapped_file(data.file_name);
+        ASSERT(t, file.is_open()) << "Can't open " << data.file_name;
+        remote.finish_direct_mmap(addr, map_bytes, prot, flags, file,
                            data.data_offset_bytes, real_file,
                            real_file_name);
         KernelMapping km_sub = km.subrange(km.start(), km.start() + ceil_page_size(map_bytes));
@@ -872,6 +1114,26 @@ void process_grow_map(ReplayTask* t) {
   restore_mapped_region(t, remote, km, data);
 }
 
+void process_patch_stub_mappings(ReplayTask* t) {
+  while (true) {
+    TraceReader::MappedData data;
+    bool found;
+    KernelMapping km = t->trace_reader().read_mapped_region(&data, &found);
+    if (!found) {
+      break;
+    }
+    AutoRemoteSyscalls remote(t);
+    ASSERT(t, km.flags() & MAP_ANONYMOUS);
+    remote.infallible_mmap_syscall_if_alive(km.start(), km.size(), km.prot(),
+                                            km.flags() | MAP_FIXED, -1, 0);
+    t->vm()->map(t, km.start(), km.size(), km.prot(), km.flags(), 0, string(),
+                 KernelMapping::NO_DEVICE, KernelMapping::NO_INODE, nullptr,
+                 &km);
+    t->vm()->mapping_flags_of(km.start()) |=
+        AddressSpace::Mapping::IS_PATCH_STUBS;
+  }
+}
+
 static void process_shmat(ReplayTask* t, const TraceFrame& trace_frame,
                           int shm_flags, ReplayTraceStep* step) {
   step->action = TSTEP_RETIRE;
@@ -1379,6 +1641,8 @@ static void rep_process_syscall_arch(ReplayTask* t, ReplayTraceStep* step,
     process_init_buffers(t, step);
   } else if (sys == t->session().syscall_number_for_rrcall_init_preload()) {
     t->at_preload_init();
+    // Monkeypatcher may have eagerly patched known syscall sites.
+    process_patch_stub_mappings(t);
   } else if (sys == t->session().syscall_number_for_rrcall_reload_auxv()) {
     // Inner rr has finished emulating execve for a tracee. Reload auxv
     // vectors now so that if gdb gets attached to the inner tracee, it will
@@ -32,6 +32,13 @@ void rep_process_syscall(ReplayTask* t, ReplayTraceStep* step);
  */
 void process_grow_map(ReplayTask* t);
 
+/**
+ * Map any syscall-patch stub pages that Monkeypatcher allocated during the
+ * current event. Must be called before the event's data records are applied,
+ * since those fill in the stubs.
+ */
+void process_patch_stub_mappings(ReplayTask* t);
+
 } // namespace rr
 
 #endif /* RR_REP_PROCESS_EVENT_H_ */
@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+#include "util.h"
+
+#include <linux/bpf.h>
+
+static int bpf(int cmd, union bpf_attr* attr, unsigned int size) {
+  return syscall(__NR_bpf, cmd, attr, size);
+}
+
+/* Bigger than any per-CPU value the kernel will write. */
+#define NUM_VALUES 8192
+
+static int create_map(int type) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = type;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint64_t);
+  attr.max_entries = 4;
+  return bpf(BPF_MAP_CREATE, &attr, sizeof(attr));
+}
+
+static void lookup(int map_fd, uint32_t key, uint64_t* value) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uintptr_t)&key;
+  attr.value = (uintptr_t)value;
+  test_assert(0 == bpf(BPF_MAP_LOOKUP_ELEM, &attr, sizeof(attr)));
+}
+
+static void update(int map_fd, uint32_t key, uint64_t* value) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uintptr_t)&key;
+  attr.value = (uintptr_t)value;
+  attr.flags = BPF_ANY;
+  test_assert(0 == bpf(BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr)));
+}
+
+int main(void) {
+  int array_fd;
+  int percpu_fd;
+  uint64_t* values = malloc(NUM_VALUES * sizeof(uint64_t));
+  uint64_t* out = malloc(NUM_VALUES * sizeof(uint64_t));
+  uint64_t* value_out;
+  int i;
+  int cpus;
+
+  array_fd = create_map(BPF_MAP_TYPE_ARRAY);
+  if (array_fd < 0) {
+    if (errno == ENOSYS) {
+      atomic_puts("bpf syscall not supported");
+      atomic_puts("EXIT-SUCCESS");
+      return 0;
+    }
+    if (errno == EPERM) {
+      atomic_puts("Skipping test because it requires CAP_SYS_ADMIN");
+      atomic_puts("EXIT-SUCCESS");
+      return 0;
+    }
+  }
+  test_assert(array_fd >= 0);
+
+  for (i = 0; i < NUM_VALUES; ++i) {
+    values[i] = 1000 + i;
+  }
+
+  /* Array maps are looked up through the syscallbuf. */
+  update(array_fd, 2, values);
+  ALLOCATE_GUARD(value_out, 'a');
+  for (i = 0; i < 10; ++i) {
+    lookup(array_fd, 2, value_out);
+    VERIFY_GUARD(value_out);
+    test_assert(*value_out == 1000);
+  }
+
+  /* A per-CPU array lookup writes a value for every possible CPU. */
+  percpu_fd = create_map(BPF_MAP_TYPE_PERCPU_ARRAY);
+  test_assert(percpu_fd >= 0);
+  update(percpu_fd, 1, values);
+  for (i = 0; i < 10; ++i) {
+    memset(out, 0xff, NUM_VALUES * sizeof(uint64_t));
+    lookup(percpu_fd, 1, out);
+    for (cpus = 0; cpus < NUM_VALUES && out[cpus] != (uint64_t)-1; ++cpus) {
+      test_assert(out[cpus] == values[cpus]);
+    }
+    test_assert(cpus > 0);
+  }
+  atomic_printf("%d possible CPUs\n", cpus);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
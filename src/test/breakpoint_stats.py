@@ -0,0 +1,22 @@
+from util import *
+import re
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('cond 1 var==100')
+
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+send_gdb('breakpoint-stats')
+expect_gdb(re.compile(r'Breakpoint hits: (\d+)'))
+hits = int(last_match().group(1))
+expect_gdb(re.compile(r'Condition evaluations: (\d+)'))
+evaluations = int(last_match().group(1))
+expect_gdb(re.compile(r'Hits filtered by conditions: (\d+)'))
+filtered = int(last_match().group(1))
+if hits < 100 or evaluations < 100 or filtered < 99:
+    failed('ERROR ... expected at least 100 hits and evaluations and 99 '
+           f'filtered hits, got {hits}, {evaluations}, {filtered}')
+
+ok()
@@ -0,0 +1,21 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+#define BUF_SIZE (16 * 1024 * 1024)
+
+static char* buf;
+
+static void breakpoint(void) {}
+
+int main(void) {
+  /* Mostly untouched, so most of it should be left out of the core. */
+  buf = (char*)mmap(NULL, BUF_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  test_assert(buf != MAP_FAILED);
+  strcpy(buf + BUF_SIZE / 2, "rr-dump-core-marker");
+  breakpoint();
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,20 @@
+from util import *
+import os
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+
+send_gdb('c')
+expect_gdb('Breakpoint 1, breakpoint')
+
+send_gdb('dump-core dump_core.core')
+expect_gdb('Wrote dump_core.core')
+
+with open('dump_core.core', 'rb') as f:
+    core = f.read()
+if core[:4] != b'\x7fELF' or b'rr-dump-core-marker' not in core:
+    failed('core file is missing the ELF header or the marker')
+if os.stat('dump_core.core').st_blocks * 512 >= len(core):
+    failed('core file is not sparse')
+
+ok()
@@ -0,0 +1,18 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+static void breakpoint(void) {}
+
+int main(void) {
+  struct sysinfo info;
+  /* sysinfo isn't handled by the syscall buffer. */
+  test_assert(0 == sysinfo(&info));
+  breakpoint();
+  test_assert(0 == sysinfo(&info));
+  atomic_puts("between");
+  test_assert(0 == sysinfo(&info));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
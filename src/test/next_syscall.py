@@ -0,0 +1,25 @@
+from util import *
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+
+send_gdb('c')
+expect_gdb('Breakpoint 1, breakpoint')
+
+def seek(cmd):
+    send_gdb(cmd)
+    expect_gdb(r'event (\d+) tid \d+: sysinfo = 0')
+    return int(last_match().group(1))
+
+second = seek('next-syscall sysinfo')
+third = seek('next-syscall sysinfo')
+if third <= second:
+    failed('next-syscall went from event %d to %d' % (second, third))
+
+if seek('prev-syscall sysinfo') != second:
+    failed('prev-syscall did not return to event %d' % second)
+first = seek('prev-syscall sysinfo')
+if first >= second:
+    failed('prev-syscall went from event %d to %d' % (second, first))
+
+ok()
@@ -0,0 +1,40 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+/* Repeatedly map some code containing a patchable syscall, run it and unmap
+   it again, like a JIT or a plugin host that keeps dlopen/dlclosing. rr
+   should reuse the patch stubs of the unmapped code. */
+
+#define ITERATIONS 500
+
+int main(void) {
+#ifdef __x86_64__
+  static const uint8_t code[] = {
+    0xb8, SYS_getpid, 0x00, 0x00, 0x00, /* mov $SYS_getpid,%eax */
+    0x0f, 0x05,                         /* syscall */
+    0x48, 0x3d, 0x01, 0xf0, 0xff, 0xff, /* cmp $-4095,%rax */
+    0xc3                                /* ret */
+  };
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  pid_t pid = getpid();
+  int i;
+
+  for (i = 0; i < ITERATIONS; ++i) {
+    long (*f)(void);
+    void* p = mmap(NULL, page_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    test_assert(p != MAP_FAILED);
+    /* Use a different offset each time so the sites don't always coincide. */
+    uint8_t* site = (uint8_t*)p + (i % 64) * 32;
+    memcpy(site, code, sizeof(code));
+    f = (long (*)(void))site;
+    test_assert(f() == pid);
+    test_assert(f() == pid);
+    test_assert(0 == munmap(p, page_size));
+  }
+#endif
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
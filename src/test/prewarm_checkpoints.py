@@ -0,0 +1,25 @@
+import time
+from util import *
+
+send_gdb('break breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+# Stay idle long enough for rr to prewarm checkpoints.
+time.sleep(5)
+
+send_gdb('break breakpoint2')
+expect_gdb('Breakpoint 2')
+send_gdb('reverse-cont')
+expect_gdb('Breakpoint 2')
+
+# Now there are checkpoints ahead of us; prewarming must keep them.
+time.sleep(5)
+send_gdb('reverse-cont')
+expect_gdb('Breakpoint 2')
+send_gdb('delete 2')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+ok()
@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+#define NUM_WORDS 1000
+
+static long words[NUM_WORDS];
+
+int main(void) {
+  pid_t child;
+  int status;
+  int i;
+
+  for (i = 0; i < NUM_WORDS; ++i) {
+    words[i] = i * 3 + 1;
+  }
+
+  if (0 == (child = fork())) {
+    test_assert(0 == ptrace(PTRACE_TRACEME, 0, NULL, NULL));
+    raise(SIGSTOP);
+    return words[0] == 77 ? 0 : 1;
+  }
+
+  test_assert(child == waitpid(child, &status, 0));
+  test_assert(WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP);
+
+  /* Like a debugger reading a struct word by word. Most of these can be
+     buffered. */
+  for (i = 0; i < NUM_WORDS; ++i) {
+    int request = (i & 1) ? PTRACE_PEEKTEXT : PTRACE_PEEKDATA;
+    errno = 0;
+    long v = ptrace(request, child, &words[i], NULL);
+    test_assert(errno == 0);
+    test_assert(v == i * 3 + 1);
+  }
+
+  test_assert(0 == ptrace(PTRACE_POKEDATA, child, &words[0], (void*)77));
+  test_assert(77 == ptrace(PTRACE_PEEKDATA, child, &words[0], NULL));
+  /* Our own copy is unchanged. */
+  test_assert(words[0] == 1);
+
+  test_assert(0 == ptrace(PTRACE_CONT, child, NULL, NULL));
+  test_assert(child == waitpid(child, &status, 0));
+  test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
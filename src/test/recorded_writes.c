@@ -0,0 +1,19 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+static struct sysinfo info;
+static struct sysinfo* info_ptr = &info;
+
+static void breakpoint(void) {}
+
+int main(void) {
+  /* sysinfo isn't handled by the syscall buffer, so its result is
+     recorded as data for this event. */
+  test_assert(0 == sysinfo(&info));
+  breakpoint();
+  test_assert(info_ptr->mem_unit > 0);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,18 @@
+from util import *
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+
+send_gdb('c')
+expect_gdb('Breakpoint 1, breakpoint')
+
+send_gdb('p/x (unsigned long)info_ptr')
+expect_gdb(r'= (0x[0-9a-f]+)')
+addr = last_match().group(1)
+send_gdb('recorded-writes %s 8' % addr)
+expect_gdb(r'event \d+ tid \d+')
+
+send_gdb('recorded-writes 0 8')
+expect_gdb('No recorded writes')
+
+ok()
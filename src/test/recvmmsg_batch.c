@@ -0,0 +1,66 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+#define NUM_MSGS 4
+
+int main(void) {
+  int fds[2];
+  struct mmsghdr msgs[NUM_MSGS];
+  struct iovec iovs[NUM_MSGS][2];
+  char heads[NUM_MSGS][2];
+  char tails[NUM_MSGS][16];
+  struct sockaddr_un names[NUM_MSGS];
+  char out[16];
+  int i;
+
+  test_assert(0 == socketpair(AF_UNIX, SOCK_DGRAM, 0, fds));
+
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < NUM_MSGS; ++i) {
+    iovs[i][0].iov_base = out;
+    iovs[i][0].iov_len = sprintf(out, "msg%d", i);
+    msgs[i].msg_hdr.msg_iov = iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    test_assert(1 == sendmmsg(fds[0], &msgs[i], 1, 0));
+    test_assert(msgs[i].msg_len == iovs[i][0].iov_len);
+  }
+
+  memset(msgs, 0, sizeof(msgs));
+  memset(names, 0xff, sizeof(names));
+  for (i = 0; i < NUM_MSGS; ++i) {
+    iovs[i][0].iov_base = heads[i];
+    iovs[i][0].iov_len = sizeof(heads[i]);
+    iovs[i][1].iov_base = tails[i];
+    iovs[i][1].iov_len = sizeof(tails[i]);
+    memset(tails[i], 0, sizeof(tails[i]));
+    msgs[i].msg_hdr.msg_iov = iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 2;
+    /* Leave one message without a name buffer */
+    if (i != 1) {
+      msgs[i].msg_hdr.msg_name = &names[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(names[i]);
+    }
+  }
+
+  /* Ask for more than is queued; we get what's there. */
+  test_assert(NUM_MSGS - 1 ==
+              recvmmsg(fds[1], msgs, NUM_MSGS - 1, MSG_DONTWAIT, NULL));
+  for (i = 0; i < NUM_MSGS - 1; ++i) {
+    atomic_printf("message %d: %u bytes '%c%c%s'\n", i, msgs[i].msg_len,
+                  heads[i][0], heads[i][1], tails[i]);
+    test_assert(msgs[i].msg_len == 4);
+    test_assert(heads[i][0] == 'm' && heads[i][1] == 's');
+    test_assert(tails[i][0] == 'g' && tails[i][1] == '0' + i);
+    test_assert(msgs[i].msg_hdr.msg_namelen <= sizeof(names[i]));
+    test_assert(i != 1 || msgs[i].msg_hdr.msg_namelen == 0);
+  }
+  test_assert(1 == recvmmsg(fds[1], &msgs[NUM_MSGS - 1], 1, MSG_DONTWAIT,
+                            NULL));
+  test_assert(tails[NUM_MSGS - 1][1] == '0' + NUM_MSGS - 1);
+  test_assert(-1 == recvmmsg(fds[1], msgs, NUM_MSGS, MSG_DONTWAIT, NULL));
+  test_assert(EAGAIN == errno);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
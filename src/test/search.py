@@ -48,6 +48,16 @@ send_gdb('find 0,-10L,(char)0,(char)1,(char)2,(char)2,(char)3,(char)0xff,(char)0
 expect_gdb('<buf>')
 expect_gdb('3 patterns found')
 
+# The rr extension reports every match in one go
+send_gdb('p/x (unsigned long)p')
+expect_gdb(r'= (0x[0-9a-f]+)')
+start = last_match().group(1)
+send_gdb('p/x (unsigned long)(p_end - p)')
+expect_gdb(r'= (0x[0-9a-f]+)')
+length = last_match().group(1)
+send_gdb('find-all %s %s 0001020203fffadebc' % (start, length))
+expect_gdb('2 matches')
+
 send_gdb('up');
 send_gdb('find 0,-10L,&argc')
 expect_gdb('<argc_ptr>')
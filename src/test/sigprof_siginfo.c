@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+/* Take SA_SIGINFO SIGPROF signals at 1kHz, the way sampling profilers do.
+   This exercises (and, with -a/--stats, times) async signal delivery with a
+   siginfo-taking handler. */
+
+#define NUM_SIGNALS 500
+
+static volatile int count;
+
+static void handler(int sig, siginfo_t* si, __attribute__((unused)) void* ctx) {
+  test_assert(sig == SIGPROF);
+  test_assert(si->si_signo == SIGPROF);
+  test_assert(si->si_code == SI_KERNEL);
+  ++count;
+}
+
+int main(void) {
+  struct itimerval itv = {
+    { 0, 1000 },
+    { 0, 1000 },
+  };
+  struct sigaction sa;
+
+  sa.sa_sigaction = handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  test_assert(0 == sigaction(SIGPROF, &sa, NULL));
+
+  test_assert(0 == setitimer(ITIMER_PROF, &itv, NULL));
+
+  while (count < NUM_SIGNALS) {
+  }
+
+  itv.it_value.tv_usec = 0;
+  itv.it_interval.tv_usec = 0;
+  test_assert(0 == setitimer(ITIMER_PROF, &itv, NULL));
+
+  atomic_printf("Got %d signals\n", count);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
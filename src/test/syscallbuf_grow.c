@@ -0,0 +1,40 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+#define CHUNK_SIZE 8192
+#define FILE_SIZE (64 * CHUNK_SIZE)
+
+static char buf[CHUNK_SIZE];
+
+int main(void) {
+  int fd;
+  int round;
+  int i;
+  volatile int spin = 0;
+
+  fd = open("tmp.bin", O_RDWR | O_CREAT | O_TRUNC, 0600);
+  test_assert(fd >= 0);
+  test_assert(0 == unlink("tmp.bin"));
+  for (i = 0; i < FILE_SIZE; i += CHUNK_SIZE) {
+    memset(buf, i / CHUNK_SIZE, sizeof(buf));
+    test_assert(CHUNK_SIZE == write(fd, buf, sizeof(buf)));
+  }
+
+  /* Each round fills the syscallbuf with reads, then spins long enough to
+     be preempted, which is where rr may grow the buffer. */
+  for (round = 0; round < 8; ++round) {
+    for (i = 0; i < FILE_SIZE; i += CHUNK_SIZE) {
+      test_assert(CHUNK_SIZE == pread(fd, buf, sizeof(buf), i));
+      test_assert(buf[0] == i / CHUNK_SIZE &&
+                  buf[CHUNK_SIZE - 1] == i / CHUNK_SIZE);
+    }
+    for (i = 0; i < 1 << 20; ++i) {
+      spin = spin + 1;
+    }
+    atomic_printf(".");
+  }
+
+  atomic_puts("\nEXIT-SUCCESS");
+  return 0;
+}
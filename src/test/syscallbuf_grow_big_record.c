@@ -0,0 +1,29 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+/* Bigger than the initial syscallbuf, smaller than the default maximum. */
+#define READ_SIZE (192 * 1024)
+
+static char buf[READ_SIZE];
+
+int main(void) {
+  int fd;
+  int i;
+
+  fd = open("tmp.bin", O_RDWR | O_CREAT | O_TRUNC, 0600);
+  test_assert(fd >= 0);
+  test_assert(0 == unlink("tmp.bin"));
+  memset(buf, 'x', sizeof(buf));
+  test_assert(READ_SIZE == write(fd, buf, sizeof(buf)));
+
+  /* None of these fit until rr grows the buffer. */
+  for (i = 0; i < 8; ++i) {
+    memset(buf, 0, sizeof(buf));
+    test_assert(READ_SIZE == pread(fd, buf, sizeof(buf), 0));
+    test_assert(buf[0] == 'x' && buf[READ_SIZE - 1] == 'x');
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+/* Above SYSCALLBUF_FDS_DISABLED_SIZE */
+#define HIGH_FD 16400
+
+static void* do_thread(__attribute__((unused)) void* p) {
+  char ch = 'x';
+  test_assert(1 == write(HIGH_FD + 2, &ch, 1));
+  return NULL;
+}
+
+int main(void) {
+  struct rlimit limit;
+  int pipe_fds[2];
+  char buf[16];
+  pthread_t thread;
+  int ret = getrlimit(RLIMIT_NOFILE, &limit);
+  test_assert(ret >= 0);
+  if (limit.rlim_cur < HIGH_FD + 10) {
+    if (limit.rlim_max < HIGH_FD + 10) {
+      atomic_puts("Can't raise fd limit enough, skipping test");
+      atomic_puts("EXIT-SUCCESS");
+      return 0;
+    }
+    limit.rlim_cur = HIGH_FD + 10;
+    test_assert(0 == setrlimit(RLIMIT_NOFILE, &limit));
+  }
+
+  /* A monitored high fd... */
+  test_assert(HIGH_FD == dup2(STDOUT_FILENO, HIGH_FD));
+  /* ...and unmonitored ones next to it. */
+  test_assert(0 == pipe(pipe_fds));
+  test_assert(HIGH_FD + 1 == dup2(pipe_fds[0], HIGH_FD + 1));
+  test_assert(HIGH_FD + 2 == dup2(pipe_fds[1], HIGH_FD + 2));
+
+  ret = write(HIGH_FD, "Line 1\n", 7);
+  test_assert(ret == 7);
+  test_assert(5 == write(HIGH_FD + 2, "hello", 5));
+  test_assert(5 == read(HIGH_FD + 1, buf, sizeof(buf)));
+  test_assert(!memcmp(buf, "hello", 5));
+
+  test_assert(0 == close(HIGH_FD));
+  test_assert(HIGH_FD == dup2(STDOUT_FILENO, HIGH_FD));
+  ret = write(HIGH_FD, "Line 2\n", 7);
+  test_assert(ret == 7);
+
+  pthread_create(&thread, NULL, do_thread, NULL);
+  pthread_join(thread, NULL);
+  test_assert(1 == read(HIGH_FD + 1, buf, sizeof(buf)));
+  test_assert(buf[0] == 'x');
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
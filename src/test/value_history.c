@@ -0,0 +1,24 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+static volatile uint32_t value;
+
+int main(void) {
+  int fds[2];
+  uint32_t v = 0x5678;
+  int i;
+
+  atomic_printf("value %p\n", (void*)&value);
+  for (i = 1; i <= 3; ++i) {
+    value = i;
+    sched_yield();
+  }
+  /* A write by the kernel rather than by user code. */
+  test_assert(0 == pipe(fds));
+  test_assert(sizeof(v) == write(fds[1], &v, sizeof(v)));
+  test_assert(sizeof(v) == read(fds[0], (void*)&value, sizeof(v)));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,84 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+/* rr virtualizes counters with this config for tracees. */
+#define PERF_COUNT_RR 0x72727272L
+
+static int sys_perf_event_open(struct perf_event_attr* attr, pid_t pid, int cpu,
+                               int group_fd, unsigned long flags) {
+  return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static int64_t read_page(volatile struct perf_event_mmap_page* page) {
+  uint32_t seq;
+  int64_t count;
+  do {
+    seq = page->lock;
+    __sync_synchronize();
+    test_assert(page->index == 0);
+    count = page->offset;
+    __sync_synchronize();
+  } while (page->lock != seq);
+  return count;
+}
+
+static void spin(void) {
+  volatile int i;
+  for (i = 0; i < 100000; ++i) {
+  }
+}
+
+int main(void) {
+  struct perf_event_attr attr;
+  volatile struct perf_event_mmap_page* page;
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  int counter_fd;
+  int pipe_fds[2];
+  int64_t before;
+  int64_t after;
+  int64_t value;
+  pid_t child;
+  int status;
+  char ch;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_RR;
+
+  counter_fd = sys_perf_event_open(&attr, 0 /*self*/, -1 /*any cpu*/, -1, 0);
+  test_assert(0 <= counter_fd);
+
+  page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, counter_fd, 0);
+  test_assert(page != MAP_FAILED);
+
+  /* The page is refreshed at syscall exits. */
+  before = read_page(page);
+  spin();
+  syscall(SYS_getpid);
+  after = read_page(page);
+  test_assert(after > before);
+
+  test_assert(0 == pipe(pipe_fds));
+  child = fork();
+  if (!child) {
+    /* Our copy of the page still shows the parent's counter. */
+    before = read_page(page);
+    test_assert(1 == read(pipe_fds[0], &ch, 1));
+    test_assert(sizeof(value) == read(counter_fd, &value, sizeof(value)));
+    after = read_page(page);
+    test_assert(after == value);
+    test_assert(after > before);
+    return 77;
+  }
+
+  spin();
+  syscall(SYS_getpid);
+  test_assert(1 == write(pipe_fds[1], "x", 1));
+  test_assert(child == waitpid(child, &status, 0));
+  test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 77);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -17,6 +17,8 @@
 #include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
@@ -25,10 +27,12 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/utsname.h>
 #include <sys/vfs.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <string>
 #include <numeric>
@@ -45,6 +49,7 @@
 #include "RecordTask.h"
 #include "ReplayTask.h"
 #include "ScopedFd.h"
+#include "StdioMonitor.h"
 #include "TraceStream.h"
 #include "WaitManager.h"
 #include "core.h"
@@ -251,11 +256,10 @@ remote_ptr<void> floor_page_size(remote_ptr<void> addr) {
  * containing |label|.  See |dump_binary_data()| for a description of
  * the remaining parameters.
  */
-static void dump_binary_chunk(FILE* out, const char* label, const uint32_t* buf,
-                              size_t buf_len, remote_ptr<void> start_addr) {
+static void dump_binary_words(FILE* out, const uint32_t* buf, size_t buf_len,
+                              remote_ptr<void> start_addr) {
   int i;
 
-  fprintf(out, "%s\n", label);
   for (i = 0; i < ssize_t(buf_len); i += 1) {
     uint32_t word = buf[i];
     fprintf(out, "0x%08x | [%p]\n", word,
@@ -263,6 +267,12 @@ static void dump_binary_chunk(FILE* out, const char* label, const uint32_t* buf,
   }
 }
 
+static void dump_binary_chunk(FILE* out, const char* label, const uint32_t* buf,
+                              size_t buf_len, remote_ptr<void> start_addr) {
+  fprintf(out, "%s\n", label);
+  dump_binary_words(out, buf, buf_len, start_addr);
+}
+
 void dump_binary_data(const char* filename, const char* label,
                       const uint32_t* buf, size_t buf_len,
                       remote_ptr<void> start_addr) {
@@ -299,32 +309,38 @@ void dump_process_memory(Task* t, FrameTime global_time, const char* tag) {
   FILE* dump_file = fopen64(filename.c_str(), "w");
 
   const AddressSpace& as = *(t->vm());
+  int pagemap_fd = t->pagemap_fd().get();
   for (const auto& m : as.maps()) {
-    vector<uint8_t> mem;
-    mem.resize(m.map.size());
+    if (is_start_of_scratch_region(t, m.map.start())) {
+      continue;
+    }
+    // Only dump the populated parts of private anonymous mappings; the
+    // rest reads as zeroes, and sanitizer shadow mappings are terabytes.
+    vector<MemoryRange> chunks;
+    bool anonymous_private = (m.map.flags() & MAP_ANONYMOUS) &&
+                             !(m.map.flags() & MAP_SHARED) && !m.local_addr;
+    if (!anonymous_private || pagemap_fd < 0 ||
+        !populated_ranges(pagemap_fd, m.map, &chunks)) {
+      chunks.assign(1, m.map);
+    }
+    // Every mapping gets its label, even if nothing in it is populated,
+    // and the words of all its chunks follow that one label.
+    fprintf(dump_file, "%s\n", m.map.str().c_str());
+    for (const auto& chunk : chunks) {
+      vector<uint8_t> mem;
+      mem.resize(chunk.size());
 
-    ssize_t mem_len =
-        t->read_bytes_fallible(m.map.start(), m.map.size(), mem.data());
-    mem_len = max(ssize_t(0), mem_len);
+      ssize_t mem_len =
+          t->read_bytes_fallible(chunk.start(), chunk.size(), mem.data());
+      mem_len = max(ssize_t(0), mem_len);
 
-    if (!is_start_of_scratch_region(t, m.map.start())) {
-      dump_binary_chunk(dump_file, m.map.str().c_str(),
-                        (const uint32_t*)mem.data(), mem_len / sizeof(uint32_t),
-                        m.map.start());
+      dump_binary_words(dump_file, (const uint32_t*)mem.data(),
+                        mem_len / sizeof(uint32_t), chunk.start());
     }
   }
   fclose(dump_file);
 }
 
-void write_pt_data(Task* t, FrameTime global_time, const vector<vector<uint8_t>>& data) {
-  string filename = format_dump_filename(t, global_time, "pt");
-  ScopedFd dump_file(filename.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0700);
-  ASSERT(t, dump_file.is_open()) << "Can't write to file " << filename;
-  for (const auto& d : data) {
-    write_all(dump_file, d.data(), d.size());
-  }
-}
-
 vector<uint8_t> read_pt_data(Task* t, FrameTime global_time) {
   string filename = format_dump_filename(t, global_time, "pt");
   FILE* dump_file = fopen64(filename.c_str(), "r");
@@ -410,16 +426,357 @@ static bool checksum_segment_filter(const AddressSpace::Mapping& m) {
   return may_diverge;
 }
 
-static uint32_t compute_checksum(void* data, size_t len) {
-  uint32_t checksum = len;
-  size_t words = len / sizeof(uint32_t);
-  uint32_t* buf = static_cast<uint32_t*>(data);
-  for (size_t i = 0; i < words; ++i) {
+/**
+ * The checksum of |len| bytes is |len| folded with each 32-bit word w by
+ * checksum = checksum * 17 + w (mod 2^32). Eight words at a time this is
+ * checksum * 17^8 + sum(w[i] * 17^(7 - i)), which gives the same result
+ * as the word-by-word loop but lets the compiler vectorize the inner sum.
+ */
+static uint32_t checksum_words(uint32_t checksum, const uint32_t* buf,
+                               size_t words) {
+  static const uint32_t powers[8] = { 410338673, 24137569, 1419857, 83521,
+                                      4913,      289,      17,      1 };
+  static const uint32_t power8 = 2680790145U;
+  size_t i = 0;
+  for (; i + 8 <= words; i += 8) {
+    uint32_t sum = 0;
+    for (int j = 0; j < 8; ++j) {
+      sum += buf[i + j] * powers[j];
+    }
+    checksum = checksum * power8 + sum;
+  }
+  for (; i < words; ++i) {
     checksum = (checksum << 4) + checksum + buf[i];
   }
   return checksum;
 }
 
+/** Fold |words| zero words into |checksum| without touching memory. */
+static uint32_t checksum_zero_words(uint32_t checksum, size_t words) {
+  uint32_t factor = 17;
+  while (words) {
+    if (words & 1) {
+      checksum *= factor;
+    }
+    factor *= factor;
+    words >>= 1;
+  }
+  return checksum;
+}
+
+static uint32_t compute_checksum(void* data, size_t len) {
+  return checksum_words(len, static_cast<uint32_t*>(data),
+                        len / sizeof(uint32_t));
+}
+
+bool populated_ranges(int pagemap_fd, MemoryRange range,
+                      vector<MemoryRange>* populated) {
+  static bool unsupported = false;
+  populated->clear();
+  if (unsupported) {
+    return false;
+  }
+  page_region regions[64];
+  pm_scan_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.size = sizeof(arg);
+  arg.start = range.start().as_int();
+  arg.end = range.end().as_int();
+  arg.vec = (uintptr_t)regions;
+  arg.vec_len = array_length(regions);
+  arg.category_anyof_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+  arg.return_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+  while (arg.start < arg.end) {
+    int ret = ioctl(pagemap_fd, PAGEMAP_SCAN, &arg);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0 || arg.walk_end <= arg.start) {
+      if (ret < 0 && (errno == ENOTTY || errno == EINVAL)) {
+        LOG(debug) << "PAGEMAP_SCAN not supported";
+        unsupported = true;
+      }
+      populated->clear();
+      return false;
+    }
+    for (int i = 0; i < ret; ++i) {
+      MemoryRange r(remote_ptr<void>(regions[i].start),
+                    remote_ptr<void>(regions[i].end));
+      if (!populated->empty() && populated->back().end() == r.start()) {
+        populated->back() = MemoryRange(populated->back().start(), r.end());
+      } else {
+        populated->push_back(r);
+      }
+    }
+    arg.start = arg.walk_end;
+  }
+  return true;
+}
+
+bool range_unpopulated(int pagemap_fd, MemoryRange range) {
+  vector<MemoryRange> populated;
+  if (populated_ranges(pagemap_fd, range, &populated)) {
+    return populated.empty();
+  }
+
+  static const uint64_t PM_PRESENT_OR_SWAPPED = 3ULL << 62;
+  uint64_t entries[512];
+  size_t pages = range.size() / page_size();
+  uint64_t index = range.start().as_int() / page_size();
+  while (pages > 0) {
+    size_t count = min(pages, array_length(entries));
+    ssize_t ret = pread(pagemap_fd, entries, count * sizeof(entries[0]),
+                        index * sizeof(entries[0]));
+    if (ret != ssize_t(count * sizeof(entries[0]))) {
+      return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      if (entries[i] & PM_PRESENT_OR_SWAPPED) {
+        return false;
+      }
+    }
+    pages -= count;
+    index += count;
+  }
+  return true;
+}
+
+/**
+ * Checksums ranges of a task's memory without needing a buffer for a whole
+ * mapping. Each range is split into 2MB (huge page sized) extents which
+ * are hashed independently, on worker threads if there are enough of them,
+ * and then combined: the checksum of a || b is
+ * checksum(a) * 17^words(b) + checksum_words(0, b). Extents of private
+ * anonymous memory that have never been populated are folded in as zeroes
+ * without being read. Where PAGEMAP_SCAN is available, runs of them (e.g.
+ * untouched sanitizer shadow memory) become a single extent that costs
+ * nothing. As with compute_checksum on a zero-filled buffer,
+ * memory after the first unreadable byte of a range counts as zero.
+ */
+class MemoryChecksummer {
+public:
+  explicit MemoryChecksummer(Task* t);
+
+  /** Returns the index to pass to checksum() after run(). */
+  size_t add(const AddressSpace::Mapping& m, MemoryRange range);
+  void run();
+  /**
+   * If |error| is non-null, it's set to the errno of the first failed read
+   * that affected the checksum, or zero.
+   */
+  uint32_t checksum(size_t index, int* error = nullptr) const;
+
+private:
+  struct Range {
+    MemoryRange range;
+    uint8_t* local_addr;
+    bool anonymous_private;
+    size_t first_extent;
+    size_t num_extents;
+  };
+  struct Extent {
+    size_t range_index;
+    remote_ptr<void> start;
+    size_t size;
+    uint32_t hash;
+    int error;
+    bool short_read;
+    // Known to be unpopulated, so hashed as zeroes without being read.
+    bool unpopulated;
+  };
+
+  static void* thread_callback(void* p);
+  void process_extents(bool use_task);
+  void process_extent(Extent& e, vector<uint8_t>& buf, bool use_task);
+
+  static const size_t extent_size = 2 * 1024 * 1024;
+  // Below this many extents it's not worth starting threads.
+  static const size_t min_parallel_extents = 32;
+
+  Task* t;
+  vector<Range> ranges;
+  vector<Extent> extents;
+  std::atomic<size_t> next_extent;
+  int mem_fd;
+  ScopedFd pagemap;
+};
+
+MemoryChecksummer::MemoryChecksummer(Task* t) : t(t), next_extent(0) {
+  char path[PATH_MAX];
+  sprintf(path, "/proc/%d/pagemap", t->tid);
+  pagemap = ScopedFd(path, O_RDONLY);
+}
+
+size_t MemoryChecksummer::add(const AddressSpace::Mapping& m,
+                              MemoryRange range) {
+  Range r;
+  r.range = range;
+  r.local_addr = m.local_addr ? static_cast<uint8_t*>(m.local_addr) +
+                                    (range.start() - m.map.start())
+                              : nullptr;
+  r.anonymous_private = (m.map.flags() & MAP_ANONYMOUS) &&
+                        !(m.map.flags() & MAP_SHARED) && !m.local_addr;
+  r.first_extent = extents.size();
+  vector<MemoryRange> populated;
+  bool know_populated = r.anonymous_private && pagemap.is_open() &&
+                        range.size() > extent_size &&
+                        populated_ranges(pagemap, range, &populated);
+  auto next_populated = populated.begin();
+  for (remote_ptr<void> addr = range.start(); addr < range.end();
+       addr += extent_size) {
+    Extent e;
+    e.range_index = ranges.size();
+    e.start = addr;
+    e.size = min<size_t>(extent_size, range.end() - addr);
+    e.hash = 0;
+    e.error = 0;
+    e.short_read = false;
+    e.unpopulated = false;
+    if (know_populated) {
+      while (next_populated != populated.end() &&
+             next_populated->end() <= addr) {
+        ++next_populated;
+      }
+      e.unpopulated = next_populated == populated.end() ||
+                      next_populated->start() >= addr + e.size;
+      if (e.unpopulated && extents.size() > r.first_extent &&
+          extents.back().unpopulated) {
+        extents.back().size += e.size;
+        continue;
+      }
+    }
+    extents.push_back(e);
+  }
+  r.num_extents = extents.size() - r.first_extent;
+  ranges.push_back(r);
+  return ranges.size() - 1;
+}
+
+void MemoryChecksummer::process_extent(Extent& e, vector<uint8_t>& buf,
+                                       bool use_task) {
+  const Range& r = ranges[e.range_index];
+  if (e.unpopulated ||
+      (r.anonymous_private && pagemap.is_open() &&
+       range_unpopulated(pagemap, MemoryRange(e.start, e.size)))) {
+    return;
+  }
+  buf.resize(e.size);
+  ssize_t valid_len;
+  if (r.local_addr) {
+    memcpy(buf.data(), r.local_addr + (e.start - r.range.start()), e.size);
+    valid_len = e.size;
+  } else if (use_task) {
+    valid_len = t->read_bytes_fallible(e.start, e.size, buf.data());
+  } else {
+    valid_len = 0;
+    while (size_t(valid_len) < e.size) {
+      ssize_t nread = pread64(mem_fd, buf.data() + valid_len,
+                              e.size - valid_len, e.start.as_int() + valid_len);
+      if (nread <= 0) {
+        if (valid_len == 0) {
+          valid_len = nread;
+        }
+        break;
+      }
+      valid_len += nread;
+    }
+  }
+  if (valid_len < 0) {
+    e.error = errno;
+    valid_len = 0;
+  }
+  if (size_t(valid_len) < e.size) {
+    memset(buf.data() + valid_len, 0, e.size - valid_len);
+    e.short_read = true;
+  }
+  e.hash = checksum_words(0, reinterpret_cast<uint32_t*>(buf.data()),
+                          e.size / sizeof(uint32_t));
+}
+
+void MemoryChecksummer::process_extents(bool use_task) {
+  vector<uint8_t> buf;
+  while (true) {
+    size_t i = next_extent++;
+    if (i >= extents.size()) {
+      return;
+    }
+    process_extent(extents[i], buf, use_task);
+  }
+}
+
+/* static */ void* MemoryChecksummer::thread_callback(void* p) {
+  static_cast<MemoryChecksummer*>(p)->process_extents(false);
+  return nullptr;
+}
+
+void MemoryChecksummer::run() {
+  if (extents.empty()) {
+    return;
+  }
+
+  // Reading through the Task reopens a stale mem fd after exec, so do a
+  // small read that way before handing the fd to other threads.
+  uint8_t probe;
+  t->read_bytes_fallible(extents[0].start, 1, &probe);
+  mem_fd = t->vm()->mem_fd();
+  if (mem_fd < 0 || extents.size() < min_parallel_extents) {
+    process_extents(true);
+    return;
+  }
+
+  int num_threads = min<long>(8, sysconf(_SC_NPROCESSORS_ONLN)) - 1;
+  vector<pthread_t> threads;
+  // rr binds itself to one CPU so that tracees inherit that binding. Our
+  // workers don't run tracee code, so like the other helper threads they
+  // go where they won't compete with the tracees.
+  int tracee_cpu = t->session().cpu_binding();
+  cpu_set_t cpus = tracee_cpu >= 0
+      ? helper_thread_cpus(tracee_cpu, t->session().original_affinity())
+      : t->session().original_affinity();
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+  // Make sure the worker threads block all signals
+  sigset_t set;
+  sigset_t old_mask;
+  sigfillset(&set);
+  sigprocmask(SIG_BLOCK, &set, &old_mask);
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, thread_callback, this)) {
+      break;
+    }
+    threads.push_back(thread);
+  }
+  sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+  pthread_attr_destroy(&attr);
+  process_extents(false);
+  for (pthread_t thread : threads) {
+    pthread_join(thread, nullptr);
+  }
+}
+
+uint32_t MemoryChecksummer::checksum(size_t index, int* error) const {
+  const Range& r = ranges[index];
+  uint32_t checksum = r.range.size();
+  bool readable = true;
+  if (error) {
+    *error = 0;
+  }
+  for (size_t i = r.first_extent; i < r.first_extent + r.num_extents; ++i) {
+    const Extent& e = extents[i];
+    checksum = checksum_zero_words(checksum, e.size / sizeof(uint32_t));
+    if (readable) {
+      checksum += e.hash;
+      if (error && !*error) {
+        *error = e.error;
+      }
+      readable = !e.short_read;
+    }
+  }
+  return checksum;
+}
+
 static const uint32_t ignored_checksum = 0x98765432;
 static const uint32_t sigbus_checksum = 0x23456789;
 
@@ -485,14 +842,31 @@ void checksum_process_memory(RecordTask* t, FrameTime global_time) {
     FATAL() << "Failed to open checksum file " << filename;
   }
 
+  struct Line {
+    string raw_map_line;
+    uint32_t checksum;
+    // If not SIZE_MAX, index of the MemoryChecksummer range to get the
+    // checksum from.
+    size_t range_index;
+  };
+  vector<Line> lines;
+  MemoryChecksummer checksummer(t);
   AddressSpace& as = *t->vm();
   for (auto it = as.maps().begin(); it != as.maps().end(); ++it) {
     AddressSpace::Mapping m = *it;
-    string raw_map_line = m.map.str();
+    Line line = { m.map.str(), ignored_checksum, SIZE_MAX };
 
     if (!checksum_segment_filter(m)) {
-      fprintf(checksums_file, "(%x) %s\n", ignored_checksum,
-              raw_map_line.c_str());
+      lines.push_back(line);
+      continue;
+    }
+
+    /* Areas not read are treated as zero. We have to do this because
+       mappings not backed by valid file data are not readable during
+       recording but are read as 0 during replay. */
+    if (!(m.flags & AddressSpace::Mapping::IS_SYSCALLBUF)) {
+      line.range_index = checksummer.add(m, m.map);
+      lines.push_back(line);
       continue;
     }
 
@@ -501,9 +875,6 @@ void checksum_process_memory(RecordTask* t, FrameTime global_time) {
     memset(mem.data(), 0, mem.size());
     ssize_t valid_mem_len =
         t->read_bytes_fallible(m.map.start(), mem.size(), mem.data());
-    /* Areas not read are treated as zero. We have to do this because
-       mappings not backed by valid file data are not readable during
-       recording but are read as 0 during replay. */
     if (valid_mem_len < 0) {
       /* It is possible for whole mappings to be beyond the extent of the
        * backing file, in which case read_bytes_fallible will return -1.
@@ -511,12 +882,22 @@ void checksum_process_memory(RecordTask* t, FrameTime global_time) {
       ASSERT(t, valid_mem_len == -1 && errno == EIO);
     }
 
-    if (m.flags & AddressSpace::Mapping::IS_SYSCALLBUF) {
-      normalize_syscallbuf(t, mem);
-    }
+    normalize_syscallbuf(t, mem);
+    line.checksum = compute_checksum(mem.data(), mem.size());
+    lines.push_back(line);
+  }
 
-    uint32_t checksum = compute_checksum(mem.data(), mem.size());
-    fprintf(checksums_file, "(%x) %s\n", checksum, raw_map_line.c_str());
+  checksummer.run();
+  for (auto& line : lines) {
+    if (line.range_index != SIZE_MAX) {
+      int error;
+      line.checksum = checksummer.checksum(line.range_index, &error);
+      ASSERT(t, !error || error == EIO)
+          << "Failed to read " << line.raw_map_line << ": "
+          << errno_name(error);
+    }
+    fprintf(checksums_file, "(%x) %s\n", line.checksum,
+            line.raw_map_line.c_str());
   }
 
   fclose(checksums_file);
@@ -535,6 +916,16 @@ void validate_process_memory(ReplayTask* t, FrameTime global_time) {
     t->write_mem(in_replay_flag, (unsigned char)0);
   }
 
+  struct Check {
+    remote_ptr<void> start;
+    uint32_t checksum;
+    uint32_t our_checksum;
+    // If not SIZE_MAX, index of the MemoryChecksummer range to get our
+    // checksum from.
+    size_t range_index;
+  };
+  vector<Check> checks;
+  MemoryChecksummer checksummer(t);
   while (true) {
     char line[1024];
     if (!fgets(line, sizeof(line), checksums_file)) {
@@ -564,22 +955,30 @@ void validate_process_memory(ReplayTask* t, FrameTime global_time) {
       continue;
     }
 
-    vector<uint8_t> mem;
-    mem.resize(end - start);
-    memset(mem.data(), 0, mem.size());
-    t->read_bytes_fallible(start, mem.size(), mem.data());
-
     const AddressSpace::Mapping& m = t->vm()->mapping_of(start);
+    Check check = { start, checksum, 0, SIZE_MAX };
 
     if (m.flags & AddressSpace::Mapping::IS_SYSCALLBUF) {
+      vector<uint8_t> mem;
+      mem.resize(end - start);
+      memset(mem.data(), 0, mem.size());
+      t->read_bytes_fallible(start, mem.size(), mem.data());
       normalize_syscallbuf(t, mem);
+      check.our_checksum = compute_checksum(mem.data(), mem.size());
+    } else {
+      check.range_index = checksummer.add(m, MemoryRange(start, end));
     }
+    checks.push_back(check);
+  }
 
-    uint32_t our_checksum = compute_checksum(mem.data(), mem.size());
-
-    if (checksum != our_checksum) {
-      notify_checksum_error(t, global_time, our_checksum, checksum,
-                            m.map.str());
+  checksummer.run();
+  for (auto& check : checks) {
+    if (check.range_index != SIZE_MAX) {
+      check.our_checksum = checksummer.checksum(check.range_index);
+    }
+    if (check.checksum != check.our_checksum) {
+      notify_checksum_error(t, global_time, check.our_checksum, check.checksum,
+                            t->vm()->mapping_of(check.start).map.str());
     }
   }
 
@@ -1048,14 +1447,118 @@ vector<CPUIDRecord> all_cpuid_records() {
 #define RR_ARCH_PRCTL(a, b) ((void)a, (void)b, -1)
 #endif
 
-bool cpuid_faulting_works() {
-  static bool did_check_cpuid_faulting = false;
-  static bool cpuid_faulting_ok = false;
+static string probe_cache_path() {
+  const char* dir = getenv("XDG_RUNTIME_DIR");
+  if (!dir || !*dir || running_under_rr()) {
+    return string();
+  }
+  return string(dir) + "/rr-probe-cache";
+}
+
+// The first line of the cache file. Probe results are only reused while
+// this matches.
+static const string& probe_cache_signature() {
+  static string signature;
+  if (!signature.empty()) {
+    return signature;
+  }
+  string boot_id;
+  ifstream boot_id_file("/proc/sys/kernel/random/boot_id");
+  getline(boot_id_file, boot_id);
+  struct utsname uname_buf;
+  string release = uname(&uname_buf) == 0 ? uname_buf.release : "";
+  // Everything that identifies the CPU model, in case the machine was
+  // migrated without rebooting.
+  string cpu;
+  ifstream cpuinfo("/proc/cpuinfo");
+  string line;
+  static const char* const cpu_fields[] = {
+    "vendor_id", "cpu family", "model", "model name", "stepping", "microcode",
+    "CPU implementer", "CPU variant", "CPU part", "CPU revision"
+  };
+  set<string> seen;
+  while (getline(cpuinfo, line)) {
+    size_t colon = line.find(':');
+    if (colon == string::npos) {
+      continue;
+    }
+    size_t name_end = line.find_last_not_of(" \t", colon - 1);
+    string name = line.substr(0, name_end == string::npos ? 0 : name_end + 1);
+    for (const char* field : cpu_fields) {
+      if (name == field && seen.insert(line).second) {
+        cpu += line + ";";
+      }
+    }
+  }
+  char hash[20];
+  sprintf(hash, "%zx", std::hash<string>()(cpu));
+  signature = "rr-probe-cache-1 " + boot_id + " " + release + " " + hash;
+  return signature;
+}
 
-  if (did_check_cpuid_faulting) {
-    return cpuid_faulting_ok;
+static bool read_probe_cache(map<string, string>* entries) {
+  string path = probe_cache_path();
+  if (path.empty()) {
+    return false;
   }
-  did_check_cpuid_faulting = true;
+  ifstream f(path);
+  string line;
+  if (!getline(f, line) || line != probe_cache_signature()) {
+    return true;
+  }
+  while (getline(f, line)) {
+    size_t space = line.find(' ');
+    if (space != string::npos) {
+      (*entries)[line.substr(0, space)] = line.substr(space + 1);
+    }
+  }
+  return true;
+}
+
+bool probe_cache_get(const string& key, string* value) {
+  map<string, string> entries;
+  read_probe_cache(&entries);
+  auto it = entries.find(key);
+  if (it == entries.end()) {
+    return false;
+  }
+  LOG(debug) << "Using cached probe result " << key << "=" << it->second;
+  *value = it->second;
+  return true;
+}
+
+void probe_cache_put(const string& key, const string& value) {
+  DEBUG_ASSERT(key.find_first_of(" \n") == string::npos &&
+               value.find('\n') == string::npos);
+  map<string, string> entries;
+  if (!read_probe_cache(&entries)) {
+    return;
+  }
+  entries[key] = value;
+  // Write a new file and rename it into place so concurrent rr processes
+  // never see a partial cache. If two race, one's new entry is lost and
+  // gets probed again next time.
+  string path = probe_cache_path();
+  string tmp_path = path + "." + to_string(getpid());
+  {
+    ofstream f(tmp_path, ios::trunc);
+    f << probe_cache_signature() << "\n";
+    for (auto& e : entries) {
+      f << e.first << " " << e.second << "\n";
+    }
+    if (!f.good()) {
+      f.close();
+      unlink(tmp_path.c_str());
+      return;
+    }
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+    unlink(tmp_path.c_str());
+  }
+}
+
+static bool probe_cpuid_faulting() {
+  bool cpuid_faulting_ok = false;
 
   // Test to see if CPUID faulting works.
   if (RR_ARCH_PRCTL(ARCH_SET_CPUID, 0L) != 0) {
@@ -1091,6 +1594,25 @@ bool cpuid_faulting_works() {
   return cpuid_faulting_ok;
 }
 
+bool cpuid_faulting_works() {
+  static bool did_check_cpuid_faulting = false;
+  static bool cpuid_faulting_ok = false;
+
+  if (did_check_cpuid_faulting) {
+    return cpuid_faulting_ok;
+  }
+  did_check_cpuid_faulting = true;
+
+  string cached;
+  if (probe_cache_get("cpuid_faulting_works", &cached)) {
+    cpuid_faulting_ok = cached == "1";
+    return cpuid_faulting_ok;
+  }
+  cpuid_faulting_ok = probe_cpuid_faulting();
+  probe_cache_put("cpuid_faulting_works", cpuid_faulting_ok ? "1" : "0");
+  return cpuid_faulting_ok;
+}
+
 const CPUIDRecord* find_cpuid_record(const vector<CPUIDRecord>& records,
                                      uint32_t eax, uint32_t ecx) {
   for (const auto& rec : records) {
@@ -1217,7 +1739,7 @@ bool trace_instructions_up_to_event(FrameTime event) {
          event <= instruction_trace_at_event_last;
 }
 
-void dump_task_set(const set<Task*>& tasks) {
+void dump_task_set(const unordered_set<Task*>& tasks) {
   printf("[");
   for (auto& t : tasks) {
     printf("%p (pid=%d, rec=%d),", t, t->tid, t->rec_tid);
@@ -1273,6 +1795,12 @@ double monotonic_now_sec() {
   return (double)tp.tv_sec + (double)tp.tv_nsec / 1e9;
 }
 
+uint64_t monotonic_now_ns() {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
 bool running_under_rr(bool cache) {
   static bool rr_under_rr = false;
   static bool rr_check_done = false;
@@ -1758,6 +2286,7 @@ OpenedSocket open_socket(const string& host, unsigned short port,
 }
 
 void notifying_abort() {
+  StdioMonitor::flush_echoed_output();
   flush_log_buffer();
   dump_rr_stack();
 
@@ -2029,6 +2558,137 @@ string get_cpu_lock_file() {
   return lock_file ? lock_file : trace_save_dir() + "/cpu_lock";
 }
 
+// Parse a sysfs CPU list like "0-3,8,10-11". Returns an empty list if
+// |path| can't be read.
+static vector<int> read_cpu_list(const string& path) {
+  vector<int> result;
+  ifstream f(path);
+  string range;
+  while (getline(f, range, ',')) {
+    int first, last;
+    int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+    if (n < 1) {
+      break;
+    }
+    if (n == 1) {
+      last = first;
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      result.push_back(cpu);
+    }
+  }
+  return result;
+}
+
+int get_num_possible_cpus() {
+  static int count = 0;
+  if (!count) {
+    count = read_cpu_list("/sys/devices/system/cpu/possible").size();
+    if (!count) {
+      count = max<int>(1, sysconf(_SC_NPROCESSORS_CONF));
+    }
+  }
+  return count;
+}
+
+static bool cpu_lock_held_by_other(const ScopedFd& cpu_lock_fd, int cpu) {
+  struct flock lock {
+    .l_type = F_WRLCK,
+    .l_whence = SEEK_SET,
+    .l_start = cpu,
+    .l_len = 1,
+    .l_pid = 0
+  };
+  return fcntl(cpu_lock_fd, F_GETLK, &lock) == 0 && lock.l_type != F_UNLCK;
+}
+
+// True if another rr holds the lock for an SMT sibling of |cpu|, i.e.
+// we'd be sharing a physical core with it.
+static bool cpu_core_busy(const ScopedFd& cpu_lock_fd, int cpu) {
+  char path[100];
+  sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+          cpu);
+  for (int sibling : read_cpu_list(path)) {
+    if (sibling != cpu && cpu_lock_held_by_other(cpu_lock_fd, sibling)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns the CPUs sharing |cpu|'s L3 cache, or an empty list if unknown.
+static vector<int> l3_cpus(int cpu) {
+  for (int index = 0;; ++index) {
+    char path[100];
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu,
+            index);
+    ifstream f(path);
+    int level;
+    if (!(f >> level)) {
+      return vector<int>();
+    }
+    if (level == 3) {
+      sprintf(path,
+              "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+              cpu, index);
+      return read_cpu_list(path);
+    }
+  }
+}
+
+// Returns the CPUs on |cpu|'s NUMA node, or an empty list if unknown.
+static vector<int> numa_node_cpus(int cpu) {
+  char path[100];
+  sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* dir = opendir(path);
+  if (!dir) {
+    return vector<int>();
+  }
+  int node = -1;
+  while (struct dirent* ent = readdir(dir)) {
+    if (sscanf(ent->d_name, "node%d", &node) == 1) {
+      break;
+    }
+    node = -1;
+  }
+  closedir(dir);
+  if (node < 0) {
+    return vector<int>();
+  }
+  sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+  return read_cpu_list(path);
+}
+
+cpu_set_t helper_thread_cpus(int tracee_cpu, const cpu_set_t& allowed) {
+  cpu_set_t others = allowed;
+  char path[100];
+  sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+          tracee_cpu);
+  CPU_CLR(tracee_cpu, &others);
+  for (int sibling : read_cpu_list(path)) {
+    if (sibling >= 0 && sibling < CPU_SETSIZE) {
+      CPU_CLR(sibling, &others);
+    }
+  }
+  if (!CPU_COUNT(&others)) {
+    return allowed;
+  }
+
+  for (auto& domain : { l3_cpus(tracee_cpu), numa_node_cpus(tracee_cpu) }) {
+    cpu_set_t near;
+    CPU_ZERO(&near);
+    for (int cpu : domain) {
+      if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &others)) {
+        CPU_SET(cpu, &near);
+      }
+    }
+    if (CPU_COUNT(&near)) {
+      return near;
+    }
+  }
+  return others;
+}
+
 /**
  * Pick a CPU at random to bind to, unless --cpu-unbound has been given,
  * in which case we return -1.
@@ -2109,9 +2769,40 @@ int choose_cpu(BindCPU bind_cpu, ScopedFd &cpu_lock_fd_out) {
   }
 
   if (cpu_lock_fd_out.is_open()) {
+    // On hybrid Intel parts, the kernel lists the performance cores under
+    // cpu_core. Prefer those over efficiency cores.
+    vector<int> p_cores = read_cpu_list("/sys/devices/cpu_core/cpus");
+    auto order_cpus = [&]() {
+      std::shuffle(cpus.begin(), cpus.end(),
+                   std::default_random_engine(random()));
+      if (!p_cores.empty()) {
+        std::stable_partition(cpus.begin(), cpus.end(), [&](int cpu) {
+          return std::find(p_cores.begin(), p_cores.end(), cpu) !=
+                 p_cores.end();
+        });
+      }
+    };
+    // First look for a physical core no other rr is using, so two rr
+    // instances don't end up as SMT siblings.
+    order_cpus();
+    for (int cpu : cpus) {
+      if (cpu_core_busy(cpu_lock_fd_out, cpu)) {
+        continue;
+      }
+      struct flock lock {
+        .l_type = F_WRLCK,
+        .l_whence = SEEK_SET,
+        .l_start = cpu,
+        .l_len = 1,
+        .l_pid = 0
+      };
+      if (fcntl(cpu_lock_fd_out, F_SETLK, &lock) == 0) {
+        return cpu;
+      }
+    }
     // Try twice to allocate a CPU. If we fail twice, pick a random one
     for (int i = 0; i < 2; ++i) {
-      std::shuffle (cpus.begin(), cpus.end(), std::default_random_engine(random()));
+      order_cpus();
       for (int cpu : cpus) {
         struct flock lock {
           .l_type = F_WRLCK,
@@ -2367,6 +3058,21 @@ string json_escape(const string& str, size_t pos) {
   return out;
 }
 
+string xml_escape(const string& str) {
+  string out;
+  for (char c : str) {
+    switch (c) {
+      case '&': out += "&amp;"; break;
+      case '<': out += "&lt;"; break;
+      case '>': out += "&gt;"; break;
+      case '"': out += "&quot;"; break;
+      case '\'': out += "&apos;"; break;
+      default: out += c; break;
+    }
+  }
+  return out;
+}
+
 void sleep_time(double t) {
   struct timespec ts;
   ts.tv_sec = (time_t)floor(t);
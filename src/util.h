@@ -6,11 +6,13 @@
 #include <signal.h>
 #include <stdio.h>
 #include <math.h>
+#include <sched.h>
 
 #include <array>
 #include <map>
 #include <set>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #if defined(__i386__) || defined(__x86_64__)
@@ -107,7 +109,9 @@ std::string format_dump_filename(Task* t, FrameTime global_time,
 bool should_dump_memory(const Event& event, FrameTime time);
 /**
  * Dump all of the memory in |t|'s address to the file
- * "[trace_dir]/[t->tid]_[global_time]_[tag]".
+ * "[trace_dir]/[t->tid]_[global_time]_[tag]". Each mapping's label is
+ * followed by its words, except that the unpopulated pages of private
+ * anonymous mappings are left out because they read as zeroes.
  */
 void dump_process_memory(Task* t, FrameTime global_time, const char* tag);
 
@@ -128,12 +132,6 @@ void checksum_process_memory(RecordTask* t, FrameTime global_time);
  */
 void validate_process_memory(ReplayTask* t, FrameTime global_time);
 
-/**
- * Write raw PT data to a file in the trace dir.
- */
-void write_pt_data(Task* t, FrameTime global_time,
-                   const std::vector<std::vector<uint8_t>>& data);
-
 /**
  * Read raw PT data to a file in the trace dir. Returns an empty vector if none found.
  */
@@ -266,6 +264,19 @@ std::vector<CPUIDRecord> all_cpuid_records();
  */
 bool cpuid_faulting_works();
 
+/**
+ * A cache of kernel and CPU probe results that can't change until the
+ * machine reboots, so every rr invocation doesn't have to redo them. It's
+ * stored in $XDG_RUNTIME_DIR/rr-probe-cache, which is per-user and cleared
+ * at logout or reboot, and is validated against the boot id, kernel
+ * release and CPU model. There's no cache if XDG_RUNTIME_DIR isn't set or
+ * we're running under rr.
+ *
+ * probe_cache_get returns false if |key| isn't cached.
+ */
+bool probe_cache_get(const std::string& key, std::string* value);
+void probe_cache_put(const std::string& key, const std::string& value);
+
 /**
  * Locate a CPUID record for the give parameters, or return nullptr if there
  * isn't one.
@@ -312,7 +323,7 @@ bool trace_instructions_up_to_event(FrameTime event);
 
 /* Helpful for broken debuggers */
 
-void dump_task_set(const std::set<Task*>& tasks);
+void dump_task_set(const std::unordered_set<Task*>& tasks);
 
 void dump_task_map(const std::map<pid_t, Task*>& tasks);
 
@@ -326,6 +337,11 @@ std::string resource_path();
  */
 double monotonic_now_sec();
 
+/**
+ * Like monotonic_now_sec(), but in nanoseconds.
+ */
+uint64_t monotonic_now_ns();
+
 bool running_under_rr(bool cache = true);
 
 std::vector<int> read_all_proc_fds(pid_t tid);
@@ -483,6 +499,13 @@ std::vector<std::string> current_env();
  */
 int get_num_cpus();
 
+/**
+ * Returns the number of CPUs the kernel could ever bring online
+ * (/sys/devices/system/cpu/possible). Per-CPU kernel data, e.g. the values
+ * of per-CPU BPF maps, is sized by this.
+ */
+int get_num_possible_cpus();
+
 enum class TrappedInstruction {
   NONE = 0,
   RDTSC = 1,
@@ -522,6 +545,13 @@ std::string get_cpu_lock_file();
    for coordination with other rr processes */
 int choose_cpu(BindCPU bind_cpu, ScopedFd& cpu_lock_fd_out);
 
+/* The CPUs in |allowed| that rr's helper threads (compression, background
+   file copies) should run on while tracees are bound to |tracee_cpu|: not
+   |tracee_cpu| or its SMT siblings, and sharing its L3 cache, or failing
+   that its NUMA node, when any such CPU exists. Returns |allowed| if
+   there's nothing else to use. */
+cpu_set_t helper_thread_cpus(int tracee_cpu, const cpu_set_t& allowed);
+
 /* Updates an IEEE 802.3 CRC-32 least significant bit first from each byte in
  * |buf|.  Pre- and post-conditioning is not performed in this function and so
  * should be performed by the caller, as required. */
@@ -597,6 +627,11 @@ size_t word_size(SupportedArch arch);
  */
 std::string json_escape(const std::string& str, size_t pos = 0);
 
+/**
+ * XML-escape |str| for use in attribute values and text.
+ */
+std::string xml_escape(const std::string& str);
+
 void sleep_time(double t);
 
 /**
@@ -654,6 +689,22 @@ inline unsigned long long dczid_el0_block_size(void) {
 #endif
 }
 
+/**
+ * Returns true if /proc/<tid>/pagemap says no page of the page-aligned
+ * |range| is present or swapped, i.e. a private anonymous mapping would read
+ * as zeroes there.
+ */
+bool range_unpopulated(int pagemap_fd, MemoryRange range);
+/**
+ * Sets |*populated| to the page ranges of the page-aligned |range| that
+ * /proc/<tid>/pagemap says are present or swapped, in address order.
+ * Uses the PAGEMAP_SCAN ioctl, which skips whole unpopulated page tables,
+ * so this is cheap even for the terabytes of sanitizer shadow memory.
+ * Returns false if the kernel doesn't support PAGEMAP_SCAN.
+ */
+bool populated_ranges(int pagemap_fd, MemoryRange range,
+                      std::vector<MemoryRange>* populated);
+
 /**
  * If `src` overlaps `dst`, replace the bytes in `dst_data` from the range `dst`
  * with the corresponding bytes in `src_data` from the range `src`.